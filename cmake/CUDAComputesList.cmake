@@ -60,6 +60,10 @@ IF(    CUDA_COMPUTE_20
     OR CUDA_COMPUTE_70
     OR CUDA_COMPUTE_72
     OR CUDA_COMPUTE_75
+    OR CUDA_COMPUTE_80
+    OR CUDA_COMPUTE_86
+    OR CUDA_COMPUTE_89
+    OR CUDA_COMPUTE_90
     )
     SET(FALLBACK OFF)
 ELSE()
@@ -89,11 +93,32 @@ MACRO(SET_COMPUTE VERSION)
     MESSAGE(STATUS "Setting Compute ${VERSION} to ON")
 ENDMACRO(SET_COMPUTE)
 
+# Computes the toolkit can build SASS for
+SET(CUDA_KNOWN_COMPUTES 20 30 32 35 37 50 52 53 60 61 62 70 72 75)
+IF(NOT CUDA_VERSION VERSION_LESS "11.0")
+    LIST(APPEND CUDA_KNOWN_COMPUTES 80)
+ENDIF()
+IF(NOT CUDA_VERSION VERSION_LESS "11.1")
+    LIST(APPEND CUDA_KNOWN_COMPUTES 86)
+ENDIF()
+IF(NOT CUDA_VERSION VERSION_LESS "11.8")
+    LIST(APPEND CUDA_KNOWN_COMPUTES 89 90)
+ENDIF()
+
 # Iterate over compute versions. Create variables and enable computes if needed
-FOREACH(VER 20 30 32 35 37 50 52 53 60 61 62 70 72 75)
+FOREACH(VER ${CUDA_KNOWN_COMPUTES})
     OPTION(CUDA_COMPUTE_${VER} "CUDA Compute Capability ${VER}" OFF)
     MARK_AS_ADVANCED(CUDA_COMPUTE_${VER})
     IF(${CUDA_COMPUTE_${VER}})
         SET_COMPUTE(${VER})
     ENDIF()
 ENDFOREACH()
+
+# Only the newest compute also ships PTX, for GPUs newer than every listed
+# one. The others run their SASS with no JIT at startup.
+OPTION(CUDA_EMBED_PTX "Embed PTX of the newest compute for later GPUs" ON)
+LIST(LENGTH COMPUTE_VERSIONS COMPUTE_VERSIONS_LEN)
+IF(CUDA_EMBED_PTX AND COMPUTE_VERSIONS_LEN GREATER 0)
+    LIST(GET COMPUTE_VERSIONS -1 NEWEST_COMPUTE)
+    SET(CUDA_GENERATE_CODE ${CUDA_GENERATE_CODE} "-gencode arch=compute_${NEWEST_COMPUTE},code=compute_${NEWEST_COMPUTE}")
+ENDIF()
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cuda_runtime.h>
+#include <cuda_fp16.h>
+#include "glm/glm.hpp"
+
+/**
+ * Colour buffer element types shared by the denoiser and the renderer's
+ * display kernels, with loads and stores that hide their layout.
+ */
+
+/**
+ * Half-precision RGB colour, padded to 8 bytes so it loads as one 64-bit
+ * access. Used for the denoiser's FP16 storage mode; all math stays float.
+ */
+struct __align__(8) Half4 {
+    __half2 xy;
+    __half2 zw;
+};
+
+__host__ __device__ inline glm::vec3 loadColor(const glm::vec3* buffer, int index) {
+    return buffer[index];
+}
+
+// Full-resolution FP32 colours sit in float4s, so each moves as one 16-byte access
+__device__ inline glm::vec3 loadColor(const float4* buffer, int index) {
+    float4 c = buffer[index];
+    return glm::vec3(c.x, c.y, c.z);
+}
+
+__device__ inline glm::vec3 loadColor(const Half4* buffer, int index) {
+    Half4 h = buffer[index];
+    float2 xy = __half22float2(h.xy);
+    return glm::vec3(xy.x, xy.y, __half2float(h.zw.x));
+}
+
+__host__ __device__ inline void storeColor(glm::vec3* buffer, int index, glm::vec3 color) {
+    buffer[index] = color;
+}
+
+__device__ inline void storeColor(float4* buffer, int index, glm::vec3 color) {
+    buffer[index] = make_float4(color.x, color.y, color.z, 0.0f);
+}
+
+__device__ inline void storeColor(Half4* buffer, int index, glm::vec3 color) {
+    Half4 h;
+    h.xy = __floats2half2_rn(color.x, color.y);
+    h.zw = __floats2half2_rn(color.z, 0.0f);
+    buffer[index] = h;
+}
@@ -0,0 +1,2284 @@
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <new>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include <cuda_runtime.h>
+#include <mma.h>
+#if CUDART_VERSION >= 12000
+#include <cooperative_groups.h>
+#endif
+#include "glm/glm.hpp"
+
+#include "denoiser.h"
+#include "colorBuffers.h"
+#include "../src/gbuffer.h"
+#include "../src/utilities.h"
+
+// Full-resolution levels run before pyramid mode drops to half resolution
+#define PYRAMID_FINE_LEVELS 2
+
+// Every scratch buffer starts on this boundary, as cudaMalloc's do
+#define SCRATCH_ALIGNMENT 256
+
+/**
+ * A layer's camera pose in a batch (denoiserFilterBatch). Its pixel
+ * lengths are a multiple of the launch camera's, so pyramid levels, which
+ * double those, keep every layer's in step.
+ */
+struct LayerPose {
+    glm::vec3 position;
+    glm::vec3 view;
+    glm::vec3 up;
+    glm::vec3 right;
+    glm::vec2 pixelScale;
+};
+
+// Where each stacked layer was seen from, as the kernels take it
+struct LayerCameras {
+    glm::vec3 offset;           // layer k's camera is at position + k * offset
+    const LayerPose *poses;     // per layer, replacing the offsets; NULL for stacked views
+};
+
+/**
+ * A denoiser's scratch buffers, carved from one block, and the stream and
+ * G-buffer of the filter call in progress.
+ */
+struct DenoiserContext {
+    glm::ivec2 resolution;
+    char *scratch;
+    bool ownsScratch;
+    // Ping-pong targets for the A-Trous levels, swapped rather than copied,
+    // in FP32 and in FP16 storage mode
+    float4 *colorIn;
+    float4 *colorOut;
+    float4 *colorTemp;          // between the two passes of a separable level
+    Half4 *halfIn;
+    Half4 *halfOut;
+    Half4 *halfTemp;
+    // Per-pixel luminance variance, filtered along in variance-guided mode
+    float *varianceIn;
+    float *varianceOut;
+    float *varianceTemp;
+    // Pyramid mode: the half-resolution level's colour (the downsampled fine
+    // result, then its own ping-pong and temp targets), G-buffer and variance.
+    // Always FP32; at a quarter of the pixels their traffic is minor.
+    glm::vec3 *pyramidColor;
+    glm::vec3 *pyramidIn;
+    glm::vec3 *pyramidOut;
+    glm::vec3 *pyramidTemp;
+    GBufferPixel *pyramidGBuffer;
+    float *pyramidVarianceIn;
+    float *pyramidVarianceOut;
+    // Summed luminance change and luminance of the last level, for the early-out
+    float *levelChange;
+    // ATROUS_TILE_SIZE^2 tiles of the image for DenoiserSettings::tileConvergence:
+    // those still to filter from the front, converged ones from the back,
+    // and how many of each classifyTiles found
+    int *tiles;
+    int *tileCounts;
+    // The guided filter's planes at 1 / DENOISER_GUIDED_SUBSAMPLE resolution:
+    // GUIDED_FEATURES of window features, later the coefficients, then their
+    // row prefix sums and their box means
+    float *guidedFeatures;
+    float *guidedPrefix;
+    float *guidedMeans;
+    // The bilateral grid's cells at the smallest cell size, a blur target of
+    // the same size, and the image's hit distance range as float bits
+    float4 *grid;
+    float4 *gridTemp;
+    unsigned int *gridRange;
+    // The kernel-predicting network, outside the scratch and only once set:
+    // its layers' FP16 weights and FP32 biases, and the predicted kernels,
+    // DENOISER_KPN_TAPS halves per pixel
+    __half *kpnWeights;
+    float *kpnBiases;
+    __half *kpnKernels;
+    // The device runs thread block clusters (sm_90 and newer), see atrousFilterCluster
+    bool clusters;
+
+    cudaStream_t stream;
+    const GBufferPixel *gBuffer;
+    int layers;                 // images stacked in the call's, see DenoiserCamera
+    LayerCameras layerCameras;
+    // denoiserFilterBatch's poses, outside the scratch and only once batched
+    LayerPose *batchPoses;
+    int batchPoseCapacity;
+    // The call's tiles still to filter, or NULL when the levels run over the whole image
+    const int *activeTiles;
+    int activeTileCount;
+    int convergedTileCount;
+};
+
+/**
+ * Camera for the half-resolution pyramid level. Coarse pixel (X, Y) shares
+ * its ray with full-resolution pixel (2X, 2Y), so the coarse G-buffer can
+ * reuse those hit distances unchanged. Odd resolutions drop the last
+ * row/column, shifting reconstructed positions by up to half a pixel.
+ */
+static Camera pyramidCamera(const Camera &cam) {
+    Camera coarse = cam;
+    coarse.resolution = glm::max(cam.resolution / 2, glm::ivec2(1));
+    coarse.pixelLength = cam.pixelLength * 2.0f;
+    return coarse;
+}
+
+/**
+ * The kernels that look at neighbours or rebuild positions filter stacked
+ * layers as images of their own, `resolution` each, one per blockIdx.z:
+ * the index of the first pixel of the block's layer, and the camera it was
+ * seen from.
+ */
+__device__ inline int layerBase(glm::ivec2 resolution) {
+    return blockIdx.z * resolution.x * resolution.y;
+}
+
+__device__ inline Camera layerCamera(Camera cam, const LayerCameras &layerCameras) {
+    if (layerCameras.poses != NULL) {
+        const LayerPose pose = layerCameras.poses[blockIdx.z];
+        cam.position = pose.position;
+        cam.view = pose.view;
+        cam.up = pose.up;
+        cam.right = pose.right;
+        cam.pixelLength *= pose.pixelScale;
+        return cam;
+    }
+    cam.position += (float)blockIdx.z * layerCameras.offset;
+    return cam;
+}
+
+// Output tile edge of atrousFilterShared, and the largest step width it is
+// used for. Past that the halo dwarfs the tile and only every stepWidth-th
+// staged pixel is ever read, so the global-memory kernel is cheaper.
+#define ATROUS_TILE_SIZE 16
+#define ATROUS_MAX_SHARED_STEP 4
+// Tiles per thread block cluster of atrousFilterCluster, at most the
+// portable cluster size of 8, and the largest step width it is used for:
+// beyond it most taps land outside the cluster's 64 x 32 pixels.
+#define ATROUS_CLUSTER_WIDTH 4
+#define ATROUS_CLUSTER_HEIGHT 2
+#define ATROUS_MAX_CLUSTER_STEP 8
+
+/**
+ * First pixel of an A-Trous block: its place in the grid, or launched over
+ * a list of ATROUS_TILE_SIZE^2 tiles with ATROUS_TILE_SIZE^2 threads, the
+ * tile's at blockIdx.x in the list.
+ */
+__device__ inline glm::ivec2 atrousBlockOrigin(const int* tiles, glm::ivec2 resolution) {
+    if (tiles == NULL) {
+        return glm::ivec2(blockIdx.x * blockDim.x, blockIdx.y * blockDim.y);
+    }
+    const int tilesX = (resolution.x + ATROUS_TILE_SIZE - 1) / ATROUS_TILE_SIZE;
+    const int tile = tiles[blockIdx.x];
+    return glm::ivec2(tile % tilesX, tile / tilesX) * ATROUS_TILE_SIZE;
+}
+
+/**
+ * 1D weights of the 5-tap A-Trous kernels; the 5x5 kernel is their outer
+ * product. Always called with a literal or unrolled index, so the switch
+ * folds into an immediate.
+ */
+template <int KERNEL>
+__device__ __forceinline__ float atrousTap(int i) {
+    if (KERNEL == DENOISER_GAUSSIAN) {
+        // Gaussian with sigma = 1, normalized over the 5 taps
+        return i == 2 ? 0.40262f : (i == 1 || i == 3) ? 0.24420f : 0.05449f;
+    }
+    // B3 spline
+    return i == 2 ? 3.0f / 8.0f : (i == 1 || i == 3) ? 1.0f / 4.0f : 1.0f / 16.0f;
+}
+
+/**
+ * Edge-stopping weight of tap q relative to centre pixel p. Disabled terms
+ * are compiled out, and their inputs are never read.
+ */
+template <bool USE_NORMAL, bool USE_POSITION>
+__device__ float atrousEdgeWeight(int stepWidth,
+        float colorPhi, float normalPhi, float positionPhi,
+        glm::vec3 cp, glm::vec3 np, glm::vec3 pp,
+        glm::vec3 cq, glm::vec3 nq, glm::vec3 pq) {
+    glm::vec3 t = cp - cq;
+    float weight = glm::min(expf(-glm::dot(t, t) / colorPhi), 1.0f);
+
+    if (USE_NORMAL) {
+        t = np - nq;
+        float dist2 = glm::max(glm::dot(t, t) / (stepWidth * stepWidth), 0.0f);
+        weight *= glm::min(expf(-dist2 / normalPhi), 1.0f);
+    }
+
+    if (USE_POSITION) {
+        t = pp - pq;
+        weight *= glm::min(expf(-glm::dot(t, t) / positionPhi), 1.0f);
+    }
+
+    return weight;
+}
+
+/**
+ * Colour edge-stopping phi of a centre pixel: the global one, or in
+ * variance-guided mode that many times the pixel's estimated variance.
+ */
+__device__ inline float atrousColorPhi(float colorPhi, const float* variance, int index) {
+    return variance != NULL ? glm::max(colorPhi * variance[index], EPSILON) : colorPhi;
+}
+
+/**
+ * One level of the edge-avoiding A-Trous wavelet transform (Dammertz et al.
+ * 2010). A 5x5 kernel is dilated by stepWidth, and each tap is weighted by
+ * how similar its colour, normal and position are to the centre. colorIn is
+ * multiplied by colorScale on load, which lets the first level read an
+ * accumulated sum directly.
+ *
+ * With varianceIn set, the colour weight is scaled by the centre pixel's
+ * variance, and the variance is filtered along into varianceOut with the
+ * squared weights, as in SVGF (Schied et al. 2017).
+ *
+ * KERNEL picks the tap weights, and disabled normal / position terms skip
+ * their G-buffer decode; launchAtrousLevel() picks the instantiation. With
+ * `tiles` set only the listed tiles are filtered, see atrousBlockOrigin.
+ */
+template <int KERNEL, bool USE_NORMAL, bool USE_POSITION, typename T>
+__global__ void atrousFilter(Camera cam, LayerCameras layerCameras, int stepWidth,
+        float colorPhi, float normalPhi, float positionPhi,
+        const GBufferPixel* gBuffer, const T* colorIn, float colorScale, T* colorOut,
+        const float* varianceIn, float* varianceOut, const int* tiles) {
+    const glm::ivec2 resolution = cam.resolution;
+    const glm::ivec2 origin = atrousBlockOrigin(tiles, resolution);
+    int x = origin.x + threadIdx.x;
+    int y = origin.y + threadIdx.y;
+    const int base = layerBase(resolution);
+    cam = layerCamera(cam, layerCameras);
+
+    if (x < resolution.x && y < resolution.y) {
+        int index = base + x + (y * resolution.x);
+        glm::vec3 cp = loadColor(colorIn, index) * colorScale;
+        glm::vec3 np(0.0f);
+        glm::vec3 pp(0.0f);
+        if (USE_NORMAL || USE_POSITION) {
+            GBufferPixel gp = gBuffer[index];
+            if (USE_NORMAL) {
+                np = gbufferNormal(gp);
+            }
+            if (USE_POSITION) {
+                pp = gbufferPosition(gp, cam, x, y);
+            }
+        }
+        const float phi = atrousColorPhi(colorPhi, varianceIn, index);
+
+        glm::vec3 sum(0.0f);
+        float cumWeight = 0.0f;
+        float varianceSum = 0.0f;
+#pragma unroll
+        for (int dy = -2; dy <= 2; dy++) {
+#pragma unroll
+            for (int dx = -2; dx <= 2; dx++) {
+                int qx = glm::clamp(x + dx * stepWidth, 0, resolution.x - 1);
+                int qy = glm::clamp(y + dy * stepWidth, 0, resolution.y - 1);
+                int q = base + qx + (qy * resolution.x);
+
+                glm::vec3 cq = loadColor(colorIn, q) * colorScale;
+                glm::vec3 nq(0.0f);
+                glm::vec3 pq(0.0f);
+                if (USE_NORMAL || USE_POSITION) {
+                    GBufferPixel gq = gBuffer[q];
+                    if (USE_NORMAL) {
+                        nq = gbufferNormal(gq);
+                    }
+                    if (USE_POSITION) {
+                        pq = gbufferPosition(gq, cam, qx, qy);
+                    }
+                }
+                float weight = atrousEdgeWeight<USE_NORMAL, USE_POSITION>(stepWidth,
+                        phi, normalPhi, positionPhi, cp, np, pp, cq, nq, pq)
+                    * atrousTap<KERNEL>(dx + 2) * atrousTap<KERNEL>(dy + 2);
+                sum += cq * weight;
+                cumWeight += weight;
+                if (varianceIn != NULL) {
+                    varianceSum += weight * weight * varianceIn[q];
+                }
+            }
+        }
+
+        storeColor(colorOut, index, cumWeight > 0.0f ? sum / cumWeight : cp);
+        if (varianceOut != NULL) {
+            varianceOut[index] = cumWeight > 0.0f ? varianceSum / (cumWeight * cumWeight) : varianceIn[index];
+        }
+    }
+}
+
+/**
+ * One direction of the separable A-Trous approximation: the same dilated
+ * 5-tap kernel and edge-stopping weights as atrousFilter, but along `axis`
+ * only. A horizontal then a vertical pass stand in for one 2D level with 10
+ * taps instead of 25. The edge weights are not separable, so this is only
+ * an approximation; it can leak along diagonals across edges.
+ */
+template <int KERNEL, bool USE_NORMAL, bool USE_POSITION, typename T>
+__global__ void atrousFilterSeparable(Camera cam, LayerCameras layerCameras, int stepWidth, glm::ivec2 axis,
+        float colorPhi, float normalPhi, float positionPhi,
+        const GBufferPixel* gBuffer, const T* colorIn, float colorScale, T* colorOut,
+        const float* varianceIn, float* varianceOut, const int* tiles) {
+    const glm::ivec2 resolution = cam.resolution;
+    const glm::ivec2 origin = atrousBlockOrigin(tiles, resolution);
+    int x = origin.x + threadIdx.x;
+    int y = origin.y + threadIdx.y;
+    const int base = layerBase(resolution);
+    cam = layerCamera(cam, layerCameras);
+
+    if (x < resolution.x && y < resolution.y) {
+        int index = base + x + (y * resolution.x);
+        glm::vec3 cp = loadColor(colorIn, index) * colorScale;
+        glm::vec3 np(0.0f);
+        glm::vec3 pp(0.0f);
+        if (USE_NORMAL || USE_POSITION) {
+            GBufferPixel gp = gBuffer[index];
+            if (USE_NORMAL) {
+                np = gbufferNormal(gp);
+            }
+            if (USE_POSITION) {
+                pp = gbufferPosition(gp, cam, x, y);
+            }
+        }
+        const float phi = atrousColorPhi(colorPhi, varianceIn, index);
+
+        glm::vec3 sum(0.0f);
+        float cumWeight = 0.0f;
+        float varianceSum = 0.0f;
+#pragma unroll
+        for (int d = -2; d <= 2; d++) {
+            int qx = glm::clamp(x + d * stepWidth * axis.x, 0, resolution.x - 1);
+            int qy = glm::clamp(y + d * stepWidth * axis.y, 0, resolution.y - 1);
+            int q = base + qx + (qy * resolution.x);
+
+            glm::vec3 cq = loadColor(colorIn, q) * colorScale;
+            glm::vec3 nq(0.0f);
+            glm::vec3 pq(0.0f);
+            if (USE_NORMAL || USE_POSITION) {
+                GBufferPixel gq = gBuffer[q];
+                if (USE_NORMAL) {
+                    nq = gbufferNormal(gq);
+                }
+                if (USE_POSITION) {
+                    pq = gbufferPosition(gq, cam, qx, qy);
+                }
+            }
+            float weight = atrousEdgeWeight<USE_NORMAL, USE_POSITION>(stepWidth,
+                    phi, normalPhi, positionPhi, cp, np, pp, cq, nq, pq)
+                * atrousTap<KERNEL>(d + 2);
+            sum += cq * weight;
+            cumWeight += weight;
+            if (varianceIn != NULL) {
+                varianceSum += weight * weight * varianceIn[q];
+            }
+        }
+
+        storeColor(colorOut, index, cumWeight > 0.0f ? sum / cumWeight : cp);
+        if (varianceOut != NULL) {
+            varianceOut[index] = cumWeight > 0.0f ? varianceSum / (cumWeight * cumWeight) : varianceIn[index];
+        }
+    }
+}
+
+__device__ inline glm::vec3 loadSharedVec3(const float* plane, int i) {
+    return glm::vec3(plane[3 * i], plane[3 * i + 1], plane[3 * i + 2]);
+}
+
+__device__ inline void storeSharedVec3(float* plane, int i, glm::vec3 v) {
+    plane[3 * i] = v.x;
+    plane[3 * i + 1] = v.y;
+    plane[3 * i + 2] = v.z;
+}
+
+/**
+ * Same filter as atrousFilter, but each ATROUS_TILE_SIZE^2 block first stages
+ * its tile plus a 2 * stepWidth halo into shared memory, with the G-buffer
+ * already decoded, so the 25 taps per pixel never touch global memory.
+ * Only the planes the instantiation uses are staged; launch with
+ * atrousSharedBytes() bytes of dynamic shared memory.
+ */
+template <int KERNEL, bool USE_NORMAL, bool USE_POSITION, typename T>
+__global__ void atrousFilterShared(Camera cam, LayerCameras layerCameras, int stepWidth,
+        float colorPhi, float normalPhi, float positionPhi,
+        const GBufferPixel* gBuffer, const T* colorIn, float colorScale, T* colorOut,
+        const float* varianceIn, float* varianceOut, const int* tiles) {
+    extern __shared__ float s_atrous[];
+
+    const glm::ivec2 resolution = cam.resolution;
+    const int base = layerBase(resolution);
+    cam = layerCamera(cam, layerCameras);
+    const glm::ivec2 tileOrigin = atrousBlockOrigin(tiles, resolution);
+    const int halo = 2 * stepWidth;
+    const int tileWidth = ATROUS_TILE_SIZE + 2 * halo;
+    const int tileCount = tileWidth * tileWidth;
+    float* s_color = s_atrous;
+    float* s_normal = s_color + 3 * tileCount;
+    float* s_position = s_normal + (USE_NORMAL ? 3 * tileCount : 0);
+    float* s_variance = s_position + (USE_POSITION ? 3 * tileCount : 0);   // only with varianceIn
+
+    const int originX = tileOrigin.x - halo;
+    const int originY = tileOrigin.y - halo;
+    for (int i = threadIdx.x + threadIdx.y * ATROUS_TILE_SIZE; i < tileCount;
+            i += ATROUS_TILE_SIZE * ATROUS_TILE_SIZE) {
+        int qx = glm::clamp(originX + i % tileWidth, 0, resolution.x - 1);
+        int qy = glm::clamp(originY + i / tileWidth, 0, resolution.y - 1);
+        int q = base + qx + (qy * resolution.x);
+        storeSharedVec3(s_color, i, loadColor(colorIn, q) * colorScale);
+        if (USE_NORMAL || USE_POSITION) {
+            GBufferPixel gq = gBuffer[q];
+            if (USE_NORMAL) {
+                storeSharedVec3(s_normal, i, gbufferNormal(gq));
+            }
+            if (USE_POSITION) {
+                storeSharedVec3(s_position, i, gbufferPosition(gq, cam, qx, qy));
+            }
+        }
+        if (varianceIn != NULL) {
+            s_variance[i] = varianceIn[q];
+        }
+    }
+    __syncthreads();
+
+    int x = tileOrigin.x + threadIdx.x;
+    int y = tileOrigin.y + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        int p = (threadIdx.x + halo) + (threadIdx.y + halo) * tileWidth;
+        glm::vec3 cp = loadSharedVec3(s_color, p);
+        glm::vec3 np = USE_NORMAL ? loadSharedVec3(s_normal, p) : glm::vec3(0.0f);
+        glm::vec3 pp = USE_POSITION ? loadSharedVec3(s_position, p) : glm::vec3(0.0f);
+        const float phi = varianceIn != NULL ? glm::max(colorPhi * s_variance[p], EPSILON) : colorPhi;
+
+        glm::vec3 sum(0.0f);
+        float cumWeight = 0.0f;
+        float varianceSum = 0.0f;
+#pragma unroll
+        for (int dy = -2; dy <= 2; dy++) {
+#pragma unroll
+            for (int dx = -2; dx <= 2; dx++) {
+                int q = p + dx * stepWidth + dy * stepWidth * tileWidth;
+                glm::vec3 cq = loadSharedVec3(s_color, q);
+                glm::vec3 nq = USE_NORMAL ? loadSharedVec3(s_normal, q) : glm::vec3(0.0f);
+                glm::vec3 pq = USE_POSITION ? loadSharedVec3(s_position, q) : glm::vec3(0.0f);
+                float weight = atrousEdgeWeight<USE_NORMAL, USE_POSITION>(stepWidth,
+                        phi, normalPhi, positionPhi, cp, np, pp, cq, nq, pq)
+                    * atrousTap<KERNEL>(dx + 2) * atrousTap<KERNEL>(dy + 2);
+                sum += cq * weight;
+                cumWeight += weight;
+                if (varianceIn != NULL) {
+                    varianceSum += weight * weight * s_variance[q];
+                }
+            }
+        }
+
+        int index = base + x + (y * resolution.x);
+        storeColor(colorOut, index, cumWeight > 0.0f ? sum / cumWeight : cp);
+        if (varianceOut != NULL) {
+            varianceOut[index] = cumWeight > 0.0f ? varianceSum / (cumWeight * cumWeight) : s_variance[p];
+        }
+    }
+}
+
+// Colour plus whichever normal, position and variance planes are used, for
+// one tile of atrousFilterShared.
+static size_t atrousSharedBytes(int stepWidth, bool useNormal, bool usePosition, bool varianceGuided) {
+    const int tileWidth = ATROUS_TILE_SIZE + 4 * stepWidth;
+    const int floatsPerPixel = 3 + (useNormal ? 3 : 0) + (usePosition ? 3 : 0) + (varianceGuided ? 1 : 0);
+    return floatsPerPixel * sizeof(float) * tileWidth * tileWidth;
+}
+
+#if CUDART_VERSION >= 12000
+/**
+ * Same filter as atrousFilterShared for the step widths past
+ * ATROUS_MAX_SHARED_STEP, on sm_90 and newer. Each block stages only its
+ * own ATROUS_TILE_SIZE^2 tile, decoded the same way, and the blocks of an
+ * ATROUS_CLUSTER_WIDTH x ATROUS_CLUSTER_HEIGHT cluster read each other's
+ * tiles through distributed shared memory, so a wide-stride tap inside the
+ * cluster costs a DSM load instead of a global load and G-buffer decode.
+ * Taps outside the cluster fall back to global memory as in atrousFilter.
+ * Launch a grid whose width and height in tiles are multiples of the
+ * cluster's, with atrousSharedBytes(0, ...) bytes of dynamic shared memory.
+ */
+template <int KERNEL, bool USE_NORMAL, bool USE_POSITION, typename T>
+__global__ void atrousFilterCluster(Camera cam, LayerCameras layerCameras, int stepWidth,
+        float colorPhi, float normalPhi, float positionPhi,
+        const GBufferPixel* gBuffer, const T* colorIn, float colorScale, T* colorOut,
+        const float* varianceIn, float* varianceOut) {
+#if __CUDA_ARCH__ >= 900
+    extern __shared__ float s_atrous[];
+    cooperative_groups::cluster_group cluster = cooperative_groups::this_cluster();
+
+    const glm::ivec2 resolution = cam.resolution;
+    const int base = layerBase(resolution);
+    cam = layerCamera(cam, layerCameras);
+    const int tileCount = ATROUS_TILE_SIZE * ATROUS_TILE_SIZE;
+    // Plane offsets, the same in every block's tile
+    const int normalPlane = 3 * tileCount;
+    const int positionPlane = normalPlane + (USE_NORMAL ? 3 * tileCount : 0);
+    const int variancePlane = positionPlane + (USE_POSITION ? 3 * tileCount : 0);   // only with varianceIn
+
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    const int p = threadIdx.x + threadIdx.y * ATROUS_TILE_SIZE;
+    {
+        // Blocks past the edge stage clamped pixels no tap reads, but still
+        // take part in the cluster barriers
+        int qx = glm::min(x, resolution.x - 1);
+        int qy = glm::min(y, resolution.y - 1);
+        int q = base + qx + (qy * resolution.x);
+        storeSharedVec3(s_atrous, p, loadColor(colorIn, q) * colorScale);
+        if (USE_NORMAL || USE_POSITION) {
+            GBufferPixel gq = gBuffer[q];
+            if (USE_NORMAL) {
+                storeSharedVec3(s_atrous + normalPlane, p, gbufferNormal(gq));
+            }
+            if (USE_POSITION) {
+                storeSharedVec3(s_atrous + positionPlane, p, gbufferPosition(gq, cam, qx, qy));
+            }
+        }
+        if (varianceIn != NULL) {
+            s_atrous[variancePlane + p] = varianceIn[q];
+        }
+    }
+    cluster.sync();
+
+    // First pixel of the cluster
+    const dim3 clusterBlock = cluster.block_index();
+    const int clusterX = (blockIdx.x - clusterBlock.x) * ATROUS_TILE_SIZE;
+    const int clusterY = (blockIdx.y - clusterBlock.y) * ATROUS_TILE_SIZE;
+
+    if (x < resolution.x && y < resolution.y) {
+        glm::vec3 cp = loadSharedVec3(s_atrous, p);
+        glm::vec3 np = USE_NORMAL ? loadSharedVec3(s_atrous + normalPlane, p) : glm::vec3(0.0f);
+        glm::vec3 pp = USE_POSITION ? loadSharedVec3(s_atrous + positionPlane, p) : glm::vec3(0.0f);
+        const float vp = varianceIn != NULL ? s_atrous[variancePlane + p] : 0.0f;
+        const float phi = varianceIn != NULL ? glm::max(colorPhi * vp, EPSILON) : colorPhi;
+
+        glm::vec3 sum(0.0f);
+        float cumWeight = 0.0f;
+        float varianceSum = 0.0f;
+#pragma unroll
+        for (int dy = -2; dy <= 2; dy++) {
+#pragma unroll
+            for (int dx = -2; dx <= 2; dx++) {
+                int qx = glm::clamp(x + dx * stepWidth, 0, resolution.x - 1);
+                int qy = glm::clamp(y + dy * stepWidth, 0, resolution.y - 1);
+                int cx = qx - clusterX;
+                int cy = qy - clusterY;
+
+                glm::vec3 cq;
+                glm::vec3 nq(0.0f);
+                glm::vec3 pq(0.0f);
+                float vq = 0.0f;
+                if (cx >= 0 && cx < ATROUS_CLUSTER_WIDTH * ATROUS_TILE_SIZE
+                        && cy >= 0 && cy < ATROUS_CLUSTER_HEIGHT * ATROUS_TILE_SIZE) {
+                    const float *tile = cluster.map_shared_rank(s_atrous,
+                            cx / ATROUS_TILE_SIZE + (cy / ATROUS_TILE_SIZE) * ATROUS_CLUSTER_WIDTH);
+                    int i = cx % ATROUS_TILE_SIZE + (cy % ATROUS_TILE_SIZE) * ATROUS_TILE_SIZE;
+                    cq = loadSharedVec3(tile, i);
+                    if (USE_NORMAL) {
+                        nq = loadSharedVec3(tile + normalPlane, i);
+                    }
+                    if (USE_POSITION) {
+                        pq = loadSharedVec3(tile + positionPlane, i);
+                    }
+                    if (varianceIn != NULL) {
+                        vq = tile[variancePlane + i];
+                    }
+                } else {
+                    int q = base + qx + (qy * resolution.x);
+                    cq = loadColor(colorIn, q) * colorScale;
+                    if (USE_NORMAL || USE_POSITION) {
+                        GBufferPixel gq = gBuffer[q];
+                        if (USE_NORMAL) {
+                            nq = gbufferNormal(gq);
+                        }
+                        if (USE_POSITION) {
+                            pq = gbufferPosition(gq, cam, qx, qy);
+                        }
+                    }
+                    if (varianceIn != NULL) {
+                        vq = varianceIn[q];
+                    }
+                }
+                float weight = atrousEdgeWeight<USE_NORMAL, USE_POSITION>(stepWidth,
+                        phi, normalPhi, positionPhi, cp, np, pp, cq, nq, pq)
+                    * atrousTap<KERNEL>(dx + 2) * atrousTap<KERNEL>(dy + 2);
+                sum += cq * weight;
+                cumWeight += weight;
+                varianceSum += weight * weight * vq;
+            }
+        }
+
+        int index = base + x + (y * resolution.x);
+        storeColor(colorOut, index, cumWeight > 0.0f ? sum / cumWeight : cp);
+        if (varianceOut != NULL) {
+            varianceOut[index] = cumWeight > 0.0f ? varianceSum / (cumWeight * cumWeight) : vp;
+        }
+    }
+    // The rest of the cluster may still be reading this block's tile
+    cluster.sync();
+#endif
+}
+
+/**
+ * Launches atrousFilterCluster for one level; false if the cluster launch
+ * is refused (e.g. no room to co-schedule a whole cluster), with the error
+ * cleared so the caller can fall back.
+ */
+template <int KERNEL, bool USE_NORMAL, bool USE_POSITION, typename T>
+static bool launchAtrousCluster(const Camera &cam, int layers, LayerCameras layerCameras, int stepWidth,
+        float colorPhi, float normalPhi, float positionPhi,
+        const GBufferPixel *gBuffer, const T *colorIn, float colorScale, T *colorOut,
+        const float *varianceIn, float *varianceOut, cudaStream_t stream) {
+    const int tilesX = (cam.resolution.x + ATROUS_TILE_SIZE - 1) / ATROUS_TILE_SIZE;
+    const int tilesY = (cam.resolution.y + ATROUS_TILE_SIZE - 1) / ATROUS_TILE_SIZE;
+    cudaLaunchAttribute attribute;
+    attribute.id = cudaLaunchAttributeClusterDimension;
+    attribute.val.clusterDim.x = ATROUS_CLUSTER_WIDTH;
+    attribute.val.clusterDim.y = ATROUS_CLUSTER_HEIGHT;
+    attribute.val.clusterDim.z = 1;
+
+    cudaLaunchConfig_t config = {};
+    config.gridDim = dim3(
+            (tilesX + ATROUS_CLUSTER_WIDTH - 1) / ATROUS_CLUSTER_WIDTH * ATROUS_CLUSTER_WIDTH,
+            (tilesY + ATROUS_CLUSTER_HEIGHT - 1) / ATROUS_CLUSTER_HEIGHT * ATROUS_CLUSTER_HEIGHT, layers);
+    config.blockDim = dim3(ATROUS_TILE_SIZE, ATROUS_TILE_SIZE);
+    config.dynamicSmemBytes = atrousSharedBytes(0, USE_NORMAL, USE_POSITION, varianceIn != NULL);
+    config.stream = stream;
+    config.attrs = &attribute;
+    config.numAttrs = 1;
+    if (cudaLaunchKernelEx(&config, atrousFilterCluster<KERNEL, USE_NORMAL, USE_POSITION, T>,
+            cam, layerCameras, stepWidth, colorPhi, normalPhi, positionPhi,
+            gBuffer, colorIn, colorScale, colorOut, varianceIn, varianceOut) != cudaSuccess) {
+        cudaGetLastError();
+        return false;
+    }
+    return true;
+}
+#endif
+
+// Per-level arguments shared by every A-Trous instantiation, for colour
+// buffers of type T
+template <typename T>
+struct AtrousLevel {
+    const Camera *cam;          // of one layer
+    int layers;
+    LayerCameras layerCameras;
+    const GBufferPixel *gBuffer;
+    int stepWidth;
+    float colorPhi;
+    float normalPhi;
+    float positionPhi;
+    const T *colorIn;
+    float colorScale;
+    T *colorOut;
+    const float *varianceIn;
+    float *varianceOut;
+    bool separable;             // two 1D passes through the temp buffers
+    T *colorTemp;
+    float *varianceTemp;
+    bool clusters;              // atrousFilterCluster may take the wide steps
+    const int *tiles;           // the tiles to filter, NULL for the whole image
+    int tileCount;
+    cudaStream_t stream;
+};
+
+template <int KERNEL, bool USE_NORMAL, bool USE_POSITION, typename T>
+static void launchAtrousLevel(const AtrousLevel<T> &level) {
+    const Camera &cam = *level.cam;
+    // A tile list takes one tile-sized block per tile
+    const dim3 blockSize2d = level.tiles != NULL ? dim3(ATROUS_TILE_SIZE, ATROUS_TILE_SIZE) : dim3(8, 8);
+    const dim3 blocksPerGrid2d = level.tiles != NULL ? dim3(level.tileCount)
+        : dim3((cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+                (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y, level.layers);
+    if (level.separable) {
+        float *varianceTemp = level.varianceIn != NULL ? level.varianceTemp : NULL;
+        atrousFilterSeparable<KERNEL, USE_NORMAL, USE_POSITION, T><<<blocksPerGrid2d, blockSize2d, 0, level.stream>>>(
+                cam, level.layerCameras, level.stepWidth, glm::ivec2(1, 0), level.colorPhi, level.normalPhi,
+                level.positionPhi, level.gBuffer, level.colorIn, level.colorScale, level.colorTemp, level.varianceIn, varianceTemp,
+                level.tiles);
+        atrousFilterSeparable<KERNEL, USE_NORMAL, USE_POSITION, T><<<blocksPerGrid2d, blockSize2d, 0, level.stream>>>(
+                cam, level.layerCameras, level.stepWidth, glm::ivec2(0, 1), level.colorPhi, level.normalPhi,
+                level.positionPhi, level.gBuffer, level.colorTemp, 1.0f, level.colorOut, varianceTemp, level.varianceOut,
+                level.tiles);
+    } else if (level.stepWidth <= ATROUS_MAX_SHARED_STEP) {
+        const dim3 tileBlockSize(ATROUS_TILE_SIZE, ATROUS_TILE_SIZE);
+        const dim3 tilesPerGrid = level.tiles != NULL ? dim3(level.tileCount)
+            : dim3((cam.resolution.x + ATROUS_TILE_SIZE - 1) / ATROUS_TILE_SIZE,
+                    (cam.resolution.y + ATROUS_TILE_SIZE - 1) / ATROUS_TILE_SIZE, level.layers);
+        const size_t sharedBytes = atrousSharedBytes(level.stepWidth,
+                USE_NORMAL, USE_POSITION, level.varianceIn != NULL);
+        atrousFilterShared<KERNEL, USE_NORMAL, USE_POSITION, T><<<tilesPerGrid, tileBlockSize, sharedBytes, level.stream>>>(
+                cam, level.layerCameras, level.stepWidth, level.colorPhi, level.normalPhi, level.positionPhi,
+                level.gBuffer, level.colorIn, level.colorScale, level.colorOut, level.varianceIn,
+                level.varianceOut, level.tiles);
+    } else {
+#if CUDART_VERSION >= 12000
+        // Clusters tile the whole image, so a tile list takes the global-memory kernel
+        if (level.clusters && level.tiles == NULL && level.stepWidth <= ATROUS_MAX_CLUSTER_STEP
+                && launchAtrousCluster<KERNEL, USE_NORMAL, USE_POSITION, T>(cam, level.layers,
+                    level.layerCameras, level.stepWidth, level.colorPhi, level.normalPhi, level.positionPhi,
+                    level.gBuffer, level.colorIn, level.colorScale, level.colorOut, level.varianceIn,
+                    level.varianceOut, level.stream)) {
+            return;
+        }
+#endif
+        atrousFilter<KERNEL, USE_NORMAL, USE_POSITION, T><<<blocksPerGrid2d, blockSize2d, 0, level.stream>>>(
+                cam, level.layerCameras, level.stepWidth, level.colorPhi, level.normalPhi, level.positionPhi,
+                level.gBuffer, level.colorIn, level.colorScale, level.colorOut, level.varianceIn,
+                level.varianceOut, level.tiles);
+    }
+}
+
+/**
+ * Dispatches one level to the instantiation for this kernel and set of edge
+ * terms, so the per-tap code never branches on them.
+ */
+template <int KERNEL, typename T>
+static void launchAtrousLevel(const AtrousLevel<T> &level, bool useNormal, bool usePosition) {
+    if (useNormal && usePosition) {
+        launchAtrousLevel<KERNEL, true, true, T>(level);
+    } else if (useNormal) {
+        launchAtrousLevel<KERNEL, true, false, T>(level);
+    } else if (usePosition) {
+        launchAtrousLevel<KERNEL, false, true, T>(level);
+    } else {
+        launchAtrousLevel<KERNEL, false, false, T>(level);
+    }
+}
+
+template <typename T>
+static void launchAtrousLevel(const AtrousLevel<T> &level, int kernel, bool useNormal, bool usePosition) {
+    if (kernel == DENOISER_GAUSSIAN) {
+        launchAtrousLevel<DENOISER_GAUSSIAN, T>(level, useNormal, usePosition);
+    } else {
+        launchAtrousLevel<DENOISER_B3_SPLINE, T>(level, useNormal, usePosition);
+    }
+}
+
+/**
+ * Variance of each pixel's mean luminance, from its accumulated moments.
+ * Below four samples the per-pixel estimate is unreliable, so the moments
+ * of the 3x3 neighbourhood are pooled instead. `sampleCount` optionally
+ * overrides iter per pixel with the effective count after temporal
+ * reprojection.
+ */
+__global__ void estimateVariance(glm::ivec2 resolution, int iter,
+        const glm::vec2* moments, const float* sampleCount, float* variance) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    const int base = layerBase(resolution);
+
+    if (x < resolution.x && y < resolution.y) {
+        int index = base + x + (y * resolution.x);
+        glm::vec2 m = moments[index] / (float)iter;
+        if (iter < 4) {
+            m = glm::vec2(0.0f);
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    int qx = glm::clamp(x + dx, 0, resolution.x - 1);
+                    int qy = glm::clamp(y + dy, 0, resolution.y - 1);
+                    m += moments[base + qx + (qy * resolution.x)];
+                }
+            }
+            m /= 9.0f * iter;
+        }
+        float n = sampleCount != NULL ? sampleCount[index] : (float)iter;
+        variance[index] = glm::max(m.y - m.x * m.x, 0.0f) / n;
+    }
+}
+
+/**
+ * One ATROUS_TILE_SIZE^2 block per tile: the standard error of each pixel's
+ * mean luminance, from its moments as in estimateVariance, RMS over the
+ * tile against the tile's mean luminance. A tile where that is still
+ * above `threshold` goes to the front of `tiles`, counted in counts[0],
+ * and a converged one to the back, counted in counts[1].
+ */
+__global__ void classifyTiles(glm::ivec2 resolution, int iter, const glm::vec2* moments,
+        const float* sampleCount, float threshold, int tileCount, int* tiles, int* counts) {
+    __shared__ float s_sums[3][ATROUS_TILE_SIZE * ATROUS_TILE_SIZE / 32];
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    float variance = 0.0f;
+    float luminance = 0.0f;
+    float pixels = 0.0f;
+    if (x < resolution.x && y < resolution.y) {
+        int index = x + (y * resolution.x);
+        glm::vec2 m = moments[index] / (float)iter;
+        float n = sampleCount != NULL ? sampleCount[index] : (float)iter;
+        variance = glm::max(m.y - m.x * m.x, 0.0f) / glm::max(n, 1.0f);
+        luminance = m.x;
+        pixels = 1.0f;
+    }
+    for (int offset = 16; offset > 0; offset /= 2) {
+        variance += __shfl_down_sync(0xffffffff, variance, offset);
+        luminance += __shfl_down_sync(0xffffffff, luminance, offset);
+        pixels += __shfl_down_sync(0xffffffff, pixels, offset);
+    }
+    const int thread = threadIdx.x + threadIdx.y * blockDim.x;
+    if ((thread & 31) == 0) {
+        s_sums[0][thread / 32] = variance;
+        s_sums[1][thread / 32] = luminance;
+        s_sums[2][thread / 32] = pixels;
+    }
+    __syncthreads();
+
+    if (thread == 0) {
+        for (int warp = 1; warp < ATROUS_TILE_SIZE * ATROUS_TILE_SIZE / 32; warp++) {
+            variance += s_sums[0][warp];
+            luminance += s_sums[1][warp];
+            pixels += s_sums[2][warp];
+        }
+        // Mean variance against the squared mean luminance, both over the tile's pixels
+        const int tile = blockIdx.x + blockIdx.y * gridDim.x;
+        if (variance * pixels > threshold * threshold * luminance * luminance) {
+            tiles[atomicAdd(&counts[0], 1)] = tile;
+        } else {
+            tiles[tileCount - 1 - atomicAdd(&counts[1], 1)] = tile;
+        }
+    }
+}
+
+/**
+ * One ATROUS_TILE_SIZE^2 block per converged tile, the last `count` of
+ * `tiles`: copies the input, scaled, into each colour buffer the levels
+ * read and write, and the variance into the variance ones, so a tile the
+ * levels skip reads as its input to the taps of its neighbours and ends
+ * up unfiltered in the result. Null buffers are skipped.
+ */
+template <typename T>
+__global__ void copyConvergedTiles(glm::ivec2 resolution, const int* tiles, int tileCount,
+        const T* input, float inputScale, T* colorA, T* colorB, T* colorC,
+        const float* varianceIn, float* varianceA, float* varianceB) {
+    const int tilesX = (resolution.x + ATROUS_TILE_SIZE - 1) / ATROUS_TILE_SIZE;
+    const int tile = tiles[tileCount - 1 - blockIdx.x];
+    int x = (tile % tilesX) * ATROUS_TILE_SIZE + threadIdx.x;
+    int y = (tile / tilesX) * ATROUS_TILE_SIZE + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        int index = x + (y * resolution.x);
+        glm::vec3 color = loadColor(input, index) * inputScale;
+        storeColor(colorA, index, color);
+        storeColor(colorB, index, color);
+        if (colorC != NULL) {
+            storeColor(colorC, index, color);
+        }
+        if (varianceIn != NULL) {
+            varianceA[index] = varianceIn[index];
+            varianceB[index] = varianceIn[index];
+        }
+    }
+}
+
+int denoiserLevels(int filterSize) {
+    int levels = 0;
+    while ((4 << levels) - 3 < filterSize) {
+        levels++;
+    }
+    return levels;
+}
+
+/**
+ * Adds up |luminance(after) - luminance(before)| and luminance(after) over
+ * the image into sums[0] and sums[1]: one atomic pair per warp.
+ */
+template <typename T>
+__global__ void measureLevelChange(glm::ivec2 resolution, const T* before, float beforeScale,
+        const T* after, float* sums) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    const glm::vec3 weights(0.2126f, 0.7152f, 0.0722f);
+
+    float change = 0.0f;
+    float total = 0.0f;
+    if (x < resolution.x && y < resolution.y) {
+        int index = layerBase(resolution) + x + (y * resolution.x);
+        float a = glm::dot(loadColor(after, index), weights);
+        float b = glm::dot(loadColor(before, index), weights) * beforeScale;
+        change = fabsf(a - b);
+        total = fabsf(a);
+    }
+    for (int offset = 16; offset > 0; offset /= 2) {
+        change += __shfl_down_sync(0xffffffff, change, offset);
+        total += __shfl_down_sync(0xffffffff, total, offset);
+    }
+    if (((threadIdx.x + threadIdx.y * blockDim.x) & 31) == 0) {
+        atomicAdd(&sums[0], change);
+        atomicAdd(&sums[1], total);
+    }
+}
+
+/**
+ * Whether the level that turned `before` into `after` changed the image's
+ * luminance by less than options.convergence of its total. Reads the sums
+ * back, so it waits for the levels queued so far.
+ */
+template <typename T>
+static bool levelConverged(const DenoiserContext &ctx, const Camera &cam, const DenoiserSettings &options,
+        const T *before, float beforeScale, const T *after) {
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y, ctx.layers);
+    cudaMemsetAsync(ctx.levelChange, 0, 2 * sizeof(float), ctx.stream);
+    measureLevelChange<<<blocksPerGrid2d, blockSize2d, 0, ctx.stream>>>(cam.resolution,
+            before, beforeScale, after, ctx.levelChange);
+    float sums[2] = { 0.0f, 0.0f };
+    cudaMemcpyAsync(sums, ctx.levelChange, sizeof(sums), cudaMemcpyDeviceToHost, ctx.stream);
+    cudaStreamSynchronize(ctx.stream);
+    return sums[0] <= options.convergence * sums[1];
+}
+
+/**
+ * Runs the denoiserLevels(filterSize) A-Trous levels, at most maxLevels, at
+ * the resolution of `cam` on `input` (scaled by inputScale on the first
+ * load), ping-ponging between levelIn and levelOut. Returns the buffer
+ * holding the result, which is `input` itself if no level runs. colorPhi
+ * is carried in and out so a coarser pass can continue the schedule; with
+ * varianceIn non-NULL the levels are variance-guided and the variance
+ * buffers are swapped along with the colour ones. With options.convergence
+ * set, the levels stop early, and `converged` is set, once one changes the
+ * image by less than that fraction. levelsRun counts the levels run.
+ */
+template <typename T>
+static const T * runAtrousLevels(const DenoiserContext &ctx, const Camera &cam, const GBufferPixel *gBuffer,
+        const DenoiserSettings &options, int filterSize, int maxLevels, float &colorPhi,
+        float *&varianceIn, float *&varianceOut,
+        const T *input, float inputScale, T *&levelIn, T *&levelOut, T *levelTemp,
+        int &levelsRun, bool &converged) {
+    const float normalPhi = glm::max(options.normalWeight * options.normalWeight, EPSILON);
+    const float positionPhi = glm::max(options.positionWeight * options.positionWeight, EPSILON);
+
+    // A zero normal or position weight disables that edge term entirely
+    const bool useNormal = options.normalWeight > 0.0f;
+    const bool usePosition = options.positionWeight > 0.0f;
+
+    const T *result = input;
+    float resultScale = inputScale;
+    const int levelCount = glm::min(denoiserLevels(filterSize), maxLevels);
+    for (int stepWidth = 1, levels = 0; levels < levelCount && !converged; stepWidth *= 2, levels++) {
+        AtrousLevel<T> level;
+        level.cam = &cam;
+        level.layers = ctx.layers;
+        level.layerCameras = ctx.layerCameras;
+        level.gBuffer = gBuffer;
+        level.stepWidth = stepWidth;
+        level.colorPhi = colorPhi;
+        level.normalPhi = normalPhi;
+        level.positionPhi = positionPhi;
+        level.colorIn = result;
+        level.colorScale = resultScale;
+        level.colorOut = levelOut;
+        level.varianceIn = varianceIn;
+        level.varianceOut = varianceOut;
+        level.separable = options.separable;
+        level.colorTemp = levelTemp;
+        level.varianceTemp = ctx.varianceTemp;
+        level.clusters = ctx.clusters;
+        // The tile list is of the full-resolution image
+        level.tiles = cam.resolution == ctx.resolution ? ctx.activeTiles : NULL;
+        level.tileCount = ctx.activeTileCount;
+        level.stream = ctx.stream;
+        launchAtrousLevel(level, options.kernel, useNormal, usePosition);
+        levelsRun++;
+
+        // The last level has nothing left to skip
+        if (options.convergence > 0.0f && levels + 1 < levelCount) {
+            converged = levelConverged(ctx, cam, options, result, resultScale, (const T *)levelOut);
+        }
+        result = levelOut;
+        resultScale = 1.0f;
+        std::swap(levelIn, levelOut);
+
+        // Variance-guided mode scales colorPhi by each pixel's variance
+        // instead of halving it per level, since filtering already shrinks
+        // the variance.
+        if (varianceIn != NULL) {
+            std::swap(varianceIn, varianceOut);
+        } else {
+            colorPhi *= 0.5f;
+        }
+    }
+    return result;
+}
+
+/**
+ * Box-filters 2x2 blocks of the fine colour and variance into the coarse
+ * level, and keeps the top-left G-buffer sample of each block. Averaging
+ * four pixels quarters the variance of their mean.
+ */
+template <typename T>
+__global__ void pyramidDownsample(glm::ivec2 resolution, glm::ivec2 coarseResolution,
+        const T* colorIn, float colorScale, const GBufferPixel* gBuffer, const float* varianceIn,
+        glm::vec3* colorOut, GBufferPixel* gBufferOut, float* varianceOut) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    const int base = layerBase(resolution);
+
+    if (x < coarseResolution.x && y < coarseResolution.y) {
+        glm::vec3 color(0.0f);
+        float variance = 0.0f;
+        for (int dy = 0; dy < 2; dy++) {
+            for (int dx = 0; dx < 2; dx++) {
+                int qx = glm::min(2 * x + dx, resolution.x - 1);
+                int qy = glm::min(2 * y + dy, resolution.y - 1);
+                int q = base + qx + (qy * resolution.x);
+                color += loadColor(colorIn, q);
+                if (varianceIn != NULL) {
+                    variance += varianceIn[q];
+                }
+            }
+        }
+
+        int index = layerBase(coarseResolution) + x + (y * coarseResolution.x);
+        colorOut[index] = color * (0.25f * colorScale);
+        gBufferOut[index] = gBuffer[base + 2 * x + (2 * y * resolution.x)];
+        if (varianceOut != NULL) {
+            varianceOut[index] = variance * (0.25f * 0.25f);
+        }
+    }
+}
+
+/**
+ * Joint bilateral upsampling of the coarse level's correction. The
+ * difference between the filtered and unfiltered coarse colour is what the
+ * coarse levels removed; it is interpolated from the four nearest coarse
+ * pixels, weighted by how well their G-buffer matches this pixel's, and
+ * added to the fine result so detail the fine levels kept survives.
+ */
+template <typename T>
+__global__ void pyramidUpsample(Camera cam, Camera coarseCam, LayerCameras layerCameras,
+        float normalPhi, float positionPhi, bool useNormal, bool usePosition,
+        const T* fine, float fineScale, const GBufferPixel* gBuffer,
+        const glm::vec3* coarseBefore, const glm::vec3* coarseAfter, const GBufferPixel* coarseGBuffer,
+        T* colorOut) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    const int base = layerBase(cam.resolution);
+    const int coarseBase = layerBase(coarseCam.resolution);
+    cam = layerCamera(cam, layerCameras);
+    coarseCam = layerCamera(coarseCam, layerCameras);
+
+    if (x < cam.resolution.x && y < cam.resolution.y) {
+        int index = base + x + (y * cam.resolution.x);
+        GBufferPixel g = gBuffer[index];
+        glm::vec3 np = gbufferNormal(g);
+        glm::vec3 pp = gbufferPosition(g, cam, x, y);
+
+        // Coarse sample X sits on fine pixel 2X
+        float u = glm::min(0.5f * x, coarseCam.resolution.x - 1.0f);
+        float v = glm::min(0.5f * y, coarseCam.resolution.y - 1.0f);
+        int x0 = (int)u;
+        int y0 = (int)v;
+        float fx = u - x0;
+        float fy = v - y0;
+
+        glm::vec3 sum(0.0f);
+        glm::vec3 bilinear(0.0f);
+        float cumWeight = 0.0f;
+        for (int dy = 0; dy < 2; dy++) {
+            for (int dx = 0; dx < 2; dx++) {
+                int qx = glm::min(x0 + dx, coarseCam.resolution.x - 1);
+                int qy = glm::min(y0 + dy, coarseCam.resolution.y - 1);
+                int q = coarseBase + qx + (qy * coarseCam.resolution.x);
+                float spatial = (dx ? fx : 1.0f - fx) * (dy ? fy : 1.0f - fy);
+                glm::vec3 correction = coarseAfter[q] - coarseBefore[q];
+                bilinear += correction * spatial;
+
+                float weight = spatial;
+                GBufferPixel gq = coarseGBuffer[q];
+                if (useNormal) {
+                    glm::vec3 t = np - gbufferNormal(gq);
+                    weight *= __expf(-glm::dot(t, t) / normalPhi);
+                }
+                if (usePosition) {
+                    glm::vec3 t = pp - gbufferPosition(gq, coarseCam, qx, qy);
+                    weight *= __expf(-glm::dot(t, t) / positionPhi);
+                }
+                sum += correction * weight;
+                cumWeight += weight;
+            }
+        }
+
+        // No matching coarse neighbour: fall back to plain bilinear
+        glm::vec3 correction = cumWeight > EPSILON ? sum / cumWeight : bilinear;
+        storeColor(colorOut, index, loadColor(fine, index) * fineScale + correction);
+    }
+}
+
+/**
+ * Pyramid mode: the first PYRAMID_FINE_LEVELS levels at full resolution,
+ * the rest of the footprint at half resolution, then the coarse correction
+ * upsampled onto the fine result. Returns the buffer holding the result;
+ * if the fine levels already converge it is the fine result.
+ */
+template <typename T>
+static const T * runAtrousPyramid(const DenoiserContext &ctx, const Camera &cam,
+        const DenoiserSettings &options,
+        float colorPhi, float *varianceIn, float *varianceOut,
+        const T *input, float inputScale, T *&levelIn, T *&levelOut, T *levelTemp, int &levelsRun) {
+    bool converged = false;
+    const T *fine = runAtrousLevels(ctx, cam, ctx.gBuffer, options, options.filterSize,
+            PYRAMID_FINE_LEVELS, colorPhi, varianceIn, varianceOut,
+            input, inputScale, levelIn, levelOut, levelTemp, levelsRun, converged);
+    const float fineScale = fine == input ? inputScale : 1.0f;
+    if (converged || denoiserLevels(options.filterSize) <= PYRAMID_FINE_LEVELS) {
+        return fine;
+    }
+
+    const Camera coarseCam = pyramidCamera(cam);
+    const dim3 blockSize2d(8, 8);
+    const dim3 coarseBlocks(
+            (coarseCam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (coarseCam.resolution.y + blockSize2d.y - 1) / blockSize2d.y, ctx.layers);
+    pyramidDownsample<<<coarseBlocks, blockSize2d, 0, ctx.stream>>>(cam.resolution, coarseCam.resolution,
+            fine, fineScale, ctx.gBuffer, varianceIn, ctx.pyramidColor, ctx.pyramidGBuffer,
+            varianceIn != NULL ? ctx.pyramidVarianceIn : NULL);
+
+    float *coarseVarianceIn = varianceIn != NULL ? ctx.pyramidVarianceIn : NULL;
+    float *coarseVarianceOut = varianceIn != NULL ? ctx.pyramidVarianceOut : NULL;
+    glm::vec3 *coarseIn = ctx.pyramidIn;
+    glm::vec3 *coarseOut = ctx.pyramidOut;
+    const glm::vec3 *coarse = runAtrousLevels(ctx, coarseCam, ctx.pyramidGBuffer, options,
+            (options.filterSize + 1) / 2, INT_MAX, colorPhi, coarseVarianceIn, coarseVarianceOut,
+            (const glm::vec3 *)ctx.pyramidColor, 1.0f, coarseIn, coarseOut, ctx.pyramidTemp,
+            levelsRun, converged);
+
+    const dim3 blocksPerGrid2d(
+            (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y, ctx.layers);
+    pyramidUpsample<<<blocksPerGrid2d, blockSize2d, 0, ctx.stream>>>(cam, coarseCam, ctx.layerCameras,
+            glm::max(options.normalWeight * options.normalWeight, EPSILON),
+            glm::max(options.positionWeight * options.positionWeight, EPSILON),
+            options.normalWeight > 0.0f, options.positionWeight > 0.0f,
+            fine, fineScale, ctx.gBuffer, ctx.pyramidColor, coarse, ctx.pyramidGBuffer, levelOut);
+
+    const T *result = levelOut;
+    std::swap(levelIn, levelOut);
+    return result;
+}
+
+/**
+ * Full- or multi-resolution A-Trous filtering of `input`, see runAtrousLevels.
+ * levelsRun is set to the number of levels run.
+ */
+template <typename T>
+static const T * runAtrousFilter(const DenoiserContext &ctx, const Camera &cam,
+        const DenoiserSettings &options,
+        const T *input, float inputScale, T *&levelIn, T *&levelOut, T *levelTemp, int &levelsRun) {
+    float colorPhi = glm::max(options.colorWeight * options.colorWeight, EPSILON);
+    float *varianceIn = options.varianceGuided ? ctx.varianceIn : NULL;
+    float *varianceOut = options.varianceGuided ? ctx.varianceOut : NULL;
+    levelsRun = 0;
+    if (ctx.activeTiles != NULL) {
+        // Every tile has converged: the input stands as it is
+        if (ctx.activeTileCount == 0) {
+            return input;
+        }
+        const dim3 tileBlockSize(ATROUS_TILE_SIZE, ATROUS_TILE_SIZE);
+        copyConvergedTiles<<<ctx.convergedTileCount, tileBlockSize, 0, ctx.stream>>>(cam.resolution,
+                ctx.activeTiles, ctx.activeTileCount + ctx.convergedTileCount, input, inputScale,
+                levelIn, levelOut, options.separable ? levelTemp : NULL,
+                varianceIn, varianceOut, ctx.varianceTemp);
+    }
+    // Single-row layers would not fit their coarse levels in the scratch
+    if (options.pyramid && (ctx.layers == 1 || cam.resolution.y > 1)) {
+        return runAtrousPyramid(ctx, cam, options, colorPhi, varianceIn, varianceOut,
+                input, inputScale, levelIn, levelOut, levelTemp, levelsRun);
+    }
+    bool converged = false;
+    return runAtrousLevels(ctx, cam, ctx.gBuffer, options, options.filterSize, INT_MAX, colorPhi,
+            varianceIn, varianceOut, input, inputScale, levelIn, levelOut, levelTemp, levelsRun, converged);
+}
+
+/**
+ * Normalizes the accumulated colour into the first filter buffer. With a
+ * G-buffer it is also divided by the first-hit albedo, so the filter only
+ * smooths lighting and texture survives remodulation; `variance`, if given,
+ * is rescaled by the squared albedo luminance to match.
+ */
+template <typename T>
+__global__ void prepareFilterInput(glm::ivec2 resolution, const float4* colorIn, float colorScale,
+        const GBufferPixel* gBuffer, float* variance, T* colorOut) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        int index = x + (y * resolution.x);
+        glm::vec3 color = loadColor(colorIn, index) * colorScale;
+        if (gBuffer != NULL) {
+            glm::vec3 albedo = gbufferDemodulationAlbedo(gBuffer[index]);
+            color /= albedo;
+            if (variance != NULL) {
+                float luminance = glm::dot(albedo, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+                variance[index] /= luminance * luminance;
+            }
+        }
+        storeColor(colorOut, index, color);
+    }
+}
+
+// Multiplies the filtered lighting back by the first-hit albedo, in place
+template <typename T>
+__global__ void remodulateAlbedo(glm::ivec2 resolution, const GBufferPixel* gBuffer, T* color) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        int index = x + (y * resolution.x);
+        storeColor(color, index, loadColor(color, index) * gbufferDemodulationAlbedo(gBuffer[index]));
+    }
+}
+
+// Normalizes (and widens, for Half4) a colour buffer into FP32
+template <typename T>
+__global__ void unpackColors(glm::ivec2 resolution, const T* colorIn, float colorScale, float4* colorOut) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        int index = x + (y * resolution.x);
+        storeColor(colorOut, index, loadColor(colorIn, index) * colorScale);
+    }
+}
+
+// Planes of the guided filter's window features: the guide g, its products
+// g_i g_j (00, 01, 02, 11, 12, 22), the colour p and the products g_i p_c at
+// GUIDED_GP + 3c + i. Its coefficients reuse the first GUIDED_COEFFICIENTS:
+// a_c at 3c + i, then b.
+#define GUIDED_GG 3
+#define GUIDED_P 9
+#define GUIDED_GP 12
+#define GUIDED_FEATURES 21
+#define GUIDED_B 9
+#define GUIDED_COEFFICIENTS 12
+
+static glm::ivec2 guidedResolution(glm::ivec2 resolution) {
+    return (resolution + DENOISER_GUIDED_SUBSAMPLE - 1) / DENOISER_GUIDED_SUBSAMPLE;
+}
+
+/**
+ * The guided filter's guide at a pixel: its octahedral normal, straight
+ * from the G-buffer, and its hit distance, both scaled into standard
+ * deviations of the edge-stopping weights. Zero for a miss.
+ */
+__device__ inline glm::vec3 guidedGuide(const GBufferPixel &g, float normalScale, float depthScale) {
+    if (g.t <= 0.0f) {
+        return glm::vec3(0.0f);
+    }
+    return glm::vec3(dequantizeUnorm16(g.normal[0]) * normalScale,
+            dequantizeUnorm16(g.normal[1]) * normalScale, g.t * depthScale);
+}
+
+/**
+ * Averages the guided filter's window features over each
+ * DENOISER_GUIDED_SUBSAMPLE square of pixels into the low-resolution
+ * planes.
+ */
+template <typename T>
+__global__ void guidedFeatures(glm::ivec2 resolution, glm::ivec2 lowResolution,
+        float normalScale, float depthScale, const GBufferPixel* gBuffer,
+        const T* colorIn, float colorScale, float* features) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < lowResolution.x && y < lowResolution.y) {
+        float f[GUIDED_FEATURES];
+#pragma unroll
+        for (int k = 0; k < GUIDED_FEATURES; k++) {
+            f[k] = 0.0f;
+        }
+        int count = 0;
+        for (int dy = 0; dy < DENOISER_GUIDED_SUBSAMPLE; dy++) {
+            for (int dx = 0; dx < DENOISER_GUIDED_SUBSAMPLE; dx++) {
+                int qx = x * DENOISER_GUIDED_SUBSAMPLE + dx;
+                int qy = y * DENOISER_GUIDED_SUBSAMPLE + dy;
+                if (qx >= resolution.x || qy >= resolution.y) {
+                    continue;
+                }
+                int q = qx + (qy * resolution.x);
+                glm::vec3 g = guidedGuide(gBuffer[q], normalScale, depthScale);
+                glm::vec3 p = loadColor(colorIn, q) * colorScale;
+                f[0] += g.x;
+                f[1] += g.y;
+                f[2] += g.z;
+                f[GUIDED_GG] += g.x * g.x;
+                f[GUIDED_GG + 1] += g.x * g.y;
+                f[GUIDED_GG + 2] += g.x * g.z;
+                f[GUIDED_GG + 3] += g.y * g.y;
+                f[GUIDED_GG + 4] += g.y * g.z;
+                f[GUIDED_GG + 5] += g.z * g.z;
+#pragma unroll
+                for (int c = 0; c < 3; c++) {
+                    f[GUIDED_P + c] += p[c];
+#pragma unroll
+                    for (int i = 0; i < 3; i++) {
+                        f[GUIDED_GP + 3 * c + i] += g[i] * p[c];
+                    }
+                }
+                count++;
+            }
+        }
+
+        const int stride = lowResolution.x * lowResolution.y;
+        const int index = x + (y * lowResolution.x);
+#pragma unroll
+        for (int k = 0; k < GUIDED_FEATURES; k++) {
+            features[k * stride + index] = f[k] / count;
+        }
+    }
+}
+
+/**
+ * Inclusive prefix sums along every row of `channels` stacked planes, one
+ * warp per row scanning it 32 pixels at a time. Sums never run longer than
+ * a row, which keeps them precise in FP32.
+ */
+__global__ void prefixRows(glm::ivec2 resolution, int channels, const float* in, float* prefix) {
+    const int warp = ((blockIdx.x * blockDim.x) + threadIdx.x) / 32;
+    const int lane = threadIdx.x & 31;
+    // Whole warps leave together, so the shuffles below always see all lanes
+    if (warp >= resolution.y * channels) {
+        return;
+    }
+    const size_t row = (size_t)warp * resolution.x;
+    float carry = 0.0f;
+    for (int x0 = 0; x0 < resolution.x; x0 += 32) {
+        int x = x0 + lane;
+        float v = x < resolution.x ? in[row + x] : 0.0f;
+        for (int offset = 1; offset < 32; offset *= 2) {
+            float n = __shfl_up_sync(0xffffffff, v, offset);
+            if (lane >= offset) {
+                v += n;
+            }
+        }
+        v += carry;
+        if (x < resolution.x) {
+            prefix[row + x] = v;
+        }
+        carry = __shfl_sync(0xffffffff, v, 31);
+    }
+}
+
+// Sum of a row over columns (left, right], from its prefix sums
+__device__ inline float windowRowSum(const float* row, int left, int right) {
+    return row[right] - (left >= 0 ? row[left] : 0.0f);
+}
+
+/**
+ * Box means over (2 radius + 1)^2 windows clipped to the image, from the
+ * rows' prefix sums: one thread per column of a plane runs down it adding
+ * the row entering the window and dropping the one leaving, so the cost is
+ * the same at any radius.
+ */
+__global__ void boxColumns(glm::ivec2 resolution, int channels, int radius, const float* prefix, float* out) {
+    const int column = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (column >= resolution.x * channels) {
+        return;
+    }
+    const int x = column % resolution.x;
+    const size_t plane = (size_t)(column / resolution.x) * resolution.x * resolution.y;
+    const float* rows = prefix + plane;
+    const int left = x - radius - 1;
+    const int right = glm::min(x + radius, resolution.x - 1);
+    const float columns = (float)(right - glm::max(x - radius, 0) + 1);
+
+    float sum = 0.0f;
+    for (int y = 0; y < glm::min(radius, resolution.y); y++) {
+        sum += windowRowSum(rows + (size_t)y * resolution.x, left, right);
+    }
+    for (int y = 0; y < resolution.y; y++) {
+        if (y + radius < resolution.y) {
+            sum += windowRowSum(rows + (size_t)(y + radius) * resolution.x, left, right);
+        }
+        if (y - radius - 1 >= 0) {
+            sum -= windowRowSum(rows + (size_t)(y - radius - 1) * resolution.x, left, right);
+        }
+        const int windowRows = glm::min(y + radius, resolution.y - 1) - glm::max(y - radius, 0) + 1;
+        out[plane + (size_t)y * resolution.x + x] = sum / (columns * windowRows);
+    }
+}
+
+/**
+ * Each window's linear model of the colour in the guide: per channel,
+ * a_c = (cov(g) + epsilon I)^-1 cov(g, p_c) and b_c = mean(p_c) - a_c . mean(g).
+ */
+__global__ void guidedCoefficients(int pixelcount, float epsilon, const float* means, float* coefficients) {
+    const int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+    if (index < pixelcount) {
+        float m[GUIDED_FEATURES];
+#pragma unroll
+        for (int k = 0; k < GUIDED_FEATURES; k++) {
+            m[k] = means[k * pixelcount + index];
+        }
+        const glm::vec3 g(m[0], m[1], m[2]);
+        const float s01 = m[GUIDED_GG + 1] - g.x * g.y;
+        const float s02 = m[GUIDED_GG + 2] - g.x * g.z;
+        const float s12 = m[GUIDED_GG + 4] - g.y * g.z;
+        const glm::mat3 sigma(
+                m[GUIDED_GG] - g.x * g.x + epsilon, s01, s02,
+                s01, m[GUIDED_GG + 3] - g.y * g.y + epsilon, s12,
+                s02, s12, m[GUIDED_GG + 5] - g.z * g.z + epsilon);
+        const glm::mat3 inverse = glm::inverse(sigma);
+#pragma unroll
+        for (int c = 0; c < 3; c++) {
+            const float p = m[GUIDED_P + c];
+            const glm::vec3 cov(m[GUIDED_GP + 3 * c] - g.x * p, m[GUIDED_GP + 3 * c + 1] - g.y * p,
+                    m[GUIDED_GP + 3 * c + 2] - g.z * p);
+            const glm::vec3 a = inverse * cov;
+#pragma unroll
+            for (int i = 0; i < 3; i++) {
+                coefficients[(3 * c + i) * pixelcount + index] = a[i];
+            }
+            coefficients[(GUIDED_B + c) * pixelcount + index] = p - glm::dot(a, g);
+        }
+    }
+}
+
+/**
+ * The guided filter's output at full resolution: the window-averaged
+ * coefficients, bilinearly upsampled, applied to the pixel's own guide.
+ */
+__global__ void guidedApply(glm::ivec2 resolution, glm::ivec2 lowResolution,
+        float normalScale, float depthScale, const GBufferPixel* gBuffer,
+        const float* coefficients, float4* colorOut) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        float u = glm::clamp((x + 0.5f) / DENOISER_GUIDED_SUBSAMPLE - 0.5f, 0.0f, lowResolution.x - 1.0f);
+        float v = glm::clamp((y + 0.5f) / DENOISER_GUIDED_SUBSAMPLE - 0.5f, 0.0f, lowResolution.y - 1.0f);
+        int x0 = (int)u;
+        int y0 = (int)v;
+        int x1 = glm::min(x0 + 1, lowResolution.x - 1);
+        int y1 = glm::min(y0 + 1, lowResolution.y - 1);
+        float fx = u - x0;
+        float fy = v - y0;
+        const int stride = lowResolution.x * lowResolution.y;
+        const int i00 = x0 + y0 * lowResolution.x;
+        const int i10 = x1 + y0 * lowResolution.x;
+        const int i01 = x0 + y1 * lowResolution.x;
+        const int i11 = x1 + y1 * lowResolution.x;
+
+        float k[GUIDED_COEFFICIENTS];
+#pragma unroll
+        for (int j = 0; j < GUIDED_COEFFICIENTS; j++) {
+            const float* plane = coefficients + j * stride;
+            k[j] = (plane[i00] * (1.0f - fx) + plane[i10] * fx) * (1.0f - fy)
+                + (plane[i01] * (1.0f - fx) + plane[i11] * fx) * fy;
+        }
+
+        int index = x + (y * resolution.x);
+        const glm::vec3 g = guidedGuide(gBuffer[index], normalScale, depthScale);
+        glm::vec3 color;
+#pragma unroll
+        for (int c = 0; c < 3; c++) {
+            color[c] = k[3 * c] * g.x + k[3 * c + 1] * g.y + k[3 * c + 2] * g.z + k[GUIDED_B + c];
+        }
+        storeColor(colorOut, index, glm::max(color, glm::vec3(0.0f)));
+    }
+}
+
+// Box means of `channels` planes of `resolution` in ctx's guided planes, see boxColumns
+static void boxFilterPlanes(const DenoiserContext &ctx, glm::ivec2 resolution, int channels, int radius,
+        const float *in, float *out) {
+    const int blockSize1d = 128;
+    const int rowThreads = resolution.y * channels * 32;
+    prefixRows<<<(rowThreads + blockSize1d - 1) / blockSize1d, blockSize1d, 0, ctx.stream>>>(resolution,
+            channels, in, ctx.guidedPrefix);
+    const int columns = resolution.x * channels;
+    boxColumns<<<(columns + blockSize1d - 1) / blockSize1d, blockSize1d, 0, ctx.stream>>>(resolution,
+            channels, radius, ctx.guidedPrefix, out);
+}
+
+/**
+ * DENOISER_GUIDED, see DenoiserMethod: window features at low resolution,
+ * their box means, the linear models they give, those models' box means,
+ * and the models applied to every full-resolution pixel's guide. The box
+ * radius covers half of filterSize.
+ */
+static void runGuidedFilter(const DenoiserContext &ctx, const DenoiserSettings &options,
+        const float4 *input, float inputScale, float4 *colorOut) {
+    const glm::ivec2 resolution = ctx.resolution;
+    const glm::ivec2 low = guidedResolution(resolution);
+    const float normalScale = options.normalWeight > 0.0f ? 1.0f / options.normalWeight : 0.0f;
+    const float depthScale = options.positionWeight > 0.0f ? 1.0f / options.positionWeight : 0.0f;
+    const float epsilon = glm::max(options.colorWeight * options.colorWeight, EPSILON);
+    const int radius = glm::max((options.filterSize / 2 + DENOISER_GUIDED_SUBSAMPLE / 2)
+        / DENOISER_GUIDED_SUBSAMPLE, 1);
+    const dim3 blockSize2d(8, 8);
+    const dim3 lowBlocks(
+            (low.x + blockSize2d.x - 1) / blockSize2d.x,
+            (low.y + blockSize2d.y - 1) / blockSize2d.y);
+    const dim3 blocksPerGrid2d(
+            (resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    const int blockSize1d = 128;
+
+    guidedFeatures<<<lowBlocks, blockSize2d, 0, ctx.stream>>>(resolution, low, normalScale, depthScale,
+            ctx.gBuffer, input, inputScale, ctx.guidedFeatures);
+    boxFilterPlanes(ctx, low, GUIDED_FEATURES, radius, ctx.guidedFeatures, ctx.guidedMeans);
+    guidedCoefficients<<<(low.x * low.y + blockSize1d - 1) / blockSize1d, blockSize1d, 0, ctx.stream>>>(
+            low.x * low.y, epsilon, ctx.guidedMeans, ctx.guidedFeatures);
+    boxFilterPlanes(ctx, low, GUIDED_COEFFICIENTS, radius, ctx.guidedFeatures, ctx.guidedMeans);
+    guidedApply<<<blocksPerGrid2d, blockSize2d, 0, ctx.stream>>>(resolution, low, normalScale, depthScale,
+            ctx.gBuffer, ctx.guidedMeans, colorOut);
+}
+
+// Cells of a bilateral grid over `resolution` with `cell` pixel cells
+static glm::ivec3 gridDims(glm::ivec2 resolution, int cell) {
+    return glm::ivec3((resolution.x + cell - 1) / cell, (resolution.y + cell - 1) / cell, DENOISER_GRID_BINS);
+}
+
+/**
+ * The nearest and farthest hit distance of the image into range[0] and
+ * range[1], as float bits, which order like the floats for positive
+ * distances: one atomic pair per warp.
+ */
+__global__ void gridDepthRange(int pixelcount, const GBufferPixel* gBuffer, unsigned int* range) {
+    const int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    float t = index < pixelcount ? gBuffer[index].t : -1.0f;
+    float nearest = t > 0.0f ? t : FLT_MAX;
+    float farthest = t > 0.0f ? t : 0.0f;
+    for (int offset = 16; offset > 0; offset /= 2) {
+        nearest = fminf(nearest, __shfl_down_sync(0xffffffff, nearest, offset));
+        farthest = fmaxf(farthest, __shfl_down_sync(0xffffffff, farthest, offset));
+    }
+    if ((threadIdx.x & 31) == 0) {
+        atomicMin(&range[0], __float_as_uint(nearest));
+        atomicMax(&range[1], __float_as_uint(farthest));
+    }
+}
+
+/**
+ * A pixel's position along the grid's range axis: its log hit distance
+ * over the image's range, across all bins but the last, which misses take.
+ */
+__device__ inline float gridBin(float t, const unsigned int* range) {
+    if (t <= 0.0f) {
+        return DENOISER_GRID_BINS - 1.0f;
+    }
+    const float lo = __logf(__uint_as_float(range[0]));
+    const float hi = __logf(__uint_as_float(range[1]));
+    const float z = hi > lo ? (__logf(t) - lo) / (hi - lo) : 0.0f;
+    return glm::clamp(z, 0.0f, 1.0f) * (DENOISER_GRID_BINS - 2);
+}
+
+// Adds each pixel's colour and a count of one to its nearest grid cell
+__global__ void gridSplat(glm::ivec2 resolution, int cell, glm::ivec3 dims, const GBufferPixel* gBuffer,
+        const float4* colorIn, float colorScale, const unsigned int* range, float4* grid) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        int index = x + (y * resolution.x);
+        glm::vec3 color = loadColor(colorIn, index) * colorScale;
+        int z = (int)(gridBin(gBuffer[index].t, range) + 0.5f);
+        float4 *c = &grid[(x / cell) + dims.x * ((y / cell) + dims.y * z)];
+        atomicAdd(&c->x, color.x);
+        atomicAdd(&c->y, color.y);
+        atomicAdd(&c->z, color.z);
+        atomicAdd(&c->w, 1.0f);
+    }
+}
+
+// One [1 2 1] / 4 pass of the grid blur along `axis`; cells past the edges are empty
+__global__ void gridBlur(glm::ivec3 dims, glm::ivec3 axis, const float4* in, float4* out) {
+    const int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+    if (index < dims.x * dims.y * dims.z) {
+        const glm::ivec3 p(index % dims.x, (index / dims.x) % dims.y, index / (dims.x * dims.y));
+        const int step = axis.x + dims.x * (axis.y + dims.y * axis.z);
+        float4 sum = in[index];
+        sum = make_float4(2.0f * sum.x, 2.0f * sum.y, 2.0f * sum.z, 2.0f * sum.w);
+        const glm::ivec3 before = p - axis;
+        const glm::ivec3 after = p + axis;
+        if (before.x >= 0 && before.y >= 0 && before.z >= 0) {
+            float4 q = in[index - step];
+            sum = make_float4(sum.x + q.x, sum.y + q.y, sum.z + q.z, sum.w + q.w);
+        }
+        if (after.x < dims.x && after.y < dims.y && after.z < dims.z) {
+            float4 q = in[index + step];
+            sum = make_float4(sum.x + q.x, sum.y + q.y, sum.z + q.z, sum.w + q.w);
+        }
+        out[index] = make_float4(0.25f * sum.x, 0.25f * sum.y, 0.25f * sum.z, 0.25f * sum.w);
+    }
+}
+
+/**
+ * Reads each pixel back out of the blurred grid, trilinearly at its own
+ * position and bin, as the mean colour there. Pixels whose neighbourhood
+ * holds no weight keep their input.
+ */
+__global__ void gridSlice(glm::ivec2 resolution, int cell, glm::ivec3 dims, const GBufferPixel* gBuffer,
+        const unsigned int* range, const float4* grid, const float4* colorIn, float colorScale,
+        float4* colorOut) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        int index = x + (y * resolution.x);
+        const glm::vec3 p(
+                glm::clamp((x + 0.5f) / cell - 0.5f, 0.0f, dims.x - 1.0f),
+                glm::clamp((y + 0.5f) / cell - 0.5f, 0.0f, dims.y - 1.0f),
+                gridBin(gBuffer[index].t, range));
+        const glm::ivec3 p0(p);
+        const glm::vec3 f = p - glm::vec3(p0);
+
+        glm::vec3 sum(0.0f);
+        float weight = 0.0f;
+        for (int corner = 0; corner < 8; corner++) {
+            const glm::ivec3 d(corner & 1, (corner >> 1) & 1, corner >> 2);
+            const glm::ivec3 q = glm::min(p0 + d, dims - 1);
+            const float w = (d.x ? f.x : 1.0f - f.x) * (d.y ? f.y : 1.0f - f.y) * (d.z ? f.z : 1.0f - f.z);
+            const float4 c = grid[q.x + dims.x * (q.y + dims.y * q.z)];
+            sum += w * glm::vec3(c.x, c.y, c.z);
+            weight += w * c.w;
+        }
+        storeColor(colorOut, index, weight > EPSILON ? sum / weight : loadColor(colorIn, index) * colorScale);
+    }
+}
+
+/**
+ * DENOISER_BILATERAL_GRID, see DenoiserMethod: splat, one [1 2 1] pass
+ * along each grid axis, and slice. Cells of filterSize / 4 pixels make the
+ * blurred footprint about filterSize across.
+ */
+static void runBilateralGrid(const DenoiserContext &ctx, const DenoiserSettings &options,
+        const float4 *input, float inputScale, float4 *colorOut) {
+    const glm::ivec2 resolution = ctx.resolution;
+    const int cell = glm::max(options.filterSize / 4, DENOISER_GRID_MIN_CELL);
+    const glm::ivec3 dims = gridDims(resolution, cell);
+    const int cells = dims.x * dims.y * dims.z;
+    const int pixelcount = resolution.x * resolution.y;
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    const int blockSize1d = 128;
+    const dim3 cellBlocks((cells + blockSize1d - 1) / blockSize1d);
+
+    // FLT_MAX-sized bits for the nearest hit, zero for the farthest
+    cudaMemsetAsync(ctx.gridRange, 0x7f, sizeof(unsigned int), ctx.stream);
+    cudaMemsetAsync(ctx.gridRange + 1, 0, sizeof(unsigned int), ctx.stream);
+    cudaMemsetAsync(ctx.grid, 0, cells * sizeof(float4), ctx.stream);
+    gridDepthRange<<<(pixelcount + blockSize1d - 1) / blockSize1d, blockSize1d, 0, ctx.stream>>>(pixelcount,
+            ctx.gBuffer, ctx.gridRange);
+    gridSplat<<<blocksPerGrid2d, blockSize2d, 0, ctx.stream>>>(resolution, cell, dims, ctx.gBuffer,
+            input, inputScale, ctx.gridRange, ctx.grid);
+    gridBlur<<<cellBlocks, blockSize1d, 0, ctx.stream>>>(dims, glm::ivec3(1, 0, 0), ctx.grid, ctx.gridTemp);
+    gridBlur<<<cellBlocks, blockSize1d, 0, ctx.stream>>>(dims, glm::ivec3(0, 1, 0), ctx.gridTemp, ctx.grid);
+    gridBlur<<<cellBlocks, blockSize1d, 0, ctx.stream>>>(dims, glm::ivec3(0, 0, 1), ctx.grid, ctx.gridTemp);
+    gridSlice<<<blocksPerGrid2d, blockSize2d, 0, ctx.stream>>>(resolution, cell, dims, ctx.gBuffer,
+            ctx.gridRange, ctx.gridTemp, input, inputScale, colorOut);
+}
+
+// Rows of pixels a kpnInfer block runs, one per warp
+#define KPN_WARPS 4
+
+/**
+ * The network's inputs at pixel (x, y): log-compressed colour, albedo,
+ * normal, log hit distance and a hit flag, then the mean log colour over
+ * the 3x3 neighbourhood and the variance of its luminance, which tell
+ * noise from texture. The last feature pads the row to a GEMM tile.
+ */
+__device__ void kpnFeatures(glm::ivec2 resolution, const float4* color, float colorScale,
+        const GBufferPixel* gBuffer, int x, int y, float features[DENOISER_KPN_INPUTS]) {
+    const int index = x + (y * resolution.x);
+    const GBufferPixel g = gBuffer[index];
+    const glm::vec3 c = glm::log(glm::max(loadColor(color, index) * colorScale, glm::vec3(0.0f)) + 1.0f);
+    const glm::vec3 albedo = gbufferAlbedo(g);
+    const glm::vec3 normal = gbufferNormal(g);
+
+    glm::vec3 mean(0.0f);
+    float luminance = 0.0f;
+    float luminance2 = 0.0f;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            int qx = glm::clamp(x + dx, 0, resolution.x - 1);
+            int qy = glm::clamp(y + dy, 0, resolution.y - 1);
+            glm::vec3 cq = glm::log(glm::max(loadColor(color, qx + (qy * resolution.x)) * colorScale,
+                glm::vec3(0.0f)) + 1.0f);
+            float l = glm::dot(cq, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+            mean += cq;
+            luminance += l;
+            luminance2 += l * l;
+        }
+    }
+    mean /= 9.0f;
+    luminance /= 9.0f;
+
+    for (int i = 0; i < 3; i++) {
+        features[i] = c[i];
+        features[3 + i] = albedo[i];
+        features[6 + i] = normal[i];
+        features[11 + i] = mean[i];
+    }
+    features[9] = g.t > 0.0f ? logf(1.0f + g.t) : 0.0f;
+    features[10] = g.t > 0.0f ? 1.0f : 0.0f;
+    features[14] = glm::max(luminance2 / 9.0f - luminance * luminance, 0.0f);
+    features[15] = 0.0f;
+}
+
+/**
+ * One 1x1 convolution of the network over a warp's 16 pixels: `act` holds
+ * their IN inputs row by row, and is overwritten with the OUT outputs,
+ * after the bias and, with `relu`, the activation; `acc` is the warp's
+ * FP32 staging. On sm_70 and newer the product runs as 16x16x16 FP16 WMMA
+ * tiles with FP32 accumulation, elsewhere as plain FMAs.
+ */
+template <int IN, int OUT>
+__device__ void kpnLayer(__half* act, const __half* weights, const float* biases, float* acc,
+        bool relu, int lane) {
+#if __CUDA_ARCH__ >= 700
+    using namespace nvcuda;
+    for (int n = 0; n < OUT; n += 16) {
+        wmma::fragment<wmma::accumulator, 16, 16, 16, float> c;
+        wmma::fill_fragment(c, 0.0f);
+#pragma unroll
+        for (int k = 0; k < IN; k += 16) {
+            wmma::fragment<wmma::matrix_a, 16, 16, 16, __half, wmma::row_major> a;
+            wmma::fragment<wmma::matrix_b, 16, 16, 16, __half, wmma::row_major> b;
+            wmma::load_matrix_sync(a, act + k, IN);
+            wmma::load_matrix_sync(b, weights + k * OUT + n, OUT);
+            wmma::mma_sync(c, a, b, c);
+        }
+        wmma::store_matrix_sync(acc + n, c, OUT, wmma::mem_row_major);
+    }
+#else
+    for (int i = lane; i < 16 * OUT; i += 32) {
+        const int row = i / OUT;
+        const int n = i % OUT;
+        float sum = 0.0f;
+        for (int k = 0; k < IN; k++) {
+            sum += __half2float(act[row * IN + k]) * __half2float(weights[k * OUT + n]);
+        }
+        acc[i] = sum;
+    }
+#endif
+    __syncwarp();
+    for (int i = lane; i < 16 * OUT; i += 32) {
+        float v = acc[i] + biases[i % OUT];
+        v = relu ? glm::max(v, 0.0f) : v;
+        acc[i] = v;
+        act[i] = __float2half(v);
+    }
+    __syncwarp();
+}
+
+/**
+ * Runs the network for 16 x KPN_WARPS pixels per block, each warp a row of
+ * 16, and writes each pixel's softmaxed kernel of DENOISER_KPN_TAPS
+ * weights. Warps past the image's edge compute clamped pixels, since the
+ * WMMA calls need every lane, but store nothing.
+ */
+__global__ void kpnInfer(glm::ivec2 resolution, const float4* color, float colorScale,
+        const GBufferPixel* gBuffer, const __half* weights, const float* biases, __half* kernels) {
+    __shared__ __align__(32) __half s_act[KPN_WARPS][16 * DENOISER_KPN_HIDDEN];
+    __shared__ __align__(32) float s_acc[KPN_WARPS][16 * DENOISER_KPN_OUTPUTS];
+
+    const int lane = threadIdx.x;
+    const int row = lane % 16;
+    const int x = blockIdx.x * 16 + row;
+    const int y = blockIdx.y * KPN_WARPS + threadIdx.y;
+    __half* act = s_act[threadIdx.y];
+    float* acc = s_acc[threadIdx.y];
+
+    if (lane < 16) {
+        float features[DENOISER_KPN_INPUTS];
+        kpnFeatures(resolution, color, colorScale, gBuffer,
+                glm::min(x, resolution.x - 1), glm::min(y, resolution.y - 1), features);
+        for (int i = 0; i < DENOISER_KPN_INPUTS; i++) {
+            act[row * DENOISER_KPN_INPUTS + i] = __float2half(features[i]);
+        }
+    }
+    __syncwarp();
+
+    kpnLayer<DENOISER_KPN_INPUTS, DENOISER_KPN_HIDDEN>(act, weights, biases, acc, true, lane);
+    weights += DENOISER_KPN_INPUTS * DENOISER_KPN_HIDDEN;
+    biases += DENOISER_KPN_HIDDEN;
+    kpnLayer<DENOISER_KPN_HIDDEN, DENOISER_KPN_HIDDEN>(act, weights, biases, acc, true, lane);
+    weights += DENOISER_KPN_HIDDEN * DENOISER_KPN_HIDDEN;
+    biases += DENOISER_KPN_HIDDEN;
+    kpnLayer<DENOISER_KPN_HIDDEN, DENOISER_KPN_OUTPUTS>(act, weights, biases, acc, false, lane);
+
+    if (lane < 16 && x < resolution.x && y < resolution.y) {
+        const float* logits = acc + row * DENOISER_KPN_OUTPUTS;
+        float largest = logits[0];
+        for (int t = 1; t < DENOISER_KPN_TAPS; t++) {
+            largest = glm::max(largest, logits[t]);
+        }
+        float total = 0.0f;
+        for (int t = 0; t < DENOISER_KPN_TAPS; t++) {
+            total += expf(logits[t] - largest);
+        }
+        __half* kernel = kernels + (x + (y * resolution.x)) * DENOISER_KPN_TAPS;
+        for (int t = 0; t < DENOISER_KPN_TAPS; t++) {
+            kernel[t] = __float2half(expf(logits[t] - largest) / total);
+        }
+    }
+}
+
+/**
+ * One A-Trous-style level with the network's kernels: the 5x5 taps
+ * dilated by stepWidth, weighted by the pixel's predicted weights instead
+ * of the wavelet's taps and edge-stopping functions.
+ */
+__global__ void kpnApply(glm::ivec2 resolution, int stepWidth, const __half* kernels,
+        const float4* colorIn, float colorScale, float4* colorOut) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        int index = x + (y * resolution.x);
+        const __half* kernel = kernels + index * DENOISER_KPN_TAPS;
+        glm::vec3 sum(0.0f);
+        float cumWeight = 0.0f;
+#pragma unroll
+        for (int dy = -2; dy <= 2; dy++) {
+#pragma unroll
+            for (int dx = -2; dx <= 2; dx++) {
+                int qx = glm::clamp(x + dx * stepWidth, 0, resolution.x - 1);
+                int qy = glm::clamp(y + dy * stepWidth, 0, resolution.y - 1);
+                float weight = __half2float(kernel[(dy + 2) * 5 + dx + 2]);
+                sum += loadColor(colorIn, qx + (qy * resolution.x)) * weight;
+                cumWeight += weight;
+            }
+        }
+        storeColor(colorOut, index, cumWeight > 0.0f ? sum * (colorScale / cumWeight)
+            : loadColor(colorIn, index) * colorScale);
+    }
+}
+
+/**
+ * DENOISER_KERNEL_PREDICTING, see DenoiserMethod: predicts every pixel's
+ * kernel once, then applies it over denoiserLevels(filterSize) levels at
+ * doubling step widths, ping-ponging through colorTemp so the last level
+ * lands in colorOut.
+ */
+static void runKernelPredicting(const DenoiserContext &ctx, const DenoiserSettings &options,
+        const float4 *input, float inputScale, float4 *colorOut) {
+    const glm::ivec2 resolution = ctx.resolution;
+    const dim3 inferBlock(32, KPN_WARPS);
+    const dim3 inferBlocks((resolution.x + 15) / 16, (resolution.y + KPN_WARPS - 1) / KPN_WARPS);
+    kpnInfer<<<inferBlocks, inferBlock, 0, ctx.stream>>>(resolution, input, inputScale, ctx.gBuffer,
+            ctx.kpnWeights, ctx.kpnBiases, ctx.kpnKernels);
+
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    const int levels = denoiserLevels(options.filterSize);
+    if (levels == 0) {
+        unpackColors<<<blocksPerGrid2d, blockSize2d, 0, ctx.stream>>>(resolution, input, inputScale, colorOut);
+        return;
+    }
+    const float4 *levelIn = input;
+    float levelScale = inputScale;
+    for (int level = 0, stepWidth = 1; level < levels; level++, stepWidth *= 2) {
+        float4 *levelOut = (levels - 1 - level) % 2 == 0 ? colorOut : ctx.colorTemp;
+        kpnApply<<<blocksPerGrid2d, blockSize2d, 0, ctx.stream>>>(resolution, stepWidth, ctx.kpnKernels,
+                levelIn, levelScale, levelOut);
+        levelIn = levelOut;
+        levelScale = 1.0f;
+    }
+}
+
+// The next `count` elements of scratch, or NULL while only sizing it
+template <typename T>
+static T * carveScratch(char *scratch, size_t &offset, size_t count) {
+    T *p = scratch != NULL ? reinterpret_cast<T *>(scratch + offset) : NULL;
+    offset += (count * sizeof(T) + SCRATCH_ALIGNMENT - 1) / SCRATCH_ALIGNMENT * SCRATCH_ALIGNMENT;
+    return p;
+}
+
+// Points the context's buffers into `scratch`; returns the bytes they span
+static size_t layoutScratch(DenoiserContext &ctx, char *scratch) {
+    const size_t pixelcount = (size_t)ctx.resolution.x * ctx.resolution.y;
+    Camera cam;
+    cam.resolution = ctx.resolution;
+    cam.pixelLength = glm::vec2(1.0f);
+    const glm::ivec2 coarse = pyramidCamera(cam).resolution;
+    const size_t coarsePixelcount = (size_t)coarse.x * coarse.y;
+
+    size_t offset = 0;
+    ctx.colorIn = carveScratch<float4>(scratch, offset, pixelcount);
+    ctx.colorOut = carveScratch<float4>(scratch, offset, pixelcount);
+    ctx.colorTemp = carveScratch<float4>(scratch, offset, pixelcount);
+    // A call runs one method, so the other methods' buffers overlay the
+    // A-Trous ones from here on
+    const size_t methodOffset = offset;
+    ctx.halfIn = carveScratch<Half4>(scratch, offset, pixelcount);
+    ctx.halfOut = carveScratch<Half4>(scratch, offset, pixelcount);
+    ctx.halfTemp = carveScratch<Half4>(scratch, offset, pixelcount);
+    ctx.varianceIn = carveScratch<float>(scratch, offset, pixelcount);
+    ctx.varianceOut = carveScratch<float>(scratch, offset, pixelcount);
+    ctx.varianceTemp = carveScratch<float>(scratch, offset, pixelcount);
+    ctx.pyramidColor = carveScratch<glm::vec3>(scratch, offset, coarsePixelcount);
+    ctx.pyramidIn = carveScratch<glm::vec3>(scratch, offset, coarsePixelcount);
+    ctx.pyramidOut = carveScratch<glm::vec3>(scratch, offset, coarsePixelcount);
+    ctx.pyramidTemp = carveScratch<glm::vec3>(scratch, offset, coarsePixelcount);
+    ctx.pyramidGBuffer = carveScratch<GBufferPixel>(scratch, offset, coarsePixelcount);
+    ctx.pyramidVarianceIn = carveScratch<float>(scratch, offset, coarsePixelcount);
+    ctx.pyramidVarianceOut = carveScratch<float>(scratch, offset, coarsePixelcount);
+    size_t end = offset;
+
+    const glm::ivec2 low = guidedResolution(ctx.resolution);
+    const size_t guidedCount = (size_t)low.x * low.y * GUIDED_FEATURES;
+    offset = methodOffset;
+    ctx.guidedFeatures = carveScratch<float>(scratch, offset, guidedCount);
+    ctx.guidedPrefix = carveScratch<float>(scratch, offset, guidedCount);
+    ctx.guidedMeans = carveScratch<float>(scratch, offset, guidedCount);
+    end = std::max(end, offset);
+
+    const glm::ivec3 dims = gridDims(ctx.resolution, DENOISER_GRID_MIN_CELL);
+    const size_t cells = (size_t)dims.x * dims.y * dims.z;
+    offset = methodOffset;
+    ctx.grid = carveScratch<float4>(scratch, offset, cells);
+    ctx.gridTemp = carveScratch<float4>(scratch, offset, cells);
+    ctx.gridRange = carveScratch<unsigned int>(scratch, offset, 2);
+    end = std::max(end, offset);
+
+    offset = end;
+    ctx.levelChange = carveScratch<float>(scratch, offset, 2);
+    const size_t tileCount = (size_t)((ctx.resolution.x + ATROUS_TILE_SIZE - 1) / ATROUS_TILE_SIZE)
+        * ((ctx.resolution.y + ATROUS_TILE_SIZE - 1) / ATROUS_TILE_SIZE);
+    ctx.tiles = carveScratch<int>(scratch, offset, tileCount);
+    ctx.tileCounts = carveScratch<int>(scratch, offset, 2);
+    return offset;
+}
+
+static Camera filterCamera(glm::ivec2 resolution, const DenoiserCamera &camera) {
+    Camera cam;
+    cam.resolution = resolution;
+    cam.position = glm::vec3(camera.position[0], camera.position[1], camera.position[2]);
+    cam.view = glm::vec3(camera.view[0], camera.view[1], camera.view[2]);
+    cam.up = glm::vec3(camera.up[0], camera.up[1], camera.up[2]);
+    cam.right = glm::vec3(camera.right[0], camera.right[1], camera.right[2]);
+    cam.pixelLength = glm::vec2(camera.pixelLength[0], camera.pixelLength[1]);
+    cam.lookAt = cam.position + cam.view;
+    cam.fov = glm::vec2(0.0f);
+    return cam;
+}
+
+DenoiserStatus denoiserScratchBytes(int width, int height, size_t *bytes) {
+    if (width <= 0 || height <= 0 || bytes == NULL) {
+        return DENOISER_INVALID_VALUE;
+    }
+    DenoiserContext ctx;
+    ctx.resolution = glm::ivec2(width, height);
+    *bytes = layoutScratch(ctx, NULL);
+    return DENOISER_SUCCESS;
+}
+
+DenoiserStatus denoiserCreate(int width, int height, void *scratch, size_t scratchBytes,
+        Denoiser *denoiser) {
+    size_t bytes = 0;
+    if (denoiser == NULL || denoiserScratchBytes(width, height, &bytes) != DENOISER_SUCCESS) {
+        return DENOISER_INVALID_VALUE;
+    }
+    if (scratch != NULL && (scratchBytes < bytes || (uintptr_t)scratch % SCRATCH_ALIGNMENT != 0)) {
+        return DENOISER_INVALID_VALUE;
+    }
+    DenoiserContext *ctx = new (std::nothrow) DenoiserContext();
+    if (ctx == NULL) {
+        return DENOISER_OUT_OF_MEMORY;
+    }
+    ctx->resolution = glm::ivec2(width, height);
+    ctx->ownsScratch = scratch == NULL;
+    if (ctx->ownsScratch && cudaMalloc(&scratch, bytes) != cudaSuccess) {
+        cudaGetLastError();
+        delete ctx;
+        return DENOISER_OUT_OF_MEMORY;
+    }
+    ctx->scratch = static_cast<char *>(scratch);
+    layoutScratch(*ctx, ctx->scratch);
+    ctx->clusters = false;
+#if CUDART_VERSION >= 12000
+    int device = 0, major = 0;
+    cudaGetDevice(&device);
+    cudaDeviceGetAttribute(&major, cudaDevAttrComputeCapabilityMajor, device);
+    ctx->clusters = major >= 9;
+#endif
+    *denoiser = ctx;
+    return DENOISER_SUCCESS;
+}
+
+/**
+ * Runs the A-Trous filter over the input colour, doubling the step width
+ * every level until the footprint covers filterSize pixels. The weights are
+ * the standard deviations of the colour, normal and position edge-stopping
+ * functions; the colour one is halved every level. In variance-guided mode
+ * colorWeight instead counts standard deviations of each pixel's own noise,
+ * estimated from its luminance moments. Pyramid mode runs all but the first
+ * levels at half resolution. With tileConvergence set, the levels skip the
+ * tiles whose pixels have converged and run over the compacted list of the
+ * rest. Stacked layers share every launch, the
+ * neighbourhood kernels taking one grid layer per image layer, seen from
+ * `camera` moved by its layerOffset or, for a batch, from `poses`. The
+ * other DenoiserMethods replace the levels, see runGuidedFilter,
+ * runBilateralGrid and runKernelPredicting.
+ */
+static DenoiserStatus filterLayers(Denoiser denoiser, const DenoiserSettings *settings,
+        const DenoiserCamera *camera, int layers, const LayerPose *poses, const DenoiserInputs *inputs,
+        float *output, DenoiserResult *result, cudaStream_t stream) {
+    const DenoiserSettings &options = *settings;
+    const bool atrous = options.method == DENOISER_ATROUS;
+    const bool needsGBuffer = options.normalWeight > 0.0f || options.positionWeight > 0.0f
+        || options.pyramid || options.demodulateAlbedo || !atrous;
+    const bool varianceGuided = options.varianceGuided && atrous;
+    if ((needsGBuffer && inputs->gBuffer == NULL)
+            || (varianceGuided && (inputs->moments == NULL || inputs->samples < 1))
+            || denoiser->resolution.y % layers != 0
+            || (!atrous && layers > 1)
+            || (options.method == DENOISER_KERNEL_PREDICTING && denoiser->kpnWeights == NULL)) {
+        return DENOISER_INVALID_VALUE;
+    }
+
+    DenoiserContext &ctx = *denoiser;
+    ctx.stream = stream;
+    ctx.gBuffer = static_cast<const GBufferPixel *>(inputs->gBuffer);
+    ctx.layers = layers;
+    ctx.layerCameras.offset = glm::vec3(camera->layerOffset[0], camera->layerOffset[1], camera->layerOffset[2]);
+    ctx.layerCameras.poses = poses;
+    // The camera of one layer; the per-pixel kernels take the whole stack
+    const Camera cam = filterCamera(glm::ivec2(ctx.resolution.x, ctx.resolution.y / layers), *camera);
+    const glm::ivec2 resolution = ctx.resolution;
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    const float4 *color = reinterpret_cast<const float4 *>(inputs->color);
+
+    if (varianceGuided) {
+        const dim3 blocksPerLayer(
+                (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+                (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y, layers);
+        estimateVariance<<<blocksPerLayer, blockSize2d, 0, stream>>>(cam.resolution, inputs->samples,
+                reinterpret_cast<const glm::vec2 *>(inputs->moments), inputs->sampleCounts, ctx.varianceIn);
+    }
+
+    // Converged tiles are left as they are, and the levels launched over
+    // the rest only; telling which needs the count of each on the host
+    ctx.activeTiles = NULL;
+    ctx.activeTileCount = 0;
+    ctx.convergedTileCount = 0;
+    if (atrous && options.tileConvergence > 0.0f && layers == 1 && !options.pyramid
+            && inputs->moments != NULL && inputs->samples >= 4) {
+        const dim3 tileBlockSize(ATROUS_TILE_SIZE, ATROUS_TILE_SIZE);
+        const dim3 tilesPerGrid(
+                (resolution.x + ATROUS_TILE_SIZE - 1) / ATROUS_TILE_SIZE,
+                (resolution.y + ATROUS_TILE_SIZE - 1) / ATROUS_TILE_SIZE);
+        cudaMemsetAsync(ctx.tileCounts, 0, 2 * sizeof(int), stream);
+        classifyTiles<<<tilesPerGrid, tileBlockSize, 0, stream>>>(resolution, inputs->samples,
+                reinterpret_cast<const glm::vec2 *>(inputs->moments), inputs->sampleCounts,
+                options.tileConvergence, tilesPerGrid.x * tilesPerGrid.y, ctx.tiles, ctx.tileCounts);
+        int counts[2] = { 0, 0 };
+        cudaMemcpyAsync(counts, ctx.tileCounts, sizeof(counts), cudaMemcpyDeviceToHost, stream);
+        cudaStreamSynchronize(stream);
+        if (counts[1] > 0) {
+            ctx.activeTiles = ctx.tiles;
+            ctx.activeTileCount = counts[0];
+            ctx.convergedTileCount = counts[1];
+        }
+    }
+
+    // Demodulation filters lighting rather than colour and restores the
+    // albedo afterwards, so textures are not blurred
+    const GBufferPixel *demodulationGBuffer = options.demodulateAlbedo ? ctx.gBuffer : NULL;
+    float *demodulationVariance = options.demodulateAlbedo && varianceGuided ? ctx.varianceIn : NULL;
+
+    DenoiserResult filtered;
+    if (!atrous) {
+        const float4 *input = color;
+        float inputScale = inputs->colorScale;
+        if (options.demodulateAlbedo) {
+            prepareFilterInput<<<blocksPerGrid2d, blockSize2d, 0, stream>>>(resolution, color,
+                    inputScale, demodulationGBuffer, (float *)NULL, ctx.colorIn);
+            input = ctx.colorIn;
+            inputScale = 1.0f;
+        }
+        if (options.method == DENOISER_GUIDED) {
+            runGuidedFilter(ctx, options, input, inputScale, ctx.colorOut);
+        } else if (options.method == DENOISER_KERNEL_PREDICTING) {
+            runKernelPredicting(ctx, options, input, inputScale, ctx.colorOut);
+        } else {
+            runBilateralGrid(ctx, options, input, inputScale, ctx.colorOut);
+        }
+        if (options.demodulateAlbedo) {
+            remodulateAlbedo<<<blocksPerGrid2d, blockSize2d, 0, stream>>>(resolution,
+                    ctx.gBuffer, ctx.colorOut);
+        }
+        filtered.color = ctx.colorOut;
+        filtered.halfPrecision = 0;
+        filtered.colorScale = 1.0f;
+        filtered.levels = 0;
+    } else if (options.halfPrecision) {
+        // Normalize and pack once, so every level moves 8-byte colours
+        Half4 *levelIn = ctx.halfIn;
+        Half4 *levelOut = ctx.halfOut;
+        prepareFilterInput<<<blocksPerGrid2d, blockSize2d, 0, stream>>>(resolution, color,
+                inputs->colorScale, demodulationGBuffer, demodulationVariance, levelIn);
+        const Half4 *half = runAtrousFilter(ctx, cam, options, (const Half4 *)levelIn, 1.0f,
+                levelIn, levelOut, ctx.halfTemp, filtered.levels);
+        if (options.demodulateAlbedo) {
+            // The result always ends up in levelIn after the swaps
+            remodulateAlbedo<<<blocksPerGrid2d, blockSize2d, 0, stream>>>(resolution,
+                    ctx.gBuffer, levelIn);
+        }
+        filtered.color = half;
+        filtered.halfPrecision = 1;
+        filtered.colorScale = 1.0f;
+    } else {
+        float4 *levelIn = ctx.colorIn;
+        float4 *levelOut = ctx.colorOut;
+        const float4 *input = color;
+        float inputScale = inputs->colorScale;
+        if (options.demodulateAlbedo) {
+            prepareFilterInput<<<blocksPerGrid2d, blockSize2d, 0, stream>>>(resolution, color,
+                    inputScale, demodulationGBuffer, demodulationVariance, levelIn);
+            input = levelIn;
+            inputScale = 1.0f;
+        }
+        const float4 *full = runAtrousFilter(ctx, cam, options, input, inputScale,
+                levelIn, levelOut, ctx.colorTemp, filtered.levels);
+        if (options.demodulateAlbedo) {
+            remodulateAlbedo<<<blocksPerGrid2d, blockSize2d, 0, stream>>>(resolution,
+                    ctx.gBuffer, levelIn);
+        }
+        filtered.color = full;
+        filtered.halfPrecision = 0;
+        filtered.colorScale = full == input ? inputScale : 1.0f;
+    }
+
+    if (output != NULL) {
+        float4 *out = reinterpret_cast<float4 *>(output);
+        if (filtered.halfPrecision) {
+            unpackColors<<<blocksPerGrid2d, blockSize2d, 0, stream>>>(resolution,
+                    static_cast<const Half4 *>(filtered.color), 1.0f, out);
+        } else if (filtered.color != out || filtered.colorScale != 1.0f) {
+            unpackColors<<<blocksPerGrid2d, blockSize2d, 0, stream>>>(resolution,
+                    static_cast<const float4 *>(filtered.color), filtered.colorScale, out);
+        }
+        filtered.color = out;
+        filtered.halfPrecision = 0;
+        filtered.colorScale = 1.0f;
+    }
+    filtered.filteredTiles = ctx.activeTiles != NULL
+        ? (float)ctx.activeTileCount / (ctx.activeTileCount + ctx.convergedTileCount) : 1.0f;
+    if (result != NULL) {
+        *result = filtered;
+    }
+    return cudaPeekAtLastError() == cudaSuccess ? DENOISER_SUCCESS : DENOISER_CUDA_ERROR;
+}
+
+DenoiserStatus denoiserFilter(Denoiser denoiser, const DenoiserSettings *settings,
+        const DenoiserCamera *camera, const DenoiserInputs *inputs, float *output,
+        DenoiserResult *result, cudaStream_t stream) {
+    if (denoiser == NULL || settings == NULL || camera == NULL || inputs == NULL || inputs->color == NULL) {
+        return DENOISER_INVALID_VALUE;
+    }
+    return filterLayers(denoiser, settings, camera, camera->layers > 1 ? camera->layers : 1, NULL, inputs,
+            output, result, stream);
+}
+
+/**
+ * The batch as layers of one stack, each with its pose relative to the
+ * first camera's. The poses are copied from pageable memory, so the host
+ * vector is free to go once the call returns.
+ */
+DenoiserStatus denoiserFilterBatch(Denoiser denoiser, const DenoiserSettings *settings,
+        const DenoiserCamera *cameras, int count, const DenoiserInputs *inputs, float *output,
+        DenoiserResult *result, cudaStream_t stream) {
+    if (denoiser == NULL || settings == NULL || cameras == NULL || count < 1 || inputs == NULL
+            || inputs->color == NULL || settings->method != DENOISER_ATROUS) {
+        return DENOISER_INVALID_VALUE;
+    }
+    DenoiserContext &ctx = *denoiser;
+    if (count > ctx.batchPoseCapacity) {
+        cudaFree(ctx.batchPoses);
+        ctx.batchPoses = NULL;
+        ctx.batchPoseCapacity = 0;
+        if (cudaMalloc(&ctx.batchPoses, count * sizeof(LayerPose)) != cudaSuccess) {
+            cudaGetLastError();
+            return DENOISER_OUT_OF_MEMORY;
+        }
+        ctx.batchPoseCapacity = count;
+    }
+    const glm::vec2 firstPixel(cameras[0].pixelLength[0], cameras[0].pixelLength[1]);
+    std::vector<LayerPose> poses(count);
+    for (int i = 0; i < count; i++) {
+        const Camera cam = filterCamera(glm::ivec2(1), cameras[i]);
+        poses[i].position = cam.position;
+        poses[i].view = cam.view;
+        poses[i].up = cam.up;
+        poses[i].right = cam.right;
+        poses[i].pixelScale = cam.pixelLength / firstPixel;
+    }
+    cudaMemcpyAsync(ctx.batchPoses, poses.data(), count * sizeof(LayerPose), cudaMemcpyHostToDevice, stream);
+    return filterLayers(denoiser, settings, &cameras[0], count, ctx.batchPoses, inputs, output, result, stream);
+}
+
+DenoiserStatus denoiserSetNetwork(Denoiser denoiser, const float *weights, size_t count) {
+    if (denoiser == NULL || (weights != NULL && count != DENOISER_KPN_WEIGHTS)) {
+        return DENOISER_INVALID_VALUE;
+    }
+    DenoiserContext &ctx = *denoiser;
+    if (weights == NULL) {
+        cudaFree(ctx.kpnWeights);
+        cudaFree(ctx.kpnBiases);
+        cudaFree(ctx.kpnKernels);
+        ctx.kpnWeights = NULL;
+        ctx.kpnBiases = NULL;
+        ctx.kpnKernels = NULL;
+        return DENOISER_SUCCESS;
+    }
+
+    // Split each layer's matrix from its biases, so every matrix starts on
+    // a WMMA tile boundary
+    const int inputs[3] = { DENOISER_KPN_INPUTS, DENOISER_KPN_HIDDEN, DENOISER_KPN_HIDDEN };
+    const int outputs[3] = { DENOISER_KPN_HIDDEN, DENOISER_KPN_HIDDEN, DENOISER_KPN_OUTPUTS };
+    std::vector<__half> matrices;
+    std::vector<float> biases;
+    for (int layer = 0; layer < 3; layer++) {
+        for (int i = 0; i < inputs[layer] * outputs[layer]; i++) {
+            matrices.push_back(__float2half(*weights++));
+        }
+        for (int i = 0; i < outputs[layer]; i++) {
+            biases.push_back(*weights++);
+        }
+    }
+
+    if (ctx.kpnWeights == NULL) {
+        const size_t pixels = (size_t)ctx.resolution.x * ctx.resolution.y;
+        if (cudaMalloc(&ctx.kpnWeights, matrices.size() * sizeof(__half)) != cudaSuccess
+                || cudaMalloc(&ctx.kpnBiases, biases.size() * sizeof(float)) != cudaSuccess
+                || cudaMalloc(&ctx.kpnKernels, pixels * DENOISER_KPN_TAPS * sizeof(__half)) != cudaSuccess) {
+            cudaGetLastError();
+            denoiserSetNetwork(denoiser, NULL, 0);
+            return DENOISER_OUT_OF_MEMORY;
+        }
+    }
+    cudaMemcpy(ctx.kpnWeights, matrices.data(), matrices.size() * sizeof(__half), cudaMemcpyHostToDevice);
+    cudaMemcpy(ctx.kpnBiases, biases.data(), biases.size() * sizeof(float), cudaMemcpyHostToDevice);
+    return DENOISER_SUCCESS;
+}
+
+void denoiserDestroy(Denoiser denoiser) {
+    if (denoiser == NULL) {
+        return;
+    }
+    denoiserSetNetwork(denoiser, NULL, 0);
+    cudaFree(denoiser->batchPoses);
+    if (denoiser->ownsScratch) {
+        cudaFree(denoiser->scratch);
+    }
+    delete denoiser;
+}
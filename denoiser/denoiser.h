@@ -0,0 +1,220 @@
+#pragma once
+
+#include <stddef.h>
+#include <cuda_runtime.h>
+
+/**
+ * Edge-avoiding A-Trous wavelet denoiser (Dammertz et al. 2010) with
+ * SVGF-style variance guidance (Schied et al. 2017), usable on any
+ * renderer's device buffers. A guided filter and a bilateral grid, whose
+ * cost per pixel does not grow with the footprint, can stand in for the
+ * wavelet levels (see DenoiserMethod). It reads the caller's colour, G-buffer and
+ * moments in place and leaves its result either in the caller's output
+ * buffer or, without one, in its scratch memory for the caller to read
+ * from there; nothing is copied in or out.
+ *
+ * Typical use:
+ *
+ *     size_t bytes;
+ *     denoiserScratchBytes(width, height, &bytes);
+ *     cudaMalloc(&scratch, bytes);            // or pass NULL to let it allocate
+ *     denoiserCreate(width, height, scratch, bytes, &denoiser);
+ *     denoiserFilter(denoiser, &settings, &camera, &inputs, output, NULL, stream);
+ *     denoiserDestroy(denoiser);
+ *
+ * All pointers in the structs below are device memory on the current device.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct DenoiserContext *Denoiser;
+
+typedef enum DenoiserStatus {
+    DENOISER_SUCCESS = 0,
+    DENOISER_INVALID_VALUE,     // a bad size, a missing buffer or too little scratch
+    DENOISER_OUT_OF_MEMORY,
+    DENOISER_CUDA_ERROR,        // a launch failed; the error is left for cudaGetLastError
+} DenoiserStatus;
+
+// Tap weights of the 5x5 kernel
+typedef enum DenoiserKernel {
+    DENOISER_B3_SPLINE = 0,
+    DENOISER_GAUSSIAN = 1,
+} DenoiserKernel;
+
+/**
+ * What filters the image. The A-Trous levels cost more with every doubling
+ * of the footprint; the other two cost the same at any filterSize, and
+ * read the same G-buffer:
+ *
+ * - DENOISER_GUIDED: the fast guided filter (He et al. 2010, 2015) at
+ *   1 / DENOISER_GUIDED_SUBSAMPLE resolution, its box filters running
+ *   through prefix sums. The guide is each pixel's octahedral normal in
+ *   normalWeights and hit distance in positionWeights, and colorWeight^2
+ *   is the regularization.
+ * - DENOISER_BILATERAL_GRID: colour splatted into a grid of filterSize / 4
+ *   pixel cells (at least DENOISER_GRID_MIN_CELL) by
+ *   DENOISER_GRID_BINS bins of log hit distance, blurred and sliced back
+ *   out (Chen et al. 2007). The weights do not apply.
+ *
+ * - DENOISER_KERNEL_PREDICTING: a small network set by
+ *   denoiserSetNetwork predicts a 5x5 kernel per pixel from its colour
+ *   and G-buffer, applied like the A-Trous taps over
+ *   denoiserLevels(filterSize) levels, with no edge-stopping weights.
+ *   Its cost grows with the footprint, but only by the gathers.
+ *
+ * All three filter a single layer only, and run neither variance-guided,
+ * separable, FP16, pyramid, early-out nor tile convergence;
+ * demodulateAlbedo applies to all.
+ */
+typedef enum DenoiserMethod {
+    DENOISER_ATROUS = 0,
+    DENOISER_GUIDED = 1,
+    DENOISER_BILATERAL_GRID = 2,
+    DENOISER_KERNEL_PREDICTING = 3,
+} DenoiserMethod;
+
+#define DENOISER_GUIDED_SUBSAMPLE 4
+#define DENOISER_GRID_MIN_CELL 8
+#define DENOISER_GRID_BINS 16
+
+/**
+ * DENOISER_KERNEL_PREDICTING's network: three 1x1 convolutions, each
+ * pixel's DENOISER_KPN_INPUTS features (log colour, albedo, normal, log hit
+ * distance, hit flag, and its 3x3 neighbourhood's mean log colour and
+ * luminance variance) through two hidden layers of DENOISER_KPN_HIDDEN
+ * ReLU units to DENOISER_KPN_OUTPUTS logits, of which the first
+ * DENOISER_KPN_TAPS are softmaxed into the 5x5 kernel, row by row. The
+ * layers run as FP16 Tensor Core GEMMs with FP32 accumulation on sm_70 and
+ * newer. Its weights are DENOISER_KPN_WEIGHTS floats: for each layer, the
+ * inputs x outputs matrix row by row, then the outputs' biases.
+ */
+#define DENOISER_KPN_INPUTS 16
+#define DENOISER_KPN_HIDDEN 32
+#define DENOISER_KPN_OUTPUTS 32
+#define DENOISER_KPN_TAPS 25
+#define DENOISER_KPN_WEIGHTS (DENOISER_KPN_INPUTS * DENOISER_KPN_HIDDEN + DENOISER_KPN_HIDDEN \
+    + DENOISER_KPN_HIDDEN * DENOISER_KPN_HIDDEN + DENOISER_KPN_HIDDEN \
+    + DENOISER_KPN_HIDDEN * DENOISER_KPN_OUTPUTS + DENOISER_KPN_OUTPUTS)
+
+typedef struct DenoiserSettings {
+    int filterSize;             // filter footprint in pixels
+    int kernel;                 // a DenoiserKernel
+    float colorWeight;          // edge-stopping standard deviations
+    float normalWeight;         // 0 disables the normal term
+    float positionWeight;       // 0 disables the position term
+    int varianceGuided;         // colorWeight counts per-pixel standard deviations
+    int separable;              // horizontal + vertical passes per level
+    int halfPrecision;          // FP16 storage for the filter's colour buffers
+    int pyramid;                // later levels at half resolution, upsampled
+    int demodulateAlbedo;       // filter lighting / albedo, remodulate after
+    float convergence;          // stop once a level changes luminance by less than this fraction; 0 runs all
+    int method;                 // a DenoiserMethod
+    float tileConvergence;      // leave 16x16 tiles unfiltered once their pixels' standard error is below this fraction of their luminance; 0 filters all
+} DenoiserSettings;
+
+/**
+ * The pinhole camera the G-buffer was rendered with. Positions are rebuilt
+ * from each pixel's hit distance along its camera ray, whose direction is
+ * normalize(view - right * pixelLength.x * (x - width / 2)
+ *                - up * pixelLength.y * (y - height / 2)).
+ *
+ * An image may stack `layers` views of height / layers rows each, such as
+ * a stereo pair, seen from cameras that differ only in position. The
+ * layers are filtered in the same launches but never across their seams,
+ * with x and y above relative to the layer.
+ */
+typedef struct DenoiserCamera {
+    float position[3];          // of layer 0
+    float view[3];
+    float up[3];
+    float right[3];
+    float pixelLength[2];
+    int layers;                 // views stacked top to bottom, dividing the height; 0 or 1 for one
+    float layerOffset[3];       // layer k's camera is at position + k * layerOffset
+} DenoiserCamera;
+
+typedef struct DenoiserInputs {
+    const float *color;         // RGBA per pixel; alpha is ignored
+    float colorScale;           // applied on load, e.g. 1 / samples for a running sum
+    const void *gBuffer;        // 16-byte GBufferPixel per pixel (src/gbuffer.h)
+    const float *moments;       // sums of luminance and its square per pixel; varianceGuided only
+    int samples;                // samples summed into `moments`
+    const float *sampleCounts;  // optional per-pixel counts that replace `samples` in the variance
+} DenoiserInputs;
+
+// Where the filtered colour of the last denoiserFilter call is
+typedef struct DenoiserResult {
+    const void *color;          // RGBA per pixel: float, or __half with halfPrecision
+    int halfPrecision;
+    float colorScale;           // to apply on read; not 1 only when no level ran
+    int levels;                 // wavelet levels run, fewer than denoiserLevels() after an early out; 0 for the other methods
+    float filteredTiles;        // fraction of the tiles the levels ran over, below 1 only with tileConvergence
+} DenoiserResult;
+
+/**
+ * Wavelet levels a filterSize footprint takes: L levels of the 5-tap
+ * kernel at step widths 1 to 2^(L-1) cover 4 * 2^L - 3 pixels, so this is
+ * the smallest such L covering filterSize, 0 up to a single pixel.
+ */
+int denoiserLevels(int filterSize);
+
+// Scratch bytes denoiserCreate needs for any settings at this resolution
+DenoiserStatus denoiserScratchBytes(int width, int height, size_t *bytes);
+
+/**
+ * Creates a denoiser for width x height images in `scratch`, at least
+ * denoiserScratchBytes() of device memory that stays the caller's. With
+ * `scratch` NULL the denoiser allocates its own.
+ */
+DenoiserStatus denoiserCreate(int width, int height, void *scratch, size_t scratchBytes,
+        Denoiser *denoiser);
+
+/**
+ * Copies DENOISER_KPN_WEIGHTS host floats of network weights (see
+ * DENOISER_KPN_INPUTS) to the device for DENOISER_KERNEL_PREDICTING, and
+ * allocates its per-pixel kernels, DENOISER_KPN_TAPS halves each, outside
+ * the scratch. NULL weights drop the network.
+ */
+DenoiserStatus denoiserSetNetwork(Denoiser denoiser, const float *weights, size_t count);
+
+/**
+ * Queues the filter on `stream`. Stacked layers with a method other than
+ * DENOISER_ATROUS are a DENOISER_INVALID_VALUE, as is
+ * DENOISER_KERNEL_PREDICTING without a network. With `output` (RGBA float per pixel) the
+ * normalized result is written there; `result`, if given, says where it is
+ * in any case: in `output`, in the scratch memory until the next call, or
+ * the input itself when the footprint is a single pixel. With
+ * settings->convergence set it waits for `stream` after each level to
+ * decide whether to run the next. With settings->tileConvergence set, and
+ * the moments of at least 4 samples, it waits once before the levels to
+ * learn which tiles have converged: those keep their input, and the levels
+ * run over the rest only, so the cost falls as the image converges. It
+ * applies to A-Trous on a single layer, outside pyramid mode.
+ */
+DenoiserStatus denoiserFilter(Denoiser denoiser, const DenoiserSettings *settings,
+        const DenoiserCamera *camera, const DenoiserInputs *inputs, float *output,
+        DenoiserResult *result, cudaStream_t stream);
+
+/**
+ * denoiserFilter over a batch of `count` images of width x height / count,
+ * such as a dataset's many small renders, each seen from its own camera
+ * in cameras[count] (whose `layers` and `layerOffset` are ignored). The
+ * inputs and output hold the images one after another, each a contiguous
+ * block, as stacked layers do, so every level of every image is a single
+ * launch with the image at blockIdx.z. Give each image's own sample count
+ * through inputs->sampleCounts when they differ. DENOISER_ATROUS only,
+ * like stacked layers, and never across the images.
+ */
+DenoiserStatus denoiserFilterBatch(Denoiser denoiser, const DenoiserSettings *settings,
+        const DenoiserCamera *cameras, int count, const DenoiserInputs *inputs, float *output,
+        DenoiserResult *result, cudaStream_t stream);
+
+// Frees the denoiser, and its scratch if it allocated that itself
+void denoiserDestroy(Denoiser denoiser);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,208 @@
+"""
+Python bindings of the renderer's C interface (src/pathtracerApi.h).
+
+Build the library with ``cmake -DBUILD_PYTHON_BINDINGS=ON`` and point
+``PATHTRACER_LIBRARY`` at it, or build in ``build/`` next to this
+directory. Results are device arrays that export
+``__cuda_array_interface__``, so CuPy, PyTorch or Numba wrap them without
+copying::
+
+    import cupy, pathtracer
+    r = pathtracer.Renderer("scenes/cornell.txt")
+    for eye in sweep:
+        r.set_camera(eye, look_at, up)
+        r.trace(64)
+        r.denoise(filter_size=64)
+        mean = cupy.asarray(r.image)[..., :3] / r.samples
+        clean = cupy.asarray(r.denoised)
+
+CuPy arrays reach DLPack consumers through ``toDlpack()``.
+"""
+
+import ctypes
+import os
+
+DENOISE_ATROUS = 0
+DENOISE_OPTIX = 1
+DENOISE_GUIDED = 2
+DENOISE_BILATERAL_GRID = 3
+
+DENOISER_B3_SPLINE = 0
+DENOISER_GAUSSIAN = 1
+
+
+class _TraceSettings(ctypes.Structure):
+    _fields_ = [
+        ("samplesPerLaunch", ctypes.c_int),
+        ("hardwareRT", ctypes.c_int),
+        ("nextEventEstimation", ctypes.c_int),
+        ("russianRoulette", ctypes.c_int),
+        ("antialias", ctypes.c_int),
+        ("deterministic", ctypes.c_int),
+    ]
+
+
+class _DenoiserSettings(ctypes.Structure):
+    _fields_ = [
+        ("filterSize", ctypes.c_int),
+        ("kernel", ctypes.c_int),
+        ("colorWeight", ctypes.c_float),
+        ("normalWeight", ctypes.c_float),
+        ("positionWeight", ctypes.c_float),
+        ("varianceGuided", ctypes.c_int),
+        ("separable", ctypes.c_int),
+        ("halfPrecision", ctypes.c_int),
+        ("pyramid", ctypes.c_int),
+        ("demodulateAlbedo", ctypes.c_int),
+        ("convergence", ctypes.c_float),
+        ("method", ctypes.c_int),
+    ]
+
+
+class _DeviceBuffers(ctypes.Structure):
+    _fields_ = [
+        ("width", ctypes.c_int),
+        ("height", ctypes.c_int),
+        ("samples", ctypes.c_int),
+        ("image", ctypes.c_void_p),
+        ("moments", ctypes.c_void_p),
+        ("gBuffer", ctypes.c_void_p),
+        ("denoised", ctypes.c_void_p),
+    ]
+
+
+def _library_path():
+    path = os.environ.get("PATHTRACER_LIBRARY")
+    if path:
+        return path
+    build = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "build")
+    if os.name == "nt":
+        return os.path.join(build, "bin", "pathtracer.dll")
+    return os.path.join(build, "lib", "libpathtracer.so")
+
+
+class DeviceArray:
+    """
+    Read-only view of a renderer buffer on the device. It is only valid
+    until the renderer next traces, denoises, resets or shuts down; copy it
+    to keep it.
+    """
+
+    def __init__(self, owner, pointer, shape, typestr):
+        self._owner = owner
+        self.shape = shape
+        self.typestr = typestr
+        self.__cuda_array_interface__ = {
+            "shape": shape,
+            "typestr": typestr,
+            "data": (pointer, True),
+            "version": 3,
+        }
+
+
+class Renderer:
+    """
+    One resident scene, re-rendered as often as needed. Only one renderer
+    may be alive per process, as the library keeps a single scene.
+    """
+
+    def __init__(self, scene_file, library=None):
+        self._lib = ctypes.CDLL(library or _library_path())
+        self._lib.ptLoadScene.argtypes = [ctypes.c_char_p]
+        self._lib.ptLoadScene.restype = ctypes.c_int
+        self._lib.ptSceneSettings.argtypes = [ctypes.POINTER(ctypes.c_int), ctypes.POINTER(ctypes.c_int)]
+        self._lib.ptSetCamera.argtypes = [ctypes.POINTER(ctypes.c_float)] * 3
+        self._lib.ptTrace.argtypes = [ctypes.c_int, ctypes.POINTER(_TraceSettings)]
+        self._lib.ptTrace.restype = ctypes.c_int
+        self._lib.ptDenoise.argtypes = [ctypes.c_int, ctypes.POINTER(_DenoiserSettings)]
+        self._lib.ptDeviceBuffers.argtypes = [ctypes.POINTER(_DeviceBuffers)]
+        if self._lib.ptLoadScene(os.fsencode(scene_file)) != 0:
+            raise IOError("cannot read scene file %s" % scene_file)
+        iterations = ctypes.c_int()
+        depth = ctypes.c_int()
+        self._lib.ptSceneSettings(ctypes.byref(iterations), ctypes.byref(depth))
+        self.iterations = iterations.value
+        self.trace_depth = depth.value
+        self.samples = 0
+
+    def close(self):
+        if self._lib is not None:
+            self._lib.ptShutdown()
+            self._lib = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def set_camera(self, position, look_at, up=(0.0, 1.0, 0.0)):
+        """Moves the camera, keeping its field of view, and clears the image."""
+        vec3 = ctypes.c_float * 3
+        self._lib.ptSetCamera(vec3(*position), vec3(*look_at), vec3(*up))
+        self.samples = 0
+
+    def reset(self):
+        self._lib.ptReset()
+        self.samples = 0
+
+    def trace(self, samples, samples_per_launch=1, hardware_rt=False,
+              next_event_estimation=True, russian_roulette=False, antialias=True,
+              deterministic=False):
+        """
+        Traces `samples` more samples per pixel; returns the total. With
+        `deterministic`, a rerun of the same calls gives the same bits.
+        """
+        settings = _TraceSettings(samples_per_launch, hardware_rt, next_event_estimation,
+                                  russian_roulette, antialias, deterministic)
+        self.samples = self._lib.ptTrace(samples, ctypes.byref(settings))
+        return self.samples
+
+    def denoise(self, backend=DENOISE_ATROUS, filter_size=80, kernel=DENOISER_B3_SPLINE,
+                color_weight=0.45, normal_weight=0.35, position_weight=0.2,
+                variance_guided=False, separable=False, half_precision=False,
+                pyramid=False, demodulate_albedo=False, convergence=0.0):
+        """
+        Denoises the accumulation into `denoised`, with the control panel's
+        defaults. A nonzero `convergence` stops the wavelet levels once one
+        changes the image's luminance by less than that fraction.
+        """
+        settings = _DenoiserSettings(filter_size, kernel, color_weight, normal_weight,
+                                     position_weight, variance_guided, separable,
+                                     half_precision, pyramid, demodulate_albedo, convergence)
+        self._lib.ptDenoise(backend, ctypes.byref(settings))
+
+    def _buffers(self):
+        buffers = _DeviceBuffers()
+        self._lib.ptDeviceBuffers(ctypes.byref(buffers))
+        return buffers
+
+    @property
+    def image(self):
+        """Float32 (height, width, 4) sums over `samples` samples."""
+        b = self._buffers()
+        return DeviceArray(self, b.image, (b.height, b.width, 4), "<f4")
+
+    @property
+    def moments(self):
+        """Float32 (height, width, 2) sums of luminance and its square."""
+        b = self._buffers()
+        return DeviceArray(self, b.moments, (b.height, b.width, 2), "<f4")
+
+    @property
+    def gbuffer(self):
+        """
+        Uint8 (height, width, 16) packed first hits: float32 t, two uint16
+        octahedral normal components, three float16 albedo channels and an
+        int16 material id, see src/gbuffer.h.
+        """
+        b = self._buffers()
+        return DeviceArray(self, b.gBuffer, (b.height, b.width, 16), "|u1")
+
+    @property
+    def denoised(self):
+        """Float32 (height, width, 4) normalized result of the last denoise(), or None."""
+        b = self._buffers()
+        if not b.denoised:
+            return None
+        return DeviceArray(self, b.denoised, (b.height, b.width, 4), "<f4")
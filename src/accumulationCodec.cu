@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "accumulationCodec.h"
+#include "deviceMemory.h"
+#include "../stream_compaction/common.h"
+
+#define CODEC_FULL_MASK 0xffffffffu
+
+static unsigned char *dev_widths = NULL;
+static int *dev_offsets = NULL;
+static uint32_t *dev_anchors = NULL;
+static uint32_t *dev_words = NULL;
+static int blockCapacity = 0;
+static int wordCapacity = 0;
+
+// Room for `blocks` blocks and `words` packed words
+static void reserveScratch(int blocks, int words) {
+    if (blocks > blockCapacity) {
+        deviceMemory::release(dev_widths);
+        deviceMemory::release(dev_offsets);
+        deviceMemory::release(dev_anchors);
+        deviceMemory::allocate(&dev_widths, blocks);
+        deviceMemory::allocate(&dev_offsets, blocks * sizeof(int));
+        deviceMemory::allocate(&dev_anchors, blocks * sizeof(uint32_t));
+        blockCapacity = blocks;
+    }
+    if (words > wordCapacity) {
+        deviceMemory::release(dev_words);
+        deviceMemory::allocate(&dev_words, words * sizeof(uint32_t));
+        wordCapacity = words;
+    }
+}
+
+// The widths' bytes in a stream, padded to a whole word
+static size_t widthBytes(int blocks) {
+    return ((size_t)blocks + 3) & ~(size_t)3;
+}
+
+// The step from a float's left neighbour to it, as integers, zigzagged so small steps down stay small
+__host__ __device__ inline uint32_t zigzag(uint32_t bits, uint32_t previous) {
+    const int32_t delta = (int32_t)(bits - previous);
+    return ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+}
+
+__host__ __device__ inline uint32_t unzigzag(uint32_t residual) {
+    return (residual >> 1) ^ (0u - (residual & 1u));
+}
+
+// Past `count`, lanes repeat the last float, so their residuals are 0
+__device__ inline uint32_t codecBits(const float *values, int count, int stride, int index) {
+    return __float_as_uint(values[(size_t)min(index, count - 1) * stride]);
+}
+
+// The lane's residual; every lane of the warp must call it
+__device__ inline uint32_t codecResidual(uint32_t bits, int lane) {
+    const uint32_t previous = __shfl_up_sync(CODEC_FULL_MASK, bits, 1);
+    return lane == 0 ? 0u : zigzag(bits, previous);
+}
+
+__global__ void kernEncodeWidths(int count, const float *values, int stride, unsigned char *widths,
+        uint32_t *anchors) {
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    const int lane = threadIdx.x & (CODEC_BLOCK - 1);
+    // Whole warps return, so the shuffles below see every lane
+    if (index - lane >= count) {
+        return;
+    }
+    const uint32_t bits = codecBits(values, count, stride, index);
+    uint32_t any = codecResidual(bits, lane);
+    for (int offset = CODEC_BLOCK / 2; offset > 0; offset >>= 1) {
+        any |= __shfl_xor_sync(CODEC_FULL_MASK, any, offset);
+    }
+    if (lane == 0) {
+        widths[index / CODEC_BLOCK] = (unsigned char)(32 - __clz(any));
+        anchors[index / CODEC_BLOCK] = bits;
+    }
+}
+
+// Ors each lane's residual into its block's words, at lane * width bits
+__global__ void kernEncodePack(int count, const float *values, int stride, const unsigned char *widths,
+        const int *offsets, uint32_t *words) {
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    const int lane = threadIdx.x & (CODEC_BLOCK - 1);
+    if (index - lane >= count) {
+        return;
+    }
+    const uint32_t residual = codecResidual(codecBits(values, count, stride, index), lane);
+    const int block = index / CODEC_BLOCK;
+    const int width = widths[block];
+    if (residual == 0) {
+        return;
+    }
+    const int bit = lane * width;
+    const int shift = bit % 32;
+    uint32_t *word = words + offsets[block] + bit / 32;
+    atomicOr(word, residual << shift);
+    if (shift + width > 32) {
+        atomicOr(word + 1, residual >> (32 - shift));
+    }
+}
+
+// Unpacks each lane's residual and sums them across the warp onto the block's first float
+__global__ void kernDecode(int count, const unsigned char *widths, const int *offsets, const uint32_t *anchors,
+        const uint32_t *words, float *values, int stride, bool add) {
+    const int index = blockIdx.x * blockDim.x + threadIdx.x;
+    const int lane = threadIdx.x & (CODEC_BLOCK - 1);
+    if (index - lane >= count) {
+        return;
+    }
+    const int block = index / CODEC_BLOCK;
+    const int width = widths[block];
+    uint32_t residual = 0;
+    if (width > 0) {
+        const int bit = lane * width;
+        const int shift = bit % 32;
+        const uint32_t *word = words + offsets[block] + bit / 32;
+        residual = word[0] >> shift;
+        if (shift + width > 32) {
+            residual |= word[1] << (32 - shift);
+        }
+        if (width < 32) {
+            residual &= (1u << width) - 1u;
+        }
+    }
+    uint32_t sum = unzigzag(residual);
+    for (int offset = 1; offset < CODEC_BLOCK; offset <<= 1) {
+        const uint32_t up = __shfl_up_sync(CODEC_FULL_MASK, sum, offset);
+        if (lane >= offset) {
+            sum += up;
+        }
+    }
+    if (index < count) {
+        const float value = __uint_as_float(anchors[block] + sum);
+        float &out = values[(size_t)index * stride];
+        out = add ? out + value : value;
+    }
+}
+
+/**
+ * Checks the stream at `in` against `bytes` and `count`, and sets
+ * `offsets` to where each block's words start. Returns the stream's size,
+ * 0 if it is malformed.
+ */
+static size_t parseStream(const unsigned char *in, size_t bytes, int count, std::vector<int> &offsets) {
+    uint32_t header[2];
+    if (bytes < sizeof(header)) {
+        return 0;
+    }
+    memcpy(header, in, sizeof(header));
+    const int blocks = (count + CODEC_BLOCK - 1) / CODEC_BLOCK;
+    const size_t size = sizeof(header) + widthBytes(blocks) + (size_t)blocks * 4 + (size_t)header[1] * 4;
+    if (header[0] != (uint32_t)count || size > bytes) {
+        return 0;
+    }
+    const unsigned char *widths = in + sizeof(header);
+    offsets.resize(blocks);
+    size_t words = 0;
+    for (int b = 0; b < blocks; b++) {
+        if (widths[b] > 32) {
+            return 0;
+        }
+        offsets[b] = (int)words;
+        words += widths[b];
+    }
+    return words == header[1] ? size : 0;
+}
+
+void accumulationCodec::encode(const float *values, int count, int stride, std::vector<unsigned char> &out,
+        cudaStream_t stream) {
+    const int blocks = (count + CODEC_BLOCK - 1) / CODEC_BLOCK;
+    const size_t start = out.size();
+    const size_t anchorsAt = start + 8 + widthBytes(blocks);
+    out.resize(anchorsAt + (size_t)blocks * 4, 0);
+    uint32_t header[2] = { (uint32_t)count, 0 };
+    if (count > 0) {
+        reserveScratch(blocks, count);
+        const int blockSize = 128;
+        const int threads = blocks * CODEC_BLOCK;
+        kernEncodeWidths<<<(threads + blockSize - 1) / blockSize, blockSize, 0, stream>>>(count, values, stride,
+            dev_widths, dev_anchors);
+        cudaMemcpyAsync(&out[start + 8], dev_widths, blocks, cudaMemcpyDeviceToHost, stream);
+        cudaMemcpyAsync(&out[anchorsAt], dev_anchors, blocks * sizeof(uint32_t), cudaMemcpyDeviceToHost, stream);
+        cudaStreamSynchronize(stream);
+
+        std::vector<int> offsets(blocks);
+        int words = 0;
+        for (int b = 0; b < blocks; b++) {
+            offsets[b] = words;
+            words += out[start + 8 + b];
+        }
+        header[1] = (uint32_t)words;
+        if (words > 0) {
+            cudaMemcpyAsync(dev_offsets, offsets.data(), blocks * sizeof(int), cudaMemcpyHostToDevice, stream);
+            cudaMemsetAsync(dev_words, 0, words * sizeof(uint32_t), stream);
+            kernEncodePack<<<(threads + blockSize - 1) / blockSize, blockSize, 0, stream>>>(count, values, stride,
+                dev_widths, dev_offsets, dev_words);
+            out.resize(out.size() + (size_t)words * 4);
+            cudaMemcpyAsync(&out[out.size() - (size_t)words * 4], dev_words, words * sizeof(uint32_t),
+                cudaMemcpyDeviceToHost, stream);
+            cudaStreamSynchronize(stream);
+        }
+    }
+    memcpy(&out[start], header, sizeof(header));
+    checkCUDAError("accumulationCodec::encode");
+}
+
+size_t accumulationCodec::decode(const unsigned char *in, size_t bytes, int count, float *values, int stride,
+        bool add, cudaStream_t stream) {
+    std::vector<int> offsets;
+    const size_t size = parseStream(in, bytes, count, offsets);
+    if (size == 0 || count == 0) {
+        return size;
+    }
+    const int blocks = (int)offsets.size();
+    uint32_t words = 0;
+    memcpy(&words, in + 4, sizeof(words));
+    reserveScratch(blocks, std::max((int)words, 1));
+    const unsigned char *widths = in + 8;
+    const unsigned char *anchors = widths + widthBytes(blocks);
+    cudaMemcpyAsync(dev_widths, widths, blocks, cudaMemcpyHostToDevice, stream);
+    cudaMemcpyAsync(dev_offsets, offsets.data(), blocks * sizeof(int), cudaMemcpyHostToDevice, stream);
+    cudaMemcpyAsync(dev_anchors, anchors, blocks * sizeof(uint32_t), cudaMemcpyHostToDevice, stream);
+    if (words > 0) {
+        cudaMemcpyAsync(dev_words, anchors + (size_t)blocks * 4, words * sizeof(uint32_t),
+            cudaMemcpyHostToDevice, stream);
+    }
+    const int blockSize = 128;
+    const int threads = blocks * CODEC_BLOCK;
+    kernDecode<<<(threads + blockSize - 1) / blockSize, blockSize, 0, stream>>>(count, dev_widths, dev_offsets,
+        dev_anchors, dev_words, values, stride, add);
+    cudaStreamSynchronize(stream);
+    checkCUDAError("accumulationCodec::decode");
+    return size;
+}
+
+size_t accumulationCodec::check(const unsigned char *in, size_t bytes, int count) {
+    std::vector<int> offsets;
+    return parseStream(in, bytes, count, offsets);
+}
+
+size_t accumulationCodec::decodeOnHost(const unsigned char *in, size_t bytes, int count, float *values,
+        int stride) {
+    std::vector<int> offsets;
+    const size_t size = parseStream(in, bytes, count, offsets);
+    if (size == 0) {
+        return 0;
+    }
+    const int blocks = (int)offsets.size();
+    const unsigned char *widths = in + 8;
+    const unsigned char *anchors = widths + widthBytes(blocks);
+    const unsigned char *words = anchors + (size_t)blocks * 4;
+    for (int b = 0; b < blocks; b++) {
+        const int width = widths[b];
+        uint32_t bits = 0;
+        memcpy(&bits, anchors + (size_t)b * 4, 4);
+        for (int lane = 0; lane < CODEC_BLOCK && b * CODEC_BLOCK + lane < count; lane++) {
+            uint32_t residual = 0;
+            if (width > 0) {
+                const int bit = lane * width;
+                const int shift = bit % 32;
+                uint32_t word[2] = { 0, 0 };
+                const size_t at = ((size_t)offsets[b] + bit / 32) * 4;
+                memcpy(&word[0], words + at, 4);
+                if (shift + width > 32) {
+                    memcpy(&word[1], words + at + 4, 4);
+                    residual = (word[0] >> shift) | (word[1] << (32 - shift));
+                } else {
+                    residual = word[0] >> shift;
+                }
+                if (width < 32) {
+                    residual &= (1u << width) - 1u;
+                }
+            }
+            bits += unzigzag(residual);
+            memcpy(&values[(size_t)(b * CODEC_BLOCK + lane) * stride], &bits, 4);
+        }
+    }
+    return size;
+}
+
+void accumulationCodec::release() {
+    deviceMemory::release(dev_widths);
+    deviceMemory::release(dev_offsets);
+    deviceMemory::release(dev_anchors);
+    deviceMemory::release(dev_words);
+    dev_widths = NULL;
+    dev_offsets = NULL;
+    dev_anchors = NULL;
+    dev_words = NULL;
+    blockCapacity = 0;
+    wordCapacity = 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include <cuda_runtime.h>
+
+// Floats per codec block: one warp's worth, each lane coding one
+#define CODEC_BLOCK 32
+
+/**
+ * Lossless compression of accumulation sums on the GPU, for checkpoints and
+ * distributed partials, which at 4K are hundreds of MB raw. A stream codes
+ * one channel, in pixel order: each float's bits are predicted by its left
+ * neighbour's, as integers, and blocks of CODEC_BLOCK residuals are
+ * zigzagged and bit-packed at the width of the block's largest. Neighbouring
+ * sums share their exponent and leading mantissa bits, so the widths stay
+ * well below 32; noise-free regions, or the zero moments of an empty sky,
+ * pack to nothing. Each block's first float is kept whole, so every block
+ * decodes on its own, one warp each. A stream holds:
+ *
+ * - the float count and the packed words' count, as two 32-bit words
+ * - the blocks' widths, one byte each, padded to a whole word
+ * - the blocks' first floats' bits, one word each
+ * - the packed words
+ *
+ * in native byte order, as accumulationFile is.
+ */
+namespace accumulationCodec {
+    /**
+     * Appends the stream of `count` floats of device memory, `stride`
+     * floats apart from `values`, to `out`. The work is queued on `stream`,
+     * which the call waits for.
+     */
+    void encode(const float *values, int count, int stride, std::vector<unsigned char> &out, cudaStream_t stream);
+
+    /**
+     * Decodes the stream at `in`, with `bytes` bytes left, into `count`
+     * floats of device memory `stride` apart from `values`, adding them to
+     * what is there with `add`, on `stream`, and waits for it. Returns the
+     * bytes the stream took, 0 if it is malformed or does not hold `count`
+     * floats.
+     */
+    size_t decode(const unsigned char *in, size_t bytes, int count, float *values, int stride, bool add,
+        cudaStream_t stream);
+
+    // The bytes the stream at `in` takes, as decode() returns them, without decoding it
+    size_t check(const unsigned char *in, size_t bytes, int count);
+
+    // The same decode on the host, for renders without a GPU, into values[i * stride]
+    size_t decodeOnHost(const unsigned char *in, size_t bytes, int count, float *values, int stride);
+
+    // Frees the scratch buffers the calls above keep between calls
+    void release();
+}
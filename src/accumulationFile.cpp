@@ -0,0 +1,149 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "accumulationFile.h"
+#include "accumulationCodec.h"
+
+namespace accumulationFile {
+
+// Bumped whenever the layout below changes
+static const char MAGIC[8] = { 'P', 'T', 'A', 'C', 'C', '0', '0', '2' };
+
+struct Header {
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    int32_t samples;
+    int32_t gBufferPixelBytes;  // catches readers built with another GBufferPixel
+    int64_t packedBytes;        // 0 for raw sums and moments
+};
+
+template <typename T>
+static bool writeArray(FILE *file, const std::vector<T> &values) {
+    return fwrite(values.data(), sizeof(T), values.size(), file) == values.size();
+}
+
+template <typename T>
+static bool readArray(FILE *file, std::vector<T> &values, size_t count) {
+    values.resize(count);
+    return fread(values.data(), sizeof(T), count, file) == count;
+}
+
+bool write(const std::string &filename, const Accumulation &accumulation) {
+    const size_t pixelcount = (size_t)accumulation.width * accumulation.height;
+    const bool packed = !accumulation.packed.empty();
+    if ((!packed && (accumulation.image.size() != pixelcount || accumulation.moments.size() != pixelcount))
+            || accumulation.gBuffer.size() != pixelcount) {
+        std::cerr << "Accumulation for " << filename << " does not match its resolution." << std::endl;
+        return false;
+    }
+
+    std::string tmpFilename = filename + ".tmp";
+    FILE *file = fopen(tmpFilename.c_str(), "wb");
+    if (file == NULL) {
+        std::cerr << "Could not open " << tmpFilename << " for writing." << std::endl;
+        return false;
+    }
+    Header header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.width = accumulation.width;
+    header.height = accumulation.height;
+    header.samples = accumulation.samples;
+    header.gBufferPixelBytes = sizeof(GBufferPixel);
+    header.packedBytes = accumulation.packed.size();
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && (packed ? writeArray(file, accumulation.packed)
+            : writeArray(file, accumulation.image) && writeArray(file, accumulation.moments))
+        && writeArray(file, accumulation.gBuffer);
+    ok = fclose(file) == 0 && ok;
+
+#ifdef _WIN32
+    // rename() does not replace an existing file on Windows
+    if (ok) {
+        remove(filename.c_str());
+    }
+#endif
+    if (!ok || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Failed writing " << filename << "." << std::endl;
+        remove(tmpFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool read(const std::string &filename, Accumulation &accumulation) {
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+    Header header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0
+        && header.gBufferPixelBytes == (int32_t)sizeof(GBufferPixel)
+        && header.width > 0 && header.height > 0 && header.samples >= 0 && header.packedBytes >= 0;
+    if (ok) {
+        const size_t pixelcount = (size_t)header.width * header.height;
+        accumulation.width = header.width;
+        accumulation.height = header.height;
+        accumulation.samples = header.samples;
+        accumulation.image.clear();
+        accumulation.moments.clear();
+        accumulation.packed.clear();
+        if (header.packedBytes > 0) {
+            ok = readArray(file, accumulation.packed, (size_t)header.packedBytes);
+        } else {
+            ok = readArray(file, accumulation.image, pixelcount)
+                && readArray(file, accumulation.moments, pixelcount);
+        }
+        ok = ok && readArray(file, accumulation.gBuffer, pixelcount);
+    }
+    fclose(file);
+    return ok;
+}
+
+bool unpack(Accumulation &accumulation) {
+    if (accumulation.packed.empty()) {
+        return true;
+    }
+    const int pixelcount = accumulation.width * accumulation.height;
+    accumulation.image.resize(pixelcount);
+    accumulation.moments.resize(pixelcount);
+    const unsigned char *in = accumulation.packed.data();
+    const unsigned char *end = in + accumulation.packed.size();
+    for (int c = 0; c < 5; c++) {
+        float *values = c < 3 ? &accumulation.image[0][c] : &accumulation.moments[0][c - 3];
+        const size_t used = accumulationCodec::decodeOnHost(in, end - in, pixelcount, values, c < 3 ? 3 : 2);
+        if (used == 0) {
+            return false;
+        }
+        in += used;
+    }
+    accumulation.packed.clear();
+    return true;
+}
+
+bool add(Accumulation &sum, const Accumulation &part) {
+    if (!part.packed.empty()) {
+        Accumulation unpacked = part;
+        return unpack(unpacked) && add(sum, unpacked);
+    }
+    // Camera rays are not jittered, so every worker's first hits agree and
+    // the first part's G-buffer stands for all of them
+    if (sum.image.empty()) {
+        sum = part;
+        return true;
+    }
+    if (sum.width != part.width || sum.height != part.height) {
+        return false;
+    }
+    for (size_t i = 0; i < sum.image.size(); i++) {
+        sum.image[i] += part.image[i];
+        sum.moments[i] += part.moments[i];
+    }
+    sum.samples += part.samples;
+    return true;
+}
+
+}
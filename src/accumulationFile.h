@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "sceneStructs.h"
+
+/**
+ * Partial renders as exchanged by distributed workers and the coordinator:
+ * the raw per-pixel sums (not averages), so partials from any number of
+ * workers merge by adding them. Native byte order; both ends are this
+ * program on the same kind of machine. Sums and moments read back from the
+ * GPU usually come losslessly packed by accumulationCodec, at a fraction
+ * of their size.
+ */
+namespace accumulationFile {
+    struct Accumulation {
+        int width;
+        int height;
+        int samples;                        // samples per pixel in the sums
+        std::vector<glm::vec3> image;       // radiance sums
+        std::vector<glm::vec2> moments;     // luminance and squared luminance sums
+        std::vector<GBufferPixel> gBuffer;  // first-hit G-buffer, the same for every worker
+        // When not empty, the image's three channels then the moments' two as
+        // accumulationCodec streams, standing in for image and moments
+        std::vector<unsigned char> packed;
+    };
+
+    /**
+     * Writes filename through filename.tmp and a rename, so a reader polling
+     * the file sees either the previous checkpoint or this one, never a
+     * partially written file.
+     */
+    bool write(const std::string &filename, const Accumulation &accumulation);
+
+    // Reads filename, failing on a missing, truncated or foreign file
+    bool read(const std::string &filename, Accumulation &accumulation);
+
+    // Unpacks packed sums into image and moments on the host, failing on a malformed stream
+    bool unpack(Accumulation &accumulation);
+
+    // Adds part's sums to sum (empty to start), unpacking them, failing unless the resolutions match
+    bool add(Accumulation &sum, const Accumulation &part);
+}
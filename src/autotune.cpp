@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cuda_runtime.h>
+
+#include "autotune.h"
+
+using autotune::Choice;
+
+// The choices are tuned one after another, each from the best so far
+enum TuneStage {
+    STAGE_PIPELINE,
+    STAGE_SORT,         // split only, as are the block sizes
+    STAGE_INTERSECT,
+    STAGE_SHADE,
+    STAGE_DONE,
+};
+
+static const int TUNED_BLOCK_SIZES[] = { 64, 128, 256 };
+
+static bool autotuneOn = false;
+static std::string cachePath;
+static std::string sceneKey;        // scene hash and resolution, as the cache writes them
+static int stage = STAGE_DONE;
+static std::vector<Choice> candidates;
+static size_t candidate = 0;
+static int candidateLaunches = 0;   // warm-up included
+static double candidateMs = 0.0;    // fastest ms per sample of the candidate's launches
+static Choice best;
+static double bestMs = 0.0;
+static bool winnerPending = false;
+static bool timing = false;
+static std::chrono::steady_clock::time_point launchStart;
+
+// 64-bit FNV-1a of the scene file's bytes
+static uint64_t hashFile(const std::string &path) {
+    uint64_t hash = 14695981039346656037ull;
+    std::ifstream in(path.c_str(), std::ios::binary);
+    char buffer[4096];
+    while (in.read(buffer, sizeof(buffer)) || in.gcount() > 0) {
+        for (std::streamsize i = 0; i < in.gcount(); i++) {
+            hash = (hash ^ (unsigned char)buffer[i]) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+static const char *device() {
+    return pathtraceLaunchConfiguration().device;
+}
+
+/**
+ * The cache holds a line per tuned scene:
+ *
+ *     HASH WIDTH HEIGHT PIPELINE SORT_MATERIAL SORT_RAYS INTERSECT SHADE MS DEVICE
+ *
+ * with the device name, which may hold spaces, running to the end of the line.
+ * Returns whether the line is this scene's on this device.
+ */
+static bool parseCacheLine(const std::string &line, Choice &choice, double &ms) {
+    std::istringstream in(line);
+    std::string hash, width, height;
+    int sortByMaterial = 0, sortRays = 0;
+    if (!(in >> hash >> width >> height >> choice.pipeline >> sortByMaterial >> sortRays
+            >> choice.intersectBlockSize >> choice.shadeBlockSize >> ms)) {
+        return false;
+    }
+    choice.sortByMaterial = sortByMaterial != 0;
+    choice.sortRays = sortRays != 0;
+    std::string name;
+    std::getline(in >> std::ws, name);
+    return hash + " " + width + " " + height == sceneKey && name == device();
+}
+
+// Rewrites the cache with this scene's line replaced by the winner
+static void writeCache() {
+    std::vector<std::string> lines;
+    {
+        std::ifstream in(cachePath.c_str());
+        std::string line;
+        Choice choice;
+        double ms;
+        while (std::getline(in, line)) {
+            if (!line.empty() && !parseCacheLine(line, choice, ms)) {
+                lines.push_back(line);
+            }
+        }
+    }
+    char entry[512];
+    snprintf(entry, sizeof(entry), "%s %d %d %d %d %d %d %.4f %s", sceneKey.c_str(), best.pipeline,
+        best.sortByMaterial ? 1 : 0, best.sortRays ? 1 : 0, best.intersectBlockSize, best.shadeBlockSize,
+        bestMs, device());
+    lines.push_back(entry);
+
+    FILE *out = fopen(cachePath.c_str(), "w");
+    if (out == NULL) {
+        printf("--autotune: cannot write %s\n", cachePath.c_str());
+        return;
+    }
+    for (size_t i = 0; i < lines.size(); i++) {
+        fprintf(out, "%s\n", lines[i].c_str());
+    }
+    fclose(out);
+}
+
+static std::vector<Choice> stageCandidates(int tuneStage) {
+    std::vector<Choice> out;
+    if (tuneStage == STAGE_PIPELINE) {
+        for (int pipeline = PIPELINE_SPLIT; pipeline <= PIPELINE_COOPERATIVE; pipeline++) {
+            // It would only time the split pipeline again
+            if (pipeline == PIPELINE_COOPERATIVE && !pathtraceLaunchConfiguration().cooperativeLaunch) {
+                continue;
+            }
+            Choice choice = { pipeline, false, false, 0, 0 };
+            out.push_back(choice);
+        }
+    } else if (best.pipeline != PIPELINE_SPLIT) {
+        // The other pipelines neither sort nor launch with the tuned sizes
+    } else if (tuneStage == STAGE_SORT) {
+        for (int sort = 1; sort < 4; sort++) {
+            Choice choice = best;
+            choice.sortByMaterial = (sort & 1) != 0;
+            choice.sortRays = (sort & 2) != 0;
+            out.push_back(choice);
+        }
+    } else if (tuneStage == STAGE_INTERSECT || tuneStage == STAGE_SHADE) {
+        for (size_t i = 0; i < sizeof(TUNED_BLOCK_SIZES) / sizeof(TUNED_BLOCK_SIZES[0]); i++) {
+            Choice choice = best;
+            (tuneStage == STAGE_INTERSECT ? choice.intersectBlockSize : choice.shadeBlockSize) =
+                TUNED_BLOCK_SIZES[i];
+            out.push_back(choice);
+        }
+    }
+    return out;
+}
+
+// Moves on to the next stage with candidates left to measure, or settles
+static void nextStage() {
+    candidate = 0;
+    candidateLaunches = 0;
+    candidates.clear();
+    while (candidates.empty() && stage < STAGE_DONE) {
+        stage++;
+        candidates = stageCandidates(stage);
+    }
+    if (stage == STAGE_DONE) {
+        printf("autotune: pipeline %d, sort %d/%d, blocks %d/%d at %.3f ms per sample\n", best.pipeline,
+            best.sortByMaterial ? 1 : 0, best.sortRays ? 1 : 0, best.intersectBlockSize,
+            best.shadeBlockSize, bestMs);
+        writeCache();
+        winnerPending = true;
+    }
+}
+
+bool autotune::start(const std::string &cacheFile) {
+    FILE *out = fopen(cacheFile.c_str(), "a");
+    if (out == NULL) {
+        return false;
+    }
+    fclose(out);
+    cachePath = cacheFile;
+    autotuneOn = true;
+    return true;
+}
+
+bool autotune::enabled() {
+    return autotuneOn;
+}
+
+void autotune::begin(const std::string &sceneFile, int width, int height) {
+    if (!autotuneOn) {
+        return;
+    }
+    char key[64];
+    snprintf(key, sizeof(key), "%016llx %d %d", (unsigned long long)hashFile(sceneFile), width, height);
+    sceneKey = key;
+    timing = false;
+
+    std::ifstream in(cachePath.c_str());
+    std::string line;
+    while (std::getline(in, line)) {
+        if (parseCacheLine(line, best, bestMs)) {
+            stage = STAGE_DONE;
+            winnerPending = true;
+            return;
+        }
+    }
+    bestMs = 1e30;
+    stage = STAGE_PIPELINE - 1;
+    nextStage();
+}
+
+bool autotune::tuning() {
+    return autotuneOn && stage < STAGE_DONE;
+}
+
+void autotune::beginLaunch(PathtraceOptions &options) {
+    if (!tuning()) {
+        return;
+    }
+    const Choice &choice = candidates[candidate];
+    options.pipeline = choice.pipeline;
+    options.sortByMaterial = choice.sortByMaterial;
+    options.sortRays = choice.sortRays;
+    pathtraceOverrideBlockSizes(choice.intersectBlockSize, choice.shadeBlockSize);
+    // Coarse or partial launches would not compare with whole ones
+    if (options.pixelStride != 1 || options.region.width > 0) {
+        return;
+    }
+    cudaDeviceSynchronize();
+    timing = true;
+    launchStart = std::chrono::steady_clock::now();
+}
+
+void autotune::endLaunch(int samples) {
+    if (!timing) {
+        return;
+    }
+    timing = false;
+    cudaDeviceSynchronize();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - launchStart).count()
+        / std::max(samples, 1);
+    // The warm-up launch pays for first-use allocations and graph capture
+    if (candidateLaunches++ == 0) {
+        candidateMs = 1e30;
+        return;
+    }
+    candidateMs = std::min(candidateMs, ms);
+    if (candidateLaunches <= AUTOTUNE_TRIAL_LAUNCHES) {
+        return;
+    }
+    if (candidateMs < bestMs) {
+        best = candidates[candidate];
+        bestMs = candidateMs;
+    }
+    candidateLaunches = 0;
+    if (++candidate == candidates.size()) {
+        nextStage();
+    }
+}
+
+bool autotune::take(Choice &choice) {
+    if (!winnerPending) {
+        return false;
+    }
+    winnerPending = false;
+    choice = best;
+    return true;
+}
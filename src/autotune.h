@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+
+#include "pathtrace.h"
+
+// Timed launches per candidate, after its warm-up launch
+#define AUTOTUNE_TRIAL_LAUNCHES 3
+
+/**
+ * Launch auto-tuner for the preview, --headless and --server, switched on with
+ *
+ *     --autotune CACHEFILE
+ *
+ * The first launches of a scene measure the pipeline choices one at a time,
+ * keeping the fastest of each before moving to the next: the pipeline, then
+ * for the split pipeline material and ray sorting and the intersection and
+ * shading block sizes. Every candidate traces one warm-up launch and
+ * AUTOTUNE_TRIAL_LAUNCHES timed ones, and is scored by its fastest
+ * wall-clock ms per sample. All candidates render the same image, so their
+ * samples accumulate as usual.
+ *
+ * The winner is appended to CACHEFILE, one line per GPU name, scene file
+ * hash and resolution; a later run of the same scene on the same GPU starts
+ * with it and skips tuning. The cache does not key on the other render
+ * settings, so delete the line to tune again after changing them.
+ */
+namespace autotune {
+    // What the tuner picks
+    struct Choice {
+        int pipeline;           // a PathtracePipeline
+        bool sortByMaterial;
+        bool sortRays;
+        int intersectBlockSize; // for pathtraceOverrideBlockSizes, 0 for the calculator's pick
+        int shadeBlockSize;
+    };
+
+    // Turns tuning on; false if CACHEFILE cannot be written
+    bool start(const std::string &cacheFile);
+
+    bool enabled();
+
+    // With the scene just bound to the devices: takes its cached choice, or
+    // starts tuning it
+    void begin(const std::string &sceneFile, int width, int height);
+
+    // Whether launches are still being measured
+    bool tuning();
+
+    // Before each pathtrace() call: while tuning, points `options` at the
+    // candidate under test and starts its clock
+    void beginLaunch(PathtraceOptions &options);
+
+    // After the pathtrace() call beginLaunch() set up, with the samples per
+    // pixel it traced; waits for the launch while timing it
+    void endLaunch(int samples);
+
+    // True once per begin(), with the winner, when tuning ends or the cache
+    // had it
+    bool take(Choice &choice);
+}
@@ -0,0 +1,515 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+
+#include "benchmark.h"
+#include "imageMetrics.h"
+#include "pathtrace.h"
+#include "scene.h"
+#include "sceneGenerator.h"
+#include "utilities.h"
+
+struct BenchmarkSettings {
+    int referenceSpp;
+    std::vector<int> spp;
+    std::vector<int> filterSizes;
+    std::vector<float> colorWeights;
+    float targetPsnr;
+    bool hardwareRT;        // --backend optix
+    std::vector<int> denoisers;     // DenoiseBackends, from --denoisers atrous,guided,grid,optix,kpn
+    std::vector<glm::ivec2> resolutions;    // --resolutions, empty for each scene's own RES
+    bool radianceCache;     // --radiance-cache: sweep again with PathtraceOptions::radianceCache
+    bool bidirectional;     // --bidirectional: and again with PathtraceOptions::bidirectional
+    bool shortStack;        // --short-stack: and again with PathtraceOptions::shortStack
+    bool compactPaths;      // --compact-paths: and again with PathtraceOptions::compactPaths
+};
+
+// One column of the sweep; denoise == false is the raw accumulated image.
+// The OptiX denoiser has no parameters and gets a single column, and the
+// bilateral grid, which takes no weights, one per filter size.
+struct FilterSetting {
+    bool denoise;
+    int backend;            // a DenoiseBackend
+    int filterSize;
+    float colorWeight;
+};
+
+// The sweeps of a scene, each with its own time-to-quality
+enum BenchmarkSweep {
+    SWEEP_PATH_TRACED,
+    SWEEP_RADIANCE_CACHE,
+    SWEEP_BIDIRECTIONAL,
+    SWEEP_SHORT_STACK,
+    SWEEP_COMPACT_PATHS,
+    SWEEP_COUNT,
+};
+
+struct BenchmarkRow {
+    int spp;
+    int filter;             // index into the filter settings
+    int sweep;              // a BenchmarkSweep
+    float traceMs;          // all iterations up to spp
+    double rays;            // path rays intersected over those iterations
+    double pathBytes;       // and the path buffer traffic of their bounces
+    float denoiseMs;
+    imageMetrics::Scores scores;
+};
+
+static std::vector<int> parseIntList(const char *s) {
+    std::vector<int> values;
+    const char *p = s;
+    while (*p != '\0') {
+        char *end;
+        int value = (int)strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        values.push_back(value);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+static std::vector<float> parseFloatList(const char *s) {
+    std::vector<float> values;
+    const char *p = s;
+    while (*p != '\0') {
+        char *end;
+        float value = strtof(p, &end);
+        if (end == p) {
+            break;
+        }
+        values.push_back(value);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+// Comma-separated denoiser names; unknown ones are skipped
+static std::vector<int> parseDenoiserList(const char *s) {
+    std::vector<int> values;
+    std::string list(s);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        std::string name = list.substr(start, end - start);
+        if (name == "atrous") {
+            values.push_back(DENOISE_ATROUS);
+        } else if (name == "guided") {
+            values.push_back(DENOISE_GUIDED);
+        } else if (name == "grid") {
+            values.push_back(DENOISE_BILATERAL_GRID);
+        } else if (name == "optix") {
+            values.push_back(DENOISE_OPTIX);
+        } else if (name == "kpn") {
+            values.push_back(DENOISE_KERNEL_PREDICTING);
+        }
+        start = end + 1;
+    }
+    return values;
+}
+
+// Comma-separated WIDTHxHEIGHT pairs; malformed ones are skipped
+static std::vector<glm::ivec2> parseResolutionList(const char *s) {
+    std::vector<glm::ivec2> values;
+    const char *p = s;
+    while (*p != '\0') {
+        int width = 0, height = 0, length = 0;
+        if (sscanf(p, "%dx%d%n", &width, &height, &length) == 2 && width > 0 && height > 0) {
+            values.push_back(glm::ivec2(width, height));
+        }
+        const char *comma = strchr(p, ',');
+        if (comma == NULL) {
+            break;
+        }
+        p = comma + 1;
+    }
+    return values;
+}
+
+PathtraceOptions benchmarkPathtraceOptions(bool hardwareRT) {
+    PathtraceOptions options;
+    options.sortByMaterial = false;
+    options.cacheFirstBounce = true;
+    options.pipeline = PIPELINE_SPLIT;
+    options.russianRoulette = false;
+    options.rouletteMinDepth = 3;
+    // One sample per call, so every spp checkpoint is reached exactly
+    options.samplesPerLaunch = 1;
+    options.seedOffset = 0;
+    options.tileRows = 0;
+    options.pixelStride = 1;
+    options.rayCost = false;
+    options.splitSpecular = false;
+    options.adaptiveSampling = false;
+    options.adaptiveThreshold = 0.02f;
+    options.adaptiveMinSamples = 16;
+    options.sampler = SAMPLER_SOBOL;
+    options.antialias = true;
+    options.jitteredGBuffer = false;
+    options.nextEventEstimation = true;
+    options.wideMeshBVH = true;
+    options.sortRays = false;
+    options.specializedShading = false;
+    options.tiledPathOrder = false;
+    options.hardwareRT = hardwareRT;
+    options.gather = GATHER_SEGMENTED;
+    options.accumulateOnTermination = false;
+    options.regeneratePaths = false;
+    options.hitRecords = false;
+    options.deterministic = false;
+    options.radianceCache = false;
+    options.photonCaustics = false;
+    options.restir = false;
+    options.meshLOD = false;
+    options.watertight = false;
+    options.shortStack = false;
+    options.lightTree = false;
+    options.pathGuiding = false;
+    options.rasterPrimary = false;
+    options.tileCulling = false;
+    options.packetCameraRays = false;
+    options.packetShadowRays = false;
+    options.pathSplit = 1;
+    options.compactPaths = false;
+    options.bidirectional = false;
+    options.region = PixelRect();
+    return options;
+}
+
+DenoiseOptions benchmarkDenoiseOptions(int filterSize, float colorWeight) {
+    DenoiseOptions options;
+    options.backend = DENOISE_ATROUS;
+    options.filterSize = filterSize;
+    options.kernel = ATROUS_B3_SPLINE;
+    options.colorWeight = colorWeight;
+    options.normalWeight = 0.35f;
+    options.positionWeight = 0.2f;
+    options.temporal = false;
+    options.varianceGuided = false;
+    options.separable = false;
+    options.halfPrecision = false;
+    options.pyramid = false;
+    options.demodulateAlbedo = false;
+    options.earlyOutThreshold = 0.0f;
+    options.tileConvergence = 0.0f;
+    options.splitSpecular = false;
+    options.specularFilterSize = filterSize;
+    options.specularColorWeight = colorWeight;
+    options.region = PixelRect();
+    return options;
+}
+
+static DenoiseOptions benchmarkDenoiseOptions(const FilterSetting &filter) {
+    DenoiseOptions options = benchmarkDenoiseOptions(filter.filterSize, filter.colorWeight);
+    options.backend = filter.backend;
+    return options;
+}
+
+static const char *denoiserName(const FilterSetting &filter) {
+    if (!filter.denoise) {
+        return "none";
+    }
+    switch (filter.backend) {
+    case DENOISE_OPTIX:
+        return "optix";
+    case DENOISE_GUIDED:
+        return "guided";
+    case DENOISE_BILATERAL_GRID:
+        return "grid";
+    case DENOISE_KERNEL_PREDICTING:
+        return "kpn";
+    default:
+        return "atrous";
+    }
+}
+
+static float elapsedMs(cudaEvent_t start, cudaEvent_t stop) {
+    cudaEventSynchronize(stop);
+    float ms = 0.0f;
+    cudaEventElapsedTime(&ms, start, stop);
+    return ms;
+}
+
+// Benchmarks a scene at `resolution`, or at its own RES if that is zero
+static void benchmarkScene(const char *sceneFile, glm::ivec2 resolution, const BenchmarkSettings &settings,
+        const std::vector<FilterSetting> &filters, FILE *csv) {
+    // Scene has no destructor definition, so like main() this never frees it
+    Scene *scene = new Scene(sceneFile);
+    if (resolution.x > 0) {
+        scene->setResolution(resolution);
+    }
+    const Camera &cam = scene->state.camera;
+    pathtraceInit(scene);
+    // Rows say which backend actually traced, so a build without OptiX
+    // still benchmarks, as cuda
+    const bool hardwareRT = settings.hardwareRT && pathtraceHardwareRTAvailable();
+    // Without the AI denoiser its column would silently repeat A-Trous, so
+    // it is left out instead
+    const bool aiDenoiser = pathtraceAIDenoiserAvailable();
+    PathtraceOptions traceOptions = benchmarkPathtraceOptions(hardwareRT);
+    const LaunchConfiguration &launch = pathtraceLaunchConfiguration();
+    printf("%s at %dx%d: %s (sm_%d, %d SMs), block sizes intersect %d (%.0f%% occupancy),"
+        " shade %d (%.0f%%), megakernel %d (%.0f%%)\n",
+        sceneFile, cam.resolution.x, cam.resolution.y, launch.device, launch.computeCapability, launch.multiprocessors,
+        launch.intersect.blockSize, launch.intersect.occupancy * 100.0f,
+        launch.shade.blockSize, launch.shade.occupancy * 100.0f,
+        launch.megakernel.blockSize, launch.megakernel.occupancy * 100.0f);
+
+    cudaEvent_t start, stop;
+    cudaEventCreate(&start);
+    cudaEventCreate(&stop);
+
+    int maxSpp = 0;
+    for (size_t i = 0; i < settings.spp.size(); i++) {
+        maxSpp = glm::max(maxSpp, settings.spp[i]);
+    }
+
+    // Iterations only seed the sampler, so numbering the reference's after
+    // the sweep's keeps it from sharing their samples
+    printf("%s: tracing %d spp reference\n", sceneFile, settings.referenceSpp);
+    pathtraceReset();
+    for (int iter = 1; iter <= settings.referenceSpp; iter++) {
+        pathtrace(0, maxSpp + iter, traceOptions);
+    }
+    // The reference stays on the device, where every row is scored
+    imageMetrics::setReference(pathtraceDeviceBuffers().image, 1.0f / settings.referenceSpp,
+        cam.resolution.x, cam.resolution.y);
+
+    std::vector<BenchmarkRow> rows;
+
+    // The reference is always path traced in full; with --radiance-cache
+    // the sweep runs again with the cache, which starts out empty, and with
+    // --bidirectional again bidirectionally; --short-stack traces the same
+    // paths as the first sweep, so only its Mrays/s should differ, and
+    // --compact-paths nearly the same, for the path_mb it moves
+    for (int sweep = 0; sweep < SWEEP_COUNT; sweep++) {
+        if ((sweep == SWEEP_RADIANCE_CACHE && !settings.radianceCache)
+                || (sweep == SWEEP_BIDIRECTIONAL && !settings.bidirectional)
+                || (sweep == SWEEP_SHORT_STACK && !settings.shortStack)
+                || (sweep == SWEEP_COMPACT_PATHS && !settings.compactPaths)) {
+            continue;
+        }
+        traceOptions.radianceCache = sweep == SWEEP_RADIANCE_CACHE;
+        traceOptions.bidirectional = sweep == SWEEP_BIDIRECTIONAL;
+        traceOptions.shortStack = sweep == SWEEP_SHORT_STACK;
+        traceOptions.compactPaths = sweep == SWEEP_COMPACT_PATHS;
+        pathtraceReset();
+        float traceMs = 0.0f;
+        double rays = 0.0;
+        double pathBytes = 0.0;
+        for (int iter = 1; iter <= maxSpp; iter++) {
+            cudaEventRecord(start);
+            pathtrace(0, iter, traceOptions);
+            cudaEventRecord(stop);
+            traceMs += elapsedMs(start, stop);
+            rays += (double)pathtraceStats().raysTraced;
+            pathBytes += (double)pathtraceStats().pathBytes;
+
+            if (std::find(settings.spp.begin(), settings.spp.end(), iter) == settings.spp.end()) {
+                continue;
+            }
+            for (size_t f = 0; f < filters.size(); f++) {
+                if (filters[f].denoise && filters[f].backend == DENOISE_OPTIX && !aiDenoiser) {
+                    continue;
+                }
+                if (filters[f].denoise && filters[f].backend == DENOISE_KERNEL_PREDICTING
+                        && !pathtraceDenoiseNetworkAvailable()) {
+                    continue;
+                }
+                BenchmarkRow row;
+                row.spp = iter;
+                row.filter = (int)f;
+                row.sweep = sweep;
+                row.traceMs = traceMs;
+                row.rays = rays;
+                row.pathBytes = pathBytes;
+                row.denoiseMs = 0.0f;
+                if (filters[f].denoise) {
+                    cudaEventRecord(start, pathtraceDisplayStream());
+                    denoise(iter, benchmarkDenoiseOptions(filters[f]));
+                    cudaEventRecord(stop, pathtraceDisplayStream());
+                    row.denoiseMs = elapsedMs(start, stop);
+                    row.scores = imageMetrics::compare(pathtraceDeviceBuffers().denoised, 1.0f);
+                } else {
+                    row.scores = imageMetrics::compare(pathtraceDeviceBuffers().image, 1.0f / iter);
+                }
+                rows.push_back(row);
+            }
+            printf("%s: %d spp done\n", sceneFile, iter);
+        }
+    }
+
+    // Time-to-quality: the cheapest checkpoint at which each filter setting
+    // reaches the target PSNR, or blank if none does, in each sweep
+    std::vector<float> timeToQuality(SWEEP_COUNT * filters.size(), -1.0f);
+    for (size_t r = 0; r < rows.size(); r++) {
+        const BenchmarkRow &row = rows[r];
+        float total = row.traceMs + row.denoiseMs;
+        float &best = timeToQuality[row.filter + row.sweep * filters.size()];
+        if (row.scores.psnr >= settings.targetPsnr && (best < 0.0f || total < best)) {
+            best = total;
+        }
+    }
+
+    for (size_t r = 0; r < rows.size(); r++) {
+        const BenchmarkRow &row = rows[r];
+        const FilterSetting &filter = filters[row.filter];
+        const DenoiseOptions options = benchmarkDenoiseOptions(filter);
+        // The OptiX denoiser takes no settings, and the grid and network no weights
+        const bool sized = filter.denoise && filter.backend != DENOISE_OPTIX;
+        const bool weighted = sized && filter.backend != DENOISE_BILATERAL_GRID
+            && filter.backend != DENOISE_KERNEL_PREDICTING;
+        const float ttq = timeToQuality[row.filter + row.sweep * filters.size()];
+        fprintf(csv, "%s,%d,%d,%s,%s,%.4f,%d,%d,%s,%d,%d,%d,%s,%d,%g,%g,%g,%.4f,%.4f,%.2f,%.4f,%.4f,%.6f,%.6f,",
+                sceneFile, cam.resolution.x, cam.resolution.y, hardwareRT ? "optix" : "cuda",
+                Scene::bvhBuilder == BVH_SAH ? "sah" : "median", scene->bvhBuildMs,
+                row.sweep == SWEEP_RADIANCE_CACHE ? 1 : 0, row.sweep == SWEEP_BIDIRECTIONAL ? 1 : 0,
+                row.sweep == SWEEP_SHORT_STACK ? "short" : "full", row.sweep == SWEEP_COMPACT_PATHS ? 1 : 0,
+                row.spp, filter.denoise ? 1 : 0, denoiserName(filter),
+                sized ? options.filterSize : 0,
+                weighted ? options.colorWeight : 0.0f,
+                weighted ? options.normalWeight : 0.0f,
+                weighted ? options.positionWeight : 0.0f,
+                row.traceMs, row.traceMs > 0.0f ? row.rays / (row.traceMs * 1e3) : 0.0, row.pathBytes / 1e6,
+                row.denoiseMs, row.scores.psnr, row.scores.ssim, row.scores.flip);
+        if (ttq >= 0.0f) {
+            fprintf(csv, "%.4f", ttq);
+        }
+        fprintf(csv, "\n");
+    }
+    fflush(csv);
+
+    cudaEventDestroy(start);
+    cudaEventDestroy(stop);
+    imageMetrics::release();
+    pathtraceFree();
+}
+
+int runBenchmark(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: --benchmark OUT.csv [--reference-spp N] [--spp A,B,...]"
+            " [--filter-sizes A,...] [--color-weights A,...] [--target-psnr DB]"
+            " [--backend cuda|optix] [--denoisers atrous,guided,grid,optix,kpn] [--resolutions WxH,...] [--radiance-cache] [--bidirectional] [--short-stack] [--compact-paths]"
+            " [--synthetic A,B,... [generator options]] [SCENEFILE.txt...]\n");
+        return 1;
+    }
+
+    BenchmarkSettings settings;
+    settings.referenceSpp = 4096;
+    settings.spp = parseIntList("1,2,4,8,16,32,64,128,256");
+    settings.filterSizes = parseIntList("16,32,64,80");
+    settings.colorWeights = parseFloatList("0.25,0.45,0.8");
+    settings.targetPsnr = 30.0f;
+    settings.hardwareRT = false;
+    settings.denoisers.push_back(DENOISE_ATROUS);
+    settings.radianceCache = false;
+    settings.bidirectional = false;
+    settings.shortStack = false;
+    settings.compactPaths = false;
+
+    const char *csvFile = argv[0];
+    std::vector<std::string> sceneFiles;
+    std::vector<int> syntheticObjects;
+    SceneGeneratorSettings generator = sceneGenerator::defaults();
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--reference-spp") == 0 && hasValue) {
+            settings.referenceSpp = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--spp") == 0 && hasValue) {
+            settings.spp = parseIntList(argv[++i]);
+        } else if (strcmp(argv[i], "--filter-sizes") == 0 && hasValue) {
+            settings.filterSizes = parseIntList(argv[++i]);
+        } else if (strcmp(argv[i], "--color-weights") == 0 && hasValue) {
+            settings.colorWeights = parseFloatList(argv[++i]);
+        } else if (strcmp(argv[i], "--target-psnr") == 0 && hasValue) {
+            settings.targetPsnr = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--backend") == 0 && hasValue) {
+            settings.hardwareRT = strcmp(argv[++i], "optix") == 0;
+        } else if (strcmp(argv[i], "--denoisers") == 0 && hasValue) {
+            settings.denoisers = parseDenoiserList(argv[++i]);
+        } else if (strcmp(argv[i], "--resolutions") == 0 && hasValue) {
+            settings.resolutions = parseResolutionList(argv[++i]);
+        } else if (strcmp(argv[i], "--radiance-cache") == 0) {
+            settings.radianceCache = true;
+        } else if (strcmp(argv[i], "--bidirectional") == 0) {
+            settings.bidirectional = true;
+        } else if (strcmp(argv[i], "--short-stack") == 0) {
+            settings.shortStack = true;
+        } else if (strcmp(argv[i], "--compact-paths") == 0) {
+            settings.compactPaths = true;
+        } else if (strcmp(argv[i], "--synthetic") == 0 && hasValue) {
+            syntheticObjects = parseIntList(argv[++i]);
+        } else if (sceneGenerator::takeOption(i, argc, argv, generator)) {
+            continue;
+        } else {
+            sceneFiles.push_back(argv[i]);
+        }
+    }
+    // Generated scenes are written next to the CSV and removed after use
+    std::vector<std::string> synthetic = sceneGenerator::writeScenes(csvFile, "synthetic",
+        syntheticObjects, generator);
+    if (synthetic.size() != syntheticObjects.size()) {
+        printf("--benchmark: cannot write synthetic scenes next to %s\n", csvFile);
+        return 1;
+    }
+    sceneFiles.insert(sceneFiles.end(), synthetic.begin(), synthetic.end());
+    if (sceneFiles.empty()) {
+        printf("--benchmark: no scene files given\n");
+        return 1;
+    }
+
+    std::vector<FilterSetting> filters;
+    FilterSetting raw = { false, DENOISE_ATROUS, 0, 0.0f };
+    filters.push_back(raw);
+    for (size_t d = 0; d < settings.denoisers.size(); d++) {
+        if (settings.denoisers[d] == DENOISE_OPTIX) {
+            FilterSetting filter = { true, DENOISE_OPTIX, 0, 0.0f };
+            filters.push_back(filter);
+            continue;
+        }
+        for (size_t s = 0; s < settings.filterSizes.size(); s++) {
+            if (settings.denoisers[d] == DENOISE_BILATERAL_GRID
+                    || settings.denoisers[d] == DENOISE_KERNEL_PREDICTING) {
+                FilterSetting filter = { true, settings.denoisers[d], settings.filterSizes[s], 0.0f };
+                filters.push_back(filter);
+                continue;
+            }
+            for (size_t c = 0; c < settings.colorWeights.size(); c++) {
+                FilterSetting filter = { true, settings.denoisers[d], settings.filterSizes[s],
+                    settings.colorWeights[c] };
+                filters.push_back(filter);
+            }
+        }
+    }
+
+    FILE *csv = fopen(csvFile, "w");
+    if (csv == NULL) {
+        printf("--benchmark: cannot open %s\n", csvFile);
+        sceneGenerator::removeScenes(synthetic);
+        return 1;
+    }
+    fprintf(csv, "scene,width,height,backend,bvh,bvh_build_ms,radiance_cache,bidirectional,traversal,compact_paths,spp,denoise,denoiser,filter_size,color_weight,normal_weight,"
+        "position_weight,trace_ms,mrays_per_s,path_mb,denoise_ms,psnr,ssim,flip,time_to_quality_ms\n");
+    // Without --resolutions each scene runs once at its own RES
+    std::vector<glm::ivec2> resolutions = settings.resolutions;
+    if (resolutions.empty()) {
+        resolutions.push_back(glm::ivec2(0));
+    }
+    for (size_t i = 0; i < sceneFiles.size(); i++) {
+        for (size_t r = 0; r < resolutions.size(); r++) {
+            benchmarkScene(sceneFiles[i].c_str(), resolutions[r], settings, filters, csv);
+        }
+    }
+    fclose(csv);
+    sceneGenerator::removeScenes(synthetic);
+    return 0;
+}
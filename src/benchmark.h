@@ -0,0 +1,61 @@
+#pragma once
+
+#include "pathtrace.h"
+
+/**
+ * Headless denoiser benchmark, run with
+ *
+ *     cis565_denoiser --benchmark OUT.csv [options] [SCENEFILE.txt...]
+ *
+ * For every scene, at each --resolutions size, a reference is traced at
+ * --reference-spp samples, then the image is traced again while the filter
+ * settings are swept at each of the --spp checkpoints. Every row of OUT.csv
+ * holds one (scene, resolution, spp, filter) combination with its path trace and denoise times, PSNR, SSIM and FLIP
+ * against the reference, scored on the device by imageMetrics.h, and the time the filter settings first reached
+ * --target-psnr on that scene. Rows also carry the intersection backend,
+ * the host BVH builder (--bvh) and its build time for the scene, and the
+ * path rays per second traced up to that checkpoint; the denoiser column
+ * says which denoiser filtered the row, and radiance_cache whether paths
+ * ended at the radiance cache (PathtraceOptions::radianceCache),
+ * bidirectional whether they were traced bidirectionally and traversal
+ * whether the BVH was walked on the full stack or the short one.
+ *
+ * Options:
+ *     --reference-spp N     samples per pixel of the reference (default 4096)
+ *     --spp A,B,...         checkpoints to evaluate (default 1,2,4,...,256)
+ *     --filter-sizes A,...  filter footprints to sweep (default 16,32,64,80)
+ *     --color-weights A,... colour weights to sweep (default 0.25,0.45,0.8)
+ *     --target-psnr DB      quality for time-to-quality (default 30)
+ *     --backend cuda|optix  intersect with the CUDA kernels (default) or
+ *                           OptiX, where the build and GPU support it
+ *     --denoisers A,...     denoisers to compare: atrous (default), guided
+ *                           and grid, whose settings are swept, optix,
+ *                           the OptiX AI denoiser, where the build and GPU
+ *                           support it, and kpn, the kernel-predicting
+ *                           network, given --denoise-network
+ *     --resolutions WxH,... render every scene at each of these instead of
+ *                           its RES, e.g. 1920x1080,3840x2160 to see how the
+ *                           denoisers' cost grows with the image
+ *     --radiance-cache      sweep a second time with the radiance cache, for
+ *                           time-to-quality with and without it; the
+ *                           reference is traced without
+ *     --bidirectional       sweep once more tracing bidirectionally
+ *                           (PathtraceOptions::bidirectional), for its
+ *                           time-to-quality against plain path tracing
+ *     --short-stack         sweep once more on the short traversal stack
+ *                           (PathtraceOptions::shortStack), for Mrays/s
+ *                           against the full stack; with --synthetic, at
+ *                           each scene size
+ *     --synthetic A,B,...   also benchmark generated scenes of A, B, ...
+ *                           objects, for Mrays/s against scene size; the
+ *                           options of sceneGenerator.h shape them
+ *
+ * Returns the process exit code.
+ */
+int runBenchmark(int argc, char **argv);
+
+// The settings every benchmark traces with, also used by kernel_benchmark
+PathtraceOptions benchmarkPathtraceOptions(bool hardwareRT);
+
+// The control panel's denoiser defaults, with the swept terms replaced
+DenoiseOptions benchmarkDenoiseOptions(int filterSize, float colorWeight);
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "intersections.h"
+
+/**
+ * PathtraceOptions::bidirectional: bidirectional path tracing for scenes
+ * lit mostly through indirect paths. Each sample pairs a light subpath,
+ * leaving a point on Scene::lights, with the pixel's camera subpath, and
+ * sums every way of joining the two (Veach 1997): the camera subpath
+ * hitting an emitter, next-event estimation, connections of each camera
+ * vertex to each stored light vertex, and light vertices connected to the
+ * camera and splatted into the pixel they project to. The strategies are
+ * weighed by the power heuristic, carried along both subpaths as the
+ * partial sums dVCM and dVC of Georgiev's recursive formulation
+ * ("Implementing Vertex Connection and Merging", 2012), so a connection
+ * needs nothing but its two end vertices.
+ *
+ * Only diffuse lobes are connected; reflective and refractive bounces,
+ * glossy ones included, are sampled through as specular vertices. Mesh
+ * emitters, whose hit triangle is not known (see emitterHitWeight), and
+ * the environment are only found by the camera subpath, at full weight.
+ * The pass ignores participating media and takes a pinhole camera.
+ */
+
+// Light vertices kept per subpath, past its point on the light; the subpath ends there
+#define BDPT_MAX_LIGHT_VERTICES 6
+// Camera and light subpaths traced at once, bounding the vertex and queue buffers
+#define BDPT_BAND_PATHS (1 << 19)
+
+// A diffuse vertex of a light subpath
+struct BdptVertex {
+    glm::vec3 position;
+    float dVCM;
+    glm::vec3 normal;       // faces the side the subpath arrived from
+    float dVC;
+    glm::vec3 throughput;   // of the subpath up to here, over its pdf
+    float diffuse;          // the diffuse lobe's weight, 1 - hasReflective - hasRefractive
+    glm::vec3 albedo;
+    int pathLength;         // segments from the light
+    glm::vec3 incoming;     // unit, back towards the previous vertex
+    float padding;
+};
+
+// A camera subpath between bounces, in the wavefront's buffer
+struct BdptCameraPath {
+    glm::vec3 origin;
+    float dVCM;
+    glm::vec3 direction;
+    float dVC;
+    glm::vec3 throughput;
+    int pathLength;         // segments traced so far; 0 once it has ended
+};
+
+// A contribution waiting on the visibility of the segment from origin
+struct BdptConnection {
+    glm::vec3 origin;
+    float distance;
+    glm::vec3 direction;
+    int pixel;
+    glm::vec3 contribution;
+    float padding;
+};
+
+// The connections of one wavefront step, resolved before the next
+struct BdptQueue {
+    BdptConnection * connections;
+    int * count;
+    int capacity;
+};
+
+// The MIS heuristic every partial sum is raised by: the power heuristic, beta = 2
+__host__ __device__ inline float bdptMis(float pdf) {
+    return pdf * pdf;
+}
+
+/**
+ * The diffuse lobe of a vertex scattering from direction `incoming` (back
+ * to where the path came from) into `outgoing`, both on the side of
+ * `normal`: its BSDF value `f`, and the solid-angle pdfs of sampling
+ * `outgoing` from `incoming` and the reverse, which include the lobe's
+ * pick. Returns false where either side is below the surface.
+ */
+__host__ __device__ inline bool bdptDiffuse(glm::vec3 albedo, float diffuse, glm::vec3 normal,
+        glm::vec3 incoming, glm::vec3 outgoing, glm::vec3 &f, float &pdfForward, float &pdfReverse) {
+    const float cosIn = glm::dot(normal, incoming);
+    const float cosOut = glm::dot(normal, outgoing);
+    if (!(diffuse > 0.0f) || cosIn <= 0.0f || cosOut <= 0.0f) {
+        return false;
+    }
+    f = albedo * (diffuse / PI);
+    pdfForward = diffuse * cosOut / PI;
+    pdfReverse = diffuse * cosIn / PI;
+    return true;
+}
+
+__host__ __device__ inline void bdptPush(const BdptQueue &queue, glm::vec3 origin, glm::vec3 direction,
+        float distance, int pixel, glm::vec3 contribution) {
+#ifdef __CUDA_ARCH__
+    const int slot = atomicAdd(queue.count, 1);
+#else
+    const int slot = (*queue.count)++;
+#endif
+    if (slot < queue.capacity) {
+        BdptConnection &connection = queue.connections[slot];
+        connection.origin = origin;
+        connection.distance = distance;
+        connection.direction = direction;
+        connection.pixel = pixel;
+        connection.contribution = contribution;
+    }
+}
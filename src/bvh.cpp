@@ -0,0 +1,410 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <thread>
+
+#include "bvh.h"
+
+AABB BVH::emptyBounds() {
+    AABB box;
+    box.min = glm::vec3(FLT_MAX);
+    box.max = glm::vec3(-FLT_MAX);
+    return box;
+}
+
+void BVH::growBounds(AABB &box, const AABB &other) {
+    box.min = glm::min(box.min, other.min);
+    box.max = glm::max(box.max, other.max);
+}
+
+void BVH::growBounds(AABB &box, const glm::vec3 &point) {
+    box.min = glm::min(box.min, point);
+    box.max = glm::max(box.max, point);
+}
+
+AABB BVH::transformBounds(const glm::mat4 &transform, const AABB &box) {
+    AABB result = emptyBounds();
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 corner((i & 1) ? box.max.x : box.min.x,
+                (i & 2) ? box.max.y : box.min.y,
+                (i & 4) ? box.max.z : box.min.z);
+        growBounds(result, glm::vec3(transform * glm::vec4(corner, 1.0f)));
+    }
+    return result;
+}
+
+AABB BVH::geomBounds(const Geom &geom) {
+    AABB unitCube;
+    unitCube.min = glm::vec3(-0.5f);
+    unitCube.max = glm::vec3(0.5f);
+    return transformBounds(geom.transform, unitCube);
+}
+
+/**
+ * Median split on the longest axis of the centroid bounds. Returns the
+ * index of the node built for primIndices[begin, end).
+ */
+static int buildRecursive(const std::vector<AABB> &bounds, const std::vector<glm::vec3> &centroids,
+        std::vector<BVHNode> &nodes, std::vector<int> &primIndices,
+        int begin, int end, int maxLeafSize) {
+    int nodeIndex = nodes.size();
+    nodes.push_back(BVHNode());
+
+    AABB box = BVH::emptyBounds();
+    AABB centroidBox = BVH::emptyBounds();
+    for (int i = begin; i < end; i++) {
+        BVH::growBounds(box, bounds[primIndices[i]]);
+        BVH::growBounds(centroidBox, centroids[primIndices[i]]);
+    }
+
+    glm::vec3 extent = centroidBox.max - centroidBox.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+    BVHNode node;
+    node.bboxMin = box.min;
+    node.bboxMax = box.max;
+    if (end - begin <= maxLeafSize || extent[axis] <= 0.0f) {
+        node.offset = begin;
+        node.count = end - begin;
+    } else {
+        int mid = (begin + end) / 2;
+        std::nth_element(primIndices.begin() + begin, primIndices.begin() + mid,
+                primIndices.begin() + end, [&](int a, int b) {
+                    return centroids[a][axis] < centroids[b][axis];
+                });
+
+        // The left child always directly follows its parent
+        buildRecursive(bounds, centroids, nodes, primIndices, begin, mid, maxLeafSize);
+        node.offset = buildRecursive(bounds, centroids, nodes, primIndices, mid, end, maxLeafSize);
+        node.count = 0;
+    }
+    nodes[nodeIndex] = node;
+    return nodeIndex;
+}
+
+// Bins per axis for the SAH split search
+#define SAH_BINS 16
+// Relative cost of visiting a node against intersecting one primitive
+#define SAH_TRAVERSAL_COST 1.0f
+// Subtrees over at least this many primitives build their right half on
+// another thread
+#define SAH_PARALLEL_MIN 4096
+
+static float surfaceArea(const AABB &box) {
+    glm::vec3 d = glm::max(box.max - box.min, glm::vec3(0.0f));
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+struct SAHBin {
+    AABB box;
+    int count;
+};
+
+struct SAHInput {
+    const std::vector<AABB> &bounds;
+    const std::vector<glm::vec3> &centroids;
+    std::vector<int> &primIndices;
+    int maxLeafSize;
+};
+
+/**
+ * Appends the SAH subtree for primIndices[begin, end) to `nodes`, with
+ * interior offsets relative to the start of `nodes`. Each node tries
+ * SAH_BINS equal-width centroid bins on all three axes and takes the
+ * cheapest boundary, falling back to the median when no split beats a
+ * leaf that would be too big. Large subtrees hand their right half to a
+ * new thread (while `spawnDepth` lasts) and splice it in afterwards.
+ *
+ * @return the index of the node built.
+ */
+static int buildSAHRecursive(const SAHInput &in, std::vector<BVHNode> &nodes,
+        int begin, int end, int spawnDepth) {
+    int nodeIndex = nodes.size();
+    nodes.push_back(BVHNode());
+
+    AABB box = BVH::emptyBounds();
+    AABB centroidBox = BVH::emptyBounds();
+    for (int i = begin; i < end; i++) {
+        BVH::growBounds(box, in.bounds[in.primIndices[i]]);
+        BVH::growBounds(centroidBox, in.centroids[in.primIndices[i]]);
+    }
+    const int count = end - begin;
+    const glm::vec3 extent = centroidBox.max - centroidBox.min;
+
+    // Costs are in units of one primitive intersection over the node's area
+    float bestCost = FLT_MAX;
+    int bestAxis = -1;
+    int bestSplit = 0;
+    for (int axis = 0; count > 1 && axis < 3; axis++) {
+        if (extent[axis] <= 0.0f) {
+            continue;
+        }
+        SAHBin bins[SAH_BINS];
+        for (int b = 0; b < SAH_BINS; b++) {
+            bins[b].box = BVH::emptyBounds();
+            bins[b].count = 0;
+        }
+        const float scale = SAH_BINS / extent[axis];
+        for (int i = begin; i < end; i++) {
+            int p = in.primIndices[i];
+            int b = std::min((int)((in.centroids[p][axis] - centroidBox.min[axis]) * scale), SAH_BINS - 1);
+            BVH::growBounds(bins[b].box, in.bounds[p]);
+            bins[b].count++;
+        }
+
+        // Right-to-left sweep for the right sides, then left-to-right
+        float rightCost[SAH_BINS];
+        AABB right = BVH::emptyBounds();
+        int rightCount = 0;
+        for (int b = SAH_BINS - 1; b > 0; b--) {
+            BVH::growBounds(right, bins[b].box);
+            rightCount += bins[b].count;
+            rightCost[b] = rightCount > 0 ? surfaceArea(right) * rightCount : 0.0f;
+        }
+        AABB left = BVH::emptyBounds();
+        int leftCount = 0;
+        for (int b = 1; b < SAH_BINS; b++) {
+            BVH::growBounds(left, bins[b - 1].box);
+            leftCount += bins[b - 1].count;
+            if (leftCount == 0 || leftCount == count) {
+                continue;
+            }
+            float cost = surfaceArea(left) * leftCount + rightCost[b];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    const float area = surfaceArea(box);
+    const float splitCost = bestAxis >= 0 && area > 0.0f
+        ? SAH_TRAVERSAL_COST + bestCost / area : FLT_MAX;
+    const bool tooBig = count > in.maxLeafSize;
+    int mid = begin;
+    if (bestAxis >= 0 && (tooBig || splitCost < count)) {
+        const float scale = SAH_BINS / extent[bestAxis];
+        const float minimum = centroidBox.min[bestAxis];
+        mid = std::partition(in.primIndices.begin() + begin, in.primIndices.begin() + end, [&](int p) {
+            return std::min((int)((in.centroids[p][bestAxis] - minimum) * scale), SAH_BINS - 1) < bestSplit;
+        }) - in.primIndices.begin();
+    } else if (tooBig && count > 1) {
+        // Every centroid in one place, or every bin split degenerate: the
+        // median by index still keeps leaves within maxLeafSize
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        mid = (begin + end) / 2;
+        std::nth_element(in.primIndices.begin() + begin, in.primIndices.begin() + mid,
+                in.primIndices.begin() + end, [&](int a, int b) {
+                    return in.centroids[a][axis] < in.centroids[b][axis];
+                });
+    }
+
+    BVHNode node;
+    node.bboxMin = box.min;
+    node.bboxMax = box.max;
+    if (mid == begin) {
+        node.offset = begin;
+        node.count = count;
+        nodes[nodeIndex] = node;
+        return nodeIndex;
+    }
+
+    node.count = 0;
+    if (count >= SAH_PARALLEL_MIN && spawnDepth > 0) {
+        std::vector<BVHNode> rightNodes;
+        std::thread rightThread([&]() {
+            rightNodes.reserve(2 * (end - mid));
+            buildSAHRecursive(in, rightNodes, mid, end, spawnDepth - 1);
+        });
+        buildSAHRecursive(in, nodes, begin, mid, spawnDepth - 1);
+        rightThread.join();
+
+        // The right subtree's own child links move with it
+        node.offset = nodes.size();
+        for (size_t i = 0; i < rightNodes.size(); i++) {
+            if (rightNodes[i].count == 0) {
+                rightNodes[i].offset += node.offset;
+            }
+        }
+        nodes.insert(nodes.end(), rightNodes.begin(), rightNodes.end());
+    } else {
+        buildSAHRecursive(in, nodes, begin, mid, spawnDepth);
+        node.offset = buildSAHRecursive(in, nodes, mid, end, spawnDepth);
+    }
+    nodes[nodeIndex] = node;
+    return nodeIndex;
+}
+
+void BVH::build(const std::vector<AABB> &bounds,
+        std::vector<BVHNode> &nodes, std::vector<int> &primIndices,
+        int maxLeafSize, BVHBuilder builder) {
+    nodes.clear();
+    primIndices.resize(bounds.size());
+    if (bounds.empty()) {
+        return;
+    }
+
+    std::vector<glm::vec3> centroids(bounds.size());
+    for (size_t i = 0; i < bounds.size(); i++) {
+        centroids[i] = 0.5f * (bounds[i].min + bounds[i].max);
+        primIndices[i] = i;
+    }
+
+    nodes.reserve(2 * bounds.size());
+    if (builder == BVH_SAH) {
+        // Thread spawning stops once every core has a subtree
+        int spawnDepth = 0;
+        for (unsigned cores = std::thread::hardware_concurrency(); cores > 1; cores /= 2) {
+            spawnDepth++;
+        }
+        SAHInput in = { bounds, centroids, primIndices, maxLeafSize };
+        buildSAHRecursive(in, nodes, 0, bounds.size(), spawnDepth);
+    } else {
+        buildRecursive(bounds, centroids, nodes, primIndices, 0, bounds.size(), maxLeafSize);
+    }
+}
+
+void BVH::refit(std::vector<BVHNode> &nodes, const std::vector<int> &primIndices,
+        const std::vector<AABB> &bounds) {
+    // Children always follow their parent, so a backwards sweep meets them first
+    for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+        BVHNode &node = nodes[i];
+        AABB box = emptyBounds();
+        if (node.count > 0) {
+            for (int k = node.offset; k < node.offset + node.count; k++) {
+                growBounds(box, bounds[primIndices[k]]);
+            }
+        } else {
+            const BVHNode &left = nodes[i + 1];
+            const BVHNode &right = nodes[node.offset];
+            growBounds(box, left.bboxMin);
+            growBounds(box, left.bboxMax);
+            growBounds(box, right.bboxMin);
+            growBounds(box, right.bboxMax);
+        }
+        node.bboxMin = box.min;
+        node.bboxMax = box.max;
+    }
+}
+
+static float boxArea(const BVHNode &node) {
+    glm::vec3 d = node.bboxMax - node.bboxMin;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+/**
+ * 8-bit grid coordinates of [low, high] from `origin` at step 2^exponent,
+ * rounded outwards so that decoding as origin + q * step (exact, since the
+ * step is a power of two) never shrinks the range.
+ */
+static void quantizeRange(float origin, int exponent, float low, float high,
+        unsigned char &qLow, unsigned char &qHigh) {
+    const float step = ldexpf(1.0f, exponent);
+    int a = glm::clamp((int)floorf((low - origin) / step), 0, 255);
+    while (a > 0 && origin + a * step > low) {
+        a--;
+    }
+    int b = glm::clamp((int)ceilf((high - origin) / step), 0, 255);
+    while (b < 255 && origin + b * step < high) {
+        b++;
+    }
+    qLow = (unsigned char)a;
+    qHigh = (unsigned char)b;
+}
+
+/**
+ * Sets node's origin, grid steps and quantized child boxes from the boxes
+ * of its `count` children
+ */
+static void quantizeChildren(WideBVHNode &node, const BVHNode *const *children, int count) {
+    AABB box = BVH::emptyBounds();
+    for (int c = 0; c < count; c++) {
+        BVH::growBounds(box, children[c]->bboxMin);
+        BVH::growBounds(box, children[c]->bboxMax);
+    }
+    node.origin = box.min;
+    node.childCount = count;
+    for (int axis = 0; axis < 3; axis++) {
+        // The smallest step that spans the box in 255 cells
+        float extent = box.max[axis] - box.min[axis];
+        int exponent = extent > 0.0f ? (int)ceilf(log2f(extent / 255.0f)) : -126;
+        exponent = glm::clamp(exponent, -126, 127);
+        while (exponent < 127 && box.min[axis] + 255.0f * ldexpf(1.0f, exponent) < box.max[axis]) {
+            exponent++;
+        }
+        node.exponent[axis] = (signed char)exponent;
+        for (int c = 0; c < count; c++) {
+            quantizeRange(box.min[axis], exponent, children[c]->bboxMin[axis],
+                    children[c]->bboxMax[axis], node.lo[axis][c], node.hi[axis][c]);
+        }
+    }
+}
+
+// Appends the wide node for binary interior node `index` and its subtree
+static int collapseRecursive(const std::vector<BVHNode> &nodes, int index,
+        std::vector<WideBVHNode> &wide) {
+    int children[BVH_WIDTH] = { index + 1, nodes[index].offset };
+    int count = 2;
+    while (count < BVH_WIDTH) {
+        int open = -1;
+        for (int c = 0; c < count; c++) {
+            if (nodes[children[c]].count == 0
+                    && (open < 0 || boxArea(nodes[children[c]]) > boxArea(nodes[children[open]]))) {
+                open = c;
+            }
+        }
+        if (open < 0) {
+            break;
+        }
+        int opened = children[open];
+        children[open] = opened + 1;
+        children[count++] = nodes[opened].offset;
+    }
+
+    const int wideIndex = wide.size();
+    wide.push_back(WideBVHNode());
+
+    WideBVHNode node = {};
+    const BVHNode *childNodes[BVH_WIDTH];
+    for (int c = 0; c < count; c++) {
+        childNodes[c] = &nodes[children[c]];
+    }
+    quantizeChildren(node, childNodes, count);
+    for (int c = 0; c < count; c++) {
+        if (childNodes[c]->count > 0) {
+            node.child[c] = childNodes[c]->offset;
+            node.triangleCount[c] = (unsigned char)childNodes[c]->count;
+        } else {
+            node.child[c] = collapseRecursive(nodes, children[c], wide);
+            node.triangleCount[c] = 0;
+        }
+    }
+    wide[wideIndex] = node;
+    return wideIndex;
+}
+
+bool BVH::collapseWide(const std::vector<BVHNode> &nodes, std::vector<WideBVHNode> &wide) {
+    wide.clear();
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].count > 255) {
+            return false;
+        }
+    }
+    if (nodes.empty()) {
+        return true;
+    }
+    if (nodes[0].count > 0) {
+        // A lone leaf becomes a wide node with one child
+        WideBVHNode node = {};
+        const BVHNode *leaf = &nodes[0];
+        quantizeChildren(node, &leaf, 1);
+        node.child[0] = leaf->offset;
+        node.triangleCount[0] = (unsigned char)leaf->count;
+        wide.push_back(node);
+        return true;
+    }
+    wide.reserve(nodes.size() / 2 + 1);
+    collapseRecursive(nodes, 0, wide);
+    return true;
+}
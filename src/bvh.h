@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+#include "glm/glm.hpp"
+
+#include "sceneStructs.h"
+
+/**
+ * Host-side bounding volume hierarchy construction. The result is a flat
+ * node array in depth-first order (see BVHNode) plus the primitive indices
+ * that leaves refer to.
+ */
+
+// How BVH::build picks its splits
+enum BVHBuilder {
+    BVH_MEDIAN,     // centroid median on the longest axis: fast, looser trees
+    BVH_SAH,        // binned surface area heuristic on all cores: slower, faster to trace
+};
+
+namespace BVH {
+    extern AABB emptyBounds();
+    extern void growBounds(AABB &box, const AABB &other);
+    extern void growBounds(AABB &box, const glm::vec3 &point);
+
+    extern AABB transformBounds(const glm::mat4 &transform, const AABB &box);
+
+    // World-space bounds of a sphere or cube Geom; both fit in the unit cube
+    extern AABB geomBounds(const Geom &geom);
+
+    /**
+     * Builds a tree over the primitive bounds. Median leaves hold at most
+     * maxLeafSize primitives; SAH ones too, but a SAH node of that size or
+     * smaller is still split when the heuristic says that is cheaper.
+     */
+    extern void build(const std::vector<AABB> &bounds,
+            std::vector<BVHNode> &nodes, std::vector<int> &primIndices,
+            int maxLeafSize = 2, BVHBuilder builder = BVH_MEDIAN);
+
+    /**
+     * Collapses the binary tree in nodes (as built above) into a 4-wide one,
+     * by repeatedly opening the largest interior child of each node until it
+     * has BVH_WIDTH children. Wide child links index `wide`, leaf ones the
+     * same primitive range as before. Returns false, leaving `wide` empty,
+     * if a leaf holds more primitives than a wide node can count.
+     */
+    extern bool collapseWide(const std::vector<BVHNode> &nodes, std::vector<WideBVHNode> &wide);
+
+    // Recomputes every node's box from new primitive bounds, keeping the tree
+    extern void refit(std::vector<BVHNode> &nodes, const std::vector<int> &primIndices,
+            const std::vector<AABB> &bounds);
+}
@@ -0,0 +1,336 @@
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "cpuRenderer.h"
+#include "gbuffer.h"
+
+// Tiles are square runs of pixels, small enough that a few per thread
+// balance the load and a batch of their paths stays in cache
+#define CPU_TILE_SIZE 16
+// Samples of a tile one batch traces; more are traced batch after batch
+#define CPU_BATCH_SAMPLES 4
+
+// A tile of the stacked image
+struct CpuTile {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+/**
+ * One thread's tiles. The owner takes them from the front, thieves from
+ * the back, so a steal takes the work furthest from what the owner is on.
+ */
+struct TileQueue {
+    std::mutex lock;
+    std::deque<int> tiles;
+};
+
+/**
+ * A batch of paths in structure-of-arrays form, a field per array like
+ * PathSegments, so each bounce's loop over the live paths walks them in
+ * order. `live` lists the paths still bouncing.
+ */
+struct PathBatch {
+    std::vector<glm::vec3> origin;
+    std::vector<glm::vec3> direction;
+    std::vector<glm::vec2> cone;
+    std::vector<glm::vec3> color;
+    std::vector<glm::vec3> radiance;
+    std::vector<float> scatterPdf;
+    std::vector<int> pixel;
+    std::vector<int> sample;
+    std::vector<int> remainingBounces;
+    std::vector<int> live;
+
+    void resize(int n) {
+        origin.resize(n);
+        direction.resize(n);
+        cone.resize(n);
+        color.resize(n);
+        radiance.resize(n);
+        scatterPdf.resize(n);
+        pixel.resize(n);
+        sample.resize(n);
+        remainingBounces.resize(n);
+    }
+
+    PathSegment load(int i) const {
+        PathSegment segment;
+        segment.ray.origin = origin[i];
+        segment.ray.direction = direction[i];
+        segment.ray.coneWidth = cone[i].x;
+        segment.ray.coneSpread = cone[i].y;
+        segment.color = color[i];
+        segment.radiance = radiance[i];
+        segment.scatterPdf = scatterPdf[i];
+        segment.pixelIndex = pixel[i];
+        segment.sampleIndex = sample[i];
+        segment.specularPath = false;
+        segment.remainingBounces = remainingBounces[i];
+        return segment;
+    }
+
+    void store(int i, const PathSegment &segment) {
+        origin[i] = segment.ray.origin;
+        direction[i] = segment.ray.direction;
+        cone[i] = glm::vec2(segment.ray.coneWidth, segment.ray.coneSpread);
+        color[i] = segment.color;
+        radiance[i] = segment.radiance;
+        scatterPdf[i] = segment.scatterPdf;
+        pixel[i] = segment.pixelIndex;
+        sample[i] = segment.sampleIndex;
+        remainingBounces[i] = segment.remainingBounces;
+    }
+};
+
+/**
+ * The scene as the host entry points read it: LightData over the Scene's
+ * own arrays, the ones pathtraceInit uploads, with the environment's
+ * texels for the unfiltered lookup.
+ */
+static LightData hostSceneData(const Scene &scene, const PathtraceOptions &options) {
+    LightData lights = {};
+    lights.lights = scene.lights.data();
+    lights.count = options.nextEventEstimation ? (int)scene.lights.size() : 0;
+    lights.lightTree = options.lightTree && lights.count > 0 ? scene.lightNodes.data() : NULL;
+    lights.geoms = scene.deviceGeoms.data();
+    lights.geomCount = (int)scene.deviceGeoms.size();
+    lights.bvhNodes = scene.bvhNodes.data();
+    lights.bvhGeomIndices = scene.bvhGeomIndices.data();
+    lights.meshData.meshes = scene.meshes.data();
+    lights.meshData.nodes = scene.meshBvhNodes.data();
+    lights.meshData.wideNodes = options.wideMeshBVH && !scene.meshWideNodes.empty()
+        ? scene.meshWideNodes.data() : NULL;
+    lights.meshData.triangles = scene.meshTriangles.data();
+    lights.meshData.triangleRecords = scene.meshTriangleRecords.data();
+    lights.meshData.positions = scene.meshPositions.data();
+    lights.meshData.normals = scene.meshNormals.data();
+    lights.meshData.uvs = scene.meshUVs.data();
+    lights.meshData.lodScale = options.meshLOD ? 1.0f : 0.0f;
+    lights.meshData.watertight = options.watertight;
+    lights.meshData.shortStack = options.shortStack;
+    lights.meshData.clouds = scene.sphereClouds.data();
+    lights.meshData.cloudNodes = scene.cloudBvhNodes.data();
+    lights.meshData.cloudSpheres = scene.cloudSpheres.data();
+    lights.meshData.sdfs = scene.sdfVolumes.data();
+    lights.meshData.sdfVoxels = scene.sdfVoxels.data();
+    const EnvironmentMap &environment = scene.environment;
+    if (!environment.image.levels.empty()) {
+        lights.environment.texels = reinterpret_cast<const float *>(environment.image.levels[0].data());
+        lights.environment.marginalCdf = environment.marginalCdf.data();
+        lights.environment.conditionalCdf = environment.conditionalCdf.data();
+        lights.environment.width = environment.image.width;
+        lights.environment.height = environment.image.height;
+        lights.environment.intensity = environment.intensity;
+        lights.environment.pmf = options.nextEventEstimation ? scene.environmentPmf() : 0.0f;
+    }
+    lights.media.media = scene.media.data();
+    lights.media.count = (int)scene.media.size();
+    lights.media.majorants = scene.mediumMajorants.data();
+    lights.media.voxels = scene.mediumVoxels.data();
+    lights.rayCounts = NULL;
+    lights.traceDepth = scene.state.traceDepth;
+    lights.firstPixel = 0;
+    return lights;
+}
+
+static std::vector<CpuTile> imageTiles(int width, int height) {
+    std::vector<CpuTile> tiles;
+    for (int y = 0; y < height; y += CPU_TILE_SIZE) {
+        for (int x = 0; x < width; x += CPU_TILE_SIZE) {
+            CpuTile tile = { x, y, std::min(CPU_TILE_SIZE, width - x), std::min(CPU_TILE_SIZE, height - y) };
+            tiles.push_back(tile);
+        }
+    }
+    return tiles;
+}
+
+static int threadCount(int threads) {
+    if (threads <= 0) {
+        threads = (int)std::thread::hardware_concurrency();
+    }
+    return std::max(threads, 1);
+}
+
+/**
+ * Runs work(tile) for every tile on `threads` threads. Tiles are dealt out
+ * round robin; a thread whose queue is empty steals from the back of the
+ * next non-empty one, and returns once all are.
+ */
+template <typename Work>
+static void runTiles(int tileCount, int threads, Work work) {
+    threads = std::min(threads, std::max(tileCount, 1));
+    std::vector<TileQueue> queues(threads);
+    for (int t = 0; t < tileCount; t++) {
+        queues[t % threads].tiles.push_back(t);
+    }
+
+    auto worker = [&](int self) {
+        while (true) {
+            int tile = -1;
+            for (int i = 0; i < threads && tile < 0; i++) {
+                TileQueue &queue = queues[(self + i) % threads];
+                std::lock_guard<std::mutex> guard(queue.lock);
+                if (!queue.tiles.empty()) {
+                    if (i == 0) {
+                        tile = queue.tiles.front();
+                        queue.tiles.pop_front();
+                    } else {
+                        tile = queue.tiles.back();
+                        queue.tiles.pop_back();
+                    }
+                }
+            }
+            // Tiles are only ever taken, so every queue stays empty once seen empty
+            if (tile < 0) {
+                return;
+            }
+            work(tile);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) {
+        pool.push_back(std::thread(worker, t));
+    }
+    worker(0);
+    for (size_t t = 0; t < pool.size(); t++) {
+        pool[t].join();
+    }
+}
+
+/**
+ * Samples firstSample .. firstSample + samples - 1 of one tile, a batch of
+ * CPU_BATCH_SAMPLES at a time. Paths of pixel p and sample s sit at
+ * p * batchSamples + s, so adding them to the image in batch order sums
+ * each pixel's samples in sample order.
+ */
+static void traceTile(const Scene &scene, const LightData &lights, const CpuTile &tile, int firstSample,
+        int samples, const PathtraceOptions &options, int rouletteBounces, PathBatch &batch,
+        std::vector<glm::vec3> &image, std::vector<glm::vec2> &moments) {
+    const Camera &cam = scene.state.camera;
+    const int width = cam.resolution.x;
+    const int traceDepth = scene.state.traceDepth;
+    const int tilePixels = tile.width * tile.height;
+    const Material *materials = scene.materials.data();
+
+    for (int done = 0; done < samples; done += CPU_BATCH_SAMPLES) {
+        const int batchSamples = std::min(CPU_BATCH_SAMPLES, samples - done);
+        const int n = tilePixels * batchSamples;
+        batch.resize(n);
+        batch.live.clear();
+        for (int local = 0; local < tilePixels; local++) {
+            const int x = tile.x + local % tile.width;
+            const int y = tile.y + local / tile.width;
+            for (int s = 0; s < batchSamples; s++) {
+                PathSegment segment;
+                segment.color = glm::vec3(1.0f);
+                segment.radiance = glm::vec3(0.0f);
+                segment.scatterPdf = 0.0f;
+                segment.specularPath = false;
+                segment.pixelIndex = x + y * width;
+                segment.remainingBounces = traceDepth;
+                segment.sampleIndex = firstSample + done + s;
+                hostCameraSample(cam, scene.state.eyeSeparation, traceDepth, x, y, options.antialias,
+                    options.sampler, segment);
+                const int i = local * batchSamples + s;
+                batch.store(i, segment);
+                batch.live.push_back(i);
+            }
+        }
+
+        // One bounce of every live path per pass, dropping the ended ones
+        while (!batch.live.empty()) {
+            size_t kept = 0;
+            for (size_t j = 0; j < batch.live.size(); j++) {
+                const int i = batch.live[j];
+                PathSegment segment = batch.load(i);
+                ShadeableIntersection intersection = hostIntersect(segment.ray, lights, materials, NULL);
+                hostShade(intersection, segment, materials, rouletteBounces, options.sampler, lights);
+                batch.store(i, segment);
+                if (segment.remainingBounces > 0) {
+                    batch.live[kept++] = i;
+                }
+            }
+            batch.live.resize(kept);
+        }
+
+        for (int i = 0; i < n; i++) {
+            const glm::vec3 color = batch.color[i];
+            const float luminance = glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+            image[batch.pixel[i]] += color;
+            moments[batch.pixel[i]] += glm::vec2(luminance, luminance * luminance);
+        }
+    }
+}
+
+void cpuRenderer::trace(const Scene &scene, int firstSample, int samples, const PathtraceOptions &options,
+        int threads, std::vector<glm::vec3> &image, std::vector<glm::vec2> &moments) {
+    const int width = scene.state.camera.resolution.x;
+    const int height = scene.state.camera.resolution.y * scene.state.viewCount();
+    if (image.empty()) {
+        image.assign(width * height, glm::vec3(0.0f));
+    }
+    if (moments.empty()) {
+        moments.assign(width * height, glm::vec2(0.0f));
+    }
+    if (samples <= 0) {
+        return;
+    }
+
+    const LightData lights = hostSceneData(scene, options);
+    const int traceDepth = scene.state.traceDepth;
+    const int rouletteBounces = options.russianRoulette
+        ? traceDepth - std::max(options.rouletteMinDepth, 1) : -1;
+    // Tiles never overlap, so threads add to their own pixels unsynchronized
+    const std::vector<CpuTile> tiles = imageTiles(width, height);
+    threads = threadCount(threads);
+    std::vector<PathBatch> batches(std::min(threads, std::max((int)tiles.size(), 1)));
+    std::mutex batchLock;
+    std::vector<PathBatch *> freeBatches;
+    for (size_t i = 0; i < batches.size(); i++) {
+        freeBatches.push_back(&batches[i]);
+    }
+    runTiles((int)tiles.size(), threads, [&](int t) {
+        PathBatch *batch;
+        {
+            std::lock_guard<std::mutex> guard(batchLock);
+            batch = freeBatches.back();
+            freeBatches.pop_back();
+        }
+        traceTile(scene, lights, tiles[t], firstSample + options.seedOffset, samples, options,
+            rouletteBounces, *batch, image, moments);
+        std::lock_guard<std::mutex> guard(batchLock);
+        freeBatches.push_back(batch);
+    });
+}
+
+void cpuRenderer::traceGBuffer(const Scene &scene, int threads, std::vector<GBufferPixel> &gBuffer) {
+    const Camera &cam = scene.state.camera;
+    const int width = cam.resolution.x;
+    const int height = cam.resolution.y * scene.state.viewCount();
+    gBuffer.resize(width * height);
+
+    PathtraceOptions options = {};
+    const LightData lights = hostSceneData(scene, options);
+    const std::vector<CpuTile> tiles = imageTiles(width, height);
+    runTiles((int)tiles.size(), threadCount(threads), [&](int t) {
+        const CpuTile &tile = tiles[t];
+        for (int y = tile.y; y < tile.y + tile.height; y++) {
+            const int view = y / cam.resolution.y;
+            const Camera eye = scene.state.viewCamera(view);
+            for (int x = tile.x; x < tile.x + tile.width; x++) {
+                Ray ray;
+                ray.origin = eye.position;
+                ray.direction = cameraRayDirection(eye, (float)x, (float)(y - view * cam.resolution.y));
+                ray.coneWidth = 0.0f;
+                ray.coneSpread = eye.pixelLength.y;
+                hostIntersect(ray, lights, scene.materials.data(), &gBuffer[x + y * width]);
+            }
+        }
+    });
+}
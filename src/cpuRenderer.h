@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "pathtrace.h"
+
+/**
+ * Multi-threaded CPU fallback of pathtrace(), for machines without a GPU
+ * (build and CI nodes rendering golden images) and for adding a host's
+ * cores to a distributed render as one more worker (--worker --cpu).
+ *
+ * It runs the kernels' own camera sampling, traversal and shading through
+ * their host entry points (hostCameraSample and friends), with the same
+ * pixel and sample seeding, so a sample follows the GPU's path up to float
+ * rounding. The image is cut into tiles that the threads take from their
+ * own queues and steal from each other's once theirs run dry; each thread
+ * traces a tile's samples as a batch of structure-of-arrays paths, bounce
+ * by bounce. Texture maps are not sampled (materials keep their colour),
+ * the environment map is read unfiltered, and every pixel gets every
+ * sample: adaptive sampling, regions and the GPU pipelines' options do
+ * not apply.
+ */
+namespace cpuRenderer {
+    /**
+     * Adds samples firstSample .. firstSample + samples - 1 (shifted by
+     * options.seedOffset) of every pixel of the stacked image to `image`
+     * and `moments`, each pixel's in sample order whatever the thread
+     * count, so reruns match bit for bit. Empty buffers start from zero.
+     * Of the options it follows the sampler, antialiasing, next-event
+     * estimation, Russian roulette and the wide mesh BVH.
+     *
+     * @param threads  0 for one per hardware thread.
+     */
+    void trace(const Scene &scene, int firstSample, int samples, const PathtraceOptions &options,
+            int threads, std::vector<glm::vec3> &image, std::vector<glm::vec2> &moments);
+
+    // The first hits along every pixel's centre ray, as computeCentreGBuffer writes them
+    void traceGBuffer(const Scene &scene, int threads, std::vector<GBufferPixel> &gBuffer);
+}
@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <cmath>
+
+#include "cpuSimd.h"
+
+#if defined(CPU_SIMD_AVX512) || defined(CPU_SIMD_AVX2)
+#include <immintrin.h>
+#endif
+
+// CPU_SIMD_WIDTH floats and a per-lane condition on them, in whichever
+// registers the build has; the tests below are written once against these
+#if defined(CPU_SIMD_AVX512)
+
+struct Mask {
+    __mmask16 m;
+};
+
+struct Lanes {
+    __m512 v;
+};
+
+static inline Lanes load(const float *p) { Lanes r = { _mm512_load_ps(p) }; return r; }
+static inline Lanes broadcast(float f) { Lanes r = { _mm512_set1_ps(f) }; return r; }
+static inline void store(float *p, Lanes a) { _mm512_storeu_ps(p, a.v); }
+static inline Lanes operator+(Lanes a, Lanes b) { Lanes r = { _mm512_add_ps(a.v, b.v) }; return r; }
+static inline Lanes operator-(Lanes a, Lanes b) { Lanes r = { _mm512_sub_ps(a.v, b.v) }; return r; }
+static inline Lanes operator*(Lanes a, Lanes b) { Lanes r = { _mm512_mul_ps(a.v, b.v) }; return r; }
+static inline Lanes operator/(Lanes a, Lanes b) { Lanes r = { _mm512_div_ps(a.v, b.v) }; return r; }
+static inline Lanes lanesSqrt(Lanes a) { Lanes r = { _mm512_sqrt_ps(a.v) }; return r; }
+// glm::min(a, b) is (b < a ? b : a), which is _mm512_min_ps(b, a) NaNs included
+static inline Lanes lanesMin(Lanes a, Lanes b) { Lanes r = { _mm512_min_ps(b.v, a.v) }; return r; }
+static inline Lanes lanesMax(Lanes a, Lanes b) { Lanes r = { _mm512_max_ps(b.v, a.v) }; return r; }
+static inline Mask operator<(Lanes a, Lanes b) { Mask r = { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ) }; return r; }
+static inline Mask operator>(Lanes a, Lanes b) { Mask r = { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ) }; return r; }
+static inline Mask operator<=(Lanes a, Lanes b) { Mask r = { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ) }; return r; }
+static inline Mask operator>=(Lanes a, Lanes b) { Mask r = { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ) }; return r; }
+static inline Mask operator&&(Mask a, Mask b) { Mask r = { (__mmask16)(a.m & b.m) }; return r; }
+static inline Mask operator||(Mask a, Mask b) { Mask r = { (__mmask16)(a.m | b.m) }; return r; }
+// a where the mask is set, b elsewhere
+static inline Lanes select(Mask m, Lanes a, Lanes b) { Lanes r = { _mm512_mask_blend_ps(m.m, b.v, a.v) }; return r; }
+
+#elif defined(CPU_SIMD_AVX2)
+
+struct Mask {
+    __m256 m;
+};
+
+struct Lanes {
+    __m256 v;
+};
+
+static inline Lanes load(const float *p) { Lanes r = { _mm256_load_ps(p) }; return r; }
+static inline Lanes broadcast(float f) { Lanes r = { _mm256_set1_ps(f) }; return r; }
+static inline void store(float *p, Lanes a) { _mm256_storeu_ps(p, a.v); }
+static inline Lanes operator+(Lanes a, Lanes b) { Lanes r = { _mm256_add_ps(a.v, b.v) }; return r; }
+static inline Lanes operator-(Lanes a, Lanes b) { Lanes r = { _mm256_sub_ps(a.v, b.v) }; return r; }
+static inline Lanes operator*(Lanes a, Lanes b) { Lanes r = { _mm256_mul_ps(a.v, b.v) }; return r; }
+static inline Lanes operator/(Lanes a, Lanes b) { Lanes r = { _mm256_div_ps(a.v, b.v) }; return r; }
+static inline Lanes lanesSqrt(Lanes a) { Lanes r = { _mm256_sqrt_ps(a.v) }; return r; }
+// glm::min(a, b) is (b < a ? b : a), which is _mm256_min_ps(b, a) NaNs included
+static inline Lanes lanesMin(Lanes a, Lanes b) { Lanes r = { _mm256_min_ps(b.v, a.v) }; return r; }
+static inline Lanes lanesMax(Lanes a, Lanes b) { Lanes r = { _mm256_max_ps(b.v, a.v) }; return r; }
+static inline Mask operator<(Lanes a, Lanes b) { Mask r = { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; return r; }
+static inline Mask operator>(Lanes a, Lanes b) { Mask r = { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; return r; }
+static inline Mask operator<=(Lanes a, Lanes b) { Mask r = { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; return r; }
+static inline Mask operator>=(Lanes a, Lanes b) { Mask r = { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; return r; }
+static inline Mask operator&&(Mask a, Mask b) { Mask r = { _mm256_and_ps(a.m, b.m) }; return r; }
+static inline Mask operator||(Mask a, Mask b) { Mask r = { _mm256_or_ps(a.m, b.m) }; return r; }
+// a where the mask is set, b elsewhere
+static inline Lanes select(Mask m, Lanes a, Lanes b) { Lanes r = { _mm256_blendv_ps(b.v, a.v, m.m) }; return r; }
+
+#else
+
+struct Mask {
+    bool m[CPU_SIMD_WIDTH];
+};
+
+struct Lanes {
+    float v[CPU_SIMD_WIDTH];
+};
+
+#define LANEWISE(type, expression) \
+    type r; \
+    for (int i = 0; i < CPU_SIMD_WIDTH; i++) { \
+        expression; \
+    } \
+    return r;
+
+static inline Lanes load(const float *p) { LANEWISE(Lanes, r.v[i] = p[i]) }
+static inline Lanes broadcast(float f) { LANEWISE(Lanes, r.v[i] = f) }
+static inline void store(float *p, Lanes a) { std::copy(a.v, a.v + CPU_SIMD_WIDTH, p); }
+static inline Lanes operator+(Lanes a, Lanes b) { LANEWISE(Lanes, r.v[i] = a.v[i] + b.v[i]) }
+static inline Lanes operator-(Lanes a, Lanes b) { LANEWISE(Lanes, r.v[i] = a.v[i] - b.v[i]) }
+static inline Lanes operator*(Lanes a, Lanes b) { LANEWISE(Lanes, r.v[i] = a.v[i] * b.v[i]) }
+static inline Lanes operator/(Lanes a, Lanes b) { LANEWISE(Lanes, r.v[i] = a.v[i] / b.v[i]) }
+static inline Lanes lanesSqrt(Lanes a) { LANEWISE(Lanes, r.v[i] = std::sqrt(a.v[i])) }
+static inline Lanes lanesMin(Lanes a, Lanes b) { LANEWISE(Lanes, r.v[i] = b.v[i] < a.v[i] ? b.v[i] : a.v[i]) }
+static inline Lanes lanesMax(Lanes a, Lanes b) { LANEWISE(Lanes, r.v[i] = a.v[i] < b.v[i] ? b.v[i] : a.v[i]) }
+static inline Mask operator<(Lanes a, Lanes b) { LANEWISE(Mask, r.m[i] = a.v[i] < b.v[i]) }
+static inline Mask operator>(Lanes a, Lanes b) { LANEWISE(Mask, r.m[i] = a.v[i] > b.v[i]) }
+static inline Mask operator<=(Lanes a, Lanes b) { LANEWISE(Mask, r.m[i] = a.v[i] <= b.v[i]) }
+static inline Mask operator>=(Lanes a, Lanes b) { LANEWISE(Mask, r.m[i] = a.v[i] >= b.v[i]) }
+static inline Mask operator&&(Mask a, Mask b) { LANEWISE(Mask, r.m[i] = a.m[i] && b.m[i]) }
+static inline Mask operator||(Mask a, Mask b) { LANEWISE(Mask, r.m[i] = a.m[i] || b.m[i]) }
+static inline Lanes select(Mask m, Lanes a, Lanes b) { LANEWISE(Lanes, r.v[i] = m.m[i] ? a.v[i] : b.v[i]) }
+
+#undef LANEWISE
+
+#endif
+
+// glm::dot of a row with (p, 1) and (v, 0), summed in glm's order
+static inline Lanes rowPoint(const Lanes row[4], const Lanes p[3]) {
+    return (row[0] * p[0] + row[1] * p[1]) + (row[2] * p[2] + row[3]);
+}
+
+static inline Lanes rowVector(const Lanes row[4], const Lanes v[3]) {
+    return (row[0] * v[0] + row[1] * v[1]) + row[2] * v[2];
+}
+
+// boxIntersectionTest, lane by lane
+static Lanes boxTest(const Lanes rows[3][4], const Lanes origin[3], const Lanes direction[3]) {
+    const Lanes zero = broadcast(0.0f);
+    Lanes tmin = broadcast(-1e38f);
+    Lanes tmax = broadcast(1e38f);
+    for (int xyz = 0; xyz < 3; ++xyz) {
+        Lanes qo = rowPoint(rows[xyz], origin);
+        Lanes qd = rowVector(rows[xyz], direction);
+        Lanes t1 = (broadcast(-0.5f) - qo) / qd;
+        Lanes t2 = (broadcast(+0.5f) - qo) / qd;
+        Lanes ta = lanesMin(t1, t2);
+        Lanes tb = lanesMax(t1, t2);
+        tmin = select(ta > zero && ta > tmin, ta, tmin);
+        tmax = select(tb < tmax, tb, tmax);
+    }
+    Lanes t = select(tmin <= zero, tmax, tmin) - broadcast(.0001f);
+    return select(tmax >= tmin && tmax > zero, t, broadcast(-1.0f));
+}
+
+// sphereIntersectionTest, lane by lane
+static Lanes sphereTest(const Lanes rows[3][4], const Lanes origin[3], const Lanes direction[3]) {
+    const Lanes zero = broadcast(0.0f);
+    Lanes ro[3];
+    Lanes rd[3];
+    for (int xyz = 0; xyz < 3; ++xyz) {
+        ro[xyz] = rowPoint(rows[xyz], origin);
+        rd[xyz] = rowVector(rows[xyz], direction);
+    }
+    Lanes a = rd[0] * rd[0] + rd[1] * rd[1] + rd[2] * rd[2];
+    Lanes vDotDirection = ro[0] * rd[0] + ro[1] * rd[1] + ro[2] * rd[2];
+    Lanes roDotRo = ro[0] * ro[0] + ro[1] * ro[1] + ro[2] * ro[2];
+    Lanes radicand = vDotDirection * vDotDirection - a * (roDotRo - broadcast(.5f * .5f));
+
+    // Missing lanes' roots are NaN, and are masked off below
+    Lanes squareRoot = lanesSqrt(radicand);
+    Lanes firstTerm = zero - vDotDirection;
+    Lanes t1 = (firstTerm + squareRoot) / a;
+    Lanes t2 = (firstTerm - squareRoot) / a;
+
+    Lanes t = select(t2 > zero, t2, t1) - broadcast(.0001f);
+    Mask miss = radicand < zero || (t1 < zero && t2 < zero);
+    return select(miss, broadcast(-1.0f), t);
+}
+
+static void geomLanes(const GeomPacket &geoms, Lanes rows[3][4]) {
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 4; c++) {
+            rows[r][c] = load(geoms.rows[r][c]);
+        }
+    }
+}
+
+static void geomLanes(const DeviceGeom &geom, Lanes rows[3][4]) {
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 4; c++) {
+            rows[r][c] = broadcast(geom.inverseRows[r][c]);
+        }
+    }
+}
+
+static void rayLanes(const Ray &ray, Lanes origin[3], Lanes direction[3]) {
+    for (int xyz = 0; xyz < 3; xyz++) {
+        origin[xyz] = broadcast(ray.origin[xyz]);
+        direction[xyz] = broadcast(ray.direction[xyz]);
+    }
+}
+
+static void rayLanes(const RayPacket &rays, Lanes origin[3], Lanes direction[3]) {
+    for (int xyz = 0; xyz < 3; xyz++) {
+        origin[xyz] = load(rays.origin[xyz]);
+        direction[xyz] = load(rays.direction[xyz]);
+    }
+}
+
+GeomPacket cpuSimd::packGeoms(const DeviceGeom *geoms, int count) {
+    GeomPacket packet;
+    for (int lane = 0; lane < CPU_SIMD_WIDTH; lane++) {
+        const DeviceGeom &geom = geoms[std::min(lane, count - 1)];
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 4; c++) {
+                packet.rows[r][c][lane] = geom.inverseRows[r][c];
+            }
+        }
+    }
+    return packet;
+}
+
+RayPacket cpuSimd::packRays(const Ray *rays, int count) {
+    RayPacket packet;
+    for (int lane = 0; lane < CPU_SIMD_WIDTH; lane++) {
+        const Ray &ray = rays[std::min(lane, count - 1)];
+        for (int xyz = 0; xyz < 3; xyz++) {
+            packet.origin[xyz][lane] = ray.origin[xyz];
+            packet.direction[xyz][lane] = ray.direction[xyz];
+        }
+    }
+    return packet;
+}
+
+void cpuSimd::boxIntersectionTest(const GeomPacket &boxes, const Ray &ray, float t[CPU_SIMD_WIDTH]) {
+    Lanes rows[3][4], origin[3], direction[3];
+    geomLanes(boxes, rows);
+    rayLanes(ray, origin, direction);
+    store(t, boxTest(rows, origin, direction));
+}
+
+void cpuSimd::sphereIntersectionTest(const GeomPacket &spheres, const Ray &ray, float t[CPU_SIMD_WIDTH]) {
+    Lanes rows[3][4], origin[3], direction[3];
+    geomLanes(spheres, rows);
+    rayLanes(ray, origin, direction);
+    store(t, sphereTest(rows, origin, direction));
+}
+
+void cpuSimd::boxIntersectionTest(const DeviceGeom &box, const RayPacket &rays, float t[CPU_SIMD_WIDTH]) {
+    Lanes rows[3][4], origin[3], direction[3];
+    geomLanes(box, rows);
+    rayLanes(rays, origin, direction);
+    store(t, boxTest(rows, origin, direction));
+}
+
+void cpuSimd::sphereIntersectionTest(const DeviceGeom &sphere, const RayPacket &rays, float t[CPU_SIMD_WIDTH]) {
+    Lanes rows[3][4], origin[3], direction[3];
+    geomLanes(sphere, rows);
+    rayLanes(rays, origin, direction);
+    store(t, sphereTest(rows, origin, direction));
+}
+
+const char *cpuSimd::instructionSet() {
+#if defined(CPU_SIMD_AVX512)
+    return "avx512";
+#elif defined(CPU_SIMD_AVX2)
+    return "avx2";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "sceneStructs.h"
+
+/**
+ * Packet versions of boxIntersectionTest and sphereIntersectionTest for the
+ * CPU renderer, CPU_SIMD_WIDTH lanes at a time: one ray against a packet of
+ * geoms (a BVH leaf's, a shadow ray's candidates) and a packet of rays
+ * against one geom. The packets are structure-of-arrays copies of
+ * DeviceGeom's inverse rows and of Rays.
+ *
+ * The lanes are AVX-512 with the CPU_SIMD=AVX512 build, AVX2 with AVX2 (the
+ * default) and plain loops the compiler may vectorize with NONE. Each lane
+ * runs the scalar test's operations in the same order, min and max
+ * included, so it returns the same `t` up to the compiler's contraction of
+ * multiplies and adds into FMAs; kernel_benchmark --cpu-packets checks the
+ * largest difference.
+ */
+#if defined(CPU_SIMD_AVX512)
+#define CPU_SIMD_WIDTH 16
+#else
+#define CPU_SIMD_WIDTH 8
+#endif
+
+// CPU_SIMD_WIDTH geoms' world-to-object rows, an array of lanes per entry
+struct alignas(64) GeomPacket {
+    float rows[3][4][CPU_SIMD_WIDTH];
+};
+
+// CPU_SIMD_WIDTH rays, an array of lanes per coordinate
+struct alignas(64) RayPacket {
+    float origin[3][CPU_SIMD_WIDTH];
+    float direction[3][CPU_SIMD_WIDTH];
+};
+
+namespace cpuSimd {
+    // Packs up to CPU_SIMD_WIDTH geoms; lanes past `count` repeat the last one
+    GeomPacket packGeoms(const DeviceGeom *geoms, int count);
+
+    // Packs up to CPU_SIMD_WIDTH rays; lanes past `count` repeat the last one
+    RayPacket packRays(const Ray *rays, int count);
+
+    /**
+     * boxIntersectionTest of `ray` against every lane's box (or
+     * sphereIntersectionTest against its sphere): t per lane, falling short
+     * of the surface by the same .0001, or -1 for a miss.
+     */
+    void boxIntersectionTest(const GeomPacket &boxes, const Ray &ray, float t[CPU_SIMD_WIDTH]);
+    void sphereIntersectionTest(const GeomPacket &spheres, const Ray &ray, float t[CPU_SIMD_WIDTH]);
+
+    // The same for every lane's ray against one box or sphere
+    void boxIntersectionTest(const DeviceGeom &box, const RayPacket &rays, float t[CPU_SIMD_WIDTH]);
+    void sphereIntersectionTest(const DeviceGeom &sphere, const RayPacket &rays, float t[CPU_SIMD_WIDTH]);
+
+    // "avx512", "avx2" or "scalar": what the lanes were built as
+    const char *instructionSet();
+}
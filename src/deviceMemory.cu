@@ -0,0 +1,142 @@
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+#include "deviceMemory.h"
+
+struct PoolDevice {
+    bool configured;
+    bool pooled;        // allocations go through the default memory pool
+    DeviceMemoryUsage usage;
+};
+
+struct Allocation {
+    int device;
+    size_t bytes;
+};
+
+static std::mutex poolMutex;
+static std::map<int, PoolDevice> poolDevices;
+static std::map<void *, Allocation> allocations;
+
+// The current device's entry, its pool set to hold on to freed memory
+static PoolDevice &currentPoolDevice(int &device) {
+    cudaGetDevice(&device);
+    PoolDevice &pd = poolDevices[device];
+    if (!pd.configured) {
+        pd.configured = true;
+        pd.pooled = false;
+#if CUDART_VERSION >= 11020
+        int supported = 0;
+        cudaDeviceGetAttribute(&supported, cudaDevAttrMemoryPoolsSupported, device);
+        cudaMemPool_t pool;
+        if (supported && cudaDeviceGetDefaultMemPool(&pool, device) == cudaSuccess) {
+            uint64_t threshold = UINT64_MAX;
+            pd.pooled = cudaMemPoolSetAttribute(pool, cudaMemPoolAttrReleaseThreshold, &threshold)
+                == cudaSuccess;
+        }
+        cudaGetLastError();
+#endif
+    }
+    return pd;
+}
+
+cudaError_t deviceMemory::allocate(void **p, size_t bytes) {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    int device;
+    PoolDevice &pd = currentPoolDevice(device);
+    cudaError_t err;
+#if CUDART_VERSION >= 11020
+    if (pd.pooled) {
+        // Ordered on the legacy stream; the renderer's non-blocking
+        // streams only see the memory once that has caught up
+        err = cudaMallocAsync(p, bytes, 0);
+        if (err == cudaSuccess) {
+            err = cudaStreamSynchronize(0);
+        }
+    } else
+#endif
+    {
+        err = cudaMalloc(p, bytes);
+    }
+    if (err != cudaSuccess) {
+        *p = NULL;
+        return err;
+    }
+    allocations[*p] = Allocation{ device, bytes };
+    pd.usage.current += bytes;
+    if (pd.usage.current > pd.usage.peak) {
+        pd.usage.peak = pd.usage.current;
+    }
+    return cudaSuccess;
+}
+
+void deviceMemory::release(void *p) {
+    if (p == NULL) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(poolMutex);
+    std::map<void *, Allocation>::iterator it = allocations.find(p);
+    if (it == allocations.end()) {
+        cudaFree(p);
+        return;
+    }
+    PoolDevice &pd = poolDevices[it->second.device];
+    pd.usage.current -= it->second.bytes;
+#if CUDART_VERSION >= 11020
+    if (pd.pooled) {
+        // cudaFree would wait for the whole device; so must this, since
+        // any stream may still be reading the buffer
+        int current;
+        cudaGetDevice(&current);
+        cudaSetDevice(it->second.device);
+        cudaDeviceSynchronize();
+        cudaFreeAsync(p, 0);
+        cudaSetDevice(current);
+    } else
+#endif
+    {
+        cudaFree(p);
+    }
+    allocations.erase(it);
+}
+
+void deviceMemory::sharePool(int owner, int peer) {
+#if CUDART_VERSION >= 11020
+    std::lock_guard<std::mutex> lock(poolMutex);
+    int current;
+    cudaGetDevice(&current);
+    cudaSetDevice(owner);
+    int device;
+    PoolDevice &pd = currentPoolDevice(device);
+    cudaMemPool_t pool;
+    if (pd.pooled && cudaDeviceGetDefaultMemPool(&pool, owner) == cudaSuccess) {
+        cudaMemAccessDesc access = {};
+        access.location.type = cudaMemLocationTypeDevice;
+        access.location.id = peer;
+        access.flags = cudaMemAccessFlagsProtReadWrite;
+        cudaMemPoolSetAccess(pool, &access, 1);
+        cudaGetLastError();
+    }
+    cudaSetDevice(current);
+#endif
+}
+
+DeviceMemoryUsage deviceMemory::usage(int device) {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    std::map<int, PoolDevice>::const_iterator it = poolDevices.find(device);
+    if (it == poolDevices.end()) {
+        return DeviceMemoryUsage();
+    }
+    DeviceMemoryUsage usage = it->second.usage;
+    usage.reserved = usage.current;
+#if CUDART_VERSION >= 11020
+    cudaMemPool_t pool;
+    uint64_t reserved = 0;
+    if (it->second.pooled && cudaDeviceGetDefaultMemPool(&pool, device) == cudaSuccess
+            && cudaMemPoolGetAttribute(pool, cudaMemPoolAttrReservedMemCurrent, &reserved) == cudaSuccess) {
+        usage.reserved = (size_t)reserved;
+    }
+#endif
+    return usage;
+}
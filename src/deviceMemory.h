@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cuda_runtime.h>
+
+/**
+ * Device memory for the renderer's buffers. Allocations come from each
+ * device's default stream-ordered memory pool, set to keep what is freed,
+ * so the buffers pathtraceFree drops on a reset or resize are handed back
+ * to the next pathtraceInit without a round trip to the driver. Toolkits
+ * (before CUDA 11.2) or devices without memory pools fall back to plain
+ * cudaMalloc. Either way the live bytes and their high-water mark are
+ * counted per device, for the stats panel.
+ */
+
+struct DeviceMemoryUsage {
+    size_t current;     // bytes held by live allocations
+    size_t peak;        // most bytes live at once
+    size_t reserved;    // bytes the pool holds from the driver, live or kept for reuse
+};
+
+namespace deviceMemory {
+    // Like cudaMalloc, on the current device; *p is usable on any stream on return
+    cudaError_t allocate(void **p, size_t bytes);
+
+    template <typename T>
+    cudaError_t allocate(T **p, size_t bytes) {
+        return allocate(reinterpret_cast<void **>(p), bytes);
+    }
+
+    // Like cudaFree: waits for work using `p` to finish, then returns it; no-op for NULL
+    void release(void *p);
+
+    // Lets `peer` reach the pool memory of `owner`, as peer access does for cudaMalloc'd memory
+    void sharePool(int owner, int peer);
+
+    DeviceMemoryUsage usage(int device);
+}
@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "exrWriter.h"
+
+namespace exrWriter {
+
+// Field values from the OpenEXR file layout specification
+#define EXR_MAGIC 20000630
+#define EXR_VERSION 2
+#define EXR_PIXEL_TYPE_HALF 1
+#define EXR_NO_COMPRESSION 0
+#define EXR_INCREASING_Y 0
+
+// Round-to-nearest-even float to IEEE half, with overflow to infinity
+static uint16_t floatToHalf(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mantissa = x & 0x7fffff;
+    int biased = (int)((x >> 23) & 0xff);
+    if (biased == 0xff) {
+        return (uint16_t)(sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0));
+    }
+    int exponent = biased - 127 + 15;
+    if (exponent >= 31) {
+        return (uint16_t)(sign | 0x7c00);
+    }
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return (uint16_t)sign;
+        }
+        // Subnormal: shift the implicit bit down into the mantissa
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t h = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (h & 1))) {
+            h++;
+        }
+        return (uint16_t)(sign | h);
+    }
+    uint32_t h = sign | ((uint32_t)exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+        h++;    // a carry into the exponent is still the right rounding
+    }
+    return (uint16_t)h;
+}
+
+// EXR is little-endian throughout
+static void put(std::vector<unsigned char> &out, const void *data, size_t bytes) {
+    const unsigned char *p = (const unsigned char *)data;
+    out.insert(out.end(), p, p + bytes);
+}
+
+static void putInt(std::vector<unsigned char> &out, int32_t v) {
+    unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8),
+        (unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+    put(out, b, 4);
+}
+
+static void putFloat(std::vector<unsigned char> &out, float f) {
+    int32_t v;
+    memcpy(&v, &f, sizeof(v));
+    putInt(out, v);
+}
+
+static void putString(std::vector<unsigned char> &out, const std::string &s) {
+    put(out, s.c_str(), s.size() + 1);
+}
+
+static void putAttribute(std::vector<unsigned char> &out, const char *name, const char *type,
+        const std::vector<unsigned char> &value) {
+    putString(out, name);
+    putString(out, type);
+    putInt(out, (int32_t)value.size());
+    put(out, value.data(), value.size());
+}
+
+static bool channelLess(const Channel &a, const Channel &b) {
+    return a.name < b.name;
+}
+
+bool write(const std::string &baseFilename, int width, int height, std::vector<Channel> &channels) {
+    std::sort(channels.begin(), channels.end(), channelLess);
+
+    std::vector<unsigned char> header;
+    putInt(header, EXR_MAGIC);
+    putInt(header, EXR_VERSION);
+
+    std::vector<unsigned char> value;
+    for (size_t c = 0; c < channels.size(); c++) {
+        putString(value, channels[c].name);
+        putInt(value, EXR_PIXEL_TYPE_HALF);
+        unsigned char linearAndReserved[4] = { 0, 0, 0, 0 };
+        put(value, linearAndReserved, 4);
+        putInt(value, 1);   // x sampling
+        putInt(value, 1);   // y sampling
+    }
+    value.push_back(0);
+    putAttribute(header, "channels", "chlist", value);
+
+    value.assign(1, EXR_NO_COMPRESSION);
+    putAttribute(header, "compression", "compression", value);
+
+    value.clear();
+    putInt(value, 0);
+    putInt(value, 0);
+    putInt(value, width - 1);
+    putInt(value, height - 1);
+    putAttribute(header, "dataWindow", "box2i", value);
+    putAttribute(header, "displayWindow", "box2i", value);
+
+    value.assign(1, EXR_INCREASING_Y);
+    putAttribute(header, "lineOrder", "lineOrder", value);
+
+    value.clear();
+    putFloat(value, 1.0f);
+    putAttribute(header, "pixelAspectRatio", "float", value);
+    putAttribute(header, "screenWindowWidth", "float", value);
+
+    value.clear();
+    putFloat(value, 0.0f);
+    putFloat(value, 0.0f);
+    putAttribute(header, "screenWindowCenter", "v2f", value);
+    header.push_back(0);
+
+    // Uncompressed files hold one scanline per block, each preceded by its
+    // y and byte count, with the channels' rows one after another
+    const size_t lineBytes = channels.size() * width * sizeof(uint16_t);
+    const size_t blockBytes = 8 + lineBytes;
+    const uint64_t firstBlock = header.size() + height * sizeof(uint64_t);
+    for (int y = 0; y < height; y++) {
+        uint64_t offset = firstBlock + y * blockBytes;
+        unsigned char b[8];
+        for (int i = 0; i < 8; i++) {
+            b[i] = (unsigned char)(offset >> (8 * i));
+        }
+        put(header, b, 8);
+    }
+
+    std::string filename = baseFilename + ".exr";
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (file == NULL) {
+        std::cerr << "Could not open " << filename << " for writing." << std::endl;
+        return false;
+    }
+    bool ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+
+    std::vector<unsigned char> block;
+    block.reserve(blockBytes);
+    for (int y = 0; ok && y < height; y++) {
+        block.clear();
+        putInt(block, y);
+        putInt(block, (int32_t)lineBytes);
+        for (size_t c = 0; c < channels.size(); c++) {
+            const float *row = &channels[c].values[y * width];
+            for (int x = 0; x < width; x++) {
+                uint16_t h = floatToHalf(row[x]);
+                block.push_back((unsigned char)h);
+                block.push_back((unsigned char)(h >> 8));
+            }
+        }
+        ok = fwrite(block.data(), 1, block.size(), file) == block.size();
+    }
+    fclose(file);
+
+    if (ok) {
+        std::cout << "Saved " << filename << "." << std::endl;
+    } else {
+        std::cerr << "Failed writing " << filename << "." << std::endl;
+    }
+    return ok;
+}
+
+}
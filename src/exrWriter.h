@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/**
+ * Minimal OpenEXR writer: one uncompressed scanline part with any number
+ * of half-float channels. Layers follow the usual "layer.channel" naming,
+ * e.g. "beauty.R" or "depth.Z", so compositors split them on load.
+ */
+namespace exrWriter {
+    struct Channel {
+        std::string name;
+        std::vector<float> values;  // width * height, row-major, top row first
+    };
+
+    // Writes channels (sorted by name, as EXR requires) to filename.exr
+    bool write(const std::string &baseFilename, int width, int height, std::vector<Channel> &channels);
+}
@@ -0,0 +1,165 @@
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cuda_runtime.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "frameDump.h"
+#include "gbuffer.h"
+#include "pathtrace.h"
+
+#define FRAME_DUMP_PAGE 4096
+
+static std::string dumpName;
+static int dumpSlots = 0;
+static int dumpEvery = 1;
+
+// The mapping, for the resolution it was sized for
+static unsigned char *view = NULL;
+static size_t viewBytes = 0;
+static bool registered = false;
+static int mappedWidth = 0;
+static int mappedHeight = 0;
+static unsigned long long frames = 0;
+#ifdef _WIN32
+static HANDLE fileHandle = INVALID_HANDLE_VALUE;
+static HANDLE mappingHandle = NULL;
+#endif
+
+static size_t pageAligned(size_t bytes) {
+    return (bytes + FRAME_DUMP_PAGE - 1) / FRAME_DUMP_PAGE * FRAME_DUMP_PAGE;
+}
+
+static void unmapFile() {
+    if (view == NULL) {
+        return;
+    }
+    if (registered) {
+        cudaHostUnregister(view);
+        registered = false;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(view);
+    CloseHandle(mappingHandle);
+    CloseHandle(fileHandle);
+#else
+    munmap(view, viewBytes);
+#endif
+    view = NULL;
+    viewBytes = 0;
+}
+
+// Creates the file at its full size and maps it shared, so readers see the writes
+static bool mapFile(size_t bytes) {
+#ifdef _WIN32
+    fileHandle = CreateFileA(dumpName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)bytes >> 32),
+        (DWORD)bytes, NULL);
+    view = mappingHandle != NULL ? (unsigned char *)MapViewOfFile(mappingHandle, FILE_MAP_WRITE, 0, 0, bytes) : NULL;
+    if (view == NULL) {
+        if (mappingHandle != NULL) {
+            CloseHandle(mappingHandle);
+        }
+        CloseHandle(fileHandle);
+        return false;
+    }
+#else
+    int fd = open(dumpName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    if (ftruncate(fd, (off_t)bytes) != 0) {
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    view = (unsigned char *)mapped;
+#endif
+    viewBytes = bytes;
+    return true;
+}
+
+static bool remap(int width, int height) {
+    unmapFile();
+    mappedWidth = width;
+    mappedHeight = height;
+    const size_t pixels = (size_t)width * height;
+    const size_t slotBytes = pageAligned(pixels * (sizeof(float4) + sizeof(GBufferPixel)));
+    const size_t firstSlot = pageAligned(sizeof(FrameDumpHeader) + dumpSlots * sizeof(FrameDumpSlot));
+    if (!mapFile(firstSlot + dumpSlots * slotBytes)) {
+        printf("--frame-dump: cannot map %s\n", dumpName.c_str());
+        dumpSlots = 0;
+        return false;
+    }
+    // Registered pages take the device copies by DMA; unregistered ones
+    // still work, staged by the driver
+    registered = cudaHostRegister(view, viewBytes, cudaHostRegisterDefault) == cudaSuccess;
+    if (!registered) {
+        cudaGetLastError();
+        printf("--frame-dump: %s could not be pinned, copies will be staged\n", dumpName.c_str());
+    }
+
+    FrameDumpHeader *header = (FrameDumpHeader *)view;
+    memcpy(header->magic, "PTFRAME1", 8);
+    header->width = width;
+    header->height = height;
+    header->slots = dumpSlots;
+    header->slotBytes = slotBytes;
+    header->firstSlot = firstSlot;
+    header->latest = 0;
+    frames = 0;
+    return true;
+}
+
+void frameDump::start(const std::string &filename, int slots, int every) {
+    dumpName = filename;
+    dumpSlots = slots > 0 ? slots : 1;
+    dumpEvery = every > 0 ? every : 1;
+}
+
+bool frameDump::enabled() {
+    return dumpSlots > 0;
+}
+
+void frameDump::traced(int width, int height, int samples, int launched) {
+    if (dumpSlots == 0 || samples / dumpEvery == (samples - launched) / dumpEvery) {
+        return;
+    }
+    if ((view == NULL || width != mappedWidth || height != mappedHeight) && !remap(width, height)) {
+        return;
+    }
+
+    FrameDumpHeader *header = (FrameDumpHeader *)view;
+    volatile FrameDumpSlot *slots = (volatile FrameDumpSlot *)(view + sizeof(FrameDumpHeader));
+    const int slot = (int)(frames % dumpSlots);
+    unsigned char *data = view + header->firstSlot + slot * header->slotBytes;
+    const size_t pixels = (size_t)width * height;
+
+    slots[slot].sequence = 0;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    pathtraceCopyRaw(data, data + pixels * sizeof(float4));
+    slots[slot].samples = samples;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    frames++;
+    slots[slot].sequence = frames;
+    ((volatile FrameDumpHeader *)header)->latest = frames;
+}
+
+void frameDump::stop() {
+    unmapFile();
+    dumpSlots = 0;
+}
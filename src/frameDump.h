@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+
+/**
+ * Raw frames for downstream tools, which want float radiance and G-buffer
+ * planes rather than PNGs. The dump is a preallocated file mapped into the
+ * renderer and registered with CUDA, so each frame is DMA'd from the
+ * device straight into the file's pages, with no encode step and no host
+ * copy; other processes map the same file and read frames while rendering
+ * goes on. Native (little-endian) byte order throughout.
+ *
+ *     offset 0     FrameDumpHeader
+ *     64           FrameDumpSlot per slot
+ *     firstSlot    the slots, slotBytes apart (page-aligned), each holding
+ *                  width * height float4 radiance sums (divide by the
+ *                  slot's samples; w unused), then as many 16-byte
+ *                  GBufferPixels (src/gbuffer.h)
+ *
+ * Frames fill the slots round robin. A slot's sequence is 0 while it is
+ * written and the frame's 1-based number once complete, and the header's
+ * `latest` is the newest complete frame, in slot (latest - 1) % slots. A
+ * reader copies a slot and keeps the copy if its sequence was nonzero and
+ * unchanged before and after.
+ */
+struct FrameDumpHeader {
+    char magic[8];              // "PTFRAME1"
+    unsigned int width;
+    unsigned int height;        // of every view, stereo pairs stacked
+    unsigned int slots;
+    unsigned int reserved;
+    unsigned long long slotBytes;
+    unsigned long long firstSlot;
+    unsigned long long latest;
+    unsigned long long padding[2];
+};
+
+struct FrameDumpSlot {
+    unsigned long long sequence;
+    unsigned int samples;
+    unsigned int reserved;
+};
+
+namespace frameDump {
+    /**
+     * Dumps to `filename` from now on, into `slots` slots, a frame each
+     * time the accumulation reaches a multiple of `every` samples. The file
+     * is created on the first frame and recreated when the resolution
+     * changes.
+     */
+    void start(const std::string &filename, int slots, int every);
+
+    bool enabled();
+
+    // After each pathtrace() call: dumps if the launch's samples reached a multiple of `every`
+    void traced(int width, int height, int samples, int launched);
+
+    // Unmaps the file, leaving its frames for readers; call before pathtraceFree()
+    void stop();
+}
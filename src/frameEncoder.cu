@@ -0,0 +1,299 @@
+#include <cstdio>
+#include <cstring>
+#include <cuda.h>
+#ifdef ENABLE_NVENC
+#include <nvEncodeAPI.h>
+#endif
+
+#include "frameEncoder.h"
+#include "deviceMemory.h"
+#include "imageEncoder.h"
+#include "../stream_compaction/common.h"
+
+static int encoderCodec = frameEncoder::CODEC_JPEG;
+static int frameWidth = 0;
+static int frameHeight = 0;
+static int encodedWidth = 0;    // the frame padded to even sizes, for video
+static int encodedHeight = 0;
+static int jpegQuality = 90;
+
+// What the show functions write
+static cudaArray_t displayArray = NULL;
+static cudaSurfaceObject_t displaySurface = 0;
+// The texels in the preview's orientation, opaque, row pitch texelPitch bytes
+static uchar4 *dev_texels = NULL;
+static size_t texelPitch = 0;
+static std::vector<unsigned char> hostTexels;
+
+/**
+ * Copies the display texels into the encoder's buffer, mirrored in x as
+ * the preview's quad draws the texture, repeating the last column and row
+ * into the padding.
+ */
+__global__ void copyDisplayTexels(cudaSurfaceObject_t display, int width, int height, int paddedWidth,
+        int paddedHeight, uchar4 *out, size_t pitch) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < paddedWidth && y < paddedHeight) {
+        const int sourceX = width - 1 - min(x, width - 1);
+        const int sourceY = min(y, height - 1);
+        uchar4 texel = surf2Dread<uchar4>(display, sourceX * sizeof(uchar4), sourceY);
+        texel.w = 255;
+        ((uchar4 *)((char *)out + y * pitch))[x] = texel;
+    }
+}
+
+#ifdef ENABLE_NVENC
+// The NVENC session, fed from dev_texels registered as its input
+static NV_ENCODE_API_FUNCTION_LIST nvenc;
+static void *session = NULL;
+static NV_ENC_REGISTERED_PTR registeredTexels = NULL;
+static NV_ENC_OUTPUT_PTR bitstream = NULL;
+static unsigned long long encodedFrames = 0;
+
+static bool nvencCheck(NVENCSTATUS status, const char *call) {
+    if (status != NV_ENC_SUCCESS) {
+        fprintf(stderr, "NVENC: %s failed with status %d\n", call, (int)status);
+        return false;
+    }
+    return true;
+}
+
+static void closeSession() {
+    if (session == NULL) {
+        return;
+    }
+    // Flush the encoder before tearing it down
+    NV_ENC_PIC_PARAMS flush = {};
+    flush.version = NV_ENC_PIC_PARAMS_VER;
+    flush.encodePicFlags = NV_ENC_PIC_FLAG_EOS;
+    nvenc.nvEncEncodePicture(session, &flush);
+    if (bitstream != NULL) {
+        nvenc.nvEncDestroyBitstreamBuffer(session, bitstream);
+        bitstream = NULL;
+    }
+    if (registeredTexels != NULL) {
+        nvenc.nvEncUnregisterResource(session, registeredTexels);
+        registeredTexels = NULL;
+    }
+    nvenc.nvEncDestroyEncoder(session);
+    session = NULL;
+}
+
+/**
+ * Opens an encoder on the current CUDA context, tuned for latency over
+ * size: P-frames only, no lookahead, constant bitrate, and parameter sets
+ * repeated on every IDR frame so a client may join at any keyframe.
+ */
+static bool openSession(int codec, int bitrate) {
+    memset(&nvenc, 0, sizeof nvenc);
+    nvenc.version = NV_ENCODE_API_FUNCTION_LIST_VER;
+    CUcontext context = NULL;
+    cudaFree(0);
+    if (!nvencCheck(NvEncodeAPICreateInstance(&nvenc), "NvEncodeAPICreateInstance")
+            || cuCtxGetCurrent(&context) != CUDA_SUCCESS) {
+        return false;
+    }
+
+    NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS open = {};
+    open.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
+    open.device = context;
+    open.deviceType = NV_ENC_DEVICE_TYPE_CUDA;
+    open.apiVersion = NVENCAPI_VERSION;
+    if (!nvencCheck(nvenc.nvEncOpenEncodeSessionEx(&open, &session), "nvEncOpenEncodeSessionEx")) {
+        session = NULL;
+        return false;
+    }
+
+    const GUID codecGuid = codec == frameEncoder::CODEC_HEVC ? NV_ENC_CODEC_HEVC_GUID : NV_ENC_CODEC_H264_GUID;
+    NV_ENC_PRESET_CONFIG preset = {};
+    preset.version = NV_ENC_PRESET_CONFIG_VER;
+    preset.presetCfg.version = NV_ENC_CONFIG_VER;
+    if (!nvencCheck(nvenc.nvEncGetEncodePresetConfigEx(session, codecGuid, NV_ENC_PRESET_P3_GUID,
+            NV_ENC_TUNING_INFO_ULTRA_LOW_LATENCY, &preset), "nvEncGetEncodePresetConfigEx")) {
+        closeSession();
+        return false;
+    }
+    NV_ENC_CONFIG config = preset.presetCfg;
+    config.gopLength = NVENC_INFINITE_GOPLENGTH;
+    config.frameIntervalP = 1;
+    config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
+    config.rcParams.averageBitRate = bitrate;
+    config.rcParams.maxBitRate = bitrate;
+    if (codec == frameEncoder::CODEC_HEVC) {
+        config.encodeCodecConfig.hevcConfig.repeatSPSPPS = 1;
+        config.encodeCodecConfig.hevcConfig.idrPeriod = config.gopLength;
+    } else {
+        config.encodeCodecConfig.h264Config.repeatSPSPPS = 1;
+        config.encodeCodecConfig.h264Config.idrPeriod = config.gopLength;
+    }
+
+    NV_ENC_INITIALIZE_PARAMS init = {};
+    init.version = NV_ENC_INITIALIZE_PARAMS_VER;
+    init.encodeGUID = codecGuid;
+    init.presetGUID = NV_ENC_PRESET_P3_GUID;
+    init.tuningInfo = NV_ENC_TUNING_INFO_ULTRA_LOW_LATENCY;
+    init.encodeWidth = encodedWidth;
+    init.encodeHeight = encodedHeight;
+    init.darWidth = encodedWidth;
+    init.darHeight = encodedHeight;
+    init.frameRateNum = 60;
+    init.frameRateDen = 1;
+    init.enablePTD = 1;
+    init.encodeConfig = &config;
+    if (!nvencCheck(nvenc.nvEncInitializeEncoder(session, &init), "nvEncInitializeEncoder")) {
+        closeSession();
+        return false;
+    }
+
+    NV_ENC_REGISTER_RESOURCE resource = {};
+    resource.version = NV_ENC_REGISTER_RESOURCE_VER;
+    resource.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR;
+    resource.resourceToRegister = dev_texels;
+    resource.width = encodedWidth;
+    resource.height = encodedHeight;
+    resource.pitch = (uint32_t)texelPitch;
+    // NVENC's ABGR is R, G, B, A in memory, as uchar4 texels are
+    resource.bufferFormat = NV_ENC_BUFFER_FORMAT_ABGR;
+    resource.bufferUsage = NV_ENC_INPUT_IMAGE;
+    NV_ENC_CREATE_BITSTREAM_BUFFER output = {};
+    output.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+    if (!nvencCheck(nvenc.nvEncRegisterResource(session, &resource), "nvEncRegisterResource")
+            || !nvencCheck(nvenc.nvEncCreateBitstreamBuffer(session, &output), "nvEncCreateBitstreamBuffer")) {
+        registeredTexels = resource.registeredResource;
+        closeSession();
+        return false;
+    }
+    registeredTexels = resource.registeredResource;
+    bitstream = output.bitstreamBuffer;
+    encodedFrames = 0;
+    return true;
+}
+
+static bool encodeVideo(bool keyframe, std::vector<unsigned char> &out) {
+    NV_ENC_MAP_INPUT_RESOURCE input = {};
+    input.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
+    input.registeredResource = registeredTexels;
+    if (!nvencCheck(nvenc.nvEncMapInputResource(session, &input), "nvEncMapInputResource")) {
+        return false;
+    }
+
+    NV_ENC_PIC_PARAMS picture = {};
+    picture.version = NV_ENC_PIC_PARAMS_VER;
+    picture.inputBuffer = input.mappedResource;
+    picture.bufferFmt = input.mappedBufferFmt;
+    picture.inputWidth = encodedWidth;
+    picture.inputHeight = encodedHeight;
+    picture.inputPitch = (uint32_t)(texelPitch / sizeof(uchar4));
+    picture.outputBitstream = bitstream;
+    picture.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+    picture.inputTimeStamp = encodedFrames;
+    if (keyframe || encodedFrames == 0) {
+        picture.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+    }
+    bool encoded = nvencCheck(nvenc.nvEncEncodePicture(session, &picture), "nvEncEncodePicture");
+    if (encoded) {
+        // Synchronous session: the lock waits for this picture's bitstream
+        NV_ENC_LOCK_BITSTREAM lock = {};
+        lock.version = NV_ENC_LOCK_BITSTREAM_VER;
+        lock.outputBitstream = bitstream;
+        encoded = nvencCheck(nvenc.nvEncLockBitstream(session, &lock), "nvEncLockBitstream");
+        if (encoded) {
+            const unsigned char *data = (const unsigned char *)lock.bitstreamBufferPtr;
+            out.assign(data, data + lock.bitstreamSizeInBytes);
+            nvenc.nvEncUnlockBitstream(session, bitstream);
+            encodedFrames++;
+        }
+    }
+    nvenc.nvEncUnmapInputResource(session, input.mappedResource);
+    return encoded;
+}
+#endif
+
+bool frameEncoder::available(int codec) {
+#ifdef ENABLE_NVENC
+    return true;
+#else
+    return codec == CODEC_JPEG;
+#endif
+}
+
+bool frameEncoder::start(int codec, int width, int height, int quality, int bitrate) {
+    stop();
+    encoderCodec = codec;
+    frameWidth = width;
+    frameHeight = height;
+    const bool video = codec != CODEC_JPEG;
+    encodedWidth = video ? (width + 1) & ~1 : width;
+    encodedHeight = video ? (height + 1) & ~1 : height;
+    jpegQuality = quality;
+
+    cudaChannelFormatDesc desc = cudaCreateChannelDesc<uchar4>();
+    cudaMallocArray(&displayArray, &desc, width, height, cudaArraySurfaceLoadStore);
+    cudaResourceDesc resource = {};
+    resource.resType = cudaResourceTypeArray;
+    resource.res.array.array = displayArray;
+    cudaCreateSurfaceObject(&displaySurface, &resource);
+    // NVENC wants its input rows aligned; 256 bytes suits every codec
+    texelPitch = (encodedWidth * sizeof(uchar4) + 255) / 256 * 256;
+    deviceMemory::allocate(&dev_texels, texelPitch * encodedHeight);
+    checkCUDAError("frameEncoder::start");
+
+#ifdef ENABLE_NVENC
+    if (video && !openSession(codec, bitrate)) {
+        stop();
+        return false;
+    }
+#else
+    if (video) {
+        stop();
+        return false;
+    }
+#endif
+    return true;
+}
+
+cudaSurfaceObject_t frameEncoder::surface() {
+    return displaySurface;
+}
+
+bool frameEncoder::encode(cudaStream_t stream, bool keyframe, std::vector<unsigned char> &out) {
+    if (dev_texels == NULL) {
+        return false;
+    }
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (encodedWidth + blockSize2d.x - 1) / blockSize2d.x,
+            (encodedHeight + blockSize2d.y - 1) / blockSize2d.y);
+    copyDisplayTexels<<<blocksPerGrid2d, blockSize2d, 0, stream>>>(displaySurface, frameWidth, frameHeight,
+            encodedWidth, encodedHeight, dev_texels, texelPitch);
+    checkCUDAError("copyDisplayTexels");
+    cudaStreamSynchronize(stream);
+
+#ifdef ENABLE_NVENC
+    if (encoderCodec != CODEC_JPEG) {
+        return encodeVideo(keyframe, out);
+    }
+#endif
+    hostTexels.resize((size_t)frameWidth * frameHeight * sizeof(uchar4));
+    cudaMemcpy2D(hostTexels.data(), frameWidth * sizeof(uchar4), dev_texels, texelPitch,
+            frameWidth * sizeof(uchar4), frameHeight, cudaMemcpyDeviceToHost);
+    return imageEncoder::encodeJpeg(hostTexels.data(), frameWidth, frameHeight, jpegQuality, out);
+}
+
+void frameEncoder::stop() {
+#ifdef ENABLE_NVENC
+    closeSession();
+#endif
+    if (displaySurface != 0) {
+        cudaDestroySurfaceObject(displaySurface);
+        displaySurface = 0;
+    }
+    if (displayArray != NULL) {
+        cudaFreeArray(displayArray);
+        displayArray = NULL;
+    }
+    deviceMemory::release(dev_texels);
+    dev_texels = NULL;
+}
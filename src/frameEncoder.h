@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <cuda_runtime.h>
+
+/**
+ * Encodes the display transform's texels for --server mode. The show
+ * functions write into a surface of an array owned here, in place of the
+ * preview's GL texture; encode() mirrors it the way the preview draws it
+ * into a pitched device buffer, which NVENC (built with ENABLE_NVENC)
+ * reads directly as its input resource, so a video frame is encoded with
+ * no host copy of the image. JPEG, the fallback where NVENC is missing,
+ * copies the texels to the host for imageEncoder::encodeJpeg.
+ */
+namespace frameEncoder {
+    enum Codec {
+        CODEC_JPEG,
+        CODEC_H264,
+        CODEC_HEVC,
+    };
+
+    // Whether this build and device can encode with `codec`
+    bool available(int codec);
+
+    /**
+     * Encodes width x height frames with `codec` from now on, at `quality`
+     * (1 to 100) for JPEG or `bitrate` bits per second, constant, for video.
+     * Video frames are padded to even sizes, as 4:2:0 chroma needs.
+     */
+    bool start(int codec, int width, int height, int quality, int bitrate);
+
+    // The surface for showImage and friends, valid until stop()
+    cudaSurfaceObject_t surface();
+
+    /**
+     * Encodes what the surface holds once the work queued on `stream` is
+     * done, replacing `out` with the JPEG file or access unit. Video
+     * frames only reference earlier ones unless `keyframe` is set.
+     */
+    bool encode(cudaStream_t stream, bool keyframe, std::vector<unsigned char> &out);
+
+    void stop();
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cuda_fp16.h>
+#include "glm/glm.hpp"
+
+#include "sceneStructs.h"
+
+/**
+ * Encoding and decoding of the packed GBufferPixel layout.
+ *
+ * Normals are stored as octahedral 2x16-bit unorm, albedo as half floats,
+ * and position is not stored at all: it is rebuilt from the hit distance `t`
+ * and the camera ray through the pixel centre.
+ */
+
+static_assert(sizeof(GBufferPixel) <= 16, "GBufferPixel must stay within 16 bytes");
+
+/**
+ * Direction of the camera ray through pixel (x, y). Shared by ray generation
+ * and G-buffer position reconstruction so the two always agree.
+ */
+__host__ __device__ inline glm::vec3 cameraRayDirection(const Camera &cam, float x, float y) {
+    return glm::normalize(cam.view
+        - cam.right * cam.pixelLength.x * (x - (float)cam.resolution.x * 0.5f)
+        - cam.up * cam.pixelLength.y * (y - (float)cam.resolution.y * 0.5f)
+        );
+}
+
+/**
+ * Inverse of cameraRayDirection: the (fractional) pixel whose camera ray
+ * passes through world point p. Returns false for points behind the camera.
+ * right and up are orthogonal to view but not necessarily unit length.
+ */
+__host__ __device__ inline bool cameraProjectPoint(const Camera &cam, glm::vec3 p, glm::vec2 &pixel) {
+    glm::vec3 d = p - cam.position;
+    float depth = glm::dot(d, cam.view);
+    if (depth <= 0.0f) {
+        return false;
+    }
+    d /= depth;
+    pixel.x = (float)cam.resolution.x * 0.5f
+        - glm::dot(d, cam.right) / (glm::dot(cam.right, cam.right) * cam.pixelLength.x);
+    pixel.y = (float)cam.resolution.y * 0.5f
+        - glm::dot(d, cam.up) / (glm::dot(cam.up, cam.up) * cam.pixelLength.y);
+    return true;
+}
+
+__host__ __device__ inline float signNotZero(float v) {
+    return v >= 0.0f ? 1.0f : -1.0f;
+}
+
+__host__ __device__ inline unsigned short quantizeUnorm16(float v) {
+    return (unsigned short)(glm::clamp(v * 0.5f + 0.5f, 0.0f, 1.0f) * 65535.0f + 0.5f);
+}
+
+__host__ __device__ inline float dequantizeUnorm16(unsigned short v) {
+    return (float)v / 65535.0f * 2.0f - 1.0f;
+}
+
+/**
+ * Projects a unit normal onto the octahedron and folds the lower hemisphere
+ * over the upper one (Cigolle et al. 2014).
+ */
+__host__ __device__ inline void encodeOctNormal(glm::vec3 n, unsigned short out[2]) {
+    n /= (glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z));
+    float u = n.x;
+    float v = n.y;
+    if (n.z < 0.0f) {
+        u = (1.0f - glm::abs(n.y)) * signNotZero(n.x);
+        v = (1.0f - glm::abs(n.x)) * signNotZero(n.y);
+    }
+    out[0] = quantizeUnorm16(u);
+    out[1] = quantizeUnorm16(v);
+}
+
+__host__ __device__ inline glm::vec3 decodeOctNormal(const unsigned short in[2]) {
+    float u = dequantizeUnorm16(in[0]);
+    float v = dequantizeUnorm16(in[1]);
+    glm::vec3 n(u, v, 1.0f - glm::abs(u) - glm::abs(v));
+    float t = glm::clamp(-n.z, 0.0f, 1.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return glm::normalize(n);
+}
+
+__host__ __device__ inline void encodeGBufferPixel(GBufferPixel &pixel,
+        float t, glm::vec3 normal, glm::vec3 albedo, int materialId) {
+    pixel.t = t;
+    encodeOctNormal(normal, pixel.normal);
+    pixel.albedo[0] = __float2half(albedo.x);
+    pixel.albedo[1] = __float2half(albedo.y);
+    pixel.albedo[2] = __float2half(albedo.z);
+    pixel.materialId = (short)materialId;
+}
+
+__host__ __device__ inline void encodeGBufferMiss(GBufferPixel &pixel) {
+    encodeGBufferPixel(pixel, -1.0f, glm::vec3(0.0f, 0.0f, 1.0f), BACKGROUND_COLOR, -1);
+}
+
+/**
+ * World-space normal of the first hit, or zero for pixels that missed.
+ */
+__host__ __device__ inline glm::vec3 gbufferNormal(const GBufferPixel &pixel) {
+    return pixel.t > 0.0f ? decodeOctNormal(pixel.normal) : glm::vec3(0.0f);
+}
+
+/**
+ * World-space position of the first hit at pixel (x, y), or zero for pixels
+ * that missed.
+ */
+__host__ __device__ inline glm::vec3 gbufferPosition(const GBufferPixel &pixel,
+        const Camera &cam, int x, int y) {
+    if (pixel.t <= 0.0f) {
+        return glm::vec3(0.0f);
+    }
+    return cam.position + pixel.t * cameraRayDirection(cam, (float)x, (float)y);
+}
+
+__host__ __device__ inline glm::vec3 gbufferAlbedo(const GBufferPixel &pixel) {
+    return glm::vec3(__half2float(pixel.albedo[0]),
+        __half2float(pixel.albedo[1]),
+        __half2float(pixel.albedo[2]));
+}
+
+// Smallest albedo channel divided out, so near-black surfaces stay finite
+#define DEMODULATION_MIN_ALBEDO 0.01f
+
+/**
+ * Albedo that denoising divides out of the colour and multiplies back in.
+ * Misses keep their colour as is.
+ */
+__host__ __device__ inline glm::vec3 gbufferDemodulationAlbedo(const GBufferPixel &pixel) {
+    if (pixel.t <= 0.0f) {
+        return glm::vec3(1.0f);
+    }
+    return glm::max(gbufferAlbedo(pixel), glm::vec3(DEMODULATION_MIN_ALBEDO));
+}
@@ -12,6 +12,8 @@ namespace glslUtility {
 GLuint createDefaultProgram(const char *attributeLocations[], GLuint numberOfLocations);
 GLuint createProgram(const char *vertexShaderPath, const char *fragmentShaderPath,
 	const char *attributeLocations[], GLuint numberOfLocations);
+GLuint createProgramFromSource(const char *vertexSource, const char *fragmentSource,
+	const char *attributeLocations[], GLuint numberOfLocations);
 }
 
 #endif
\ No newline at end of file
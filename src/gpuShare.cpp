@@ -0,0 +1,92 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "gpuShare.h"
+
+static bool backgroundWork = false;
+static std::chrono::steady_clock::time_point lastHeartbeat;
+static bool heartbeatWritten = false;
+// A background render checks the heartbeat at most this often
+static std::chrono::steady_clock::time_point lastCheck;
+static bool lastActive = false;
+static bool checked = false;
+
+static std::string heartbeatFile() {
+    const char *dir = getenv("TMPDIR");
+#ifdef _WIN32
+    if (dir == NULL) {
+        dir = getenv("TEMP");
+    }
+    if (dir == NULL) {
+        dir = ".";
+    }
+    return std::string(dir) + "\\pathtracer-interactive";
+#else
+    if (dir == NULL) {
+        dir = "/tmp";
+    }
+    return std::string(dir) + "/pathtracer-interactive";
+#endif
+}
+
+// Wall-clock milliseconds, which unlike the steady clock compare across processes
+static long long wallMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void gpuShare::setBackground(bool background) {
+    backgroundWork = background;
+}
+
+bool gpuShare::background() {
+    return backgroundWork;
+}
+
+void gpuShare::heartbeat() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (heartbeatWritten && now - lastHeartbeat < std::chrono::milliseconds(GPU_SHARE_HEARTBEAT_MS)) {
+        return;
+    }
+    heartbeatWritten = true;
+    lastHeartbeat = now;
+    const std::string name = heartbeatFile();
+    FILE *out = fopen(name.c_str(), "w");
+    if (out != NULL) {
+        fprintf(out, "%lld\n", wallMs());
+        fclose(out);
+    }
+}
+
+bool gpuShare::interactiveActive() {
+    const std::string name = heartbeatFile();
+    FILE *in = fopen(name.c_str(), "r");
+    if (in == NULL) {
+        return false;
+    }
+    long long written = 0;
+    const bool valid = fscanf(in, "%lld", &written) == 1;
+    fclose(in);
+    return valid && wallMs() - written < GPU_SHARE_STALE_MS;
+}
+
+bool gpuShare::beginLaunch() {
+    if (!backgroundWork) {
+        return false;
+    }
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (!checked || now - lastCheck >= std::chrono::milliseconds(GPU_SHARE_HEARTBEAT_MS)) {
+        checked = true;
+        lastCheck = now;
+        lastActive = interactiveActive();
+    }
+    return lastActive;
+}
+
+void gpuShare::endLaunch(double launchMs) {
+    const double idleMs = launchMs * (1.0 - GPU_SHARE_BACKGROUND_DUTY) / GPU_SHARE_BACKGROUND_DUTY;
+    std::this_thread::sleep_for(std::chrono::microseconds((long long)(idleMs * 1000.0)));
+}
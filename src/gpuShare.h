@@ -0,0 +1,37 @@
+#pragma once
+
+// How often an interactive preview rewrites its heartbeat file
+#define GPU_SHARE_HEARTBEAT_MS 250
+// A heartbeat older than this means the preview is gone
+#define GPU_SHARE_STALE_MS 2000
+// The share of the GPU's time background work keeps while a preview runs
+#define GPU_SHARE_BACKGROUND_DUTY 0.25
+// Rows per band, so each of a background launch's kernels is short
+#define GPU_SHARE_TILE_ROWS 64
+
+/**
+ * Sharing a GPU between an artist's interactive preview and background
+ * renders (--batch, --headless, --worker started with --background) in
+ * other processes. Stream priorities only order work within one CUDA
+ * context, so the processes cooperate instead: the preview writes a
+ * heartbeat file in the temporary directory every frame or so, and while
+ * it is fresh a background render traces one sample per launch in bands of
+ * GPU_SHARE_TILE_ROWS rows, waits for each launch to finish, and then
+ * sleeps so that it keeps the GPU no more than GPU_SHARE_BACKGROUND_DUTY of
+ * the time. Without a preview, background work runs at full speed.
+ */
+namespace gpuShare {
+    // Marks this process's renders as background work
+    void setBackground(bool background);
+    bool background();
+
+    // The preview, once per displayed frame
+    void heartbeat();
+    // Whether some preview's heartbeat is fresh
+    bool interactiveActive();
+
+    // Around each launch of a background render: whether the launch
+    // should be chunked and yield, and after it finished, the yield
+    bool beginLaunch();
+    void endLaunch(double launchMs);
+}
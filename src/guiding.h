@@ -0,0 +1,167 @@
+#pragma once
+
+#include "radianceCache.h"
+
+/**
+ * Path guiding for PathtraceOptions::pathGuiding: a world-space hash grid
+ * of cells, each learning a histogram of the light arriving at the path
+ * vertices inside it over GUIDE_BINS equal-area direction bins. A diffuse
+ * bounce then draws its direction from its cell's histogram with
+ * probability GUIDE_FRACTION and from the cosine lobe otherwise, and is
+ * weighted by the mixture of both densities (one-sample MIS), so openings
+ * that let the light in are found far more often than the cosine alone
+ * would find them.
+ *
+ * The cells learn from the paths themselves, in the manner of the
+ * radiance cache: a light-sampled vertex adds what the next segment's
+ * shading added to the path (emission, the next vertex's light sample, a
+ * cached cell), per unit of throughput and of the pdf it was scattered
+ * with, to the bin of the ray's direction. Launches sample from the CDFs
+ * built before they start and learn into separate sums, so a vertex's
+ * density is the same when scattering and when weighing its light sample.
+ * Learning stops after GUIDE_TRAINING_LAUNCHES, leaving the CDFs fixed.
+ */
+
+// Slots of the table, a power of two
+#define GUIDE_CELLS (1 << 16)
+// Slots tried after a key's own before a lookup gives up
+#define GUIDE_PROBES 8
+// Cell edges along the diagonal of the scene's bounds
+#define GUIDE_RESOLUTION 32
+// Direction bins: rows of equal height in cos(theta) about +z, by columns in phi
+#define GUIDE_BIN_ROWS 8
+#define GUIDE_BIN_COLUMNS 8
+#define GUIDE_BINS (GUIDE_BIN_ROWS * GUIDE_BIN_COLUMNS)
+// Floats per slot: the bins and the sample count, or the bins' CDF
+#define GUIDE_RECORD (GUIDE_BINS + 1)
+// Samples a cell needs before its histogram guides anything
+#define GUIDE_MIN_SAMPLES 64
+// Cells past this many samples are halved once per launch, so that the
+// estimates learned before the guide took over fade out
+#define GUIDE_MAX_SAMPLES 4096
+// Share of guided diffuse bounces drawn from the histogram
+#define GUIDE_FRACTION 0.5f
+// Share of each CDF spread evenly over the bins, so that no direction
+// a few unlucky samples missed is left without density
+#define GUIDE_UNIFORM 0.1f
+// Launches after a reset that learn, after which the CDFs stay as they are
+#define GUIDE_TRAINING_LAUNCHES 64
+
+// The key of the cell holding `p`, never 0
+__host__ __device__ inline unsigned int guideKey(const PathGuide &guide, glm::vec3 p) {
+    glm::ivec3 c = glm::ivec3(glm::floor(p / guide.cellSize));
+    unsigned int key = radianceCacheHash((unsigned int)c.x
+        ^ radianceCacheHash((unsigned int)c.y ^ radianceCacheHash((unsigned int)c.z)));
+    return key != 0 ? key : 1;
+}
+
+/**
+ * The slot of `key`, or -1 if it has none. With `insert`, an empty slot on
+ * the way is claimed for it; only the device inserts.
+ */
+__host__ __device__ inline int guideSlot(const PathGuide &guide, unsigned int key, bool insert) {
+    for (int probe = 0; probe < GUIDE_PROBES; probe++) {
+        unsigned int slot = (key + probe) & guide.mask;
+        unsigned int found = guide.keys[slot];
+#ifdef __CUDA_ARCH__
+        if (found == 0 && insert) {
+            found = atomicCAS(&guide.keys[slot], 0u, key);
+            if (found == 0) {
+                return (int)slot;
+            }
+        }
+#endif
+        if (found == key) {
+            return (int)slot;
+        }
+        if (found == 0) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// The bin of unit `direction`
+__host__ __device__ inline int guideBin(glm::vec3 direction) {
+    int row = glm::clamp((int)((1.0f - direction.z) * 0.5f * GUIDE_BIN_ROWS), 0, GUIDE_BIN_ROWS - 1);
+    float phi = atan2f(direction.y, direction.x);
+    if (phi < 0.0f) {
+        phi += TWO_PI;
+    }
+    int column = glm::clamp((int)(phi / TWO_PI * GUIDE_BIN_COLUMNS), 0, GUIDE_BIN_COLUMNS - 1);
+    return row * GUIDE_BIN_COLUMNS + column;
+}
+
+/**
+ * The CDF that guides scattering at `p` (GUIDE_BINS + 1 entries from 0 to
+ * 1), or NULL where the cell has not learned enough yet.
+ */
+__host__ __device__ inline const float *guideDistribution(const PathGuide &guide, glm::vec3 p) {
+    if (guide.keys == NULL) {
+        return NULL;
+    }
+    int slot = guideSlot(guide, guideKey(guide, p), false);
+    if (slot < 0) {
+        return NULL;
+    }
+    const float *cdf = guide.distributions + slot * GUIDE_RECORD;
+    return cdf[GUIDE_BINS] > 0.0f ? cdf : NULL;
+}
+
+// Solid-angle density of sampleGuide drawing `direction`
+__host__ __device__ inline float guidePdf(const float *cdf, glm::vec3 direction) {
+    int bin = guideBin(direction);
+    return (cdf[bin + 1] - cdf[bin]) * (GUIDE_BINS / (4.0f * PI));
+}
+
+// A direction drawn from the bins of `cdf` by u1, then uniformly within the bin by u1 and u2
+__host__ __device__ inline glm::vec3 sampleGuide(const float *cdf, float u1, float u2) {
+    int lo = 0;
+    int hi = GUIDE_BINS;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] <= u1) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    float width = cdf[lo + 1] - cdf[lo];
+    float t = width > 0.0f ? glm::clamp((u1 - cdf[lo]) / width, 0.0f, 0.99999994f) : 0.5f;
+    float z = 1.0f - 2.0f * ((lo / GUIDE_BIN_COLUMNS) + t) / GUIDE_BIN_ROWS;
+    float phi = TWO_PI * ((lo % GUIDE_BIN_COLUMNS) + u2) / GUIDE_BIN_COLUMNS;
+    float r = sqrtf(fmaxf(0.0f, 1.0f - z * z));
+    return glm::vec3(r * cosf(phi), r * sinf(phi), z);
+}
+
+/**
+ * Density of a guided diffuse bounce about `normal` scattering towards
+ * `wi`: the mixture of the cosine lobe and, with a `cdf`, its histogram.
+ */
+__host__ __device__ inline float guidedDiffusePdf(const float *cdf, glm::vec3 normal, glm::vec3 wi) {
+    float cosine = fmaxf(glm::dot(normal, wi), 0.0f) / PI;
+    if (cdf == NULL) {
+        return cosine;
+    }
+    return (1.0f - GUIDE_FRACTION) * cosine + GUIDE_FRACTION * guidePdf(cdf, wi);
+}
+
+/**
+ * Adds one sample to the bin of `direction` in the cell holding `p`: the
+ * luminance of the light found that way per unit pdf. Dropped if the
+ * table is full.
+ */
+__host__ __device__ inline void guideAdd(const PathGuide &guide, glm::vec3 p, glm::vec3 direction, float value) {
+#ifdef __CUDA_ARCH__
+    if (!(value >= 0.0f && value < 1e30f)) {
+        return;
+    }
+    int slot = guideSlot(guide, guideKey(guide, p), true);
+    if (slot < 0) {
+        return;
+    }
+    float *record = guide.training + slot * GUIDE_RECORD;
+    atomicAdd(&record[guideBin(direction)], value);
+    atomicAdd(&record[GUIDE_BINS], 1.0f);
+#endif
+}
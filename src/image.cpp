@@ -1,17 +1,15 @@
+#include <cassert>
 #include <iostream>
 #include <string>
 #include <stb_image_write.h>
 
 #include "image.h"
+#include "parallelFor.h"
 
 image::image(int x, int y) :
         xSize(x),
         ySize(y),
-        pixels(new glm::vec3[x * y]) {
-}
-
-image::~image() {
-    delete pixels;
+        pixels(x * y) {
 }
 
 void image::setPixel(int x, int y, const glm::vec3 &pixel) {
@@ -20,26 +18,32 @@ void image::setPixel(int x, int y, const glm::vec3 &pixel) {
 }
 
 void image::savePNG(const std::string &baseFilename) {
-    unsigned char *bytes = new unsigned char[3 * xSize * ySize];
-    for (int y = 0; y < ySize; y++) {
-        for (int x = 0; x < xSize; x++) { 
-            int i = y * xSize + x;
-            glm::vec3 pix = glm::clamp(pixels[i], glm::vec3(), glm::vec3(1)) * 255.f;
-            bytes[3 * i + 0] = (unsigned char) pix.x;
-            bytes[3 * i + 1] = (unsigned char) pix.y;
-            bytes[3 * i + 2] = (unsigned char) pix.z;
-        }
-    }
-
+    std::vector<unsigned char> bytes;
+    quantizeRGB8(pixels.data(), xSize, ySize, 1.0f, false, bytes);
     std::string filename = baseFilename + ".png";
-    stbi_write_png(filename.c_str(), xSize, ySize, 3, bytes, xSize * 3);
+    stbi_write_png(filename.c_str(), xSize, ySize, 3, bytes.data(), xSize * 3);
     std::cout << "Saved " << filename << "." << std::endl;
-
-    delete[] bytes;
 }
 
 void image::saveHDR(const std::string &baseFilename) {
     std::string filename = baseFilename + ".hdr";
-    stbi_write_hdr(filename.c_str(), xSize, ySize, 3, (const float *) pixels);
+    stbi_write_hdr(filename.c_str(), xSize, ySize, 3, (const float *) pixels.data());
     std::cout << "Saved " + filename + "." << std::endl;
 }
+
+void quantizeRGB8(const glm::vec3 *pixels, int width, int height, float scale, bool flipX,
+        std::vector<unsigned char> &bytes) {
+    bytes.resize(3 * (size_t)width * height);
+    // A row per task: both buffers are walked in order, and rows share no cache lines worth contending
+    parallelFor(height, 1, [&](int y) {
+        const glm::vec3 *row = pixels + (size_t)y * width;
+        unsigned char *out = &bytes[3 * (size_t)y * width];
+        for (int x = 0; x < width; x++) {
+            glm::vec3 pix = glm::clamp(row[x] * scale, glm::vec3(), glm::vec3(1)) * 255.f;
+            unsigned char *texel = out + 3 * (flipX ? width - 1 - x : x);
+            texel[0] = (unsigned char) pix.x;
+            texel[1] = (unsigned char) pix.y;
+            texel[2] = (unsigned char) pix.z;
+        }
+    });
+}
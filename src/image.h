@@ -1,5 +1,7 @@
 #pragma once
 
+#include <string>
+#include <vector>
 #include <glm/glm.hpp>
 
 using namespace std;
@@ -8,12 +10,19 @@ class image {
 private:
     int xSize;
     int ySize;
-    glm::vec3 *pixels;
+    std::vector<glm::vec3> pixels;
 
 public:
     image(int x, int y);
-    ~image();
     void setPixel(int x, int y, const glm::vec3 &pixel);
     void savePNG(const std::string &baseFilename);
     void saveHDR(const std::string &baseFilename);
 };
+
+/**
+ * Scales width x height linear pixels, clamps them to [0, 1] and quantizes
+ * them into 8-bit RGB in one pass per row, rows in parallel, mirrored in x
+ * when `flipX` is set: the encoders' input, with no float copy made.
+ */
+void quantizeRGB8(const glm::vec3 *pixels, int width, int height, float scale, bool flipX,
+        std::vector<unsigned char> &bytes);
@@ -0,0 +1,731 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "imageEncoder.h"
+#include "parallelFor.h"
+
+namespace imageEncoder {
+
+// Filtered bytes a PNG chunk holds at least, so every core has a few
+#define PNG_CHUNK_BYTES (1 << 18)
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_HASH_BITS 15
+
+static const int LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const int LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const int DISTANCE_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const int DISTANCE_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Deflate's fixed Huffman codes, bit-reversed for the LSB-first stream
+struct FixedCodes {
+    uint16_t literal[288];
+    uint8_t literalBits[288];
+    uint16_t distance[30];
+    uint8_t lengthSymbol[DEFLATE_MAX_MATCH + 1];    // length code index per length
+
+    static uint16_t reverse(uint32_t code, int bits) {
+        uint32_t r = 0;
+        for (int i = 0; i < bits; i++) {
+            r = (r << 1) | ((code >> i) & 1);
+        }
+        return (uint16_t)r;
+    }
+
+    FixedCodes() {
+        for (int s = 0; s < 288; s++) {
+            uint32_t code;
+            int bits;
+            if (s < 144) {
+                code = 0x30 + s;
+                bits = 8;
+            } else if (s < 256) {
+                code = 0x190 + (s - 144);
+                bits = 9;
+            } else if (s < 280) {
+                code = s - 256;
+                bits = 7;
+            } else {
+                code = 0xc0 + (s - 280);
+                bits = 8;
+            }
+            literal[s] = reverse(code, bits);
+            literalBits[s] = (uint8_t)bits;
+        }
+        for (int d = 0; d < 30; d++) {
+            distance[d] = reverse(d, 5);
+        }
+        // 258 has a code of its own, so 227's range stops at 257
+        for (int code = 0; code < 29; code++) {
+            int end = code + 1 < 29 ? LENGTH_BASE[code + 1] : DEFLATE_MAX_MATCH + 1;
+            for (int length = LENGTH_BASE[code]; length < end; length++) {
+                lengthSymbol[length] = (uint8_t)code;
+            }
+        }
+    }
+};
+
+static const FixedCodes fixedCodes;
+
+// An LSB-first bit stream into a byte vector, as deflate packs it
+struct BitWriter {
+    std::vector<unsigned char> &out;
+    uint64_t bits;
+    int count;
+
+    explicit BitWriter(std::vector<unsigned char> &o) : out(o), bits(0), count(0) {}
+
+    void put(uint32_t value, int n) {
+        bits |= (uint64_t)value << count;
+        count += n;
+        while (count >= 8) {
+            out.push_back((unsigned char)bits);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    void align() {
+        if (count > 0) {
+            put(0, 8 - count);
+        }
+    }
+
+    void literal(int symbol) {
+        put(fixedCodes.literal[symbol], fixedCodes.literalBits[symbol]);
+    }
+
+    void match(int length, int distance) {
+        int code = fixedCodes.lengthSymbol[length];
+        literal(257 + code);
+        put(length - LENGTH_BASE[code], LENGTH_EXTRA[code]);
+        int d = 29;
+        while (DISTANCE_BASE[d] > distance) {
+            d--;
+        }
+        put(fixedCodes.distance[d], 5);
+        put(distance - DISTANCE_BASE[d], DISTANCE_EXTRA[d]);
+    }
+};
+
+static inline uint32_t hash3(const unsigned char *p) {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+/**
+ * One fixed-Huffman block of `data`, matches found along hash chains of at
+ * most maxChain candidates, then the empty stored block that byte-aligns
+ * the stream. The last chunk instead closes with an empty final block.
+ */
+static void deflateChunk(const unsigned char *data, int n, int maxChain, bool last,
+        std::vector<unsigned char> &out) {
+    BitWriter writer(out);
+    writer.put(0 | (1 << 1), 3);    // not final, fixed Huffman
+    std::vector<int> head(1 << DEFLATE_HASH_BITS, -1);
+    std::vector<int> prev(n);
+    const auto insert = [&](int i) {
+        if (i + 3 <= n) {
+            uint32_t h = hash3(data + i);
+            prev[i] = head[h];
+            head[h] = i;
+        }
+    };
+
+    for (int i = 0; i < n; ) {
+        int best = 0;
+        int bestDistance = 0;
+        if (i + 3 <= n) {
+            const int limit = std::min(DEFLATE_MAX_MATCH, n - i);
+            int candidate = head[hash3(data + i)];
+            for (int chain = maxChain; candidate >= 0 && i - candidate <= DEFLATE_WINDOW && chain > 0; chain--) {
+                if (data[candidate + best] == data[i + best]) {
+                    int length = 0;
+                    while (length < limit && data[candidate + length] == data[i + length]) {
+                        length++;
+                    }
+                    if (length > best) {
+                        best = length;
+                        bestDistance = i - candidate;
+                        if (length == limit) {
+                            break;
+                        }
+                    }
+                }
+                candidate = prev[candidate];
+            }
+        }
+        if (best >= 3) {
+            writer.match(best, bestDistance);
+            for (int end = i + best; i < end; i++) {
+                insert(i);
+            }
+        } else {
+            writer.literal(data[i]);
+            insert(i);
+            i++;
+        }
+    }
+    writer.literal(256);
+
+    if (last) {
+        writer.put(1 | (1 << 1), 3);    // final, fixed Huffman, empty
+        writer.literal(256);
+        writer.align();
+    } else {
+        writer.put(0, 3);
+        writer.align();
+        const unsigned char sync[4] = { 0x00, 0x00, 0xff, 0xff };
+        out.insert(out.end(), sync, sync + 4);
+    }
+}
+
+// Level 0: stored blocks of up to 65535 bytes, and the final empty one last
+static void storeChunk(const unsigned char *data, int n, bool last, std::vector<unsigned char> &out) {
+    for (int begin = 0; begin < n; begin += 65535) {
+        int length = std::min(65535, n - begin);
+        const unsigned char header[5] = { 0x00, (unsigned char)length, (unsigned char)(length >> 8),
+            (unsigned char)~length, (unsigned char)(~length >> 8) };
+        out.insert(out.end(), header, header + 5);
+        out.insert(out.end(), data + begin, data + begin + length);
+    }
+    if (last) {
+        const unsigned char final[5] = { 0x01, 0x00, 0x00, 0xff, 0xff };
+        out.insert(out.end(), final, final + 5);
+    }
+}
+
+struct CrcTable {
+    uint32_t entries[256];
+
+    CrcTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            entries[i] = c;
+        }
+    }
+};
+
+static const CrcTable crcTable;
+
+static uint32_t crc32(uint32_t crc, const unsigned char *data, size_t n) {
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) {
+        crc = crcTable.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t adler32(const unsigned char *data, size_t n) {
+    uint32_t a = 1;
+    uint32_t b = 0;
+    while (n > 0) {
+        // 5552 bytes is the most that cannot overflow b before the modulo
+        size_t block = std::min(n, (size_t)5552);
+        n -= block;
+        while (block-- > 0) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+static void putBigEndian(std::vector<unsigned char> &out, uint32_t v) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back((unsigned char)(v >> shift));
+    }
+}
+
+// A PNG chunk: length, type, data and the CRC of type and data
+static void putChunk(std::vector<unsigned char> &out, const char *type, const std::vector<unsigned char> &data) {
+    putBigEndian(out, (uint32_t)data.size());
+    const size_t typeStart = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    putBigEndian(out, crc32(0, &out[typeStart], out.size() - typeStart));
+}
+
+static unsigned char paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    return (unsigned char)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+/**
+ * Filters one row into out (filter byte first): unfiltered for stored
+ * output, otherwise whichever of PNG's five filters leaves the smallest
+ * sum of magnitudes, the usual heuristic.
+ */
+static void filterRow(const unsigned char *row, const unsigned char *above, int rowBytes, bool store,
+        unsigned char *out) {
+    if (store) {
+        out[0] = 0;
+        std::copy(row, row + rowBytes, out + 1);
+        return;
+    }
+    std::vector<unsigned char> trial(rowBytes);
+    int bestCost = -1;
+    for (int filter = 0; filter < 5; filter++) {
+        int cost = 0;
+        for (int i = 0; i < rowBytes; i++) {
+            int a = i >= 3 ? row[i - 3] : 0;
+            int b = above != NULL ? above[i] : 0;
+            int c = i >= 3 && above != NULL ? above[i - 3] : 0;
+            int predicted = filter == 0 ? 0 : filter == 1 ? a : filter == 2 ? b
+                : filter == 3 ? (a + b) >> 1 : paeth(a, b, c);
+            trial[i] = (unsigned char)(row[i] - predicted);
+            cost += abs((signed char)trial[i]);
+        }
+        if (bestCost < 0 || cost < bestCost) {
+            bestCost = cost;
+            out[0] = (unsigned char)filter;
+            std::copy(trial.begin(), trial.end(), out + 1);
+        }
+    }
+}
+
+static bool writeFile(const std::string &filename, const std::vector<unsigned char> &bytes) {
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (file == NULL) {
+        std::cerr << "Could not open " << filename << " for writing." << std::endl;
+        return false;
+    }
+    bool ok = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    ok = fclose(file) == 0 && ok;
+    if (ok) {
+        std::cout << "Saved " << filename << "." << std::endl;
+    } else {
+        std::cerr << "Failed writing " << filename << "." << std::endl;
+    }
+    return ok;
+}
+
+bool writePng(const std::string &filename, const unsigned char *rgb, int width, int height, int level) {
+    level = std::min(std::max(level, 0), PNG_MAX_LEVEL);
+    const bool store = level == 0;
+    const int rowBytes = 3 * width;
+    const size_t lineBytes = rowBytes + 1;
+    std::vector<unsigned char> filtered(lineBytes * height);
+    parallelFor(height, 16, [&](int y) {
+        filterRow(rgb + (size_t)y * rowBytes, y > 0 ? rgb + (size_t)(y - 1) * rowBytes : NULL, rowBytes, store,
+            &filtered[y * lineBytes]);
+    });
+
+    const int rowsPerChunk = std::max(1, (int)(PNG_CHUNK_BYTES / lineBytes));
+    const int chunks = std::max(1, (height + rowsPerChunk - 1) / rowsPerChunk);
+    // Level 1 takes the first candidate, level 9 follows chains 256 long
+    const int maxChain = 1 << (level - 1);
+    std::vector<std::vector<unsigned char> > idat(chunks);
+    parallelFor(chunks, 1, [&](int c) {
+        const size_t begin = (size_t)c * rowsPerChunk * lineBytes;
+        const size_t end = std::min(filtered.size(), begin + (size_t)rowsPerChunk * lineBytes);
+        const bool last = c + 1 == chunks;
+        std::vector<unsigned char> &out = idat[c];
+        out.reserve(store ? end - begin + 64 : (end - begin) / 2);
+        if (c == 0) {
+            // zlib header: deflate with a 32K window, check bits for "fastest"
+            out.push_back(0x78);
+            out.push_back(0x01);
+        }
+        if (store) {
+            storeChunk(&filtered[begin], (int)(end - begin), last, out);
+        } else {
+            deflateChunk(&filtered[begin], (int)(end - begin), maxChain, last, out);
+        }
+    });
+    std::vector<unsigned char> &tail = idat[chunks - 1];
+    putBigEndian(tail, adler32(filtered.data(), filtered.size()));
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a };
+    std::vector<unsigned char> png(signature, signature + 8);
+    std::vector<unsigned char> header;
+    putBigEndian(header, width);
+    putBigEndian(header, height);
+    const unsigned char format[5] = { 8, 2, 0, 0, 0 };  // 8-bit RGB, deflate, adaptive, not interlaced
+    header.insert(header.end(), format, format + 5);
+    putChunk(png, "IHDR", header);
+    for (int c = 0; c < chunks; c++) {
+        putChunk(png, "IDAT", idat[c]);
+    }
+    putChunk(png, "IEND", std::vector<unsigned char>());
+    return writeFile(filename, png);
+}
+
+bool writeQoi(const std::string &filename, const unsigned char *rgb, int width, int height) {
+    std::vector<unsigned char> out;
+    out.reserve(14 + (size_t)width * height * 2);
+    const char magic[4] = { 'q', 'o', 'i', 'f' };
+    out.insert(out.end(), magic, magic + 4);
+    putBigEndian(out, width);
+    putBigEndian(out, height);
+    out.push_back(3);   // RGB
+    out.push_back(0);   // sRGB colour, the same encoding as the PNGs
+
+    unsigned char index[64][3] = {};
+    unsigned char previous[3] = { 0, 0, 0 };
+    const size_t count = (size_t)width * height;
+    int run = 0;
+    for (size_t p = 0; p < count; p++) {
+        const unsigned char *px = rgb + 3 * p;
+        if (px[0] == previous[0] && px[1] == previous[1] && px[2] == previous[2]) {
+            run++;
+            if (run == 62 || p + 1 == count) {
+                out.push_back((unsigned char)(0xc0 | (run - 1)));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out.push_back((unsigned char)(0xc0 | (run - 1)));
+            run = 0;
+        }
+        // Alpha is always 255
+        const int slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+        if (index[slot][0] == px[0] && index[slot][1] == px[1] && index[slot][2] == px[2]) {
+            out.push_back((unsigned char)slot);
+        } else {
+            std::copy(px, px + 3, index[slot]);
+            const int dr = (signed char)(px[0] - previous[0]);
+            const int dg = (signed char)(px[1] - previous[1]);
+            const int db = (signed char)(px[2] - previous[2]);
+            const int drDg = dr - dg;
+            const int dbDg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                out.push_back((unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+            } else if (dg >= -32 && dg <= 31 && drDg >= -8 && drDg <= 7 && dbDg >= -8 && dbDg <= 7) {
+                out.push_back((unsigned char)(0x80 | (dg + 32)));
+                out.push_back((unsigned char)((drDg + 8) << 4 | (dbDg + 8)));
+            } else {
+                out.push_back(0xfe);
+                out.insert(out.end(), px, px + 3);
+            }
+        }
+        std::copy(px, px + 3, previous);
+    }
+    const unsigned char end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    out.insert(out.end(), end, end + 8);
+    return writeFile(filename, out);
+}
+
+bool writePfm(const std::string &filename, const glm::vec3 *pixels, int width, int height, float scale,
+        bool flipX) {
+    char header[64];
+    int headerBytes = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", width, height);
+    std::vector<unsigned char> out(headerBytes + sizeof(glm::vec3) * (size_t)width * height);
+    std::copy(header, header + headerBytes, out.begin());
+    // A negative scale marks little-endian floats, which is what x86 and ARM hosts hold
+    const size_t rowBytes = sizeof(glm::vec3) * width;
+    parallelFor(height, 16, [&](int y) {
+        const glm::vec3 *row = pixels + (size_t)(height - 1 - y) * width;
+        unsigned char *line = &out[headerBytes + y * rowBytes];
+        for (int x = 0; x < width; x++) {
+            const glm::vec3 value = row[x] * scale;
+            std::copy(reinterpret_cast<const unsigned char *>(&value),
+                reinterpret_cast<const unsigned char *>(&value) + sizeof(glm::vec3),
+                line + sizeof(glm::vec3) * (flipX ? width - 1 - x : x));
+        }
+    });
+    return writeFile(filename, out);
+}
+
+// JPEG quantization tables of Annex K, in natural order, for quality 50
+static const unsigned char JPEG_LUMA_QUANT[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99 };
+static const unsigned char JPEG_CHROMA_QUANT[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99 };
+// Natural index of each zigzag position
+static const unsigned char JPEG_ZIGZAG[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
+
+// Annex K's Huffman tables: codes per length 1 to 16, then the symbols
+static const unsigned char JPEG_DC_LUMA_BITS[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const unsigned char JPEG_DC_CHROMA_BITS[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const unsigned char JPEG_DC_SYMBOLS[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const unsigned char JPEG_AC_LUMA_BITS[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const unsigned char JPEG_AC_LUMA_SYMBOLS[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa };
+static const unsigned char JPEG_AC_CHROMA_BITS[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const unsigned char JPEG_AC_CHROMA_SYMBOLS[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa };
+
+// A Huffman table's code and length per symbol, assigned canonically from its counts
+struct JpegCodes {
+    uint16_t code[256];
+    uint8_t bits[256];
+
+    JpegCodes(const unsigned char *counts, const unsigned char *symbols) {
+        std::fill(bits, bits + 256, 0);
+        uint16_t next = 0;
+        int k = 0;
+        for (int length = 1; length <= 16; length++) {
+            for (int i = 0; i < counts[length - 1]; i++, k++) {
+                code[symbols[k]] = next++;
+                bits[symbols[k]] = (uint8_t)length;
+            }
+            next <<= 1;
+        }
+    }
+};
+
+static const JpegCodes dcLumaCodes(JPEG_DC_LUMA_BITS, JPEG_DC_SYMBOLS);
+static const JpegCodes dcChromaCodes(JPEG_DC_CHROMA_BITS, JPEG_DC_SYMBOLS);
+static const JpegCodes acLumaCodes(JPEG_AC_LUMA_BITS, JPEG_AC_LUMA_SYMBOLS);
+static const JpegCodes acChromaCodes(JPEG_AC_CHROMA_BITS, JPEG_AC_CHROMA_SYMBOLS);
+
+// Cosines of the 8-point DCT-II, with its normalization folded in
+struct DctTable {
+    float c[8][8];
+
+    DctTable() {
+        for (int u = 0; u < 8; u++) {
+            for (int x = 0; x < 8; x++) {
+                c[u][x] = (u == 0 ? 0.35355339f : 0.5f) * (float)cos((2 * x + 1) * u * 3.14159265358979 / 16.0);
+            }
+        }
+    }
+};
+
+static const DctTable dctTable;
+
+// An MSB-first bit stream, with the 0x00 JPEG stuffs after every 0xff byte
+struct JpegBitWriter {
+    std::vector<unsigned char> &out;
+    uint32_t bits;
+    int count;
+
+    explicit JpegBitWriter(std::vector<unsigned char> &o) : out(o), bits(0), count(0) {}
+
+    void put(uint32_t value, int n) {
+        bits = (bits << n) | (value & ((1u << n) - 1));
+        count += n;
+        while (count >= 8) {
+            const unsigned char byte = (unsigned char)(bits >> (count - 8));
+            out.push_back(byte);
+            if (byte == 0xff) {
+                out.push_back(0);
+            }
+            count -= 8;
+        }
+    }
+
+    // Pads the last byte with 1 bits
+    void flush() {
+        if (count > 0) {
+            put(0x7f, 8 - count);
+        }
+    }
+};
+
+// Bits of |v|: the category a coefficient is coded in
+static int jpegCategory(int v) {
+    int magnitude = v < 0 ? -v : v;
+    int bits = 0;
+    while (magnitude > 0) {
+        bits++;
+        magnitude >>= 1;
+    }
+    return bits;
+}
+
+// A coefficient's category bits; negative values are sent as v - 1, one's complement
+static void putCoefficient(JpegBitWriter &writer, int v, int bits) {
+    writer.put(v < 0 ? v - 1 : v, bits);
+}
+
+static void putBlock(JpegBitWriter &writer, const short *block, int &previousDc, const JpegCodes &dc,
+        const JpegCodes &ac) {
+    const int diff = block[0] - previousDc;
+    previousDc = block[0];
+    const int category = jpegCategory(diff);
+    writer.put(dc.code[category], dc.bits[category]);
+    putCoefficient(writer, diff, category);
+
+    int run = 0;
+    for (int k = 1; k < 64; k++) {
+        const int v = block[k];
+        if (v == 0) {
+            run++;
+            continue;
+        }
+        while (run >= 16) {
+            writer.put(ac.code[0xf0], ac.bits[0xf0]);
+            run -= 16;
+        }
+        const int bits = jpegCategory(v);
+        const int symbol = run << 4 | bits;
+        writer.put(ac.code[symbol], ac.bits[symbol]);
+        putCoefficient(writer, v, bits);
+        run = 0;
+    }
+    if (run > 0) {
+        writer.put(ac.code[0], ac.bits[0]);
+    }
+}
+
+static void putMarker(std::vector<unsigned char> &out, unsigned char marker, int length) {
+    out.push_back(0xff);
+    out.push_back(marker);
+    out.push_back((unsigned char)(length >> 8));
+    out.push_back((unsigned char)length);
+}
+
+static void putHuffmanTable(std::vector<unsigned char> &out, int id, const unsigned char *counts,
+        const unsigned char *symbols, int symbolCount) {
+    out.push_back((unsigned char)id);
+    out.insert(out.end(), counts, counts + 16);
+    out.insert(out.end(), symbols, symbols + symbolCount);
+}
+
+bool encodeJpeg(const unsigned char *rgba, int width, int height, int quality, std::vector<unsigned char> &out) {
+    quality = std::min(std::max(quality, 1), 100);
+    const int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+    // Divisors per natural index, luma then chroma, and as sent in zigzag order
+    float divisor[2][64];
+    unsigned char tables[2][64];
+    for (int i = 0; i < 64; i++) {
+        const int luma = std::min(std::max((JPEG_LUMA_QUANT[i] * scale + 50) / 100, 1), 255);
+        const int chroma = std::min(std::max((JPEG_CHROMA_QUANT[i] * scale + 50) / 100, 1), 255);
+        divisor[0][i] = (float)luma;
+        divisor[1][i] = (float)chroma;
+    }
+    for (int k = 0; k < 64; k++) {
+        tables[0][k] = (unsigned char)divisor[0][JPEG_ZIGZAG[k]];
+        tables[1][k] = (unsigned char)divisor[1][JPEG_ZIGZAG[k]];
+    }
+
+    // Transform and quantize every 8x8 block of Y, Cb and Cr (4:4:4) on
+    // every core; only the entropy coding after is sequential
+    const int blocksX = (width + 7) / 8;
+    const int blocksY = (height + 7) / 8;
+    std::vector<short> coefficients((size_t)blocksX * blocksY * 3 * 64);
+    parallelFor(blocksY, 1, [&](int by) {
+        for (int bx = 0; bx < blocksX; bx++) {
+            float samples[3][64];
+            for (int y = 0; y < 8; y++) {
+                const int py = std::min(by * 8 + y, height - 1);
+                for (int x = 0; x < 8; x++) {
+                    const int px = std::min(bx * 8 + x, width - 1);
+                    const unsigned char *texel = rgba + 4 * ((size_t)py * width + px);
+                    const float r = texel[0], g = texel[1], b = texel[2];
+                    samples[0][y * 8 + x] = 0.299f * r + 0.587f * g + 0.114f * b - 128.0f;
+                    samples[1][y * 8 + x] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+                    samples[2][y * 8 + x] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+                }
+            }
+            short *blocks = &coefficients[((size_t)by * blocksX + bx) * 3 * 64];
+            for (int component = 0; component < 3; component++) {
+                // Rows, then columns
+                float rows[64];
+                for (int y = 0; y < 8; y++) {
+                    for (int u = 0; u < 8; u++) {
+                        float sum = 0.0f;
+                        for (int x = 0; x < 8; x++) {
+                            sum += dctTable.c[u][x] * samples[component][y * 8 + x];
+                        }
+                        rows[y * 8 + u] = sum;
+                    }
+                }
+                const float *d = divisor[component == 0 ? 0 : 1];
+                for (int k = 0; k < 64; k++) {
+                    const int v = JPEG_ZIGZAG[k] / 8;
+                    const int u = JPEG_ZIGZAG[k] % 8;
+                    float sum = 0.0f;
+                    for (int y = 0; y < 8; y++) {
+                        sum += dctTable.c[v][y] * rows[y * 8 + u];
+                    }
+                    blocks[component * 64 + k] = (short)lroundf(sum / d[JPEG_ZIGZAG[k]]);
+                }
+            }
+        }
+    });
+
+    out.clear();
+    out.reserve((size_t)width * height / 2 + 1024);
+    out.push_back(0xff);
+    out.push_back(0xd8);
+    // JFIF 1.01, no density or thumbnail
+    putMarker(out, 0xe0, 16);
+    const unsigned char jfif[14] = { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+    out.insert(out.end(), jfif, jfif + 14);
+    putMarker(out, 0xdb, 2 + 2 * 65);
+    for (int t = 0; t < 2; t++) {
+        out.push_back((unsigned char)t);
+        out.insert(out.end(), tables[t], tables[t] + 64);
+    }
+    // Baseline frame: 8-bit, three components at full resolution
+    putMarker(out, 0xc0, 17);
+    const unsigned char frame[15] = { 8, (unsigned char)(height >> 8), (unsigned char)height,
+        (unsigned char)(width >> 8), (unsigned char)width, 3, 1, 0x11, 0, 2, 0x11, 1, 3, 0x11, 1 };
+    out.insert(out.end(), frame, frame + 15);
+    putMarker(out, 0xc4, 2 + 4 * 17 + 2 * 12 + 2 * 162);
+    putHuffmanTable(out, 0x00, JPEG_DC_LUMA_BITS, JPEG_DC_SYMBOLS, 12);
+    putHuffmanTable(out, 0x10, JPEG_AC_LUMA_BITS, JPEG_AC_LUMA_SYMBOLS, 162);
+    putHuffmanTable(out, 0x01, JPEG_DC_CHROMA_BITS, JPEG_DC_SYMBOLS, 12);
+    putHuffmanTable(out, 0x11, JPEG_AC_CHROMA_BITS, JPEG_AC_CHROMA_SYMBOLS, 162);
+    putMarker(out, 0xda, 12);
+    const unsigned char scan[10] = { 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 };
+    out.insert(out.end(), scan, scan + 10);
+
+    JpegBitWriter writer(out);
+    int previousDc[3] = { 0, 0, 0 };
+    for (size_t block = 0; block < coefficients.size() / (3 * 64); block++) {
+        const short *blocks = &coefficients[block * 3 * 64];
+        putBlock(writer, blocks, previousDc[0], dcLumaCodes, acLumaCodes);
+        putBlock(writer, blocks + 64, previousDc[1], dcChromaCodes, acChromaCodes);
+        putBlock(writer, blocks + 128, previousDc[2], dcChromaCodes, acChromaCodes);
+    }
+    writer.flush();
+    out.push_back(0xff);
+    out.push_back(0xd9);
+    return true;
+}
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+/**
+ * Encoders for the image writer's output formats, in place of
+ * stbi_write_png's single-threaded default-level deflate once frames are
+ * rendered faster than they encode.
+ *
+ * PNGs are filtered and deflated in chunks of rows on every core, each
+ * chunk its own IDAT: level 0 stores the rows uncompressed, levels 1 to 9
+ * search ever longer hash chains for matches coded with deflate's fixed
+ * Huffman tables, the way fast PNG encoders trade size for speed. Chunks end
+ * on an empty stored block, so their streams concatenate into one valid
+ * zlib stream; matches never reach back into an earlier chunk.
+ *
+ * QOI (qoiformat.org) and PFM suit intermediate frames: QOI is lossless 8-bit
+ * at a fraction of deflate's cost, PFM the raw linear floats, unclamped.
+ * JPEG, baseline 4:4:4 with the standard tables, is for --server's frames.
+ */
+namespace imageEncoder {
+    // Highest PNG compression level, as with zlib
+    const int PNG_MAX_LEVEL = 9;
+
+    // Writes width x height 8-bit RGB as filename, top row first
+    bool writePng(const std::string &filename, const unsigned char *rgb, int width, int height, int level);
+
+    bool writeQoi(const std::string &filename, const unsigned char *rgb, int width, int height);
+
+    // Writes linear pixels times `scale`, top row first, in PFM's bottom-up order
+    bool writePfm(const std::string &filename, const glm::vec3 *pixels, int width, int height, float scale,
+            bool flipX);
+
+    // Encodes width x height RGBA (alpha ignored), top row first, at quality 1 to 100
+    bool encodeJpeg(const unsigned char *rgba, int width, int height, int quality, std::vector<unsigned char> &out);
+}
@@ -0,0 +1,531 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <stb_image.h>
+
+#include "imageMetrics.h"
+#include "deviceMemory.h"
+#include "utilities.h"
+#include "../stream_compaction/common.h"
+
+#define METRICS_BLOCK_EDGE 16
+#define METRICS_BLOCK_SIZE (METRICS_BLOCK_EDGE * METRICS_BLOCK_EDGE)
+#define METRICS_WARP_SIZE 32
+
+// What every pixel adds to the totals
+enum MetricSum {
+    SUM_SQUARED_ERROR,  // over the three channels
+    SUM_SSIM,           // of the window whose corner it is, if any
+    SUM_FLIP,
+    METRICS_SUMS,
+};
+
+// FLIP's exponents and its colour error's breakpoint
+#define FLIP_QC 0.7f
+#define FLIP_QF 0.5f
+#define FLIP_PC 0.4f
+#define FLIP_PT 0.95f
+
+// The filter footprints at FLIP_PPD, as FLIP sizes them: three standard
+// deviations of the widest contrast sensitivity Gaussian, and of the
+// feature detectors' Gaussian
+#define FLIP_COLOR_RADIUS 10
+#define FLIP_FEATURE_RADIUS 9
+#define FLIP_COLOR_TAPS (2 * FLIP_COLOR_RADIUS + 1)
+#define FLIP_FEATURE_TAPS (2 * FLIP_FEATURE_RADIUS + 1)
+
+// The contrast sensitivity filters of the three opponent channels, each
+// normalized, and the edge and point detectors along x; transposed, they
+// detect along y
+__constant__ float3 c_flipColorKernel[FLIP_COLOR_TAPS * FLIP_COLOR_TAPS];
+__constant__ float2 c_flipFeatureKernel[FLIP_FEATURE_TAPS * FLIP_FEATURE_TAPS];
+
+static int referenceWidth = 0;
+static int referenceHeight = 0;
+static bool referenceSet = false;
+static bool kernelsUploaded = false;
+static float flipColorMax = 0.0f;   // the error between pure green and blue, FLIP's cmax
+static float4 *dev_reference = NULL;            // clamped
+static float4 *dev_referenceLab = NULL;         // filtered, as Hunt-adjusted L*a*b*
+static float2 *dev_referenceFeatures = NULL;    // edge and point magnitudes
+static float4 *dev_ycxcz = NULL;                // the image being scored, see toYcxcz
+static float *dev_partials = NULL;              // METRICS_SUMS per scoring block
+static double *dev_sums = NULL;
+
+static dim3 scoringBlocks(int width, int height) {
+    return dim3((width + METRICS_BLOCK_EDGE - 1) / METRICS_BLOCK_EDGE,
+        (height + METRICS_BLOCK_EDGE - 1) / METRICS_BLOCK_EDGE);
+}
+
+// The colour spaces FLIP works in, with its D65 white
+__host__ __device__ inline glm::vec3 flipWhite() {
+    return glm::vec3(0.950428545f, 1.0f, 1.088900371f);
+}
+
+__host__ __device__ inline float srgbToLinear(float c) {
+    return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+__host__ __device__ inline glm::vec3 linearToXyz(glm::vec3 c) {
+    return glm::vec3(
+        0.41238656f * c.x + 0.35759149f * c.y + 0.18045049f * c.z,
+        0.21263682f * c.x + 0.71518298f * c.y + 0.07218020f * c.z,
+        0.01933062f * c.x + 0.11919716f * c.y + 0.95037259f * c.z);
+}
+
+__host__ __device__ inline glm::vec3 xyzToLinear(glm::vec3 c) {
+    return glm::vec3(
+        3.241003275f * c.x - 1.537398934f * c.y - 0.498615861f * c.z,
+        -0.969224334f * c.x + 1.875930071f * c.y + 0.041554224f * c.z,
+        0.055639423f * c.x - 0.204011202f * c.y + 1.057148933f * c.z);
+}
+
+__host__ __device__ inline glm::vec3 xyzToYcxcz(glm::vec3 xyz) {
+    const glm::vec3 v = xyz / flipWhite();
+    return glm::vec3(116.0f * v.y - 16.0f, 500.0f * (v.x - v.y), 200.0f * (v.y - v.z));
+}
+
+__host__ __device__ inline glm::vec3 ycxczToXyz(glm::vec3 c) {
+    const float y = (c.x + 16.0f) / 116.0f;
+    return glm::vec3(y + c.y / 500.0f, y, y - c.z / 200.0f) * flipWhite();
+}
+
+__host__ __device__ inline float labCurve(float t) {
+    const float delta = 6.0f / 29.0f;
+    return t > delta * delta * delta ? cbrtf(t) : t / (3.0f * delta * delta) + 4.0f / 29.0f;
+}
+
+__host__ __device__ inline glm::vec3 xyzToLab(glm::vec3 xyz) {
+    const glm::vec3 v = xyz / flipWhite();
+    const glm::vec3 f(labCurve(v.x), labCurve(v.y), labCurve(v.z));
+    return glm::vec3(116.0f * f.y - 16.0f, 500.0f * (f.x - f.y), 200.0f * (f.y - f.z));
+}
+
+// Chroma scaled by lightness, as the Hunt effect makes dark colours look duller
+__host__ __device__ inline glm::vec3 huntAdjust(glm::vec3 lab) {
+    return glm::vec3(lab.x, 0.01f * lab.x * lab.y, 0.01f * lab.x * lab.z);
+}
+
+__host__ __device__ inline float hyab(glm::vec3 a, glm::vec3 b) {
+    const glm::vec3 d = a - b;
+    return fabsf(d.x) + sqrtf(d.y * d.y + d.z * d.z);
+}
+
+// `scale` times a texel, clamped as a PNG would hold it
+__device__ inline glm::vec3 displayValue(const float4 *image, int index, float scale) {
+    const float4 c = image[index];
+    return glm::clamp(glm::vec3(c.x, c.y, c.z) * scale, 0.0f, 1.0f);
+}
+
+__device__ inline float luminance(glm::vec3 c) {
+    return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+/**
+ * Converts the display values of `image` to FLIP's YCxCz opponent space,
+ * with the luminance its feature detectors see, in [0, 1], in w. With
+ * `clamped` set the display values are kept there too, for the reference.
+ */
+__global__ void toYcxcz(glm::ivec2 resolution, const float4 *image, float scale, float4 *out, float4 *clamped) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        const int index = x + (y * resolution.x);
+        const glm::vec3 c = displayValue(image, index, scale);
+        const glm::vec3 ycxcz = xyzToYcxcz(linearToXyz(
+            glm::vec3(srgbToLinear(c.x), srgbToLinear(c.y), srgbToLinear(c.z))));
+        out[index] = make_float4(ycxcz.x, ycxcz.y, ycxcz.z, (ycxcz.x + 16.0f) / 116.0f);
+        if (clamped != NULL) {
+            clamped[index] = make_float4(c.x, c.y, c.z, 0.0f);
+        }
+    }
+}
+
+/**
+ * FLIP's preprocessing of the pixel at (x, y) of a YCxCz image: its colour
+ * through the contrast sensitivity filters, as Hunt-adjusted L*a*b*, and
+ * the magnitudes of the luminance's edge and point responses there. Taps
+ * past the border repeat the edge pixels.
+ */
+__device__ void flipFilter(glm::ivec2 resolution, const float4 *ycxcz, int x, int y,
+        glm::vec3 &lab, glm::vec2 &features) {
+    glm::vec3 filtered(0.0f);
+    for (int dy = -FLIP_COLOR_RADIUS; dy <= FLIP_COLOR_RADIUS; dy++) {
+        const int row = min(max(y + dy, 0), resolution.y - 1) * resolution.x;
+        for (int dx = -FLIP_COLOR_RADIUS; dx <= FLIP_COLOR_RADIUS; dx++) {
+            const float4 c = ycxcz[row + min(max(x + dx, 0), resolution.x - 1)];
+            const float3 w = c_flipColorKernel[(dy + FLIP_COLOR_RADIUS) * FLIP_COLOR_TAPS + dx + FLIP_COLOR_RADIUS];
+            filtered += glm::vec3(w.x * c.x, w.y * c.y, w.z * c.z);
+        }
+    }
+    const glm::vec3 linear = glm::clamp(xyzToLinear(ycxczToXyz(filtered)), 0.0f, 1.0f);
+    lab = huntAdjust(xyzToLab(linearToXyz(linear)));
+
+    glm::vec2 edge(0.0f);
+    glm::vec2 point(0.0f);
+    for (int dy = -FLIP_FEATURE_RADIUS; dy <= FLIP_FEATURE_RADIUS; dy++) {
+        const int row = min(max(y + dy, 0), resolution.y - 1) * resolution.x;
+        for (int dx = -FLIP_FEATURE_RADIUS; dx <= FLIP_FEATURE_RADIUS; dx++) {
+            const float l = ycxcz[row + min(max(x + dx, 0), resolution.x - 1)].w;
+            const float2 alongX = c_flipFeatureKernel[(dy + FLIP_FEATURE_RADIUS) * FLIP_FEATURE_TAPS
+                + dx + FLIP_FEATURE_RADIUS];
+            const float2 alongY = c_flipFeatureKernel[(dx + FLIP_FEATURE_RADIUS) * FLIP_FEATURE_TAPS
+                + dy + FLIP_FEATURE_RADIUS];
+            edge += l * glm::vec2(alongX.x, alongY.x);
+            point += l * glm::vec2(alongX.y, alongY.y);
+        }
+    }
+    features = glm::vec2(glm::length(edge), glm::length(point));
+}
+
+__global__ void filterReference(glm::ivec2 resolution, const float4 *ycxcz, float4 *referenceLab,
+        float2 *referenceFeatures) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        const int index = x + (y * resolution.x);
+        glm::vec3 lab;
+        glm::vec2 features;
+        flipFilter(resolution, ycxcz, x, y, lab, features);
+        referenceLab[index] = make_float4(lab.x, lab.y, lab.z, 0.0f);
+        referenceFeatures[index] = make_float2(features.x, features.y);
+    }
+}
+
+// The colour error, remapped to put most of [0, 1] below pc * cmax, raised
+// to one less the feature error, which is how FLIP weighs edges it moved
+__device__ float flipError(glm::vec3 lab, glm::vec2 features, float4 referenceLab, float2 referenceFeatures,
+        float cmax) {
+    const float colorDistance = powf(hyab(lab, glm::vec3(referenceLab.x, referenceLab.y, referenceLab.z)), FLIP_QC);
+    const float knee = FLIP_PC * cmax;
+    const float colorError = colorDistance < knee ? (FLIP_PT / knee) * colorDistance
+        : FLIP_PT + ((colorDistance - knee) / (cmax - knee)) * (1.0f - FLIP_PT);
+    const float featureDistance = fmaxf(fabsf(features.x - referenceFeatures.x),
+        fabsf(features.y - referenceFeatures.y));
+    const float featureError = powf(featureDistance * 0.70710678f, FLIP_QF);
+    return powf(colorError, 1.0f - featureError);
+}
+
+// SSIM of the luminance over the window with its corner at (x0, y0)
+__device__ float windowSsim(glm::ivec2 resolution, const float4 *image, float scale, const float4 *reference,
+        int x0, int y0) {
+    const float c1 = 0.01f * 0.01f;
+    const float c2 = 0.03f * 0.03f;
+    const float n = SSIM_WINDOW * SSIM_WINDOW;
+    float sx = 0.0f, sy = 0.0f, sxx = 0.0f, syy = 0.0f, sxy = 0.0f;
+    for (int y = y0; y < y0 + SSIM_WINDOW; y++) {
+        for (int x = x0; x < x0 + SSIM_WINDOW; x++) {
+            const int index = x + (y * resolution.x);
+            const float a = luminance(displayValue(image, index, scale));
+            const float b = luminance(displayValue(reference, index, 1.0f));
+            sx += a;
+            sy += b;
+            sxx += a * a;
+            syy += b * b;
+            sxy += a * b;
+        }
+    }
+    const float mx = sx / n;
+    const float my = sy / n;
+    const float vx = sxx / n - mx * mx;
+    const float vy = syy / n - my * my;
+    const float cov = sxy / n - mx * my;
+    return ((2.0f * mx * my + c1) * (2.0f * cov + c2)) / ((mx * mx + my * my + c1) * (vx + vy + c2));
+}
+
+// Adds up the block's `sums` into partials[sum * blocks + block], one
+// shuffle reduction per warp and one more over the warps
+__device__ void blockSums(float (&sums)[METRICS_SUMS], float *partials) {
+    __shared__ float warpSums[METRICS_SUMS][METRICS_BLOCK_SIZE / METRICS_WARP_SIZE];
+    const int thread = threadIdx.x + (threadIdx.y * blockDim.x);
+    const int lane = thread % METRICS_WARP_SIZE;
+    const int warp = thread / METRICS_WARP_SIZE;
+    for (int s = 0; s < METRICS_SUMS; s++) {
+        for (int offset = METRICS_WARP_SIZE / 2; offset > 0; offset /= 2) {
+            sums[s] += __shfl_down_sync(0xffffffff, sums[s], offset);
+        }
+        if (lane == 0) {
+            warpSums[s][warp] = sums[s];
+        }
+    }
+    __syncthreads();
+    if (warp != 0) {
+        return;
+    }
+    const int blocks = gridDim.x * gridDim.y;
+    const int block = blockIdx.x + (blockIdx.y * gridDim.x);
+    for (int s = 0; s < METRICS_SUMS; s++) {
+        float sum = lane < METRICS_BLOCK_SIZE / METRICS_WARP_SIZE ? warpSums[s][lane] : 0.0f;
+        for (int offset = METRICS_WARP_SIZE / 2; offset > 0; offset /= 2) {
+            sum += __shfl_down_sync(0xffffffff, sum, offset);
+        }
+        if (lane == 0) {
+            partials[s * blocks + block] = sum;
+        }
+    }
+}
+
+/**
+ * Scores every pixel of `scale` times `image`, whose YCxCz is in `ycxcz`,
+ * against the reference, leaving the block's totals in `partials`.
+ */
+__global__ void scorePixels(glm::ivec2 resolution, const float4 *image, float scale, const float4 *ycxcz,
+        const float4 *reference, const float4 *referenceLab, const float2 *referenceFeatures, float cmax,
+        float *partials) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    float sums[METRICS_SUMS] = { 0.0f, 0.0f, 0.0f };
+    if (x < resolution.x && y < resolution.y) {
+        const int index = x + (y * resolution.x);
+        const glm::vec3 d = displayValue(image, index, scale) - displayValue(reference, index, 1.0f);
+        sums[SUM_SQUARED_ERROR] = glm::dot(d, d);
+        if (x % SSIM_STRIDE == 0 && y % SSIM_STRIDE == 0
+                && x + SSIM_WINDOW <= resolution.x && y + SSIM_WINDOW <= resolution.y) {
+            sums[SUM_SSIM] = windowSsim(resolution, image, scale, reference, x, y);
+        }
+        glm::vec3 lab;
+        glm::vec2 features;
+        flipFilter(resolution, ycxcz, x, y, lab, features);
+        sums[SUM_FLIP] = flipError(lab, features, referenceLab[index], referenceFeatures[index], cmax);
+    }
+    blockSums(sums, partials);
+}
+
+// Block s adds up sum s over the scoring pass's `blocks` partials, in double
+__global__ void sumPartials(int blocks, const float *partials, double *sums) {
+    __shared__ double threadSums[METRICS_BLOCK_SIZE];
+    double sum = 0.0;
+    for (int i = threadIdx.x; i < blocks; i += blockDim.x) {
+        sum += partials[blockIdx.x * blocks + i];
+    }
+    threadSums[threadIdx.x] = sum;
+    __syncthreads();
+    for (int stride = blockDim.x / 2; stride > 0; stride /= 2) {
+        if (threadIdx.x < stride) {
+            threadSums[threadIdx.x] += threadSums[threadIdx.x + stride];
+        }
+        __syncthreads();
+    }
+    if (threadIdx.x == 0) {
+        sums[blockIdx.x] = threadSums[0];
+    }
+}
+
+/**
+ * Fills the FLIP filters' constant memory, sampled at FLIP_PPD. The colour
+ * filters are FLIP's sums of Gaussians in degrees of visual angle, the
+ * feature detectors the first and second x derivatives of a Gaussian of
+ * 0.082 degrees' width, their positive and negative weights each summing
+ * to one.
+ */
+static void uploadFlipKernels() {
+    const float a1[3] = { 1.0f, 1.0f, 34.1f };
+    const float b1[3] = { 0.0047f, 0.0053f, 0.04f };
+    const float a2[3] = { 0.0f, 0.0f, 13.5f };
+    const float b2[3] = { 1e-5f, 1e-5f, 0.025f };
+    float3 color[FLIP_COLOR_TAPS * FLIP_COLOR_TAPS];
+    float colorTotals[3] = { 0.0f, 0.0f, 0.0f };
+    for (int dy = -FLIP_COLOR_RADIUS; dy <= FLIP_COLOR_RADIUS; dy++) {
+        for (int dx = -FLIP_COLOR_RADIUS; dx <= FLIP_COLOR_RADIUS; dx++) {
+            const float degrees2 = (float)(dx * dx + dy * dy) / (FLIP_PPD * FLIP_PPD);
+            float w[3];
+            for (int c = 0; c < 3; c++) {
+                w[c] = a1[c] * sqrtf(PI / b1[c]) * expf(-PI * PI * degrees2 / b1[c])
+                    + a2[c] * sqrtf(PI / b2[c]) * expf(-PI * PI * degrees2 / b2[c]);
+                colorTotals[c] += w[c];
+            }
+            color[(dy + FLIP_COLOR_RADIUS) * FLIP_COLOR_TAPS + dx + FLIP_COLOR_RADIUS] = make_float3(w[0], w[1], w[2]);
+        }
+    }
+    for (int i = 0; i < FLIP_COLOR_TAPS * FLIP_COLOR_TAPS; i++) {
+        color[i] = make_float3(color[i].x / colorTotals[0], color[i].y / colorTotals[1], color[i].z / colorTotals[2]);
+    }
+
+    const float sd = 0.5f * 0.082f * FLIP_PPD;
+    float2 feature[FLIP_FEATURE_TAPS * FLIP_FEATURE_TAPS];
+    float positive[2] = { 0.0f, 0.0f };
+    float negative[2] = { 0.0f, 0.0f };
+    for (int dy = -FLIP_FEATURE_RADIUS; dy <= FLIP_FEATURE_RADIUS; dy++) {
+        for (int dx = -FLIP_FEATURE_RADIUS; dx <= FLIP_FEATURE_RADIUS; dx++) {
+            const float g = expf(-(float)(dx * dx + dy * dy) / (2.0f * sd * sd));
+            const float w[2] = { -dx * g, ((float)(dx * dx) / (sd * sd) - 1.0f) * g };
+            for (int k = 0; k < 2; k++) {
+                (w[k] > 0.0f ? positive[k] : negative[k]) += fabsf(w[k]);
+            }
+            feature[(dy + FLIP_FEATURE_RADIUS) * FLIP_FEATURE_TAPS + dx + FLIP_FEATURE_RADIUS] = make_float2(w[0], w[1]);
+        }
+    }
+    for (int i = 0; i < FLIP_FEATURE_TAPS * FLIP_FEATURE_TAPS; i++) {
+        feature[i].x /= feature[i].x > 0.0f ? positive[0] : negative[0];
+        feature[i].y /= feature[i].y > 0.0f ? positive[1] : negative[1];
+    }
+
+    cudaMemcpyToSymbol(c_flipColorKernel, color, sizeof(color));
+    cudaMemcpyToSymbol(c_flipFeatureKernel, feature, sizeof(feature));
+    const glm::vec3 green = huntAdjust(xyzToLab(linearToXyz(glm::vec3(0.0f, 1.0f, 0.0f))));
+    const glm::vec3 blue = huntAdjust(xyzToLab(linearToXyz(glm::vec3(0.0f, 0.0f, 1.0f))));
+    flipColorMax = powf(hyab(green, blue), FLIP_QC);
+    kernelsUploaded = true;
+}
+
+static void releaseBuffers() {
+    deviceMemory::release(dev_reference);
+    deviceMemory::release(dev_referenceLab);
+    deviceMemory::release(dev_referenceFeatures);
+    deviceMemory::release(dev_ycxcz);
+    deviceMemory::release(dev_partials);
+    deviceMemory::release(dev_sums);
+    dev_reference = NULL;
+    dev_referenceLab = NULL;
+    dev_referenceFeatures = NULL;
+    dev_ycxcz = NULL;
+    dev_partials = NULL;
+    dev_sums = NULL;
+}
+
+// Sizes the buffers for a width x height reference, keeping them if they fit
+static void allocate(int width, int height) {
+    if (dev_reference != NULL && width == referenceWidth && height == referenceHeight) {
+        return;
+    }
+    releaseBuffers();
+    const size_t pixelcount = (size_t)width * height;
+    const dim3 blocks = scoringBlocks(width, height);
+    deviceMemory::allocate(&dev_reference, pixelcount * sizeof(float4));
+    deviceMemory::allocate(&dev_referenceLab, pixelcount * sizeof(float4));
+    deviceMemory::allocate(&dev_referenceFeatures, pixelcount * sizeof(float2));
+    deviceMemory::allocate(&dev_ycxcz, pixelcount * sizeof(float4));
+    deviceMemory::allocate(&dev_partials, METRICS_SUMS * blocks.x * blocks.y * sizeof(float));
+    deviceMemory::allocate(&dev_sums, METRICS_SUMS * sizeof(double));
+    referenceWidth = width;
+    referenceHeight = height;
+}
+
+void imageMetrics::setReference(const float4 *reference, float scale, int width, int height) {
+    if (!kernelsUploaded) {
+        uploadFlipKernels();
+    }
+    allocate(width, height);
+    const glm::ivec2 resolution(width, height);
+    const dim3 blockSize2d(METRICS_BLOCK_EDGE, METRICS_BLOCK_EDGE);
+    const dim3 blocksPerGrid2d = scoringBlocks(width, height);
+    // The clamped copy may overwrite `reference` in place, when it was
+    // uploaded there
+    toYcxcz<<<blocksPerGrid2d, blockSize2d>>>(resolution, reference, scale, dev_ycxcz, dev_reference);
+    filterReference<<<blocksPerGrid2d, blockSize2d>>>(resolution, dev_ycxcz, dev_referenceLab,
+        dev_referenceFeatures);
+    referenceSet = true;
+
+    checkCUDAError("imageMetrics::setReference");
+}
+
+void imageMetrics::setReference(const std::vector<glm::vec3> &reference, int width, int height) {
+    allocate(width, height);
+    std::vector<float4> texels(reference.size());
+    for (size_t i = 0; i < reference.size(); i++) {
+        texels[i] = make_float4(reference[i].x, reference[i].y, reference[i].z, 0.0f);
+    }
+    cudaMemcpy(dev_reference, texels.data(), texels.size() * sizeof(float4), cudaMemcpyHostToDevice);
+    setReference(dev_reference, 1.0f, width, height);
+}
+
+// A little-endian colour PFM as imageEncoder::writePfm writes it: rows
+// bottom up, and mirrored like the PNG output
+static bool readPfm(const std::string &filename, int &width, int &height, std::vector<glm::vec3> &pixels) {
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    std::string magic;
+    float scale = 0.0f;
+    if (!(in >> magic >> width >> height >> scale) || magic != "PF" || scale >= 0.0f || width <= 0 || height <= 0) {
+        return false;
+    }
+    // The single whitespace character ending the header
+    in.get();
+    std::vector<glm::vec3> rows((size_t)width * height);
+    if (!in.read(reinterpret_cast<char *>(rows.data()), rows.size() * sizeof(glm::vec3))) {
+        return false;
+    }
+    pixels.resize(rows.size());
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            pixels[x + (size_t)y * width] = rows[(width - 1 - x) + (size_t)(height - 1 - y) * width];
+        }
+    }
+    return true;
+}
+
+bool imageMetrics::loadReference(const std::string &filename, int width, int height, std::string &error) {
+    size_t dot = filename.find_last_of('.');
+    std::string extension = dot == std::string::npos ? "" : filename.substr(dot + 1);
+    std::vector<glm::vec3> pixels;
+    int fileWidth = 0, fileHeight = 0;
+    if (extension == "pfm" || extension == "PFM") {
+        if (!readPfm(filename, fileWidth, fileHeight, pixels)) {
+            error = "could not read reference " + filename;
+            return false;
+        }
+    } else {
+        int channels;
+        unsigned char *bytes = stbi_load(filename.c_str(), &fileWidth, &fileHeight, &channels, 3);
+        if (bytes == NULL) {
+            error = "could not read reference " + filename + ": " + stbi_failure_reason();
+            return false;
+        }
+        pixels.resize((size_t)fileWidth * fileHeight);
+        for (int y = 0; y < fileHeight; y++) {
+            for (int x = 0; x < fileWidth; x++) {
+                const unsigned char *texel = bytes + 3 * ((fileWidth - 1 - x) + (size_t)y * fileWidth);
+                pixels[x + (size_t)y * fileWidth] = glm::vec3(texel[0], texel[1], texel[2]) / 255.0f;
+            }
+        }
+        stbi_image_free(bytes);
+    }
+    if (fileWidth != width || fileHeight != height) {
+        char size[64];
+        snprintf(size, sizeof(size), " is %dx%d, not %dx%d", fileWidth, fileHeight, width, height);
+        error = "reference " + filename + size;
+        return false;
+    }
+    setReference(pixels, width, height);
+    return true;
+}
+
+bool imageMetrics::hasReference() {
+    return referenceSet;
+}
+
+imageMetrics::Scores imageMetrics::compare(const float4 *image, float scale) {
+    Scores scores = { 0.0f, 0.0f, 0.0f };
+    if (!referenceSet) {
+        return scores;
+    }
+    const glm::ivec2 resolution(referenceWidth, referenceHeight);
+    const dim3 blockSize2d(METRICS_BLOCK_EDGE, METRICS_BLOCK_EDGE);
+    const dim3 blocksPerGrid2d = scoringBlocks(referenceWidth, referenceHeight);
+    const int blocks = blocksPerGrid2d.x * blocksPerGrid2d.y;
+    toYcxcz<<<blocksPerGrid2d, blockSize2d>>>(resolution, image, scale, dev_ycxcz, NULL);
+    scorePixels<<<blocksPerGrid2d, blockSize2d>>>(resolution, image, scale, dev_ycxcz, dev_reference,
+        dev_referenceLab, dev_referenceFeatures, flipColorMax, dev_partials);
+    sumPartials<<<METRICS_SUMS, METRICS_BLOCK_SIZE>>>(blocks, dev_partials, dev_sums);
+    double sums[METRICS_SUMS];
+    cudaMemcpy(sums, dev_sums, sizeof(sums), cudaMemcpyDeviceToHost);
+    checkCUDAError("imageMetrics::compare");
+
+    const double pixels = (double)referenceWidth * referenceHeight;
+    const double mse = sums[SUM_SQUARED_ERROR] / (3.0 * pixels);
+    scores.psnr = mse <= 0.0 ? METRICS_MAX_PSNR : std::min((float)(10.0 * log10(1.0 / mse)), METRICS_MAX_PSNR);
+    const int windows = referenceWidth >= SSIM_WINDOW && referenceHeight >= SSIM_WINDOW
+        ? ((referenceWidth - SSIM_WINDOW) / SSIM_STRIDE + 1) * ((referenceHeight - SSIM_WINDOW) / SSIM_STRIDE + 1)
+        : 0;
+    scores.ssim = windows > 0 ? (float)(sums[SUM_SSIM] / windows) : 1.0f;
+    scores.flip = (float)(sums[SUM_FLIP] / pixels);
+    return scores;
+}
+
+void imageMetrics::release() {
+    releaseBuffers();
+    referenceSet = false;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+#include <glm/glm.hpp>
+
+// PSNR reported for images identical to the reference
+#define METRICS_MAX_PSNR 100.0f
+// SSIM window edge and stride, in pixels
+#define SSIM_WINDOW 8
+#define SSIM_STRIDE 4
+// Viewing distance FLIP assumes, in pixels per degree of visual angle: a
+// 0.7 m view of a 4K 24" monitor, FLIP's own default
+#define FLIP_PPD 67.0f
+
+/**
+ * Image quality against a reference, measured on the primary device so a
+ * render can be scored every few samples without copying it back. All
+ * three metrics see the clamped [0, 1] values that an exported PNG would
+ * hold:
+ *
+ * - PSNR in dB over the three channels, up to METRICS_MAX_PSNR
+ * - mean SSIM of the luminance, over SSIM_WINDOW square windows placed
+ *   every SSIM_STRIDE pixels
+ * - mean LDR-FLIP error (Andersson et al. 2020), 0 for identical images
+ *   and 1 at worst, at FLIP_PPD pixels per degree, taking the clamped
+ *   values as sRGB-encoded, as a viewer shows the PNG
+ *
+ * Every pixel is scored in one pass that sums per block, followed by a
+ * pass over the block sums; only the three totals are read back. The
+ * reference's filtered FLIP colours and features are kept from
+ * setReference(), so each compare() filters only the image. While a
+ * reference is set its buffers take 56 bytes per pixel.
+ */
+namespace imageMetrics {
+    struct Scores {
+        float psnr;
+        float ssim;
+        float flip;
+    };
+
+    // Scores later images against `scale` times the width x height texels
+    // of `reference`, in the renderer's pixel order, e.g. an averaged dev_image
+    void setReference(const float4 *reference, float scale, int width, int height);
+
+    // Same from host pixels, already normalized
+    void setReference(const std::vector<glm::vec3> &reference, int width, int height);
+
+    /**
+     * Reads a PNG or PFM image as --headless writes them, mirrored back
+     * into the renderer's pixel order, as the reference; it must be width x
+     * height. PNG bytes are taken as the clamped values they were written
+     * from. False with `error` set if it cannot be used.
+     */
+    bool loadReference(const std::string &filename, int width, int height, std::string &error);
+
+    bool hasReference();
+
+    // Scores `scale` times the reference-sized texels of `image`, which
+    // must be ready for the default stream, and waits for the scores
+    Scores compare(const float4 *image, float scale);
+
+    // Drops the reference and its buffers
+    void release();
+}
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "imageWriter.h"
+#include "image.h"
+#include "imageEncoder.h"
+#include "exrWriter.h"
+#include "gbuffer.h"
+
+namespace imageWriter {
+
+struct WriteJob {
+    std::vector<glm::vec3> pixels;
+    int width;
+    int height;
+    float scale;
+    std::string filename;
+};
+
+static int outputFormat = IMAGE_PNG;
+static int outputPngLevel = 6;
+
+static std::mutex queueMutex;
+static std::condition_variable workerDone;
+static std::deque<std::function<void()> > queue;
+// The worker only lives while there is work, so nothing outlives flush()
+static bool workerRunning = false;
+
+void setFormat(int format, int pngLevel) {
+    outputFormat = format;
+    outputPngLevel = std::min(std::max(pngLevel, 0), imageEncoder::PNG_MAX_LEVEL);
+}
+
+const char *extension() {
+    return outputFormat == IMAGE_QOI ? "qoi" : outputFormat == IMAGE_PFM ? "pfm" : "png";
+}
+
+void writeImage(const std::vector<glm::vec3> &pixels, int width, int height,
+        float scale, const std::string &filename) {
+    const std::string path = filename + "." + extension();
+    if (outputFormat == IMAGE_PFM) {
+        imageEncoder::writePfm(path, pixels.data(), width, height, scale, true);
+        return;
+    }
+    std::vector<unsigned char> bytes;
+    quantizeRGB8(pixels.data(), width, height, scale, true, bytes);
+    if (outputFormat == IMAGE_QOI) {
+        imageEncoder::writeQoi(path, bytes.data(), width, height);
+    } else {
+        imageEncoder::writePng(path, bytes.data(), width, height, outputPngLevel);
+    }
+}
+
+/**
+ * Appends one layer of `count` channels, value(pixel index, channel) each,
+ * with the same horizontal flip as the PNG output.
+ */
+template <typename F>
+static void addLayer(std::vector<exrWriter::Channel> &channels, const char *layer,
+        const char **names, int count, int width, int height, F value) {
+    for (int c = 0; c < count; c++) {
+        exrWriter::Channel channel;
+        channel.name = std::string(layer) + "." + names[c];
+        channel.values.resize((size_t)width * height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                channel.values[(width - 1 - x) + y * width] = value(x + y * width, c);
+            }
+        }
+        channels.push_back(std::move(channel));
+    }
+}
+
+static void writeAovs(const AovSnapshot &snapshot, int width, int height, const std::string &filename) {
+    const char *rgb[3] = { "R", "G", "B" };
+    const char *xyz[3] = { "X", "Y", "Z" };
+    std::vector<exrWriter::Channel> channels;
+
+    addLayer(channels, "beauty", rgb, 3, width, height, [&](int i, int c) {
+        return snapshot.beauty[i][c] * snapshot.beautyScale;
+    });
+    if (!snapshot.denoised.empty()) {
+        addLayer(channels, "denoised", rgb, 3, width, height, [&](int i, int c) {
+            return snapshot.denoised[i][c];
+        });
+    }
+    addLayer(channels, "normal", xyz, 3, width, height, [&](int i, int c) {
+        return gbufferNormal(snapshot.gBuffer[i])[c];
+    });
+    addLayer(channels, "depth", xyz + 2, 1, width, height, [&](int i, int) {
+        float t = snapshot.gBuffer[i].t;
+        return t > 0.0f ? t : std::numeric_limits<float>::infinity();
+    });
+    addLayer(channels, "albedo", rgb, 3, width, height, [&](int i, int c) {
+        return gbufferAlbedo(snapshot.gBuffer[i])[c];
+    });
+
+    exrWriter::write(filename, width, height, channels);
+}
+
+static void workerLoop() {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    while (!queue.empty()) {
+        std::function<void()> job;
+        std::swap(job, queue.front());
+        queue.pop_front();
+
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+    workerRunning = false;
+    workerDone.notify_all();
+}
+
+static void enqueue(const std::function<void()> &job) {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    queue.push_back(job);
+    if (!workerRunning) {
+        // Detached: flush() is how callers wait for it before exiting
+        std::thread(workerLoop).detach();
+        workerRunning = true;
+    }
+}
+
+void writeImageAsync(std::vector<glm::vec3> &pixels, int width, int height,
+        float scale, const std::string &filename) {
+    std::shared_ptr<WriteJob> job(new WriteJob);
+    job->pixels.swap(pixels);
+    job->width = width;
+    job->height = height;
+    job->scale = scale;
+    job->filename = filename;
+    enqueue([job] {
+        writeImage(job->pixels, job->width, job->height, job->scale, job->filename);
+    });
+}
+
+void writeAovsAsync(AovSnapshot &snapshot, int width, int height, const std::string &filename) {
+    std::shared_ptr<AovSnapshot> job(new AovSnapshot);
+    job->beauty.swap(snapshot.beauty);
+    job->beautyScale = snapshot.beautyScale;
+    job->denoised.swap(snapshot.denoised);
+    job->gBuffer.swap(snapshot.gBuffer);
+    enqueue([job, width, height, filename] {
+        writeAovs(*job, width, height, filename);
+    });
+}
+
+void writeAccumulationAsync(accumulationFile::Accumulation &accumulation, const std::string &filename) {
+    std::shared_ptr<accumulationFile::Accumulation> job(new accumulationFile::Accumulation);
+    job->width = accumulation.width;
+    job->height = accumulation.height;
+    job->samples = accumulation.samples;
+    job->image.swap(accumulation.image);
+    job->moments.swap(accumulation.moments);
+    job->packed.swap(accumulation.packed);
+    job->gBuffer.swap(accumulation.gBuffer);
+    enqueue([job, filename] {
+        accumulationFile::write(filename, *job);
+    });
+}
+
+void flush() {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    workerDone.wait(lock, [] { return !workerRunning; });
+}
+
+}
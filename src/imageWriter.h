@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "sceneStructs.h"
+#include "accumulationFile.h"
+
+/**
+ * Image output off the render thread. Callers hand over a snapshot of the
+ * pixels; scaling, the horizontal flip into image order and PNG or EXR
+ * encoding all happen on one background worker, in submission order.
+ */
+namespace imageWriter {
+    // The layers of an EXR save, each read back from the device once
+    struct AovSnapshot {
+        std::vector<glm::vec3> beauty;      // accumulated radiance
+        float beautyScale;                  // 1 / iterations
+        std::vector<glm::vec3> denoised;    // normalized; empty to omit the layer
+        std::vector<GBufferPixel> gBuffer;  // normal, depth and albedo layers
+    };
+
+    // What writeImage encodes
+    enum ImageFormat {
+        IMAGE_PNG,
+        IMAGE_QOI,      // lossless 8-bit, far cheaper to encode
+        IMAGE_PFM,      // raw linear floats
+    };
+
+    // Sets writeImage's format and PNG compression level (0 stores, up to 9), before any write
+    void setFormat(int format, int pngLevel);
+
+    // The file extension of the current format, without the dot
+    const char *extension();
+
+    // Scales, flips and writes width x height pixels as filename.EXTENSION, blocking
+    void writeImage(const std::vector<glm::vec3> &pixels, int width, int height,
+            float scale, const std::string &filename);
+
+    // Queues the same write for the worker; takes ownership of pixels
+    void writeImageAsync(std::vector<glm::vec3> &pixels, int width, int height,
+            float scale, const std::string &filename);
+
+    /**
+     * Queues a half-float filename.exr with beauty.RGB, denoised.RGB,
+     * normal.XYZ (world space), depth.Z (distance along the camera ray,
+     * infinite for misses) and albedo.RGB layers. Takes ownership of the
+     * snapshot's buffers.
+     */
+    void writeAovsAsync(AovSnapshot &snapshot, int width, int height, const std::string &filename);
+
+    // Queues accumulationFile::write of a checkpoint; takes ownership of its buffers
+    void writeAccumulationAsync(accumulationFile::Accumulation &accumulation, const std::string &filename);
+
+    // Waits until every queued image has been written
+    void flush();
+}
@@ -1,62 +1,190 @@
 #pragma once
 
 #include "intersections.h"
+#include "guiding.h"
+#include "sampler.h"
+
+// The lobes scatterRay chooses between
+enum ScatterLobe {
+    LOBE_DIFFUSE,
+    LOBE_REFLECT,   // mirror, or glossy with a positive specular exponent
+    LOBE_REFRACT,   // the transmitted half of a dielectric
+};
+
+// Material features a shading variant is compiled with, as bits. A variant
+// without a feature treats every material as lacking it, so it may only
+// shade scenes whose materials all do.
+enum MaterialFeature {
+    MATERIAL_REFLECTIVE = 1,    // hasReflective > 0
+    MATERIAL_REFRACTIVE = 2,    // hasRefractive > 0
+    MATERIAL_TEXTURED = 4,      // any of the texture maps
+    MATERIAL_FEATURES_ALL = 7,
+};
+
+// Scattered ray cones spread by this fraction of their lobe's angular
+// width, as ray differentials of rough bounces do (Suykens & Willems 2001)
+#define RAY_CONE_LOBE_FRACTION 0.125f
 
 /**
- * Computes a cosine-weighted random direction in a hemisphere.
- * Used for diffuse lighting.
+ * The spread of a ray cone leaving through a power-cosine lobe of
+ * `exponent` (see samplePowerCosine), which was `spread` arriving: a
+ * perfect specular lobe keeps it, rougher lobes widen it to a fraction of
+ * their own width, about sqrt(2 / (exponent + 2)) radians.
  */
-__host__ __device__
-glm::vec3 calculateRandomDirectionInHemisphere(
-        glm::vec3 normal, thrust::default_random_engine &rng) {
-    thrust::uniform_real_distribution<float> u01(0, 1);
+__host__ __device__ inline float scatteredConeSpread(float spread, float exponent) {
+    if (exponent <= 0.0f) {
+        return spread;
+    }
+    return fmaxf(spread, RAY_CONE_LOBE_FRACTION * sqrtf(2.0f / (exponent + 2.0f)));
+}
 
-    float up = sqrt(u01(rng)); // cos(theta)
-    float over = sqrt(1 - up * up); // sin(theta)
-    float around = u01(rng) * TWO_PI;
+/**
+ * A direction about the unit `axis` with density proportional to the
+ * cosine of the angle to it raised to `exponent`, from two uniform
+ * numbers. Exponent 1 is the cosine-weighted hemisphere of diffuse
+ * surfaces, larger ones narrow it into a glossy lobe, and exponent <= 0
+ * returns the axis itself (a perfect specular lobe).
+ */
+__host__ __device__
+glm::vec3 samplePowerCosine(glm::vec3 axis, float exponent, float u1, float u2) {
+    float up = exponent == 1.0f ? sqrt(u1) // cos(theta)
+        : exponent > 0.0f ? powf(u1, 1.0f / (exponent + 1.0f)) : 1.0f;
+    float over = sqrt(fmaxf(0.0f, 1 - up * up)); // sin(theta)
+    float around = u2 * TWO_PI;
 
-    // Find a direction that is not the normal based off of whether or not the
-    // normal's components are all equal to sqrt(1/3) or whether or not at
+    // Find a direction that is not the axis based off of whether or not the
+    // axis's components are all equal to sqrt(1/3) or whether or not at
     // least one component is less than sqrt(1/3). Learned this trick from
     // Peter Kutz.
 
-    glm::vec3 directionNotNormal;
-    if (abs(normal.x) < SQRT_OF_ONE_THIRD) {
-        directionNotNormal = glm::vec3(1, 0, 0);
-    } else if (abs(normal.y) < SQRT_OF_ONE_THIRD) {
-        directionNotNormal = glm::vec3(0, 1, 0);
+    glm::vec3 directionNotAxis;
+    if (abs(axis.x) < SQRT_OF_ONE_THIRD) {
+        directionNotAxis = glm::vec3(1, 0, 0);
+    } else if (abs(axis.y) < SQRT_OF_ONE_THIRD) {
+        directionNotAxis = glm::vec3(0, 1, 0);
     } else {
-        directionNotNormal = glm::vec3(0, 0, 1);
+        directionNotAxis = glm::vec3(0, 0, 1);
     }
 
-    // Use not-normal direction to generate two perpendicular directions
+    // Use not-axis direction to generate two perpendicular directions
     glm::vec3 perpendicularDirection1 =
-        glm::normalize(glm::cross(normal, directionNotNormal));
+        glm::normalize(glm::cross(axis, directionNotAxis));
     glm::vec3 perpendicularDirection2 =
-        glm::normalize(glm::cross(normal, perpendicularDirection1));
+        glm::normalize(glm::cross(axis, perpendicularDirection1));
 
-    return up * normal
+    return up * axis
         + cos(around) * over * perpendicularDirection1
         + sin(around) * over * perpendicularDirection2;
 }
 
 /**
- * Simple ray scattering with diffuse and perfect specular support.
+ * Computes a cosine-weighted random direction in a hemisphere.
+ * Used for diffuse lighting.
+ */
+__host__ __device__
+glm::vec3 calculateRandomDirectionInHemisphere(
+        glm::vec3 normal, Sampler &sampler) {
+    float u1 = nextSample(sampler);
+    float u2 = nextSample(sampler);
+    return samplePowerCosine(normal, 1.0f, u1, u2);
+}
+
+/**
+ * Scatters the path off a surface that mixes a diffuse, a reflective and a
+ * refractive lobe in the proportions 1 - hasReflective - hasRefractive,
+ * hasReflective and hasRefractive, and multiplies the throughput by the
+ * lobe's colour: `color` for diffuse, `specular.color` otherwise. Each
+ * bounce picks one lobe with the probability it is weighted by, so no
+ * other reweighting is needed.
+ *
+ * The refractive lobe is a dielectric of `indexOfRefraction`: Schlick's
+ * Fresnel term (total internal reflection included) splits it between
+ * reflection and transmission. `frontFace` says whether the ray arrives
+ * from outside the surface, which `normal` faces either way. Reflection
+ * and transmission are glossy with a positive `specular.exponent` and
+ * perfect otherwise.
+ *
+ * Every lobe is drawn by the same samplePowerCosine call and differs only
+ * in its axis and exponent, so a warp whose paths picked different lobes
+ * does not diverge into per-BSDF sampling code, and diffuse-only scenes
+ * pay for little more than the lobe choice. Returns the ScatterLobe.
+ *
+ * With a `guide` CDF (guiding.h), the diffuse lobe draws its direction
+ * from the guide instead, GUIDE_FRACTION of the time, by the lobe choice
+ * rescaled within the lobe, and the throughput takes the cosine over the
+ * mixture's density, guidedDiffusePdf.
+ *
+ * `Features` (MaterialFeature bits) compiles out the lobes the scene's
+ * materials do not have; the same numbers are drawn either way.
  */
+template <int Features = MATERIAL_FEATURES_ALL>
 __host__ __device__
-void scatterRay(
+int scatterRay(
 		PathSegment & pathSegment,
         glm::vec3 intersect,
         glm::vec3 normal,
+        bool frontFace,
         const Material &m,
-        thrust::default_random_engine &rng) {
-    glm::vec3 newDirection;
-    if (m.hasReflective) {
-        newDirection = glm::reflect(pathSegment.ray.direction, normal);
-    } else {
-        newDirection = calculateRandomDirectionInHemisphere(normal, rng);
+        Sampler &sampler,
+        const float *guide = NULL) {
+    float u1 = nextSample(sampler);
+    float u2 = nextSample(sampler);
+    float pick = nextSample(sampler);
+
+    const bool reflects = (Features & MATERIAL_REFLECTIVE) != 0;
+    const bool refracts = (Features & MATERIAL_REFRACTIVE) != 0;
+    const float hasReflective = reflects ? m.hasReflective : 0.0f;
+    const float hasRefractive = refracts ? m.hasRefractive : 0.0f;
+    const glm::vec3 incident = pathSegment.ray.direction;
+    int lobe = reflects && pick < hasReflective ? LOBE_REFLECT
+        : refracts && pick < hasReflective + hasRefractive ? LOBE_REFRACT : LOBE_DIFFUSE;
+    glm::vec3 axis = lobe == LOBE_DIFFUSE ? normal : glm::reflect(incident, normal);
+
+    if (refracts && lobe == LOBE_REFRACT) {
+        // Reuse the pick, rescaled to [0, 1) within the lobe, for the Fresnel choice
+        float u = (pick - hasReflective) / hasRefractive;
+        float ior = m.indexOfRefraction > 0.0f ? m.indexOfRefraction : 1.0f;
+        glm::vec3 refracted = glm::refract(incident, normal, frontFace ? 1.0f / ior : ior);
+        float fresnel = 1.0f;  // glm::refract returns 0 under total internal reflection
+        if (glm::dot(refracted, refracted) > 0.0f) {
+            // Schlick's approximation takes the angle on the outside
+            float cosOutside = frontFace ? -glm::dot(incident, normal) : -glm::dot(refracted, normal);
+            float r0 = (1.0f - ior) / (1.0f + ior);
+            r0 *= r0;
+            float c = 1.0f - cosOutside;
+            fresnel = r0 + (1.0f - r0) * (c * c) * (c * c) * c;
+        }
+        if (u >= fresnel) {
+            axis = glm::normalize(refracted);
+        } else {
+            lobe = LOBE_REFLECT;
+        }
     }
 
+    const float exponent = lobe == LOBE_DIFFUSE ? 1.0f : m.specular.exponent;
+    glm::vec3 newDirection = samplePowerCosine(axis, exponent, u1, u2);
+    // A glossy lobe about a grazing axis spills across the surface; mirror
+    // the spill back to the side the lobe scatters to
+    float side = lobe == LOBE_REFRACT ? -1.0f : 1.0f;
+    float cosNormal = glm::dot(newDirection, normal);
+    if (cosNormal * side < 0.0f) {
+        newDirection -= 2.0f * cosNormal * normal;
+    }
+
+    pathSegment.color *= lobe == LOBE_DIFFUSE ? m.color : m.specular.color;
+    if (lobe == LOBE_DIFFUSE && guide != NULL) {
+        float u = (pick - hasReflective - hasRefractive) / (1.0f - hasReflective - hasRefractive);
+        if (u < GUIDE_FRACTION) {
+            newDirection = sampleGuide(guide, u1, u2);
+        }
+        // Directions into the surface carry nothing
+        float pdf = guidedDiffusePdf(guide, normal, newDirection);
+        pathSegment.color *= pdf > 0.0f ? fmaxf(glm::dot(normal, newDirection), 0.0f) / (PI * pdf) : 0.0f;
+    }
+    // The cone leaves with the width it reached the hit with
+    pathSegment.ray.coneWidth += pathSegment.ray.coneSpread * glm::distance(intersect, pathSegment.ray.origin);
+    pathSegment.ray.coneSpread = scatteredConeSpread(pathSegment.ray.coneSpread, exponent);
     pathSegment.ray.direction = newDirection;
     pathSegment.ray.origin = intersect + (newDirection * 0.0001f);
+    return lobe;
 }
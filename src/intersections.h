@@ -4,8 +4,13 @@
 #include <glm/gtx/intersect.hpp>
 
 #include "sceneStructs.h"
+#include "gbuffer.h"
 #include "utilities.h"
 
+// Traversal stack depth; median-split BVHs are about log2(primitives) deep,
+// GPU-built (LBVH) ones up to the 30 Morton bits plus log2(geoms)
+#define BVH_STACK_SIZE 64
+
 /**
  * Handy-dandy hash function that provides seeds for random number generation.
  */
@@ -34,25 +39,43 @@ __host__ __device__ glm::vec3 multiplyMV(glm::mat4 m, glm::vec4 v) {
     return glm::vec3(m * v);
 }
 
+__host__ __device__ inline glm::vec3 worldToObjectPoint(const DeviceGeom &geom, glm::vec3 p) {
+    glm::vec4 h(p, 1.0f);
+    return glm::vec3(glm::dot(geom.inverseRows[0], h), glm::dot(geom.inverseRows[1], h), glm::dot(geom.inverseRows[2], h));
+}
+
+__host__ __device__ inline glm::vec3 worldToObjectVector(const DeviceGeom &geom, glm::vec3 v) {
+    glm::vec4 h(v, 0.0f);
+    return glm::vec3(glm::dot(geom.inverseRows[0], h), glm::dot(geom.inverseRows[1], h), glm::dot(geom.inverseRows[2], h));
+}
+
+/**
+ * Maps an object-space normal to world space with the inverse transpose,
+ * i.e. the transpose of the stored inverse rows. Not normalized.
+ */
+__host__ __device__ inline glm::vec3 objectToWorldNormal(const DeviceGeom &geom, glm::vec3 n) {
+    return n.x * glm::vec3(geom.inverseRows[0])
+        + n.y * glm::vec3(geom.inverseRows[1])
+        + n.z * glm::vec3(geom.inverseRows[2]);
+}
+
 /**
  * Test intersection between a ray and a transformed cube. Untransformed,
  * the cube ranges from -0.5 to 0.5 in each axis and is centered at the origin.
+ * The object-space direction is left unnormalized, so its `t` is the
+ * world-space one. Only the distance is computed; the closest hit's normal
+ * comes from surfaceNormal.
  *
- * @param intersectionPoint  Output parameter for point of intersection.
- * @param normal             Output parameter for surface normal.
- * @param outside            Output param for whether the ray came from outside.
- * @return                   Ray parameter `t` value. -1 if no intersection.
+ * @return  Ray parameter `t` value, falling slightly short of the surface
+ *          like getPointOnRay. -1 if no intersection.
  */
-__host__ __device__ float boxIntersectionTest(Geom box, Ray r,
-        glm::vec3 &intersectionPoint, glm::vec3 &normal, bool &outside) {
+__host__ __device__ float boxIntersectionTest(const DeviceGeom &box, Ray r) {
     Ray q;
-    q.origin    =                multiplyMV(box.inverseTransform, glm::vec4(r.origin   , 1.0f));
-    q.direction = glm::normalize(multiplyMV(box.inverseTransform, glm::vec4(r.direction, 0.0f)));
+    q.origin    = worldToObjectPoint(box, r.origin);
+    q.direction = worldToObjectVector(box, r.direction);
 
     float tmin = -1e38f;
     float tmax = 1e38f;
-    glm::vec3 tmin_n;
-    glm::vec3 tmax_n;
     for (int xyz = 0; xyz < 3; ++xyz) {
         float qdxyz = q.direction[xyz];
         /*if (glm::abs(qdxyz) > 0.00001f)*/ {
@@ -60,82 +83,800 @@ __host__ __device__ float boxIntersectionTest(Geom box, Ray r,
             float t2 = (+0.5f - q.origin[xyz]) / qdxyz;
             float ta = glm::min(t1, t2);
             float tb = glm::max(t1, t2);
-            glm::vec3 n;
-            n[xyz] = t2 < t1 ? +1 : -1;
             if (ta > 0 && ta > tmin) {
                 tmin = ta;
-                tmin_n = n;
             }
             if (tb < tmax) {
                 tmax = tb;
-                tmax_n = n;
             }
         }
     }
 
     if (tmax >= tmin && tmax > 0) {
-        outside = true;
-        if (tmin <= 0) {
-            tmin = tmax;
-            tmin_n = tmax_n;
-            outside = false;
-        }
-        intersectionPoint = multiplyMV(box.transform, glm::vec4(getPointOnRay(q, tmin), 1.0f));
-        normal = glm::normalize(multiplyMV(box.invTranspose, glm::vec4(tmin_n, 0.0f)));
-        return glm::length(r.origin - intersectionPoint);
+        return (tmin <= 0 ? tmax : tmin) - .0001f;
     }
     return -1;
 }
 
+/**
+ * boxIntersectionTest for an AXIS_ALIGNED_CUBE. Its inverse transform is a
+ * per-axis scale and offset, so the slab test runs on the ray as is, with
+ * no matrix products.
+ */
+__host__ __device__ float axisAlignedBoxIntersectionTest(const DeviceGeom &box, Ray r) {
+    glm::vec3 scale(box.inverseRows[0].x, box.inverseRows[1].y, box.inverseRows[2].z);
+    glm::vec3 offset(box.inverseRows[0].w, box.inverseRows[1].w, box.inverseRows[2].w);
+    glm::vec3 origin = scale * r.origin + offset;
+    glm::vec3 invDirection = 1.0f / (scale * r.direction);
+    glm::vec3 t1 = (-0.5f - origin) * invDirection;
+    glm::vec3 t2 = (+0.5f - origin) * invDirection;
+    glm::vec3 tNear = glm::min(t1, t2);
+    glm::vec3 tFar = glm::max(t1, t2);
+    float tEnter = glm::max(glm::max(tNear.x, tNear.y), tNear.z);
+    float tExit = glm::min(glm::min(tFar.x, tFar.y), tFar.z);
+    if (tExit < tEnter || tExit <= 0) {
+        return -1;
+    }
+    return (tEnter > 0 ? tEnter : tExit) - .0001f;
+}
+
 /**
  * Test intersection between a ray and a transformed sphere. Untransformed,
- * the sphere always has radius 0.5 and is centered at the origin.
+ * the sphere always has radius 0.5 and is centered at the origin. As for
+ * boxes, the unnormalized object-space direction keeps `t` in world units.
  *
- * @param intersectionPoint  Output parameter for point of intersection.
- * @param normal             Output parameter for surface normal.
- * @param outside            Output param for whether the ray came from outside.
- * @return                   Ray parameter `t` value. -1 if no intersection.
+ * @return  Ray parameter `t` value, falling slightly short of the surface
+ *          like getPointOnRay. -1 if no intersection.
  */
-__host__ __device__ float sphereIntersectionTest(Geom sphere, Ray r,
-        glm::vec3 &intersectionPoint, glm::vec3 &normal, bool &outside) {
+__host__ __device__ float sphereIntersectionTest(const DeviceGeom &sphere, Ray r) {
     float radius = .5;
 
-    glm::vec3 ro = multiplyMV(sphere.inverseTransform, glm::vec4(r.origin, 1.0f));
-    glm::vec3 rd = glm::normalize(multiplyMV(sphere.inverseTransform, glm::vec4(r.direction, 0.0f)));
-
-    Ray rt;
-    rt.origin = ro;
-    rt.direction = rd;
+    glm::vec3 ro = worldToObjectPoint(sphere, r.origin);
+    glm::vec3 rd = worldToObjectVector(sphere, r.direction);
 
-    float vDotDirection = glm::dot(rt.origin, rt.direction);
-    float radicand = vDotDirection * vDotDirection - (glm::dot(rt.origin, rt.origin) - powf(radius, 2));
+    float a = glm::dot(rd, rd);
+    float vDotDirection = glm::dot(ro, rd);
+    float radicand = vDotDirection * vDotDirection - a * (glm::dot(ro, ro) - radius * radius);
     if (radicand < 0) {
         return -1;
     }
 
     float squareRoot = sqrt(radicand);
     float firstTerm = -vDotDirection;
-    float t1 = firstTerm + squareRoot;
-    float t2 = firstTerm - squareRoot;
+    float t1 = (firstTerm + squareRoot) / a;
+    float t2 = (firstTerm - squareRoot) / a;
 
-    float t = 0;
     if (t1 < 0 && t2 < 0) {
         return -1;
-    } else if (t1 > 0 && t2 > 0) {
-        t = min(t1, t2);
-        outside = true;
+    }
+    return (t2 > 0 ? t2 : t1) - .0001f;
+}
+
+/**
+ * sphereIntersectionTest for a UNIFORM_SPHERE: the closed-form test against
+ * its world-space centre and radius.
+ */
+__host__ __device__ float uniformSphereIntersectionTest(const DeviceGeom &sphere, Ray r) {
+    glm::vec3 centre(sphere.inverseRows[0]);
+    float radius = sphere.inverseRows[0].w;
+
+    // World ray directions are unit length
+    glm::vec3 toOrigin = r.origin - centre;
+    float b = glm::dot(toOrigin, r.direction);
+    float radicand = b * b - (glm::dot(toOrigin, toOrigin) - radius * radius);
+    if (radicand < 0) {
+        return -1;
+    }
+    float squareRoot = sqrt(radicand);
+    float t1 = -b + squareRoot;
+    float t2 = -b - squareRoot;
+
+    if (t1 < 0 && t2 < 0) {
+        return -1;
+    }
+    return (t2 > 0 ? t2 : t1) - .0001f;
+}
+
+/**
+ * Slab test between a ray and an axis-aligned box.
+ *
+ * @param invDirection  Component-wise reciprocal of the ray direction.
+ * @param tMax          Closest hit found so far; boxes entered beyond it miss.
+ * @return              Entry distance, clamped to 0 when the origin is inside.
+ *                      -1 if no intersection.
+ */
+__host__ __device__ float aabbIntersectionTest(glm::vec3 bboxMin, glm::vec3 bboxMax,
+        Ray r, glm::vec3 invDirection, float tMax) {
+    glm::vec3 t1 = (bboxMin - r.origin) * invDirection;
+    glm::vec3 t2 = (bboxMax - r.origin) * invDirection;
+    glm::vec3 tNear = glm::min(t1, t2);
+    glm::vec3 tFar = glm::max(t1, t2);
+    float tEnter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+    float tExit = glm::min(glm::min(tFar.x, tFar.y), tFar.z);
+    return (tEnter <= tExit && tEnter <= tMax) ? tEnter : -1;
+}
+
+/**
+ * Moller-Trumbore ray/triangle test.
+ *
+ * @param u, v  Output barycentric coordinates of the hit w.r.t. p1 and p2.
+ * @return      Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ float triangleIntersectionTest(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2,
+        Ray r, float &u, float &v) {
+    glm::vec3 e1 = p1 - p0;
+    glm::vec3 e2 = p2 - p0;
+    glm::vec3 pvec = glm::cross(r.direction, e2);
+    float det = glm::dot(e1, pvec);
+    if (glm::abs(det) < 1e-12f) {
+        return -1;
+    }
+    float invDet = 1.0f / det;
+    glm::vec3 tvec = r.origin - p0;
+    u = glm::dot(tvec, pvec) * invDet;
+    if (u < 0.0f || u > 1.0f) {
+        return -1;
+    }
+    glm::vec3 qvec = glm::cross(tvec, e1);
+    v = glm::dot(r.direction, qvec) * invDet;
+    if (v < 0.0f || u + v > 1.0f) {
+        return -1;
+    }
+    float t = glm::dot(e2, qvec) * invDet;
+    return t > 0.0f ? t : -1;
+}
+
+/**
+ * A ray set up for watertightTriangleTest: its dominant direction axis
+ * becomes z, the other two x and y, swapped for a negative z to keep the
+ * winding, and the shear that takes the direction onto +z.
+ */
+struct WatertightRay {
+    int kx;
+    int ky;
+    int kz;
+    glm::vec3 shear;
+};
+
+__host__ __device__ inline WatertightRay watertightRay(glm::vec3 direction) {
+    WatertightRay w;
+    const glm::vec3 a = glm::abs(direction);
+    w.kz = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+    w.kx = (w.kz + 1) % 3;
+    w.ky = (w.kx + 1) % 3;
+    if (direction[w.kz] < 0.0f) {
+        const int k = w.kx;
+        w.kx = w.ky;
+        w.ky = k;
+    }
+    w.shear = glm::vec3(direction[w.kx] / direction[w.kz], direction[w.ky] / direction[w.kz],
+            1.0f / direction[w.kz]);
+    return w;
+}
+
+/**
+ * Watertight ray/triangle test (Woop, Benthin and Wald 2013). The vertices
+ * are moved to the ray origin and sheared so the ray runs along +z, where
+ * the 2D edge functions of two triangles sharing an edge are computed from
+ * the same values: a ray through the edge, or a shared vertex, hits at
+ * least one of them, and never slips through a crack. Edge functions that
+ * come out exactly zero are recomputed in double precision.
+ *
+ * @param u, v  Output barycentric coordinates of the hit w.r.t. p1 and p2.
+ * @return      Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ inline float watertightTriangleTest(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2,
+        const Ray &r, const WatertightRay &w, float &u, float &v) {
+    const glm::vec3 a = p0 - r.origin;
+    const glm::vec3 b = p1 - r.origin;
+    const glm::vec3 c = p2 - r.origin;
+    const float ax = a[w.kx] - w.shear.x * a[w.kz];
+    const float ay = a[w.ky] - w.shear.y * a[w.kz];
+    const float bx = b[w.kx] - w.shear.x * b[w.kz];
+    const float by = b[w.ky] - w.shear.y * b[w.kz];
+    const float cx = c[w.kx] - w.shear.x * c[w.kz];
+    const float cy = c[w.ky] - w.shear.y * c[w.kz];
+
+    float e0 = cx * by - cy * bx;
+    float e1 = ax * cy - ay * cx;
+    float e2 = bx * ay - by * ax;
+    if (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f) {
+        e0 = (float)((double)cx * by - (double)cy * bx);
+        e1 = (float)((double)ax * cy - (double)ay * cx);
+        e2 = (float)((double)bx * ay - (double)by * ax);
+    }
+    if ((e0 < 0.0f || e1 < 0.0f || e2 < 0.0f) && (e0 > 0.0f || e1 > 0.0f || e2 > 0.0f)) {
+        return -1;
+    }
+    const float det = e0 + e1 + e2;
+    if (det == 0.0f) {
+        return -1;
+    }
+    const float t = (e0 * a[w.kz] + e1 * b[w.kz] + e2 * c[w.kz]) * w.shear.z;
+    // Behind the origin when t and det differ in sign
+    if (det < 0.0f ? t >= 0.0f : t <= 0.0f) {
+        return -1;
+    }
+    const float invDet = 1.0f / det;
+    u = e1 * invDet;
+    v = e2 * invDet;
+    return t * invDet;
+}
+
+// Where a ray hit a mesh: the triangle, in leaf order, and the barycentric
+// coordinates of the hit w.r.t. its second and third vertices
+struct MeshHit {
+    int triangle;
+    float u;
+    float v;
+};
+
+// Counts one BVH node fetch towards the ray cost views, when they are counting
+__host__ __device__ inline void countNodeVisit(const MeshData &meshData) {
+    if (meshData.nodeVisits != NULL) {
+        (*meshData.nodeVisits)++;
+    }
+}
+
+// Object-space position of vertex v of `mesh` or one of its levels, off its grid in compact uploads
+__host__ __device__ inline glm::vec3 meshPosition(const MeshData &meshData, const Mesh &mesh, int v) {
+    if (meshData.compactPositions != NULL) {
+        return meshGridPoint(mesh, meshData.compactPositions[v]);
+    }
+    return meshData.positions[v];
+}
+
+__host__ __device__ inline glm::vec3 meshNormal(const MeshData &meshData, int v) {
+    if (meshData.compactNormals != NULL) {
+        const ushort2 packed = meshData.compactNormals[v];
+        const unsigned short octahedral[2] = { packed.x, packed.y };
+        return decodeOctNormal(octahedral);
+    }
+    return meshData.normals[v];
+}
+
+__host__ __device__ inline glm::vec2 meshUV(const MeshData &meshData, int v) {
+    if (meshData.compactUVs != NULL) {
+        const __half2 packed = meshData.compactUVs[v];
+        return glm::vec2(__half2float(packed.x), __half2float(packed.y));
+    }
+    return meshData.uvs[v];
+}
+
+/**
+ * Tests triangle i of `mesh`, in leaf order, against the object-space ray
+ * q set up as w, reading its TriangleRecord where meshData has them and
+ * gathering its vertices through the index triple otherwise.
+ */
+__host__ __device__ inline float meshTriangleTest(const MeshData &meshData, const Mesh &mesh, int i,
+        const Ray &q, const WatertightRay &w, float &u, float &v) {
+    glm::vec3 p0, p1, p2;
+    if (meshData.triangleRecords != NULL) {
+        const TriangleRecord record = meshData.triangleRecords[i];
+        p0 = glm::vec3(record.p0.x, record.p0.y, record.p0.z);
+        p1 = glm::vec3(record.p1.x, record.p1.y, record.p1.z);
+        p2 = glm::vec3(record.p2.x, record.p2.y, record.p2.z);
     } else {
-        t = max(t1, t2);
-        outside = false;
+        const glm::ivec3 tri = meshData.triangles[i];
+        p0 = meshPosition(meshData, mesh, tri.x);
+        p1 = meshPosition(meshData, mesh, tri.y);
+        p2 = meshPosition(meshData, mesh, tri.z);
     }
+    return meshData.watertight ? watertightTriangleTest(p0, p1, p2, q, w, u, v)
+        : triangleIntersectionTest(p0, p1, p2, q, u, v);
+}
 
-    glm::vec3 objspaceIntersection = getPointOnRay(rt, t);
+// Tests triangles [first, first + count) of a mesh leaf against the object-space ray q
+__host__ __device__ inline void meshLeafIntersectionTest(const MeshData &meshData, const Mesh &mesh, const Ray &q,
+        const WatertightRay &w, int first, int count, float &tClosest, int &hitTriangle, MeshHit &hit) {
+    for (int i = first; i < first + count; i++) {
+        float u, v;
+        float t = meshTriangleTest(meshData, mesh, i, q, w, u, v);
+        if (t > 0.0f && t < tClosest) {
+            tClosest = t;
+            hitTriangle = i;
+            hit.u = u;
+            hit.v = v;
+        }
+    }
+}
+
+/**
+ * Walks a mesh's 4-wide BVH: each node fetch decodes and tests all its
+ * children's boxes, tests hit leaves at once and pushes hit interior
+ * children farthest first, so the nearest is visited next.
+ */
+__host__ __device__ inline void wideMeshTraversal(const MeshData &meshData, const Mesh &mesh, const Ray &q,
+        glm::vec3 invDirection, const WatertightRay &w, float &tClosest, int &hitTriangle, MeshHit &hit) {
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = mesh.wideRoot;
+    while (stackSize > 0) {
+        const WideBVHNode node = meshData.wideNodes[stack[--stackSize]];
+        countNodeVisit(meshData);
+        const glm::vec3 step(ldexpf(1.0f, node.exponent[0]), ldexpf(1.0f, node.exponent[1]),
+                ldexpf(1.0f, node.exponent[2]));
 
-    intersectionPoint = multiplyMV(sphere.transform, glm::vec4(objspaceIntersection, 1.f));
-    normal = glm::normalize(multiplyMV(sphere.invTranspose, glm::vec4(objspaceIntersection, 0.f)));
-    if (!outside) {
-        normal = -normal;
+        int nearChildren[BVH_WIDTH];
+        float nearT[BVH_WIDTH];
+        int hits = 0;
+        for (int c = 0; c < node.childCount; c++) {
+            glm::vec3 low = node.origin + glm::vec3(node.lo[0][c], node.lo[1][c], node.lo[2][c]) * step;
+            glm::vec3 high = node.origin + glm::vec3(node.hi[0][c], node.hi[1][c], node.hi[2][c]) * step;
+            float t = aabbIntersectionTest(low, high, q, invDirection, tClosest);
+            if (t < 0.0f) {
+                continue;
+            }
+            if (node.triangleCount[c] > 0) {
+                meshLeafIntersectionTest(meshData, mesh, q, w, node.child[c], node.triangleCount[c],
+                        tClosest, hitTriangle, hit);
+                continue;
+            }
+            // Insertion sort, nearest last
+            int k = hits++;
+            for (; k > 0 && nearT[k - 1] < t; k--) {
+                nearT[k] = nearT[k - 1];
+                nearChildren[k] = nearChildren[k - 1];
+            }
+            nearT[k] = t;
+            nearChildren[k] = node.child[c];
+        }
+        for (int k = 0; k < hits; k++) {
+            // A leaf tested after the sort may have moved the closest hit nearer
+            if (nearT[k] <= tClosest) {
+                stack[stackSize++] = nearChildren[k];
+            }
+        }
     }
+}
+
+/**
+ * The level of detail of `mesh` for an object-space ray footprint
+ * `footprint` wide: the coarsest whose clustering cell still fits in it.
+ */
+__host__ __device__ inline int meshLevel(const Mesh &mesh, float footprint) {
+    if (!(footprint >= mesh.lodCellSize) || mesh.lodCount == 0) {
+        return 0;
+    }
+    return glm::min(1 + (int)floorf(log2f(footprint / mesh.lodCellSize)), mesh.lodCount);
+}
+
+/**
+ * Test intersection between a ray and a transformed triangle mesh by walking
+ * the mesh's object-space BVH, the 4-wide one when meshData has them. The
+ * object-space ray direction is left unnormalized so its `t` equals the
+ * world-space one, which lets the search be bounded by the closest hit
+ * found so far. A mesh with coarser versions is walked at the level
+ * meshLevel picks for the ray's cone where it enters the mesh's bounds.
+ *
+ * @param tMax  Closest hit so far; farther triangles are skipped.
+ * @param hit   Output parameter for the triangle hit, for surfaceNormal.
+ * @return      Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ float meshIntersectionTest(const DeviceGeom &geom, Ray r, const MeshData &meshData, float tMax,
+        MeshHit &hit) {
+    Mesh mesh = meshData.meshes[geom.meshid];
+
+    Ray q;
+    q.origin    = worldToObjectPoint(geom, r.origin);
+    q.direction = worldToObjectVector(geom, r.direction);
+    const glm::vec3 invDirection = 1.0f / q.direction;
+    const WatertightRay w = watertightRay(q.direction);
+
+    float tClosest = tMax;
+    int hitTriangle = -1;
+
+    if (mesh.lodCount > 0 && meshData.lodScale > 0.0f && r.coneWidth + r.coneSpread > 0.0f) {
+        const BVHNode root = meshData.nodes[mesh.bvhRoot];
+        float tEnter = aabbIntersectionTest(root.bboxMin, root.bboxMax, q, invDirection, tMax);
+        if (tEnter < 0.0f) {
+            return -1;
+        }
+        // World lengths along the ray scale by |q.direction| into object space
+        float footprint = (r.coneWidth + r.coneSpread * tEnter) * glm::length(q.direction) * meshData.lodScale;
+        int level = meshLevel(mesh, footprint);
+        if (level > 0) {
+            mesh = meshData.meshes[geom.meshid + level];
+        }
+    }
+
+    if (meshData.wideNodes != NULL && mesh.wideRoot >= 0) {
+        wideMeshTraversal(meshData, mesh, q, invDirection, w, tClosest, hitTriangle, hit);
+    } else {
+        int stack[BVH_STACK_SIZE];
+        int stackSize = 0;
+        int nodeIndex = mesh.bvhRoot;
+        while (nodeIndex >= 0) {
+            const BVHNode node = meshData.nodes[nodeIndex];
+            countNodeVisit(meshData);
+            if (aabbIntersectionTest(node.bboxMin, node.bboxMax, q, invDirection, tClosest) >= 0.0f) {
+                if (node.count > 0) {
+                    meshLeafIntersectionTest(meshData, mesh, q, w, node.offset, node.count,
+                            tClosest, hitTriangle, hit);
+                } else {
+                    stack[stackSize++] = node.offset;
+                    nodeIndex++;
+                    continue;
+                }
+            }
+            nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+        }
+    }
+
+    if (hitTriangle < 0) {
+        return -1;
+    }
+    hit.triangle = hitTriangle;
+    return tClosest;
+}
+
+// Tests spheres [first, first + count) of a cloud leaf against the object-space ray q
+__host__ __device__ inline void cloudLeafIntersectionTest(const MeshData &meshData, const Ray &q,
+        int first, int count, float &tClosest, int &hitSphere) {
+    const float a = glm::dot(q.direction, q.direction);
+    for (int i = first; i < first + count; i++) {
+        const CloudSphere sphere = meshData.cloudSpheres[i];
+        glm::vec3 toOrigin = q.origin - sphere.centre;
+        float b = glm::dot(toOrigin, q.direction);
+        float radicand = b * b - a * (glm::dot(toOrigin, toOrigin) - sphere.radius * sphere.radius);
+        if (radicand < 0.0f) {
+            continue;
+        }
+        float squareRoot = sqrtf(radicand);
+        float t = (-b - squareRoot) / a;
+        if (t <= 0.0f) {
+            t = (-b + squareRoot) / a;
+        }
+        if (t > 0.0f && t < tClosest) {
+            tClosest = t;
+            hitSphere = i;
+        }
+    }
+}
+
+/**
+ * Test intersection between a ray and a transformed sphere cloud by walking
+ * the cloud's object-space BVH, the way meshIntersectionTest walks a
+ * mesh's binary one. Hits are pulled towards the ray origin by the same
+ * margin as sphereIntersectionTest's.
+ *
+ * @param tMax  Closest hit so far; farther spheres are skipped.
+ * @param hit   Output parameter: the sphere hit, in `triangle`.
+ * @return      Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ float sphereCloudIntersectionTest(const DeviceGeom &geom, Ray r, const MeshData &meshData,
+        float tMax, MeshHit &hit) {
+    const SphereCloud cloud = meshData.clouds[geom.meshid];
+
+    Ray q;
+    q.origin    = worldToObjectPoint(geom, r.origin);
+    q.direction = worldToObjectVector(geom, r.direction);
+    const glm::vec3 invDirection = 1.0f / q.direction;
+
+    float tClosest = tMax;
+    int hitSphere = -1;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    int nodeIndex = cloud.bvhRoot;
+    while (nodeIndex >= 0) {
+        const BVHNode node = meshData.cloudNodes[nodeIndex];
+        countNodeVisit(meshData);
+        if (aabbIntersectionTest(node.bboxMin, node.bboxMax, q, invDirection, tClosest) >= 0.0f) {
+            if (node.count > 0) {
+                cloudLeafIntersectionTest(meshData, q, node.offset, node.count, tClosest, hitSphere);
+            } else {
+                stack[stackSize++] = node.offset;
+                nodeIndex++;
+                continue;
+            }
+        }
+        nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+    }
+
+    if (hitSphere < 0) {
+        return -1;
+    }
+    hit.triangle = hitSphere;
+    hit.u = 0.0f;
+    hit.v = 0.0f;
+    return tClosest - .0001f;
+}
+
+// Sphere-tracing steps through an SDF's box, at least and at most; in
+// between, two per voxel the ray crosses
+#define SDF_MIN_STEPS 16
+#define SDF_MAX_STEPS 256
+// Points closer to the surface than this many voxels are on it
+#define SDF_HIT_TOLERANCE 0.05f
+
+/**
+ * The value at point `p`, clamped into the box, of a grid of `resolution`
+ * samples at the corners of voxels spanning it, trilinearly interpolated:
+ * by the texture unit from `texture` on the device, from `values` (x
+ * fastest) on the host.
+ */
+__host__ __device__ inline float gridValue(cudaTextureObject_t texture, const float *values,
+        glm::ivec3 resolution, glm::vec3 boundsMin, glm::vec3 boundsMax, glm::vec3 p) {
+    const glm::vec3 u = glm::clamp((p - boundsMin) / (boundsMax - boundsMin), 0.0f, 1.0f);
+    const glm::vec3 g = u * glm::vec3(resolution - 1);
+#ifdef __CUDA_ARCH__
+    // Samples sit at texel centres, so the box corners are half a texel in
+    const glm::vec3 c = (g + 0.5f) / glm::vec3(resolution);
+    return tex3D<float>(texture, c.x, c.y, c.z);
+#else
+    const glm::ivec3 i = glm::min(glm::ivec3(g), resolution - 2);
+    const glm::vec3 f = g - glm::vec3(i);
+    const int sx = 1;
+    const int sy = resolution.x;
+    const int sz = resolution.x * resolution.y;
+    const float *v = values + i.z * sz + i.y * sy + i.x;
+    float x00 = v[0] + f.x * (v[sx] - v[0]);
+    float x10 = v[sy] + f.x * (v[sy + sx] - v[sy]);
+    float x01 = v[sz] + f.x * (v[sz + sx] - v[sz]);
+    float x11 = v[sz + sy] + f.x * (v[sz + sy + sx] - v[sz + sy]);
+    float y0 = x00 + f.y * (x10 - x00);
+    float y1 = x01 + f.y * (x11 - x01);
+    return y0 + f.z * (y1 - y0);
+#endif
+}
+
+// The distance to the surface of `sdf` at object-space point `p`, clamped into its box
+__host__ __device__ inline float sdfDistance(const SdfVolume &sdf, const float *voxels, glm::vec3 p) {
+    return gridValue(sdf.texture, voxels + sdf.voxelOffset, sdf.resolution, sdf.boundsMin, sdf.boundsMax, p);
+}
+
+// Object-space gradient of `sdf` at `p`, by central differences half a voxel apart
+__host__ __device__ inline glm::vec3 sdfGradient(const SdfVolume &sdf, const float *voxels, glm::vec3 p) {
+    const float h = 0.5f * sdf.voxelSize;
+    return glm::vec3(
+        sdfDistance(sdf, voxels, p + glm::vec3(h, 0.0f, 0.0f)) - sdfDistance(sdf, voxels, p - glm::vec3(h, 0.0f, 0.0f)),
+        sdfDistance(sdf, voxels, p + glm::vec3(0.0f, h, 0.0f)) - sdfDistance(sdf, voxels, p - glm::vec3(0.0f, h, 0.0f)),
+        sdfDistance(sdf, voxels, p + glm::vec3(0.0f, 0.0f, h)) - sdfDistance(sdf, voxels, p - glm::vec3(0.0f, 0.0f, h)));
+}
+
+/**
+ * Test intersection between a ray and a transformed SDF volume by sphere
+ * tracing through the volume's box: each step advances by the distance
+ * sampled at the current point, so steps are long in empty space and the
+ * walk stops as soon as it is within SDF_HIT_TOLERANCE voxels of the
+ * surface. The step budget grows with the voxels the ray crosses. A ray
+ * starting inside the surface, as refracted rays do, traces it from within.
+ *
+ * Never inlined, so its loop and texture fetches get their own registers
+ * rather than adding to those of the BVH walk that calls it, which every
+ * analytic primitive's test shares.
+ *
+ * @param tMax  Closest hit so far; the march stops there.
+ * @return      Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ __noinline__ float sdfIntersectionTest(const DeviceGeom &geom, Ray r,
+        const MeshData &meshData, float tMax) {
+    const SdfVolume sdf = meshData.sdfs[geom.meshid];
+#ifdef __CUDA_ARCH__
+    if (sdf.texture == 0) {
+        return -1;
+    }
+#endif
+
+    Ray q;
+    q.origin    = worldToObjectPoint(geom, r.origin);
+    q.direction = worldToObjectVector(geom, r.direction);
+    const glm::vec3 invDirection = 1.0f / q.direction;
+    float t = aabbIntersectionTest(sdf.boundsMin, sdf.boundsMax, q, invDirection, tMax);
+    if (t < 0.0f) {
+        return -1;
+    }
+    const glm::vec3 t1 = (sdf.boundsMin - q.origin) * invDirection;
+    const glm::vec3 t2 = (sdf.boundsMax - q.origin) * invDirection;
+    const glm::vec3 tFar = glm::max(t1, t2);
+    const float tExit = glm::min(glm::min(glm::min(tFar.x, tFar.y), tFar.z), tMax);
+
+    // Object-space lengths per unit of t, which is the world one
+    const float speed = glm::length(q.direction);
+    const float tolerance = SDF_HIT_TOLERANCE * sdf.voxelSize;
+    const int maxSteps = glm::min(SDF_MAX_STEPS,
+        SDF_MIN_STEPS + (int)(2.0f * (tExit - t) * speed / sdf.voxelSize));
+    int step = 0;
+    float d = sdfDistance(sdf, meshData.sdfVoxels, q.origin + t * q.direction);
+    if (t == 0.0f) {
+        // A ray leaving the surface starts on it; step off before telling
+        // which side it is on
+        while (fabsf(d) < tolerance && step < maxSteps && t < tExit) {
+            t += tolerance / speed;
+            d = sdfDistance(sdf, meshData.sdfVoxels, q.origin + t * q.direction);
+            step++;
+        }
+    }
+    const float side = d < 0.0f ? -1.0f : 1.0f;
+    for (; step < maxSteps && t <= tExit; step++) {
+        const float distance = side * d;
+        if (distance < tolerance) {
+            return t;
+        }
+        t += distance / speed;
+        d = sdfDistance(sdf, meshData.sdfVoxels, q.origin + t * q.direction);
+    }
+    return -1;
+}
+
+/**
+ * The intersection test of device geom type TYPE, so a loop over geoms of
+ * one type compiles to that test alone. A new primitive type adds its
+ * test here and a case to the leaf dispatch in pathtrace.cu.
+ *
+ * @param tMax  Closest hit so far; only meshes, clouds and SDFs use it to bound their walk.
+ * @param hit   Output parameter for the triangle hit of meshes, or the sphere hit of clouds.
+ */
+template <int TYPE>
+__host__ __device__ inline float geomIntersectionTest(const DeviceGeom &geom, const Ray &r,
+        const MeshData &meshData, float tMax, MeshHit &hit) {
+    if (TYPE == AXIS_ALIGNED_CUBE) {
+        return axisAlignedBoxIntersectionTest(geom, r);
+    } else if (TYPE == UNIFORM_SPHERE) {
+        return uniformSphereIntersectionTest(geom, r);
+    } else if (TYPE == CUBE) {
+        return boxIntersectionTest(geom, r);
+    } else if (TYPE == SPHERE) {
+        return sphereIntersectionTest(geom, r);
+    } else if (TYPE == MESH) {
+        return meshIntersectionTest(geom, r, meshData, tMax, hit);
+    } else if (TYPE == SPHERE_CLOUD) {
+        return sphereCloudIntersectionTest(geom, r, meshData, tMax, hit);
+    } else if (TYPE == SDF_VOLUME) {
+        return sdfIntersectionTest(geom, r, meshData, tMax);
+    }
+    return -1;
+}
+
+// The material of a hit on `geom`: a cloud sphere's own, if it has one, else the geom's
+__host__ __device__ inline int hitMaterial(const DeviceGeom &geom, const MeshData &meshData, const MeshHit &meshHit) {
+    if (geom.type == SPHERE_CLOUD) {
+        const int materialid = meshData.cloudSpheres[meshHit.triangle].materialid;
+        if (materialid >= 0) {
+            return materialid;
+        }
+    }
+    return geom.materialid;
+}
+
+/**
+ * World-space unit normal of `geom` where `r` hits it at `t`, facing the
+ * ray (so flipped for hits from inside, which `frontFace` reports). Only
+ * the closest hit of a ray needs it, so the intersection tests above leave
+ * it out; `meshHit` is only read for meshes and clouds.
+ */
+__host__ __device__ glm::vec3 surfaceNormal(const DeviceGeom &geom, Ray r, float t,
+        const MeshData &meshData, const MeshHit &meshHit, bool &frontFace) {
+    glm::vec3 normal;
+    if (geom.type == UNIFORM_SPHERE) {
+        normal = r.origin + t * r.direction - glm::vec3(geom.inverseRows[0]);
+    } else if (geom.type == SPHERE) {
+        normal = objectToWorldNormal(geom, worldToObjectPoint(geom, r.origin + t * r.direction));
+    } else if (geom.type == SPHERE_CLOUD) {
+        const glm::vec3 centre = meshData.cloudSpheres[meshHit.triangle].centre;
+        normal = objectToWorldNormal(geom, worldToObjectPoint(geom, r.origin + t * r.direction) - centre);
+    } else if (geom.type == SDF_VOLUME) {
+        normal = objectToWorldNormal(geom, sdfGradient(meshData.sdfs[geom.meshid], meshData.sdfVoxels,
+            worldToObjectPoint(geom, r.origin + t * r.direction)));
+    } else if (geom.type == MESH) {
+        const Mesh mesh = meshData.meshes[geom.meshid];
+        glm::ivec3 tri = meshData.triangles[meshHit.triangle];
+        glm::vec3 objectNormal;
+        if (mesh.hasNormals) {
+            objectNormal = (1.0f - meshHit.u - meshHit.v) * meshNormal(meshData, tri.x)
+                + meshHit.u * meshNormal(meshData, tri.y) + meshHit.v * meshNormal(meshData, tri.z);
+        } else {
+            const glm::vec3 p0 = meshPosition(meshData, mesh, tri.x);
+            objectNormal = glm::cross(meshPosition(meshData, mesh, tri.y) - p0,
+                    meshPosition(meshData, mesh, tri.z) - p0);
+        }
+        normal = objectToWorldNormal(geom, objectNormal);
+    } else {
+        // Cubes: the face is the axis the object-space hit point is furthest along
+        glm::vec3 p = worldToObjectPoint(geom, r.origin + t * r.direction);
+        glm::vec3 a = glm::abs(p);
+        int axis = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+        glm::vec3 objectNormal(0.0f);
+        objectNormal[axis] = p[axis] > 0.0f ? 1.0f : -1.0f;
+        normal = objectToWorldNormal(geom, objectNormal);
+    }
+    normal = glm::normalize(normal);
+    frontFace = glm::dot(normal, r.direction) <= 0.0f;
+    return frontFace ? normal : -normal;
+}
+
+/**
+ * Maps an object-space direction to world space: the inverse of the 3x3
+ * part of the stored inverse rows. Only textured hits need it.
+ */
+__host__ __device__ inline glm::vec3 objectToWorldVector(const DeviceGeom &geom, glm::vec3 v) {
+    glm::mat3 worldToObject = glm::transpose(glm::mat3(glm::vec3(geom.inverseRows[0]),
+        glm::vec3(geom.inverseRows[1]), glm::vec3(geom.inverseRows[2])));
+    return glm::inverse(worldToObject) * v;
+}
+
+/**
+ * Texture coordinates and tangent frame where `r` hits `geom` at `t`, for
+ * textured materials. Spheres, a cloud's included, map longitude to u and
+ * latitude to v about their object z axis (world z for a UNIFORM_SPHERE); cube faces each span
+ * [0, 1]^2 over their other two axes; meshes interpolate their vertex uvs,
+ * or get zero without any, as SDF volumes always do. `intersection.surfaceNormal` must already be
+ * set; its uv, tangent, bitangentSign and uvDensity are filled in.
+ */
+__host__ __device__ void surfaceFrame(const DeviceGeom &geom, Ray r, float t,
+        const MeshData &meshData, const MeshHit &meshHit, ShadeableIntersection &intersection) {
+    glm::vec2 uv(0.0f);
+    glm::vec3 dpdu(0.0f);
+    glm::vec3 dpdv(0.0f);
+    const glm::vec3 hit = r.origin + t * r.direction;
+    if (geom.type == SPHERE || geom.type == UNIFORM_SPHERE || geom.type == SPHERE_CLOUD) {
+        glm::vec3 p = geom.type == UNIFORM_SPHERE ? hit - glm::vec3(geom.inverseRows[0])
+            : worldToObjectPoint(geom, hit);
+        if (geom.type == SPHERE_CLOUD) {
+            p -= meshData.cloudSpheres[meshHit.triangle].centre;
+        }
+        float ring = sqrtf(p.x * p.x + p.y * p.y);
+        float phi = atan2f(p.y, p.x);
+        float theta = atan2f(ring, p.z);
+        uv = glm::vec2(phi / (2.0f * PI) + 0.5f, theta / PI);
+        float cosPhi = ring > 0.0f ? p.x / ring : 1.0f;
+        float sinPhi = ring > 0.0f ? p.y / ring : 0.0f;
+        dpdu = 2.0f * PI * glm::vec3(-p.y, p.x, 0.0f);
+        dpdv = PI * glm::vec3(p.z * cosPhi, p.z * sinPhi, -ring);
+        if (geom.type != UNIFORM_SPHERE) {
+            dpdu = objectToWorldVector(geom, dpdu);
+            dpdv = objectToWorldVector(geom, dpdv);
+        }
+    } else if (geom.type == MESH) {
+        const Mesh mesh = meshData.meshes[geom.meshid];
+        if (mesh.hasUVs) {
+            glm::ivec3 tri = meshData.triangles[meshHit.triangle];
+            glm::vec2 uv0 = meshUV(meshData, tri.x);
+            glm::vec2 duv1 = meshUV(meshData, tri.y) - uv0;
+            glm::vec2 duv2 = meshUV(meshData, tri.z) - uv0;
+            uv = uv0 + meshHit.u * duv1 + meshHit.v * duv2;
+            glm::vec3 p0 = meshPosition(meshData, mesh, tri.x);
+            glm::vec3 e1 = meshPosition(meshData, mesh, tri.y) - p0;
+            glm::vec3 e2 = meshPosition(meshData, mesh, tri.z) - p0;
+            float det = duv1.x * duv2.y - duv1.y * duv2.x;
+            if (fabsf(det) > 1e-12f) {
+                dpdu = objectToWorldVector(geom, (e1 * duv2.y - e2 * duv1.y) / det);
+                dpdv = objectToWorldVector(geom, (e2 * duv1.x - e1 * duv2.x) / det);
+            }
+        }
+    } else if (geom.type == SDF_VOLUME) {
+        // No parameterization; the tangent below is any one
+    } else {
+        // Cubes: the face as in surfaceNormal, unmirrored seen from outside
+        glm::vec3 p = worldToObjectPoint(geom, hit);
+        glm::vec3 a = glm::abs(p);
+        int axis = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+        int uAxis = (axis + 1) % 3;
+        int vAxis = (axis + 2) % 3;
+        float side = p[axis] > 0.0f ? 1.0f : -1.0f;
+        uv = glm::vec2(0.5f + side * p[uAxis], 0.5f + p[vAxis]);
+        glm::vec3 du(0.0f);
+        glm::vec3 dv(0.0f);
+        du[uAxis] = side;
+        dv[vAxis] = 1.0f;
+        dpdu = objectToWorldVector(geom, du);
+        dpdv = objectToWorldVector(geom, dv);
+    }
+
+    // Gram-Schmidt against the shading normal; poles and meshes without uvs
+    // have no u direction, so any tangent does
+    const glm::vec3 n = intersection.surfaceNormal;
+    glm::vec3 tangent = dpdu - n * glm::dot(n, dpdu);
+    if (glm::dot(tangent, tangent) < 1e-12f) {
+        tangent = fabsf(n.x) > 0.5f ? glm::vec3(-n.y, n.x, 0.0f) : glm::vec3(0.0f, -n.z, n.y);
+    }
+    intersection.uv = uv;
+    intersection.tangent = glm::normalize(tangent);
+    intersection.bitangentSign = glm::dot(glm::cross(n, intersection.tangent), dpdv) < 0.0f ? -1.0f : 1.0f;
+    float area = glm::length(glm::cross(dpdu, dpdv));
+    intersection.uvDensity = area > 0.0f ? 1.0f / sqrtf(area) : 0.0f;
+}
 
-    return glm::length(r.origin - intersectionPoint);
+__host__ __device__ inline bool hasTextureMaps(const Material &material) {
+    return material.albedoMap >= 0 || material.normalMap >= 0 || material.roughnessMap >= 0;
 }
@@ -0,0 +1,819 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "benchmark.h"
+#include "cpuSimd.h"
+#include "pathtrace.h"
+#include "scene.h"
+#include "sceneGenerator.h"
+
+/**
+ * Kernel micro-benchmark, a separate executable from the renderer:
+ *
+ *     kernel_benchmark OUT.json|OUT.csv [options] [SCENEFILE.txt...]
+ *
+ * Every scene, from a file or generated (see sceneGenerator.h), is traced with
+ * the --benchmark settings, and the GPU timers of each stage are read after
+ * every iteration: ray generation, computeIntersections, shadeSimpleMaterials
+ * and the stream compaction summed over the split pipeline's bounces, the
+ * whole bounce loop of whichever pipeline traced it, then finalGather and
+ * the denoiser, and the whole iteration as the host waits for it. After
+ * --warmup untimed iterations, each stage is reported over --repetitions
+ * iterations as mean, median, min, max, standard deviation and
+ * interquartile range in ms, as JSON, or as CSV when OUT ends in .csv.
+ * Each scene also records the GPU and the block size and occupancy that
+ * pathtraceLaunchConfiguration() chose for the tuned kernels.
+ *
+ * Options:
+ *     --warmup N            iterations before timing starts (default 8)
+ *     --repetitions N       timed iterations (default 32)
+ *     --synthetic A,B,...   generated scenes of A, B, ... objects, shaped by
+ *                           the generator's options
+ *     --spheres A,B,...     generated scenes of only spheres, on a grid
+ *     --cubes A,B,...       the same with cubes
+ *     --filter-size N       denoiser footprint (default 80)
+ *     --samples-per-launch N  samples per pixel each iteration traces (default 1)
+ *     --gather atomic|segmented  finalGather's mode for several samples
+ *                           per launch (default segmented)
+ *     --pipeline NAME       split, wavefront, megakernel, graph, persistent or
+ *                           cooperative (default split); only the bounces
+ *                           stage covers the ones that do not time each bounce
+ *     --hit-records         intersect into compact hit records after the
+ *                           first bounce (computeHitRecords), which the
+ *                           intersection stage's launch figures then describe
+ *     --compare-l2          time every scene a second time without the L2
+ *                           persistence window over its hot arrays, whose
+ *                           set-aside each scene's rows record (0 for none)
+ *     --cpu-packets N       also time the CPU renderer's packet box and sphere
+ *                           tests (cpuSimd.h) on N random ray-geom pairs per
+ *                           repetition against the scalar tests, and report
+ *                           the largest difference between their t values;
+ *                           scene files are then optional
+ *     --replay CAPTURE      also time the intersection and shading kernels
+ *                           on a bounce captured with --capture-bounce (see
+ *                           pathtraceCaptureBounce), with no scene parsed;
+ *                           may repeat, and scene files are then optional.
+ *                           Only those two stages of its rows are filled.
+ *     --replay-kernel intersect|shade  replay only that kernel, e.g. for
+ *                           a profiler to see it alone
+ *     --baseline FILE       append every stage's median and IQR to FILE, a
+ *                           tab-separated results database keyed by GPU,
+ *                           commit, scene and settings
+ *     --compare FILE        compare every stage with its latest row in FILE
+ *                           of the same GPU, scene and settings (from
+ *                           --against's commit if given) and flag the
+ *                           regressions, exiting with 2 if there are any;
+ *                           with --baseline too, the rows are added after
+ *     --against COMMIT      the baseline commit --compare reads
+ *     --commit ID           the commit the results are stored under
+ *                           (default: HEAD when CMake configured the build)
+ *
+ * A stage counts as slower or faster only when its median moved by more
+ * than REGRESSION_IQR_FACTOR times the larger of the two IQRs, and by more
+ * than REGRESSION_MIN_PERCENT of the baseline median, so run-to-run noise
+ * and timer resolution do not raise false alarms. More repetitions narrow
+ * the IQRs and catch smaller regressions.
+ */
+
+// Medians must move by more than this many IQRs...
+#define REGRESSION_IQR_FACTOR 1.5
+// ...and by more than this share of the baseline median to count
+#define REGRESSION_MIN_PERCENT 2.0
+
+#ifndef BENCHMARK_COMMIT
+#define BENCHMARK_COMMIT "unknown"
+#endif
+
+// A timed stage; totals sum the stage over the iteration's bounces
+enum KernelStage {
+    STAGE_GENERATE_RAYS,
+    STAGE_INTERSECT,
+    STAGE_SHADE,
+    STAGE_COMPACT,
+    STAGE_BOUNCES,          // the whole bounce loop, whatever the pipeline
+    STAGE_FINAL_GATHER,
+    STAGE_DENOISE,
+    STAGE_ITERATION,        // end to end, host wall time of pathtrace() and denoise()
+    STAGE_COUNT,
+};
+
+static const char *STAGE_NAMES[STAGE_COUNT] = {
+    "generateRayFromCamera",
+    "computeIntersections",
+    "shadeSimpleMaterials",
+    "compaction",
+    "bounces",
+    "finalGather",
+    "denoise",
+    "iteration",
+};
+
+struct KernelBenchmarkSettings {
+    int warmup;
+    int repetitions;
+    int filterSize;
+    int samplesPerLaunch;
+    int gather;             // a GatherMode
+    bool hitRecords;
+    int pipeline;           // a PathtracePipeline
+    bool compareL2;
+    std::string replayKernel;   // empty for both
+    std::string commit;         // results are stored under
+};
+
+// --pipeline's names, in PathtracePipeline order
+static const char *PIPELINE_NAMES[] = {
+    "split", "wavefront", "megakernel", "graph", "persistent", "cooperative",
+};
+static const int PIPELINE_NAME_COUNT = sizeof(PIPELINE_NAMES) / sizeof(PIPELINE_NAMES[0]);
+
+struct StageSummary {
+    double meanMs;
+    double medianMs;
+    double minMs;
+    double maxMs;
+    double stddevMs;
+    double iqrMs;           // third quartile less first
+    int count;              // timed runs, 0 for a stage that was not run
+};
+
+// One benchmarked scene, as the output lists it
+struct SceneResult {
+    std::string name;
+    int geoms;
+    int width;
+    int height;
+    int depth;
+    LaunchConfiguration launch;
+    StageSummary stages[STAGE_COUNT];
+};
+
+// A cpuSimd packet test timed against the scalar test it vectorizes
+struct PacketResult {
+    std::string name;
+    int tests;              // ray-geom pairs per repetition
+    StageSummary scalar;
+    StageSummary packet;
+    float maxError;         // largest |t| difference where both hit
+    int mismatches;         // pairs one side hits and the other misses
+};
+
+static std::vector<int> parseIntList(const char *s) {
+    std::vector<int> values;
+    const char *p = s;
+    while (*p != '\0') {
+        char *end;
+        int value = (int)strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        values.push_back(value);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+// Linearly interpolated between the closest ranks of the sorted `ms`
+static double percentile(const std::vector<double> &ms, double p) {
+    const double rank = p * (ms.size() - 1);
+    const size_t below = (size_t)rank;
+    const size_t above = std::min(below + 1, ms.size() - 1);
+    return ms[below] + (rank - below) * (ms[above] - ms[below]);
+}
+
+static StageSummary summarize(std::vector<double> ms) {
+    StageSummary summary = {};
+    if (ms.empty()) {
+        return summary;
+    }
+    std::sort(ms.begin(), ms.end());
+    double sum = 0.0;
+    for (size_t i = 0; i < ms.size(); i++) {
+        sum += ms[i];
+    }
+    summary.meanMs = sum / ms.size();
+    double squares = 0.0;
+    for (size_t i = 0; i < ms.size(); i++) {
+        squares += (ms[i] - summary.meanMs) * (ms[i] - summary.meanMs);
+    }
+    size_t mid = ms.size() / 2;
+    summary.medianMs = ms.size() % 2 == 1 ? ms[mid] : 0.5 * (ms[mid - 1] + ms[mid]);
+    summary.minMs = ms.front();
+    summary.maxMs = ms.back();
+    summary.stddevMs = sqrt(squares / ms.size());
+    summary.iqrMs = percentile(ms, 0.75) - percentile(ms, 0.25);
+    summary.count = (int)ms.size();
+    return summary;
+}
+
+static void benchmarkScene(const std::string &sceneFile, const KernelBenchmarkSettings &settings,
+        std::vector<SceneResult> &results) {
+    // Scene has no destructor definition, so like main() this never frees it
+    Scene *scene = new Scene(sceneFile);
+    const Camera &cam = scene->state.camera;
+    pathtraceInit(scene);
+
+    // Every bounce intersects, so the intersection stage does not depend on
+    // the iteration; the first-bounce cache would skip bounce 0 after the
+    // first iteration
+    PathtraceOptions traceOptions = benchmarkPathtraceOptions(false);
+    traceOptions.cacheFirstBounce = false;
+    traceOptions.samplesPerLaunch = settings.samplesPerLaunch;
+    traceOptions.gather = settings.gather;
+    traceOptions.hitRecords = settings.hitRecords;
+    traceOptions.pipeline = settings.pipeline;
+    DenoiseOptions denoiseOptions = benchmarkDenoiseOptions(settings.filterSize, 0.45f);
+
+    pathtraceReset();
+    pathtraceEnableTiming(true, false);
+    std::vector<double> ms[STAGE_COUNT];
+    for (int iter = 1; iter <= settings.warmup + settings.repetitions; iter++) {
+        // pathtrace() and denoise() take the samples accumulated so far
+        const int samples = iter * settings.samplesPerLaunch;
+        auto start = std::chrono::steady_clock::now();
+        pathtrace(0, samples, traceOptions);
+        denoise(samples, denoiseOptions);
+        cudaDeviceSynchronize();
+        const double iterationMs = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+        const PathtraceStats &stats = pathtraceStats();
+        if (iter <= settings.warmup) {
+            continue;
+        }
+        double bounces[4] = { 0.0, 0.0, 0.0, stats.megakernelMs };
+        for (int depth = 0; depth < stats.depths && depth < STATS_MAX_DEPTH; depth++) {
+            bounces[0] += stats.intersectMs[depth];
+            bounces[1] += stats.shadeMs[depth];
+            bounces[2] += stats.compactMs[depth];
+            bounces[3] += stats.sortRaysMs[depth] + stats.intersectMs[depth] + stats.shadeMs[depth]
+                + stats.compactMs[depth];
+        }
+        ms[STAGE_GENERATE_RAYS].push_back(stats.generateRaysMs);
+        ms[STAGE_INTERSECT].push_back(bounces[0]);
+        ms[STAGE_SHADE].push_back(bounces[1]);
+        ms[STAGE_COMPACT].push_back(bounces[2]);
+        ms[STAGE_BOUNCES].push_back(bounces[3]);
+        ms[STAGE_FINAL_GATHER].push_back(stats.finalGatherMs);
+        ms[STAGE_DENOISE].push_back(stats.denoiseMs);
+        ms[STAGE_ITERATION].push_back(iterationMs);
+    }
+    pathtraceEnableTiming(false);
+
+    SceneResult result;
+    result.name = sceneFile;
+    result.geoms = (int)scene->geoms.size();
+    result.width = cam.resolution.x;
+    result.height = cam.resolution.y;
+    result.depth = scene->state.traceDepth;
+    result.launch = pathtraceLaunchConfiguration();
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        result.stages[s] = summarize(ms[s]);
+    }
+    results.push_back(result);
+    printf("%s: %d geoms, %d iterations timed on %s (sm_%d), blocks of %d/%d threads, %zu KB of L2 persisting\n",
+        sceneFile.c_str(), result.geoms, settings.repetitions, result.launch.device,
+        result.launch.computeCapability, result.launch.intersect.blockSize, result.launch.shade.blockSize,
+        result.launch.l2PersistingBytes >> 10);
+
+    pathtraceFree();
+}
+
+// Times a bounce capture's kernels, which pathtraceReplay runs without a scene
+static bool benchmarkReplay(const std::string &captureFile, const KernelBenchmarkSettings &settings,
+        std::vector<SceneResult> &results) {
+    ReplayResult replay;
+    std::string error;
+    if (!pathtraceReplay(captureFile, settings.replayKernel, settings.warmup, settings.repetitions, replay, error)) {
+        printf("kernel_benchmark: %s\n", error.c_str());
+        return false;
+    }
+    SceneResult result = {};
+    result.name = captureFile;
+    result.geoms = replay.geoms;
+    result.width = replay.resolution.x;
+    result.height = replay.resolution.y;
+    result.depth = replay.depth;
+    result.launch = pathtraceLaunchConfiguration();
+    result.stages[STAGE_INTERSECT] = summarize(replay.intersectMs);
+    result.stages[STAGE_SHADE] = summarize(replay.shadeMs);
+    results.push_back(result);
+    printf("%s: bounce %d of %d paths replayed %d times on %s, %.3f ms intersecting (%d hits differ),"
+        " %.3f ms shading\n", captureFile.c_str(), replay.depth, replay.paths, settings.repetitions,
+        result.launch.device, result.stages[STAGE_INTERSECT].medianMs, replay.mismatches,
+        result.stages[STAGE_SHADE].medianMs);
+    return true;
+}
+
+/**
+ * Times the four packet variants over `tests` pairs of random geoms (unit
+ * cubes and spheres scaled 0.5 to 2, rotated and spread over [-4, 4]) and
+ * rays from [-8, 8]. Geom-packet variants test one ray against each packet
+ * of CPU_SIMD_WIDTH geoms, ray-packet variants a packet of rays against one
+ * geom. The scalar side goes through the host entry points in pathtrace.cu,
+ * so it pays a call per test the inlined packets do not.
+ */
+static void benchmarkPackets(int tests, const KernelBenchmarkSettings &settings,
+        std::vector<PacketResult> &results) {
+    tests = std::max(tests / CPU_SIMD_WIDTH, 1) * CPU_SIMD_WIDTH;
+    srand(565);
+    const auto uniform = [](float lo, float hi) { return lo + (hi - lo) * (float)rand() / (float)RAND_MAX; };
+    std::vector<DeviceGeom> geoms(tests);
+    std::vector<Ray> rays(tests);
+    for (int i = 0; i < tests; i++) {
+        glm::vec3 axis = glm::normalize(glm::vec3(uniform(-1, 1), uniform(-1, 1), uniform(1e-3f, 1)));
+        glm::mat4 transform = glm::translate(glm::mat4(1.0f),
+            glm::vec3(uniform(-4, 4), uniform(-4, 4), uniform(-4, 4)));
+        transform = glm::rotate(transform, uniform(0, 6.2831853f), axis);
+        transform = glm::scale(transform, glm::vec3(uniform(0.5f, 2), uniform(0.5f, 2), uniform(0.5f, 2)));
+        glm::mat4 inverse = glm::inverse(transform);
+        geoms[i] = DeviceGeom();
+        for (int r = 0; r < 3; r++) {
+            geoms[i].inverseRows[r] = glm::vec4(inverse[0][r], inverse[1][r], inverse[2][r], inverse[3][r]);
+        }
+        rays[i].origin = glm::vec3(uniform(-8, 8), uniform(-8, 8), uniform(-8, 8));
+        rays[i].direction = glm::normalize(-rays[i].origin + glm::vec3(uniform(-4, 4), uniform(-4, 4), uniform(-4, 4)));
+    }
+    const int packets = tests / CPU_SIMD_WIDTH;
+    std::vector<GeomPacket> geomPackets(packets);
+    std::vector<RayPacket> rayPackets(packets);
+    for (int p = 0; p < packets; p++) {
+        geomPackets[p] = cpuSimd::packGeoms(&geoms[p * CPU_SIMD_WIDTH], CPU_SIMD_WIDTH);
+        rayPackets[p] = cpuSimd::packRays(&rays[p * CPU_SIMD_WIDTH], CPU_SIMD_WIDTH);
+    }
+
+    const char *names[4] = { "box_geom_packet", "sphere_geom_packet", "box_ray_packet", "sphere_ray_packet" };
+    std::vector<float> scalarT(tests);
+    std::vector<float> packetT(tests);
+    for (int variant = 0; variant < 4; variant++) {
+        const bool sphere = variant % 2 == 1;
+        const bool geomPacket = variant < 2;
+        std::vector<double> scalarMs;
+        std::vector<double> packetMs;
+        for (int rep = 0; rep < settings.warmup + settings.repetitions; rep++) {
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < tests; i++) {
+                // Pair i is geom i with the packet's ray, or ray i with the packet's geom
+                const int shared = i - i % CPU_SIMD_WIDTH;
+                const DeviceGeom &geom = geoms[geomPacket ? i : shared];
+                const Ray &ray = rays[geomPacket ? shared : i];
+                scalarT[i] = sphere ? hostSphereIntersectionTest(geom, ray) : hostBoxIntersectionTest(geom, ray);
+            }
+            auto middle = std::chrono::steady_clock::now();
+            for (int p = 0; p < packets; p++) {
+                float *t = &packetT[p * CPU_SIMD_WIDTH];
+                const int shared = p * CPU_SIMD_WIDTH;
+                if (geomPacket && sphere) {
+                    cpuSimd::sphereIntersectionTest(geomPackets[p], rays[shared], t);
+                } else if (geomPacket) {
+                    cpuSimd::boxIntersectionTest(geomPackets[p], rays[shared], t);
+                } else if (sphere) {
+                    cpuSimd::sphereIntersectionTest(geoms[shared], rayPackets[p], t);
+                } else {
+                    cpuSimd::boxIntersectionTest(geoms[shared], rayPackets[p], t);
+                }
+            }
+            auto end = std::chrono::steady_clock::now();
+            if (rep >= settings.warmup) {
+                scalarMs.push_back(std::chrono::duration<double, std::milli>(middle - start).count());
+                packetMs.push_back(std::chrono::duration<double, std::milli>(end - middle).count());
+            }
+        }
+
+        PacketResult result;
+        result.name = names[variant];
+        result.tests = tests;
+        result.scalar = summarize(scalarMs);
+        result.packet = summarize(packetMs);
+        result.maxError = 0.0f;
+        result.mismatches = 0;
+        for (int i = 0; i < tests; i++) {
+            if ((scalarT[i] < 0.0f) != (packetT[i] < 0.0f)) {
+                result.mismatches++;
+            } else if (scalarT[i] >= 0.0f) {
+                result.maxError = std::max(result.maxError, std::fabs(scalarT[i] - packetT[i]));
+            }
+        }
+        results.push_back(result);
+        printf("cpu %s (%s x%d): %.3f ms scalar, %.3f ms packet for %d tests, max |dt| %g, %d mismatched\n",
+            result.name.c_str(), cpuSimd::instructionSet(), CPU_SIMD_WIDTH, result.scalar.medianMs,
+            result.packet.medianMs, tests, result.maxError, result.mismatches);
+    }
+}
+
+// The tuned launch of a stage's kernel, or NULL for the fixed-size ones
+static const KernelLaunch *stageLaunch(const LaunchConfiguration &launch, int stage, bool hitRecords) {
+    if (stage == STAGE_INTERSECT) {
+        return hitRecords ? &launch.hitRecords : &launch.intersect;
+    } else if (stage == STAGE_SHADE) {
+        return &launch.shade;
+    }
+    return NULL;
+}
+
+static const char *gatherName(int gather) {
+    return gather == GATHER_ATOMIC ? "atomic" : "segmented";
+}
+
+static void writeCsvRow(FILE *out, const KernelBenchmarkSettings &settings, const std::string &scene,
+        int geoms, int width, int height, int depth, const std::string &kernel, const StageSummary &stage,
+        int computeCapability, size_t l2PersistingBytes) {
+    fprintf(out, "%s,%d,%d,%d,%d,%d,%s,%d,%s,%s,%d,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%d,%zu,",
+        scene.c_str(), geoms, width, height, depth,
+        settings.samplesPerLaunch, gatherName(settings.gather), settings.hitRecords ? 1 : 0,
+        PIPELINE_NAMES[settings.pipeline], kernel.c_str(), settings.warmup, settings.repetitions,
+        stage.meanMs, stage.medianMs, stage.minMs, stage.maxMs, stage.stddevMs, stage.iqrMs, computeCapability,
+        l2PersistingBytes);
+}
+
+/**
+ * Packet results follow the scenes as rows of a "cpu_packets.ISA" scene,
+ * geoms holding the tests per repetition and width the lanes, each variant
+ * as a _scalar and a _packet kernel.
+ */
+static void writeCsv(FILE *out, const KernelBenchmarkSettings &settings,
+        const std::vector<SceneResult> &results, const std::vector<PacketResult> &packets) {
+    fprintf(out, "scene,geoms,width,height,depth,samples_per_launch,gather,hit_records,pipeline,kernel,warmup,repetitions,"
+        "mean_ms,median_ms,min_ms,max_ms,stddev_ms,iqr_ms,compute_capability,l2_persisting_bytes,block_size,occupancy\n");
+    for (size_t r = 0; r < results.size(); r++) {
+        const SceneResult &result = results[r];
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            writeCsvRow(out, settings, result.name, result.geoms, result.width, result.height, result.depth,
+                STAGE_NAMES[s], result.stages[s], result.launch.computeCapability, result.launch.l2PersistingBytes);
+            // Blank for the kernels with fixed block sizes
+            const KernelLaunch *launch = stageLaunch(result.launch, s, settings.hitRecords);
+            if (launch != NULL) {
+                fprintf(out, "%d,%.3f", launch->blockSize, launch->occupancy);
+            } else {
+                fprintf(out, ",");
+            }
+            fprintf(out, "\n");
+        }
+    }
+    const std::string packetScene = std::string("cpu_packets.") + cpuSimd::instructionSet();
+    for (size_t r = 0; r < packets.size(); r++) {
+        const PacketResult &packet = packets[r];
+        writeCsvRow(out, settings, packetScene, packet.tests, CPU_SIMD_WIDTH, 0, 0, packet.name + "_scalar",
+            packet.scalar, 0, 0);
+        fprintf(out, ",\n");
+        writeCsvRow(out, settings, packetScene, packet.tests, CPU_SIMD_WIDTH, 0, 0, packet.name + "_packet",
+            packet.packet, 0, 0);
+        fprintf(out, ",\n");
+    }
+}
+
+// Scene names are file paths, so only quotes and backslashes need escaping
+static std::string jsonString(const std::string &s) {
+    std::string quoted = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"' || s[i] == '\\') {
+            quoted += '\\';
+        }
+        quoted += s[i];
+    }
+    return quoted + "\"";
+}
+
+static void writeJsonStage(FILE *out, const char *name, const StageSummary &stage) {
+    fprintf(out, "\"%s\": { \"mean_ms\": %.4f, \"median_ms\": %.4f, \"min_ms\": %.4f,"
+        " \"max_ms\": %.4f, \"stddev_ms\": %.4f, \"iqr_ms\": %.4f", name, stage.meanMs, stage.medianMs,
+        stage.minMs, stage.maxMs, stage.stddevMs, stage.iqrMs);
+}
+
+static void writeJson(FILE *out, const KernelBenchmarkSettings &settings,
+        const std::vector<SceneResult> &results, const std::vector<PacketResult> &packets) {
+    fprintf(out, "{\n  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"samples_per_launch\": %d,\n"
+        "  \"gather\": \"%s\",\n  \"hit_records\": %s,\n  \"pipeline\": \"%s\",\n  \"scenes\": [\n",
+        settings.warmup, settings.repetitions, settings.samplesPerLaunch, gatherName(settings.gather),
+        settings.hitRecords ? "true" : "false", PIPELINE_NAMES[settings.pipeline]);
+    for (size_t r = 0; r < results.size(); r++) {
+        const SceneResult &result = results[r];
+        const LaunchConfiguration &launch = result.launch;
+        fprintf(out, "    {\n      \"scene\": %s,\n      \"geoms\": %d,\n      \"width\": %d,\n"
+            "      \"height\": %d,\n      \"depth\": %d,\n",
+            jsonString(result.name).c_str(), result.geoms, result.width, result.height, result.depth);
+        fprintf(out, "      \"device\": %s,\n      \"compute_capability\": %d,\n"
+            "      \"multiprocessors\": %d,\n      \"megakernel_block_size\": %d,\n"
+            "      \"megakernel_occupancy\": %.3f,\n      \"l2_persisting_bytes\": %zu,\n"
+            "      \"l2_window_bytes\": %zu,\n      \"kernels\": {\n",
+            jsonString(launch.device).c_str(), launch.computeCapability, launch.multiprocessors,
+            launch.megakernel.blockSize, launch.megakernel.occupancy, launch.l2PersistingBytes,
+            launch.l2WindowBytes);
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            fprintf(out, "        ");
+            writeJsonStage(out, STAGE_NAMES[s], result.stages[s]);
+            const KernelLaunch *stageKernel = stageLaunch(launch, s, settings.hitRecords);
+            if (stageKernel != NULL) {
+                fprintf(out, ", \"block_size\": %d, \"occupancy\": %.3f",
+                    stageKernel->blockSize, stageKernel->occupancy);
+            }
+            fprintf(out, " }%s\n", s + 1 < STAGE_COUNT ? "," : "");
+        }
+        fprintf(out, "      }\n    }%s\n", r + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"cpu_packets\": {\n    \"instruction_set\": \"%s\",\n    \"width\": %d,\n"
+        "    \"variants\": [\n", cpuSimd::instructionSet(), CPU_SIMD_WIDTH);
+    for (size_t r = 0; r < packets.size(); r++) {
+        const PacketResult &packet = packets[r];
+        fprintf(out, "      { \"name\": \"%s\", \"tests\": %d, \"max_error\": %g, \"mismatches\": %d, ",
+            packet.name.c_str(), packet.tests, packet.maxError, packet.mismatches);
+        writeJsonStage(out, "scalar", packet.scalar);
+        fprintf(out, " }, ");
+        writeJsonStage(out, "packet", packet.packet);
+        fprintf(out, " } }%s\n", r + 1 < packets.size() ? "," : "");
+    }
+    fprintf(out, "    ]\n  }\n}\n");
+}
+
+// One stage of one result, as a line of the baseline file
+struct BaselineRow {
+    std::string gpu;
+    std::string commit;
+    std::string scene;
+    std::string config;
+    std::string stage;
+    double medianMs;
+    double iqrMs;
+    int repetitions;
+};
+
+// The settings a result's timings depend on, so that only like is compared with like
+static std::string baselineConfig(const KernelBenchmarkSettings &settings, const SceneResult &result) {
+    char config[256];
+    snprintf(config, sizeof(config), "%dx%d,depth=%d,pipeline=%s,spp=%d,gather=%s,hit_records=%d,filter=%d,l2_kb=%zu",
+        result.width, result.height, result.depth, PIPELINE_NAMES[settings.pipeline], settings.samplesPerLaunch,
+        gatherName(settings.gather), settings.hitRecords ? 1 : 0, settings.filterSize,
+        result.launch.l2PersistingBytes >> 10);
+    return config;
+}
+
+// Lines that do not split into a whole row, such as the header, are skipped
+static std::vector<BaselineRow> readBaseline(const std::string &file) {
+    std::vector<BaselineRow> rows;
+    std::ifstream in(file.c_str());
+    std::string line;
+    while (std::getline(in, line)) {
+        std::vector<std::string> fields;
+        std::stringstream columns(line);
+        std::string field;
+        while (std::getline(columns, field, '\t')) {
+            fields.push_back(field);
+        }
+        if (fields.size() != 8 || line[0] == '#') {
+            continue;
+        }
+        BaselineRow row;
+        row.gpu = fields[0];
+        row.commit = fields[1];
+        row.scene = fields[2];
+        row.config = fields[3];
+        row.stage = fields[4];
+        row.medianMs = atof(fields[5].c_str());
+        row.iqrMs = atof(fields[6].c_str());
+        row.repetitions = atoi(fields[7].c_str());
+        rows.push_back(row);
+    }
+    return rows;
+}
+
+static bool appendBaseline(const std::string &file, const KernelBenchmarkSettings &settings,
+        const std::vector<SceneResult> &results) {
+    FILE *out = fopen(file.c_str(), "a");
+    if (out == NULL) {
+        return false;
+    }
+    fseek(out, 0, SEEK_END);
+    if (ftell(out) == 0) {
+        fprintf(out, "# gpu\tcommit\tscene\tconfig\tstage\tmedian_ms\tiqr_ms\trepetitions\n");
+    }
+    for (size_t r = 0; r < results.size(); r++) {
+        const SceneResult &result = results[r];
+        const std::string config = baselineConfig(settings, result);
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            if (result.stages[s].count > 0) {
+                fprintf(out, "%s\t%s\t%s\t%s\t%s\t%.5f\t%.5f\t%d\n", result.launch.device,
+                    settings.commit.c_str(), result.name.c_str(), config.c_str(), STAGE_NAMES[s],
+                    result.stages[s].medianMs, result.stages[s].iqrMs, result.stages[s].count);
+            }
+        }
+    }
+    return fclose(out) == 0;
+}
+
+/**
+ * Prints every stage of `results` against its latest baseline row, of
+ * commit `against` if that is not empty, and returns the number of
+ * regressions (see REGRESSION_IQR_FACTOR).
+ */
+static int compareBaseline(const std::vector<BaselineRow> &baseline, const std::string &against,
+        const KernelBenchmarkSettings &settings, const std::vector<SceneResult> &results) {
+    int regressions = 0;
+    int improvements = 0;
+    int compared = 0;
+    for (size_t r = 0; r < results.size(); r++) {
+        const SceneResult &result = results[r];
+        const std::string config = baselineConfig(settings, result);
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            const StageSummary &stage = result.stages[s];
+            if (stage.count == 0) {
+                continue;
+            }
+            const BaselineRow *base = NULL;
+            for (size_t b = 0; b < baseline.size(); b++) {
+                const BaselineRow &row = baseline[b];
+                if (row.gpu == result.launch.device && row.scene == result.name && row.config == config
+                        && row.stage == STAGE_NAMES[s] && (against.empty() || row.commit == against)) {
+                    base = &row;
+                }
+            }
+            if (base == NULL) {
+                printf("%s %s: %.4f ms, no baseline\n", result.name.c_str(), STAGE_NAMES[s], stage.medianMs);
+                continue;
+            }
+            const double delta = stage.medianMs - base->medianMs;
+            const double threshold = std::max(REGRESSION_IQR_FACTOR * std::max(stage.iqrMs, base->iqrMs),
+                base->medianMs * REGRESSION_MIN_PERCENT / 100.0);
+            const char *verdict = "within noise";
+            if (delta > threshold) {
+                verdict = "REGRESSION";
+                regressions++;
+            } else if (delta < -threshold) {
+                verdict = "faster";
+                improvements++;
+            }
+            compared++;
+            printf("%s %s: %.4f ms at %s -> %.4f ms, %+.1f%% (IQR %.4f / %.4f ms) %s\n", result.name.c_str(),
+                STAGE_NAMES[s], base->medianMs, base->commit.c_str(), stage.medianMs,
+                base->medianMs > 0.0 ? 100.0 * delta / base->medianMs : 0.0, base->iqrMs, stage.iqrMs, verdict);
+        }
+    }
+    printf("%d stages compared: %d regressions, %d faster\n", compared, regressions, improvements);
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s OUT.json|OUT.csv [--warmup N] [--repetitions N] [--spheres A,B,...]"
+            " [--cubes A,B,...] [--synthetic A,B,...] [generator options] [--filter-size N]"
+            " [--samples-per-launch N] [--gather atomic|segmented] [--pipeline NAME] [--hit-records]"
+            " [--compare-l2] [--cpu-packets N] [--replay CAPTURE] [--replay-kernel intersect|shade]"
+            " [--baseline FILE] [--compare FILE] [--against COMMIT] [--commit ID]"
+            " [SCENEFILE.txt...]\n",
+            argv[0]);
+        return 1;
+    }
+
+    KernelBenchmarkSettings settings;
+    settings.warmup = 8;
+    settings.repetitions = 32;
+    settings.filterSize = 80;
+    settings.samplesPerLaunch = 1;
+    settings.gather = GATHER_SEGMENTED;
+    settings.hitRecords = false;
+    settings.pipeline = PIPELINE_SPLIT;
+    settings.compareL2 = false;
+    settings.commit = BENCHMARK_COMMIT;
+    SceneGeneratorSettings generator = sceneGenerator::defaults();
+
+    const std::string outFile = argv[1];
+    std::vector<std::string> sceneFiles;
+    std::vector<int> spheres;
+    std::vector<int> cubes;
+    std::vector<int> objects;
+    int packetTests = 0;
+    std::vector<std::string> captureFiles;
+    std::string baselineFile;
+    std::string compareFile;
+    std::string against;
+    for (int i = 2; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--warmup") == 0 && hasValue) {
+            settings.warmup = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--repetitions") == 0 && hasValue) {
+            settings.repetitions = std::max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--spheres") == 0 && hasValue) {
+            spheres = parseIntList(argv[++i]);
+        } else if (strcmp(argv[i], "--cubes") == 0 && hasValue) {
+            cubes = parseIntList(argv[++i]);
+        } else if (strcmp(argv[i], "--synthetic") == 0 && hasValue) {
+            objects = parseIntList(argv[++i]);
+        } else if (sceneGenerator::takeOption(i, argc, argv, generator)) {
+            continue;
+        } else if (strcmp(argv[i], "--filter-size") == 0 && hasValue) {
+            settings.filterSize = std::max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--samples-per-launch") == 0 && hasValue) {
+            settings.samplesPerLaunch = std::min(std::max(atoi(argv[++i]), 1), MAX_SAMPLES_PER_LAUNCH);
+        } else if (strcmp(argv[i], "--gather") == 0 && hasValue) {
+            settings.gather = strcmp(argv[++i], "atomic") == 0 ? GATHER_ATOMIC : GATHER_SEGMENTED;
+        } else if (strcmp(argv[i], "--pipeline") == 0 && hasValue) {
+            const char *name = argv[++i];
+            settings.pipeline = -1;
+            for (int p = 0; p < PIPELINE_NAME_COUNT; p++) {
+                if (strcmp(name, PIPELINE_NAMES[p]) == 0) {
+                    settings.pipeline = p;
+                }
+            }
+            if (settings.pipeline < 0) {
+                printf("kernel_benchmark: unknown pipeline %s\n", name);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--hit-records") == 0) {
+            settings.hitRecords = true;
+        } else if (strcmp(argv[i], "--compare-l2") == 0) {
+            settings.compareL2 = true;
+        } else if (strcmp(argv[i], "--cpu-packets") == 0 && hasValue) {
+            packetTests = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--baseline") == 0 && hasValue) {
+            baselineFile = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && hasValue) {
+            compareFile = argv[++i];
+        } else if (strcmp(argv[i], "--against") == 0 && hasValue) {
+            against = argv[++i];
+        } else if (strcmp(argv[i], "--commit") == 0 && hasValue) {
+            settings.commit = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && hasValue) {
+            captureFiles.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "--replay-kernel") == 0 && hasValue) {
+            settings.replayKernel = argv[++i];
+            if (settings.replayKernel != "intersect" && settings.replayKernel != "shade") {
+                printf("kernel_benchmark: unknown replay kernel %s\n", settings.replayKernel.c_str());
+                return 1;
+            }
+        } else {
+            sceneFiles.push_back(argv[i]);
+        }
+    }
+
+    // Synthetic scenes are written next to the output and removed after use
+    SceneGeneratorSettings gridded = generator;
+    gridded.distribution = DISTRIBUTION_GRID;
+    gridded.sphereFraction = 1.0f;
+    std::vector<std::string> synthetic = sceneGenerator::writeScenes(outFile, "sphere", spheres, gridded);
+    gridded.sphereFraction = 0.0f;
+    std::vector<std::string> generated = sceneGenerator::writeScenes(outFile, "cube", cubes, gridded);
+    synthetic.insert(synthetic.end(), generated.begin(), generated.end());
+    generated = sceneGenerator::writeScenes(outFile, "synthetic", objects, generator);
+    synthetic.insert(synthetic.end(), generated.begin(), generated.end());
+    if (synthetic.size() != spheres.size() + cubes.size() + objects.size()) {
+        printf("kernel_benchmark: cannot write synthetic scenes next to %s\n", outFile.c_str());
+        sceneGenerator::removeScenes(synthetic);
+        return 1;
+    }
+    sceneFiles.insert(sceneFiles.end(), synthetic.begin(), synthetic.end());
+    if (sceneFiles.empty() && packetTests == 0 && captureFiles.empty()) {
+        printf("kernel_benchmark: no scene files, synthetic scenes, --cpu-packets or --replay given\n");
+        return 1;
+    }
+
+    std::vector<SceneResult> results;
+    for (size_t i = 0; i < sceneFiles.size(); i++) {
+        benchmarkScene(sceneFiles[i], settings, results);
+        if (settings.compareL2) {
+            pathtraceUseL2Persistence(false);
+            benchmarkScene(sceneFiles[i], settings, results);
+            pathtraceUseL2Persistence(true);
+        }
+    }
+    sceneGenerator::removeScenes(synthetic);
+    for (size_t i = 0; i < captureFiles.size(); i++) {
+        if (!benchmarkReplay(captureFiles[i], settings, results)) {
+            return 1;
+        }
+    }
+    std::vector<PacketResult> packets;
+    if (packetTests > 0) {
+        benchmarkPackets(packetTests, settings, packets);
+    }
+
+    FILE *out = fopen(outFile.c_str(), "w");
+    if (out == NULL) {
+        printf("kernel_benchmark: cannot open %s\n", outFile.c_str());
+        return 1;
+    }
+    bool csv = outFile.size() >= 4 && outFile.compare(outFile.size() - 4, 4, ".csv") == 0;
+    if (csv) {
+        writeCsv(out, settings, results, packets);
+    } else {
+        writeJson(out, settings, results, packets);
+    }
+    fclose(out);
+
+    int regressions = 0;
+    if (!compareFile.empty()) {
+        regressions = compareBaseline(readBaseline(compareFile), against, settings, results);
+    }
+    if (!baselineFile.empty() && !appendBaseline(baselineFile, settings, results)) {
+        printf("kernel_benchmark: cannot write %s\n", baselineFile.c_str());
+        return 1;
+    }
+    return regressions > 0 ? 2 : 0;
+}
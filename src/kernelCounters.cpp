@@ -0,0 +1,503 @@
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "kernelCounters.h"
+
+#ifdef ENABLE_CUPTI
+#include <cuda.h>
+#include <cupti_profiler_target.h>
+#include <cupti_target.h>
+#include <nvperf_cuda_host.h>
+#include <nvperf_host.h>
+#include <nvperf_target.h>
+#endif
+
+using kernelCounters::KernelReport;
+
+static std::vector<KernelReport> lastReport;
+
+#ifdef ENABLE_CUPTI
+
+// Evaluated for every range, in this order
+enum CounterMetric {
+    METRIC_DURATION,
+    METRIC_OCCUPANCY,
+    METRIC_DRAM_PERCENT,
+    METRIC_DRAM_BYTES,
+    METRIC_L2_HIT_RATE,
+    METRIC_THREADS_PER_INSTRUCTION,
+    METRIC_SM_PERCENT,
+    METRIC_COUNT,
+};
+
+static const char *METRIC_NAMES[METRIC_COUNT] = {
+    "gpu__time_duration.sum",
+    "sm__warps_active.avg.pct_of_peak_sustained_active",
+    "dram__throughput.avg.pct_of_peak_sustained_elapsed",
+    "dram__bytes.sum",
+    "lts__t_sector_hit_rate.pct",
+    "smsp__thread_inst_executed_per_inst_executed.ratio",
+    "sm__throughput.avg.pct_of_peak_sustained_elapsed",
+};
+
+static bool initialized = false;
+static bool sessionOpen = false;
+static int launchesLeft = 0;        // of the window; 0 while none runs
+static std::string chipName;
+static std::vector<uint8_t> configImage;
+static std::vector<uint8_t> counterDataPrefix;
+static std::vector<uint8_t> counterDataImage;
+static std::vector<uint8_t> counterDataScratch;
+
+static bool cuptiOk(CUptiResult result, const char *call) {
+    if (result != CUPTI_SUCCESS) {
+        const char *message = "";
+        cuptiGetResultString(result, &message);
+        printf("--kernel-counters: %s failed: %s\n", call, message);
+        return false;
+    }
+    return true;
+}
+
+static bool nvpwOk(NVPA_Status status, const char *call) {
+    if (status != NVPA_STATUS_SUCCESS) {
+        printf("--kernel-counters: %s failed: %d\n", call, (int)status);
+        return false;
+    }
+    return true;
+}
+
+// A metrics evaluator for the chip, over `counterData` once there is some
+static NVPW_MetricsEvaluator *createEvaluator(std::vector<uint8_t> &scratch, const uint8_t *counterData,
+        size_t counterDataSize) {
+    NVPW_CUDA_MetricsEvaluator_CalculateScratchBufferSize_Params sizeParams = {
+        NVPW_CUDA_MetricsEvaluator_CalculateScratchBufferSize_Params_STRUCT_SIZE };
+    sizeParams.pChipName = chipName.c_str();
+    if (!nvpwOk(NVPW_CUDA_MetricsEvaluator_CalculateScratchBufferSize(&sizeParams),
+            "NVPW_CUDA_MetricsEvaluator_CalculateScratchBufferSize")) {
+        return NULL;
+    }
+    scratch.resize(sizeParams.scratchBufferSize);
+    NVPW_CUDA_MetricsEvaluator_Initialize_Params initParams = {
+        NVPW_CUDA_MetricsEvaluator_Initialize_Params_STRUCT_SIZE };
+    initParams.scratchBufferSize = scratch.size();
+    initParams.pScratchBuffer = scratch.data();
+    if (counterData != NULL) {
+        initParams.pCounterDataImage = counterData;
+        initParams.counterDataImageSize = counterDataSize;
+    } else {
+        initParams.pChipName = chipName.c_str();
+    }
+    if (!nvpwOk(NVPW_CUDA_MetricsEvaluator_Initialize(&initParams), "NVPW_CUDA_MetricsEvaluator_Initialize")) {
+        return NULL;
+    }
+    return initParams.pMetricsEvaluator;
+}
+
+static void destroyEvaluator(NVPW_MetricsEvaluator *evaluator) {
+    NVPW_MetricsEvaluator_Destroy_Params params = { NVPW_MetricsEvaluator_Destroy_Params_STRUCT_SIZE };
+    params.pMetricsEvaluator = evaluator;
+    NVPW_MetricsEvaluator_Destroy(&params);
+}
+
+static bool evalRequest(NVPW_MetricsEvaluator *evaluator, const char *metric, NVPW_MetricEvalRequest &request) {
+    NVPW_MetricsEvaluator_ConvertMetricNameToMetricEvalRequest_Params params = {
+        NVPW_MetricsEvaluator_ConvertMetricNameToMetricEvalRequest_Params_STRUCT_SIZE };
+    params.pMetricsEvaluator = evaluator;
+    params.pMetricName = metric;
+    params.pMetricEvalRequest = &request;
+    params.metricEvalRequestStructSize = NVPW_MetricEvalRequest_STRUCT_SIZE;
+    return nvpwOk(NVPW_MetricsEvaluator_ConvertMetricNameToMetricEvalRequest(&params), metric);
+}
+
+// The raw counters the metrics are computed from
+static bool rawMetricNames(std::vector<std::string> &names) {
+    std::vector<uint8_t> scratch;
+    NVPW_MetricsEvaluator *evaluator = createEvaluator(scratch, NULL, 0);
+    if (evaluator == NULL) {
+        return false;
+    }
+    bool ok = true;
+    for (int metric = 0; metric < METRIC_COUNT && ok; metric++) {
+        NVPW_MetricEvalRequest request;
+        ok = evalRequest(evaluator, METRIC_NAMES[metric], request);
+        NVPW_MetricsEvaluator_GetMetricRawDependencies_Params params = {
+            NVPW_MetricsEvaluator_GetMetricRawDependencies_Params_STRUCT_SIZE };
+        params.pMetricsEvaluator = evaluator;
+        params.pMetricEvalRequests = &request;
+        params.numMetricEvalRequests = 1;
+        params.metricEvalRequestStructSize = NVPW_MetricEvalRequest_STRUCT_SIZE;
+        params.metricEvalRequestStrideSize = sizeof(NVPW_MetricEvalRequest);
+        ok = ok && nvpwOk(NVPW_MetricsEvaluator_GetMetricRawDependencies(&params),
+            "NVPW_MetricsEvaluator_GetMetricRawDependencies");
+        std::vector<const char *> dependencies(params.numRawDependencies);
+        params.ppRawDependencies = dependencies.data();
+        ok = ok && nvpwOk(NVPW_MetricsEvaluator_GetMetricRawDependencies(&params),
+            "NVPW_MetricsEvaluator_GetMetricRawDependencies");
+        for (size_t i = 0; ok && i < dependencies.size(); i++) {
+            if (std::find(names.begin(), names.end(), dependencies[i]) == names.end()) {
+                names.push_back(dependencies[i]);
+            }
+        }
+    }
+    destroyEvaluator(evaluator);
+    return ok;
+}
+
+// The profiler's configuration image and the counter data prefix for the metrics
+static bool buildImages() {
+    std::vector<std::string> names;
+    if (!rawMetricNames(names)) {
+        return false;
+    }
+    std::vector<NVPA_RawMetricRequest> requests;
+    for (size_t i = 0; i < names.size(); i++) {
+        NVPA_RawMetricRequest request = { NVPA_RAW_METRIC_REQUEST_STRUCT_SIZE };
+        request.pMetricName = names[i].c_str();
+        request.isolated = true;
+        request.keepInstances = true;
+        requests.push_back(request);
+    }
+
+    NVPW_CUDA_RawMetricsConfig_Create_V2_Params createParams = { NVPW_CUDA_RawMetricsConfig_Create_V2_Params_STRUCT_SIZE };
+    createParams.activityKind = NVPA_ACTIVITY_KIND_PROFILER;
+    createParams.pChipName = chipName.c_str();
+    if (!nvpwOk(NVPW_CUDA_RawMetricsConfig_Create_V2(&createParams), "NVPW_CUDA_RawMetricsConfig_Create_V2")) {
+        return false;
+    }
+    NVPA_RawMetricsConfig *config = createParams.pRawMetricsConfig;
+    NVPW_RawMetricsConfig_BeginPassGroup_Params beginParams = { NVPW_RawMetricsConfig_BeginPassGroup_Params_STRUCT_SIZE };
+    beginParams.pRawMetricsConfig = config;
+    NVPW_RawMetricsConfig_AddMetrics_Params addParams = { NVPW_RawMetricsConfig_AddMetrics_Params_STRUCT_SIZE };
+    addParams.pRawMetricsConfig = config;
+    addParams.pRawMetricRequests = requests.data();
+    addParams.numMetricRequests = requests.size();
+    NVPW_RawMetricsConfig_EndPassGroup_Params endParams = { NVPW_RawMetricsConfig_EndPassGroup_Params_STRUCT_SIZE };
+    endParams.pRawMetricsConfig = config;
+    NVPW_RawMetricsConfig_GenerateConfigImage_Params generateParams = {
+        NVPW_RawMetricsConfig_GenerateConfigImage_Params_STRUCT_SIZE };
+    generateParams.pRawMetricsConfig = config;
+    NVPW_RawMetricsConfig_GetConfigImage_Params imageParams = { NVPW_RawMetricsConfig_GetConfigImage_Params_STRUCT_SIZE };
+    imageParams.pRawMetricsConfig = config;
+    bool ok = nvpwOk(NVPW_RawMetricsConfig_BeginPassGroup(&beginParams), "NVPW_RawMetricsConfig_BeginPassGroup")
+        && nvpwOk(NVPW_RawMetricsConfig_AddMetrics(&addParams), "NVPW_RawMetricsConfig_AddMetrics")
+        && nvpwOk(NVPW_RawMetricsConfig_EndPassGroup(&endParams), "NVPW_RawMetricsConfig_EndPassGroup")
+        && nvpwOk(NVPW_RawMetricsConfig_GenerateConfigImage(&generateParams),
+            "NVPW_RawMetricsConfig_GenerateConfigImage")
+        && nvpwOk(NVPW_RawMetricsConfig_GetConfigImage(&imageParams), "NVPW_RawMetricsConfig_GetConfigImage");
+    if (ok) {
+        configImage.resize(imageParams.bytesCopied);
+        imageParams.bytesAllocated = configImage.size();
+        imageParams.pBuffer = configImage.data();
+        ok = nvpwOk(NVPW_RawMetricsConfig_GetConfigImage(&imageParams), "NVPW_RawMetricsConfig_GetConfigImage");
+    }
+    NVPW_RawMetricsConfig_Destroy_Params destroyConfig = { NVPW_RawMetricsConfig_Destroy_Params_STRUCT_SIZE };
+    destroyConfig.pRawMetricsConfig = config;
+    NVPW_RawMetricsConfig_Destroy(&destroyConfig);
+    if (!ok) {
+        return false;
+    }
+
+    NVPW_CUDA_CounterDataBuilder_Create_Params builderParams = { NVPW_CUDA_CounterDataBuilder_Create_Params_STRUCT_SIZE };
+    builderParams.pChipName = chipName.c_str();
+    if (!nvpwOk(NVPW_CUDA_CounterDataBuilder_Create(&builderParams), "NVPW_CUDA_CounterDataBuilder_Create")) {
+        return false;
+    }
+    NVPW_CounterDataBuilder_AddMetrics_Params builderAdd = { NVPW_CounterDataBuilder_AddMetrics_Params_STRUCT_SIZE };
+    builderAdd.pCounterDataBuilder = builderParams.pCounterDataBuilder;
+    builderAdd.pRawMetricRequests = requests.data();
+    builderAdd.numMetricRequests = requests.size();
+    NVPW_CounterDataBuilder_GetCounterDataPrefix_Params prefixParams = {
+        NVPW_CounterDataBuilder_GetCounterDataPrefix_Params_STRUCT_SIZE };
+    prefixParams.pCounterDataBuilder = builderParams.pCounterDataBuilder;
+    ok = nvpwOk(NVPW_CounterDataBuilder_AddMetrics(&builderAdd), "NVPW_CounterDataBuilder_AddMetrics")
+        && nvpwOk(NVPW_CounterDataBuilder_GetCounterDataPrefix(&prefixParams),
+            "NVPW_CounterDataBuilder_GetCounterDataPrefix");
+    if (ok) {
+        counterDataPrefix.resize(prefixParams.bytesCopied);
+        prefixParams.bytesAllocated = counterDataPrefix.size();
+        prefixParams.pBuffer = counterDataPrefix.data();
+        ok = nvpwOk(NVPW_CounterDataBuilder_GetCounterDataPrefix(&prefixParams),
+            "NVPW_CounterDataBuilder_GetCounterDataPrefix");
+    }
+    NVPW_CounterDataBuilder_Destroy_Params destroyBuilder = { NVPW_CounterDataBuilder_Destroy_Params_STRUCT_SIZE };
+    destroyBuilder.pCounterDataBuilder = builderParams.pCounterDataBuilder;
+    NVPW_CounterDataBuilder_Destroy(&destroyBuilder);
+    return ok;
+}
+
+// Once per process, on the current context's device
+static bool initialize() {
+    if (initialized) {
+        return true;
+    }
+    CUpti_Profiler_Initialize_Params profilerParams = { CUpti_Profiler_Initialize_Params_STRUCT_SIZE };
+    NVPW_InitializeHost_Params hostParams = { NVPW_InitializeHost_Params_STRUCT_SIZE };
+    if (!cuptiOk(cuptiProfilerInitialize(&profilerParams), "cuptiProfilerInitialize")
+            || !nvpwOk(NVPW_InitializeHost(&hostParams), "NVPW_InitializeHost")) {
+        return false;
+    }
+    CUdevice device;
+    cuCtxGetDevice(&device);
+    CUpti_Device_GetChipName_Params chipParams = { CUpti_Device_GetChipName_Params_STRUCT_SIZE };
+    chipParams.deviceIndex = (size_t)device;
+    if (!cuptiOk(cuptiDeviceGetChipName(&chipParams), "cuptiDeviceGetChipName")) {
+        return false;
+    }
+    chipName = chipParams.pChipName;
+    initialized = buildImages();
+    return initialized;
+}
+
+// A fresh counter data image and scratch for up to KERNEL_COUNTERS_MAX_RANGES ranges
+static bool prepareCounterData() {
+    CUpti_Profiler_CounterDataImageOptions options;
+    options.pCounterDataPrefix = counterDataPrefix.data();
+    options.counterDataPrefixSize = counterDataPrefix.size();
+    options.maxNumRanges = KERNEL_COUNTERS_MAX_RANGES;
+    options.maxNumRangeTreeNodes = KERNEL_COUNTERS_MAX_RANGES;
+    options.maxRangeNameLength = 256;
+
+    CUpti_Profiler_CounterDataImage_CalculateSize_Params sizeParams = {
+        CUpti_Profiler_CounterDataImage_CalculateSize_Params_STRUCT_SIZE };
+    sizeParams.pOptions = &options;
+    sizeParams.sizeofCounterDataImageOptions = CUpti_Profiler_CounterDataImageOptions_STRUCT_SIZE;
+    if (!cuptiOk(cuptiProfilerCounterDataImageCalculateSize(&sizeParams), "cuptiProfilerCounterDataImageCalculateSize")) {
+        return false;
+    }
+    counterDataImage.assign(sizeParams.counterDataImageSize, 0);
+    CUpti_Profiler_CounterDataImage_Initialize_Params initParams = {
+        CUpti_Profiler_CounterDataImage_Initialize_Params_STRUCT_SIZE };
+    initParams.sizeofCounterDataImageOptions = CUpti_Profiler_CounterDataImageOptions_STRUCT_SIZE;
+    initParams.pOptions = &options;
+    initParams.counterDataImageSize = counterDataImage.size();
+    initParams.pCounterDataImage = counterDataImage.data();
+    if (!cuptiOk(cuptiProfilerCounterDataImageInitialize(&initParams), "cuptiProfilerCounterDataImageInitialize")) {
+        return false;
+    }
+
+    CUpti_Profiler_CounterDataImage_CalculateScratchBufferSize_Params scratchSize = {
+        CUpti_Profiler_CounterDataImage_CalculateScratchBufferSize_Params_STRUCT_SIZE };
+    scratchSize.counterDataImageSize = counterDataImage.size();
+    scratchSize.pCounterDataImage = counterDataImage.data();
+    if (!cuptiOk(cuptiProfilerCounterDataImageCalculateScratchBufferSize(&scratchSize),
+            "cuptiProfilerCounterDataImageCalculateScratchBufferSize")) {
+        return false;
+    }
+    counterDataScratch.assign(scratchSize.counterDataScratchBufferSize, 0);
+    CUpti_Profiler_CounterDataImage_InitializeScratchBuffer_Params scratchParams = {
+        CUpti_Profiler_CounterDataImage_InitializeScratchBuffer_Params_STRUCT_SIZE };
+    scratchParams.counterDataImageSize = counterDataImage.size();
+    scratchParams.pCounterDataImage = counterDataImage.data();
+    scratchParams.counterDataScratchBufferSize = counterDataScratch.size();
+    scratchParams.pCounterDataScratchBuffer = counterDataScratch.data();
+    return cuptiOk(cuptiProfilerCounterDataImageInitializeScratchBuffer(&scratchParams),
+        "cuptiProfilerCounterDataImageInitializeScratchBuffer");
+}
+
+// Opens a session with every kernel its own range, replayed until all counters are read
+static bool openSession() {
+    if (!initialize() || !prepareCounterData()) {
+        return false;
+    }
+    CUpti_Profiler_BeginSession_Params beginParams = { CUpti_Profiler_BeginSession_Params_STRUCT_SIZE };
+    beginParams.ctx = NULL;
+    beginParams.counterDataImageSize = counterDataImage.size();
+    beginParams.pCounterDataImage = counterDataImage.data();
+    beginParams.counterDataScratchBufferSize = counterDataScratch.size();
+    beginParams.pCounterDataScratchBuffer = counterDataScratch.data();
+    beginParams.range = CUPTI_AutoRange;
+    beginParams.replayMode = CUPTI_KernelReplay;
+    beginParams.maxRangesPerPass = KERNEL_COUNTERS_MAX_RANGES;
+    beginParams.maxLaunchesPerPass = KERNEL_COUNTERS_MAX_RANGES;
+    if (!cuptiOk(cuptiProfilerBeginSession(&beginParams), "cuptiProfilerBeginSession")) {
+        return false;
+    }
+    CUpti_Profiler_SetConfig_Params configParams = { CUpti_Profiler_SetConfig_Params_STRUCT_SIZE };
+    configParams.pConfig = configImage.data();
+    configParams.configSize = configImage.size();
+    configParams.passIndex = 0;
+    configParams.minNestingLevel = 1;
+    configParams.numNestingLevels = 1;
+    CUpti_Profiler_EnableProfiling_Params enableParams = { CUpti_Profiler_EnableProfiling_Params_STRUCT_SIZE };
+    if (!cuptiOk(cuptiProfilerSetConfig(&configParams), "cuptiProfilerSetConfig")
+            || !cuptiOk(cuptiProfilerEnableProfiling(&enableParams), "cuptiProfilerEnableProfiling")) {
+        CUpti_Profiler_EndSession_Params endParams = { CUpti_Profiler_EndSession_Params_STRUCT_SIZE };
+        cuptiProfilerEndSession(&endParams);
+        return false;
+    }
+    sessionOpen = true;
+    return true;
+}
+
+static void closeSession() {
+    CUpti_Profiler_DisableProfiling_Params disableParams = { CUpti_Profiler_DisableProfiling_Params_STRUCT_SIZE };
+    CUpti_Profiler_UnsetConfig_Params unsetParams = { CUpti_Profiler_UnsetConfig_Params_STRUCT_SIZE };
+    CUpti_Profiler_EndSession_Params endParams = { CUpti_Profiler_EndSession_Params_STRUCT_SIZE };
+    cuptiOk(cuptiProfilerDisableProfiling(&disableParams), "cuptiProfilerDisableProfiling");
+    cuptiOk(cuptiProfilerUnsetConfig(&unsetParams), "cuptiProfilerUnsetConfig");
+    cuptiOk(cuptiProfilerEndSession(&endParams), "cuptiProfilerEndSession");
+    sessionOpen = false;
+}
+
+// Folds every range of the counter data into one KernelReport per kernel name
+static void evaluateReport() {
+    lastReport.clear();
+    std::vector<uint8_t> scratch;
+    NVPW_MetricsEvaluator *evaluator = createEvaluator(scratch, counterDataImage.data(), counterDataImage.size());
+    if (evaluator == NULL) {
+        return;
+    }
+    NVPW_MetricEvalRequest requests[METRIC_COUNT];
+    bool ok = true;
+    for (int metric = 0; metric < METRIC_COUNT && ok; metric++) {
+        ok = evalRequest(evaluator, METRIC_NAMES[metric], requests[metric]);
+    }
+    NVPW_MetricsEvaluator_SetDeviceAttributes_Params attributeParams = {
+        NVPW_MetricsEvaluator_SetDeviceAttributes_Params_STRUCT_SIZE };
+    attributeParams.pMetricsEvaluator = evaluator;
+    attributeParams.pCounterDataImage = counterDataImage.data();
+    attributeParams.counterDataImageSize = counterDataImage.size();
+    ok = ok && nvpwOk(NVPW_MetricsEvaluator_SetDeviceAttributes(&attributeParams),
+        "NVPW_MetricsEvaluator_SetDeviceAttributes");
+    NVPW_CounterData_GetNumRanges_Params rangesParams = { NVPW_CounterData_GetNumRanges_Params_STRUCT_SIZE };
+    rangesParams.pCounterDataImage = counterDataImage.data();
+    ok = ok && nvpwOk(NVPW_CounterData_GetNumRanges(&rangesParams), "NVPW_CounterData_GetNumRanges");
+
+    // Percentages are summed weighted by time, and divided by it at the end
+    std::map<std::string, KernelReport> kernels;
+    for (size_t range = 0; ok && range < rangesParams.numRanges; range++) {
+        NVPW_Profiler_CounterData_GetRangeDescriptions_Params descriptionParams = {
+            NVPW_Profiler_CounterData_GetRangeDescriptions_Params_STRUCT_SIZE };
+        descriptionParams.pCounterDataImage = counterDataImage.data();
+        descriptionParams.rangeIndex = range;
+        ok = nvpwOk(NVPW_Profiler_CounterData_GetRangeDescriptions(&descriptionParams),
+            "NVPW_Profiler_CounterData_GetRangeDescriptions");
+        std::vector<const char *> descriptions(descriptionParams.numDescriptions);
+        descriptionParams.ppDescriptions = descriptions.data();
+        ok = ok && nvpwOk(NVPW_Profiler_CounterData_GetRangeDescriptions(&descriptionParams),
+            "NVPW_Profiler_CounterData_GetRangeDescriptions");
+
+        double values[METRIC_COUNT];
+        NVPW_MetricsEvaluator_EvaluateToGpuValues_Params evaluateParams = {
+            NVPW_MetricsEvaluator_EvaluateToGpuValues_Params_STRUCT_SIZE };
+        evaluateParams.pMetricsEvaluator = evaluator;
+        evaluateParams.pMetricEvalRequests = requests;
+        evaluateParams.numMetricEvalRequests = METRIC_COUNT;
+        evaluateParams.metricEvalRequestStructSize = NVPW_MetricEvalRequest_STRUCT_SIZE;
+        evaluateParams.metricEvalRequestStrideSize = sizeof(NVPW_MetricEvalRequest);
+        evaluateParams.pCounterDataImage = counterDataImage.data();
+        evaluateParams.counterDataImageSize = counterDataImage.size();
+        evaluateParams.rangeIndex = range;
+        evaluateParams.isolated = true;
+        evaluateParams.pMetricValues = values;
+        ok = ok && nvpwOk(NVPW_MetricsEvaluator_EvaluateToGpuValues(&evaluateParams),
+            "NVPW_MetricsEvaluator_EvaluateToGpuValues");
+        if (!ok || descriptions.empty()) {
+            continue;
+        }
+
+        KernelReport &kernel = kernels[descriptions[0]];
+        const double ms = values[METRIC_DURATION] * 1e-6;
+        kernel.launches++;
+        kernel.ms += ms;
+        kernel.occupancy += (float)(values[METRIC_OCCUPANCY] * ms);
+        kernel.dramPercent += (float)(values[METRIC_DRAM_PERCENT] * ms);
+        kernel.dramBytes += values[METRIC_DRAM_BYTES];
+        kernel.l2HitRate += (float)(values[METRIC_L2_HIT_RATE] * ms);
+        kernel.warpEfficiency += (float)(values[METRIC_THREADS_PER_INSTRUCTION] / 32.0 * 100.0 * ms);
+        kernel.smPercent += (float)(values[METRIC_SM_PERCENT] * ms);
+    }
+    destroyEvaluator(evaluator);
+
+    for (std::map<std::string, KernelReport>::iterator it = kernels.begin(); it != kernels.end(); ++it) {
+        KernelReport kernel = it->second;
+        kernel.name = it->first;
+        const float weight = kernel.ms > 0.0 ? (float)(1.0 / kernel.ms) : 0.0f;
+        kernel.occupancy *= weight;
+        kernel.dramPercent *= weight;
+        kernel.l2HitRate *= weight;
+        kernel.warpEfficiency *= weight;
+        kernel.smPercent *= weight;
+        kernel.bound = std::max(kernel.dramPercent, kernel.smPercent) < KERNEL_COUNTERS_BOUND_PERCENT ? "latency"
+            : kernel.dramPercent > kernel.smPercent ? "memory" : "compute";
+        lastReport.push_back(kernel);
+    }
+    std::sort(lastReport.begin(), lastReport.end(), [](const KernelReport &a, const KernelReport &b) {
+        return a.ms > b.ms;
+    });
+}
+
+bool kernelCounters::available() {
+    return true;
+}
+
+bool kernelCounters::start(int launches) {
+    if (launchesLeft > 0 || launches < 1) {
+        return false;
+    }
+    launchesLeft = launches;
+    return true;
+}
+
+bool kernelCounters::collecting() {
+    return launchesLeft > 0;
+}
+
+void kernelCounters::beginLaunch() {
+    if (launchesLeft > 0 && !sessionOpen && !openSession()) {
+        launchesLeft = 0;
+    }
+}
+
+void kernelCounters::endLaunch() {
+    if (!sessionOpen || --launchesLeft > 0) {
+        return;
+    }
+    // The denoising and display work queued after the last launch is left out
+    cuCtxSynchronize();
+    closeSession();
+    evaluateReport();
+    print();
+}
+
+#else
+
+bool kernelCounters::available() {
+    return false;
+}
+
+bool kernelCounters::start(int) {
+    return false;
+}
+
+bool kernelCounters::collecting() {
+    return false;
+}
+
+void kernelCounters::beginLaunch() {
+}
+
+void kernelCounters::endLaunch() {
+}
+
+#endif
+
+const std::vector<KernelReport> &kernelCounters::report() {
+    return lastReport;
+}
+
+void kernelCounters::print() {
+    printf("%-40s %8s %10s %6s %6s %9s %6s %6s %6s  %s\n", "kernel", "launches", "ms", "occ%", "dram%",
+        "dram MiB", "l2hit%", "warp%", "sm%", "bound");
+    for (size_t i = 0; i < lastReport.size(); i++) {
+        const KernelReport &kernel = lastReport[i];
+        printf("%-40.40s %8d %10.3f %6.1f %6.1f %9.1f %6.1f %6.1f %6.1f  %s\n", kernel.name.c_str(),
+            kernel.launches, kernel.ms, kernel.occupancy, kernel.dramPercent,
+            kernel.dramBytes / (1024.0 * 1024.0), kernel.l2HitRate, kernel.warpEfficiency, kernel.smPercent,
+            kernel.bound);
+    }
+}
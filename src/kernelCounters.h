@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Kernel launches one window records at most; later ones go unmeasured
+#define KERNEL_COUNTERS_MAX_RANGES 4096
+// Below this share of both the DRAM and the SM peak a kernel is latency bound
+#define KERNEL_COUNTERS_BOUND_PERCENT 60.0f
+
+/**
+ * Hardware counters per kernel from CUPTI's profiling API, in builds with
+ * ENABLE_CUPTI, collected over a window of launches started with
+ *
+ *     --kernel-counters LAUNCHES
+ *
+ * or the Stats pane's button. Everything the primary GPU runs during the
+ * window's pathtrace() launches and the denoising and display work between
+ * them is replayed kernel by kernel until all counters are read, so the
+ * window renders many times slower than usual; other GPUs go unmeasured.
+ * No external profiler is needed, but the driver must allow counter access
+ * to the user (or run as root).
+ *
+ * Each kernel name then gets, over its launches, its summed GPU time, and
+ * time-weighted: achieved occupancy, DRAM throughput, L2 hit rate, warp
+ * execution efficiency and SM throughput. The roofline-style verdict puts
+ * it against the GPU's peaks: memory bound when DRAM throughput is the
+ * larger share of its peak, compute bound when SM throughput is, and
+ * latency bound when neither reaches KERNEL_COUNTERS_BOUND_PERCENT.
+ */
+namespace kernelCounters {
+    struct KernelReport {
+        std::string name;
+        int launches;
+        double ms;              // summed GPU time
+        float occupancy;        // achieved, % of the SM's warp slots
+        float dramPercent;      // DRAM throughput, % of peak
+        double dramBytes;       // summed
+        float l2HitRate;        // % of L2 sectors hit
+        float warpEfficiency;   // active threads per warp instruction, % of 32
+        float smPercent;        // SM throughput, % of peak
+        const char *bound;      // "memory", "compute" or "latency"
+    };
+
+    // Whether the build has CUPTI
+    bool available();
+
+    // Measures the next `launches` launches; false without CUPTI or while a window runs
+    bool start(int launches);
+
+    // Whether a window is started and not yet reported
+    bool collecting();
+
+    // Around each pathtrace() call, as autotune's hooks are
+    void beginLaunch();
+    void endLaunch();
+
+    // The last finished window, slowest kernel first
+    const std::vector<KernelReport> &report();
+
+    // Prints report() to stdout
+    void print();
+}
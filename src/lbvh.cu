@@ -0,0 +1,467 @@
+#include <algorithm>
+#include <cfloat>
+#include <cuda.h>
+#include <glm/glm.hpp>
+
+#include "lbvh.h"
+#include "deviceMemory.h"
+#include "../stream_compaction/common.h"
+#include "../stream_compaction/radix.h"
+
+namespace LBVH {
+
+#define LBVH_BLOCK_SIZE 256
+// Blocks of the first scene-bounds reduction pass; the second pass is one block
+#define LBVH_REDUCE_BLOCKS 256
+#define MORTON_BITS 30
+
+/*
+ * Nodes are built in Karras order, interior nodes 0..n-2 followed by leaves
+ * n-1..2n-2, and only placed in depth-first order as they are written out.
+ * A node covering geoms [first, last] sits at 2 * first plus the number of
+ * left-child steps on its path from the root: every right step skips over
+ * its left sibling's 2k - 1 nodes and the step itself.
+ */
+static unsigned int *dev_keys = NULL;
+static AABB *dev_geomBounds = NULL;
+static AABB *dev_nodeBounds = NULL;     // per Karras node, for the bottom-up pass
+static AABB *dev_partialBounds = NULL;  // per reduction block, then the scene's at [0]
+static int *dev_parents = NULL;         // Karras node's parent, -1 for the root
+static int *dev_firsts = NULL;          // first geom under the Karras node
+static int *dev_positions = NULL;       // depth-first index of the Karras node
+static int2 *dev_children = NULL;       // Karras nodes of each interior node
+static int *dev_visits = NULL;          // children done, per interior node
+static float *dev_cost = NULL;          // sahCost's sum
+static int scratchCapacity = 0;
+
+void freeScratch() {
+    deviceMemory::release(dev_keys);
+    deviceMemory::release(dev_geomBounds);
+    deviceMemory::release(dev_nodeBounds);
+    deviceMemory::release(dev_partialBounds);
+    deviceMemory::release(dev_parents);
+    deviceMemory::release(dev_firsts);
+    deviceMemory::release(dev_positions);
+    deviceMemory::release(dev_children);
+    deviceMemory::release(dev_visits);
+    deviceMemory::release(dev_cost);
+    dev_keys = NULL;
+    dev_geomBounds = NULL;
+    dev_nodeBounds = NULL;
+    dev_partialBounds = NULL;
+    dev_parents = NULL;
+    dev_firsts = NULL;
+    dev_positions = NULL;
+    dev_children = NULL;
+    dev_visits = NULL;
+    dev_cost = NULL;
+    scratchCapacity = 0;
+    StreamCompaction::Radix::freeScratch();
+}
+
+static void initScratch(int n) {
+    if (n <= scratchCapacity) {
+        return;
+    }
+    freeScratch();
+    const int nodes = nodeCount(n);
+    deviceMemory::allocate(&dev_keys, n * sizeof(unsigned int));
+    deviceMemory::allocate(&dev_geomBounds, n * sizeof(AABB));
+    deviceMemory::allocate(&dev_nodeBounds, nodes * sizeof(AABB));
+    deviceMemory::allocate(&dev_partialBounds, LBVH_REDUCE_BLOCKS * sizeof(AABB));
+    deviceMemory::allocate(&dev_parents, nodes * sizeof(int));
+    deviceMemory::allocate(&dev_firsts, nodes * sizeof(int));
+    deviceMemory::allocate(&dev_positions, nodes * sizeof(int));
+    deviceMemory::allocate(&dev_children, n * sizeof(int2));
+    deviceMemory::allocate(&dev_visits, n * sizeof(int));
+    deviceMemory::allocate(&dev_cost, sizeof(float));
+    scratchCapacity = n;
+    checkCUDAError("lbvh initScratch");
+}
+
+static int blocksFor(int n) {
+    return StreamCompaction::Common::blocksFor(n, LBVH_BLOCK_SIZE);
+}
+
+/**
+ * World-space box of a geom, from the object-space box through the forward
+ * transform (the inverse of the stored world-to-object rows): the centre
+ * maps through it and the half extent through its absolute value.
+ */
+__device__ AABB worldBounds(const DeviceGeom &geom, const Mesh *meshes, const BVHNode *meshNodes,
+        const SphereCloud *clouds, const BVHNode *cloudNodes, const SdfVolume *sdfs) {
+    AABB box;
+    if (geom.type == UNIFORM_SPHERE) {
+        glm::vec3 centre(geom.inverseRows[0]);
+        float radius = geom.inverseRows[0].w;
+        box.min = centre - radius;
+        box.max = centre + radius;
+        return box;
+    }
+
+    glm::vec3 objectMin(-0.5f);
+    glm::vec3 objectMax(0.5f);
+    if (geom.type == MESH) {
+        const BVHNode root = meshNodes[meshes[geom.meshid].bvhRoot];
+        objectMin = root.bboxMin;
+        objectMax = root.bboxMax;
+    } else if (geom.type == SPHERE_CLOUD) {
+        const BVHNode root = cloudNodes[clouds[geom.meshid].bvhRoot];
+        objectMin = root.bboxMin;
+        objectMax = root.bboxMax;
+    } else if (geom.type == SDF_VOLUME) {
+        objectMin = sdfs[geom.meshid].boundsMin;
+        objectMax = sdfs[geom.meshid].boundsMax;
+    }
+
+    // glm matrices are column-major, so the rows go in transposed
+    glm::mat3 inverse = glm::transpose(glm::mat3(glm::vec3(geom.inverseRows[0]),
+        glm::vec3(geom.inverseRows[1]), glm::vec3(geom.inverseRows[2])));
+    glm::vec3 inverseOffset(geom.inverseRows[0].w, geom.inverseRows[1].w, geom.inverseRows[2].w);
+    glm::mat3 forward = glm::inverse(inverse);
+    glm::mat3 absForward(glm::abs(forward[0]), glm::abs(forward[1]), glm::abs(forward[2]));
+
+    glm::vec3 centre = forward * (0.5f * (objectMin + objectMax) - inverseOffset);
+    glm::vec3 extent = absForward * (0.5f * (objectMax - objectMin));
+    box.min = centre - extent;
+    box.max = centre + extent;
+    return box;
+}
+
+__global__ void kernGeomBounds(int n, const DeviceGeom *geoms, const Mesh *meshes,
+        const BVHNode *meshNodes, const SphereCloud *clouds, const BVHNode *cloudNodes, const SdfVolume *sdfs,
+        AABB *bounds) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index < n) {
+        bounds[index] = worldBounds(geoms[index], meshes, meshNodes, clouds, cloudNodes, sdfs);
+    }
+}
+
+// Grid-stride union of the centroids of boxes[0, n), one result per block
+__global__ void kernReduceCentroidBounds(int n, const AABB *boxes, bool centroids, AABB *out) {
+    __shared__ glm::vec3 lows[LBVH_BLOCK_SIZE];
+    __shared__ glm::vec3 highs[LBVH_BLOCK_SIZE];
+    glm::vec3 low(FLT_MAX);
+    glm::vec3 high(-FLT_MAX);
+    for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += blockDim.x * gridDim.x) {
+        glm::vec3 a = centroids ? 0.5f * (boxes[i].min + boxes[i].max) : boxes[i].min;
+        glm::vec3 b = centroids ? a : boxes[i].max;
+        low = glm::min(low, a);
+        high = glm::max(high, b);
+    }
+    lows[threadIdx.x] = low;
+    highs[threadIdx.x] = high;
+    __syncthreads();
+    for (int stride = blockDim.x / 2; stride > 0; stride /= 2) {
+        if (threadIdx.x < stride) {
+            lows[threadIdx.x] = glm::min(lows[threadIdx.x], lows[threadIdx.x + stride]);
+            highs[threadIdx.x] = glm::max(highs[threadIdx.x], highs[threadIdx.x + stride]);
+        }
+        __syncthreads();
+    }
+    if (threadIdx.x == 0) {
+        out[blockIdx.x].min = lows[0];
+        out[blockIdx.x].max = highs[0];
+    }
+}
+
+__global__ void kernMortonCodes(int n, const AABB *bounds, const AABB *sceneBox,
+        unsigned int *keys, int *indices) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index >= n) {
+        return;
+    }
+    const AABB box = *sceneBox;
+    glm::vec3 extent = glm::max(box.max - box.min, glm::vec3(1e-20f));
+    glm::vec3 centroid = 0.5f * (bounds[index].min + bounds[index].max);
+    glm::vec3 unit = glm::clamp((centroid - box.min) / extent, 0.0f, 1.0f);
+    glm::uvec3 cell = glm::uvec3(glm::min(unit * 1024.0f, glm::vec3(1023.0f)));
+    keys[index] = (expandBits(cell.x) << 2) | (expandBits(cell.y) << 1) | expandBits(cell.z);
+    indices[index] = index;
+}
+
+// Length of the common prefix of sorted keys i and j, ties broken by index
+__device__ int commonPrefix(int n, const unsigned int *keys, int i, int j) {
+    if (j < 0 || j >= n) {
+        return -1;
+    }
+    unsigned int a = keys[i];
+    unsigned int b = keys[j];
+    return a == b ? 32 + __clz(i ^ j) : __clz(a ^ b);
+}
+
+/**
+ * Karras's construction for interior node i: the direction of its range
+ * from the neighbouring prefixes, the other end by exponential then binary
+ * search, and the split where the common prefix grows.
+ */
+__global__ void kernBuildHierarchy(int n, const unsigned int *keys, int2 *children,
+        int *parents, int *firsts) {
+    int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (i >= n - 1) {
+        return;
+    }
+    int d = commonPrefix(n, keys, i, i + 1) - commonPrefix(n, keys, i, i - 1) >= 0 ? 1 : -1;
+    int minPrefix = commonPrefix(n, keys, i, i - d);
+
+    int maxLength = 2;
+    while (commonPrefix(n, keys, i, i + maxLength * d) > minPrefix) {
+        maxLength *= 2;
+    }
+    int length = 0;
+    for (int t = maxLength / 2; t >= 1; t /= 2) {
+        if (commonPrefix(n, keys, i, i + (length + t) * d) > minPrefix) {
+            length += t;
+        }
+    }
+    int j = i + length * d;
+
+    int nodePrefix = commonPrefix(n, keys, i, j);
+    int split = 0;
+    for (int divisor = 2, t = (length + 1) / 2; ; divisor *= 2, t = (length + divisor - 1) / divisor) {
+        if (commonPrefix(n, keys, i, i + (split + t) * d) > nodePrefix) {
+            split += t;
+        }
+        if (t <= 1) {
+            break;
+        }
+    }
+    int gamma = i + split * d + (d < 0 ? -1 : 0);
+
+    int first = d > 0 ? i : j;
+    int last = d > 0 ? j : i;
+    int left = first == gamma ? n - 1 + gamma : gamma;
+    int right = last == gamma + 1 ? n - 1 + gamma + 1 : gamma + 1;
+    children[i] = make_int2(left, right);
+    parents[left] = i;
+    parents[right] = i;
+    firsts[i] = first;
+    if (i == 0) {
+        parents[0] = -1;
+    }
+}
+
+__global__ void kernLeafFirsts(int n, int *firsts) {
+    int k = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (k < n) {
+        firsts[n - 1 + k] = k;
+    }
+}
+
+__global__ void kernNodePositions(int count, const int *parents, const int2 *children,
+        const int *firsts, int *positions) {
+    int node = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (node >= count) {
+        return;
+    }
+    int leftSteps = 0;
+    for (int child = node, parent = parents[node]; parent >= 0; child = parent, parent = parents[parent]) {
+        leftSteps += children[parent].x == child;
+    }
+    positions[node] = 2 * firsts[node] + leftSteps;
+}
+
+// Reads a box another thread may just have written, past the L1 cache
+__device__ AABB loadBounds(const AABB *boxes, int i) {
+    const volatile float *f = (const volatile float *)(boxes + i);
+    AABB box;
+    box.min = glm::vec3(f[0], f[1], f[2]);
+    box.max = glm::vec3(f[3], f[4], f[5]);
+    return box;
+}
+
+/**
+ * Writes leaf k, then walks up: the second child to finish an interior
+ * node writes it and carries on, the first one stops.
+ */
+__global__ void kernEmitNodes(int n, const AABB *geomBounds, const int *geomIndices,
+        const int *parents, const int2 *children, const int *positions,
+        AABB *nodeBounds, int *visits, BVHNode *nodes) {
+    int k = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (k >= n) {
+        return;
+    }
+    int node = n - 1 + k;
+    AABB box = geomBounds[geomIndices[k]];
+    BVHNode leaf;
+    leaf.bboxMin = box.min;
+    leaf.bboxMax = box.max;
+    leaf.offset = k;
+    leaf.count = 1;
+    nodes[positions[node]] = leaf;
+    nodeBounds[node] = box;
+
+    for (int parent = parents[node]; parent >= 0; parent = parents[parent]) {
+        __threadfence();
+        if (atomicAdd(&visits[parent], 1) == 0) {
+            return;
+        }
+        int2 pair = children[parent];
+        AABB left = loadBounds(nodeBounds, pair.x);
+        AABB right = loadBounds(nodeBounds, pair.y);
+        box.min = glm::min(left.min, right.min);
+        box.max = glm::max(left.max, right.max);
+        BVHNode interior;
+        interior.bboxMin = box.min;
+        interior.bboxMax = box.max;
+        interior.offset = positions[pair.y];
+        interior.count = 0;
+        nodes[positions[parent]] = interior;
+        nodeBounds[parent] = box;
+    }
+}
+
+// Parent of every node of a depth-first tree, -1 for the root
+__global__ void kernTreeParents(int count, const BVHNode *nodes, int *parents) {
+    int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (i >= count) {
+        return;
+    }
+    if (i == 0) {
+        parents[0] = -1;
+    }
+    const BVHNode node = nodes[i];
+    if (node.count == 0) {
+        parents[i + 1] = i;
+        parents[node.offset] = i;
+    }
+}
+
+/**
+ * Refits from leaf i up, as kernEmitNodes builds: an interior node's
+ * children are the next node and its offset, and the boxes are read back
+ * through nodeBounds, indexed like the nodes.
+ */
+__global__ void kernRefitNodes(int count, const AABB *geomBounds, const int *geomIndices,
+        const int *parents, AABB *nodeBounds, int *visits, BVHNode *nodes) {
+    int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (i >= count || nodes[i].count == 0) {
+        return;
+    }
+    const BVHNode leaf = nodes[i];
+    AABB box = geomBounds[geomIndices[leaf.offset]];
+    for (int k = 1; k < leaf.count; k++) {
+        const AABB geomBox = geomBounds[geomIndices[leaf.offset + k]];
+        box.min = glm::min(box.min, geomBox.min);
+        box.max = glm::max(box.max, geomBox.max);
+    }
+    nodes[i].bboxMin = box.min;
+    nodes[i].bboxMax = box.max;
+    nodeBounds[i] = box;
+
+    for (int parent = parents[i]; parent >= 0; parent = parents[parent]) {
+        __threadfence();
+        if (atomicAdd(&visits[parent], 1) == 0) {
+            return;
+        }
+        AABB left = loadBounds(nodeBounds, parent + 1);
+        AABB right = loadBounds(nodeBounds, nodes[parent].offset);
+        box.min = glm::min(left.min, right.min);
+        box.max = glm::max(left.max, right.max);
+        nodes[parent].bboxMin = box.min;
+        nodes[parent].bboxMax = box.max;
+        nodeBounds[parent] = box;
+    }
+}
+
+__host__ __device__ float surfaceArea(const glm::vec3 &low, const glm::vec3 &high) {
+    glm::vec3 d = glm::max(high - low, glm::vec3(0.0f));
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+/**
+ * Sums each node's area times its cost, a traversal step for interior
+ * nodes and one intersection per geom for leaves, over a warp with
+ * shuffles and then one atomic per warp.
+ */
+__global__ void kernSahCost(int count, const BVHNode *nodes, float *cost) {
+    int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+    float sum = 0.0f;
+    if (i < count) {
+        const BVHNode node = nodes[i];
+        sum = surfaceArea(node.bboxMin, node.bboxMax) * (node.count == 0 ? 1.0f : (float)node.count);
+    }
+    for (int offset = 16; offset > 0; offset /= 2) {
+        sum += __shfl_down_sync(0xffffffff, sum, offset);
+    }
+    if ((threadIdx.x & 31) == 0 && sum > 0.0f) {
+        atomicAdd(cost, sum);
+    }
+}
+
+void geomBounds(int n, const DeviceGeom *geoms, const Mesh *meshes, const BVHNode *meshNodes,
+        const SphereCloud *clouds, const BVHNode *cloudNodes, const SdfVolume *sdfs, AABB *bounds) {
+    if (n > 0) {
+        kernGeomBounds<<<blocksFor(n), LBVH_BLOCK_SIZE>>>(n, geoms, meshes, meshNodes, clouds, cloudNodes,
+            sdfs, bounds);
+    }
+}
+
+void build(int n, const DeviceGeom *geoms, const Mesh *meshes, const BVHNode *meshNodes,
+        const SphereCloud *clouds, const BVHNode *cloudNodes, const SdfVolume *sdfs,
+        BVHNode *nodes, int *geomIndices) {
+    if (n <= 0) {
+        return;
+    }
+    initScratch(n);
+    const int blocks = blocksFor(n);
+    const int reduceBlocks = std::min(blocks, LBVH_REDUCE_BLOCKS);
+
+    kernGeomBounds<<<blocks, LBVH_BLOCK_SIZE>>>(n, geoms, meshes, meshNodes, clouds, cloudNodes,
+        sdfs, dev_geomBounds);
+    kernReduceCentroidBounds<<<reduceBlocks, LBVH_BLOCK_SIZE>>>(n, dev_geomBounds, true, dev_partialBounds);
+    kernReduceCentroidBounds<<<1, LBVH_BLOCK_SIZE>>>(reduceBlocks, dev_partialBounds, false, dev_partialBounds);
+    kernMortonCodes<<<blocks, LBVH_BLOCK_SIZE>>>(n, dev_geomBounds, dev_partialBounds, dev_keys, geomIndices);
+    StreamCompaction::Radix::sortByKey(n, dev_keys, geomIndices, MORTON_BITS);
+
+    const int count = nodeCount(n);
+    if (n > 1) {
+        kernBuildHierarchy<<<blocksFor(n - 1), LBVH_BLOCK_SIZE>>>(n, dev_keys, dev_children,
+            dev_parents, dev_firsts);
+        cudaMemset(dev_visits, 0, (n - 1) * sizeof(int));
+    } else {
+        cudaMemset(dev_parents, 0xff, sizeof(int));
+    }
+    kernLeafFirsts<<<blocks, LBVH_BLOCK_SIZE>>>(n, dev_firsts);
+    kernNodePositions<<<blocksFor(count), LBVH_BLOCK_SIZE>>>(count, dev_parents, dev_children,
+        dev_firsts, dev_positions);
+    kernEmitNodes<<<blocks, LBVH_BLOCK_SIZE>>>(n, dev_geomBounds, geomIndices, dev_parents,
+        dev_children, dev_positions, dev_nodeBounds, dev_visits, nodes);
+    checkCUDAError("lbvh build");
+}
+
+void refit(int count, int n, const DeviceGeom *geoms, const Mesh *meshes, const BVHNode *meshNodes,
+        const SphereCloud *clouds, const BVHNode *cloudNodes, const SdfVolume *sdfs,
+        BVHNode *nodes, const int *geomIndices) {
+    if (count <= 0) {
+        return;
+    }
+    // A tree with at most two geoms per leaf has fewer nodes than nodeCount(n)
+    initScratch(std::max(n, (count + 1) / 2));
+    kernGeomBounds<<<blocksFor(n), LBVH_BLOCK_SIZE>>>(n, geoms, meshes, meshNodes, clouds, cloudNodes,
+        sdfs, dev_geomBounds);
+    kernTreeParents<<<blocksFor(count), LBVH_BLOCK_SIZE>>>(count, nodes, dev_parents);
+    // Depth-first indices run past n, so the visits go in dev_firsts
+    cudaMemset(dev_firsts, 0, count * sizeof(int));
+    kernRefitNodes<<<blocksFor(count), LBVH_BLOCK_SIZE>>>(count, dev_geomBounds, geomIndices,
+        dev_parents, dev_nodeBounds, dev_firsts, nodes);
+    checkCUDAError("lbvh refit");
+}
+
+float sahCost(int count, const BVHNode *nodes) {
+    if (count <= 0) {
+        return 0.0f;
+    }
+    initScratch(1);
+    cudaMemset(dev_cost, 0, sizeof(float));
+    kernSahCost<<<blocksFor(count), LBVH_BLOCK_SIZE>>>(count, nodes, dev_cost);
+    float cost = 0.0f;
+    BVHNode root;
+    cudaMemcpy(&cost, dev_cost, sizeof(float), cudaMemcpyDeviceToHost);
+    cudaMemcpy(&root, nodes, sizeof(BVHNode), cudaMemcpyDeviceToHost);
+    checkCUDAError("lbvh sahCost");
+    float rootArea = surfaceArea(root.bboxMin, root.bboxMax);
+    return rootArea > 0.0f ? cost / rootArea : 0.0f;
+}
+
+}
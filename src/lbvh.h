@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cuda_runtime.h>
+#include "sceneStructs.h"
+
+/**
+ * Device-side linear BVH construction over the scene's geoms, after Karras,
+ * "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d
+ * Trees" (HPG 2012): Morton codes of the geom centroids, a radix sort, one
+ * thread per interior node to find its range and split, and a bottom-up
+ * pass for the boxes. The result uses the same depth-first BVHNode layout
+ * as BVH::build, with one geom per leaf, so traversal is unchanged.
+ */
+namespace LBVH {
+    // Nodes in a tree over n geoms
+    inline int nodeCount(int n) {
+        return n > 0 ? 2 * n - 1 : 0;
+    }
+
+    // Spreads the low 10 bits of v out to every third bit, for Morton codes
+    __host__ __device__ inline unsigned int expandBits(unsigned int v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    /**
+     * Builds the tree over geoms[0, n) into nodes (nodeCount(n) entries) and
+     * geomIndices (n entries). All pointers are device memory on the current
+     * device; mesh and sphere cloud geoms are bounded by the root box of
+     * their own BVH, SDF volumes by their grid's box.
+     */
+    void build(int n, const DeviceGeom *geoms, const Mesh *meshes, const BVHNode *meshNodes,
+            const SphereCloud *clouds, const BVHNode *cloudNodes, const SdfVolume *sdfs,
+            BVHNode *nodes, int *geomIndices);
+
+    /**
+     * Refits a depth-first tree of `count` nodes over geoms[0, n) in place,
+     * as laid out by BVH::build or build() alike, to the geoms' current
+     * boxes: one thread per leaf walks up, and the second child to finish
+     * each interior node writes it. The topology is kept.
+     */
+    void refit(int count, int n, const DeviceGeom *geoms, const Mesh *meshes, const BVHNode *meshNodes,
+            const SphereCloud *clouds, const BVHNode *cloudNodes, const SdfVolume *sdfs,
+            BVHNode *nodes, const int *geomIndices);
+
+    // World-space boxes of geoms[0, n) into `bounds`, as build() and refit() box them
+    void geomBounds(int n, const DeviceGeom *geoms, const Mesh *meshes, const BVHNode *meshNodes,
+            const SphereCloud *clouds, const BVHNode *cloudNodes, const SdfVolume *sdfs, AABB *bounds);
+
+    // SAH cost of a tree of `count` nodes, in geom intersections per ray
+    // through its root box; refits raise it as the boxes grow and overlap
+    float sahCost(int count, const BVHNode *nodes);
+
+    void freeScratch();
+}
@@ -0,0 +1,288 @@
+#pragma once
+
+#include "intersections.h"
+
+/**
+ * Helpers for next-event estimation over Scene::lights and the environment
+ * map: picking a light, by power or through the light tree, drawing a
+ * point or direction on it, and the solid-angle pdf of having done so,
+ * which scattered rays that hit a light or leave the scene need for their
+ * MIS weight.
+ */
+
+// Picks a light by its pmf and rescales `u` to [0, 1) within its bin
+__host__ __device__ inline int pickLight(const LightData &lights, float &u) {
+    // The first light whose cdf is above u, by bisection, since meshes
+    // may list thousands of triangles
+    int lo = 0;
+    int hi = lights.count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (u >= lights.lights[mid].cdf) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    const int l = lo;
+    const Light &light = lights.lights[l];
+    float below = light.cdf - light.pmf;
+    u = glm::min((u - below) / light.pmf, 0.99999994f);
+    return l;
+}
+
+__host__ __device__ inline glm::vec3 lightToWorldPoint(const Light &light, glm::vec3 p) {
+    glm::vec4 h(p, 1.0f);
+    return glm::vec3(glm::dot(light.transformRows[0], h), glm::dot(light.transformRows[1], h),
+        glm::dot(light.transformRows[2], h));
+}
+
+// Column `axis` of the transform: the world-space image of that unit edge
+__host__ __device__ inline glm::vec3 lightAxis(const Light &light, int axis) {
+    return glm::vec3(light.transformRows[0][axis], light.transformRows[1][axis], light.transformRows[2][axis]);
+}
+
+/**
+ * Draws a point uniformly over the light's surface from `u0` (face choice,
+ * cubes only) and `u1`, `u2`. `normal` is a unit normal of its face; only
+ * its line matters, since lights emit from both sides.
+ */
+__host__ __device__ inline void sampleLightPoint(const Light &light, float u0, float u1, float u2,
+        glm::vec3 &point, glm::vec3 &normal) {
+    if (light.type == MESH) {
+        // A triangle's rows hold its corners; square-root warped barycentrics are uniform over it
+        const glm::vec3 p0(light.transformRows[0]);
+        const glm::vec3 p1(light.transformRows[1]);
+        const glm::vec3 p2(light.transformRows[2]);
+        const float s = sqrtf(u1);
+        point = (1.0f - s) * p0 + (s * (1.0f - u2)) * p1 + (s * u2) * p2;
+        normal = glm::normalize(glm::cross(p1 - p0, p2 - p0));
+        return;
+    }
+    if (light.type == SPHERE) {
+        float z = 1.0f - 2.0f * u1;
+        float r = sqrtf(fmaxf(0.0f, 1.0f - z * z));
+        float phi = TWO_PI * u2;
+        point = lightToWorldPoint(light, 0.5f * glm::vec3(r * cosf(phi), r * sinf(phi), z));
+        normal = glm::normalize(point - lightToWorldPoint(light, glm::vec3(0.0f)));
+        return;
+    }
+    // Face pairs are picked by area, then either face of the pair
+    int axis = u0 < light.faceCdf[0] ? 0 : u0 < light.faceCdf[1] ? 1 : 2;
+    float below = axis == 0 ? 0.0f : light.faceCdf[axis - 1];
+    float side = (u0 - below) / (light.faceCdf[axis] - below);
+    glm::vec3 p;
+    p[axis] = side < 0.5f ? -0.5f : 0.5f;
+    p[(axis + 1) % 3] = u1 - 0.5f;
+    p[(axis + 2) % 3] = u2 - 0.5f;
+    point = lightToWorldPoint(light, p);
+    normal = glm::normalize(glm::cross(lightAxis(light, (axis + 1) % 3), lightAxis(light, (axis + 2) % 3)));
+}
+
+/**
+ * Solid-angle pdf of light sampling producing a point at `distance` whose
+ * normal makes cosine `cosLight` with the direction to it, once the light
+ * was picked with probability `pmf`.
+ */
+__host__ __device__ inline float lightPdf(const Light &light, float pmf, float distance, float cosLight) {
+    return pmf * distance * distance / (light.area * fmaxf(fabsf(cosLight), 1e-6f));
+}
+
+/**
+ * The light tree's estimate of how much the lights below `node` give
+ * point `p`: their power over the squared distance to the box, times the
+ * largest cosine any of their normals can make with the direction to `p`
+ * (in the spirit of PBRT-v4's light BVH), with the lights' two sides and
+ * no receiver normal. Depending on the point alone, it is the same at a
+ * shading point and where a ray leaving it hits a light, so the pmf can
+ * be rebuilt there for MIS.
+ */
+__host__ __device__ inline float lightNodeImportance(const LightNode &node, glm::vec3 p) {
+    if (!(node.power > 0.0f)) {
+        return 0.0f;
+    }
+    const glm::vec3 centre = 0.5f * (node.boundsMin + node.boundsMax);
+    const glm::vec3 half = 0.5f * (node.boundsMax - node.boundsMin);
+    const float radius2 = glm::dot(half, half);
+    const glm::vec3 toPoint = p - centre;
+    const float distance2 = glm::dot(toPoint, toPoint);
+    // Inside the bounding sphere every direction is open, and the distance
+    // stops shrinking so that nearby lights do not blow up
+    if (distance2 <= radius2) {
+        return node.power / fmaxf(radius2, 1e-12f);
+    }
+    if (node.cosTheta <= -1.0f) {
+        return node.power / distance2;
+    }
+    // The angle between the cone and the direction to p, less the cone's
+    // half angle and that of the bounding sphere seen from p
+    const float cosW = fminf(fabsf(glm::dot(node.axis, toPoint)) / sqrtf(distance2), 1.0f);
+    const float sinW = sqrtf(fmaxf(0.0f, 1.0f - cosW * cosW));
+    const float cosO = node.cosTheta;
+    const float sinO = sqrtf(fmaxf(0.0f, 1.0f - cosO * cosO));
+    const float sinB2 = radius2 / distance2;
+    const float cosB = sqrtf(fmaxf(0.0f, 1.0f - sinB2));
+    const float sinB = sqrtf(sinB2);
+    float cosAngle = 1.0f;
+    if (cosW < cosO) {
+        const float cosWO = cosW * cosO + sinW * sinO;
+        const float sinWO = sinW * cosO - cosW * sinO;
+        if (cosWO < cosB) {
+            cosAngle = cosWO * cosB + sinWO * sinB;
+        }
+    }
+    return cosAngle > 0.0f ? node.power * cosAngle / distance2 : 0.0f;
+}
+
+/**
+ * Walks the light tree from the root to one light for point `p`, taking
+ * each child with probability proportional to its importance, and
+ * rescales `u` along the way so that it is left uniform in [0, 1) for the
+ * light's own use. Returns the light and its probability in `pmf`, or -1
+ * if no light can reach `p`.
+ */
+__host__ __device__ inline int sampleLightTree(const LightData &lights, glm::vec3 p, float &u, float &pmf) {
+    pmf = 1.0f;
+    int index = 0;
+    while (lights.lightTree[index].count == 0) {
+        const int right = lights.lightTree[index].offset;
+        const float left = lightNodeImportance(lights.lightTree[index + 1], p);
+        const float total = left + lightNodeImportance(lights.lightTree[right], p);
+        if (!(total > 0.0f)) {
+            return -1;
+        }
+        const float pLeft = left / total;
+        if (u < pLeft) {
+            u = fminf(u / pLeft, 0.99999994f);
+            pmf *= pLeft;
+            index++;
+        } else {
+            u = fminf((u - pLeft) / (1.0f - pLeft), 0.99999994f);
+            pmf *= 1.0f - pLeft;
+            index = right;
+        }
+    }
+    return lights.lightTree[index].offset;
+}
+
+// Probability of sampleLightTree picking `light` for point `p`, from its leaf up to the root
+__host__ __device__ inline float lightTreePmf(const LightData &lights, glm::vec3 p, int light) {
+    float pmf = 1.0f;
+    int index = lights.lights[light].node;
+    for (int parent = lights.lightTree[index].parent; parent >= 0; parent = lights.lightTree[parent].parent) {
+        const float left = lightNodeImportance(lights.lightTree[parent + 1], p);
+        const float total = left + lightNodeImportance(lights.lightTree[lights.lightTree[parent].offset], p);
+        if (!(total > 0.0f)) {
+            return 0.0f;
+        }
+        pmf *= (index == parent + 1 ? left : total - left) / total;
+        index = parent;
+    }
+    return pmf;
+}
+
+// Veach's power heuristic (beta = 2) for the strategy with pdf `a`
+__host__ __device__ inline float powerHeuristic(float a, float b) {
+    float a2 = a * a;
+    return a2 / (a2 + b * b);
+}
+
+// Whether shading samples lights directly: there are lights, or an environment it samples
+__host__ __device__ inline bool directLighting(const LightData &lights) {
+    return lights.count > 0 || lights.environment.pmf > 0.0f;
+}
+
+// Direction of environment map coordinates (u, v), see EnvironmentMap
+__host__ __device__ inline glm::vec3 environmentDirection(float u, float v) {
+    float phi = TWO_PI * u;
+    float theta = PI * v;
+    float sinTheta = sinf(theta);
+    return glm::vec3(sinTheta * cosf(phi), cosf(theta), sinTheta * sinf(phi));
+}
+
+__host__ __device__ inline glm::vec2 environmentUV(glm::vec3 direction) {
+    float phi = atan2f(direction.z, direction.x);
+    if (phi < 0.0f) {
+        phi += TWO_PI;
+    }
+    return glm::vec2(phi / TWO_PI, acosf(glm::clamp(direction.y, -1.0f, 1.0f)) / PI);
+}
+
+// The bin [cdf[i], cdf[i + 1]) of an n-bin CDF (cdf[0] = 0, cdf[n] = 1) holding u
+__host__ __device__ inline int findCdfBin(const float *cdf, int n, float u) {
+    int lo = 0;
+    int hi = n;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] <= u) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Solid-angle pdf of sampleEnvironment drawing the texel (row, column):
+ * its share of the image's weighted luminance spread over its uv area,
+ * over the 2 pi^2 sin(theta) solid angle per unit of uv.
+ */
+__host__ __device__ inline float environmentTexelPdf(const EnvironmentLight &environment, int row, int column,
+        float sinTheta) {
+    const float *rowCdf = environment.conditionalCdf + row * (environment.width + 1);
+    float p = (environment.marginalCdf[row + 1] - environment.marginalCdf[row])
+        * (rowCdf[column + 1] - rowCdf[column]) * environment.width * environment.height;
+    return sinTheta > 0.0f ? p / (2.0f * PI * PI * sinTheta) : 0.0f;
+}
+
+/**
+ * Draws a direction towards the environment with probability following
+ * its radiance: a row from the marginal CDF, then a column of that row,
+ * then a uniform point within the texel.
+ */
+__host__ __device__ inline glm::vec3 sampleEnvironment(const EnvironmentLight &environment, float u1, float u2,
+        float &pdf) {
+    int row = findCdfBin(environment.marginalCdf, environment.height, u1);
+    const float *rowCdf = environment.conditionalCdf + row * (environment.width + 1);
+    int column = findCdfBin(rowCdf, environment.width, u2);
+    float rowWidth = environment.marginalCdf[row + 1] - environment.marginalCdf[row];
+    float columnWidth = rowCdf[column + 1] - rowCdf[column];
+    float du = columnWidth > 0.0f ? (u2 - rowCdf[column]) / columnWidth : 0.5f;
+    float dv = rowWidth > 0.0f ? (u1 - environment.marginalCdf[row]) / rowWidth : 0.5f;
+    float v = (row + dv) / environment.height;
+    pdf = environmentTexelPdf(environment, row, column, sinf(PI * v));
+    return environmentDirection((column + du) / environment.width, v);
+}
+
+__host__ __device__ inline float environmentPdf(const EnvironmentLight &environment, glm::vec3 direction) {
+    glm::vec2 uv = environmentUV(direction);
+    int column = glm::min((int)(uv.x * environment.width), environment.width - 1);
+    int row = glm::min((int)(uv.y * environment.height), environment.height - 1);
+    return environmentTexelPdf(environment, row, column, sqrtf(direction.x * direction.x + direction.z * direction.z));
+}
+
+/**
+ * Radiance of the environment along `direction`, or BACKGROUND_COLOR
+ * without one. The host reads the nearest of `texels` where the device
+ * filters its texture.
+ */
+__host__ __device__ inline glm::vec3 environmentRadiance(const EnvironmentLight &environment, glm::vec3 direction) {
+#ifdef __CUDA_ARCH__
+    if (environment.texture == 0) {
+        return BACKGROUND_COLOR;
+    }
+    glm::vec2 uv = environmentUV(direction);
+    float4 texel = tex2D<float4>(environment.texture, uv.x, uv.y);
+    return environment.intensity * glm::vec3(texel.x, texel.y, texel.z);
+#else
+    if (environment.texels == NULL) {
+        return BACKGROUND_COLOR;
+    }
+    glm::vec2 uv = environmentUV(direction);
+    int column = glm::clamp((int)(uv.x * environment.width), 0, environment.width - 1);
+    int row = glm::clamp((int)(uv.y * environment.height), 0, environment.height - 1);
+    const float *texel = environment.texels + 4 * (row * environment.width + column);
+    return environment.intensity * glm::vec3(texel[0], texel[1], texel[2]);
+#endif
+}
@@ -1,12 +1,39 @@
 #include "main.h"
 #include "preview.h"
+#include "accumulationFile.h"
+#include "autotune.h"
+#include "benchmark.h"
+#include "cpuRenderer.h"
+#include "frameDump.h"
+#include "frameEncoder.h"
+#include "gpuShare.h"
+#include "imageMetrics.h"
+#include "imageWriter.h"
+#include "kernelCounters.h"
+#include "powerMonitor.h"
+#include "mappedFile.h"
+#include "rasterVisibility.h"
+#include "remoteSession.h"
+#include "sceneGenerator.h"
+#include "telemetry.h"
+#include "nvtx.h"
+#include "../denoiser/denoiser.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <thread>
 
 #include "../imgui/imgui.h"
 #include "../imgui/imgui_impl_glfw.h"
 #include "../imgui/imgui_impl_opengl3.h"
 
 static std::string startTimeString;
+// The command line as given, for --batch --concurrent to launch its children with
+static std::vector<std::string> launchArguments;
 
 // For camera controls
 static bool leftMousePressed = false;
@@ -23,14 +50,279 @@ int ui_iterations = 0;
 int startupIterations = 0;
 int lastLoopIterations = 0;
 bool ui_showGbuffer = false;
+int ui_gbufferView = GBUFFER_DEPTH;
 bool ui_denoise = false;
+int ui_denoiseBackend = DENOISE_ATROUS;
+bool ui_temporal = false;
+bool ui_varianceGuided = false;
+bool ui_separableFilter = false;
+bool ui_halfPrecisionFilter = false;
+bool ui_pyramidFilter = false;
+bool ui_demodulateAlbedo = false;
+float ui_earlyOutThreshold = 0.0f;
+float ui_tileConvergence = 0.0f;
 int ui_filterSize = 80;
+int ui_filterKernel = ATROUS_B3_SPLINE;
 float ui_colorWeight = 0.45f;
 float ui_normalWeight = 0.35f;
 float ui_positionWeight = 0.2f;
+bool ui_splitSpecular = false;
+int ui_specularFilterSize = 20;
+float ui_specularColorWeight = 0.2f;
+float ui_exposure = 0.0f;
+int ui_toneMapper = TONEMAP_CLAMP;
+bool ui_srgbDisplay = false;
+bool ui_temporalAA = false;
+float ui_taaBlend = 0.1f;
+int ui_stereoEye = 0;
 bool ui_saveAndExit = false;
+bool ui_saveAovs = false;
+bool ui_sortByMaterial = false;
+bool ui_cacheFirstBounce = true;
+int ui_pipeline = PIPELINE_SPLIT;
+bool ui_russianRoulette = false;
+int ui_rouletteMinDepth = 3;
+bool ui_showStats = false;
+int ui_samplesPerLaunch = 1;
+int ui_launchesPerDisplay = 1;
+bool ui_syncFreeBatch = false;
+bool ui_frameBudget = false;
+float ui_frameBudgetMs = 16.0f;
+bool ui_interactiveQuality = false;
+int ui_interactiveStride = 4;
+int ui_interactiveDepth = 2;
+bool ui_pauseWhenHidden = false;
+bool ui_powerCap = false;
+int ui_powerCapIterations = 30;
+int ui_tileRows = 0;
+bool ui_adaptiveSampling = false;
+float ui_adaptiveThreshold = 0.02f;
+int ui_adaptiveMinSamples = 16;
+int ui_sampler = SAMPLER_SOBOL;
+bool ui_antialias = true;
+bool ui_jitteredGBuffer = false;
+bool ui_nextEventEstimation = true;
+bool ui_wideMeshBVH = true;
+bool ui_sortRays = false;
+bool ui_specializedShading = true;
+bool ui_tiledPathOrder = false;
+bool ui_hardwareRT = false;
+int ui_gather = GATHER_SEGMENTED;
+bool ui_accumulateOnTermination = false;
+bool ui_regeneratePaths = false;
+bool ui_hitRecords = false;
+bool ui_deterministic = false;
+bool ui_radianceCache = false;
+bool ui_photonCaustics = false;
+bool ui_restir = false;
+bool ui_meshLOD = false;
+bool ui_watertight = false;
+bool ui_shortStack = false;
+bool ui_lightTree = false;
+bool ui_pathGuiding = false;
+bool ui_bidirectional = false;
+bool ui_rasterPrimary = false;
+bool ui_tileCulling = false;
+bool ui_packetCameraRays = false;
+bool ui_packetShadowRays = false;
+int ui_pathSplit = 1;
+bool ui_compactPaths = false;
+// Shift + left drag selects the region of interest; ui_regionDrag is the
+// rectangle being dragged out, empty otherwise
+bool ui_regionOfInterest = false;
+PixelRect ui_regionRect = PixelRect();
+PixelRect ui_regionDrag = PixelRect();
+bool ui_reloadScene = true;
+int ui_editedMaterial = -1;
+int ui_editedGeom = -1;
 
 static bool camchanged = true;
+
+// What the display texture currently shows, so idle frames can skip the display kernels
+enum DisplayMode { DISPLAY_NONE, DISPLAY_IMAGE, DISPLAY_GBUFFER, DISPLAY_DENOISED };
+static DisplayMode lastDisplayMode = DISPLAY_NONE;
+// Display updates runCuda() made, and whether they go to frameEncoder's
+// surface for --server rather than the preview's texture
+static int displayedFrames = 0;
+static bool serving = false;
+static DenoiseOptions lastDenoiseOptions;
+static DisplayOptions lastDisplayOptions;
+static int lastGBufferView = GBUFFER_DEPTH;
+static bool lastRayCost = false;
+static bool lastSplitSpecular = false;
+static PixelRect lastRegion = PixelRect();
+static bool draggingRegion = false;
+static glm::ivec2 regionDragStart;
+
+// The region every stage is restricted to, empty for the whole image.
+// Stereo pairs are always rendered whole.
+static PixelRect activeRegion() {
+    return ui_regionOfInterest && scene->state.viewCount() == 1 ? ui_regionRect : PixelRect();
+}
+
+static bool sameRegion(const PixelRect &a, const PixelRect &b) {
+    return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+}
+
+static bool sameDenoiseOptions(const DenoiseOptions &a, const DenoiseOptions &b) {
+    return a.backend == b.backend
+        && a.filterSize == b.filterSize
+        && a.kernel == b.kernel
+        && a.colorWeight == b.colorWeight
+        && a.normalWeight == b.normalWeight
+        && a.positionWeight == b.positionWeight
+        && a.temporal == b.temporal
+        && a.varianceGuided == b.varianceGuided
+        && a.separable == b.separable
+        && a.halfPrecision == b.halfPrecision
+        && a.pyramid == b.pyramid
+        && a.demodulateAlbedo == b.demodulateAlbedo
+        && a.earlyOutThreshold == b.earlyOutThreshold
+        && a.tileConvergence == b.tileConvergence
+        && a.splitSpecular == b.splitSpecular
+        && a.specularFilterSize == b.specularFilterSize
+        && a.specularColorWeight == b.specularColorWeight
+        && sameRegion(a.region, b.region);
+}
+
+static bool sameDisplayOptions(const DisplayOptions &a, const DisplayOptions &b) {
+    return a.exposure == b.exposure
+        && a.toneMapper == b.toneMapper
+        && a.srgb == b.srgb
+        && a.eye == b.eye
+        && a.temporalAA == b.temporalAA
+        && a.taaBlend == b.taaBlend;
+}
+
+static DisplayOptions currentDisplayOptions() {
+    DisplayOptions options;
+    options.exposure = ui_exposure;
+    options.toneMapper = ui_toneMapper;
+    options.srgb = ui_srgbDisplay;
+    options.region = activeRegion();
+    options.eye = ui_stereoEye;
+    options.temporalAA = ui_temporalAA;
+    options.taaBlend = ui_taaBlend;
+    return options;
+}
+static PathtraceOptions currentPathtraceOptions() {
+    PathtraceOptions options;
+    options.sortByMaterial = ui_sortByMaterial;
+    options.cacheFirstBounce = ui_cacheFirstBounce;
+    options.pipeline = ui_pipeline;
+    options.russianRoulette = ui_russianRoulette;
+    options.rouletteMinDepth = ui_rouletteMinDepth;
+    options.samplesPerLaunch = ui_samplesPerLaunch;
+    options.seedOffset = 0;
+    options.tileRows = ui_tileRows;
+    options.pixelStride = 1;
+    // Only counted while a ray cost view is up
+    options.rayCost = ui_showGbuffer && ui_gbufferView >= GBUFFER_BOUNCES;
+    options.splitSpecular = ui_splitSpecular;
+    options.adaptiveSampling = ui_adaptiveSampling;
+    options.adaptiveThreshold = ui_adaptiveThreshold;
+    options.adaptiveMinSamples = ui_adaptiveMinSamples;
+    options.sampler = ui_sampler;
+    options.antialias = ui_antialias;
+    options.jitteredGBuffer = ui_jitteredGBuffer;
+    options.nextEventEstimation = ui_nextEventEstimation;
+    options.wideMeshBVH = ui_wideMeshBVH;
+    options.sortRays = ui_sortRays;
+    options.specializedShading = ui_specializedShading;
+    options.tiledPathOrder = ui_tiledPathOrder;
+    options.hardwareRT = ui_hardwareRT;
+    options.gather = ui_gather;
+    options.accumulateOnTermination = ui_accumulateOnTermination;
+    options.regeneratePaths = ui_regeneratePaths;
+    options.hitRecords = ui_hitRecords;
+    options.deterministic = ui_deterministic;
+    options.radianceCache = ui_radianceCache;
+    options.photonCaustics = ui_photonCaustics;
+    options.restir = ui_restir;
+    options.meshLOD = ui_meshLOD;
+    options.watertight = ui_watertight;
+    options.shortStack = ui_shortStack;
+    options.lightTree = ui_lightTree;
+    options.pathGuiding = ui_pathGuiding;
+    options.bidirectional = ui_bidirectional;
+    options.rasterPrimary = ui_rasterPrimary;
+    options.tileCulling = ui_tileCulling;
+    options.packetCameraRays = ui_packetCameraRays;
+    options.packetShadowRays = ui_packetShadowRays;
+    options.pathSplit = ui_pathSplit;
+    options.compactPaths = ui_compactPaths;
+    options.region = activeRegion();
+    return options;
+}
+
+/**
+ * Traces the next launch's samples, options.samplesPerLaunch but never past
+ * `target` samples, and advances `iteration` past them.
+ */
+static void traceNextSamples(int frame, int target, PathtraceOptions options) {
+    // The tuner's winner becomes the control panel's settings, which the
+    // user may still change
+    autotune::Choice tuned;
+    if (autotune::take(tuned)) {
+        ui_pipeline = options.pipeline = tuned.pipeline;
+        ui_sortByMaterial = options.sortByMaterial = tuned.sortByMaterial;
+        ui_sortRays = options.sortRays = tuned.sortRays;
+        pathtraceOverrideBlockSizes(tuned.intersectBlockSize, tuned.shadeBlockSize);
+    }
+    // Background work next to a preview traces short launches and yields
+    const bool yield = gpuShare::beginLaunch();
+    if (yield) {
+        options.samplesPerLaunch = 1;
+        options.tileRows = options.tileRows > 0 ? std::min(options.tileRows, GPU_SHARE_TILE_ROWS)
+            : GPU_SHARE_TILE_ROWS;
+    }
+    std::chrono::steady_clock::time_point launchStart = std::chrono::steady_clock::now();
+    options.samplesPerLaunch = std::min(std::min(options.samplesPerLaunch, MAX_SAMPLES_PER_LAUNCH),
+        target - iteration);
+    iteration += options.samplesPerLaunch;
+    autotune::beginLaunch(options);
+    kernelCounters::beginLaunch();
+    pathtrace(frame, iteration, options);
+    if (yield) {
+        cudaDeviceSynchronize();
+        gpuShare::endLaunch(std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - launchStart).count());
+    }
+    kernelCounters::endLaunch();
+    autotune::endLaunch(options.samplesPerLaunch);
+    telemetry::traced(options.samplesPerLaunch);
+    const PathtraceStats &stats = pathtraceStats();
+    long long pathRays = 0;
+    for (int depth = 0; depth < stats.depths && depth < STATS_MAX_DEPTH; depth++) {
+        pathRays += stats.pathCounts[depth];
+    }
+    powerMonitor::traced(options.samplesPerLaunch, pathRays);
+    frameDump::traced(width, height * scene->state.viewCount(), iteration, options.samplesPerLaunch);
+}
+
+static DenoiseOptions currentDenoiseOptions() {
+    DenoiseOptions options;
+    options.backend = ui_denoiseBackend;
+    options.filterSize = ui_filterSize;
+    options.kernel = ui_filterKernel;
+    options.colorWeight = ui_colorWeight;
+    options.normalWeight = ui_normalWeight;
+    options.positionWeight = ui_positionWeight;
+    options.temporal = ui_temporal;
+    options.varianceGuided = ui_varianceGuided;
+    options.separable = ui_separableFilter;
+    options.halfPrecision = ui_halfPrecisionFilter;
+    options.pyramid = ui_pyramidFilter;
+    options.demodulateAlbedo = ui_demodulateAlbedo;
+    options.earlyOutThreshold = ui_earlyOutThreshold;
+    options.tileConvergence = ui_tileConvergence;
+    options.splitSpecular = ui_splitSpecular;
+    options.specularFilterSize = ui_specularFilterSize;
+    options.specularColorWeight = ui_specularColorWeight;
+    options.region = activeRegion();
+    return options;
+}
+
 static float dtheta = 0, dphi = 0;
 static glm::vec3 cammove;
 
@@ -45,21 +337,636 @@ int iteration;
 int width;
 int height;
 
+// Rows of saved images and accumulation files: a stereo pair is stacked,
+// left eye over right
+static int imageHeight() {
+    return height * renderState->viewCount();
+}
+
+// Launches budget mode may queue per frame, of up to MAX_SAMPLES_PER_LAUNCH samples each
+#define BUDGET_MAX_LAUNCHES 32
+// How long the camera must rest before full-depth tracing resumes
+#define BUDGET_SETTLE_SECONDS 0.2
+
+/**
+ * Frame budget mode: each frame traces as many samples as fit in
+ * ui_frameBudgetMs of GPU time, and while the camera moves, a trace depth
+ * at which even one sample does not fit is cut for the next restart. Once
+ * the camera has rested, the scene's depth comes back and accumulation
+ * restarts at full quality. The GPU time comes from events around each
+ * frame's launches, read on a later frame so measuring never stalls.
+ */
+struct FrameBudget {
+    cudaEvent_t start;
+    cudaEvent_t stop;
+    bool pending;               // events recorded, not yet read
+    int pendingSamples;         // samples traced between them
+    int pendingDepth;           // at this trace depth
+    float sampleMs;             // GPU time per sample at measuredDepth, 0 until measured
+    int measuredDepth;
+    int fullDepth;              // the scene's trace depth while it is cut, else 0
+    Scene *scene;               // the scene fullDepth belongs to
+    std::chrono::steady_clock::time_point lastMove;
+};
+static FrameBudget frameBudget = {};
+
+// Folds the last frame's launches into sampleMs once their events completed
+static void readFrameBudget() {
+    FrameBudget &fb = frameBudget;
+    if (!fb.pending || cudaEventQuery(fb.stop) != cudaSuccess) {
+        return;
+    }
+    float ms = 0.0f;
+    cudaEventElapsedTime(&ms, fb.start, fb.stop);
+    float sampleMs = ms / fb.pendingSamples;
+    fb.sampleMs = fb.sampleMs > 0.0f && fb.measuredDepth == fb.pendingDepth
+        ? 0.5f * (fb.sampleMs + sampleMs) : sampleMs;
+    fb.measuredDepth = fb.pendingDepth;
+    fb.pending = false;
+}
+
+/**
+ * Picks the trace depth for a restart of accumulation: cut, taking a
+ * sample's cost as proportional to its depth, while the camera moves and
+ * one sample at full depth would overrun the budget, and back to the
+ * scene's once the camera rests, which forces the restart itself.
+ */
+static void applyFrameBudget(bool cameraMoved) {
+    FrameBudget &fb = frameBudget;
+    if (fb.scene != scene) {
+        // A reload brought its own trace depth
+        fb.scene = scene;
+        fb.fullDepth = 0;
+        fb.sampleMs = 0.0f;
+    }
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (cameraMoved) {
+        fb.lastMove = now;
+    } else {
+        if (fb.fullDepth > 0 && std::chrono::duration<double>(now - fb.lastMove).count() >= BUDGET_SETTLE_SECONDS) {
+            renderState->traceDepth = fb.fullDepth;
+            fb.fullDepth = 0;
+            camchanged = true;
+        }
+        return;
+    }
+    if (!ui_frameBudget || fb.sampleMs <= 0.0f) {
+        return;
+    }
+    const int full = fb.fullDepth > 0 ? fb.fullDepth : renderState->traceDepth;
+    const float fullSampleMs = fb.sampleMs * full / fb.measuredDepth;
+    const int depth = fullSampleMs > ui_frameBudgetMs
+        ? glm::clamp((int)(full * ui_frameBudgetMs / fullSampleMs), 1, full) : full;
+    renderState->traceDepth = depth;
+    fb.fullDepth = depth < full ? full : 0;
+}
+
+// Samples one frame may trace within the budget, from the last measurement
+static int frameBudgetSamples() {
+    const float sampleMs = frameBudget.sampleMs;
+    const int most = MAX_SAMPLES_PER_LAUNCH * BUDGET_MAX_LAUNCHES;
+    return sampleMs > 0.0f ? glm::clamp((int)(ui_frameBudgetMs / sampleMs), 1, most) : 1;
+}
+
+// Samples each coarse level of the interaction ladder traces, once the
+// camera is released, before the next finer one restarts accumulation
+#define INTERACTION_STEP_SAMPLES 4
+// Samples the full-quality level traces before the display stops going
+// through the temporal denoiser
+#define INTERACTION_SETTLE_SAMPLES 16
+
+/**
+ * Interaction quality ladder: while the camera is dragged, launches trace
+ * one pixel in ui_interactiveStride each way (PathtraceOptions::pixelStride)
+ * at no more than ui_interactiveDepth bounces, and are shown through the
+ * temporal denoiser. Once the camera is released, the stride halves every
+ * INTERACTION_STEP_SAMPLES samples, the step back to every pixel also
+ * bringing back the scene's depth. Each step restarts accumulation, but
+ * the camera stands still, so the denoiser's reprojection carries the
+ * coarser levels' estimate over as history wherever the G-buffer still
+ * agrees. With the frame budget on, the depth is left to it.
+ */
+struct InteractionLadder {
+    int stride;                 // pixel stride of the current level, 1 at full resolution
+    int fullDepth;              // the scene's trace depth while it is capped, else 0
+    bool settling;              // the full-quality level is still shown denoised
+    Scene *scene;               // the scene fullDepth belongs to
+};
+static InteractionLadder interactionLadder = { 1, 0, false, NULL };
+
+// Whether the ladder shows the image through the temporal denoiser
+static bool interactionDenoised() {
+    const InteractionLadder &ladder = interactionLadder;
+    return ladder.stride > 1 || ladder.fullDepth > 0 || ladder.settling;
+}
+
+// Back to every pixel at the scene's depth, which forces a restart
+static void finishInteractionLadder() {
+    InteractionLadder &ladder = interactionLadder;
+    if (ladder.fullDepth > 0) {
+        renderState->traceDepth = ladder.fullDepth;
+        ladder.fullDepth = 0;
+    }
+    ladder.stride = 1;
+    camchanged = true;
+}
+
+/**
+ * Picks the ladder's level for a restart of accumulation: the coarsest
+ * while the camera is dragged, then a step up once the current level has
+ * its samples, which forces the restart itself.
+ */
+static void applyInteractionLadder(bool cameraMoved) {
+    InteractionLadder &ladder = interactionLadder;
+    if (ladder.scene != scene) {
+        // A reload brought its own trace depth
+        ladder.scene = scene;
+        ladder.stride = 1;
+        ladder.fullDepth = 0;
+        ladder.settling = false;
+    }
+    const bool dragging = leftMousePressed || rightMousePressed || middleMousePressed;
+    if (ui_interactiveQuality && cameraMoved && dragging) {
+        ladder.stride = std::max(ui_interactiveStride, 1);
+        ladder.settling = false;
+        if (!ui_frameBudget) {
+            const int full = ladder.fullDepth > 0 ? ladder.fullDepth : renderState->traceDepth;
+            const int depth = glm::clamp(ui_interactiveDepth, 1, full);
+            renderState->traceDepth = depth;
+            ladder.fullDepth = depth < full ? full : 0;
+        }
+        return;
+    }
+    const bool coarse = ladder.stride > 1 || ladder.fullDepth > 0;
+    if (!ui_interactiveQuality) {
+        ladder.settling = false;
+        if (coarse) {
+            finishInteractionLadder();
+        }
+        return;
+    }
+    if (dragging) {
+        return;
+    }
+    if (ladder.settling) {
+        ladder.settling = iteration < INTERACTION_SETTLE_SAMPLES;
+    } else if (coarse && iteration >= INTERACTION_STEP_SAMPLES) {
+        ladder.stride /= 2;
+        camchanged = true;
+        if (ladder.stride <= 1) {
+            finishInteractionLadder();
+            ladder.settling = true;
+        }
+    }
+}
+
+// Hot reload of the interactive scene: the file, the size and modification
+// time it was loaded with, and a newer stamp waiting to settle
+#define SCENE_POLL_SECONDS 0.25
+static std::string sceneFileName;
+static int64_t loadedSceneStamp[2];
+static int64_t pendingSceneStamp[2];
+static double lastScenePoll = 0.0;
+
+static int runHeadless(const char *sceneFile, int argc, char **argv);
+static int runGenerateScene(const char *sceneFile, int argc, char **argv);
+static int runAnimation(const char *sceneFile, int argc, char **argv);
+static int runBatch(const char *jobFile, int argc, char **argv);
+static int runWorker(const char *sceneFile, int argc, char **argv);
+static int runCoordinator(const char *sceneFile, int argc, char **argv);
+static int runServer(const char *sceneFile, int argc, char **argv);
+static void loadInteractiveScene(const char *sceneFile);
+
+// Distributed workers seed from disjoint iteration ranges this long. The
+// random engines keep 22 bits of the iteration, which bounds the workers.
+#define DISTRIBUTED_SEED_STRIDE (1 << 16)
+#define DISTRIBUTED_MAX_WORKERS 32
+
 //-------------------------------
 //-------------MAIN--------------
 //-------------------------------
 
+// The DenoiseBackend a --denoiser value names; unknown names are A-Trous
+static int parseDenoiseBackend(const char *name) {
+    return strcmp(name, "optix") == 0 ? DENOISE_OPTIX
+        : strcmp(name, "guided") == 0 ? DENOISE_GUIDED
+        : strcmp(name, "grid") == 0 ? DENOISE_BILATERAL_GRID
+        : strcmp(name, "kpn") == 0 ? DENOISE_KERNEL_PREDICTING : DENOISE_ATROUS;
+}
+
+/**
+ * Removes "--gpus N" (N GPUs, 0 for all), "--display-gpu" (the first
+ * GPU only merges, denoises and displays the others' samples), "--gpu-bvh" (build the
+ * top-level BVH on the GPU), "--paged-geometry" (page the meshes from host
+ * memory even when they fit on the GPUs), "--share-geometry" (map the
+ * meshes another process on the GPU uploaded, or share ours with later
+ * ones, see sceneShare.h), "--compact-meshes" (16-bit
+ * mesh vertices, see Scene::compactMeshes), "--coherent-geoms" (sort the
+ * geoms by place and material, see Scene::coherentGeomOrder), "--virtual-textures" (page
+ * texture tiles in as shading asks for them), "--no-l2-persistence" (leave
+ * the scene's hot arrays to the L2's usual policy) and "--bvh sah|median"
+ * (the host BVH builder) from the arguments, wherever they appear, since every mode
+ * accepts them. Returns the new argc.
+ */
+static int takeDeviceOption(int argc, char **argv) {
+    int kept = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--gpus") == 0 && i + 1 < argc) {
+            pathtraceUseDevices(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--display-gpu") == 0) {
+            pathtraceDedicateDisplayDevice(true);
+        } else if (strcmp(argv[i], "--gpu-bvh") == 0) {
+            pathtraceUseDeviceBVH(true);
+        } else if (strcmp(argv[i], "--paged-geometry") == 0) {
+            pathtraceUsePagedGeometry(true);
+        } else if (strcmp(argv[i], "--share-geometry") == 0) {
+            pathtraceShareGeometry(true);
+        } else if (strcmp(argv[i], "--compact-meshes") == 0) {
+            Scene::compactMeshes = true;
+        } else if (strcmp(argv[i], "--coherent-geoms") == 0) {
+            Scene::coherentGeomOrder = true;
+        } else if (strcmp(argv[i], "--virtual-textures") == 0) {
+            pathtraceUseVirtualTextures(true);
+        } else if (strcmp(argv[i], "--no-l2-persistence") == 0) {
+            pathtraceUseL2Persistence(false);
+        } else if (strcmp(argv[i], "--bvh") == 0 && i + 1 < argc) {
+            Scene::bvhBuilder = strcmp(argv[++i], "sah") == 0 ? BVH_SAH : BVH_MEDIAN;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    return kept;
+}
+
+/**
+ * Removes "--image-format png|qoi|pfm" and "--png-level N" (0 stores, 9
+ * compresses hardest; 6 by default), which pick how every mode writes its
+ * images (see imageWriter::setFormat). Returns the new argc.
+ */
+static int takeImageOption(int argc, char **argv) {
+    int kept = 0;
+    int format = imageWriter::IMAGE_PNG;
+    int pngLevel = 6;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--image-format") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            format = strcmp(name, "qoi") == 0 ? imageWriter::IMAGE_QOI
+                : strcmp(name, "pfm") == 0 ? imageWriter::IMAGE_PFM : imageWriter::IMAGE_PNG;
+        } else if (strcmp(argv[i], "--png-level") == 0 && i + 1 < argc) {
+            pngLevel = atoi(argv[++i]);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    imageWriter::setFormat(format, pngLevel);
+    return kept;
+}
+
+/**
+ * Removes "--frame-dump FILE", "--frame-dump-slots N" (default 8) and
+ * "--frame-dump-every SAMPLES" (default 1), starting the raw frame dump
+ * (see frameDump.h) if a file was given. Returns the new argc.
+ */
+static int takeFrameDumpOption(int argc, char **argv) {
+    int kept = 0;
+    const char *target = NULL;
+    int slots = 8;
+    int every = 1;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--frame-dump") == 0 && i + 1 < argc) {
+            target = argv[++i];
+        } else if (strcmp(argv[i], "--frame-dump-slots") == 0 && i + 1 < argc) {
+            slots = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--frame-dump-every") == 0 && i + 1 < argc) {
+            every = atoi(argv[++i]);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    if (target != NULL) {
+        frameDump::start(target, slots, every);
+    }
+    return kept;
+}
+
+/**
+ * Removes "--telemetry TARGET" and "--telemetry-period SECONDS", starting
+ * the telemetry reports (see telemetry.h) if a target was given.
+ *
+ * @return the remaining argument count, or -1 if TARGET cannot be written.
+ */
+static int takeTelemetryOption(int argc, char **argv) {
+    int kept = 0;
+    const char *target = NULL;
+    double period = 5.0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc) {
+            target = argv[++i];
+        } else if (strcmp(argv[i], "--telemetry-period") == 0 && i + 1 < argc) {
+            period = atof(argv[++i]);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    if (target != NULL && !telemetry::start(target, period)) {
+        printf("--telemetry: cannot write %s\n", target);
+        return -1;
+    }
+    return kept;
+}
+
+/**
+ * Removes "--autotune CACHEFILE", starting the launch tuner (see
+ * autotune.h) if it was given.
+ *
+ * @return the remaining argument count, or -1 if CACHEFILE cannot be written.
+ */
+static int takeAutotuneOption(int argc, char **argv) {
+    int kept = 0;
+    const char *cacheFile = NULL;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--autotune") == 0 && i + 1 < argc) {
+            cacheFile = argv[++i];
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    if (cacheFile != NULL && !autotune::start(cacheFile)) {
+        printf("--autotune: cannot write %s\n", cacheFile);
+        return -1;
+    }
+    return kept;
+}
+
+/**
+ * Removes "--kernel-counters LAUNCHES", measuring the first LAUNCHES
+ * launches' kernels (see kernelCounters.h) if it was given.
+ *
+ * @return the remaining argument count, or -1 if the build has no CUPTI.
+ */
+static int takeKernelCountersOption(int argc, char **argv) {
+    int kept = 0;
+    int launches = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--kernel-counters") == 0 && i + 1 < argc) {
+            launches = std::max(atoi(argv[++i]), 1);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    if (launches > 0 && !kernelCounters::start(launches)) {
+        printf("--kernel-counters: this build has no CUPTI (ENABLE_CUPTI)\n");
+        return -1;
+    }
+    return kept;
+}
+
+/**
+ * Removes "--capture-bounce FILE" and "--capture-depth N", writing bounce N
+ * (0 by default) of the first split-pipeline launch to FILE for
+ * kernel_benchmark --replay (see pathtraceCaptureBounce).
+ *
+ * @return the remaining argument count.
+ */
+static int takeCaptureOption(int argc, char **argv) {
+    int kept = 0;
+    const char *captureFile = NULL;
+    int depth = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--capture-bounce") == 0 && i + 1 < argc) {
+            captureFile = argv[++i];
+        } else if (strcmp(argv[i], "--capture-depth") == 0 && i + 1 < argc) {
+            depth = std::max(atoi(argv[++i]), 0);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    if (captureFile != NULL) {
+        pathtraceCaptureBounce(captureFile, depth);
+    }
+    return kept;
+}
+
+/**
+ * Removes "--background", which has this process's renders give way to an
+ * interactive preview on the same machine (see gpuShare.h).
+ *
+ * @return the remaining argument count.
+ */
+static int takeBackgroundOption(int argc, char **argv) {
+    int kept = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--background") == 0) {
+            gpuShare::setBackground(true);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    return kept;
+}
+
+/**
+ * Removes "--denoise-network WEIGHTS", loading the kernel-predicting
+ * denoiser's network from WEIGHTS, DENOISER_KPN_WEIGHTS raw little-endian
+ * floats laid out as denoiser.h describes, if it was given.
+ *
+ * @return the remaining argument count, or -1 if WEIGHTS cannot be read.
+ */
+static int takeDenoiseNetworkOption(int argc, char **argv) {
+    int kept = 0;
+    const char *weightsFile = NULL;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--denoise-network") == 0 && i + 1 < argc) {
+            weightsFile = argv[++i];
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    if (weightsFile == NULL) {
+        return kept;
+    }
+    std::vector<float> weights(DENOISER_KPN_WEIGHTS + 1);
+    FILE *in = fopen(weightsFile, "rb");
+    const size_t count = in != NULL ? fread(weights.data(), sizeof(float), weights.size(), in) : 0;
+    if (in != NULL) {
+        fclose(in);
+    }
+    if (count != DENOISER_KPN_WEIGHTS) {
+        printf("--denoise-network: %s does not hold %d floats\n", weightsFile, DENOISER_KPN_WEIGHTS);
+        return -1;
+    }
+    weights.pop_back();
+    pathtraceUseDenoiseNetwork(weights);
+    return kept;
+}
+
+/**
+ * pathtraceInit, with the default launch made wide enough to give every
+ * GPU at least one sample, and the power monitor sampling the GPUs.
+ */
+static void initPathtrace() {
+    pathtraceInit(scene);
+    ui_samplesPerLaunch = std::max(ui_samplesPerLaunch,
+        std::min(pathtraceDeviceCount(), MAX_SAMPLES_PER_LAUNCH));
+    powerMonitor::start(pathtraceDevices());
+}
+
+// pathtraceFree, reporting the telemetry counted on the devices and releasing the frame dump first
+static void freePathtrace() {
+    telemetry::flush();
+    frameDump::stop();
+    pathtraceFree();
+}
+
+/**
+ * Has the driver load each kernel's module on its first launch instead of
+ * all of them when the context is created (CUDA 11.7 on). Must run before
+ * any CUDA call; a CUDA_MODULE_LOADING already set is kept.
+ */
+static void enableLazyModuleLoading() {
+#ifdef _WIN32
+    if (getenv("CUDA_MODULE_LOADING") == NULL) {
+        _putenv_s("CUDA_MODULE_LOADING", "LAZY");
+    }
+#else
+    setenv("CUDA_MODULE_LOADING", "LAZY", 0);
+#endif
+}
+
 int main(int argc, char** argv) {
+    enableLazyModuleLoading();
     startTimeString = currentTimeString();
+    launchArguments.assign(argv, argv + argc);
+    argc = takeDeviceOption(argc, argv);
+    argc = takeImageOption(argc, argv);
+    argc = takeFrameDumpOption(argc, argv);
+    argc = takeTelemetryOption(argc, argv);
+    if (argc >= 0) {
+        argc = takeAutotuneOption(argc, argv);
+    }
+    if (argc >= 0) {
+        argc = takeDenoiseNetworkOption(argc, argv);
+    }
+    if (argc >= 0) {
+        argc = takeKernelCountersOption(argc, argv);
+    }
+    if (argc >= 0) {
+        argc = takeCaptureOption(argc, argv);
+    }
+    if (argc >= 0) {
+        argc = takeBackgroundOption(argc, argv);
+    }
+    if (argc < 0) {
+        return 1;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--benchmark") == 0) {
+        // Headless: no window or GL context is created
+        return runBenchmark(argc - 2, argv + 2);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--generate-scene") == 0) {
+        return runGenerateScene(argv[2], argc - 3, argv + 3);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--headless") == 0) {
+        return runHeadless(argv[2], argc - 3, argv + 3);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--animation") == 0) {
+        return runAnimation(argv[2], argc - 3, argv + 3);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--batch") == 0) {
+        return runBatch(argv[2], argc - 3, argv + 3);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--worker") == 0) {
+        return runWorker(argv[2], argc - 3, argv + 3);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--coordinator") == 0) {
+        return runCoordinator(argv[2], argc - 3, argv + 3);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "--server") == 0) {
+        return runServer(argv[2], argc - 3, argv + 3);
+    }
 
     if (argc < 2) {
         printf("Usage: %s SCENEFILE.txt\n", argv[0]);
+        printf("       %s --headless SCENEFILE.txt [--iterations N] [--samples-per-launch K] [--tile-rows R] [--adaptive ERROR] [--random-sampler] [--no-antialias] [--no-nee] [--deterministic] [--radiance-cache] [--photon-caustics] [--restir] [--mesh-lod] [--watertight] [--short-stack] [--light-bvh] [--path-guiding] [--bidirectional] [--tiled-paths] [--path-split M] [--compact-paths] [--checkpoint M] [--resume] [--cpu THREADS] [--denoise] [--denoiser atrous|guided|grid|optix|kpn] [--exr] [--reference FILE [--target-psnr DB] [--target-ssim S] [--target-flip E]] [--target-error E] [--time-limit SECONDS] [--training-input N] [--output BASENAME]\n", argv[0]);
+        printf("       %s --animation SCENEFILE.txt [--iterations N] [--samples-per-launch K] [--tile-rows R] [--adaptive ERROR] [--random-sampler] [--no-antialias] [--no-nee] [--deterministic] [--radiance-cache] [--photon-caustics] [--restir] [--mesh-lod] [--watertight] [--short-stack] [--light-bvh] [--path-guiding] [--bidirectional] [--tiled-paths] [--path-split M] [--compact-paths] [--denoise] [--denoiser atrous|guided|grid|optix|kpn] [--target-error E] [--time-limit SECONDS] [--output BASENAME]\n", argv[0]);
+        printf("       %s --batch JOBS.txt [--iterations N] [--samples-per-launch K] [--tile-rows R] [--adaptive ERROR] [--random-sampler] [--no-antialias] [--no-nee] [--deterministic] [--radiance-cache] [--photon-caustics] [--restir] [--mesh-lod] [--watertight] [--short-stack] [--light-bvh] [--path-guiding] [--bidirectional] [--tiled-paths] [--path-split M] [--compact-paths] [--denoise] [--denoise-batch N] [--denoiser atrous|guided|grid|optix|kpn] [--concurrent N]\n", argv[0]);
+        printf("       %s --benchmark OUT.csv [options] [SCENEFILE.txt...]\n", argv[0]);
+        printf("       %s --generate-scene OUT.txt [--objects N] [--materials N] [--lights N] [--distribution uniform|grid|clustered] [--sphere-fraction F] [--resolution N] [--depth N] [--seed N]\n", argv[0]);
+        printf("       %s --worker SCENEFILE.txt --worker-index I [--iterations N] [--samples-per-launch K] [--tile-rows R] [--adaptive ERROR] [--random-sampler] [--no-antialias] [--no-nee] [--deterministic] [--radiance-cache] [--photon-caustics] [--restir] [--mesh-lod] [--watertight] [--short-stack] [--light-bvh] [--path-guiding] [--bidirectional] [--tiled-paths] [--path-split M] [--compact-paths] [--checkpoint M] [--cpu THREADS] [--output FILE.acc]\n", argv[0]);
+        printf("       %s --coordinator SCENEFILE.txt [--target-samples N] [--poll SECONDS] [--denoise] [--denoiser atrous|guided|grid|optix|kpn] [--exr] [--output BASENAME] PARTIAL.acc...\n", argv[0]);
+        printf("       %s --server SCENEFILE.txt [--port N] [--codec jpeg|h264|hevc] [--quality Q] [--bitrate BITS] [--iterations N] [--denoise] [--denoiser atrous|guided|grid|optix|kpn]\n", argv[0]);
+        printf("Every mode also takes --gpus N to trace on N GPUs (0 for all visible), with\n");
+        printf("--display-gpu leaving the first to denoise and display what the others trace,\n");
+        printf("and --gpu-bvh to build the top-level BVH on the GPU, --paged-geometry to page\n");
+        printf("meshes from host memory as scenes too large for the GPU do, --share-geometry to\n");
+        printf("upload a scene's meshes once for every process rendering it on a GPU,\n");
+        printf("the first to upload them outliving the rest, --compact-meshes to\n");
+        printf("store mesh vertices in 16 bits (no hardware RT), --coherent-geoms to sort the\n");
+        printf("geoms by place and material at load, --virtual-textures to stream\n");
+        printf("texture tiles in as the camera needs them, --bvh sah|median to pick the\n");
+        printf("host BVH builder (median by default), --no-l2-persistence to stop\n");
+        printf("pinning the scene's hot arrays in L2 on sm_80 and newer, and --telemetry TARGET\n");
+        printf("[--telemetry-period SECONDS] to report ray throughput to stdout (-), a JSON\n");
+        printf("lines file or a Prometheus .prom file, with GPU power and samples per joule in\n");
+        printf("builds with ENABLE_NVML. --image-format png|qoi|pfm and --png-level N\n");
+        printf("(0 to store, up to 9) set how images are written, PNG at level 6 by default.\n");
+        printf("--frame-dump FILE [--frame-dump-slots N] [--frame-dump-every SAMPLES] maps FILE\n");
+        printf("and copies raw radiance sums and G-buffers into it for other processes to read.\n");
+        printf("The preview, --headless and --server take --autotune CACHEFILE to time the\n");
+        printf("pipeline choices on a scene's first launches and reuse the fastest from CACHEFILE.\n");
+        printf("--kernel-counters LAUNCHES reports CUPTI hardware counters per kernel over the\n");
+        printf("first LAUNCHES launches, in builds with ENABLE_CUPTI.\n");
+        printf("--denoise-network WEIGHTS loads the kpn denoiser's network (see denoiser.h).\n");
+        printf("--capture-bounce FILE [--capture-depth N] writes bounce N of the first split\n");
+        printf("launch's kernel inputs to FILE, for kernel_benchmark --replay FILE.\n");
+        printf("--background has --batch, --headless and --worker renders yield most of the\n");
+        printf("GPU to a preview running on the same machine.\n");
+        printf("--headless and --worker take --cpu THREADS\n");
+        printf("to trace on the host's cores instead (0 for all), without texture maps.\n");
         return 1;
     }
 
-    const char *sceneFile = argv[1];
+    // The scene is parsed and uploaded, creating the CUDA context, on its
+    // own thread while the window and GL context come up on this one
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::thread loader([&]() {
+        loadInteractiveScene(argv[1]);
+        initPathtrace();
+    });
+    const bool windowed = initWindow();
+    loader.join();
+    if (!windowed) {
+        printf("Could not create the preview window\n");
+        freePathtrace();
+        return 1;
+    }
+    initDisplay();
+    autotune::begin(sceneFileName, width, imageHeight());
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Ready to trace in %.1f ms\n", ms);
+
+    // GLFW main loop
+    mainLoop();
+
+    imageWriter::flush();
+    freePathtrace();
+    return 0;
+}
 
-    // Load scene file
+// Loads the scene and points the orbit camera at it, for the preview and --server
+static void loadInteractiveScene(const char *sceneFile) {
+    sceneFileName = sceneFile;
+    fileStamp(sceneFileName, loadedSceneStamp[0], loadedSceneStamp[1]);
+    pendingSceneStamp[0] = loadedSceneStamp[0];
+    pendingSceneStamp[1] = loadedSceneStamp[1];
     scene = new Scene(sceneFile);
 
     // Set up camera stuff from loaded path tracer settings
@@ -87,44 +994,1490 @@ int main(int argc, char** argv) {
     theta = glm::acos(glm::dot(glm::normalize(viewZY), glm::vec3(0, 1, 0)));
     ogLookAt = cam.lookAt;
     zoom = glm::length(cam.position - ogLookAt);
+}
 
-    // Initialize CUDA and GL components
-    init();
-
-    // GLFW main loop
-    mainLoop();
-
-    return 0;
+static std::string defaultImageName(int samples) {
+    std::ostringstream ss;
+    ss << renderState->imageName << "." << startTimeString << "." << samples << "samp";
+    return ss.str();
 }
 
+/**
+ * Snapshots the accumulated image and queues it for the image writer, so
+ * rendering continues while it is encoded.
+ */
 void saveImage() {
+    NvtxRange saveRange("save image", iteration);
+    std::vector<glm::vec3> snapshot;
+    pathtraceRetrieveImage(snapshot);
+
     float samples = iteration;
     // output image file
-    image img(width, height);
+    imageWriter::writeImageAsync(snapshot, width, imageHeight(), 1.0f / samples, defaultImageName(iteration));
+}
+
+/**
+ * Snapshots the beauty, denoised and G-buffer AOVs, one readback each (the
+ * G-buffer carries normal, depth and albedo), and queues them as one EXR.
+ */
+static void saveAovs(const std::string &filename) {
+    NvtxRange saveRange("save AOVs", iteration);
+    imageWriter::AovSnapshot snapshot;
+    pathtraceRetrieveImage(snapshot.beauty);
+    snapshot.beautyScale = 1.0f / iteration;
+    denoise(iteration, currentDenoiseOptions());
+    pathtraceRetrieveDenoised(snapshot.denoised);
+    pathtraceRetrieveGBuffer(snapshot.gBuffer);
+    imageWriter::writeAovsAsync(snapshot, width, imageHeight(), filename);
+}
 
-    for (int x = 0; x < width; x++) {
-        for (int y = 0; y < height; y++) {
-            int index = x + (y * width);
-            glm::vec3 pix = renderState->image[index];
-            img.setPixel(width - 1 - x, y, glm::vec3(pix) / samples);
+/**
+ * Writes the current accumulation of `samples` samples as outputName.png,
+ * denoised with the control panel's default settings if asked, or with
+ * `exr` every AOV as one multi-layer EXR. Blocks until the file is written.
+ */
+static void writeResult(const std::string &outputName, int samples, bool denoiseOutput, bool exrOutput) {
+    if (exrOutput) {
+        saveAovs(outputName);
+        imageWriter::flush();
+    } else if (denoiseOutput) {
+        std::vector<glm::vec3> denoised;
+        denoise(samples, currentDenoiseOptions());
+        pathtraceRetrieveDenoised(denoised);
+        imageWriter::writeImage(denoised, width, imageHeight(), 1.0f, outputName);
+    } else {
+        pathtraceRetrieveImage();
+        imageWriter::writeImage(renderState->image, width, imageHeight(), 1.0f / samples, outputName);
+    }
+}
+
+// Samples between --headless scorings against a --reference with targets
+#define HEADLESS_METRIC_SAMPLES 16
+
+// The --headless output so far against the reference: the image of
+// `samples` samples, or its denoised result
+static imageMetrics::Scores scoreOutput(int samples, bool denoised) {
+    if (denoised) {
+        denoise(samples, currentDenoiseOptions());
+        return imageMetrics::compare(pathtraceDeviceBuffers().denoised, 1.0f);
+    }
+    return imageMetrics::compare(pathtraceDeviceBuffers().image, 1.0f / samples);
+}
+
+// Samples before a render's error is first estimated, for a target error
+#define STOP_FIRST_CHECK_SAMPLES 16
+
+/**
+ * Stops a --headless or --animation render short of its iterations once
+ * its estimated relative error drops below `relativeError`, or `seconds`
+ * after beginRenderStop(): the scene's TARGETERROR and TIMELIMIT, or
+ * --target-error and --time-limit. The raw image's error comes from the
+ * on-device variance estimate (pathtraceRelativeError), and as it falls
+ * with the square root of the samples each estimate predicts when the
+ * next is worth taking, at most twice the samples on. A denoised render
+ * is judged by how much its denoised result still changes
+ * (pathtraceDenoisedChange), so it is checked at every doubling instead.
+ */
+struct RenderStop {
+    float relativeError;    // 0 for none
+    float seconds;          // 0 for none
+    bool denoised;
+    std::chrono::steady_clock::time_point start;
+    int nextCheck;          // samples at the next error estimate
+};
+
+// Command-line values, negative where not given, override the scene's
+static RenderStop renderStop(float relativeError, float seconds, bool denoised) {
+    RenderStop stop;
+    stop.relativeError = relativeError >= 0.0f ? relativeError : renderState->targetError;
+    stop.seconds = seconds >= 0.0f ? seconds : renderState->timeLimit;
+    stop.denoised = denoised;
+    stop.nextCheck = STOP_FIRST_CHECK_SAMPLES;
+    return stop;
+}
+
+static void beginRenderStop(RenderStop &stop) {
+    stop.start = std::chrono::steady_clock::now();
+    stop.nextCheck = STOP_FIRST_CHECK_SAMPLES;
+}
+
+// `target` held back to the next error estimate
+static int renderStopTarget(const RenderStop &stop, int target) {
+    return stop.relativeError > 0.0f ? std::min(target, stop.nextCheck) : target;
+}
+
+// After each launch, with `samples` traced: whether they are enough
+static bool renderStopReached(RenderStop &stop, int samples, const DenoiseOptions &denoiseOptions) {
+    if (stop.seconds > 0.0f && std::chrono::duration<double>(std::chrono::steady_clock::now() - stop.start).count()
+            >= stop.seconds) {
+        return true;
+    }
+    if (stop.relativeError <= 0.0f || samples < stop.nextCheck) {
+        return false;
+    }
+    float error;
+    if (stop.denoised) {
+        denoise(samples, denoiseOptions);
+        error = pathtraceDenoisedChange();
+        stop.nextCheck = 2 * samples;
+    } else {
+        error = pathtraceRelativeError(samples);
+        const double ratio = error / stop.relativeError;
+        stop.nextCheck = (int)std::min(std::max(samples * ratio * ratio, samples + 1.0), 2.0 * samples);
+    }
+    return error >= 0.0f && error < stop.relativeError;
+}
+
+/**
+ * Writes a synthetic scene file (see sceneGenerator.h) of --objects spheres
+ * and cubes, without touching the GPU.
+ */
+static int runGenerateScene(const char *sceneFile, int argc, char **argv) {
+    SceneGeneratorSettings settings = sceneGenerator::defaults();
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--objects") == 0 && i + 1 < argc) {
+            settings.objects = std::max(atoi(argv[++i]), 0);
+        } else if (!sceneGenerator::takeOption(i, argc, argv, settings)) {
+            printf("--generate-scene: unknown option %s\n", argv[i]);
+            return 1;
         }
     }
+    if (!sceneGenerator::write(sceneFile, settings)) {
+        printf("--generate-scene: cannot write %s\n", sceneFile);
+        return 1;
+    }
+    printf("Wrote %s: %d objects, %d materials, %d lights\n", sceneFile,
+        settings.objects, settings.materials, settings.lights);
+    return 0;
+}
 
-    std::string filename = renderState->imageName;
-    std::ostringstream ss;
-    ss << filename << "." << startTimeString << "." << samples << "samp";
-    filename = ss.str();
+/**
+ * --headless --cpu: the same render traced by cpuRenderer on `threads`
+ * host threads (0 for all) without touching CUDA, for machines with no
+ * GPU. Checkpoints and --resume use the same BASENAME.acc as the GPU path.
+ */
+static int runHeadlessCpu(const char *sceneFile, int iterations, int checkpoint, bool resume, int threads,
+        const std::string &outputName, const std::string &checkpointName) {
+    const PathtraceOptions options = currentPathtraceOptions();
+    accumulationFile::Accumulation accumulation;
+    if (resume && accumulationFile::read(checkpointName, accumulation)) {
+        if (accumulation.width != width || accumulation.height != imageHeight()
+                || !accumulationFile::unpack(accumulation)) {
+            printf("--headless: %s is not a checkpoint of this scene\n", checkpointName.c_str());
+            return 1;
+        }
+        accumulation.samples = std::min(accumulation.samples, iterations);
+        printf("%s: resumed at %d of %d samples from %s\n", sceneFile, accumulation.samples, iterations,
+            checkpointName.c_str());
+    } else {
+        accumulation = accumulationFile::Accumulation();
+        accumulation.width = width;
+        accumulation.height = imageHeight();
+        accumulation.samples = 0;
+        cpuRenderer::traceGBuffer(*scene, threads, accumulation.gBuffer);
+    }
+
+    while (accumulation.samples < iterations) {
+        const int target = checkpoint > 0 ? std::min(accumulation.samples + checkpoint, iterations) : iterations;
+        cpuRenderer::trace(*scene, accumulation.samples, target - accumulation.samples, options, threads,
+            accumulation.image, accumulation.moments);
+        accumulation.samples = target;
+        if (checkpoint > 0 && target < iterations && !accumulationFile::write(checkpointName, accumulation)) {
+            return 1;
+        }
+    }
+
+    imageWriter::writeImage(accumulation.image, width, imageHeight(), 1.0f / iterations, outputName);
+    printf("%s: %d iterations traced on the CPU written to %s.%s\n", sceneFile, iterations,
+        outputName.c_str(), imageWriter::extension());
+    if (checkpoint > 0 || resume) {
+        remove(checkpointName.c_str());
+    }
+    return 0;
+}
+
+/**
+ * Batch rendering without GLFW, OpenGL or the display texture: traces the scene's
+ * ITERATIONS (or --iterations) samples from the scene-file camera, denoises
+ * with the control panel's default settings if asked, and writes the PNG,
+ * or with --exr every AOV as one multi-layer EXR.
+ *
+ * With --checkpoint M the sums so far are saved to BASENAME.acc every M
+ * samples, copied back and written off the render loop, and --resume
+ * carries on from that file when it is there. Samples are seeded by their
+ * number, so a resumed render traces the same samples an uninterrupted
+ * one would have. The file is removed once the result is written.
+ * --cpu THREADS traces on the host instead (see runHeadlessCpu).
+ *
+ * --reference FILE, a PNG or PFM of the scene as this mode writes it,
+ * scores the output against it on the device every
+ * HEADLESS_METRIC_SAMPLES samples (see imageMetrics.h), after denoising
+ * with --denoise. The render stops early, writing what it has, once it
+ * reaches every target given: --target-psnr DB, --target-ssim S and
+ * --target-flip E, FLIP's error being the one that must drop below E.
+ * Without a reference, --target-error E and --time-limit SECONDS stop it
+ * on its own error estimate or the clock (see RenderStop).
+ *
+ * --training-input N writes a training pair for the kernel-predicting
+ * denoiser: the AOVs at N samples as BASENAME.input.exr, the network's
+ * noisy input with its G-buffer, and the finished render as BASENAME.exr,
+ * its reference.
+ */
+static int runHeadless(const char *sceneFile, int argc, char **argv) {
+    bool denoiseOutput = false;
+    std::string referenceName;
+    float targetPsnr = -1.0f;
+    float targetSsim = -1.0f;
+    float targetFlip = -1.0f;
+    float targetError = -1.0f;
+    float timeLimit = -1.0f;
+    bool exrOutput = false;
+    bool resume = false;
+    int iterations = -1;
+    int checkpoint = 0;
+    int cpuThreads = -1;
+    int trainingSamples = 0;
+    std::string outputName;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--denoise") == 0) {
+            denoiseOutput = true;
+        } else if (strcmp(argv[i], "--denoiser") == 0 && i + 1 < argc) {
+            ui_denoiseBackend = parseDenoiseBackend(argv[++i]);
+        } else if (strcmp(argv[i], "--exr") == 0) {
+            exrOutput = true;
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            resume = true;
+        } else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            cpuThreads = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--samples-per-launch") == 0 && i + 1 < argc) {
+            ui_samplesPerLaunch = std::max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--tile-rows") == 0 && i + 1 < argc) {
+            ui_tileRows = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc) {
+            ui_adaptiveSampling = true;
+            ui_adaptiveThreshold = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--random-sampler") == 0) {
+            ui_sampler = SAMPLER_RANDOM;
+        } else if (strcmp(argv[i], "--no-antialias") == 0) {
+            ui_antialias = false;
+        } else if (strcmp(argv[i], "--no-nee") == 0) {
+            ui_nextEventEstimation = false;
+        } else if (strcmp(argv[i], "--deterministic") == 0) {
+            ui_deterministic = true;
+        } else if (strcmp(argv[i], "--radiance-cache") == 0) {
+            ui_radianceCache = true;
+        } else if (strcmp(argv[i], "--photon-caustics") == 0) {
+            ui_photonCaustics = true;
+        } else if (strcmp(argv[i], "--restir") == 0) {
+            ui_restir = true;
+        } else if (strcmp(argv[i], "--mesh-lod") == 0) {
+            ui_meshLOD = true;
+        } else if (strcmp(argv[i], "--watertight") == 0) {
+            ui_watertight = true;
+        } else if (strcmp(argv[i], "--short-stack") == 0) {
+            ui_shortStack = true;
+        } else if (strcmp(argv[i], "--light-bvh") == 0) {
+            ui_lightTree = true;
+        } else if (strcmp(argv[i], "--path-guiding") == 0) {
+            ui_pathGuiding = true;
+        } else if (strcmp(argv[i], "--bidirectional") == 0) {
+            ui_bidirectional = true;
+        } else if (strcmp(argv[i], "--tiled-paths") == 0) {
+            ui_tiledPathOrder = true;
+        } else if (strcmp(argv[i], "--path-split") == 0 && i + 1 < argc) {
+            ui_pathSplit = glm::clamp(atoi(argv[++i]), 1, MAX_PATH_SPLIT);
+        } else if (strcmp(argv[i], "--compact-paths") == 0) {
+            ui_compactPaths = true;
+        } else if (strcmp(argv[i], "--reference") == 0 && i + 1 < argc) {
+            referenceName = argv[++i];
+        } else if (strcmp(argv[i], "--target-psnr") == 0 && i + 1 < argc) {
+            targetPsnr = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--target-ssim") == 0 && i + 1 < argc) {
+            targetSsim = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--target-flip") == 0 && i + 1 < argc) {
+            targetFlip = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--target-error") == 0 && i + 1 < argc) {
+            targetError = std::max((float)atof(argv[++i]), 0.0f);
+        } else if (strcmp(argv[i], "--time-limit") == 0 && i + 1 < argc) {
+            timeLimit = std::max((float)atof(argv[++i]), 0.0f);
+        } else if (strcmp(argv[i], "--training-input") == 0 && i + 1 < argc) {
+            trainingSamples = std::max(atoi(argv[++i]), 0);
+            exrOutput = true;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            outputName = argv[++i];
+        } else {
+            printf("--headless: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (cpuThreads >= 0 && (denoiseOutput || exrOutput)) {
+        printf("--headless: --cpu writes neither --denoise nor --exr output\n");
+        return 1;
+    }
+    if (cpuThreads >= 0 && (!referenceName.empty() || targetError >= 0.0f || timeLimit >= 0.0f)) {
+        printf("--headless: --cpu neither scores against a --reference nor stops early\n");
+        return 1;
+    }
+    const bool targets = targetPsnr >= 0.0f || targetSsim >= 0.0f || targetFlip >= 0.0f;
+    if (targets && referenceName.empty()) {
+        printf("--headless: --target-psnr, --target-ssim and --target-flip need a --reference\n");
+        return 1;
+    }
+
+    scene = new Scene(sceneFile);
+    renderState = &scene->state;
+    width = renderState->camera.resolution.x;
+    height = renderState->camera.resolution.y;
+    if (iterations < 1) {
+        iterations = renderState->iterations;
+    }
+    if (outputName.empty()) {
+        outputName = defaultImageName(iterations) + (denoiseOutput ? ".denoised" : "");
+    }
+
+    const std::string checkpointName = outputName + ".acc";
+    if (cpuThreads >= 0) {
+        return runHeadlessCpu(sceneFile, iterations, checkpoint, resume, cpuThreads, outputName,
+            checkpointName);
+    }
 
-    // CHECKITOUT
-    img.savePNG(filename);
-    //img.saveHDR(filename);  // Save a Radiance HDR file
+    initPathtrace();
+    std::string referenceError;
+    if (!referenceName.empty() && !imageMetrics::loadReference(referenceName, width, imageHeight(),
+            referenceError)) {
+        printf("--headless: %s\n", referenceError.c_str());
+        freePathtrace();
+        return 1;
+    }
+    autotune::begin(sceneFile, width, imageHeight());
+    pathtraceReset();
+    iteration = 0;
+    RenderStop stop = renderStop(targetError, timeLimit, denoiseOutput);
+    beginRenderStop(stop);
+    accumulationFile::Accumulation accumulation;
+    if (resume && accumulationFile::read(checkpointName, accumulation)) {
+        if (!pathtraceMergeAccumulation(accumulation, true)) {
+            printf("--headless: %s is not a checkpoint of this scene\n", checkpointName.c_str());
+            freePathtrace();
+            return 1;
+        }
+        iteration = std::min(accumulation.samples, iterations);
+        printf("%s: resumed at %d of %d samples from %s\n", sceneFile, iteration, iterations,
+            checkpointName.c_str());
+    }
+
+    while (iteration < iterations) {
+        // Launches never straddle a checkpoint, so each lands exactly
+        int target = checkpoint > 0 ? std::min((iteration / checkpoint + 1) * checkpoint, iterations)
+            : iterations;
+        // Or a scoring
+        int launchTarget = renderStopTarget(stop, targets
+            ? std::min(target, (iteration / HEADLESS_METRIC_SAMPLES + 1) * HEADLESS_METRIC_SAMPLES) : target);
+        // Or the training input
+        if (iteration < trainingSamples) {
+            launchTarget = std::min(launchTarget, trainingSamples);
+        }
+        // Read per launch, as the tuner's winner changes them
+        traceNextSamples(0, launchTarget, currentPathtraceOptions());
+        if (pathtraceCheckpointReady() || (iteration == target && iteration < iterations)) {
+            // Collect a landed copy, or make room for the next one
+            accumulation.width = width;
+            accumulation.height = imageHeight();
+            accumulation.samples = pathtraceFinishCheckpoint(accumulation.packed, accumulation.gBuffer);
+            if (accumulation.samples > 0) {
+                imageWriter::writeAccumulationAsync(accumulation, checkpointName);
+            }
+        }
+        if (checkpoint > 0 && iteration == target && iteration < iterations) {
+            pathtraceBeginCheckpoint(iteration);
+        }
+        if (iteration == trainingSamples && iteration < iterations) {
+            saveAovs(outputName + ".input");
+        }
+        if (targets && iteration % HEADLESS_METRIC_SAMPLES == 0 && iteration < iterations) {
+            const imageMetrics::Scores scores = scoreOutput(iteration, denoiseOutput);
+            if ((targetPsnr < 0.0f || scores.psnr >= targetPsnr) && (targetSsim < 0.0f || scores.ssim >= targetSsim)
+                    && (targetFlip < 0.0f || scores.flip <= targetFlip)) {
+                printf("%s: reached the targets at %d samples\n", sceneFile, iteration);
+                break;
+            }
+        }
+        if (iteration < iterations && renderStopReached(stop, iteration, currentDenoiseOptions())) {
+            printf("%s: stopped at %d samples\n", sceneFile, iteration);
+            break;
+        }
+    }
+
+    if (!referenceName.empty()) {
+        const imageMetrics::Scores scores = scoreOutput(iteration, denoiseOutput);
+        printf("%s: PSNR %.2f dB, SSIM %.4f, FLIP %.4f against %s\n", sceneFile, scores.psnr, scores.ssim,
+            scores.flip, referenceName.c_str());
+        imageMetrics::release();
+    }
+    writeResult(outputName, iteration, denoiseOutput, exrOutput);
+    printf("%s: %d iterations written to %s.%s\n", sceneFile, iteration, outputName.c_str(),
+        exrOutput ? "exr" : imageWriter::extension());
+    if (checkpoint > 0 || resume) {
+        // A finished render leaves no checkpoint behind to resume from
+        imageWriter::flush();
+        remove(checkpointName.c_str());
+    }
+
+    freePathtrace();
+    return 0;
+}
+
+/**
+ * Renders every frame of the scene's camera and geom KEYFRAME paths back
+ * to back as BASENAME.NNNN.png, headless. Scene, BVH and device buffers
+ * are set up once; each frame uploads only the moved geoms' poses, which
+ * the GPU refits the BVH to (see pathtraceAnimateGeoms), and resets the
+ * accumulation. Frame N's readback runs
+ * on its own stream and its encode on the image writer while frame N+1
+ * traces. A target error or time limit (see RenderStop) ends each frame
+ * on its own.
+ */
+static int runAnimation(const char *sceneFile, int argc, char **argv) {
+    bool denoiseOutput = false;
+    int iterations = -1;
+    float targetError = -1.0f;
+    float timeLimit = -1.0f;
+    std::string outputName;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--denoise") == 0) {
+            denoiseOutput = true;
+        } else if (strcmp(argv[i], "--denoiser") == 0 && i + 1 < argc) {
+            ui_denoiseBackend = parseDenoiseBackend(argv[++i]);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--samples-per-launch") == 0 && i + 1 < argc) {
+            ui_samplesPerLaunch = std::max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--tile-rows") == 0 && i + 1 < argc) {
+            ui_tileRows = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc) {
+            ui_adaptiveSampling = true;
+            ui_adaptiveThreshold = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--random-sampler") == 0) {
+            ui_sampler = SAMPLER_RANDOM;
+        } else if (strcmp(argv[i], "--no-antialias") == 0) {
+            ui_antialias = false;
+        } else if (strcmp(argv[i], "--no-nee") == 0) {
+            ui_nextEventEstimation = false;
+        } else if (strcmp(argv[i], "--deterministic") == 0) {
+            ui_deterministic = true;
+        } else if (strcmp(argv[i], "--radiance-cache") == 0) {
+            ui_radianceCache = true;
+        } else if (strcmp(argv[i], "--photon-caustics") == 0) {
+            ui_photonCaustics = true;
+        } else if (strcmp(argv[i], "--restir") == 0) {
+            ui_restir = true;
+        } else if (strcmp(argv[i], "--mesh-lod") == 0) {
+            ui_meshLOD = true;
+        } else if (strcmp(argv[i], "--watertight") == 0) {
+            ui_watertight = true;
+        } else if (strcmp(argv[i], "--short-stack") == 0) {
+            ui_shortStack = true;
+        } else if (strcmp(argv[i], "--light-bvh") == 0) {
+            ui_lightTree = true;
+        } else if (strcmp(argv[i], "--path-guiding") == 0) {
+            ui_pathGuiding = true;
+        } else if (strcmp(argv[i], "--bidirectional") == 0) {
+            ui_bidirectional = true;
+        } else if (strcmp(argv[i], "--tiled-paths") == 0) {
+            ui_tiledPathOrder = true;
+        } else if (strcmp(argv[i], "--path-split") == 0 && i + 1 < argc) {
+            ui_pathSplit = glm::clamp(atoi(argv[++i]), 1, MAX_PATH_SPLIT);
+        } else if (strcmp(argv[i], "--compact-paths") == 0) {
+            ui_compactPaths = true;
+        } else if (strcmp(argv[i], "--target-error") == 0 && i + 1 < argc) {
+            targetError = std::max((float)atof(argv[++i]), 0.0f);
+        } else if (strcmp(argv[i], "--time-limit") == 0 && i + 1 < argc) {
+            timeLimit = std::max((float)atof(argv[++i]), 0.0f);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            outputName = argv[++i];
+        } else {
+            printf("--animation: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    scene = new Scene(sceneFile);
+    renderState = &scene->state;
+    width = renderState->camera.resolution.x;
+    height = renderState->camera.resolution.y;
+    const int frames = scene->animationFrames();
+    if (frames == 0) {
+        printf("--animation: %s has no KEYFRAMEs\n", sceneFile);
+        return 1;
+    }
+    if (iterations < 1) {
+        iterations = renderState->iterations;
+    }
+    if (outputName.empty()) {
+        outputName = renderState->imageName + "." + startTimeString;
+    }
+
+    initPathtrace();
+    const PathtraceOptions options = currentPathtraceOptions();
+    const DenoiseOptions denoiseOptions = currentDenoiseOptions();
+    // Each frame stops on its own
+    RenderStop stop = renderStop(targetError, timeLimit, denoiseOutput);
+    long long samples = 0;
+    std::vector<glm::vec3> pixels;
+    for (int frame = 0; frame <= frames; frame++) {
+        if (frame < frames) {
+            NvtxRange frameRange("animation frame", frame);
+            scene->setCameraFrame(frame);
+            pathtraceAnimateGeoms(scene->setGeomFrame(frame));
+            pathtraceReset();
+            beginRenderStop(stop);
+            for (iteration = 0; iteration < iterations; ) {
+                traceNextSamples(frame, renderStopTarget(stop, iterations), options);
+                if (iteration < iterations && renderStopReached(stop, iteration, denoiseOptions)) {
+                    break;
+                }
+            }
+            samples += iteration;
+            if (denoiseOutput) {
+                denoise(iteration, denoiseOptions);
+            }
+        }
+
+        // The previous frame's copy has been overlapping this one's tracing
+        if (frame > 0) {
+            pathtraceFinishReadback(pixels);
+            std::ostringstream ss;
+            ss << outputName << "." << std::setfill('0') << std::setw(4) << frame - 1;
+            imageWriter::writeImageAsync(pixels, width, imageHeight(), 1.0f, ss.str());
+        }
+        if (frame < frames) {
+            pathtraceBeginReadback(iteration, denoiseOutput);
+        }
+    }
+    imageWriter::flush();
+    printf("%s: %d frames of %.1f iterations on average written to %s.NNNN.%s\n", sceneFile, frames,
+        (double)samples / frames, outputName.c_str(), imageWriter::extension());
+
+    freePathtrace();
+    return 0;
+}
+
+// One view of a --batch job list
+struct BatchJob {
+    std::string sceneFile;
+    std::string outputName;
+    bool hasCamera;         // else the scene file's camera
+    glm::vec3 eye;
+    glm::vec3 lookAt;
+    bool hasUp;             // else the scene camera's up
+    glm::vec3 up;
+    int iterations;         // 0 for --iterations or the scene's ITERATIONS
+    int priority;           // higher first; 0 by default
+};
+
+/**
+ * Reads a job list: one view per line, as
+ *
+ *     SCENEFILE OUTPUT [eye X Y Z lookat X Y Z [up X Y Z]] [iterations N] [priority P]
+ *
+ * Blank lines and lines starting with # are skipped. Scene paths are
+ * relative to the working directory, like on the command line.
+ */
+static bool readBatchJobs(const char *jobFile, std::vector<BatchJob> &jobs) {
+    std::ifstream in(jobFile);
+    if (!in) {
+        printf("--batch: cannot read %s\n", jobFile);
+        return false;
+    }
+    std::string line;
+    for (int lineNumber = 1; std::getline(in, line); lineNumber++) {
+        std::istringstream tokens(line);
+        BatchJob job;
+        if (!(tokens >> job.sceneFile) || job.sceneFile[0] == '#') {
+            continue;
+        }
+        job.hasCamera = false;
+        job.hasUp = false;
+        job.iterations = 0;
+        job.priority = 0;
+        bool valid = (bool)(tokens >> job.outputName);
+        bool hasEye = false;
+        bool hasLookAt = false;
+        std::string key;
+        while (valid && tokens >> key) {
+            if (key == "eye") {
+                valid = (bool)(tokens >> job.eye.x >> job.eye.y >> job.eye.z);
+                hasEye = true;
+            } else if (key == "lookat") {
+                valid = (bool)(tokens >> job.lookAt.x >> job.lookAt.y >> job.lookAt.z);
+                hasLookAt = true;
+            } else if (key == "up") {
+                valid = (bool)(tokens >> job.up.x >> job.up.y >> job.up.z);
+                job.hasUp = true;
+            } else if (key == "iterations") {
+                valid = (bool)(tokens >> job.iterations);
+            } else if (key == "priority") {
+                valid = (bool)(tokens >> job.priority);
+            } else {
+                valid = false;
+            }
+        }
+        if (!valid || hasEye != hasLookAt || (job.hasUp && !hasEye)) {
+            printf("--batch: %s:%d: expected SCENEFILE OUTPUT [eye X Y Z lookat X Y Z [up X Y Z]]"
+                " [iterations N] [priority P]\n", jobFile, lineNumber);
+            return false;
+        }
+        job.hasCamera = hasEye;
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// --batch --concurrent admits another child only while the busiest GPU was
+// busy less than this percent of NVML's last sample period
+#define BATCH_ADMIT_UTILIZATION 90
+// and waits this long after each admission for its load to show up there
+#define BATCH_ADMIT_SETTLE_MS 2000
+
+// Options that name a file every child would write over, kept to the parent
+static const char *const BATCH_PARENT_OPTIONS[] = {
+    "--batch", "--concurrent", "--telemetry", "--telemetry-period", "--frame-dump",
+    "--frame-dump-slots", "--frame-dump-every", "--capture-bounce", "--capture-depth",
+    "--kernel-counters",
+};
+
+static std::string shellQuote(const std::string &argument) {
+#ifdef _WIN32
+    return "\"" + argument + "\"";
+#else
+    std::string quoted = "'";
+    for (size_t i = 0; i < argument.size(); i++) {
+        quoted += argument[i] == '\'' ? std::string("'\\''") : std::string(1, argument[i]);
+    }
+    return quoted + "'";
+#endif
+}
+
+static void writeBatchJob(std::ofstream &out, const BatchJob &job) {
+    out << std::setprecision(9) << job.sceneFile << " " << job.outputName;
+    if (job.hasCamera) {
+        out << " eye " << job.eye.x << " " << job.eye.y << " " << job.eye.z
+            << " lookat " << job.lookAt.x << " " << job.lookAt.y << " " << job.lookAt.z;
+        if (job.hasUp) {
+            out << " up " << job.up.x << " " << job.up.y << " " << job.up.z;
+        }
+    }
+    if (job.iterations > 0) {
+        out << " iterations " << job.iterations;
+    }
+    out << "\n";
+}
+
+/**
+ * --batch --concurrent N: packs up to N of a job list's scenes onto the
+ * GPUs at once, for lists of small renders that one at a time leave most
+ * of a large GPU idle. The renderer holds one scene per process, so each
+ * scene's views (`jobs` is sorted by priority, then scene) go to a child
+ * --batch of their own, launched with this command line. Children start
+ * highest priority first, and after the first only while NVML measures
+ * the GPUs below BATCH_ADMIT_UTILIZATION percent busy; without NVML the
+ * count N alone limits them. Under MPS their kernels share the GPU
+ * outright; without it the driver time-slices the contexts, and one
+ * child's parse, upload, readback and encode still overlap another's
+ * tracing.
+ */
+static int runConcurrentBatch(const char *jobFile, const std::vector<BatchJob> &jobs, int concurrent) {
+    std::vector<std::string> partFiles;
+    for (size_t j = 0; j < jobs.size(); j++) {
+        if (j == 0 || jobs[j].sceneFile != jobs[j - 1].sceneFile || jobs[j].priority != jobs[j - 1].priority) {
+            std::ostringstream name;
+            name << jobFile << "." << partFiles.size() << ".jobs";
+            partFiles.push_back(name.str());
+            std::ofstream(partFiles.back().c_str(), std::ios::trunc);
+        }
+        std::ofstream out(partFiles.back().c_str(), std::ios::app);
+        writeBatchJob(out, jobs[j]);
+        if (!out) {
+            printf("--batch: cannot write %s\n", partFiles.back().c_str());
+            return 1;
+        }
+    }
+
+    std::string options;
+    for (size_t i = 1; i < launchArguments.size(); i++) {
+        bool parentOnly = false;
+        for (size_t k = 0; k < sizeof(BATCH_PARENT_OPTIONS) / sizeof(BATCH_PARENT_OPTIONS[0]); k++) {
+            parentOnly = parentOnly || launchArguments[i] == BATCH_PARENT_OPTIONS[k];
+        }
+        if (parentOnly) {
+            i++;
+        } else {
+            options += " " + shellQuote(launchArguments[i]);
+        }
+    }
+
+    powerMonitor::start(pathtraceDevices());
+    std::mutex childMutex;
+    std::condition_variable childExited;
+    int running = 0;
+    int failed = 0;
+    std::vector<std::thread> children;
+    for (size_t p = 0; p < partFiles.size(); p++) {
+        {
+            std::unique_lock<std::mutex> lock(childMutex);
+            while (running > 0 && (running >= concurrent
+                    || powerMonitor::utilization() >= BATCH_ADMIT_UTILIZATION)) {
+                childExited.wait_for(lock, std::chrono::milliseconds(POWER_SAMPLE_MS * 4));
+            }
+            running++;
+        }
+        const std::string command = shellQuote(launchArguments[0]) + " --batch " + shellQuote(partFiles[p]) + options;
+        children.push_back(std::thread([&, command, p]() {
+            const int status = std::system(command.c_str());
+            std::lock_guard<std::mutex> lock(childMutex);
+            if (status != 0) {
+                printf("--batch: %s exited with status %d\n", partFiles[p].c_str(), status);
+                failed++;
+            }
+            running--;
+            childExited.notify_one();
+        }));
+        if (powerMonitor::available() && p + 1 < partFiles.size()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(BATCH_ADMIT_SETTLE_MS));
+        }
+    }
+    for (size_t c = 0; c < children.size(); c++) {
+        children[c].join();
+    }
+    for (size_t p = 0; p < partFiles.size(); p++) {
+        remove(partFiles[p].c_str());
+    }
+    printf("%s: %zu views in %zu concurrent jobs, %d failed\n", jobFile, jobs.size(), partFiles.size(), failed);
+    return failed > 0 ? 1 : 0;
+}
+
+/**
+ * Renders every view of a job list (see readBatchJobs) to OUTPUT.png in one
+ * process, headless. Jobs are grouped by scene, so each scene is parsed
+ * and uploaded once and stays resident for all of its cameras; only the
+ * accumulation is reset between them. A scene of the same resolution as
+ * the previous one is swapped in with pathtraceUpdateScene, keeping every
+ * image and path buffer. Each view's readback and encode overlap the next
+ * view's tracing, as in --animation. Higher priority views go first, and
+ * --concurrent N renders up to N scenes at once (see runConcurrentBatch).
+ * --denoise-batch N queues up to N denoised views of a resolution and
+ * filters them together with A-Trous (see pathtraceDenoiseBatch), as a
+ * dataset of many small renders would otherwise pay a launch per level
+ * for each.
+ */
+static int runBatch(const char *jobFile, int argc, char **argv) {
+    bool denoiseOutput = false;
+    int denoiseBatch = 0;
+    int defaultIterations = -1;
+    int concurrent = 1;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--denoise") == 0) {
+            denoiseOutput = true;
+        } else if (strcmp(argv[i], "--denoise-batch") == 0 && i + 1 < argc) {
+            denoiseOutput = true;
+            denoiseBatch = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--concurrent") == 0 && i + 1 < argc) {
+            concurrent = std::max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--denoiser") == 0 && i + 1 < argc) {
+            ui_denoiseBackend = parseDenoiseBackend(argv[++i]);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            defaultIterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--samples-per-launch") == 0 && i + 1 < argc) {
+            ui_samplesPerLaunch = std::max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--tile-rows") == 0 && i + 1 < argc) {
+            ui_tileRows = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc) {
+            ui_adaptiveSampling = true;
+            ui_adaptiveThreshold = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--random-sampler") == 0) {
+            ui_sampler = SAMPLER_RANDOM;
+        } else if (strcmp(argv[i], "--no-antialias") == 0) {
+            ui_antialias = false;
+        } else if (strcmp(argv[i], "--no-nee") == 0) {
+            ui_nextEventEstimation = false;
+        } else if (strcmp(argv[i], "--deterministic") == 0) {
+            ui_deterministic = true;
+        } else if (strcmp(argv[i], "--radiance-cache") == 0) {
+            ui_radianceCache = true;
+        } else if (strcmp(argv[i], "--photon-caustics") == 0) {
+            ui_photonCaustics = true;
+        } else if (strcmp(argv[i], "--restir") == 0) {
+            ui_restir = true;
+        } else if (strcmp(argv[i], "--mesh-lod") == 0) {
+            ui_meshLOD = true;
+        } else if (strcmp(argv[i], "--watertight") == 0) {
+            ui_watertight = true;
+        } else if (strcmp(argv[i], "--short-stack") == 0) {
+            ui_shortStack = true;
+        } else if (strcmp(argv[i], "--light-bvh") == 0) {
+            ui_lightTree = true;
+        } else if (strcmp(argv[i], "--path-guiding") == 0) {
+            ui_pathGuiding = true;
+        } else if (strcmp(argv[i], "--bidirectional") == 0) {
+            ui_bidirectional = true;
+        } else if (strcmp(argv[i], "--tiled-paths") == 0) {
+            ui_tiledPathOrder = true;
+        } else if (strcmp(argv[i], "--path-split") == 0 && i + 1 < argc) {
+            ui_pathSplit = glm::clamp(atoi(argv[++i]), 1, MAX_PATH_SPLIT);
+        } else if (strcmp(argv[i], "--compact-paths") == 0) {
+            ui_compactPaths = true;
+        } else {
+            printf("--batch: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    std::vector<BatchJob> jobs;
+    if (!readBatchJobs(jobFile, jobs)) {
+        return 1;
+    }
+    if (jobs.empty()) {
+        printf("--batch: %s lists no jobs\n", jobFile);
+        return 1;
+    }
+    std::stable_sort(jobs.begin(), jobs.end(), [](const BatchJob &a, const BatchJob &b) {
+        return a.priority != b.priority ? a.priority > b.priority : a.sceneFile < b.sceneFile;
+    });
+    if (concurrent > 1) {
+        return runConcurrentBatch(jobFile, jobs, concurrent);
+    }
+
+    const DenoiseOptions denoiseOptions = currentDenoiseOptions();
+    std::vector<glm::vec3> pixels;
+    const BatchJob *pending = NULL;     // job whose readback is in flight
+    int pendingWidth = 0;
+    int pendingHeight = 0;
+    std::vector<const BatchJob *> batched;     // jobs queued for the batch denoiser
+    std::vector<std::vector<glm::vec3>> denoised;
+    int batchedWidth = 0;
+    int batchedHeight = 0;
+    auto flushBatch = [&]() {
+        const int count = pathtraceDenoiseBatch(denoiseOptions, denoised);
+        for (int k = 0; k < count; k++) {
+            imageWriter::writeImageAsync(denoised[k], batchedWidth, batchedHeight, 1.0f, batched[k]->outputName);
+        }
+        batched.clear();
+    };
+    Camera sceneCamera;
+    int scenes = 0;
+    for (size_t j = 0; j <= jobs.size(); j++) {
+        const bool sceneChange = j < jobs.size() && (j == 0 || jobs[j].sceneFile != jobs[j - 1].sceneFile);
+        if (j < jobs.size() && sceneChange) {
+            if (pending != NULL) {
+                pathtraceFinishReadback(pixels);
+                imageWriter::writeImageAsync(pixels, pendingWidth, pendingHeight, 1.0f, pending->outputName);
+                pending = NULL;
+            }
+            Scene *next = new Scene(jobs[j].sceneFile);
+            if (scene == NULL) {
+                scene = next;
+                initPathtrace();
+            } else if (next->state.camera.resolution == scene->state.camera.resolution) {
+                pathtraceUpdateScene(next);
+                scene = next;
+            } else {
+                flushBatch();
+                freePathtrace();
+                scene = next;
+                initPathtrace();
+            }
+            renderState = &scene->state;
+            width = renderState->camera.resolution.x;
+            height = renderState->camera.resolution.y;
+            sceneCamera = renderState->camera;
+            scenes++;
+        }
+
+        if (j < jobs.size()) {
+            const BatchJob &job = jobs[j];
+            NvtxRange jobRange("batch job", (int)j);
+            renderState->camera = sceneCamera;
+            if (job.hasCamera) {
+                scene->setCamera(job.eye, job.lookAt, job.hasUp ? job.up : sceneCamera.up);
+            }
+            const int iterations = job.iterations > 0 ? job.iterations
+                : defaultIterations > 0 ? defaultIterations : renderState->iterations;
+            const PathtraceOptions options = currentPathtraceOptions();
+            pathtraceReset();
+            for (iteration = 0; iteration < iterations; ) {
+                traceNextSamples(0, iterations, options);
+            }
+            if (denoiseBatch > 1 && pathtraceQueueDenoise(iterations, denoiseBatch)) {
+                batched.push_back(&job);
+                batchedWidth = width;
+                batchedHeight = imageHeight();
+                if ((int)batched.size() == denoiseBatch) {
+                    flushBatch();
+                }
+                printf("%s: %d iterations of %s\n", job.outputName.c_str(), iterations, job.sceneFile.c_str());
+                continue;
+            }
+            if (denoiseOutput) {
+                denoise(iterations, denoiseOptions);
+            }
+
+            // The previous view's copy has been overlapping this one's tracing
+            if (pending != NULL) {
+                pathtraceFinishReadback(pixels);
+                imageWriter::writeImageAsync(pixels, pendingWidth, pendingHeight, 1.0f, pending->outputName);
+            }
+            pathtraceBeginReadback(iterations, denoiseOutput);
+            pending = &job;
+            pendingWidth = width;
+            pendingHeight = imageHeight();
+            printf("%s: %d iterations of %s\n", job.outputName.c_str(), iterations, job.sceneFile.c_str());
+        } else {
+            if (pending != NULL) {
+                pathtraceFinishReadback(pixels);
+                imageWriter::writeImageAsync(pixels, pendingWidth, pendingHeight, 1.0f, pending->outputName);
+            }
+            flushBatch();
+        }
+    }
+    imageWriter::flush();
+    printf("%s: %zu views of %d scenes written\n", jobFile, jobs.size(), scenes);
+
+    freePathtrace();
+    return 0;
 }
 
-void runCuda() {
+/**
+ * One node of a distributed render, headless: traces the scene's
+ * ITERATIONS (or --iterations) samples, seeded apart from every other
+ * --worker-index, and every --checkpoint samples and at the end replaces
+ * FILE.acc with its sums so far. Workers share nothing with the
+ * coordinator but a filesystem, so one that lags or dies only leaves its
+ * last checkpoint behind. With --cpu THREADS it traces on the host's
+ * cores, adding a machine without a GPU to the render.
+ */
+static int runWorker(const char *sceneFile, int argc, char **argv) {
+    int workerIndex = -1;
+    int iterations = -1;
+    int checkpoint = 64;
+    int cpuThreads = -1;
+    std::string outputName;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--worker-index") == 0 && i + 1 < argc) {
+            workerIndex = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            cpuThreads = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--samples-per-launch") == 0 && i + 1 < argc) {
+            ui_samplesPerLaunch = std::max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--tile-rows") == 0 && i + 1 < argc) {
+            ui_tileRows = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc) {
+            ui_adaptiveSampling = true;
+            ui_adaptiveThreshold = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--random-sampler") == 0) {
+            ui_sampler = SAMPLER_RANDOM;
+        } else if (strcmp(argv[i], "--no-antialias") == 0) {
+            ui_antialias = false;
+        } else if (strcmp(argv[i], "--no-nee") == 0) {
+            ui_nextEventEstimation = false;
+        } else if (strcmp(argv[i], "--deterministic") == 0) {
+            ui_deterministic = true;
+        } else if (strcmp(argv[i], "--radiance-cache") == 0) {
+            ui_radianceCache = true;
+        } else if (strcmp(argv[i], "--photon-caustics") == 0) {
+            ui_photonCaustics = true;
+        } else if (strcmp(argv[i], "--restir") == 0) {
+            ui_restir = true;
+        } else if (strcmp(argv[i], "--mesh-lod") == 0) {
+            ui_meshLOD = true;
+        } else if (strcmp(argv[i], "--watertight") == 0) {
+            ui_watertight = true;
+        } else if (strcmp(argv[i], "--short-stack") == 0) {
+            ui_shortStack = true;
+        } else if (strcmp(argv[i], "--light-bvh") == 0) {
+            ui_lightTree = true;
+        } else if (strcmp(argv[i], "--path-guiding") == 0) {
+            ui_pathGuiding = true;
+        } else if (strcmp(argv[i], "--bidirectional") == 0) {
+            ui_bidirectional = true;
+        } else if (strcmp(argv[i], "--tiled-paths") == 0) {
+            ui_tiledPathOrder = true;
+        } else if (strcmp(argv[i], "--path-split") == 0 && i + 1 < argc) {
+            ui_pathSplit = glm::clamp(atoi(argv[++i]), 1, MAX_PATH_SPLIT);
+        } else if (strcmp(argv[i], "--compact-paths") == 0) {
+            ui_compactPaths = true;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            outputName = argv[++i];
+        } else {
+            printf("--worker: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (workerIndex < 0 || workerIndex >= DISTRIBUTED_MAX_WORKERS) {
+        printf("--worker: --worker-index must be in [0, %d)\n", DISTRIBUTED_MAX_WORKERS);
+        return 1;
+    }
+
+    scene = new Scene(sceneFile);
+    renderState = &scene->state;
+    width = renderState->camera.resolution.x;
+    height = renderState->camera.resolution.y;
+    if (iterations < 1) {
+        iterations = renderState->iterations;
+    }
+    // Past the stride a worker would reuse the next one's seeds
+    iterations = std::min(iterations, DISTRIBUTED_SEED_STRIDE);
+    if (checkpoint < 1) {
+        checkpoint = iterations;
+    }
+    if (outputName.empty()) {
+        std::ostringstream ss;
+        ss << renderState->imageName << ".worker" << workerIndex << ".acc";
+        outputName = ss.str();
+    }
+
+    PathtraceOptions options = currentPathtraceOptions();
+    options.seedOffset = workerIndex * DISTRIBUTED_SEED_STRIDE;
+    accumulationFile::Accumulation accumulation;
+    accumulation.width = width;
+    accumulation.height = imageHeight();
+    if (cpuThreads >= 0) {
+        // The same partial a GPU worker writes, so the coordinator merges either
+        accumulation.samples = 0;
+        cpuRenderer::traceGBuffer(*scene, cpuThreads, accumulation.gBuffer);
+        while (accumulation.samples < iterations) {
+            const int target = std::min(accumulation.samples + checkpoint, iterations);
+            cpuRenderer::trace(*scene, accumulation.samples, target - accumulation.samples, options,
+                cpuThreads, accumulation.image, accumulation.moments);
+                accumulation.samples = target;
+            if (!accumulationFile::write(outputName, accumulation)) {
+                return 1;
+            }
+            printf("%s: CPU worker %d checkpointed %d of %d samples to %s\n", sceneFile, workerIndex,
+                accumulation.samples, iterations, outputName.c_str());
+        }
+        return 0;
+    }
+
+    initPathtrace();
+    pathtraceReset();
+    for (iteration = 0; iteration < iterations; ) {
+        // Launches never straddle a checkpoint, so each lands exactly
+        int nextCheckpoint = std::min((iteration / checkpoint + 1) * checkpoint, iterations);
+        traceNextSamples(0, nextCheckpoint, options);
+        if (iteration == nextCheckpoint) {
+            NvtxRange checkpointRange("worker checkpoint", iteration);
+            pathtraceRetrievePacked(accumulation.packed);
+            pathtraceRetrieveGBuffer(accumulation.gBuffer);
+            accumulation.samples = iteration;
+            if (!accumulationFile::write(outputName, accumulation)) {
+                freePathtrace();
+                return 1;
+            }
+            printf("%s: worker %d checkpointed %d of %d samples to %s (sums packed to %zu KB)\n", sceneFile,
+                workerIndex, iteration, iterations, outputName.c_str(), accumulation.packed.size() >> 10);
+        }
+    }
+
+    freePathtrace();
+    return 0;
+}
+
+/**
+ * Merges the workers' partial renders into one image, headless. Every
+ * round sums whichever PARTIAL.acc files can be read (missing ones are
+ * workers that have not checkpointed yet) and, when that adds samples,
+ * writes the result like --headless does. With --poll it keeps rounding
+ * every SECONDS until --target-samples (default: ITERATIONS per partial)
+ * are in, so stragglers delay nothing but their own contribution;
+ * without it one round is made.
+ */
+static int runCoordinator(const char *sceneFile, int argc, char **argv) {
+    bool denoiseOutput = false;
+    bool exrOutput = false;
+    int targetSamples = -1;
+    float pollSeconds = 0.0f;
+    std::string outputName;
+    std::vector<std::string> partials;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--denoise") == 0) {
+            denoiseOutput = true;
+        } else if (strcmp(argv[i], "--denoiser") == 0 && i + 1 < argc) {
+            ui_denoiseBackend = parseDenoiseBackend(argv[++i]);
+        } else if (strcmp(argv[i], "--exr") == 0) {
+            exrOutput = true;
+        } else if (strcmp(argv[i], "--target-samples") == 0 && i + 1 < argc) {
+            targetSamples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--poll") == 0 && i + 1 < argc) {
+            pollSeconds = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            outputName = argv[++i];
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            printf("--coordinator: unknown option %s\n", argv[i]);
+            return 1;
+        } else {
+            partials.push_back(argv[i]);
+        }
+    }
+    if (partials.empty()) {
+        printf("--coordinator: no PARTIAL.acc files given\n");
+        return 1;
+    }
+
+    scene = new Scene(sceneFile);
+    renderState = &scene->state;
+    width = renderState->camera.resolution.x;
+    height = renderState->camera.resolution.y;
+    if (targetSamples < 1) {
+        targetSamples = renderState->iterations * (int)partials.size();
+    }
+    if (outputName.empty()) {
+        outputName = renderState->imageName + "." + startTimeString + ".distributed"
+            + (denoiseOutput ? ".denoised" : "");
+    }
+
+    initPathtrace();
+    int merged = 0;
+    while (true) {
+        // Packed partials are unpacked on the GPU, as they are added
+        std::vector<accumulationFile::Accumulation> parts;
+        int samples = 0;
+        for (size_t i = 0; i < partials.size(); i++) {
+            accumulationFile::Accumulation part;
+            if (accumulationFile::read(partials[i], part) && part.width == width && part.height == imageHeight()
+                    && part.samples > 0) {
+                samples += part.samples;
+                parts.push_back(std::move(part));
+            }
+        }
+
+        if (samples > merged) {
+            NvtxRange mergeRange("coordinator merge", samples);
+            int workers = 0;
+            merged = 0;
+            for (size_t i = 0; i < parts.size(); i++) {
+                if (pathtraceMergeAccumulation(parts[i], workers == 0)) {
+                    workers++;
+                    merged += parts[i].samples;
+                }
+            }
+            iteration = merged;
+            writeResult(outputName, merged, denoiseOutput, exrOutput);
+            printf("%s: %d of %d samples from %d of %d workers written to %s.%s\n", sceneFile, merged,
+                targetSamples, workers, (int)partials.size(), outputName.c_str(), exrOutput ? "exr" : imageWriter::extension());
+        }
+        if (merged >= targetSamples || pollSeconds <= 0.0f) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds((int)(pollSeconds * 1000.0f)));
+    }
+
+    freePathtrace();
+    if (merged == 0) {
+        printf("%s: none of the partials could be read\n", sceneFile);
+        return 1;
+    }
+    return 0;
+}
+
+// A control panel value a --server client may set, by its ui_ name without the prefix
+struct RemoteValue {
+    const char *name;
+    int *intValue;
+    bool *boolValue;
+    float *floatValue;
+};
+#define REMOTE_INT(name) { #name, &ui_##name, NULL, NULL }
+#define REMOTE_BOOL(name) { #name, NULL, &ui_##name, NULL }
+#define REMOTE_FLOAT(name) { #name, NULL, NULL, &ui_##name }
+static const RemoteValue remoteValues[] = {
+    REMOTE_INT(iterations), REMOTE_BOOL(showGbuffer), REMOTE_INT(gbufferView),
+    REMOTE_BOOL(denoise), REMOTE_INT(denoiseBackend), REMOTE_BOOL(temporal), REMOTE_BOOL(varianceGuided),
+    REMOTE_BOOL(separableFilter), REMOTE_BOOL(halfPrecisionFilter), REMOTE_BOOL(pyramidFilter),
+    REMOTE_BOOL(demodulateAlbedo), REMOTE_FLOAT(earlyOutThreshold), REMOTE_FLOAT(tileConvergence),
+    REMOTE_INT(filterSize),
+    REMOTE_INT(filterKernel), REMOTE_FLOAT(colorWeight), REMOTE_FLOAT(normalWeight),
+    REMOTE_FLOAT(positionWeight), REMOTE_BOOL(splitSpecular), REMOTE_INT(specularFilterSize),
+    REMOTE_FLOAT(specularColorWeight), REMOTE_FLOAT(exposure), REMOTE_INT(toneMapper), REMOTE_BOOL(srgbDisplay),
+    REMOTE_BOOL(temporalAA), REMOTE_FLOAT(taaBlend),
+    REMOTE_INT(stereoEye), REMOTE_BOOL(sortByMaterial), REMOTE_BOOL(cacheFirstBounce), REMOTE_INT(pipeline),
+    REMOTE_BOOL(russianRoulette), REMOTE_INT(rouletteMinDepth), REMOTE_INT(samplesPerLaunch),
+    REMOTE_INT(launchesPerDisplay), REMOTE_BOOL(syncFreeBatch), REMOTE_BOOL(frameBudget), REMOTE_FLOAT(frameBudgetMs),
+    REMOTE_INT(tileRows), REMOTE_BOOL(adaptiveSampling), REMOTE_FLOAT(adaptiveThreshold),
+    REMOTE_INT(adaptiveMinSamples), REMOTE_INT(sampler), REMOTE_BOOL(antialias), REMOTE_BOOL(jitteredGBuffer),
+    REMOTE_BOOL(nextEventEstimation), REMOTE_BOOL(wideMeshBVH), REMOTE_BOOL(meshLOD), REMOTE_BOOL(watertight), REMOTE_BOOL(lightTree), REMOTE_BOOL(sortRays), REMOTE_BOOL(tiledPathOrder), REMOTE_BOOL(hardwareRT),
+    REMOTE_INT(gather), REMOTE_BOOL(accumulateOnTermination), REMOTE_BOOL(regeneratePaths),
+    REMOTE_BOOL(hitRecords), REMOTE_BOOL(deterministic), REMOTE_BOOL(radianceCache),
+    REMOTE_BOOL(photonCaustics), REMOTE_BOOL(restir), REMOTE_BOOL(pathGuiding), REMOTE_BOOL(bidirectional),
+};
+
+/**
+ * Applies one client command (see remoteSession.h) the way the preview's
+ * mouse and control panel would. Returns false for "quit".
+ */
+static bool applyRemoteCommand(const std::string &line, bool &keyframe) {
+    std::istringstream words(line);
+    std::string command;
+    words >> command;
+    Camera &cam = renderState->camera;
+    if (command == "camera") {
+        words >> phi >> theta >> zoom;
+        camchanged = true;
+    } else if (command == "lookat") {
+        words >> cam.lookAt.x >> cam.lookAt.y >> cam.lookAt.z;
+        camchanged = true;
+    } else if (command == "restart") {
+        camchanged = true;
+    } else if (command == "keyframe") {
+        keyframe = true;
+    } else if (command == "quit") {
+        return false;
+    } else if (command == "set") {
+        std::string name;
+        float value = 0.0f;
+        words >> name >> value;
+        const RemoteValue *target = NULL;
+        for (size_t i = 0; i < sizeof remoteValues / sizeof remoteValues[0]; i++) {
+            if (name == remoteValues[i].name) {
+                target = &remoteValues[i];
+            }
+        }
+        if (target == NULL || words.fail()) {
+            printf("--server: cannot set %s\n", name.c_str());
+        } else if (target->intValue != NULL) {
+            *target->intValue = (int)value;
+        } else if (target->boolValue != NULL) {
+            *target->boolValue = value != 0.0f;
+        } else {
+            *target->floatValue = value;
+        }
+        ui_samplesPerLaunch = glm::clamp(ui_samplesPerLaunch, 1, MAX_SAMPLES_PER_LAUNCH);
+        ui_iterations = std::max(ui_iterations, 1);
+    } else if (!command.empty()) {
+        printf("--server: unknown command %s\n", command.c_str());
+    }
+    return true;
+}
+
+/**
+ * Renders for remote clients over TCP, one at a time, with no window: each
+ * client's commands drive runCuda() as the preview's input would, and
+ * every display update runCuda() makes is encoded by frameEncoder, on the
+ * GPU with NVENC for --codec h264 or hevc, and sent back. Once the image
+ * has converged the server sleeps until the client sends something. A new
+ * client starts with whatever the last one left set.
+ */
+static int runServer(const char *sceneFile, int argc, char **argv) {
+    int port = 7878;
+    int codec = frameEncoder::CODEC_JPEG;
+    int quality = 85;
+    int bitrate = 20000000;
+    int iterations = -1;
+    bool denoiseOutput = false;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--codec") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            codec = strcmp(name, "h264") == 0 ? frameEncoder::CODEC_H264
+                : strcmp(name, "hevc") == 0 ? frameEncoder::CODEC_HEVC : frameEncoder::CODEC_JPEG;
+        } else if (strcmp(argv[i], "--quality") == 0 && i + 1 < argc) {
+            quality = glm::clamp(atoi(argv[++i]), 1, 100);
+        } else if (strcmp(argv[i], "--bitrate") == 0 && i + 1 < argc) {
+            bitrate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--denoise") == 0) {
+            denoiseOutput = true;
+        } else if (strcmp(argv[i], "--denoiser") == 0 && i + 1 < argc) {
+            ui_denoiseBackend = parseDenoiseBackend(argv[++i]);
+        } else {
+            printf("--server: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (!frameEncoder::available(codec)) {
+        printf("--server: --codec h264 and hevc need a build with ENABLE_NVENC\n");
+        return 1;
+    }
+
+    loadInteractiveScene(sceneFile);
+    if (iterations > 0) {
+        ui_iterations = iterations;
+        startupIterations = iterations;
+    }
+    ui_denoise = denoiseOutput;
+    // The scene poll times itself with GLFW, which has no window here
+    ui_reloadScene = false;
+    initPathtrace();
+    autotune::begin(sceneFile, width, imageHeight());
+    if (!frameEncoder::start(codec, width, height, quality, bitrate)) {
+        printf("--server: cannot start the frame encoder\n");
+        freePathtrace();
+        return 1;
+    }
+    if (!remoteSession::listen(port)) {
+        printf("--server: cannot listen on port %d\n", port);
+        frameEncoder::stop();
+        freePathtrace();
+        return 1;
+    }
+    printf("%s: serving %dx%d frames on port %d\n", sceneFile, width, height, port);
+
+    serving = true;
+    std::vector<unsigned char> encoded;
+    while (remoteSession::accept()) {
+        printf("--server: client connected\n");
+        bool keyframe = true;
+        int sentFrame = -1;
+        bool open = true;
+        while (open) {
+            // Nothing left to trace or send: wait for the client's next command
+            const bool idle = iteration >= ui_iterations && sentFrame == displayedFrames;
+            std::vector<std::string> lines;
+            open = remoteSession::receive(lines, idle ? -1 : 0);
+            for (size_t i = 0; i < lines.size() && open; i++) {
+                open = applyRemoteCommand(lines[i], keyframe);
+            }
+            if (!open) {
+                break;
+            }
+
+            runCuda();
+            if (sentFrame != displayedFrames) {
+                NvtxRange encodeRange("encode frame", iteration);
+                if (!frameEncoder::encode(pathtraceDisplayStream(), keyframe, encoded)) {
+                    printf("--server: could not encode a frame\n");
+                    break;
+                }
+                RemoteFrameHeader header;
+                memcpy(header.magic, "PTV1", 4);
+                header.codec = codec;
+                header.width = width;
+                header.height = height;
+                header.samples = iteration;
+                header.bytes = (unsigned int)encoded.size();
+                open = remoteSession::sendFrame(header, encoded.data());
+                sentFrame = displayedFrames;
+                keyframe = false;
+            }
+        }
+        printf("--server: client disconnected\n");
+    }
+    serving = false;
+
+    remoteSession::close();
+    frameEncoder::stop();
+    freePathtrace();
+    return 0;
+}
+
+/**
+ * Reloads the scene file once an edit to it has settled: the same new size
+ * and modification time on two polls in a row, so a save still being
+ * written is not parsed. The interactive camera and resolution carry over;
+ * pathtraceUpdateScene swaps in the new geometry and accumulation restarts.
+ */
+static void reloadSceneIfChanged() {
+    double now = glfwGetTime();
+    if (now - lastScenePoll < SCENE_POLL_SECONDS) {
+        return;
+    }
+    lastScenePoll = now;
+
+    int64_t stamp[2];
+    fileStamp(sceneFileName, stamp[0], stamp[1]);
+    bool loaded = stamp[0] == loadedSceneStamp[0] && stamp[1] == loadedSceneStamp[1];
+    bool settled = stamp[0] == pendingSceneStamp[0] && stamp[1] == pendingSceneStamp[1];
+    pendingSceneStamp[0] = stamp[0];
+    pendingSceneStamp[1] = stamp[1];
+    if (stamp[0] == 0 || loaded || !settled) {
+        return;
+    }
+    loadedSceneStamp[0] = stamp[0];
+    loadedSceneStamp[1] = stamp[1];
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Scene *reloaded = new Scene(sceneFileName);
+    reloaded->state.camera = scene->state.camera;
+    reloaded->state.eyeSeparation = scene->state.eyeSeparation;
+    reloaded->state.image.assign(width * height * reloaded->state.viewCount(), glm::vec3());
+    pathtraceUpdateScene(reloaded);
+    delete scene;
+    scene = reloaded;
+    renderState = &scene->state;
+    camchanged = true;
+    autotune::begin(sceneFileName, width, imageHeight());
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Reloaded %s in %.1f ms\n", sceneFileName.c_str(), ms);
+}
+
+/**
+ * The split, wavefront and persistent pipelines read path counts back or
+ * copy from the host every launch, which would stall a batch on each one;
+ * a batch goes through the cooperative pipeline instead, or the graph on
+ * devices without cooperative launches. The others keep their own.
+ */
+static int syncFreePipeline(int pipeline) {
+    if (pipeline == PIPELINE_MEGAKERNEL || pipeline == PIPELINE_GRAPH || pipeline == PIPELINE_COOPERATIVE) {
+        return pipeline;
+    }
+    return pathtraceLaunchConfiguration().cooperativeLaunch ? PIPELINE_COOPERATIVE : PIPELINE_GRAPH;
+}
+
+/**
+ * Traces up to ui_launchesPerDisplay launches, then rewrites the display
+ * texture if what it shows changed. Returns whether anything was traced or
+ * displayed, or samples remain to be traced; when not, the preview can
+ * wait for input instead of drawing the same frame again.
+ */
+bool runCuda() {
+    NvtxRange runCudaRange("runCuda");
+    if (ui_reloadScene) {
+        reloadSceneIfChanged();
+    }
+
+    // The control panel edited this material or geom of the scene
+    if (ui_editedMaterial >= 0 || ui_editedGeom >= 0) {
+        if (ui_editedGeom >= 0) {
+            scene->moveGeom(ui_editedGeom);
+        }
+        scene->rebuildLights();
+        pathtraceSceneEdited();
+        ui_editedMaterial = -1;
+        ui_editedGeom = -1;
+        camchanged = true;
+    }
     if (lastLoopIterations != ui_iterations) {
       lastLoopIterations = ui_iterations;
       camchanged = true;
     }
+    // The ray cost views count from a restart, so every pixel has them all
+    const bool rayCost = currentPathtraceOptions().rayCost;
+    if (rayCost && !lastRayCost) {
+        camchanged = true;
+    }
+    lastRayCost = rayCost;
+    // So does the specular part the denoiser splits off
+    if (ui_splitSpecular && !lastSplitSpecular) {
+        camchanged = true;
+    }
+    lastSplitSpecular = ui_splitSpecular;
+    // Pixels entering or leaving the region would be short of samples
+    if (!sameRegion(activeRegion(), lastRegion)) {
+        lastRegion = activeRegion();
+        camchanged = true;
+    }
+    readFrameBudget();
+    applyFrameBudget(camchanged);
+    applyInteractionLadder(camchanged);
 
     if (camchanged) {
         iteration = 0;
@@ -146,40 +2499,132 @@ void runCuda() {
         camchanged = false;
       }
 
-    // Map OpenGL buffer object for writing from CUDA on a single GPU
-    // No data is moved (Win & Linux). When mapped to CUDA, OpenGL should not use this buffer
+    // Map the OpenGL display texture for writing from CUDA on a single GPU
+    // No data is moved (Win & Linux). When mapped to CUDA, OpenGL should not use this texture
 
     if (iteration == 0) {
-        pathtraceFree();
-        pathtraceInit(scene);
+        pathtraceReset();
     }
 
-    uchar4 *pbo_dptr = NULL;
-    cudaGLMapBufferObject((void**)&pbo_dptr, pbo);
-
-    if (iteration < ui_iterations) {
-        iteration++;
+    pathtraceEnableTiming(ui_showStats);
+    gpuShare::heartbeat();
 
+    bool traced = false;
+    // Several launches per display refresh let tracing run at its own
+    // cadence, without a display pass and GUI frame after every launch
+    PathtraceOptions traceOptions = currentPathtraceOptions();
+    traceOptions.pixelStride = interactionLadder.stride;
+    // The preview rasterizes the camera's primary visibility once, before
+    // its first launch or the first since the option was turned on
+    static bool rasterPrimaryDrawn = false;
+    if (traceOptions.rasterPrimary && !serving && (iteration == 0 || !rasterPrimaryDrawn)) {
+        rasterVisibility::render(scene);
+    }
+    rasterPrimaryDrawn = traceOptions.rasterPrimary && !serving;
+    int launches = std::max(ui_launchesPerDisplay, 1);
+    const bool timeFrame = ui_frameBudget && !frameBudget.pending && iteration < ui_iterations;
+    if (ui_frameBudget) {
+        const int samples = frameBudgetSamples();
+        traceOptions.samplesPerLaunch = std::min(samples, MAX_SAMPLES_PER_LAUNCH);
+        launches = (samples + traceOptions.samplesPerLaunch - 1) / traceOptions.samplesPerLaunch;
+    }
+    if (timeFrame) {
+        if (frameBudget.start == NULL) {
+            cudaEventCreate(&frameBudget.start);
+            cudaEventCreate(&frameBudget.stop);
+        }
+        cudaEventRecord(frameBudget.start, 0);
+    }
+    // A sync-free batch is queued back to back without waiting on the GPU
+    const bool syncFree = ui_syncFreeBatch && launches > 1;
+    if (syncFree) {
+        traceOptions.pipeline = syncFreePipeline(traceOptions.pipeline);
+    }
+    const int firstIteration = iteration;
+    for (int launch = 0; launch < launches && iteration < ui_iterations; launch++) {
+        // Each timer waits for its last launch's, so a sync-free batch only times its last launch
+        if (syncFree) {
+            pathtraceEnableTiming(ui_showStats && (launch == launches - 1
+                || iteration + traceOptions.samplesPerLaunch >= ui_iterations));
+        }
         // execute the kernel
         int frame = 0;
-        pathtrace(frame, iteration);
+        traceNextSamples(frame, ui_iterations, traceOptions);
+        traced = true;
+    }
+    pathtraceEnableTiming(ui_showStats);
+    if (timeFrame) {
+        cudaEventRecord(frameBudget.stop, 0);
+        frameBudget.pending = true;
+        frameBudget.pendingSamples = iteration - firstIteration;
+        frameBudget.pendingDepth = renderState->traceDepth;
     }
 
-    if (ui_showGbuffer) {
-      showGBuffer(pbo_dptr);
-    } else {
-      showImage(pbo_dptr, iteration);
+    DenoiseOptions denoiseOptions = currentDenoiseOptions();
+    denoiseOptions.temporal = denoiseOptions.temporal || interactionDenoised();
+
+    // The texture only needs rewriting when the image or what is shown of it
+    // changed; otherwise the preview just draws it again.
+    DisplayMode displayMode = ui_showGbuffer ? DISPLAY_GBUFFER
+        : ui_denoise || interactionDenoised() ? DISPLAY_DENOISED : DISPLAY_IMAGE;
+    DisplayOptions displayOptions = currentDisplayOptions();
+    // Outside the region the texture keeps the last full frame, unless it
+    // showed something else
+    if (displayMode != lastDisplayMode) {
+        displayOptions.region = PixelRect();
     }
+    // A new display transform alone reuses the last denoise() result
+    bool denoiseChanged = traced || displayMode != lastDisplayMode
+        || (displayMode == DISPLAY_DENOISED
+            && !sameDenoiseOptions(denoiseOptions, lastDenoiseOptions));
+    bool displayChanged = denoiseChanged
+        || (displayMode == DISPLAY_GBUFFER && ui_gbufferView != lastGBufferView)
+        || (displayMode != DISPLAY_GBUFFER && !sameDisplayOptions(displayOptions, lastDisplayOptions));
+
+    if (displayChanged) {
+        NvtxRange displayRange("display", (int)displayMode);
+        cudaSurfaceObject_t display = 0;
+        {
+            NvtxRange mapRange("map display texture");
+            display = serving ? frameEncoder::surface() : mapDisplaySurface(pathtraceDisplayStream());
+        }
 
-    // unmap buffer object
-    cudaGLUnmapBufferObject(pbo);
+        if (displayMode == DISPLAY_GBUFFER) {
+          showGBuffer(display, ui_gbufferView);
+        } else if (displayMode == DISPLAY_DENOISED) {
+          if (denoiseChanged) {
+            denoise(iteration, denoiseOptions);
+          }
+          showDenoisedImage(display, displayOptions);
+        } else {
+          showImage(display, iteration, displayOptions);
+        }
+
+        // hand the texture back to OpenGL
+        if (!serving) {
+            NvtxRange unmapRange("unmap display texture");
+            unmapDisplaySurface(pathtraceDisplayStream());
+        }
+        displayedFrames++;
+        lastDisplayMode = displayMode;
+        lastDenoiseOptions = denoiseOptions;
+        lastDisplayOptions = displayOptions;
+        lastGBufferView = ui_gbufferView;
+    }
+
+    if (ui_saveAovs) {
+        saveAovs(defaultImageName(iteration));
+        ui_saveAovs = false;
+    }
 
     if (ui_saveAndExit) {
         saveImage();
-        pathtraceFree();
+        imageWriter::flush();
+        freePathtrace();
         cudaDeviceReset();
         exit(EXIT_SUCCESS);
     }
+    return traced || displayChanged || iteration < ui_iterations;
 }
 
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
@@ -192,6 +2637,9 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
       case GLFW_KEY_S:
         saveImage();
         break;
+      case GLFW_KEY_E:
+        saveAovs(defaultImageName(iteration));
+        break;
       case GLFW_KEY_SPACE:
         camchanged = true;
         renderState = &scene->state;
@@ -202,14 +2650,56 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
     }
 }
 
+// The image pixel under a window position; the preview mirrors the image horizontally
+static glm::ivec2 windowToPixel(GLFWwindow* window, double xpos, double ypos) {
+  int windowWidth = 0, windowHeight = 0;
+  glfwGetWindowSize(window, &windowWidth, &windowHeight);
+  glm::ivec2 pixel((int)(xpos * width / std::max(windowWidth, 1)),
+    (int)(ypos * height / std::max(windowHeight, 1)));
+  pixel.x = width - 1 - pixel.x;
+  return glm::clamp(pixel, glm::ivec2(0), glm::ivec2(width - 1, height - 1));
+}
+
+// The pixels between two corners, both included
+static PixelRect pixelSpan(glm::ivec2 a, glm::ivec2 b) {
+  glm::ivec2 lo = glm::min(a, b);
+  glm::ivec2 hi = glm::max(a, b);
+  PixelRect rect = { lo.x, lo.y, hi.x - lo.x + 1, hi.y - lo.y + 1 };
+  return rect;
+}
+
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
+  if (draggingRegion && button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE) {
+    // A click without a drag leaves the region as it was
+    draggingRegion = false;
+    if (ui_regionDrag.width > 1 && ui_regionDrag.height > 1) {
+      ui_regionRect = ui_regionDrag;
+      ui_regionOfInterest = true;
+    }
+    ui_regionDrag = PixelRect();
+    return;
+  }
   if (ImGui::GetIO().WantCaptureMouse) return;
+  if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && (mods & GLFW_MOD_SHIFT)) {
+    double xpos, ypos;
+    glfwGetCursorPos(window, &xpos, &ypos);
+    draggingRegion = true;
+    regionDragStart = windowToPixel(window, xpos, ypos);
+    ui_regionDrag = pixelSpan(regionDragStart, regionDragStart);
+    return;
+  }
   leftMousePressed = (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS);
   rightMousePressed = (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS);
   middleMousePressed = (button == GLFW_MOUSE_BUTTON_MIDDLE && action == GLFW_PRESS);
 }
 
 void mousePositionCallback(GLFWwindow* window, double xpos, double ypos) {
+  if (draggingRegion) {
+    ui_regionDrag = pixelSpan(regionDragStart, windowToPixel(window, xpos, ypos));
+    lastX = xpos;
+    lastY = ypos;
+    return;
+  }
   if (xpos == lastX || ypos == lastY) return; // otherwise, clicking back into window causes re-start
   if (leftMousePressed) {
     // compute new camera parameters
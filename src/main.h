@@ -35,14 +35,91 @@ extern int height;
 extern int ui_iterations;
 extern int startupIterations;
 extern bool ui_showGbuffer;
+extern int ui_gbufferView;
 extern bool ui_denoise;
+extern int ui_denoiseBackend;
+extern bool ui_temporal;
+extern bool ui_varianceGuided;
+extern bool ui_separableFilter;
+extern bool ui_halfPrecisionFilter;
+extern bool ui_pyramidFilter;
+extern bool ui_demodulateAlbedo;
+extern float ui_earlyOutThreshold;
+extern float ui_tileConvergence;
 extern int ui_filterSize;
+extern int ui_filterKernel;
 extern float ui_colorWeight;
 extern float ui_normalWeight;
 extern float ui_positionWeight;
+extern bool ui_splitSpecular;
+extern int ui_specularFilterSize;
+extern float ui_specularColorWeight;
+extern float ui_exposure;
+extern int ui_toneMapper;
+extern bool ui_srgbDisplay;
+extern bool ui_temporalAA;
+extern float ui_taaBlend;
+extern int ui_stereoEye;
 extern bool ui_saveAndExit;
+extern bool ui_saveAovs;
+extern bool ui_sortByMaterial;
+extern bool ui_cacheFirstBounce;
+extern int ui_pipeline;
+extern bool ui_russianRoulette;
+extern int ui_rouletteMinDepth;
+extern bool ui_showStats;
+extern int ui_samplesPerLaunch;
+extern int ui_launchesPerDisplay;
+extern bool ui_syncFreeBatch;
+extern bool ui_frameBudget;
+extern float ui_frameBudgetMs;
+extern bool ui_interactiveQuality;
+extern int ui_interactiveStride;
+extern int ui_interactiveDepth;
+extern bool ui_pauseWhenHidden;
+extern bool ui_powerCap;
+extern int ui_powerCapIterations;
+extern int ui_tileRows;
+extern bool ui_adaptiveSampling;
+extern float ui_adaptiveThreshold;
+extern int ui_adaptiveMinSamples;
+extern int ui_sampler;
+extern bool ui_antialias;
+extern bool ui_jitteredGBuffer;
+extern bool ui_nextEventEstimation;
+extern bool ui_wideMeshBVH;
+extern bool ui_sortRays;
+extern bool ui_specializedShading;
+extern bool ui_tiledPathOrder;
+extern bool ui_hardwareRT;
+extern int ui_gather;
+extern bool ui_accumulateOnTermination;
+extern bool ui_regeneratePaths;
+extern bool ui_hitRecords;
+extern bool ui_deterministic;
+extern bool ui_radianceCache;
+extern bool ui_photonCaustics;
+extern bool ui_restir;
+extern bool ui_meshLOD;
+extern bool ui_watertight;
+extern bool ui_shortStack;
+extern bool ui_lightTree;
+extern bool ui_pathGuiding;
+extern bool ui_bidirectional;
+extern bool ui_rasterPrimary;
+extern bool ui_tileCulling;
+extern bool ui_packetCameraRays;
+extern bool ui_packetShadowRays;
+extern int ui_pathSplit;
+extern bool ui_compactPaths;
+extern bool ui_regionOfInterest;
+extern PixelRect ui_regionRect;
+extern PixelRect ui_regionDrag;
+extern bool ui_reloadScene;
+extern int ui_editedMaterial;
+extern int ui_editedGeom;
 
-void runCuda();
+bool runCuda();
 void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods);
 void mousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
@@ -0,0 +1,64 @@
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "mappedFile.h"
+
+MappedFile::MappedFile(const std::string &filename) : bytes(NULL), length(0), mapped(false) {
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void *view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED) {
+            bytes = (const unsigned char *)view;
+            length = (size_t)info.st_size;
+            mapped = true;
+        }
+    }
+    close(fd);
+#else
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (file == NULL) {
+        return;
+    }
+    fseek(file, 0, SEEK_END);
+    long end = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (end > 0) {
+        contents.resize((size_t)end);
+        if (fread(contents.data(), 1, contents.size(), file) == contents.size()) {
+            bytes = contents.data();
+            length = contents.size();
+        }
+    }
+    fclose(file);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (mapped) {
+        munmap((void *)bytes, length);
+    }
+#endif
+}
+
+void fileStamp(const std::string &filename, int64_t &size, int64_t &mtime) {
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0) {
+        size = 0;
+        mtime = 0;
+        return;
+    }
+    size = (int64_t)info.st_size;
+    mtime = (int64_t)info.st_mtime;
+}
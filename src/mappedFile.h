@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Read-only view of a whole file: memory-mapped where the platform has
+ * mmap, read into memory otherwise. Empty if the file cannot be opened.
+ * The bytes are not NUL-terminated.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &filename);
+    ~MappedFile();
+
+    const unsigned char *data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    const unsigned char *bytes;
+    size_t length;
+    bool mapped;
+    std::vector<unsigned char> contents;
+};
+
+// Size and modification time, both 0 for a missing file
+void fileStamp(const std::string &filename, int64_t &size, int64_t &mtime);
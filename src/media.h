@@ -0,0 +1,195 @@
+#pragma once
+
+#include <thrust/random.h>
+
+#include "intersections.h"
+
+/**
+ * Participating media: the boxes of Scene::media, which attenuate and
+ * scatter light along every ray segment crossing them. Scattered paths
+ * find their collisions by delta tracking (Woodcock): tentative collisions
+ * are drawn against a majorant of the extinction and accepted with
+ * probability extinction / majorant. Shadow rays weigh their light by
+ * ratio tracking's estimate of the transmittance instead, with the same
+ * tentative collisions. A heterogeneous medium's majorants are those of a
+ * coarse grid over its box, walked cell by cell, so the steps are only as
+ * short as the densest voxels nearby, not the densest in the box.
+ *
+ * The media are independent of each other, so overlapping boxes add up.
+ * The radiance cache and caustic photons do not see them.
+ */
+
+// Seed depth bit of the random engines of free-flight sampling, clear of NEE_SEED_BIT
+#define MEDIUM_SEED_BIT 0x200
+
+// Extinction of `medium` at world point `p`
+__host__ __device__ inline float mediumExtinction(const MediumData &media, const Medium &medium, glm::vec3 p) {
+    if (medium.voxelOffset < 0) {
+        return medium.density;
+    }
+    return medium.density * gridValue(medium.texture, media.voxels + medium.voxelOffset, medium.resolution,
+        medium.boundsMin, medium.boundsMax, p);
+}
+
+/**
+ * A 3D DDA over the majorant cells of one medium that a ray crosses, from
+ * where it enters the box to where it leaves it or reaches tMax.
+ */
+struct MajorantWalk {
+    glm::ivec3 cell;
+    glm::ivec3 step;
+    glm::vec3 tNext;    // ray parameter at the next cell boundary on each axis
+    glm::vec3 tDelta;   // and between boundaries
+    float t;
+    float tEnd;
+};
+
+// Starts the walk of `r` through `medium`; false if it misses the box before tMax
+__host__ __device__ inline bool majorantWalkStart(const Medium &medium, const Ray &r, float tMax,
+        MajorantWalk &walk) {
+    const glm::vec3 invDirection = 1.0f / r.direction;
+    const glm::vec3 t1 = (medium.boundsMin - r.origin) * invDirection;
+    const glm::vec3 t2 = (medium.boundsMax - r.origin) * invDirection;
+    const glm::vec3 tNear = glm::min(t1, t2);
+    const glm::vec3 tFar = glm::max(t1, t2);
+    walk.t = fmaxf(fmaxf(fmaxf(tNear.x, tNear.y), tNear.z), 0.0f);
+    walk.tEnd = fminf(fminf(fminf(tFar.x, tFar.y), tFar.z), tMax);
+    if (!(walk.t < walk.tEnd)) {
+        return false;
+    }
+    const glm::vec3 cellSize = (medium.boundsMax - medium.boundsMin) / glm::vec3(medium.majorantResolution);
+    const glm::vec3 c = (r.origin + walk.t * r.direction - medium.boundsMin) / cellSize;
+    walk.cell = glm::clamp(glm::ivec3(glm::floor(c)), glm::ivec3(0), medium.majorantResolution - 1);
+    for (int axis = 0; axis < 3; axis++) {
+        if (r.direction[axis] > 0.0f) {
+            walk.step[axis] = 1;
+            walk.tDelta[axis] = cellSize[axis] * invDirection[axis];
+            walk.tNext[axis] = walk.t + (walk.cell[axis] + 1 - c[axis]) * walk.tDelta[axis];
+        } else if (r.direction[axis] < 0.0f) {
+            walk.step[axis] = -1;
+            walk.tDelta[axis] = -cellSize[axis] * invDirection[axis];
+            walk.tNext[axis] = walk.t + (c[axis] - walk.cell[axis]) * walk.tDelta[axis];
+        } else {
+            walk.step[axis] = 0;
+            walk.tDelta[axis] = FLT_MAX;
+            walk.tNext[axis] = FLT_MAX;
+        }
+    }
+    return true;
+}
+
+/**
+ * The next span [t0, t1) of the walk and the majorant over it; false once
+ * the walk has left the box.
+ */
+__host__ __device__ inline bool majorantWalkNext(const MediumData &media, const Medium &medium,
+        MajorantWalk &walk, float &t0, float &t1, float &majorant) {
+    if (!(walk.t < walk.tEnd)) {
+        return false;
+    }
+    const glm::ivec3 res = medium.majorantResolution;
+    int axis = walk.tNext.x < walk.tNext.y ? (walk.tNext.x < walk.tNext.z ? 0 : 2)
+        : (walk.tNext.y < walk.tNext.z ? 1 : 2);
+    t0 = walk.t;
+    t1 = fminf(walk.tNext[axis], walk.tEnd);
+    majorant = media.majorants[medium.majorantOffset + (walk.cell.z * res.y + walk.cell.y) * res.x + walk.cell.x];
+    walk.t = t1;
+    walk.cell[axis] += walk.step[axis];
+    walk.tNext[axis] += walk.tDelta[axis];
+    if (walk.cell[axis] < 0 || walk.cell[axis] >= res[axis]) {
+        walk.t = walk.tEnd;
+    }
+    return true;
+}
+
+/**
+ * Delta tracking of `r` through every medium before tMax. Returns the
+ * distance to the first real collision, -1 if there is none, and sets
+ * `medium` to the index of the medium it is in.
+ */
+__host__ __device__ inline float sampleMediumCollision(const MediumData &media, const Ray &r, float tMax,
+        thrust::default_random_engine &rng, int &medium) {
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    float collision = -1.0f;
+    for (int m = 0; m < media.count; m++) {
+        const Medium &box = media.media[m];
+        MajorantWalk walk;
+        if (!majorantWalkStart(box, r, collision >= 0.0f ? collision : tMax, walk)) {
+            continue;
+        }
+        float t0, t1, majorant;
+        bool found = false;
+        while (!found && majorantWalkNext(media, box, walk, t0, t1, majorant)) {
+            if (!(majorant > 0.0f)) {
+                continue;
+            }
+            for (float t = t0 - logf(1.0f - u01(rng)) / majorant; t < t1;
+                    t -= logf(1.0f - u01(rng)) / majorant) {
+                if (u01(rng) * majorant < mediumExtinction(media, box, r.origin + t * r.direction)) {
+                    collision = t;
+                    medium = m;
+                    found = true;
+                    break;
+                }
+            }
+        }
+    }
+    return collision;
+}
+
+/**
+ * Ratio tracking's unbiased estimate of the transmittance along `r` up to
+ * tMax through every medium.
+ */
+__host__ __device__ inline float mediumTransmittance(const MediumData &media, const Ray &r, float tMax,
+        thrust::default_random_engine &rng) {
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    float transmittance = 1.0f;
+    for (int m = 0; m < media.count && transmittance > 0.0f; m++) {
+        const Medium &box = media.media[m];
+        MajorantWalk walk;
+        if (!majorantWalkStart(box, r, tMax, walk)) {
+            continue;
+        }
+        float t0, t1, majorant;
+        while (majorantWalkNext(media, box, walk, t0, t1, majorant)) {
+            if (!(majorant > 0.0f)) {
+                continue;
+            }
+            for (float t = t0 - logf(1.0f - u01(rng)) / majorant; t < t1;
+                    t -= logf(1.0f - u01(rng)) / majorant) {
+                transmittance *= 1.0f - mediumExtinction(media, box, r.origin + t * r.direction) / majorant;
+            }
+        }
+    }
+    return fmaxf(transmittance, 0.0f);
+}
+
+/**
+ * Henyey-Greenstein phase function of asymmetry `g` between a ray's
+ * direction of travel and the direction it scatters to, `cosTheta` apart:
+ * also the density, per steradian, of sampleHenyeyGreenstein.
+ */
+__host__ __device__ inline float henyeyGreenstein(float g, float cosTheta) {
+    const float denominator = 1.0f + g * g - 2.0f * g * cosTheta;
+    return (1.0f - g * g) / (4.0f * PI * denominator * sqrtf(denominator));
+}
+
+// A direction scattered from unit `direction` by henyeyGreenstein(g), from two uniform numbers
+__host__ __device__ inline glm::vec3 sampleHenyeyGreenstein(glm::vec3 direction, float g, float u1, float u2) {
+    float cosTheta;
+    if (fabsf(g) < 1e-3f) {
+        cosTheta = 1.0f - 2.0f * u1;
+    } else {
+        const float s = (1.0f - g * g) / (1.0f + g - 2.0f * g * u1);
+        cosTheta = (1.0f + g * g - s * s) / (2.0f * g);
+    }
+    cosTheta = glm::clamp(cosTheta, -1.0f, 1.0f);
+    const float sinTheta = sqrtf(fmaxf(0.0f, 1.0f - cosTheta * cosTheta));
+    const float phi = TWO_PI * u2;
+    const glm::vec3 other = fabsf(direction.x) < SQRT_OF_ONE_THIRD ? glm::vec3(1.0f, 0.0f, 0.0f)
+        : fabsf(direction.y) < SQRT_OF_ONE_THIRD ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(0.0f, 0.0f, 1.0f);
+    const glm::vec3 b1 = glm::normalize(glm::cross(direction, other));
+    const glm::vec3 b2 = glm::cross(direction, b1);
+    return cosTheta * direction + sinTheta * (cosf(phi) * b1 + sinf(phi) * b2);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+/**
+ * NVTX ranges for Nsight Systems timelines, compiled in only when the
+ * build defines ENABLE_NVTX (cmake -DENABLE_NVTX=ON). Otherwise every
+ * range is an empty inline object and costs nothing.
+ *
+ *     NvtxRange range("bounce", depth, numPaths);
+ *
+ * names the range "bounce <depth>" and attaches numPaths as its payload.
+ */
+
+#ifdef ENABLE_NVTX
+#include <cstdio>
+#include <nvToolsExt.h>
+#endif
+
+class NvtxRange {
+public:
+    explicit NvtxRange(const char *name) {
+#ifdef ENABLE_NVTX
+        nvtxRangePushA(name);
+#endif
+    }
+
+    NvtxRange(const char *name, int payload) {
+#ifdef ENABLE_NVTX
+        push(name, payload);
+#endif
+    }
+
+    // The index is folded into the name, so the payload stays free for counts
+    NvtxRange(const char *name, int index, int payload) {
+#ifdef ENABLE_NVTX
+        char label[64];
+        snprintf(label, sizeof(label), "%s %d", name, index);
+        push(label, payload);
+#endif
+    }
+
+    ~NvtxRange() {
+#ifdef ENABLE_NVTX
+        nvtxRangePop();
+#endif
+    }
+
+private:
+    NvtxRange(const NvtxRange &);
+    NvtxRange &operator=(const NvtxRange &);
+
+#ifdef ENABLE_NVTX
+    static void push(const char *name, int payload) {
+        nvtxEventAttributes_t attributes = {};
+        attributes.version = NVTX_VERSION;
+        attributes.size = NVTX_EVENT_ATTRIB_STRUCT_SIZE;
+        attributes.messageType = NVTX_MESSAGE_TYPE_ASCII;
+        attributes.message.ascii = name;
+        attributes.payloadType = NVTX_PAYLOAD_TYPE_INT32;
+        attributes.payload.iValue = payload;
+        nvtxRangePushEx(&attributes);
+    }
+#endif
+};
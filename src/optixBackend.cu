@@ -0,0 +1,592 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "optixBackend.h"
+
+#ifdef ENABLE_OPTIX
+#include <optix.h>
+#include <optix_function_table_definition.h>
+#include <optix_stubs.h>
+
+#include "bvh.h"
+#include "deviceMemory.h"
+#include "gbuffer.h"
+#include "optixLaunchParams.h"
+
+// The denoiser's guide layers and optixDenoiserInvoke's layer arguments
+// arrived in OptiX 7.3; older SDKs build without it
+#if OPTIX_VERSION >= 70300
+#define OPTIX_AI_DENOISER
+#endif
+#endif
+
+namespace OptixBackend {
+
+#ifdef ENABLE_OPTIX
+
+// CMake passes the path of the compiled optixPrograms.cu unquoted
+#define OPTIX_STRINGIFY(x) #x
+#define OPTIX_STRING(x) OPTIX_STRINGIFY(x)
+#define OPTIX_LOG_SIZE 2048
+
+// Program groups, in their order in the shader binding table. The two hit
+// groups are consecutive, so an instance's sbtOffset picks between them.
+enum ProgramGroup {
+    GROUP_RAYGEN,
+    GROUP_MISS,
+    GROUP_GEOM,     // custom primitives: spheres and cubes
+    GROUP_MESH,     // built-in triangles
+    GROUP_COUNT,
+};
+
+// The programs read everything from the launch params, so records are bare headers
+struct __align__(OPTIX_SBT_RECORD_ALIGNMENT) SbtRecord {
+    char header[OPTIX_SBT_RECORD_HEADER_SIZE];
+};
+
+static bool initialized = false;    // whether available() has tried to create the pipeline
+static bool ready = false;
+static OptixDeviceContext context = NULL;
+static OptixModule module = NULL;
+static OptixProgramGroup groups[GROUP_COUNT] = {};
+static OptixPipeline pipeline = NULL;
+static SbtRecord *dev_sbtRecords = NULL;
+static OptixShaderBindingTable sbt = {};
+
+static std::vector<void *> accelBuffers;   // every GAS and the IAS
+static int *dev_customGeoms = NULL;
+static OptixLaunchParams launchParams = {};
+static OptixLaunchParams *dev_launchParams = NULL;
+
+// AI denoiser, created on first use and set up for the resolution it last
+// ran at. It owns its inputs: the normalized beauty, albedo and normal
+// guides, and the output it returns.
+static bool denoiserInitialized = false;
+static glm::ivec2 denoiserResolution(0);
+static size_t denoiserStateBytes = 0;
+static size_t denoiserScratchBytes = 0;
+static void *dev_denoiserState = NULL;
+static void *dev_denoiserScratch = NULL;
+static float *dev_denoiserIntensity = NULL;
+static float4 *dev_denoiserBeauty = NULL;
+static float4 *dev_denoiserAlbedo = NULL;
+static float4 *dev_denoiserNormal = NULL;
+static float4 *dev_denoiserOutput = NULL;
+#ifdef OPTIX_AI_DENOISER
+static OptixDenoiser denoiser = NULL;
+#endif
+
+static bool check(OptixResult result, const char *call) {
+    if (result != OPTIX_SUCCESS) {
+        fprintf(stderr, "OptiX: %s failed: %s\n", call, optixGetErrorName(result));
+        return false;
+    }
+    return true;
+}
+
+static bool readPtx(std::string &ptx) {
+    std::ifstream file(OPTIX_STRING(OPTIX_PTX_PATH), std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "OptiX: cannot read %s\n", OPTIX_STRING(OPTIX_PTX_PATH));
+        return false;
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    ptx = contents.str();
+    return true;
+}
+
+static bool createPipeline() {
+    // OptiX runs on the runtime's context of the current device
+    cudaFree(0);
+    OptixDeviceContextOptions contextOptions = {};
+    if (!check(optixInit(), "optixInit")
+            || !check(optixDeviceContextCreate(0, &contextOptions, &context), "optixDeviceContextCreate")) {
+        return false;
+    }
+
+    std::string ptx;
+    if (!readPtx(ptx)) {
+        return false;
+    }
+
+    OptixModuleCompileOptions moduleOptions = {};
+    moduleOptions.maxRegisterCount = OPTIX_COMPILE_DEFAULT_MAX_REGISTER_COUNT;
+    moduleOptions.optLevel = OPTIX_COMPILE_OPTIMIZATION_DEFAULT;
+    moduleOptions.debugLevel = OPTIX_COMPILE_DEBUG_LEVEL_NONE;
+
+    // Rays go through an IAS to a GAS, and carry the five payloads of
+    // optixPrograms.cu; triangles report their barycentrics as attributes
+    OptixPipelineCompileOptions pipelineOptions = {};
+    pipelineOptions.usesMotionBlur = 0;
+    pipelineOptions.traversableGraphFlags = OPTIX_TRAVERSABLE_GRAPH_FLAG_ALLOW_SINGLE_LEVEL_INSTANCING;
+    pipelineOptions.numPayloadValues = 5;
+    pipelineOptions.numAttributeValues = 2;
+    pipelineOptions.exceptionFlags = OPTIX_EXCEPTION_FLAG_NONE;
+    pipelineOptions.pipelineLaunchParamsVariableName = "params";
+#if OPTIX_VERSION >= 70100
+    pipelineOptions.usesPrimitiveTypeFlags = OPTIX_PRIMITIVE_TYPE_FLAGS_CUSTOM
+        | OPTIX_PRIMITIVE_TYPE_FLAGS_TRIANGLE;
+#endif
+
+    char log[OPTIX_LOG_SIZE];
+    size_t logSize = sizeof(log);
+#if OPTIX_VERSION >= 70700
+    OptixResult result = optixModuleCreate(context, &moduleOptions, &pipelineOptions,
+        ptx.c_str(), ptx.size(), log, &logSize, &module);
+#else
+    OptixResult result = optixModuleCreateFromPTX(context, &moduleOptions, &pipelineOptions,
+        ptx.c_str(), ptx.size(), log, &logSize, &module);
+#endif
+    if (!check(result, "module creation")) {
+        fprintf(stderr, "%s\n", log);
+        return false;
+    }
+
+    OptixProgramGroupDesc descs[GROUP_COUNT] = {};
+    descs[GROUP_RAYGEN].kind = OPTIX_PROGRAM_GROUP_KIND_RAYGEN;
+    descs[GROUP_RAYGEN].raygen.module = module;
+    descs[GROUP_RAYGEN].raygen.entryFunctionName = "__raygen__bounce";
+    descs[GROUP_MISS].kind = OPTIX_PROGRAM_GROUP_KIND_MISS;
+    descs[GROUP_MISS].miss.module = module;
+    descs[GROUP_MISS].miss.entryFunctionName = "__miss__bounce";
+    descs[GROUP_GEOM].kind = OPTIX_PROGRAM_GROUP_KIND_HITGROUP;
+    descs[GROUP_GEOM].hitgroup.moduleCH = module;
+    descs[GROUP_GEOM].hitgroup.entryFunctionNameCH = "__closesthit__geom";
+    descs[GROUP_GEOM].hitgroup.moduleIS = module;
+    descs[GROUP_GEOM].hitgroup.entryFunctionNameIS = "__intersection__geom";
+    descs[GROUP_MESH].kind = OPTIX_PROGRAM_GROUP_KIND_HITGROUP;
+    descs[GROUP_MESH].hitgroup.moduleCH = module;
+    descs[GROUP_MESH].hitgroup.entryFunctionNameCH = "__closesthit__mesh";
+    OptixProgramGroupOptions groupOptions = {};
+    logSize = sizeof(log);
+    if (!check(optixProgramGroupCreate(context, descs, GROUP_COUNT, &groupOptions, log, &logSize, groups),
+            "optixProgramGroupCreate")) {
+        fprintf(stderr, "%s\n", log);
+        return false;
+    }
+
+    // No program traces further rays
+    OptixPipelineLinkOptions linkOptions = {};
+    linkOptions.maxTraceDepth = 1;
+#if OPTIX_VERSION < 70700
+    linkOptions.debugLevel = OPTIX_COMPILE_DEBUG_LEVEL_NONE;
+#endif
+    logSize = sizeof(log);
+    if (!check(optixPipelineCreate(context, &pipelineOptions, &linkOptions, groups, GROUP_COUNT,
+            log, &logSize, &pipeline), "optixPipelineCreate")) {
+        fprintf(stderr, "%s\n", log);
+        return false;
+    }
+
+    SbtRecord records[GROUP_COUNT];
+    for (int i = 0; i < GROUP_COUNT; i++) {
+        if (!check(optixSbtRecordPackHeader(groups[i], &records[i]), "optixSbtRecordPackHeader")) {
+            return false;
+        }
+    }
+    deviceMemory::allocate(&dev_sbtRecords, sizeof(records));
+    cudaMemcpy(dev_sbtRecords, records, sizeof(records), cudaMemcpyHostToDevice);
+    sbt.raygenRecord = (CUdeviceptr)(dev_sbtRecords + GROUP_RAYGEN);
+    sbt.missRecordBase = (CUdeviceptr)(dev_sbtRecords + GROUP_MISS);
+    sbt.missRecordStrideInBytes = sizeof(SbtRecord);
+    sbt.missRecordCount = 1;
+    sbt.hitgroupRecordBase = (CUdeviceptr)(dev_sbtRecords + GROUP_GEOM);
+    sbt.hitgroupRecordStrideInBytes = sizeof(SbtRecord);
+    sbt.hitgroupRecordCount = GROUP_COUNT - GROUP_GEOM;
+
+    deviceMemory::allocate(&dev_launchParams, sizeof(OptixLaunchParams));
+    return true;
+}
+
+bool available() {
+    if (!initialized) {
+        initialized = true;
+        ready = createPipeline();
+        if (!ready) {
+            fprintf(stderr, "OptiX: hardware ray tracing unavailable, using the CUDA kernels\n");
+        }
+    }
+    return ready;
+}
+
+static void freeAccel() {
+    for (size_t i = 0; i < accelBuffers.size(); i++) {
+        deviceMemory::release(accelBuffers[i]);
+    }
+    accelBuffers.clear();
+    deviceMemory::release(dev_customGeoms);
+    dev_customGeoms = NULL;
+    launchParams.handle = 0;
+}
+
+// Builds one acceleration structure, kept in accelBuffers until freeAccel()
+static OptixTraversableHandle buildAccel(const OptixBuildInput &input) {
+    OptixAccelBuildOptions options = {};
+    options.buildFlags = OPTIX_BUILD_FLAG_PREFER_FAST_TRACE;
+    options.operation = OPTIX_BUILD_OPERATION_BUILD;
+    OptixAccelBufferSizes sizes;
+    if (!check(optixAccelComputeMemoryUsage(context, &options, &input, 1, &sizes),
+            "optixAccelComputeMemoryUsage")) {
+        return 0;
+    }
+
+    void *temp;
+    void *output;
+    deviceMemory::allocate(&temp, sizes.tempSizeInBytes);
+    deviceMemory::allocate(&output, sizes.outputSizeInBytes);
+    accelBuffers.push_back(output);
+    OptixTraversableHandle handle = 0;
+    check(optixAccelBuild(context, 0, &options, &input, 1, (CUdeviceptr)temp, sizes.tempSizeInBytes,
+        (CUdeviceptr)output, sizes.outputSizeInBytes, &handle, NULL, 0), "optixAccelBuild");
+    // release() waits for the build
+    deviceMemory::release(temp);
+    return handle;
+}
+
+static OptixInstance makeInstance(const glm::mat4 &transform, int id, int hitGroup,
+        OptixTraversableHandle handle) {
+    OptixInstance instance;
+    memset(&instance, 0, sizeof(instance));
+    // Row-major 3x4 object-to-world, from glm's column-major matrix
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 4; c++) {
+            instance.transform[4 * r + c] = transform[c][r];
+        }
+    }
+    instance.instanceId = id;
+    instance.sbtOffset = hitGroup - GROUP_GEOM;
+    instance.visibilityMask = 255;
+    instance.flags = OPTIX_INSTANCE_FLAG_NONE;
+    instance.traversableHandle = handle;
+    return instance;
+}
+
+void build(const Scene *scene, const DeviceGeom *geoms, const Material *materials,
+        const MeshData &meshData) {
+    if (!available()) {
+        return;
+    }
+    freeAccel();
+    std::vector<OptixInstance> instances;
+    const unsigned int geometryFlags = OPTIX_GEOMETRY_FLAG_DISABLE_ANYHIT;
+
+    // Spheres, cubes, sphere clouds and SDFs, by their world bounds, under an identity instance
+    std::vector<OptixAabb> aabbs;
+    std::vector<int> customGeoms;
+    for (size_t i = 0; i < scene->geoms.size(); i++) {
+        const Geom &geom = scene->geoms[i];
+        if (geom.type == MESH) {
+            continue;
+        }
+        AABB bounds = BVH::geomBounds(geom);
+        if (geom.type == SPHERE_CLOUD) {
+            const BVHNode &root = scene->cloudBvhNodes[scene->sphereClouds[geom.meshid].bvhRoot];
+            AABB cloudBounds;
+            cloudBounds.min = root.bboxMin;
+            cloudBounds.max = root.bboxMax;
+            bounds = BVH::transformBounds(geom.transform, cloudBounds);
+        } else if (geom.type == SDF_VOLUME) {
+            AABB sdfBounds;
+            sdfBounds.min = scene->sdfVolumes[geom.meshid].boundsMin;
+            sdfBounds.max = scene->sdfVolumes[geom.meshid].boundsMax;
+            bounds = BVH::transformBounds(geom.transform, sdfBounds);
+        }
+        OptixAabb aabb = { bounds.min.x, bounds.min.y, bounds.min.z,
+            bounds.max.x, bounds.max.y, bounds.max.z };
+        aabbs.push_back(aabb);
+        customGeoms.push_back((int)i);
+    }
+    if (!aabbs.empty()) {
+        OptixAabb *dev_aabbs;
+        deviceMemory::allocate(&dev_aabbs, aabbs.size() * sizeof(OptixAabb));
+        cudaMemcpy(dev_aabbs, aabbs.data(), aabbs.size() * sizeof(OptixAabb), cudaMemcpyHostToDevice);
+        deviceMemory::allocate(&dev_customGeoms, customGeoms.size() * sizeof(int));
+        cudaMemcpy(dev_customGeoms, customGeoms.data(), customGeoms.size() * sizeof(int),
+            cudaMemcpyHostToDevice);
+
+        CUdeviceptr aabbBuffer = (CUdeviceptr)dev_aabbs;
+        OptixBuildInput input = {};
+        input.type = OPTIX_BUILD_INPUT_TYPE_CUSTOM_PRIMITIVES;
+        input.customPrimitiveArray.aabbBuffers = &aabbBuffer;
+        input.customPrimitiveArray.numPrimitives = (unsigned int)aabbs.size();
+        input.customPrimitiveArray.flags = &geometryFlags;
+        input.customPrimitiveArray.numSbtRecords = 1;
+        OptixTraversableHandle handle = buildAccel(input);
+        deviceMemory::release(dev_aabbs);
+        if (handle != 0) {
+            instances.push_back(makeInstance(glm::mat4(1.0f), 0, GROUP_GEOM, handle));
+        }
+    }
+
+    // One GAS per mesh, over its slice of the shared triangle array. The
+    // indices are into the shared positions, so every GAS sees all of them.
+    // Hardware traversal cannot pick a level per ray, so only the full
+    // detail of meshes with coarser versions gets one.
+    std::vector<OptixTraversableHandle> meshHandles(scene->meshes.size(), 0);
+    CUdeviceptr vertexBuffer = (CUdeviceptr)meshData.positions;
+    for (size_t m = 0; m < scene->meshes.size(); m++) {
+        const Mesh &mesh = scene->meshes[m];
+        if (mesh.triangleCount == 0 || mesh.lodLevel > 0) {
+            continue;
+        }
+        OptixBuildInput input = {};
+        input.type = OPTIX_BUILD_INPUT_TYPE_TRIANGLES;
+        input.triangleArray.vertexFormat = OPTIX_VERTEX_FORMAT_FLOAT3;
+        input.triangleArray.vertexStrideInBytes = sizeof(glm::vec3);
+        input.triangleArray.numVertices = (unsigned int)scene->meshPositions.size();
+        input.triangleArray.vertexBuffers = &vertexBuffer;
+        input.triangleArray.indexFormat = OPTIX_INDICES_FORMAT_UNSIGNED_INT3;
+        input.triangleArray.indexStrideInBytes = sizeof(glm::ivec3);
+        input.triangleArray.numIndexTriplets = mesh.triangleCount;
+        input.triangleArray.indexBuffer = (CUdeviceptr)(meshData.triangles + mesh.triangleOffset);
+        input.triangleArray.flags = &geometryFlags;
+        input.triangleArray.numSbtRecords = 1;
+        meshHandles[m] = buildAccel(input);
+    }
+    for (size_t i = 0; i < scene->geoms.size(); i++) {
+        const Geom &geom = scene->geoms[i];
+        if (geom.type == MESH && meshHandles[geom.meshid] != 0) {
+            instances.push_back(makeInstance(geom.transform, (int)i, GROUP_MESH, meshHandles[geom.meshid]));
+        }
+    }
+
+    if (!instances.empty()) {
+        OptixInstance *dev_instances;
+        deviceMemory::allocate(&dev_instances, instances.size() * sizeof(OptixInstance));
+        cudaMemcpy(dev_instances, instances.data(), instances.size() * sizeof(OptixInstance),
+            cudaMemcpyHostToDevice);
+        OptixBuildInput input = {};
+        input.type = OPTIX_BUILD_INPUT_TYPE_INSTANCES;
+        input.instanceArray.instances = (CUdeviceptr)dev_instances;
+        input.instanceArray.numInstances = (unsigned int)instances.size();
+        launchParams.handle = buildAccel(input);
+        deviceMemory::release(dev_instances);
+    }
+
+    launchParams.geoms = geoms;
+    launchParams.customGeoms = dev_customGeoms;
+    launchParams.meshData = meshData;
+    launchParams.materials = materials;
+}
+
+void intersect(int depth, int numPaths, const PathSegments &paths,
+        const ShadeableIntersections &intersections, GBufferPixel *gBuffer) {
+    if (numPaths == 0) {
+        return;
+    }
+    launchParams.paths = paths;
+    launchParams.intersections = intersections;
+    launchParams.gBuffer = gBuffer;
+    launchParams.depth = depth;
+    cudaMemcpyAsync(dev_launchParams, &launchParams, sizeof(OptixLaunchParams), cudaMemcpyHostToDevice, 0);
+    check(optixLaunch(pipeline, 0, (CUdeviceptr)dev_launchParams, sizeof(OptixLaunchParams), &sbt,
+        numPaths, 1, 1), "optixLaunch");
+}
+
+static void freeDenoiserBuffers() {
+    deviceMemory::release(dev_denoiserState);
+    deviceMemory::release(dev_denoiserScratch);
+    deviceMemory::release(dev_denoiserIntensity);
+    deviceMemory::release(dev_denoiserBeauty);
+    deviceMemory::release(dev_denoiserAlbedo);
+    deviceMemory::release(dev_denoiserNormal);
+    deviceMemory::release(dev_denoiserOutput);
+    dev_denoiserState = NULL;
+    dev_denoiserScratch = NULL;
+    dev_denoiserIntensity = NULL;
+    dev_denoiserBeauty = NULL;
+    dev_denoiserAlbedo = NULL;
+    dev_denoiserNormal = NULL;
+    dev_denoiserOutput = NULL;
+    denoiserResolution = glm::ivec2(0);
+}
+
+bool denoiserAvailable() {
+#ifdef OPTIX_AI_DENOISER
+    if (!available()) {
+        return false;
+    }
+    if (!denoiserInitialized) {
+        denoiserInitialized = true;
+        OptixDenoiserOptions options = {};
+        options.guideAlbedo = 1;
+        options.guideNormal = 1;
+        if (!check(optixDenoiserCreate(context, OPTIX_DENOISER_MODEL_KIND_HDR, &options, &denoiser),
+                "optixDenoiserCreate")) {
+            denoiser = NULL;
+        }
+    }
+    return denoiser != NULL;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Normalizes the colour into the beauty layer and unpacks the G-buffer into
+ * the albedo and camera-space normal guides. The normal's axes run along
+ * increasing columns, towards row 0 and towards the camera; misses get a
+ * zero normal.
+ */
+__global__ void prepareDenoiserLayers(Camera cam, const float4 *color, float colorScale,
+        const GBufferPixel *gBuffer, float4 *beauty, float4 *albedo, float4 *normal) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < cam.resolution.x && y < cam.resolution.y) {
+        int index = x + (y * cam.resolution.x);
+        float4 c = color[index];
+        beauty[index] = make_float4(c.x * colorScale, c.y * colorScale, c.z * colorScale, 1.0f);
+        const GBufferPixel pixel = gBuffer[index];
+        glm::vec3 a = gbufferAlbedo(pixel);
+        albedo[index] = make_float4(a.x, a.y, a.z, 1.0f);
+        glm::vec3 n = gbufferNormal(pixel);
+        normal[index] = make_float4(-glm::dot(n, glm::normalize(cam.right)),
+            glm::dot(n, glm::normalize(cam.up)), -glm::dot(n, glm::normalize(cam.view)), 0.0f);
+    }
+}
+
+#ifdef OPTIX_AI_DENOISER
+
+// (Re)allocates the denoiser's buffers when the resolution changes
+static bool setupDenoiser(glm::ivec2 resolution, cudaStream_t stream) {
+    if (resolution == denoiserResolution) {
+        return true;
+    }
+    freeDenoiserBuffers();
+    OptixDenoiserSizes sizes;
+    if (!check(optixDenoiserComputeMemoryResources(denoiser, resolution.x, resolution.y, &sizes),
+            "optixDenoiserComputeMemoryResources")) {
+        return false;
+    }
+    denoiserStateBytes = sizes.stateSizeInBytes;
+    // The intensity computation shares the invocation's scratch
+    denoiserScratchBytes = glm::max(sizes.withoutOverlapScratchSizeInBytes, sizes.computeIntensitySizeInBytes);
+    const size_t pixelcount = (size_t)resolution.x * resolution.y;
+    deviceMemory::allocate(&dev_denoiserState, denoiserStateBytes);
+    deviceMemory::allocate(&dev_denoiserScratch, denoiserScratchBytes);
+    deviceMemory::allocate(&dev_denoiserIntensity, sizeof(float));
+    deviceMemory::allocate(&dev_denoiserBeauty, pixelcount * sizeof(float4));
+    deviceMemory::allocate(&dev_denoiserAlbedo, pixelcount * sizeof(float4));
+    deviceMemory::allocate(&dev_denoiserNormal, pixelcount * sizeof(float4));
+    deviceMemory::allocate(&dev_denoiserOutput, pixelcount * sizeof(float4));
+    if (!check(optixDenoiserSetup(denoiser, stream, resolution.x, resolution.y,
+            (CUdeviceptr)dev_denoiserState, denoiserStateBytes,
+            (CUdeviceptr)dev_denoiserScratch, denoiserScratchBytes), "optixDenoiserSetup")) {
+        freeDenoiserBuffers();
+        return false;
+    }
+    denoiserResolution = resolution;
+    return true;
+}
+
+static OptixImage2D denoiserImage(float4 *data, glm::ivec2 resolution) {
+    OptixImage2D image = {};
+    image.data = (CUdeviceptr)data;
+    image.width = resolution.x;
+    image.height = resolution.y;
+    image.rowStrideInBytes = resolution.x * sizeof(float4);
+    image.pixelStrideInBytes = sizeof(float4);
+    image.format = OPTIX_PIXEL_FORMAT_FLOAT4;
+    return image;
+}
+
+#endif
+
+const float4 *denoise(const Camera &cam, const float4 *color, float colorScale,
+        const GBufferPixel *gBuffer, cudaStream_t stream) {
+#ifdef OPTIX_AI_DENOISER
+    if (!denoiserAvailable() || !setupDenoiser(cam.resolution, stream)) {
+        return NULL;
+    }
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    prepareDenoiserLayers<<<blocksPerGrid2d, blockSize2d, 0, stream>>>(cam, color, colorScale, gBuffer,
+            dev_denoiserBeauty, dev_denoiserAlbedo, dev_denoiserNormal);
+
+    OptixDenoiserGuideLayer guides = {};
+    guides.albedo = denoiserImage(dev_denoiserAlbedo, cam.resolution);
+    guides.normal = denoiserImage(dev_denoiserNormal, cam.resolution);
+    OptixDenoiserLayer layer = {};
+    layer.input = denoiserImage(dev_denoiserBeauty, cam.resolution);
+    layer.output = denoiserImage(dev_denoiserOutput, cam.resolution);
+
+    // The HDR model expects its input scaled to a fixed average intensity
+    if (!check(optixDenoiserComputeIntensity(denoiser, stream, &layer.input, (CUdeviceptr)dev_denoiserIntensity,
+            (CUdeviceptr)dev_denoiserScratch, denoiserScratchBytes), "optixDenoiserComputeIntensity")) {
+        return NULL;
+    }
+    OptixDenoiserParams params = {};
+    params.hdrIntensity = (CUdeviceptr)dev_denoiserIntensity;
+    params.blendFactor = 0.0f;
+    if (!check(optixDenoiserInvoke(denoiser, stream, &params,
+            (CUdeviceptr)dev_denoiserState, denoiserStateBytes, &guides, &layer, 1, 0, 0,
+            (CUdeviceptr)dev_denoiserScratch, denoiserScratchBytes), "optixDenoiserInvoke")) {
+        return NULL;
+    }
+    return dev_denoiserOutput;
+#else
+    return NULL;
+#endif
+}
+
+void release() {
+    freeAccel();
+    freeDenoiserBuffers();
+#ifdef OPTIX_AI_DENOISER
+    if (denoiser != NULL) {
+        optixDenoiserDestroy(denoiser);
+        denoiser = NULL;
+    }
+#endif
+    denoiserInitialized = false;
+    if (!ready) {
+        return;
+    }
+    deviceMemory::release(dev_launchParams);
+    deviceMemory::release(dev_sbtRecords);
+    dev_launchParams = NULL;
+    dev_sbtRecords = NULL;
+    optixPipelineDestroy(pipeline);
+    for (int i = 0; i < GROUP_COUNT; i++) {
+        optixProgramGroupDestroy(groups[i]);
+    }
+    optixModuleDestroy(module);
+    optixDeviceContextDestroy(context);
+    initialized = false;
+    ready = false;
+}
+
+#else
+
+bool available() {
+    return false;
+}
+
+void build(const Scene *, const DeviceGeom *, const Material *, const MeshData &) {
+}
+
+void intersect(int, int, const PathSegments &, const ShadeableIntersections &, GBufferPixel *) {
+}
+
+bool denoiserAvailable() {
+    return false;
+}
+
+const float4 *denoise(const Camera &, const float4 *, float, const GBufferPixel *, cudaStream_t) {
+    return NULL;
+}
+
+void release() {
+}
+
+#endif
+
+}
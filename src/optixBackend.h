@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+#include "scene.h"
+#include "sceneStructs.h"
+
+/**
+ * Hardware ray tracing of the path bounces through OptiX, compiled in only
+ * when the build defines ENABLE_OPTIX (cmake -DENABLE_OPTIX=ON
+ * -DOptiX_INSTALL_DIR=...). Otherwise available() is false and the rest
+ * does nothing, so callers keep the CUDA kernels.
+ *
+ * The scene becomes an instance AS over one GAS of custom primitives for
+ * its spheres and cubes and one triangle GAS per mesh, instanced by each
+ * geom that uses the mesh. intersect() fills the same intersection and
+ * G-buffer entries as computeIntersections.
+ */
+namespace OptixBackend {
+    // Whether OptiX is compiled in and a pipeline could be created on the
+    // current device; the first call creates it
+    bool available();
+
+    /**
+     * Builds the acceleration structures of `scene` from its arrays already
+     * uploaded to the current device, replacing any earlier ones. The
+     * pointers are kept for intersect() and must stay valid until the next
+     * build() or release().
+     */
+    void build(const Scene *scene, const DeviceGeom *geoms, const Material *materials,
+            const MeshData &meshData);
+
+    // Intersects paths [0, numPaths) of a bounce on the default stream
+    void intersect(int depth, int numPaths, const PathSegments &paths,
+            const ShadeableIntersections &intersections, GBufferPixel *gBuffer);
+
+    // Whether the OptiX AI denoiser can run: available() and OptiX 7.3 or later
+    bool denoiserAvailable();
+
+    /**
+     * Runs the AI denoiser (HDR model, albedo and normal guides) on `color`
+     * scaled by colorScale, taking the guides from the first-hit G-buffer,
+     * all on the device. Returns the denoised image, which stays valid until
+     * the next call or release(), or NULL if the denoiser is unavailable.
+     */
+    const float4 *denoise(const Camera &cam, const float4 *color, float colorScale,
+            const GBufferPixel *gBuffer, cudaStream_t stream);
+
+    // Frees the acceleration structures, the denoiser and the pipeline
+    void release();
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <optix.h>
+
+#include "sceneStructs.h"
+
+/**
+ * What optixPrograms.cu reads from its "params" constant: the scene's
+ * acceleration structure, the bounce's path and intersection buffers and
+ * the device scene arrays the hit is resolved against, which are the same
+ * ones computeIntersections is passed.
+ */
+struct OptixLaunchParams {
+    OptixTraversableHandle handle;
+    PathSegments paths;
+    ShadeableIntersections intersections;
+    GBufferPixel * gBuffer;     // NULL unless this is the G-buffer bounce
+    int depth;
+    const DeviceGeom * geoms;
+    const int * customGeoms;    // geom of each primitive of the custom GAS
+    MeshData meshData;
+    const Material * materials;
+};
@@ -0,0 +1,139 @@
+#include <cfloat>
+#include <optix.h>
+
+#include "optixLaunchParams.h"
+#include "gbuffer.h"
+#include "intersections.h"
+#include "pathbuffers.h"
+
+/**
+ * OptiX programs for the hardware ray tracing backend, compiled to PTX on
+ * their own (see CMakeLists.txt) and loaded by optixBackend.cu. One launch
+ * index per path slot does what intersectPath does in pathtrace.cu, with
+ * the traversal and triangle tests left to the RT cores. Spheres, cubes,
+ * sphere clouds and SDF volumes are custom primitives tested by the same
+ * functions the CUDA kernels use; a cloud walks its own BVH in software
+ * and an SDF sphere-traces its grid.
+ *
+ * Hits come back as payloads: geom, t, and for meshes the triangle and its
+ * barycentrics, so the normal is computed once, by surfaceNormal.
+ */
+
+extern "C" {
+__constant__ OptixLaunchParams params;
+}
+
+static __device__ float customIntersectionTest(const DeviceGeom &geom, Ray r, MeshHit &hit) {
+    if (geom.type == SPHERE_CLOUD) {
+        return sphereCloudIntersectionTest(geom, r, params.meshData, optixGetRayTmax(), hit);
+    } else if (geom.type == SDF_VOLUME) {
+        return sdfIntersectionTest(geom, r, params.meshData, optixGetRayTmax());
+    } else if (geom.type == AXIS_ALIGNED_CUBE) {
+        return axisAlignedBoxIntersectionTest(geom, r);
+    } else if (geom.type == UNIFORM_SPHERE) {
+        return uniformSphereIntersectionTest(geom, r);
+    } else if (geom.type == CUBE) {
+        return boxIntersectionTest(geom, r);
+    }
+    return sphereIntersectionTest(geom, r);
+}
+
+extern "C" __global__ void __raygen__bounce() {
+    const int path_index = optixGetLaunchIndex().x;
+
+    Ray ray = loadRay(params.paths, path_index);
+
+    unsigned int geomIndex = (unsigned int)-1;
+    unsigned int t = 0;
+    unsigned int triangle = 0;
+    unsigned int u = 0;
+    unsigned int v = 0;
+    optixTrace(params.handle,
+        make_float3(ray.origin.x, ray.origin.y, ray.origin.z),
+        make_float3(ray.direction.x, ray.direction.y, ray.direction.z),
+        0.0f, FLT_MAX, 0.0f, OptixVisibilityMask(255), OPTIX_RAY_FLAG_DISABLE_ANYHIT,
+        0, 1, 0, geomIndex, t, triangle, u, v);
+
+    // With several samples per pixel only sample 0, which sits in the
+    // pixel's own slot, writes the G-buffer
+    GBufferPixel * gBufferPixel = NULL;
+    if (params.depth == 0 && params.gBuffer != NULL) {
+        int pixel = loadPixelIndex(params.paths, path_index);
+        gBufferPixel = pixel == path_index ? &params.gBuffer[pixel] : NULL;
+    }
+
+    if ((int)geomIndex < 0) {
+        storeIntersectionMiss(params.intersections, path_index);
+        if (gBufferPixel != NULL) {
+            encodeGBufferMiss(*gBufferPixel);
+        }
+        return;
+    }
+
+    const DeviceGeom &geom = params.geoms[geomIndex];
+    MeshHit meshHit;
+    meshHit.triangle = (int)triangle;
+    meshHit.u = __uint_as_float(u);
+    meshHit.v = __uint_as_float(v);
+    const float hitT = __uint_as_float(t);
+    bool frontFace;
+    glm::vec3 normal = surfaceNormal(geom, ray, hitT, params.meshData, meshHit, frontFace);
+    const int materialid = hitMaterial(geom, params.meshData, meshHit);
+    storeIntersection(params.intersections, path_index, hitT, materialid, normal, (int)geomIndex,
+        frontFace);
+    if (hasTextureMaps(params.materials[materialid])) {
+        ShadeableIntersection intersection;
+        intersection.surfaceNormal = normal;
+        surfaceFrame(geom, ray, hitT, params.meshData, meshHit, intersection);
+        storeIntersectionSurface(params.intersections, path_index, intersection);
+    }
+    // The G-buffer gets the untextured albedo; texture lookups stay in pathtrace.cu
+    if (gBufferPixel != NULL) {
+        encodeGBufferPixel(*gBufferPixel, hitT, normal,
+            params.materials[materialid].color, materialid);
+    }
+}
+
+extern "C" __global__ void __miss__bounce() {
+    optixSetPayload_0((unsigned int)-1);
+}
+
+// Spheres and cubes live in one GAS under an identity instance, so the
+// world ray is the one the tests expect
+extern "C" __global__ void __intersection__geom() {
+    const DeviceGeom &geom = params.geoms[params.customGeoms[optixGetPrimitiveIndex()]];
+    float3 origin = optixGetWorldRayOrigin();
+    float3 direction = optixGetWorldRayDirection();
+    Ray ray;
+    ray.origin = glm::vec3(origin.x, origin.y, origin.z);
+    ray.direction = glm::vec3(direction.x, direction.y, direction.z);
+    ray.coneWidth = 0.0f;
+    ray.coneSpread = 0.0f;
+
+    MeshHit hit;
+    hit.triangle = 0;
+    float t = customIntersectionTest(geom, ray, hit);
+    if (t > optixGetRayTmin() && t < optixGetRayTmax()) {
+        optixReportIntersection(t, 0, (unsigned int)hit.triangle);
+    }
+}
+
+// A cloud's sphere comes back in the triangle payload
+extern "C" __global__ void __closesthit__geom() {
+    optixSetPayload_0((unsigned int)params.customGeoms[optixGetPrimitiveIndex()]);
+    optixSetPayload_1(__float_as_uint(optixGetRayTmax()));
+    optixSetPayload_2(optixGetAttribute_0());
+}
+
+// Mesh instances carry their geom as the instance id. The instance
+// transform maps the ray without renormalizing it, so t is the world one.
+extern "C" __global__ void __closesthit__mesh() {
+    const int geomIndex = optixGetInstanceId();
+    const Mesh &mesh = params.meshData.meshes[params.geoms[geomIndex].meshid];
+    const float2 barycentrics = optixGetTriangleBarycentrics();
+    optixSetPayload_0((unsigned int)geomIndex);
+    optixSetPayload_1(__float_as_uint(optixGetRayTmax()));
+    optixSetPayload_2((unsigned int)(mesh.triangleOffset + optixGetPrimitiveIndex()));
+    optixSetPayload_3(__float_as_uint(barycentrics.x));
+    optixSetPayload_4(__float_as_uint(barycentrics.y));
+}
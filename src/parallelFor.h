@@ -0,0 +1,37 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/**
+ * Calls body(i) for every i in [0, count) on up to one thread per core,
+ * which take `grain` consecutive indices at a time. Runs on the calling
+ * thread alone when there is at most one grain of work.
+ */
+template <typename F>
+void parallelFor(int count, int grain, const F &body) {
+    int threadCount = std::min((count + grain - 1) / grain, (int)std::thread::hardware_concurrency());
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int begin = next.fetch_add(grain); begin < count; begin = next.fetch_add(grain)) {
+            int end = std::min(begin + grain, count);
+            for (int i = begin; i < end; i++) {
+                body(i);
+            }
+        }
+    };
+    if (threadCount <= 1) {
+        worker();
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int t = 1; t < threadCount; t++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+}
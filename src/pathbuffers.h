@@ -0,0 +1,326 @@
+#pragma once
+
+#include <cuda_runtime.h>
+#include <cuda_fp16.h>
+#include "glm/glm.hpp"
+
+#include "sceneStructs.h"
+#include "gbuffer.h"
+
+/**
+ * Element access for the structure-of-arrays PathSegments and
+ * ShadeableIntersections buffers. Kernels work on the AoS structs in
+ * registers and only go through these to load and store, so each one reads
+ * just the field groups it uses.
+ */
+
+__device__ inline float4 packVec3(glm::vec3 v, float w) {
+    return make_float4(v.x, v.y, v.z, w);
+}
+
+__device__ inline glm::vec3 unpackVec3(float4 v) {
+    return glm::vec3(v.x, v.y, v.z);
+}
+
+// Marks specularPath in the top bit of the stored sampleIndex
+#define PATH_SPECULAR_BIT 0x80000000u
+// Set in the sampleIndex of split paths (see kernSplitPaths), whose numbers
+// then never meet a camera path's
+#define PATH_SPLIT_SAMPLE_BIT 0x40000000u
+
+/**
+ * The compact layout keeps the ray origin and scatterPdf at full precision
+ * and quantizes the rest: the direction octahedral like G-buffer normals,
+ * color, radiance and the cone as halves, saturated at the largest, and
+ * remainingBounces in the low bits of pixelIndex's word. Directions come
+ * back within about 1e-4 radians, so images differ from the full layout's
+ * in the noise but not on average.
+ */
+#define PATH_BOUNCE_BITS 6
+#define PATH_BOUNCE_MASK ((1u << PATH_BOUNCE_BITS) - 1u)
+// Traces deeper than this, or pixel counts past the other, keep the full layout
+#define PATH_COMPACT_MAX_DEPTH ((int)PATH_BOUNCE_MASK)
+#define PATH_COMPACT_MAX_PIXELS (1 << (32 - PATH_BOUNCE_BITS))
+#define PATH_HALF_MAX 65504.0f
+
+// Bytes of one path in either layout, for buffer sizes and traffic estimates
+#define PATH_SEGMENT_BYTES (4 * sizeof(float4) + sizeof(float2))
+#define PATH_SEGMENT_COMPACT_BYTES (sizeof(float4) + sizeof(uint4) + sizeof(uint2) + sizeof(unsigned int))
+
+__host__ __device__ inline bool isCompact(const PathSegments &paths) {
+    return paths.originOctDirection != NULL;
+}
+
+__device__ inline unsigned int packHalf2(float lo, float hi) {
+    lo = glm::clamp(lo, -PATH_HALF_MAX, PATH_HALF_MAX);
+    hi = glm::clamp(hi, -PATH_HALF_MAX, PATH_HALF_MAX);
+    return (unsigned int)__half_as_ushort(__float2half_rn(lo))
+        | ((unsigned int)__half_as_ushort(__float2half_rn(hi)) << 16);
+}
+
+__device__ inline float unpackHalfLo(unsigned int bits) {
+    return __half2float(__ushort_as_half((unsigned short)(bits & 0xffff)));
+}
+
+__device__ inline float unpackHalfHi(unsigned int bits) {
+    return __half2float(__ushort_as_half((unsigned short)(bits >> 16)));
+}
+
+__device__ inline float4 packOriginDirection(glm::vec3 origin, glm::vec3 direction) {
+    unsigned short oct[2];
+    encodeOctNormal(direction, oct);
+    return packVec3(origin, __int_as_float((int)(oct[0] | ((unsigned int)oct[1] << 16))));
+}
+
+__device__ inline glm::vec3 unpackOctDirection(float4 originDirection) {
+    unsigned int bits = (unsigned int)__float_as_int(originDirection.w);
+    unsigned short oct[2] = { (unsigned short)(bits & 0xffff), (unsigned short)(bits >> 16) };
+    return decodeOctNormal(oct);
+}
+
+__device__ inline glm::vec3 unpackThroughput(uint4 throughputPixel) {
+    return glm::vec3(unpackHalfLo(throughputPixel.x), unpackHalfHi(throughputPixel.x),
+        unpackHalfLo(throughputPixel.y));
+}
+
+__device__ inline int unpackCompactPixel(uint4 throughputPixel) {
+    return (int)(throughputPixel.w >> PATH_BOUNCE_BITS);
+}
+
+__device__ inline PathSegment unpackCompactPathSegment(float4 originDirection, uint4 throughputPixel,
+        uint2 samplePdf, unsigned int cone) {
+    PathSegment segment;
+    segment.ray.origin = unpackVec3(originDirection);
+    segment.ray.direction = unpackOctDirection(originDirection);
+    segment.ray.coneWidth = unpackHalfLo(cone);
+    segment.ray.coneSpread = unpackHalfHi(cone);
+    segment.color = unpackThroughput(throughputPixel);
+    segment.radiance = glm::vec3(unpackHalfHi(throughputPixel.y), unpackHalfLo(throughputPixel.z),
+        unpackHalfHi(throughputPixel.z));
+    segment.pixelIndex = unpackCompactPixel(throughputPixel);
+    segment.remainingBounces = (int)(throughputPixel.w & PATH_BOUNCE_MASK);
+    segment.sampleIndex = (int)(samplePdf.x & ~PATH_SPECULAR_BIT);
+    segment.specularPath = (samplePdf.x & PATH_SPECULAR_BIT) != 0;
+    segment.scatterPdf = __int_as_float((int)samplePdf.y);
+    return segment;
+}
+
+__device__ inline void storeCompactPathSegment(const PathSegments &paths, int index, const PathSegment &segment) {
+    paths.originOctDirection[index] = packOriginDirection(segment.ray.origin, segment.ray.direction);
+    paths.throughputPixel[index] = make_uint4(packHalf2(segment.color.x, segment.color.y),
+        packHalf2(segment.color.z, segment.radiance.x), packHalf2(segment.radiance.y, segment.radiance.z),
+        ((unsigned int)segment.pixelIndex << PATH_BOUNCE_BITS) | ((unsigned int)segment.remainingBounces & PATH_BOUNCE_MASK));
+    paths.samplePdf[index] = make_uint2((unsigned int)segment.sampleIndex | (segment.specularPath ? PATH_SPECULAR_BIT : 0u),
+        (unsigned int)__float_as_int(segment.scatterPdf));
+    paths.packedCone[index] = packHalf2(segment.ray.coneWidth, segment.ray.coneSpread);
+}
+
+__device__ inline PathSegment unpackPathSegment(float4 originBounces, float4 direction,
+        float4 colorPixel, float4 radiancePdf, float2 cone) {
+    PathSegment segment;
+    segment.ray.origin = unpackVec3(originBounces);
+    segment.ray.direction = unpackVec3(direction);
+    segment.ray.coneWidth = cone.x;
+    segment.ray.coneSpread = cone.y;
+    segment.color = unpackVec3(colorPixel);
+    segment.pixelIndex = __float_as_int(colorPixel.w);
+    segment.remainingBounces = __float_as_int(originBounces.w);
+    segment.sampleIndex = (int)((unsigned int)__float_as_int(direction.w) & ~PATH_SPECULAR_BIT);
+    segment.specularPath = ((unsigned int)__float_as_int(direction.w) & PATH_SPECULAR_BIT) != 0;
+    segment.radiance = unpackVec3(radiancePdf);
+    segment.scatterPdf = radiancePdf.w;
+    return segment;
+}
+
+__device__ inline PathSegment loadPathSegment(const PathSegments &paths, int index) {
+    if (isCompact(paths)) {
+        return unpackCompactPathSegment(paths.originOctDirection[index], paths.throughputPixel[index],
+            paths.samplePdf[index], paths.packedCone[index]);
+    }
+    return unpackPathSegment(paths.originBounces[index], paths.direction[index],
+        paths.colorPixel[index], paths.radiancePdf[index], paths.cone[index]);
+}
+
+// Reads around L1, which is not kept coherent between SMs, for a segment
+// another block stored during the same launch
+__device__ inline PathSegment loadPathSegmentCoherent(const PathSegments &paths, int index) {
+    if (isCompact(paths)) {
+        return unpackCompactPathSegment(__ldcg(&paths.originOctDirection[index]),
+            __ldcg(&paths.throughputPixel[index]), __ldcg(&paths.samplePdf[index]), __ldcg(&paths.packedCone[index]));
+    }
+    return unpackPathSegment(__ldcg(&paths.originBounces[index]), __ldcg(&paths.direction[index]),
+        __ldcg(&paths.colorPixel[index]), __ldcg(&paths.radiancePdf[index]), __ldcg(&paths.cone[index]));
+}
+
+__device__ inline void storePathSegment(const PathSegments &paths, int index, const PathSegment &segment) {
+    if (isCompact(paths)) {
+        storeCompactPathSegment(paths, index, segment);
+        return;
+    }
+    paths.originBounces[index] = packVec3(segment.ray.origin, __int_as_float(segment.remainingBounces));
+    paths.direction[index] = packVec3(segment.ray.direction,
+        __int_as_float((int)((unsigned int)segment.sampleIndex | (segment.specularPath ? PATH_SPECULAR_BIT : 0u))));
+    paths.colorPixel[index] = packVec3(segment.color, __int_as_float(segment.pixelIndex));
+    paths.radiancePdf[index] = packVec3(segment.radiance, segment.scatterPdf);
+    paths.cone[index] = make_float2(segment.ray.coneWidth, segment.ray.coneSpread);
+}
+
+// The ray alone, for the traversal kernels
+__device__ inline Ray loadRay(const PathSegments &paths, int index) {
+    Ray ray;
+    if (isCompact(paths)) {
+        float4 originDirection = paths.originOctDirection[index];
+        unsigned int cone = paths.packedCone[index];
+        ray.origin = unpackVec3(originDirection);
+        ray.direction = unpackOctDirection(originDirection);
+        ray.coneWidth = unpackHalfLo(cone);
+        ray.coneSpread = unpackHalfHi(cone);
+        return ray;
+    }
+    ray.origin = unpackVec3(paths.originBounces[index]);
+    ray.direction = unpackVec3(paths.direction[index]);
+    float2 cone = paths.cone[index];
+    ray.coneWidth = cone.x;
+    ray.coneSpread = cone.y;
+    return ray;
+}
+
+__device__ inline int loadRemainingBounces(const PathSegments &paths, int index) {
+    if (isCompact(paths)) {
+        return (int)(paths.throughputPixel[index].w & PATH_BOUNCE_MASK);
+    }
+    return __float_as_int(paths.originBounces[index].w);
+}
+
+__device__ inline int loadPixelIndex(const PathSegments &paths, int index) {
+    if (isCompact(paths)) {
+        return unpackCompactPixel(paths.throughputPixel[index]);
+    }
+    return __float_as_int(paths.colorPixel[index].w);
+}
+
+// sampleIndex with the specular bit, as stored
+__device__ inline unsigned int loadSampleBits(const PathSegments &paths, int index) {
+    if (isCompact(paths)) {
+        return paths.samplePdf[index].x;
+    }
+    return (unsigned int)__float_as_int(paths.direction[index].w);
+}
+
+// The gathers' view of a path: color, and pixelIndex in the bits of w
+__device__ inline float4 loadColorPixel(const PathSegments &paths, int index) {
+    if (isCompact(paths)) {
+        uint4 throughputPixel = paths.throughputPixel[index];
+        return packVec3(unpackThroughput(throughputPixel), __int_as_float(unpackCompactPixel(throughputPixel)));
+    }
+    return paths.colorPixel[index];
+}
+
+// Both buffers must have the same layout
+__device__ inline void copyPathSegment(const PathSegments &dst, int dstIndex,
+        const PathSegments &src, int srcIndex) {
+    if (isCompact(src)) {
+        dst.originOctDirection[dstIndex] = src.originOctDirection[srcIndex];
+        dst.throughputPixel[dstIndex] = src.throughputPixel[srcIndex];
+        dst.samplePdf[dstIndex] = src.samplePdf[srcIndex];
+        dst.packedCone[dstIndex] = src.packedCone[srcIndex];
+        return;
+    }
+    dst.originBounces[dstIndex] = src.originBounces[srcIndex];
+    dst.direction[dstIndex] = src.direction[srcIndex];
+    dst.colorPixel[dstIndex] = src.colorPixel[srcIndex];
+    dst.radiancePdf[dstIndex] = src.radiancePdf[srcIndex];
+    dst.cone[dstIndex] = src.cone[srcIndex];
+}
+
+__device__ inline ShadeableIntersection loadIntersection(const ShadeableIntersections &intersections, int index) {
+    float2 tMaterial = intersections.tMaterial[index];
+
+    ShadeableIntersection intersection;
+    intersection.t = tMaterial.x;
+    intersection.materialId = __float_as_int(tMaterial.y);
+    intersection.surfaceNormal = glm::vec3(0.0f);
+    intersection.geomIndex = -1;
+    intersection.frontFace = true;
+    if (tMaterial.x > 0.0f) {
+        float4 normal = intersections.normal[index];
+        int geomIndex = __float_as_int(normal.w);
+        intersection.surfaceNormal = unpackVec3(normal);
+        intersection.geomIndex = geomIndex >= 0 ? geomIndex : ~geomIndex;
+        intersection.frontFace = geomIndex >= 0;
+    }
+    return intersection;
+}
+
+__device__ inline void storeIntersection(const ShadeableIntersections &intersections, int index,
+        float t, int materialId, glm::vec3 normal, int geomIndex, bool frontFace) {
+    intersections.tMaterial[index] = make_float2(t, __int_as_float(materialId));
+    intersections.normal[index] = packVec3(normal, __int_as_float(frontFace ? geomIndex : ~geomIndex));
+}
+
+/**
+ * The texturing half of an intersection, kept apart so untextured hits and
+ * the kernels that ignore it never touch it. The tangent is octahedral in
+ * the bits of z; w is uvDensity, negated for a mirrored bitangent.
+ */
+__device__ inline void storeIntersectionSurface(const ShadeableIntersections &intersections, int index,
+        const ShadeableIntersection &intersection) {
+    unsigned short tangent[2];
+    encodeOctNormal(intersection.tangent, tangent);
+    intersections.surface[index] = make_float4(intersection.uv.x, intersection.uv.y,
+        __int_as_float((int)(tangent[0] | ((unsigned int)tangent[1] << 16))),
+        intersection.bitangentSign * intersection.uvDensity);
+}
+
+__device__ inline void loadIntersectionSurface(const ShadeableIntersections &intersections, int index,
+        ShadeableIntersection &intersection) {
+    float4 surface = intersections.surface[index];
+    unsigned int bits = (unsigned int)__float_as_int(surface.z);
+    unsigned short tangent[2] = { (unsigned short)(bits & 0xffff), (unsigned short)(bits >> 16) };
+    intersection.uv = glm::vec2(surface.x, surface.y);
+    intersection.tangent = decodeOctNormal(tangent);
+    intersection.bitangentSign = surface.w < 0.0f ? -1.0f : 1.0f;
+    intersection.uvDensity = fabsf(surface.w);
+}
+
+/**
+ * The reduced intersection kernel's 16-byte hit: t and the closest geom in
+ * tMaterial, in place of its material, and an 8-byte record of the mesh
+ * triangle hit and its barycentrics, quantized to 16 bits each. The
+ * material is looked up through the geom by the sort keys and shading,
+ * which rebuild the normal and texture frame from the record.
+ */
+__device__ inline void storeHitRecord(const ShadeableIntersections &intersections, int index,
+        float t, int geomIndex, int triangle, float u, float v) {
+    unsigned int qu = (unsigned int)(glm::clamp(u, 0.0f, 1.0f) * 65535.0f + 0.5f);
+    unsigned int qv = (unsigned int)(glm::clamp(v, 0.0f, 1.0f) * 65535.0f + 0.5f);
+    intersections.tMaterial[index] = make_float2(t, __int_as_float(geomIndex));
+    intersections.hitRecord[index] = make_int2(triangle, (int)(qu | (qv << 16)));
+}
+
+// A hit record's triangle and barycentrics (see storeHitRecord)
+__device__ inline void loadHitRecordTriangle(const ShadeableIntersections &intersections, int index,
+        int &triangle, float &u, float &v) {
+    int2 record = intersections.hitRecord[index];
+    unsigned int bits = (unsigned int)record.y;
+    triangle = record.x;
+    u = (float)(bits & 0xffff) / 65535.0f;
+    v = (float)(bits >> 16) / 65535.0f;
+}
+
+__device__ inline void storeIntersectionMiss(const ShadeableIntersections &intersections, int index) {
+    intersections.tMaterial[index] = make_float2(-1.0f, __int_as_float(-1));
+}
+
+__device__ inline void copyIntersection(const ShadeableIntersections &dst, int dstIndex,
+        const ShadeableIntersections &src, int srcIndex) {
+    dst.tMaterial[dstIndex] = src.tMaterial[srcIndex];
+    dst.normal[dstIndex] = src.normal[srcIndex];
+    dst.surface[dstIndex] = src.surface[srcIndex];
+}
+
+__device__ inline void copyHitRecord(const ShadeableIntersections &dst, int dstIndex,
+        const ShadeableIntersections &src, int srcIndex) {
+    dst.tMaterial[dstIndex] = src.tMaterial[srcIndex];
+    dst.hitRecord[dstIndex] = src.hitRecord[srcIndex];
+}
@@ -1,6 +1,11 @@
 #include <cstdio>
 #include <cuda.h>
 #include <cmath>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <cooperative_groups.h>
 #include <thrust/execution_policy.h>
 #include <thrust/random.h>
 #include <thrust/remove.h>
@@ -8,19 +13,68 @@
 #include "sceneStructs.h"
 #include "scene.h"
 #include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
 #include "glm/gtx/norm.hpp"
 #include "utilities.h"
+#include "deviceMemory.h"
 #include "pathtrace.h"
 #include "intersections.h"
+#include "lbvh.h"
 #include "interactions.h"
+#include "lights.h"
+#include "radianceCache.h"
+#include "guiding.h"
+#include "photonMap.h"
+#include "bidirectional.h"
+#include "restir.h"
+#include "media.h"
+#include "gbuffer.h"
+#include "pathbuffers.h"
+#include "nvtx.h"
+#include "optixBackend.h"
+#include "texture.h"
+#include "virtualTexture.h"
+#include "accumulationCodec.h"
+#include "tileCulling.h"
+#include "sceneShare.h"
+#include "../stream_compaction/efficient.h"
+#include "../stream_compaction/radix.h"
+#include "../denoiser/colorBuffers.h"
+#include "../denoiser/denoiser.h"
 
-#define ERRORCHECK 1
+// ERRORCHECK 2 synchronizes at every check, so a fault is reported against
+// the kernel that caused it, but the CPU stalls after every launch.
+// ERRORCHECK 1 checks without synchronizing: launch errors are caught at
+// once, execution faults at the first check after they surface (at the
+// latest when the frame's display texture is unmapped). 0 disables checking.
+#ifndef ERRORCHECK
+#  ifdef NDEBUG
+#    define ERRORCHECK 1
+#  else
+#    define ERRORCHECK 2
+#  endif
+#endif
 
 #define FILENAME (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
 #define checkCUDAError(msg) checkCUDAErrorFn(msg, FILENAME, __LINE__)
+
+// Geom and Material arrays up to this size are staged into shared memory by
+// each block of the intersection and shading kernels; larger ones are read
+// from global memory. Constant memory is not used because the BVH and the
+// material lookup are indexed per thread, which serializes constant reads.
+#define SCENE_SHARED_MAX_BYTES 8192
+
+#define WARP_SIZE 32
+#define PERSISTENT_BLOCK_SIZE 128
+#define COOPERATIVE_BLOCK_SIZE 128
+// The heavy kernels are compiled for blocks up to this size, which bounds
+// their registers so any size the occupancy calculator picks fits
+#define LAUNCH_MAX_BLOCK_SIZE 256
 void checkCUDAErrorFn(const char *msg, const char *file, int line) {
 #if ERRORCHECK
+#  if ERRORCHECK > 1
     cudaDeviceSynchronize();
+#  endif
     cudaError_t err = cudaGetLastError();
     if (cudaSuccess == err) {
         return;
@@ -39,395 +93,10269 @@ void checkCUDAErrorFn(const char *msg, const char *file, int line) {
 }
 
 __host__ __device__
-thrust::default_random_engine makeSeededRandomEngine(int iter, int index, int depth) {
-    int h = utilhash((1 << 31) | (depth << 22) | iter) ^ utilhash(index);
+thrust::default_random_engine makeSeededRandomEngine(int sample, int pixel, int depth) {
+    int h = utilhash((1 << 31) | (depth << 22) | sample) ^ utilhash(pixel);
     return thrust::default_random_engine(h);
 }
 
-//Kernel that writes the image to the OpenGL PBO directly.
-__global__ void sendImageToPBO(uchar4* pbo, glm::ivec2 resolution,
-        int iter, glm::vec3* image) {
-    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
-    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+// Drops the padding of colours copied back from the device
+static void copyHostColors(const float4 *in, int n, glm::vec3 *out) {
+    for (int i = 0; i < n; i++) {
+        out[i] = glm::vec3(in[i].x, in[i].y, in[i].z);
+    }
+}
 
-    if (x < resolution.x && y < resolution.y) {
-        int index = x + (y * resolution.x);
-        glm::vec3 pix = image[index];
+// Tone curve of one channel of exposed radiance, see ToneMapper
+__device__ inline float toneMap(float c, int toneMapper) {
+    if (toneMapper == TONEMAP_REINHARD) {
+        return c / (1.0f + c);
+    } else if (toneMapper == TONEMAP_ACES) {
+        return (c * (2.51f * c + 0.03f)) / (c * (2.43f * c + 0.59f) + 0.14f);
+    }
+    return c;
+}
 
-        glm::ivec3 color;
-        color.x = glm::clamp((int) (pix.x / iter * 255.0), 0, 255);
-        color.y = glm::clamp((int) (pix.y / iter * 255.0), 0, 255);
-        color.z = glm::clamp((int) (pix.z / iter * 255.0), 0, 255);
+__device__ inline float srgbEncode(float c) {
+    return c <= 0.0031308f ? 12.92f * c : 1.055f * __powf(c, 1.0f / 2.4f) - 0.055f;
+}
 
-        // Each thread writes one pixel location in the texture (textel)
-        pbo[index].w = 0;
-        pbo[index].x = color.x;
-        pbo[index].y = color.y;
-        pbo[index].z = color.z;
+/**
+ * One display channel: scaled by `scale` (the exposure, times 1 / iter for
+ * a sum), tone mapped, clamped to [0, 1], optionally sRGB encoded and
+ * quantized to 8 bits, in float throughout.
+ */
+__device__ inline unsigned char displayChannel(float c, float scale, const DisplayOptions &options) {
+    c = __saturatef(toneMap(fmaxf(c * scale, 0.0f), options.toneMapper));
+    if (options.srgb) {
+        return (unsigned char)(srgbEncode(c) * 255.0f + 0.5f);
     }
+    return (unsigned char)(c * 255.0f);
 }
 
-__global__ void gbufferToPBO(uchar4* pbo, glm::ivec2 resolution, GBufferPixel* gBuffer) {
-    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
-    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+/**
+ * Applies the display transform to a float or half colour buffer and
+ * writes it straight into the display texture, through its surface, so the
+ * transform costs no pass of its own. Only the texels of `region` are
+ * written; the grid covers just those.
+ */
+template <typename T>
+__global__ void sendImageToDisplay(cudaSurfaceObject_t display, glm::ivec2 resolution, PixelRect region,
+        float scale, DisplayOptions options, const T* image) {
+    int x = region.x + (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = region.y + (blockIdx.y * blockDim.y) + threadIdx.y;
 
-    if (x < resolution.x && y < resolution.y) {
+    if (x < region.x + region.width && y < region.y + region.height) {
         int index = x + (y * resolution.x);
-        float timeToIntersect = gBuffer[index].t * 256.0;
+        glm::vec3 pix = loadColor(image, index);
 
-        pbo[index].w = 0;
-        pbo[index].x = timeToIntersect;
-        pbo[index].y = timeToIntersect;
-        pbo[index].z = timeToIntersect;
+        // Each thread writes one pixel location in the texture (textel)
+        surf2Dwrite(make_uchar4(displayChannel(pix.x, scale, options), displayChannel(pix.y, scale, options),
+                displayChannel(pix.z, scale, options), 0), display, x * sizeof(uchar4), y);
     }
 }
 
-static Scene * hst_scene = NULL;
-static glm::vec3 * dev_image = NULL;
-static Geom * dev_geoms = NULL;
-static Material * dev_materials = NULL;
-static PathSegment * dev_paths = NULL;
-static ShadeableIntersection * dev_intersections = NULL;
-static GBufferPixel* dev_gBuffer = NULL;
-// TODO: static variables for device memory, any extra info you need, etc
-// ...
-
-void pathtraceInit(Scene *scene) {
-    hst_scene = scene;
-    const Camera &cam = hst_scene->state.camera;
-    const int pixelcount = cam.resolution.x * cam.resolution.y;
+// The display kernels' scale for a buffer holding `samples` summed samples
+static float displayScale(int samples, const DisplayOptions &options) {
+    return exp2f(options.exposure) / samples;
+}
 
-    cudaMalloc(&dev_image, pixelcount * sizeof(glm::vec3));
-    cudaMemset(dev_image, 0, pixelcount * sizeof(glm::vec3));
+// `region` clipped to an image of `resolution`; the whole image when that leaves it empty
+static PixelRect clampRegion(const PixelRect &region, glm::ivec2 resolution) {
+    const int x0 = glm::clamp(region.x, 0, resolution.x);
+    const int y0 = glm::clamp(region.y, 0, resolution.y);
+    const int x1 = glm::clamp(region.x + region.width, 0, resolution.x);
+    const int y1 = glm::clamp(region.y + region.height, 0, resolution.y);
+    PixelRect clamped = { x0, y0, x1 - x0, y1 - y0 };
+    if (clamped.width <= 0 || clamped.height <= 0) {
+        clamped.x = 0;
+        clamped.y = 0;
+        clamped.width = resolution.x;
+        clamped.height = resolution.y;
+    }
+    return clamped;
+}
 
-  	cudaMalloc(&dev_paths, pixelcount * sizeof(PathSegment));
+// The whole image is not a region, so callers take their full-frame paths
+static bool partialRegion(const PixelRect &region, glm::ivec2 resolution) {
+    return region.width < resolution.x || region.height < resolution.y;
+}
 
-  	cudaMalloc(&dev_geoms, scene->geoms.size() * sizeof(Geom));
-  	cudaMemcpy(dev_geoms, scene->geoms.data(), scene->geoms.size() * sizeof(Geom), cudaMemcpyHostToDevice);
+/**
+ * Writes one G-buffer channel as colour, a GBufferView. Depth and position
+ * are normalized by the top-level BVH's bounds, read on the device, so the
+ * picture needs nothing from the host; misses stay black.
+ */
+__global__ void gbufferToDisplay(cudaSurfaceObject_t display, Camera cam, const GBufferPixel* gBuffer,
+        int view, const BVHNode* bvhNodes, int geomCount) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
 
-  	cudaMalloc(&dev_materials, scene->materials.size() * sizeof(Material));
-  	cudaMemcpy(dev_materials, scene->materials.data(), scene->materials.size() * sizeof(Material), cudaMemcpyHostToDevice);
+    if (x < cam.resolution.x && y < cam.resolution.y) {
+        int index = x + (y * cam.resolution.x);
+        GBufferPixel g = gBuffer[index];
+        glm::vec3 boxMin(-1.0f);
+        glm::vec3 boxMax(1.0f);
+        if (geomCount > 0) {
+            boxMin = bvhNodes[0].bboxMin;
+            boxMax = bvhNodes[0].bboxMax;
+        }
 
-  	cudaMalloc(&dev_intersections, pixelcount * sizeof(ShadeableIntersection));
-  	cudaMemset(dev_intersections, 0, pixelcount * sizeof(ShadeableIntersection));
+        glm::vec3 color(0.0f);
+        if (g.t > 0.0f) {
+            if (view == GBUFFER_NORMAL) {
+                color = gbufferNormal(g) * 0.5f + 0.5f;
+            } else if (view == GBUFFER_POSITION) {
+                color = (gbufferPosition(g, cam, x, y) - boxMin) / glm::max(boxMax - boxMin, glm::vec3(1e-20f));
+            } else if (view == GBUFFER_ALBEDO) {
+                color = gbufferAlbedo(g);
+            } else {
+                // Near is bright, fading out at the far side of the scene
+                glm::vec3 center = 0.5f * (boxMin + boxMax);
+                float farDepth = glm::distance(cam.position, center) + 0.5f * glm::distance(boxMin, boxMax);
+                color = glm::vec3(1.0f - g.t / glm::max(farDepth, 1e-20f));
+            }
+        }
+        color = glm::clamp(color, 0.0f, 1.0f) * 255.0f;
 
-    cudaMalloc(&dev_gBuffer, pixelcount * sizeof(GBufferPixel));
+        surf2Dwrite(make_uchar4((unsigned char)color.x, (unsigned char)color.y, (unsigned char)color.z, 0),
+                display, x * sizeof(uchar4), y);
+    }
+}
 
-    // TODO: initialize any extra device memeory you need
+// One count of a RayCost: 0 for its bounces, 1 its BVH nodes, 2 its shadow rays
+__device__ inline unsigned int rayCostCount(const RayCost &cost, int channel) {
+    return channel == 0 ? cost.bounces : channel == 1 ? cost.nodes : cost.shadowRays;
+}
 
-    checkCUDAError("pathtraceInit");
+// The largest `channel` count of the pixels into *largest, one atomic per warp
+__global__ void rayCostMax(int pixelcount, const RayCost* rayCost, int channel, unsigned int* largest) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    unsigned int count = index < pixelcount ? rayCostCount(rayCost[index], channel) : 0u;
+    for (int offset = WARP_SIZE / 2; offset > 0; offset /= 2) {
+        count = max(count, __shfl_down_sync(0xffffffff, count, offset));
+    }
+    if ((threadIdx.x & (WARP_SIZE - 1)) == 0) {
+        atomicMax(largest, count);
+    }
 }
 
-void pathtraceFree() {
-    cudaFree(dev_image);  // no-op if dev_image is null
-  	cudaFree(dev_paths);
-  	cudaFree(dev_geoms);
-  	cudaFree(dev_materials);
-  	cudaFree(dev_intersections);
-    cudaFree(dev_gBuffer);
-    // TODO: clean up any extra device memory you created
+/**
+ * Writes a ray cost view as a heatmap: each pixel's count of `channel`
+ * over the largest in the image, through a ramp from black by red and
+ * yellow to white. Black throughout while nothing was counted.
+ */
+__global__ void rayCostToDisplay(cudaSurfaceObject_t display, glm::ivec2 resolution, const RayCost* rayCost,
+        int channel, const unsigned int* largest) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
 
-    checkCUDAError("pathtraceFree");
+    if (x < resolution.x && y < resolution.y) {
+        float heat = 0.0f;
+        if (rayCost != NULL && *largest > 0) {
+            heat = (float)rayCostCount(rayCost[x + (y * resolution.x)], channel) / (float)*largest;
+        }
+        glm::vec3 color = glm::clamp(3.0f * heat - glm::vec3(0.0f, 1.0f, 2.0f), 0.0f, 1.0f) * 255.0f;
+
+        surf2Dwrite(make_uchar4((unsigned char)color.x, (unsigned char)color.y, (unsigned char)color.z, 0),
+                display, x * sizeof(uchar4), y);
+    }
 }
 
+static Scene * hst_scene = NULL;
+static float4 * dev_image = NULL;
+// Adaptive sampling: pixels whose estimate has converged since the last
+// reset, and the samples per pixel accumulated in dev_image over that time
+static unsigned char * dev_converged = NULL;
+static int accumulatedSamples = 0;
+
 /**
-* Generate PathSegments with rays from the camera through the screen into the
-* scene, which is the first bounce of rays.
-*
-* Antialiasing - add rays for sub-pixel sampling
-* motion blur - jitter rays "in time"
-* lens effect - jitter ray origin positions based on a lens
-*/
-__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, PathSegment* pathSegments)
-{
-	int x = (blockIdx.x * blockDim.x) + threadIdx.x;
-	int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+ * Where the mesh and sphere cloud arrays of a scene upload live. Resident,
+ * they share the block of the other scene arrays in device memory. A scene
+ * whose geometry does not fit pages it instead: managed memory that prefers
+ * the host, with the meshes that most hits land on prefetched to the device
+ * between launches (see updateGeometryResidency), or, on devices without
+ * concurrent managed access, mapped host memory the kernels read over the
+ * bus. Clouds are left to on-demand migration. With
+ * pathtraceShareGeometry(true) the primary's resident meshes get a device
+ * allocation of their own, exported to other processes rendering the same
+ * geometry on that GPU or mapped from the one that exported it first (see
+ * sceneShare.h).
+ */
+enum GeometryPaging {
+    GEOMETRY_RESIDENT,
+    GEOMETRY_MANAGED,
+    GEOMETRY_MAPPED,
+    GEOMETRY_EXPORTED,      // cudaMalloc'd here, and shared with other processes
+    GEOMETRY_IMPORTED,      // another process's, mapped read-only
+};
 
-	if (x < cam.resolution.x && y < cam.resolution.y) {
-		int index = x + (y * cam.resolution.x);
-		PathSegment & segment = pathSegments[index];
+// An upload leaves 1/GEOMETRY_HEADROOM_FRACTION of device memory free for the path buffers and the rest
+#define GEOMETRY_HEADROOM_FRACTION 8
 
-		segment.ray.origin = cam.position;
-    segment.color = glm::vec3(1.0f, 1.0f, 1.0f);
+static char * dev_sceneData = NULL;     // holds all the scene arrays below, see uploadScene
+static char * dev_sceneGeometry = NULL; // holds the mesh arrays instead when they are paged or shared
+static int sceneGeometryPaging = GEOMETRY_RESIDENT;
+// With pathtraceUsePagedGeometry(true) the mesh arrays are paged even when they would fit
+static bool forcePagedGeometry = false;
+// With pathtraceShareGeometry(true) resident mesh arrays are shared across processes
+static bool shareGeometry = false;
+// Unless pathtraceUseL2Persistence(false), the trace streams' L2 access
+// policy window keeps the scene's hot arrays resident (see sceneL2Policy);
+// this is the primary's, which graph captures take on too
+static bool l2Persistence = true;
+static std::vector<float> denoiseNetwork;   // given to every denoiser created
+// pathtraceCaptureBounce's request, served by the first split-pipeline
+// bounce that reaches captureDepth; empty once written
+static std::string captureFile;
+static int captureDepth = 0;
+static cudaStreamAttrValue primaryL2Policy = {};
+static DeviceGeom * dev_geoms = NULL;
+static Material * dev_materials = NULL;
+static int sharedGeomBytes = 0;        // 0 when geoms stay in global memory
+static int sharedMaterialBytes = 0;    // 0 when materials stay in global memory
+static int sceneMaterialFeatures = MATERIAL_FEATURES_ALL;  // MaterialFeature bits of the bound materials
+static BVHNode * dev_bvhNodes = NULL;
+static int * dev_bvhGeomIndices = NULL;
+// With pathtraceUseDeviceBVH(true) the top-level BVH is rebuilt on the GPU
+// (lbvh.h) from the uploaded geoms, and dev_bvhNodes and
+// dev_bvhGeomIndices point at these instead of into dev_sceneData
+static bool deviceBVH = false;
+static BVHNode * dev_lbvhNodes = NULL;
+static int * dev_lbvhGeomIndices = NULL;
+static int lbvhCapacity = 0;    // geoms the LBVH buffers have room for
+// Once pathtraceAnimateGeoms has moved geoms on the GPU, the top-level BVH
+// is refit there after every upload, since the host's nodes no longer
+// match it, and rebuilt there once refitting has raised its SAH cost past
+// BVH_REBUILD_COST_RATIO times its cost as built
+#define BVH_REBUILD_COST_RATIO 1.3f
+static bool geomsAnimated = false;
+// Live edits (see queueSceneEdits) go into a second copy of the primary's
+// hot scene arrays (SceneBuffers::hotBytes) while launches read the first,
+// and the two swap at the next pathtrace(). sceneHotFront is the copy the
+// dev_* pointers into the hot arrays point into: dev_sceneData's or
+// dev_sceneBack.
+static char * sceneHotFront = NULL;
+static size_t sceneHotBytes = 0;
+static char * dev_sceneBack = NULL;
+static char * hst_sceneEdits = NULL;        // pinned, staged arrays at their offsets in the hot arrays
+static cudaStream_t sceneEditStream = NULL;
+static cudaEvent_t sceneEditsReady = NULL;  // on sceneEditStream: the back copy is written
+static cudaEvent_t sceneBackReleased = NULL;    // on the default stream: no launch reads the back copy
+static bool sceneSwapPending = false;
+static float bvhBuiltCost = 0.0f;       // 0 until measured
+static GeomTransform * dev_geomTransforms = NULL;
+static int geomTransformCapacity = 0;
+static Light * dev_lights = NULL;
+static LightNode * dev_lightNodes = NULL;
+static Mesh * dev_meshes = NULL;
+static BVHNode * dev_meshBvhNodes = NULL;
+static WideBVHNode * dev_meshWideNodes = NULL;
+static glm::ivec3 * dev_meshTriangles = NULL;
+static TriangleRecord * dev_meshTriangleRecords = NULL;
+static glm::vec3 * dev_meshPositions = NULL;
+static glm::vec3 * dev_meshNormals = NULL;
+static glm::vec2 * dev_meshUVs = NULL;
+// Compact scenes' vertices instead of the four arrays above (see compactMeshVertices)
+static ushort3 * dev_meshCompactPositions = NULL;
+static ushort2 * dev_meshCompactNormals = NULL;
+static __half2 * dev_meshCompactUVs = NULL;
+static SphereCloud * dev_sphereClouds = NULL;
+static BVHNode * dev_cloudBvhNodes = NULL;
+static CloudSphere * dev_cloudSpheres = NULL;
+static SdfVolume * dev_sdfVolumes = NULL;
+static Medium * dev_media = NULL;
+static float * dev_mediumMajorants = NULL;
+// Residency of the primary's paged meshes, GEOMETRY_MANAGED only: every
+// launch counts its path hits per geom into dev_geomHits, copied back
+// behind the launch, and the next one prefetches the mesh groups (a loaded
+// mesh and its levels of detail) most hits land on to the device, up to
+// geometryBudget bytes, and sends the rest back to the host
+struct MeshPages {
+    int nodes[2];           // [first, end) of each array the group spans
+    int wideNodes[2];
+    int triangles[2];
+    int vertices[2];
+    size_t bytes;
+    float heat;             // hits, halved every launch
+    bool resident;
+};
+static std::vector<MeshPages> meshPages;
+static std::vector<int> meshEntryPages;     // group of each Mesh entry
+static size_t geometryBudget = 0;
+static unsigned int * dev_geomHits = NULL;  // NULL unless the meshes are managed
+static unsigned int * hst_geomHits = NULL;  // pinned
+static int geomHitsCount = 0;
+static bool geomHitsPending = false;        // a copy of dev_geomHits is on its way
+static cudaEvent_t geomHitsCopied = NULL;
+static cudaStream_t pagingStream = NULL;
+// Material textures of each device's scene upload, and the table of them
+// the shading kernels index with Material's maps on every device. The
+// pixel spread is the angle one pixel subtends, for texture mip levels.
+struct GpuTexture {
+    int device;
+    DeviceTexture texture;
+    cudaMipmappedArray_t array;
+};
+static std::vector<GpuTexture> gpuTextures;
+static cudaTextureObject_t environmentTexture = 0;
+static float * dev_environmentMarginalCdf = NULL;
+static float * dev_environmentConditionalCdf = NULL;
+__constant__ DeviceTexture c_textures[MAX_TEXTURES];
+// The page table and feedback of the textures in c_textures that are
+// virtual; only the primary's are, with pathtraceUseVirtualTextures(true)
+__constant__ VirtualTexturePool c_virtualTextures;
+static bool virtualTexturing = false;
+__constant__ float c_pixelSpread;
+// Path slots: samplesPerLaunch per pixel, sample s of pixel p in slot
+// s * pixelcount + p until the first compaction, or + pathSlot(p) with
+// PathtraceOptions::tiledPathOrder
+static PathSegments dev_paths = {};
+static int pathCapacity = 0;
+static int launchSamples = 1;   // samples per pixel the slots were last filled with
+static bool launchTiledPaths = false;   // and whether in pathSlot's order
+static PathSegments dev_pathsCompacted = {};
+static bool compactPathBuffers = false;    // both in the compact layout (PathtraceOptions::compactPaths)
+static int * dev_pathFlags = NULL;
+// Compaction partitions path indices rather than whole segments
+static int * dev_pathIdentity = NULL;
+static int * dev_pathOrder = NULL;
+// Wavefront mode: path slot queues for the current and next bounce, and the
+// extend stage's work counter followed by the next queue's length
+static int * dev_queues[2] = { NULL, NULL };
+static int * dev_queueCounters = NULL;
+static int persistentBlocks = 0;    // computed on first use
+// Persistent mode: the ring buffer's counters, its entries being
+// dev_queues[0]. head and tail count every entry dequeued and enqueued in
+// the launch, at most numPaths * traceDepth.
+struct PathQueue {
+	int head;
+	int tail;
+	int live;                   // paths queued or being traced
+	int warpsDone;
+	unsigned int warpMin;       // fewest bounces a warp traced, for telemetry
+	unsigned int warpMax;
+	unsigned int warpTotal;
+};
+static PathQueue * dev_pathQueue = NULL;
+// Cooperative mode: paths surviving each bounce, rotating over three so
+// one can be cleared while the others are counted and read
+static int * dev_cooperativeLive = NULL;
+static LaunchConfiguration launchConfig = {};
+static int intersectBlockOverride = 0;
+static int shadeBlockOverride = 0;
+static void chooseLaunchConfiguration();
+// Telemetry counters (see LightData), summed over the devices and cleared
+// by pathtraceReadTelemetry
+static unsigned long long * dev_rayCounts = NULL;
+static bool telemetryEnabled = false;
+// The persistent queue's load balance follows the shadow rays: launches,
+// warps, and the least, most and total bounces per warp, summed over launches
+#define RAY_COUNT_QUEUE (TELEMETRY_BOUNCES + 1)
+#define RAY_COUNT_SLOTS (RAY_COUNT_QUEUE + 5)
+// Graph mode: the instantiated bounce loop and the settings it was captured
+// with. Captures need a stream other than the legacy default one.
+static cudaStream_t graphCaptureStream = NULL;
+static cudaGraphExec_t graphExec = NULL;
+static int graphFirstBounce = 0;
+static int graphRouletteBounces = 0;
+static int graphSampler = 0;
+static GBufferPixel * graphGBuffer = NULL;
+static const WideBVHNode * graphWideNodes = NULL;
+static float graphLodScale = 0.0f;
+static int graphLightCount = 0;
+static const LightNode * graphLightTree = NULL;
+static float graphEnvironmentPmf = 0.0f;
+static unsigned long long * graphRayCounts = NULL;
+static RayCost * graphRayCost = NULL;
+static RadianceCache graphCache = {};
+static PathGuide graphGuide = {};
+static PhotonGrid graphPhotons = {};
+static const Reservoir * graphReservoirs = NULL;
+static unsigned int * graphGeomHits = NULL;
+// PathtraceOptions::radianceCache's table, on the primary GPU only. It
+// outlives pathtraceReset(), since camera moves leave the radiance in the
+// scene as it was; scene changes clear it before its next use.
+static RadianceCache radianceCache = {};
+static bool radianceCacheValid = false;
+// PathtraceOptions::pathGuiding's cells, on the primary GPU only, kept
+// like the radiance cache until the scene changes. pathGuide.training is
+// dev_guideTraining while launches still learn; pathGuideLaunches counts
+// the ones that did since the last clear.
+static PathGuide pathGuide = {};
+static float * dev_guideTraining = NULL;
+static float * dev_guideDistributions = NULL;
+static bool pathGuideValid = false;
+static int pathGuideLaunches = 0;
+// PathtraceOptions::photonCaustics' photons, sorted into their grid on the
+// primary GPU. Emitted once and reused by every launch until the scene
+// changes; dev_photonCount is the number stored.
+static PhotonGrid photonGrid = {};
+static float4 * dev_photonPositions = NULL;
+static float4 * dev_photonPower = NULL;
+static unsigned int * dev_photonCellStart = NULL;
+static unsigned int * dev_photonCellEnd = NULL;
+static int * dev_photonCount = NULL;
+static bool photonMapValid = false;
+// PathtraceOptions::bidirectional's buffers, allocated on first use: a
+// band's light vertices and camera subpaths, the connection queue, and
+// the sample being traced, which light splats reach from any band
+static BdptVertex * dev_bdptVertices = NULL;
+static int * dev_bdptVertexCounts = NULL;
+static BdptCameraPath * dev_bdptCameraPaths = NULL;
+static BdptConnection * dev_bdptQueue = NULL;
+static int * dev_bdptQueueCount = NULL;
+static unsigned long long * dev_bdptRays = NULL;
+static float4 * dev_bdptSample = NULL;
+static int bdptBandCapacity = 0;
+static int bdptQueueCapacity = 0;
+static int bdptSamplePixels = 0;
+// PathtraceOptions::restir's reservoirs for the primary GPU's pixels,
+// written through dev_reservoirScratch each launch. They stay, with
+// reservoirGBuffer and reservoirCamera, as the next launch's history.
+static Reservoir * dev_reservoirs = NULL;
+static Reservoir * dev_reservoirScratch = NULL;
+static const GBufferPixel * reservoirGBuffer = NULL;
+static Camera reservoirCamera;
+static bool reservoirsValid = false;
+static ShadeableIntersections dev_intersectionsSorted = {};
+static unsigned int * dev_materialKeys = NULL;
+static int * dev_materialOrder = NULL;
+static ShadeableIntersections dev_firstBounceCache = {};
+static bool firstBounceCached = false;
+// Whether dev_gBuffer holds computeCentreGBuffer's result for this camera
+static bool centreGBufferValid = false;
+static ShadeableIntersections dev_intersections = {};
+static GBufferPixel* dev_gBuffer = NULL;
+// The preview's rasterized camera hits (see pathtraceSetRasterHits), and
+// whether they are of the current camera
+static int2* dev_rasterHits = NULL;
+static bool rasterHitsValid = false;
+// PathtraceOptions::tileCulling's per-tile geom lists: whether they were
+// binned for the current camera and geoms, and whether that worked
+static TileGeomLists tileLists = {};
+static bool tileListsBinned = false;
+static bool tileListsValid = false;
+// Split specular mode: the specular paths' share of dev_image, which holds
+// every sample since the restart while specularValid, and the buffers its
+// denoising works in
+static float4 * dev_specular = NULL;
+static bool specularValid = false;
+static GBufferPixel * dev_specularGBuffer = NULL;
+static float4 * dev_diffuseColor = NULL;
+static float4 * dev_specularDenoised = NULL;
+static float4 * dev_splitDenoised = NULL;
+// The A-Trous denoiser and the scratch it filters in. dev_denoised aliases
+// whichever buffer (scratch, dev_temporal or dev_image) holds the result.
+static char * dev_denoiserScratch = NULL;
+static Denoiser denoiser = NULL;
+static const float4 * dev_denoised = NULL;
+static int denoisedIter = 1;
+// FP16 storage mode: the result is in half precision in the scratch
+static const Half4 * dev_denoisedHalf = NULL;
+static bool denoisedHalf = false;       // result is dev_denoisedHalf
+// Temporal reprojection: this frame's blended colour and sample count, and
+// the ones frozen at the last camera change together with the G-buffer and
+// camera they were rendered with. Reset swaps the pairs.
+static float4 * dev_temporal = NULL;
+static float * dev_temporalLength = NULL;
+static float4 * dev_history = NULL;
+static float * dev_historyLength = NULL;
+static GBufferPixel * dev_prevGBuffer = NULL;
+static Camera renderedCamera;
+static Camera historyCamera;
+static bool temporalValid = false;  // dev_temporal matches the current frame
+static bool historyValid = false;
+// Display TAA: the last resolved frame, normalized, with the camera it was
+// resolved for, and the buffer the next resolve writes. taaReproject marks
+// a camera change since, whose G-buffer pathtraceReset kept in
+// dev_prevGBuffer. Allocated on first use.
+static float4 * dev_taaHistory = NULL;
+static float4 * dev_taaResolved = NULL;
+static Camera taaCamera;
+static bool taaValid = false;
+static bool taaReproject = false;
+// Stopping estimates (see pathtraceRelativeError): the luminance of the
+// denoised result last compared, and the sum the estimates reduce into.
+// Allocated on first use.
+static float * dev_stopLuminance = NULL;
+static bool stopLuminanceValid = false;
+static float * dev_stopSum = NULL;
+static float4 * hst_pinnedImage = NULL;
+// Overlapped readback: a normalized device snapshot, copied to its own
+// pinned buffer on a non-blocking stream while the next frame traces
+static float4 * dev_readback = NULL;
+static float4 * hst_readback = NULL;
+static cudaStream_t readbackStream = NULL;
+static cudaEvent_t readbackReady = NULL;
+static cudaEvent_t readbackDone = NULL;
+static bool readbackPending = false;
+// Overlapped checkpoint: the raw sums, moments and G-buffer, snapshotted on
+// the device; the G-buffer is copied to pinned memory on their own stream,
+// the sums and moments packed there by accumulationCodec once it is collected
+static float4 * dev_checkpointImage = NULL;
+static glm::vec2 * dev_checkpointMoments = NULL;
+static GBufferPixel * dev_checkpointGBuffer = NULL;
+static GBufferPixel * hst_checkpointGBuffer = NULL;
+static cudaStream_t checkpointStream = NULL;
+static cudaEvent_t checkpointReady = NULL;
+static cudaEvent_t checkpointDone = NULL;
+// Region denoising: the inputs cropped to the region plus the footprint's
+// reach, a denoiser (and scratch) sized to that crop, and the full-frame
+// result the filtered region is pasted into. All allocated on first use.
+static float4 * dev_regionColor = NULL;
+static GBufferPixel * dev_regionGBuffer = NULL;
+static glm::vec2 * dev_regionMoments = NULL;
+static float * dev_regionLengths = NULL;
+static int regionCapacity = 0;
+static char * dev_regionScratch = NULL;
+static size_t regionScratchBytes = 0;
+static Denoiser regionDenoiser = NULL;
+static glm::ivec2 regionDenoiserSize(0);
+static float4 * dev_regionDenoised = NULL;
+// Batched denoising: up to batchCapacity queued images of batchResolution,
+// one after another with their normalized colours, G-buffers, raw moments
+// and per-pixel sample counts, each with the camera it was seen from, and
+// a denoiser sized to the whole stack. All allocated on first use.
+static float4 * dev_batchColor = NULL;
+static GBufferPixel * dev_batchGBuffer = NULL;
+static glm::vec2 * dev_batchMoments = NULL;
+static float * dev_batchSamples = NULL;
+static float4 * dev_batchDenoised = NULL;
+static glm::ivec2 batchResolution(0);
+static int batchCapacity = 0;
+static int batchFewestSamples = 0;
+static std::vector<DenoiserCamera> batchCameras;
+static Denoiser batchDenoiser = NULL;
+static int batchDenoiserImages = 0;
+// Each pixel's RayCost since the last reset, for the ray cost views, and
+// the largest count of the one shown. Allocated on first use.
+static RayCost * dev_rayCost = NULL;
+static unsigned int * dev_rayCostMax = NULL;
+static bool checkpointPending = false;
+static int checkpointSamples = 0;
+// Denoising and display conversion run on their own non-blocking stream, so the
+// next iteration's ray generation and bounces overlap the current frame's
+// display. Display work waits for everything queued on the default stream
+// before it; the trace only waits for displayDone before it rewrites what
+// the display reads (the G-buffer, image and moments).
+static cudaStream_t displayStream = NULL;
+static cudaEvent_t traceQueued = NULL;
+static cudaEvent_t displayDone = NULL;
+// Multi-GPU: every other device picked by pathtraceUseDevices() gets its own
+// scene upload, path slots and accumulation, and traces a share of each
+// launch's samples with the megakernel. Its accumulation is folded into
+// dev_image and dev_moments only when they are read (mergeTraceDevices), so
+// the devices never wait on each other while tracing.
+struct TraceDevice {
+    int device;
+    cudaStream_t stream;            // on `device`
+    cudaEvent_t copied;             // on `device`: accumulation staged and cleared
+    cudaEvent_t merged;             // on the primary: staging buffers free again
+    cudaEvent_t sceneRead;          // on `device`: the last swapped edits are copied from the primary
+    char *sceneData;                // holds the scene arrays below
+    char *sceneGeometry;            // holds the mesh arrays instead when they are paged
+    int geometryPaging;             // GeometryPaging
+    DeviceGeom *geoms;
+    BVHNode *bvhNodes;
+    int *bvhGeomIndices;
+    Light *lights;
+    LightNode *lightNodes;
+    Mesh *meshes;
+    BVHNode *meshBvhNodes;
+    WideBVHNode *meshWideNodes;
+    glm::ivec3 *meshTriangles;
+    TriangleRecord *meshTriangleRecords;
+    glm::vec3 *meshPositions;
+    glm::vec3 *meshNormals;
+    glm::vec2 *meshUVs;
+    ushort3 *meshCompactPositions;
+    ushort2 *meshCompactNormals;
+    __half2 *meshCompactUVs;
+    SphereCloud *sphereClouds;
+    BVHNode *cloudBvhNodes;
+    CloudSphere *cloudSpheres;
+    SdfVolume *sdfVolumes;          // texture objects filled in by uploadTextures
+    Medium *media;                  // likewise
+    float *mediumMajorants;
+    Material *materials;
+    float *environmentMarginalCdf;
+    float *environmentConditionalCdf;
+    cudaTextureObject_t environmentTexture;
+    BVHNode *lbvhNodes;             // copies of the primary's GPU-built BVH
+    int *lbvhGeomIndices;
+    PathSegments paths;
+    int pathCapacity;
+    GBufferPixel *gBuffer;          // written by the megakernel, never read
+    float4 *image;
+    glm::vec2 *moments;
+    float4 *stagedImage;            // on the primary
+    unsigned long long *rayCounts;  // telemetry, see LightData
+    glm::vec2 *stagedMoments;       // on the primary
+    bool pending;                   // image holds samples not yet merged
+};
+static std::vector<TraceDevice> traceDevices;
+static int requestedDevices = 1;    // 0: every visible device
+static int primaryDevice = 0;
+// The primary leaves its share of the samples to the other devices, see pathtraceDedicateDisplayDevice
+static bool dedicatedDisplay = false;
 
-		segment.ray.direction = glm::normalize(cam.view
-			- cam.right * cam.pixelLength.x * ((float)x - (float)cam.resolution.x * 0.5f)
-			- cam.up * cam.pixelLength.y * ((float)y - (float)cam.resolution.y * 0.5f)
-			);
+static void initTraceDevices(Scene *scene);
+static void resetTraceDevices();
+static void freeTraceDevices();
+static void mergeTraceDevices();
 
-		segment.pixelIndex = index;
-		segment.remainingBounces = traceDepth;
-	}
+// Per-pixel sums of luminance and squared luminance over the accumulated
+// samples, from which the denoiser estimates variance
+static glm::vec2 * dev_moments = NULL;
+// Stages FP32 copies of the denoised image for host readback
+static float4 * dev_denoiseStaging = NULL;
+// TODO: static variables for device memory, any extra info you need, etc
+// ...
+
+// GPU timers: a start/stop event pair per stage, and per bounce for the
+// ray sort, intersect, shade and compaction kernels. Stops are only waited on when the slot is
+// reused or pathtraceStats() reads it, so timing never stalls a frame.
+enum TimerSlot {
+    TIMER_GENERATE_RAYS,
+    TIMER_MEGAKERNEL,
+    TIMER_FINAL_GATHER,
+    TIMER_DENOISE,
+    TIMER_DISPLAY,
+    TIMER_INTERSECT,
+    TIMER_SHADE = TIMER_INTERSECT + STATS_MAX_DEPTH,
+    TIMER_SORT_RAYS = TIMER_SHADE + STATS_MAX_DEPTH,
+    TIMER_COMPACT = TIMER_SORT_RAYS + STATS_MAX_DEPTH,
+    TIMER_COUNT = TIMER_COMPACT + STATS_MAX_DEPTH,
+};
+
+// Weight of the newest frame in the timers' rolling averages
+#define STATS_SMOOTHING 0.1f
+
+static cudaEvent_t timerEvents[TIMER_COUNT][2];
+static bool timerPending[TIMER_COUNT];
+static float timerAverageMs[TIMER_COUNT];
+static bool timingEnabled = false;
+static bool timingSmoothed = true;  // false: the averages hold each stage's latest time
+static PathtraceStats stats = {};
+
+static void timerResolve(int slot) {
+    if (!timerPending[slot]) {
+        return;
+    }
+    float ms = 0.0f;
+    cudaEventSynchronize(timerEvents[slot][1]);
+    cudaEventElapsedTime(&ms, timerEvents[slot][0], timerEvents[slot][1]);
+    timerAverageMs[slot] = timingSmoothed && timerAverageMs[slot] > 0.0f
+        ? glm::mix(timerAverageMs[slot], ms, STATS_SMOOTHING) : ms;
+    timerPending[slot] = false;
 }
 
-__global__ void computeIntersections(
-	int depth
-	, int num_paths
-	, PathSegment * pathSegments
-	, Geom * geoms
-	, int geoms_size
-	, ShadeableIntersection * intersections
-	)
-{
-	int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+static void timerStart(int slot, cudaStream_t stream = 0) {
+    if (timingEnabled && slot < TIMER_COUNT) {
+        timerResolve(slot);
+        cudaEventRecord(timerEvents[slot][0], stream);
+    }
+}
 
-	if (path_index < num_paths)
-	{
-		PathSegment pathSegment = pathSegments[path_index];
+static void timerStop(int slot, cudaStream_t stream = 0) {
+    if (timingEnabled && slot < TIMER_COUNT) {
+        cudaEventRecord(timerEvents[slot][1], stream);
+        timerPending[slot] = true;
+    }
+}
 
-		float t;
-		glm::vec3 intersect_point;
-		glm::vec3 normal;
-		float t_min = FLT_MAX;
-		int hit_geom_index = -1;
-		bool outside = true;
+// For stages skipped this frame, so their old average does not linger
+static void timerClear(int slot) {
+    if (slot < TIMER_COUNT) {
+        timerPending[slot] = false;
+        timerAverageMs[slot] = 0.0f;
+    }
+}
 
-		glm::vec3 tmp_intersect;
-		glm::vec3 tmp_normal;
+// Per-bounce slot, or TIMER_COUNT (untimed) past STATS_MAX_DEPTH
+static int bounceTimer(int base, int depth) {
+    return depth < STATS_MAX_DEPTH ? base + depth : TIMER_COUNT;
+}
 
-		// naive parse through global geoms
+static void recordPathCount(int depth, int numPaths) {
+    if (depth < STATS_MAX_DEPTH) {
+        stats.pathCounts[depth] = numPaths;
+    }
+    // Each live path's ray read to intersect it, and its segment read and
+    // written to shade it, in the layout the buffers are in
+    const size_t ray = compactPathBuffers ? sizeof(float4) + sizeof(unsigned int)
+        : 2 * sizeof(float4) + sizeof(float2);
+    const size_t segment = compactPathBuffers ? PATH_SEGMENT_COMPACT_BYTES : PATH_SEGMENT_BYTES;
+    stats.pathBytes += (long long)numPaths * (long long)(ray + 2 * segment);
+}
 
-		for (int i = 0; i < geoms_size; i++)
-		{
-			Geom & geom = geoms[i];
+// Brackets work queued on displayStream
+static void beginDisplayWork() {
+    cudaEventRecord(traceQueued, 0);
+    cudaStreamWaitEvent(displayStream, traceQueued, 0);
+}
 
-			if (geom.type == CUBE)
-			{
-				t = boxIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
-			}
-			else if (geom.type == SPHERE)
-			{
-				t = sphereIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
-			}
+static void endDisplayWork() {
+    cudaEventRecord(displayDone, displayStream);
+}
 
-			// Compute the minimum t from the intersection tests to determine what
-			// scene geometry object was hit first.
-			if (t > 0.0f && t_min > t)
-			{
-				t_min = t;
-				hit_geom_index = i;
-				intersect_point = tmp_intersect;
-				normal = tmp_normal;
-			}
-		}
+// Orders the default stream after all display work queued so far
+static void waitForDisplay() {
+    cudaStreamWaitEvent(0, displayDone, 0);
+}
 
-		if (hit_geom_index == -1)
-		{
-			intersections[path_index].t = -1.0f;
-		}
-		else
-		{
-			//The ray hits something
-			intersections[path_index].t = t_min;
-			intersections[path_index].materialId = geoms[hit_geom_index].materialid;
-			intersections[path_index].surfaceNormal = normal;
-		}
-	}
+// Drops the instantiated graph, so the next graph iteration captures anew
+static void destroyGraph() {
+    if (graphExec != NULL) {
+        cudaGraphExecDestroy(graphExec);
+        graphExec = NULL;
+    }
 }
 
-__global__ void shadeSimpleMaterials (
-  int iter
-  , int num_paths
-	, ShadeableIntersection * shadeableIntersections
-	, PathSegment * pathSegments
-	, Material * materials
-	)
-{
-  int idx = blockIdx.x * blockDim.x + threadIdx.x;
-  if (idx < num_paths)
-  {
-    ShadeableIntersection intersection = shadeableIntersections[idx];
-    PathSegment segment = pathSegments[idx];
-    if (segment.remainingBounces == 0) {
-      return;
+static void allocPathSegments(PathSegments &paths, int n, bool compact = false) {
+    if (compact) {
+        deviceMemory::allocate(&paths.originOctDirection, n * sizeof(float4));
+        deviceMemory::allocate(&paths.throughputPixel, n * sizeof(uint4));
+        deviceMemory::allocate(&paths.samplePdf, n * sizeof(uint2));
+        deviceMemory::allocate(&paths.packedCone, n * sizeof(unsigned int));
+        return;
     }
+    deviceMemory::allocate(&paths.originBounces, n * sizeof(float4));
+    deviceMemory::allocate(&paths.direction, n * sizeof(float4));
+    deviceMemory::allocate(&paths.colorPixel, n * sizeof(float4));
+    deviceMemory::allocate(&paths.radiancePdf, n * sizeof(float4));
+    deviceMemory::allocate(&paths.cone, n * sizeof(float2));
+}
 
-    if (intersection.t > 0.0f) { // if the intersection exists...
-      segment.remainingBounces--;
-      // Set up the RNG
-      thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, segment.remainingBounces);
+static void freePathSegments(PathSegments &paths) {
+    deviceMemory::release(paths.originBounces);
+    deviceMemory::release(paths.direction);
+    deviceMemory::release(paths.colorPixel);
+    deviceMemory::release(paths.radiancePdf);
+    deviceMemory::release(paths.cone);
+    deviceMemory::release(paths.originOctDirection);
+    deviceMemory::release(paths.throughputPixel);
+    deviceMemory::release(paths.samplePdf);
+    deviceMemory::release(paths.packedCone);
+    paths = PathSegments();
+}
 
-      Material material = materials[intersection.materialId];
-      glm::vec3 materialColor = material.color;
+/**
+ * The arrays of a path buffer in its layout, with the bytes each takes a
+ * path; returns how many. Copies and captures go through these.
+ */
+static int pathSegmentArrays(const PathSegments &paths, void *arrays[5], size_t bytes[5]) {
+    if (isCompact(paths)) {
+        void *compact[4] = { paths.originOctDirection, paths.throughputPixel, paths.samplePdf, paths.packedCone };
+        size_t sizes[4] = { sizeof(float4), sizeof(uint4), sizeof(uint2), sizeof(unsigned int) };
+        std::copy(compact, compact + 4, arrays);
+        std::copy(sizes, sizes + 4, bytes);
+        return 4;
+    }
+    void *full[5] = { paths.originBounces, paths.direction, paths.colorPixel, paths.radiancePdf, paths.cone };
+    size_t sizes[5] = { sizeof(float4), sizeof(float4), sizeof(float4), sizeof(float4), sizeof(float2) };
+    std::copy(full, full + 5, arrays);
+    std::copy(sizes, sizes + 5, bytes);
+    return 5;
+}
 
-      // If the material indicates that the object was a light, "light" the ray
-      if (material.emittance > 0.0f) {
-        segment.color *= (materialColor * material.emittance);
-        segment.remainingBounces = 0;
-      }
-      else {
-        segment.color *= materialColor;
-        glm::vec3 intersectPos = intersection.t * segment.ray.direction + segment.ray.origin;
-        scatterRay(segment, intersectPos, intersection.surfaceNormal, material, rng);
-      }
-    // If there was no intersection, color the ray black.
-    // Lots of renderers use 4 channel color, RGBA, where A = alpha, often
-    // used for opacity, in which case they can indicate "no opacity".
-    // This can be useful for post-processing and image compositing.
-    } else {
-      segment.color = glm::vec3(0.0f);
-      segment.remainingBounces = 0;
+// Both buffers must have the same layout
+static void copyPathSegments(const PathSegments &dst, const PathSegments &src, int n) {
+    void *dstArrays[5];
+    void *srcArrays[5];
+    size_t bytes[5];
+    pathSegmentArrays(dst, dstArrays, bytes);
+    const int count = pathSegmentArrays(src, srcArrays, bytes);
+    for (int i = 0; i < count; i++) {
+        cudaMemcpy(dstArrays[i], srcArrays[i], n * bytes[i], cudaMemcpyDeviceToDevice);
     }
+}
 
-    pathSegments[idx] = segment;
-  }
+static void allocIntersections(ShadeableIntersections &intersections, int n) {
+    deviceMemory::allocate(&intersections.tMaterial, n * sizeof(float2));
+    deviceMemory::allocate(&intersections.normal, n * sizeof(float4));
+    deviceMemory::allocate(&intersections.surface, n * sizeof(float4));
+    deviceMemory::allocate(&intersections.hitRecord, n * sizeof(int2));
 }
 
-__global__ void generateGBuffer (
-  int num_paths,
-  ShadeableIntersection* shadeableIntersections,
-	PathSegment* pathSegments,
-  GBufferPixel* gBuffer) {
-  int idx = blockIdx.x * blockDim.x + threadIdx.x;
-  if (idx < num_paths)
-  {
-    gBuffer[idx].t = shadeableIntersections[idx].t;
-  }
+static void freeIntersections(ShadeableIntersections &intersections) {
+    deviceMemory::release(intersections.tMaterial);
+    deviceMemory::release(intersections.normal);
+    deviceMemory::release(intersections.surface);
+    deviceMemory::release(intersections.hitRecord);
+    intersections = ShadeableIntersections();
+}
+
+static void copyIntersections(const ShadeableIntersections &dst, const ShadeableIntersections &src, int n) {
+    cudaMemcpy(dst.tMaterial, src.tMaterial, n * sizeof(float2), cudaMemcpyDeviceToDevice);
+    cudaMemcpy(dst.normal, src.normal, n * sizeof(float4), cudaMemcpyDeviceToDevice);
+    cudaMemcpy(dst.surface, src.surface, n * sizeof(float4), cudaMemcpyDeviceToDevice);
+    cudaMemcpy(dst.hitRecord, src.hitRecord, n * sizeof(int2), cudaMemcpyDeviceToDevice);
 }
 
-// Add the current iteration's output to the overall image
-__global__ void finalGather(int nPaths, glm::vec3 * image, PathSegment * iterationPaths)
+__global__ void kernIdentity(int n, int * indices)
 {
 	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
 
-	if (index < nPaths)
+	if (index < n)
 	{
-		PathSegment iterationPath = iterationPaths[index];
-		image[iterationPath.pixelIndex] += iterationPath.color;
+		indices[index] = index;
 	}
 }
 
 /**
- * Wrapper for the __global__ call that sets up the kernel calls and does a ton
- * of memory management
+ * Allocates every per-path buffer for n path slots: the segments, their
+ * intersections, the compaction, sorting and queue indices, and the
+ * first-bounce cache. pathtrace() regrows them when a launch traces more
+ * samples per pixel than they hold.
  */
-void pathtrace(int frame, int iter) {
-    const int traceDepth = hst_scene->state.traceDepth;
-    const Camera &cam = hst_scene->state.camera;
-    const int pixelcount = cam.resolution.x * cam.resolution.y;
+static void allocPathBuffers(int n) {
+  	allocPathSegments(dev_paths, n, compactPathBuffers);
+  	allocPathSegments(dev_pathsCompacted, n, compactPathBuffers);
+  	deviceMemory::allocate(&dev_pathFlags, n * sizeof(int));
+  	deviceMemory::allocate(&dev_pathOrder, n * sizeof(int));
+  	deviceMemory::allocate(&dev_pathIdentity, n * sizeof(int));
+  	kernIdentity<<<(n + 127) / 128, 128>>>(n, dev_pathIdentity);
+  	deviceMemory::allocate(&dev_queues[0], n * sizeof(int));
+  	deviceMemory::allocate(&dev_queues[1], n * sizeof(int));
+  	StreamCompaction::Efficient::initScratch(n);
 
-	// 2D block for generating ray from camera
-    const dim3 blockSize2d(8, 8);
-    const dim3 blocksPerGrid2d(
-            (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
-            (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+  	allocIntersections(dev_intersections, n);
+  	cudaMemset(dev_intersections.tMaterial, 0, n * sizeof(float2));
+  	allocIntersections(dev_intersectionsSorted, n);
+  	deviceMemory::allocate(&dev_materialKeys, n * sizeof(unsigned int));
+  	deviceMemory::allocate(&dev_materialOrder, n * sizeof(int));
+  	allocIntersections(dev_firstBounceCache, n);
+  	pathCapacity = n;
+}
 
-	// 1D block for path tracing
-	const int blockSize1d = 128;
+static void freePathBuffers() {
+  	freePathSegments(dev_paths);
+  	freePathSegments(dev_pathsCompacted);
+  	deviceMemory::release(dev_pathFlags);
+  	deviceMemory::release(dev_pathOrder);
+  	deviceMemory::release(dev_pathIdentity);
+  	deviceMemory::release(dev_queues[0]);
+  	deviceMemory::release(dev_queues[1]);
+  	freeIntersections(dev_intersections);
+  	freeIntersections(dev_intersectionsSorted);
+  	deviceMemory::release(dev_materialKeys);
+  	deviceMemory::release(dev_materialOrder);
+  	freeIntersections(dev_firstBounceCache);
+  	pathCapacity = 0;
+}
 
-    ///////////////////////////////////////////////////////////////////////////
+// Device copies of the scene arrays, all within the one allocation `data`
+// except for the mesh arrays when they are paged or shared, which are in `geometry`
+struct SceneBuffers {
+    char *data;
+    char *geometry;         // NULL when resident
+    int paging;             // GeometryPaging
+    size_t geometryBudget;  // device bytes paged geometry may take, GEOMETRY_MANAGED only
+    DeviceGeom *geoms;
+    BVHNode *bvhNodes;
+    int *bvhGeomIndices;
+    Light *lights;
+    LightNode *lightNodes;
+    Mesh *meshes;
+    BVHNode *meshBvhNodes;
+    WideBVHNode *meshWideNodes;
+    glm::ivec3 *meshTriangles;
+    TriangleRecord *meshTriangleRecords;
+    glm::vec3 *meshPositions;
+    glm::vec3 *meshNormals;
+    glm::vec2 *meshUVs;
+    ushort3 *meshCompactPositions;
+    ushort2 *meshCompactNormals;
+    __half2 *meshCompactUVs;
+    SphereCloud *sphereClouds;
+    BVHNode *cloudBvhNodes;
+    CloudSphere *cloudSpheres;
+    SdfVolume *sdfVolumes;          // texture objects filled in by uploadTextures
+    Medium *media;                  // likewise
+    float *mediumMajorants;
+    Material *materials;
+    float *environmentMarginalCdf;
+    float *environmentConditionalCdf;
+    size_t hotBytes;        // the arrays every bounce reads, at the start of data
+};
 
-    // Pathtracing Recap:
-    // * Initialize array of path rays (using rays that come out of the camera)
-    //   * You can pass the Camera object to that kernel.
-    //   * Each path ray must carry at minimum a (ray, color) pair,
-    //   * where color starts as the multiplicative identity, white = (1, 1, 1).
-    //   * This has already been done for you.
-    // * NEW: For the first depth, generate geometry buffers (gbuffers)
-    // * For each depth:
-    //   * Compute an intersection in the scene for each path ray.
-    //     A very naive version of this has been implemented for you, but feel
-    //     free to add more primitives and/or a better algorithm.
-    //     Currently, intersection distance is recorded as a parametric distance,
-    //     t, or a "distance along the ray." t = -1.0 indicates no intersection.
-    //     * Color is attenuated (multiplied) by reflections off of any object
-    //   * Stream compact away all of the terminated paths.
-    //     You may use either your implementation or `thrust::remove_if` or its
-    //     cousins.
-    //     * Note that you can't really use a 2D kernel launch any more - switch
-    //       to 1D.
-    //   * Shade the rays that intersected something or didn't bottom out.
-    //     That is, color the ray by performing a color computation according
-    //     to the shader, then generate a new ray to continue the ray path.
-    //     We recommend just updating the ray's PathSegment in place.
-    //     Note that this step may come before or after stream compaction,
-    //     since some shaders you write may also cause a path to terminate.
-    // * Finally:
-    //     * if not denoising, add this iteration's results to the image
-    //     * TODO: if denoising, run kernels that take both the raw pathtraced result and the gbuffer, and put the result in the "pbo" from opengl
+// The 16-bit vertex arrays of a compact upload (see Scene::compactMeshes)
+struct CompactMeshVertices {
+    std::vector<ushort3> positions;
+    std::vector<ushort2> normals;
+    std::vector<__half2> uvs;
+};
 
-	generateRayFromCamera <<<blocksPerGrid2d, blockSize2d >>>(cam, iter, traceDepth, dev_paths);
-	checkCUDAError("generate camera ray");
+/**
+ * Encodes the scene's vertices for a compact upload: positions as their
+ * coordinates on their mesh's grid, which they were snapped to on load so
+ * nothing is lost, normals octahedrally and uvs as half floats. Prints the
+ * vertex memory this saves. Returns false, leaving `out` empty, unless
+ * the scene was loaded with Scene::compactMeshes.
+ */
+static bool compactMeshVertices(const Scene *scene, CompactMeshVertices &out) {
+    bool gridded = false;
+    for (size_t m = 0; m < scene->meshes.size(); m++) {
+        gridded = gridded || scene->meshes[m].gridStep != glm::vec3(0.0f);
+    }
+    if (!gridded) {
+        return false;
+    }
+    out.positions.assign(scene->meshPositions.size(), ushort3());
+    for (size_t m = 0; m < scene->meshes.size(); m++) {
+        const Mesh &mesh = scene->meshes[m];
+        for (int t = mesh.triangleOffset; t < mesh.triangleOffset + mesh.triangleCount; t++) {
+            const glm::ivec3 &tri = scene->meshTriangles[t];
+            for (int k = 0; k < 3; k++) {
+                out.positions[tri[k]] = meshGridCoordinates(mesh, scene->meshPositions[tri[k]]);
+            }
+        }
+    }
+    out.normals.resize(scene->meshNormals.size());
+    for (size_t i = 0; i < scene->meshNormals.size(); i++) {
+        const glm::vec3 &n = scene->meshNormals[i];
+        unsigned short octahedral[2];
+        encodeOctNormal(n != glm::vec3(0.0f) ? n : glm::vec3(0.0f, 0.0f, 1.0f), octahedral);
+        out.normals[i].x = octahedral[0];
+        out.normals[i].y = octahedral[1];
+    }
+    out.uvs.resize(scene->meshUVs.size());
+    for (size_t i = 0; i < scene->meshUVs.size(); i++) {
+        out.uvs[i].x = __float2half(scene->meshUVs[i].x);
+        out.uvs[i].y = __float2half(scene->meshUVs[i].y);
+    }
 
-	int depth = 0;
-	PathSegment* dev_path_end = dev_paths + pixelcount;
-	int num_paths = dev_path_end - dev_paths;
+    const size_t floatBytes = scene->meshTriangleRecords.size() * sizeof(TriangleRecord)
+        + scene->meshPositions.size() * sizeof(glm::vec3) + scene->meshNormals.size() * sizeof(glm::vec3)
+        + scene->meshUVs.size() * sizeof(glm::vec2);
+    const size_t compactBytes = out.positions.size() * sizeof(ushort3) + out.normals.size() * sizeof(ushort2)
+        + out.uvs.size() * sizeof(__half2);
+    printf("Compact meshes: vertex data takes %.1f MB rather than %.1f MB\n",
+        compactBytes / (1024.0 * 1024.0), floatBytes / (1024.0 * 1024.0));
+    return true;
+}
 
-	// --- PathSegment Tracing Stage ---
-	// Shoot ray into scene, bounce between objects, push shading chunks
+// `v`, or an empty array in its place when `drop`
+template <typename T>
+static const std::vector<T> & sceneArrayUnless(bool drop, const std::vector<T> &v) {
+    static const std::vector<T> empty;
+    return drop ? empty : v;
+}
 
-  // Empty gbuffer
-  cudaMemset(dev_gBuffer, 0, pixelcount * sizeof(GBufferPixel));
+// Reserves a 16-byte aligned range for `v` and returns its offset
+template <typename T>
+static size_t reserveSceneArray(size_t &bytes, const std::vector<T> &v) {
+    size_t offset = (bytes + 15) & ~(size_t)15;
+    bytes = offset + v.size() * sizeof(T);
+    return offset;
+}
 
-	// clean shading chunks
-	cudaMemset(dev_intersections, 0, pixelcount * sizeof(ShadeableIntersection));
+template <typename T>
+static T * placeSceneArray(char *staging, char *device, size_t offset, const std::vector<T> &v) {
+    if (!v.empty()) {
+        memcpy(staging + offset, v.data(), v.size() * sizeof(T));
+    }
+    return reinterpret_cast<T *>(device + offset);
+}
 
-  bool iterationComplete = false;
-	while (!iterationComplete) {
+/**
+ * How the current device should hold `geometryBytes` of mesh arrays next
+ * to `coreBytes` of the rest: resident if both fit with the headroom left
+ * and not `paged`, else paged the best way the device supports. `budget`
+ * is set to the device memory left for paged geometry.
+ */
+static int chooseGeometryPaging(size_t coreBytes, size_t geometryBytes, bool paged, size_t &budget) {
+    int device = 0;
+    cudaGetDevice(&device);
+    size_t free = 0;
+    size_t total = 0;
+    cudaMemGetInfo(&free, &total);
+    const size_t reserve = coreBytes + total / GEOMETRY_HEADROOM_FRACTION;
+    budget = free > reserve ? free - reserve : 0;
 
-	// tracing
-	dim3 numblocksPathSegmentTracing = (num_paths + blockSize1d - 1) / blockSize1d;
-	computeIntersections <<<numblocksPathSegmentTracing, blockSize1d>>> (
-		depth
-		, num_paths
-		, dev_paths
-		, dev_geoms
-		, hst_scene->geoms.size()
-		, dev_intersections
-		);
-	checkCUDAError("trace one bounce");
-	cudaDeviceSynchronize();
+    int managed = 0;
+    cudaDeviceGetAttribute(&managed, cudaDevAttrConcurrentManagedAccess, device);
+    if (!paged && geometryBytes <= budget) {
+        return GEOMETRY_RESIDENT;
+    }
+    return managed ? GEOMETRY_MANAGED : GEOMETRY_MAPPED;
+}
 
-  if (depth == 0) {
-    generateGBuffer<<<numblocksPathSegmentTracing, blockSize1d>>>(num_paths, dev_intersections, dev_paths, dev_gBuffer);
-  }
+/**
+ * Allocates `buffers.geometry` for paged mesh arrays, in managed memory
+ * that starts on the host or in mapped host memory, and returns the address
+ * kernels on the current device reach it at; NULL if the host cannot
+ * hold it either.
+ */
+static char * allocatePagedGeometry(SceneBuffers &buffers, size_t bytes) {
+    int device = 0;
+    cudaGetDevice(&device);
+    buffers.geometry = NULL;
+    if (buffers.paging == GEOMETRY_MANAGED) {
+        if (cudaMallocManaged(&buffers.geometry, bytes) != cudaSuccess) {
+            cudaGetLastError();
+            return NULL;
+        }
+        cudaMemAdvise(buffers.geometry, bytes, cudaMemAdviseSetPreferredLocation, cudaCpuDeviceId);
+        cudaMemAdvise(buffers.geometry, bytes, cudaMemAdviseSetAccessedBy, device);
+        return buffers.geometry;
+    }
+    if (cudaHostAlloc(&buffers.geometry, bytes, cudaHostAllocMapped | cudaHostAllocPortable) != cudaSuccess) {
+        cudaGetLastError();
+        return NULL;
+    }
+    char *mapped = NULL;
+    cudaHostGetDevicePointer(reinterpret_cast<void **>(&mapped), buffers.geometry, 0);
+    return mapped;
+}
 
-	depth++;
+template <typename T>
+static uint64_t hashSceneArray(uint64_t key, const std::vector<T> &v) {
+    return sceneShare::hash(v.data(), v.size() * sizeof(T), key);
+}
 
-  shadeSimpleMaterials<<<numblocksPathSegmentTracing, blockSize1d>>> (
-    iter,
-    num_paths,
-    dev_intersections,
-    dev_paths,
-    dev_materials
-  );
-  iterationComplete = depth == traceDepth;
-	}
+/**
+ * Gives `buffers` a device allocation of `bytes` for mesh arrays that hash
+ * to `key`: another process's, when one exports them, or else one of its
+ * own to export once it holds them. NULL, with `buffers` unchanged, if
+ * neither is possible.
+ */
+static char * allocateSharedGeometry(SceneBuffers &buffers, size_t bytes, uint64_t key) {
+    void *geometry = sceneShare::open(key, bytes);
+    if (geometry != NULL) {
+        buffers.paging = GEOMETRY_IMPORTED;
+        printf("Scene meshes (%zu MB) mapped from another process\n", bytes >> 20);
+    } else if (cudaMalloc(&geometry, bytes) == cudaSuccess) {
+        // Pool memory cannot be exported with cudaIpcGetMemHandle
+        buffers.paging = GEOMETRY_EXPORTED;
+    } else {
+        cudaGetLastError();
+        return NULL;
+    }
+    buffers.geometry = static_cast<char *>(geometry);
+    return buffers.geometry;
+}
 
-  // Assemble this iteration and apply it to the image
-  dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
-	finalGather<<<numBlocksPixels, blockSize1d>>>(num_paths, dev_image, dev_paths);
+/**
+ * Uploads every scene array to the current device with a single copy:
+ * they are packed into one pinned staging buffer, which also lets the copy
+ * run at full DMA speed, and land in one device allocation. Mesh arrays
+ * too large for the device, or that do not get their share of its memory,
+ * are paged (see GeometryPaging) and written straight into host memory
+ * instead, so a scene larger than VRAM still renders, only slower. A
+ * compact scene's vertices go up as compactMeshVertices encodes them, in
+ * place of the float arrays and triangle records. Shared, the primary's
+ * resident mesh arrays take a copy of their own, or none when mapped from
+ * the process that uploaded them first.
+ */
+static SceneBuffers uploadScene(const Scene *scene) {
+    CompactMeshVertices compact;
+    const bool compactMeshes = compactMeshVertices(scene, compact);
+    const std::vector<TriangleRecord> &triangleRecordArray
+        = sceneArrayUnless(compactMeshes, scene->meshTriangleRecords);
+    const std::vector<glm::vec3> &positionArray = sceneArrayUnless(compactMeshes, scene->meshPositions);
+    const std::vector<glm::vec3> &normalArray = sceneArrayUnless(compactMeshes, scene->meshNormals);
+    const std::vector<glm::vec2> &uvArray = sceneArrayUnless(compactMeshes, scene->meshUVs);
 
-    ///////////////////////////////////////////////////////////////////////////
+    size_t bytes = 0;
+    // The small arrays every bounce reads go first, for the L2 persistence window
+    const size_t geoms = reserveSceneArray(bytes, scene->deviceGeoms);
+    const size_t bvhNodes = reserveSceneArray(bytes, scene->bvhNodes);
+    const size_t bvhGeomIndices = reserveSceneArray(bytes, scene->bvhGeomIndices);
+    const size_t materials = reserveSceneArray(bytes, scene->materials);
+    const size_t meshes = reserveSceneArray(bytes, scene->meshes);
+    const size_t sphereClouds = reserveSceneArray(bytes, scene->sphereClouds);
+    const size_t sdfVolumes = reserveSceneArray(bytes, scene->sdfVolumes);
+    const size_t media = reserveSceneArray(bytes, scene->media);
+    const size_t lights = reserveSceneArray(bytes, scene->lights);
+    const size_t lightNodes = reserveSceneArray(bytes, scene->lightNodes);
+    const size_t hotBytes = bytes;
+    const size_t mediumMajorants = reserveSceneArray(bytes, scene->mediumMajorants);
+    const size_t environmentMarginalCdf = reserveSceneArray(bytes, scene->environment.marginalCdf);
+    const size_t environmentConditionalCdf = reserveSceneArray(bytes, scene->environment.conditionalCdf);
+    const size_t coreBytes = bytes;
 
-    // CHECKITOUT: use dev_image as reference if you want to implement saving denoised images.
-    // Otherwise, screenshots are also acceptable.
-    // Retrieve image from GPU
-    cudaMemcpy(hst_scene->state.image.data(), dev_image,
-            pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+    size_t geometryBytes = 0;
+    const size_t meshBvhNodes = reserveSceneArray(geometryBytes, scene->meshBvhNodes);
+    const size_t meshWideNodes = reserveSceneArray(geometryBytes, scene->meshWideNodes);
+    const size_t meshTriangles = reserveSceneArray(geometryBytes, scene->meshTriangles);
+    const size_t meshTriangleRecords = reserveSceneArray(geometryBytes, triangleRecordArray);
+    const size_t meshPositions = reserveSceneArray(geometryBytes, positionArray);
+    const size_t meshNormals = reserveSceneArray(geometryBytes, normalArray);
+    const size_t meshUVs = reserveSceneArray(geometryBytes, uvArray);
+    const size_t meshCompactPositions = reserveSceneArray(geometryBytes, compact.positions);
+    const size_t meshCompactNormals = reserveSceneArray(geometryBytes, compact.normals);
+    const size_t meshCompactUVs = reserveSceneArray(geometryBytes, compact.uvs);
+    const size_t cloudBvhNodes = reserveSceneArray(geometryBytes, scene->cloudBvhNodes);
+    const size_t cloudSpheres = reserveSceneArray(geometryBytes, scene->cloudSpheres);
+    geometryBytes = std::max(geometryBytes, (size_t)16);
 
-    checkCUDAError("pathtrace");
-}
+    SceneBuffers buffers;
+    buffers.geometry = NULL;
+    buffers.hotBytes = hotBytes;
+    buffers.paging = chooseGeometryPaging(coreBytes, geometryBytes, forcePagedGeometry, buffers.geometryBudget);
+    const size_t geometryOffset = (coreBytes + 15) & ~(size_t)15;
+    int device = 0;
+    cudaGetDevice(&device);
+    char *geometry = NULL;
+    uint64_t key = 0;
+    if (buffers.paging == GEOMETRY_RESIDENT && shareGeometry && device == primaryDevice) {
+        key = hashSceneArray(key, scene->meshBvhNodes);
+        key = hashSceneArray(key, scene->meshWideNodes);
+        key = hashSceneArray(key, scene->meshTriangles);
+        key = hashSceneArray(key, triangleRecordArray);
+        key = hashSceneArray(key, positionArray);
+        key = hashSceneArray(key, normalArray);
+        key = hashSceneArray(key, uvArray);
+        key = hashSceneArray(key, compact.positions);
+        key = hashSceneArray(key, compact.normals);
+        key = hashSceneArray(key, compact.uvs);
+        key = hashSceneArray(key, scene->cloudBvhNodes);
+        key = hashSceneArray(key, scene->cloudSpheres);
+        geometry = allocateSharedGeometry(buffers, geometryBytes, key);
+        if (geometry != NULL) {
+            // Staged behind the rest as when resident, but copied on their own
+            bytes = geometryOffset + geometryBytes;
+            deviceMemory::allocate(&buffers.data, std::max(coreBytes, (size_t)16));
+        }
+    }
+    if (buffers.paging == GEOMETRY_RESIDENT) {
+        bytes = geometryOffset + geometryBytes;
+        if (deviceMemory::allocate(&buffers.data, bytes) != cudaSuccess) {
+            // cudaMemGetInfo's free memory may still be too fragmented, or
+            // shared with other processes; page the meshes after all
+            cudaGetLastError();
+            buffers.paging = chooseGeometryPaging(coreBytes, geometryBytes, true, buffers.geometryBudget);
+        }
+    }
+    if (buffers.paging == GEOMETRY_MANAGED || buffers.paging == GEOMETRY_MAPPED) {
+        bytes = std::max(coreBytes, (size_t)16);
+        deviceMemory::allocate(&buffers.data, bytes);
+        geometry = allocatePagedGeometry(buffers, geometryBytes);
+        if (geometry != NULL) {
+            printf("Scene meshes (%zu MB) paged from %s memory\n", geometryBytes >> 20,
+                buffers.paging == GEOMETRY_MANAGED ? "managed" : "mapped host");
+        } else {
+            printf("Cannot allocate %zu MB of host memory for the scene's meshes\n", geometryBytes >> 20);
+        }
+    } else if (buffers.paging == GEOMETRY_RESIDENT) {
+        geometry = buffers.data + geometryOffset;
+    }
 
-// CHECKITOUT: this kernel "post-processes" the gbuffer/gbuffers into something that you can visualize for debugging.
-void showGBuffer(uchar4* pbo) {
-    const Camera &cam = hst_scene->state.camera;
-    const dim3 blockSize2d(8, 8);
-    const dim3 blocksPerGrid2d(
-            (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
-            (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    // Resident, the mesh arrays are staged behind the rest and copied with
+    // them; paged, they are written where they stay
+    const bool paged = buffers.paging == GEOMETRY_MANAGED || buffers.paging == GEOMETRY_MAPPED;
+    char *staging = NULL;
+    cudaMallocHost(&staging, bytes);
+    char *geometryStaging = paged ? buffers.geometry : staging + geometryOffset;
+    buffers.geoms = placeSceneArray(staging, buffers.data, geoms, scene->deviceGeoms);
+    buffers.bvhNodes = placeSceneArray(staging, buffers.data, bvhNodes, scene->bvhNodes);
+    buffers.bvhGeomIndices = placeSceneArray(staging, buffers.data, bvhGeomIndices, scene->bvhGeomIndices);
+    buffers.lights = placeSceneArray(staging, buffers.data, lights, scene->lights);
+    buffers.lightNodes = placeSceneArray(staging, buffers.data, lightNodes, scene->lightNodes);
+    buffers.meshes = placeSceneArray(staging, buffers.data, meshes, scene->meshes);
+    buffers.sphereClouds = placeSceneArray(staging, buffers.data, sphereClouds, scene->sphereClouds);
+    buffers.sdfVolumes = placeSceneArray(staging, buffers.data, sdfVolumes, scene->sdfVolumes);
+    buffers.media = placeSceneArray(staging, buffers.data, media, scene->media);
+    buffers.mediumMajorants = placeSceneArray(staging, buffers.data, mediumMajorants, scene->mediumMajorants);
+    if (geometry != NULL) {
+        buffers.meshBvhNodes = placeSceneArray(geometryStaging, geometry, meshBvhNodes, scene->meshBvhNodes);
+        buffers.meshWideNodes = placeSceneArray(geometryStaging, geometry, meshWideNodes, scene->meshWideNodes);
+        buffers.meshTriangles = placeSceneArray(geometryStaging, geometry, meshTriangles, scene->meshTriangles);
+        buffers.meshTriangleRecords = placeSceneArray(geometryStaging, geometry, meshTriangleRecords,
+            triangleRecordArray);
+        buffers.meshPositions = placeSceneArray(geometryStaging, geometry, meshPositions, positionArray);
+        buffers.meshNormals = placeSceneArray(geometryStaging, geometry, meshNormals, normalArray);
+        buffers.meshUVs = placeSceneArray(geometryStaging, geometry, meshUVs, uvArray);
+        buffers.meshCompactPositions = placeSceneArray(geometryStaging, geometry, meshCompactPositions,
+            compact.positions);
+        buffers.meshCompactNormals = placeSceneArray(geometryStaging, geometry, meshCompactNormals,
+            compact.normals);
+        buffers.meshCompactUVs = placeSceneArray(geometryStaging, geometry, meshCompactUVs, compact.uvs);
+        // Kernels tell the two layouts apart by which pointers are NULL
+        if (compactMeshes) {
+            buffers.meshTriangleRecords = NULL;
+            buffers.meshPositions = NULL;
+            buffers.meshNormals = NULL;
+            buffers.meshUVs = NULL;
+        } else {
+            buffers.meshCompactPositions = NULL;
+            buffers.meshCompactNormals = NULL;
+            buffers.meshCompactUVs = NULL;
+        }
+        buffers.cloudBvhNodes = placeSceneArray(geometryStaging, geometry, cloudBvhNodes, scene->cloudBvhNodes);
+        buffers.cloudSpheres = placeSceneArray(geometryStaging, geometry, cloudSpheres, scene->cloudSpheres);
+    } else {
+        buffers.meshBvhNodes = NULL;
+        buffers.meshWideNodes = NULL;
+        buffers.meshTriangles = NULL;
+        buffers.meshTriangleRecords = NULL;
+        buffers.meshPositions = NULL;
+        buffers.meshNormals = NULL;
+        buffers.meshUVs = NULL;
+        buffers.meshCompactPositions = NULL;
+        buffers.meshCompactNormals = NULL;
+        buffers.meshCompactUVs = NULL;
+        buffers.cloudBvhNodes = NULL;
+        buffers.cloudSpheres = NULL;
+    }
+    buffers.materials = placeSceneArray(staging, buffers.data, materials, scene->materials);
+    buffers.environmentMarginalCdf = placeSceneArray(staging, buffers.data, environmentMarginalCdf,
+        scene->environment.marginalCdf);
+    buffers.environmentConditionalCdf = placeSceneArray(staging, buffers.data, environmentConditionalCdf,
+        scene->environment.conditionalCdf);
+    if (buffers.paging == GEOMETRY_EXPORTED || buffers.paging == GEOMETRY_IMPORTED) {
+        cudaMemcpy(buffers.data, staging, coreBytes, cudaMemcpyHostToDevice);
+    } else {
+        cudaMemcpy(buffers.data, staging, bytes, cudaMemcpyHostToDevice);
+    }
+    if (buffers.paging == GEOMETRY_EXPORTED) {
+        cudaMemcpy(buffers.geometry, staging + geometryOffset, geometryBytes, cudaMemcpyHostToDevice);
+        if (sceneShare::publish(buffers.geometry, geometryBytes, key)) {
+            printf("Scene meshes (%zu MB) shared with other processes\n", geometryBytes >> 20);
+        }
+    }
+    cudaFreeHost(staging);
+    return buffers;
+}
 
-    // CHECKITOUT: process the gbuffer results and send them to OpenGL buffer for visualization
-    gbufferToPBO<<<blocksPerGrid2d, blockSize2d>>>(pbo, cam.resolution, dev_gBuffer);
+// Frees what uploadScene allocated for `data` and `geometry`
+static void releaseSceneBuffers(char *data, char *geometry, int paging) {
+    deviceMemory::release(data);
+    if (paging == GEOMETRY_MANAGED) {
+        cudaFree(geometry);
+    } else if (paging == GEOMETRY_MAPPED) {
+        cudaFreeHost(geometry);
+    } else if (paging == GEOMETRY_EXPORTED) {
+        sceneShare::withdraw(geometry);
+        cudaFree(geometry);
+    } else if (paging == GEOMETRY_IMPORTED) {
+        sceneShare::close(geometry);
+    }
+}
+
+/**
+ * Creates the scene's textures and environment map on the current device
+ * and fills that device's texture table. Textures that failed to load, or
+ * that the device cannot hold, get a null entry, which shading treats as
+ * no map; the environment's texture is returned, 0 if there is none.
+ * The volumes of the scene's SDFs are created alongside and their objects
+ * written into `sdfTable`, the device's copy of Scene::sdfVolumes; a
+ * volume that failed keeps object 0, and then is never hit. The grids of
+ * heterogeneous media go into `mediumTable` the same way; one that failed
+ * reads as empty.
+ */
+static cudaTextureObject_t uploadTextures(const Scene *scene, SdfVolume *sdfTable, Medium *mediumTable) {
+    int device = 0;
+    cudaGetDevice(&device);
+    DeviceTexture table[MAX_TEXTURES] = {};
+    VirtualTexturePool virtualPool = {};
+    if (virtualTexturing && device == primaryDevice) {
+        virtualPool = virtualTextures::create(scene->textures, table);
+    }
+    for (size_t i = 0; i < scene->textures.size(); i++) {
+        const TextureImage &image = scene->textures[i];
+        if (image.levels.empty() || table[i].levels > 0) {
+            continue;
+        }
+        GpuTexture texture;
+        texture.device = device;
+        std::string error;
+        if (!textureLoader::create(image, texture.texture, texture.array, error)) {
+            printf("%s\n", error.c_str());
+            continue;
+        }
+        table[i] = texture.texture;
+        gpuTextures.push_back(texture);
+    }
+    cudaMemcpyToSymbol(c_textures, table, sizeof(table));
+    cudaMemcpyToSymbol(c_virtualTextures, &virtualPool, sizeof(virtualPool));
+    const float pixelSpread = scene->state.camera.pixelLength.y;
+    cudaMemcpyToSymbol(c_pixelSpread, &pixelSpread, sizeof(float));
+
+    cudaTextureObject_t environment = 0;
+    if (!scene->environment.image.levels.empty()) {
+        GpuTexture texture;
+        texture.device = device;
+        std::string error;
+        if (textureLoader::create(scene->environment.image, texture.texture, texture.array, error)) {
+            environment = texture.texture.object;
+            gpuTextures.push_back(texture);
+        } else {
+            printf("%s\n", error.c_str());
+        }
+    }
+
+    // The SDF table was uploaded without texture objects, which are per device
+    if (!scene->sdfVolumes.empty()) {
+        std::vector<SdfVolume> sdfs = scene->sdfVolumes;
+        for (size_t i = 0; i < sdfs.size(); i++) {
+            GpuTexture texture;
+            texture.device = device;
+            std::string error;
+            const glm::ivec3 res = sdfs[i].resolution;
+            if (textureLoader::createVolume(&scene->sdfVoxels[sdfs[i].voxelOffset], res.x, res.y, res.z,
+                    texture.texture, texture.array, error)) {
+                sdfs[i].texture = texture.texture.object;
+                gpuTextures.push_back(texture);
+            } else {
+                printf("%s\n", error.c_str());
+            }
+        }
+        cudaMemcpy(sdfTable, sdfs.data(), sdfs.size() * sizeof(SdfVolume), cudaMemcpyHostToDevice);
+    }
+    if (!scene->media.empty()) {
+        std::vector<Medium> media = scene->media;
+        for (size_t i = 0; i < media.size(); i++) {
+            if (media[i].voxelOffset < 0) {
+                continue;
+            }
+            GpuTexture texture;
+            texture.device = device;
+            std::string error;
+            const glm::ivec3 res = media[i].resolution;
+            if (textureLoader::createVolume(&scene->mediumVoxels[media[i].voxelOffset], res.x, res.y, res.z,
+                    texture.texture, texture.array, error)) {
+                media[i].texture = texture.texture.object;
+                gpuTextures.push_back(texture);
+            } else {
+                printf("%s\n", error.c_str());
+            }
+        }
+        cudaMemcpy(mediumTable, media.data(), media.size() * sizeof(Medium), cudaMemcpyHostToDevice);
+    }
+    checkCUDAError("uploadTextures");
+    return environment;
+}
+
+/**
+ * The environment as the kernels see it on one device. Next-event
+ * estimation samples it, with the share Scene::buildLights left it, only
+ * when `sampled`. A device that could not create the texture keeps the
+ * share, so the lights' pmfs still add up, and sees a black environment.
+ */
+static EnvironmentLight environmentLight(const Scene *scene, cudaTextureObject_t texture,
+        const float *marginalCdf, const float *conditionalCdf, bool sampled) {
+    EnvironmentLight environment = {};
+    environment.texture = texture;
+    if (!scene->environment.image.levels.empty()) {
+        environment.marginalCdf = marginalCdf;
+        environment.conditionalCdf = conditionalCdf;
+        environment.width = scene->environment.image.width;
+        environment.height = scene->environment.image.height;
+        environment.intensity = scene->environment.intensity;
+        environment.pmf = sampled ? scene->environmentPmf() : 0.0f;
+    }
+    return environment;
+}
+
+// The media as the kernels see them on one device
+static MediumData mediumData(const Scene *scene, const Medium *media, const float *majorants) {
+    MediumData data = {};
+    data.media = media;
+    data.count = scene->media.size();
+    data.majorants = majorants;
+    return data;
+}
+
+// Frees every device's textures
+static void freeTextures() {
+    int device = 0;
+    cudaGetDevice(&device);
+    for (size_t i = 0; i < gpuTextures.size(); i++) {
+        cudaSetDevice(gpuTextures[i].device);
+        textureLoader::destroy(gpuTextures[i].texture, gpuTextures[i].array);
+    }
+    cudaSetDevice(primaryDevice);
+    virtualTextures::destroy();
+    cudaSetDevice(device);
+    gpuTextures.clear();
+    environmentTexture = 0;
+    for (size_t i = 0; i < traceDevices.size(); i++) {
+        traceDevices[i].environmentTexture = 0;
+    }
+}
+
+/**
+ * The scene arrays that edits can change in place, as last uploaded, so
+ * that an edit only copies the entries that differ
+ */
+struct EditableSceneArrays {
+    std::vector<DeviceGeom> geoms;
+    std::vector<BVHNode> bvhNodes;
+    std::vector<Light> lights;
+    std::vector<LightNode> lightNodes;
+    std::vector<Material> materials;
+};
+static EditableSceneArrays uploadedArrays;
+
+static void keepUploadedArrays(const Scene *scene) {
+    uploadedArrays.geoms = scene->deviceGeoms;
+    uploadedArrays.bvhNodes = scene->bvhNodes;
+    uploadedArrays.lights = scene->lights;
+    uploadedArrays.lightNodes = scene->lightNodes;
+    uploadedArrays.materials = scene->materials;
+}
+
+static void prepareGeometryResidency(const Scene *scene, const SceneBuffers &buffers);
+static void freeSceneEdits();
+
+/**
+ * The L2 access policy window for a trace stream of the current device
+ * over `buffers`' hot arrays (SceneBuffers::hotBytes): the top-level BVH,
+ * geoms, materials, mesh, cloud, SDF and medium records and the lights,
+ * which every bounce reads while the path buffers stream past them. Their
+ * accesses persist in the L2 set-aside, which is sized to the window up to
+ * the device's persisting limit; when the window is larger, its hit ratio
+ * scales down so the persisting lines fit, and the rest stream. Devices
+ * before sm_80 have no set-aside and get an empty window, as does every
+ * device with pathtraceUseL2Persistence(false). Sets `persistingBytes` to
+ * the set-aside.
+ */
+static cudaStreamAttrValue sceneL2Policy(const SceneBuffers &buffers, size_t &persistingBytes) {
+    cudaStreamAttrValue policy = {};
+    persistingBytes = 0;
+    int device = 0;
+    int maxPersisting = 0;
+    int maxWindow = 0;
+    cudaGetDevice(&device);
+    cudaDeviceGetAttribute(&maxPersisting, cudaDevAttrMaxPersistingL2CacheSize, device);
+    cudaDeviceGetAttribute(&maxWindow, cudaDevAttrMaxAccessPolicyWindowSize, device);
+    if (maxPersisting <= 0) {
+        return policy;
+    }
+    // Lines the last scene left persisting would crowd this one's out
+    cudaCtxResetPersistingL2Cache();
+    const size_t windowBytes = std::min(buffers.hotBytes, (size_t)maxWindow);
+    if (l2Persistence && windowBytes > 0) {
+        persistingBytes = std::min(windowBytes, (size_t)maxPersisting);
+        policy.accessPolicyWindow.base_ptr = buffers.data;
+        policy.accessPolicyWindow.num_bytes = windowBytes;
+        policy.accessPolicyWindow.hitRatio = (float)persistingBytes / (float)windowBytes;
+        policy.accessPolicyWindow.hitProp = cudaAccessPropertyPersisting;
+        policy.accessPolicyWindow.missProp = cudaAccessPropertyStreaming;
+    }
+    cudaDeviceSetLimit(cudaLimitPersistingL2CacheSize, persistingBytes);
+    checkCUDAError("sceneL2Policy");
+    return policy;
+}
+
+// The MaterialFeature bits some material of `scene` has
+static int materialFeatures(const Scene *scene) {
+    int features = 0;
+    for (size_t i = 0; i < scene->materials.size(); i++) {
+        const Material &material = scene->materials[i];
+        features |= (material.hasReflective > 0.0f ? MATERIAL_REFLECTIVE : 0)
+            | (material.hasRefractive > 0.0f ? MATERIAL_REFRACTIVE : 0)
+            | (hasTextureMaps(material) ? MATERIAL_TEXTURED : 0);
+    }
+    return features;
+}
+
+// Points the primary device's scene arrays at `buffers`
+static void bindSceneBuffers(const Scene *scene, const SceneBuffers &buffers) {
+    freeSceneEdits();
+    sceneHotFront = buffers.data;
+    sceneHotBytes = buffers.hotBytes;
+    dev_sceneData = buffers.data;
+    dev_sceneGeometry = buffers.geometry;
+    sceneGeometryPaging = buffers.paging;
+    dev_geoms = buffers.geoms;
+    dev_bvhNodes = buffers.bvhNodes;
+    dev_bvhGeomIndices = buffers.bvhGeomIndices;
+    bvhBuiltCost = 0.0f;
+    dev_lights = buffers.lights;
+    dev_lightNodes = buffers.lightNodes;
+    dev_meshes = buffers.meshes;
+    dev_meshBvhNodes = buffers.meshBvhNodes;
+    dev_meshWideNodes = buffers.meshWideNodes;
+    dev_meshTriangles = buffers.meshTriangles;
+    dev_meshTriangleRecords = buffers.meshTriangleRecords;
+    dev_meshPositions = buffers.meshPositions;
+    dev_meshNormals = buffers.meshNormals;
+    dev_meshUVs = buffers.meshUVs;
+    dev_meshCompactPositions = buffers.meshCompactPositions;
+    dev_meshCompactNormals = buffers.meshCompactNormals;
+    dev_meshCompactUVs = buffers.meshCompactUVs;
+    dev_sphereClouds = buffers.sphereClouds;
+    dev_cloudBvhNodes = buffers.cloudBvhNodes;
+    dev_cloudSpheres = buffers.cloudSpheres;
+    dev_sdfVolumes = buffers.sdfVolumes;
+    dev_media = buffers.media;
+    dev_mediumMajorants = buffers.mediumMajorants;
+    dev_materials = buffers.materials;
+    dev_environmentMarginalCdf = buffers.environmentMarginalCdf;
+    dev_environmentConditionalCdf = buffers.environmentConditionalCdf;
+
+    sharedGeomBytes = scene->deviceGeoms.size() * sizeof(DeviceGeom);
+    if (sharedGeomBytes > SCENE_SHARED_MAX_BYTES) {
+        sharedGeomBytes = 0;
+    }
+
+    sharedMaterialBytes = scene->materials.size() * sizeof(Material);
+    if (sharedMaterialBytes > SCENE_SHARED_MAX_BYTES) {
+        sharedMaterialBytes = 0;
+    }
+    sceneMaterialFeatures = materialFeatures(scene);
+    chooseLaunchConfiguration();
+    primaryL2Policy = sceneL2Policy(buffers, launchConfig.l2PersistingBytes);
+    launchConfig.l2WindowBytes = primaryL2Policy.accessPolicyWindow.num_bytes;
+    cudaStreamSetAttribute(0, cudaStreamAttributeAccessPolicyWindow, &primaryL2Policy);
+    if (graphCaptureStream != NULL) {
+        cudaStreamSetAttribute(graphCaptureStream, cudaStreamAttributeAccessPolicyWindow, &primaryL2Policy);
+    }
+    // Drivers that take no window on the legacy stream leave it to the graphs
+    cudaGetLastError();
+    prepareGeometryResidency(scene, buffers);
+}
+
+static void bindTraceDeviceScene(TraceDevice &td, const SceneBuffers &buffers) {
+    size_t persistingBytes = 0;
+    cudaStreamAttrValue policy = sceneL2Policy(buffers, persistingBytes);
+    cudaStreamSetAttribute(td.stream, cudaStreamAttributeAccessPolicyWindow, &policy);
+    td.sceneData = buffers.data;
+    td.sceneGeometry = buffers.geometry;
+    td.geometryPaging = buffers.paging;
+    td.geoms = buffers.geoms;
+    td.bvhNodes = buffers.bvhNodes;
+    td.bvhGeomIndices = buffers.bvhGeomIndices;
+    td.lights = buffers.lights;
+    td.lightNodes = buffers.lightNodes;
+    td.meshes = buffers.meshes;
+    td.meshBvhNodes = buffers.meshBvhNodes;
+    td.meshWideNodes = buffers.meshWideNodes;
+    td.meshTriangles = buffers.meshTriangles;
+    td.meshTriangleRecords = buffers.meshTriangleRecords;
+    td.meshPositions = buffers.meshPositions;
+    td.meshNormals = buffers.meshNormals;
+    td.meshUVs = buffers.meshUVs;
+    td.meshCompactPositions = buffers.meshCompactPositions;
+    td.meshCompactNormals = buffers.meshCompactNormals;
+    td.meshCompactUVs = buffers.meshCompactUVs;
+    td.sphereClouds = buffers.sphereClouds;
+    td.cloudBvhNodes = buffers.cloudBvhNodes;
+    td.cloudSpheres = buffers.cloudSpheres;
+    td.sdfVolumes = buffers.sdfVolumes;
+    td.media = buffers.media;
+    td.mediumMajorants = buffers.mediumMajorants;
+    td.materials = buffers.materials;
+    td.environmentMarginalCdf = buffers.environmentMarginalCdf;
+    td.environmentConditionalCdf = buffers.environmentConditionalCdf;
+}
+
+static void freeGeometryResidency() {
+    if (geomHitsPending) {
+        cudaEventSynchronize(geomHitsCopied);
+        geomHitsPending = false;
+    }
+    deviceMemory::release(dev_geomHits);
+    dev_geomHits = NULL;
+    cudaFreeHost(hst_geomHits);
+    hst_geomHits = NULL;
+    geomHitsCount = 0;
+    meshPages.clear();
+    meshEntryPages.clear();
+}
+
+// Groups the primary's paged meshes for updateGeometryResidency; does nothing unless they are managed
+static void prepareGeometryResidency(const Scene *scene, const SceneBuffers &buffers) {
+    freeGeometryResidency();
+    if (buffers.paging != GEOMETRY_MANAGED || buffers.meshTriangles == NULL) {
+        return;
+    }
+    geometryBudget = buffers.geometryBudget;
+
+    // A group's arrays run from its first entry's to the next group's,
+    // as Scene::loadMeshes appends them; wideRoot is -1 for entries
+    // without wide nodes and their vertices start at their lowest index
+    const std::vector<Mesh> &meshes = scene->meshes;
+    std::vector<int> firsts;
+    for (size_t m = 0; m < meshes.size(); m += 1 + meshes[m].lodCount) {
+        firsts.push_back((int)m);
+    }
+    meshPages.resize(firsts.size());
+    meshEntryPages.resize(meshes.size());
+    int nextNodes = scene->meshBvhNodes.size();
+    int nextWide = scene->meshWideNodes.size();
+    int nextTriangles = scene->meshTriangles.size();
+    int nextVertices = scene->meshPositions.size();
+    for (int g = (int)firsts.size() - 1; g >= 0; g--) {
+        const int first = firsts[g];
+        const int end = std::min(first + 1 + meshes[first].lodCount, (int)meshes.size());
+        MeshPages &pages = meshPages[g];
+        int wide = nextWide;
+        int vertices = nextVertices;
+        for (int m = first; m < end; m++) {
+            meshEntryPages[m] = g;
+            if (meshes[m].wideRoot >= 0) {
+                wide = std::min(wide, meshes[m].wideRoot);
+            }
+        }
+        for (int t = meshes[first].triangleOffset; t < nextTriangles; t++) {
+            const glm::ivec3 &tri = scene->meshTriangles[t];
+            vertices = std::min(vertices, std::min(tri.x, std::min(tri.y, tri.z)));
+        }
+        pages.nodes[0] = meshes[first].bvhRoot;
+        pages.nodes[1] = nextNodes;
+        pages.wideNodes[0] = wide;
+        pages.wideNodes[1] = nextWide;
+        pages.triangles[0] = meshes[first].triangleOffset;
+        pages.triangles[1] = nextTriangles;
+        pages.vertices[0] = vertices;
+        pages.vertices[1] = nextVertices;
+        pages.bytes = (pages.nodes[1] - pages.nodes[0]) * sizeof(BVHNode)
+            + (pages.wideNodes[1] - pages.wideNodes[0]) * sizeof(WideBVHNode)
+            + (pages.triangles[1] - pages.triangles[0])
+                * (sizeof(glm::ivec3) + (buffers.meshTriangleRecords != NULL ? sizeof(TriangleRecord) : 0))
+            + (pages.vertices[1] - pages.vertices[0])
+                * (buffers.meshCompactPositions != NULL ? sizeof(ushort3) : sizeof(glm::vec3));
+        pages.heat = 0.0f;
+        pages.resident = false;
+        nextNodes = pages.nodes[0];
+        nextWide = pages.wideNodes[0];
+        nextTriangles = pages.triangles[0];
+        nextVertices = pages.vertices[0];
+    }
+
+    geomHitsCount = std::max((int)scene->deviceGeoms.size(), 1);
+    deviceMemory::allocate(&dev_geomHits, geomHitsCount * sizeof(unsigned int));
+    cudaMemset(dev_geomHits, 0, geomHitsCount * sizeof(unsigned int));
+    cudaMallocHost(&hst_geomHits, geomHitsCount * sizeof(unsigned int));
+    if (geomHitsCopied == NULL) {
+        cudaEventCreateWithFlags(&geomHitsCopied, cudaEventDisableTiming);
+        cudaStreamCreateWithFlags(&pagingStream, cudaStreamNonBlocking);
+    }
+    checkCUDAError("prepareGeometryResidency");
+}
+
+// Moves [first, end) of `array` to `location` on the paging stream
+template <typename T>
+static void prefetchMeshRange(const T *array, const int range[2], int location) {
+    if (array != NULL && range[1] > range[0]) {
+        cudaMemPrefetchAsync(array + range[0], (range[1] - range[0]) * sizeof(T), location, pagingStream);
+    }
+}
+
+static void prefetchMeshPages(const MeshPages &pages, int location) {
+    prefetchMeshRange(dev_meshBvhNodes, pages.nodes, location);
+    prefetchMeshRange(dev_meshWideNodes, pages.wideNodes, location);
+    prefetchMeshRange(dev_meshTriangles, pages.triangles, location);
+    prefetchMeshRange(dev_meshTriangleRecords, pages.triangles, location);
+    prefetchMeshRange(dev_meshPositions, pages.vertices, location);
+    prefetchMeshRange(dev_meshCompactPositions, pages.vertices, location);
+    // Normals and UVs are indexed like the positions only when every mesh has them
+    if (hst_scene->meshNormals.size() == hst_scene->meshPositions.size()) {
+        prefetchMeshRange(dev_meshNormals, pages.vertices, location);
+        prefetchMeshRange(dev_meshCompactNormals, pages.vertices, location);
+    }
+    if (hst_scene->meshUVs.size() == hst_scene->meshPositions.size()) {
+        prefetchMeshRange(dev_meshUVs, pages.vertices, location);
+        prefetchMeshRange(dev_meshCompactUVs, pages.vertices, location);
+    }
+}
+
+/**
+ * Before a launch: once the hit counts of an earlier launch are back,
+ * ranks the mesh groups by their hits, decayed over launches so a group
+ * does not flip in and out with the noise, and prefetches the hottest ones
+ * that fit geometryBudget to the primary device while the launch runs; the
+ * pages of the others go back to the host. Kernels still reach every page
+ * wherever it is, so this only decides which ones they read at device speed.
+ */
+static void updateGeometryResidency() {
+    if (!geomHitsPending || cudaEventQuery(geomHitsCopied) != cudaSuccess) {
+        cudaGetLastError();
+        return;
+    }
+    geomHitsPending = false;
+    std::vector<float> hits(meshPages.size(), 0.0f);
+    for (int i = 0; i < geomHitsCount && i < (int)hst_scene->deviceGeoms.size(); i++) {
+        const int meshid = hst_scene->deviceGeoms[i].meshid;
+        if (hst_geomHits[i] > 0 && meshid >= 0 && meshid < (int)meshEntryPages.size()) {
+            hits[meshEntryPages[meshid]] += hst_geomHits[i];
+        }
+    }
+    std::vector<int> order(meshPages.size());
+    for (size_t g = 0; g < meshPages.size(); g++) {
+        meshPages[g].heat = 0.5f * meshPages[g].heat + hits[g];
+        order[g] = (int)g;
+    }
+    std::sort(order.begin(), order.end(), [](int a, int b) { return meshPages[a].heat > meshPages[b].heat; });
+
+    int device = 0;
+    cudaGetDevice(&device);
+    size_t budget = geometryBudget;
+    for (size_t i = 0; i < order.size(); i++) {
+        MeshPages &pages = meshPages[order[i]];
+        const bool resident = pages.heat > 0.0f && pages.bytes <= budget;
+        if (resident) {
+            budget -= pages.bytes;
+        }
+        if (resident != pages.resident) {
+            prefetchMeshPages(pages, resident ? device : cudaCpuDeviceId);
+            pages.resident = resident;
+        }
+    }
+    checkCUDAError("updateGeometryResidency");
+}
+
+// After a launch: copies its hit counts back behind it and clears them for the next
+static void collectGeometryHits() {
+    if (dev_geomHits == NULL || geomHitsPending) {
+        return;
+    }
+    cudaMemcpyAsync(hst_geomHits, dev_geomHits, geomHitsCount * sizeof(unsigned int), cudaMemcpyDeviceToHost, 0);
+    cudaEventRecord(geomHitsCopied, 0);
+    cudaMemsetAsync(dev_geomHits, 0, geomHitsCount * sizeof(unsigned int), 0);
+    geomHitsPending = true;
+}
+
+/**
+ * Makes the GPU tree from LBVH::build the top-level BVH of every device:
+ * it is built on the primary from the geoms already uploaded there and
+ * copied to the others.
+ */
+static void buildDeviceBVH(const Scene *scene) {
+    const int n = (int)scene->deviceGeoms.size();
+    const size_t nodeBytes = LBVH::nodeCount(n) * sizeof(BVHNode);
+    const size_t indexBytes = n * sizeof(int);
+    if (n > lbvhCapacity) {
+        deviceMemory::release(dev_lbvhNodes);
+        deviceMemory::release(dev_lbvhGeomIndices);
+        deviceMemory::allocate(&dev_lbvhNodes, nodeBytes);
+        deviceMemory::allocate(&dev_lbvhGeomIndices, indexBytes);
+        for (size_t i = 0; i < traceDevices.size(); i++) {
+            TraceDevice &td = traceDevices[i];
+            cudaSetDevice(td.device);
+            deviceMemory::release(td.lbvhNodes);
+            deviceMemory::release(td.lbvhGeomIndices);
+            deviceMemory::allocate(&td.lbvhNodes, nodeBytes);
+            deviceMemory::allocate(&td.lbvhGeomIndices, indexBytes);
+        }
+        cudaSetDevice(primaryDevice);
+        lbvhCapacity = n;
+    }
+
+    LBVH::build(n, dev_geoms, dev_meshes, dev_meshBvhNodes, dev_sphereClouds, dev_cloudBvhNodes,
+        dev_sdfVolumes, dev_lbvhNodes, dev_lbvhGeomIndices);
+    dev_bvhNodes = dev_lbvhNodes;
+    dev_bvhGeomIndices = dev_lbvhGeomIndices;
+    for (size_t i = 0; i < traceDevices.size(); i++) {
+        TraceDevice &td = traceDevices[i];
+        cudaMemcpyPeer(td.lbvhNodes, td.device, dev_lbvhNodes, primaryDevice, nodeBytes);
+        cudaMemcpyPeer(td.lbvhGeomIndices, td.device, dev_lbvhGeomIndices, primaryDevice, indexBytes);
+        td.bvhNodes = td.lbvhNodes;
+        td.bvhGeomIndices = td.lbvhGeomIndices;
+    }
+    bvhBuiltCost = 0.0f;
+    checkCUDAError("buildDeviceBVH");
+}
+
+// Rebuilds the GPU tree after every upload with pathtraceUseDeviceBVH(true)
+static void rebuildDeviceBVH(const Scene *scene) {
+    if (deviceBVH && !scene->deviceGeoms.empty()) {
+        buildDeviceBVH(scene);
+    }
+}
+
+// Nodes of the bound top-level tree, which is laid out by BVH::build or LBVH::build
+static int boundBVHNodeCount(const Scene *scene) {
+    return dev_bvhNodes == dev_lbvhNodes ? LBVH::nodeCount((int)scene->deviceGeoms.size())
+        : (int)scene->bvhNodes.size();
+}
+
+static float boundBVHCost(const Scene *scene) {
+    return LBVH::sahCost(boundBVHNodeCount(scene), dev_bvhNodes);
+}
+
+/**
+ * Refits the bound top-level tree to the geoms on the primary, or rebuilds
+ * it with LBVH::build when the refit tree has grown too costly to trace,
+ * and copies it to the other devices.
+ */
+static void refitTopLevelBVH(const Scene *scene) {
+    const int n = (int)scene->deviceGeoms.size();
+    if (n == 0) {
+        return;
+    }
+    LBVH::refit(boundBVHNodeCount(scene), n, dev_geoms, dev_meshes, dev_meshBvhNodes, dev_sphereClouds,
+        dev_cloudBvhNodes, dev_sdfVolumes, dev_bvhNodes, dev_bvhGeomIndices);
+    if (bvhBuiltCost > 0.0f && boundBVHCost(scene) > BVH_REBUILD_COST_RATIO * bvhBuiltCost) {
+        buildDeviceBVH(scene);
+        bvhBuiltCost = boundBVHCost(scene);
+        printf("Top-level BVH rebuilt on the GPU after refits\n");
+    }
+    const size_t nodeBytes = boundBVHNodeCount(scene) * sizeof(BVHNode);
+    for (size_t i = 0; i < traceDevices.size(); i++) {
+        TraceDevice &td = traceDevices[i];
+        cudaMemcpyPeer(td.bvhNodes, td.device, dev_bvhNodes, primaryDevice, nodeBytes);
+    }
+    checkCUDAError("refitTopLevelBVH");
+}
+
+/**
+ * Whether pathtraceInit() and every later scene update replace the host-
+ * built top-level BVH with one built on the GPU. Takes effect at the next
+ * pathtraceInit().
+ */
+void pathtraceUseDeviceBVH(bool enable) {
+    deviceBVH = enable;
+}
+
+/**
+ * Whether the primary device pages the scene's RGBA8 textures in as
+ * shading asks for their tiles (see virtualTexture.h) rather than
+ * uploading them whole. Takes effect at the next upload.
+ */
+void pathtraceUseVirtualTextures(bool enable) {
+    virtualTexturing = enable;
+}
+
+/**
+ * Whether scene uploads page the mesh arrays from host memory even when
+ * they would fit on the device, as they do when they would not (see
+ * GeometryPaging). Takes effect at the next upload.
+ */
+void pathtraceUsePagedGeometry(bool enable) {
+    forcePagedGeometry = enable;
+}
+
+/**
+ * Whether the primary's resident mesh arrays are shared with other
+ * processes uploading the same geometry to the same GPU (see
+ * sceneShare.h), off by default. Takes effect at the next upload.
+ */
+void pathtraceShareGeometry(bool enable) {
+    shareGeometry = enable;
+}
+
+/**
+ * Whether the trace streams keep the scene's hot arrays persisting in L2
+ * (see sceneL2Policy), on by default. Takes effect at the next upload.
+ */
+void pathtraceUseL2Persistence(bool enable) {
+    l2Persistence = enable;
+}
+
+void pathtraceUseDenoiseNetwork(const std::vector<float> &weights) {
+    denoiseNetwork = weights;
+    const float *network = weights.empty() ? NULL : weights.data();
+    if (denoiser != NULL) {
+        denoiserSetNetwork(denoiser, network, weights.size());
+    }
+    if (regionDenoiser != NULL) {
+        denoiserSetNetwork(regionDenoiser, network, weights.size());
+    }
+}
+
+bool pathtraceDenoiseNetworkAvailable() {
+    return !denoiseNetwork.empty();
+}
+
+void pathtraceCaptureBounce(const std::string &file, int depth) {
+    captureFile = file;
+    captureDepth = std::max(depth, 0);
+}
+
+// Builds the OptiX instance and geometry ASes on the primary GPU, when OptiX is available
+// and the meshes have the float vertices it builds from
+static void buildHardwareAS(const Scene *scene) {
+    if (dev_meshCompactPositions != NULL) {
+        return;
+    }
+    MeshData meshData = {};
+    meshData.meshes = dev_meshes;
+    meshData.triangles = dev_meshTriangles;
+    meshData.positions = dev_meshPositions;
+    meshData.normals = dev_meshNormals;
+    meshData.uvs = dev_meshUVs;
+    meshData.clouds = dev_sphereClouds;
+    meshData.cloudNodes = dev_cloudBvhNodes;
+    meshData.cloudSpheres = dev_cloudSpheres;
+    meshData.sdfs = dev_sdfVolumes;
+    OptixBackend::build(scene, dev_geoms, dev_materials, meshData);
+    checkCUDAError("buildHardwareAS");
+}
+
+/**
+ * Rebuilds the acceleration structures made from the uploaded scene rather
+ * than uploaded with it: the GPU-built or GPU-refit top-level BVH and,
+ * when OptiX is available, its instance and geometry ASes on the primary GPU.
+ */
+static void rebuildAccelerationStructures(const Scene *scene) {
+    rebuildDeviceBVH(scene);
+    if (geomsAnimated && !deviceBVH) {
+        refitTopLevelBVH(scene);
+    }
+    buildHardwareAS(scene);
+}
+
+// Whether PathtraceOptions::hardwareRT can take effect in this build, on this GPU and for this scene
+bool pathtraceHardwareRTAvailable() {
+    return OptixBackend::available() && dev_meshCompactPositions == NULL;
+}
+
+// Whether DENOISE_OPTIX can take effect in this build and on this GPU
+bool pathtraceAIDenoiserAvailable() {
+    return OptixBackend::denoiserAvailable();
+}
+
+/**
+ * The image the renderer accumulates: every view's camera.resolution image,
+ * stacked top to bottom. A stereo pair is traced as one image of twice the
+ * height, so every launch, buffer and readback covers both eyes; only the
+ * camera rays and the G-buffer's positions tell them apart.
+ */
+static glm::ivec2 imageResolution() {
+    const RenderState &state = hst_scene->state;
+    return glm::ivec2(state.camera.resolution.x, state.camera.resolution.y * state.viewCount());
+}
+
+void pathtraceInit(Scene *scene) {
+    hst_scene = scene;
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+
+    deviceMemory::allocate(&dev_image, pixelcount * sizeof(float4));
+    cudaMemset(dev_image, 0, pixelcount * sizeof(float4));
+    deviceMemory::allocate(&dev_moments, pixelcount * sizeof(glm::vec2));
+    cudaMemset(dev_moments, 0, pixelcount * sizeof(glm::vec2));
+    deviceMemory::allocate(&dev_converged, pixelcount * sizeof(unsigned char));
+    cudaMemset(dev_converged, 0, pixelcount * sizeof(unsigned char));
+    accumulatedSamples = 0;
+
+  	allocPathBuffers(pixelcount);
+  	launchSamples = 1;
+  	deviceMemory::allocate(&dev_queueCounters, 2 * sizeof(int));
+  	deviceMemory::allocate(&dev_pathQueue, sizeof(PathQueue));
+  	deviceMemory::allocate(&dev_cooperativeLive, 3 * sizeof(int));
+  	deviceMemory::allocate(&dev_rayCounts, RAY_COUNT_SLOTS * sizeof(unsigned long long));
+  	cudaMemset(dev_rayCounts, 0, RAY_COUNT_SLOTS * sizeof(unsigned long long));
+
+  	bindSceneBuffers(scene, uploadScene(scene));
+  	environmentTexture = uploadTextures(scene, dev_sdfVolumes, dev_media);
+  	keepUploadedArrays(scene);
+
+  	firstBounceCached = false;
+
+    deviceMemory::allocate(&dev_gBuffer, pixelcount * sizeof(GBufferPixel));
+    deviceMemory::allocate(&dev_prevGBuffer, pixelcount * sizeof(GBufferPixel));
+    deviceMemory::allocate(&dev_rasterHits, pixelcount * sizeof(int2));
+    rasterHitsValid = false;
+    tileListsBinned = false;
+
+    deviceMemory::allocate(&dev_temporal, pixelcount * sizeof(float4));
+    deviceMemory::allocate(&dev_temporalLength, pixelcount * sizeof(float));
+    deviceMemory::allocate(&dev_history, pixelcount * sizeof(float4));
+    deviceMemory::allocate(&dev_historyLength, pixelcount * sizeof(float));
+    temporalValid = false;
+    historyValid = false;
+
+    deviceMemory::allocate(&dev_denoiseStaging, pixelcount * sizeof(float4));
+    // The denoiser filters in memory tracked with the renderer's own
+    size_t denoiserBytes = 0;
+    denoiserScratchBytes(resolution.x, resolution.y, &denoiserBytes);
+    deviceMemory::allocate(&dev_denoiserScratch, denoiserBytes);
+    if (denoiserCreate(resolution.x, resolution.y, dev_denoiserScratch, denoiserBytes,
+            &denoiser) != DENOISER_SUCCESS) {
+        fprintf(stderr, "Could not create the denoiser.\n");
+    } else if (!denoiseNetwork.empty()
+            && denoiserSetNetwork(denoiser, denoiseNetwork.data(), denoiseNetwork.size()) != DENOISER_SUCCESS) {
+        fprintf(stderr, "Could not load the denoiser's network.\n");
+    }
+
+    cudaMallocHost(&hst_pinnedImage, pixelcount * sizeof(float4));
+    // The readback buffers are only allocated by pathtraceBeginReadback,
+    // the checkpoint ones by pathtraceBeginCheckpoint
+    readbackPending = false;
+    checkpointPending = false;
+
+    for (int slot = 0; slot < TIMER_COUNT; slot++) {
+        cudaEventCreate(&timerEvents[slot][0]);
+        cudaEventCreate(&timerEvents[slot][1]);
+        timerPending[slot] = false;
+        timerAverageMs[slot] = 0.0f;
+    }
+    // At the greatest priority, so a frame's display and denoise kernels
+    // start ahead of the trace blocks already queued on the default stream
+    int leastPriority = 0;
+    int greatestPriority = 0;
+    cudaDeviceGetStreamPriorityRange(&leastPriority, &greatestPriority);
+    cudaStreamCreateWithPriority(&displayStream, cudaStreamNonBlocking, greatestPriority);
+    cudaEventCreateWithFlags(&traceQueued, cudaEventDisableTiming);
+    cudaEventCreateWithFlags(&displayDone, cudaEventDisableTiming);
+    cudaEventRecord(displayDone, displayStream);
+
+    initTraceDevices(scene);
+    rebuildAccelerationStructures(scene);
+    radianceCacheValid = false;
+    pathGuideValid = false;
+    photonMapValid = false;
+    reservoirsValid = false;
+
+    // TODO: initialize any extra device memeory you need
+
+    checkCUDAError("pathtraceInit");
+}
+
+/**
+ * Restarts accumulation after a camera or setting change. Only the image is
+ * cleared and the first-bounce cache invalidated; the camera is passed to
+ * the kernels by value every iteration, so all other buffers and the scene
+ * upload stay resident.
+ */
+void pathtraceReset() {
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+
+    // The last display may still be reading the buffers cleared or swapped here
+    waitForDisplay();
+    cudaMemset(dev_image, 0, pixelcount * sizeof(float4));
+    cudaMemset(dev_moments, 0, pixelcount * sizeof(glm::vec2));
+    cudaMemset(dev_converged, 0, pixelcount * sizeof(unsigned char));
+    if (dev_rayCost != NULL) {
+        cudaMemset(dev_rayCost, 0, pixelcount * sizeof(RayCost));
+    }
+    if (dev_specular != NULL) {
+        cudaMemset(dev_specular, 0, pixelcount * sizeof(float4));
+    }
+    accumulatedSamples = 0;
+    resetTraceDevices();
+    firstBounceCached = false;
+    centreGBufferValid = false;
+    rasterHitsValid = false;
+    tileListsBinned = false;
+    destroyGraph();
+
+    // Keep the last temporally filtered frame as history for reprojection.
+    // Its G-buffer moves along with it, as do the reservoirs'; the next
+    // iteration rewrites dev_gBuffer.
+    historyValid = temporalValid;
+    if (temporalValid) {
+        std::swap(dev_temporal, dev_history);
+        std::swap(dev_temporalLength, dev_historyLength);
+        historyCamera = renderedCamera;
+    }
+    // A second reset before the next TAA resolve would swap the history's
+    // G-buffer back to be overwritten, so the history goes with it
+    taaReproject = taaValid && !taaReproject;
+    taaValid = taaReproject;
+    stopLuminanceValid = false;
+    if (temporalValid || reservoirsValid || taaReproject) {
+        std::swap(dev_gBuffer, dev_prevGBuffer);
+    }
+    temporalValid = false;
+    reservoirsValid = reservoirsValid && reservoirGBuffer != dev_gBuffer;
+
+    checkCUDAError("pathtraceReset");
+}
+
+template <typename T>
+static bool sameEntries(const std::vector<T> &a, const std::vector<T> &b) {
+    return a.size() == b.size()
+        && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+}
+
+static bool sameTextures(const std::vector<TextureImage> &a, const std::vector<TextureImage> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].filename != b[i].filename || a[i].srgb != b[i].srgb || a[i].format != b[i].format
+                || a[i].levels != b[i].levels) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Copies the runs of entries where `next` differs from `previous`, which
+ * has the same length, to `device`. Returns the number of entries copied.
+ */
+template <typename T>
+static size_t uploadChangedEntries(T *device, const std::vector<T> &previous, const std::vector<T> &next) {
+    size_t copied = 0;
+    size_t begin = 0;
+    while (begin < next.size()) {
+        if (memcmp(&previous[begin], &next[begin], sizeof(T)) == 0) {
+            begin++;
+            continue;
+        }
+        size_t end = begin + 1;
+        while (end < next.size() && memcmp(&previous[end], &next[end], sizeof(T)) != 0) {
+            end++;
+        }
+        cudaMemcpy(device + begin, next.data() + begin, (end - begin) * sizeof(T), cudaMemcpyHostToDevice);
+        copied += end - begin;
+        begin = end;
+    }
+    return copied;
+}
+
+/**
+ * Copies the entries of the edited arrays that differ from what the GPUs
+ * hold to each of them, and returns how many entries changed. The array
+ * lengths must be the same as in the last upload. A GPU-built BVH is
+ * rebuilt from the new geoms rather than patched, and a GPU-refit one
+ * refit again.
+ */
+static size_t uploadSceneEdits(const Scene *scene) {
+    size_t copied = uploadChangedEntries(dev_geoms, uploadedArrays.geoms, scene->deviceGeoms)
+        + uploadChangedEntries(dev_lights, uploadedArrays.lights, scene->lights)
+        + uploadChangedEntries(dev_lightNodes, uploadedArrays.lightNodes, scene->lightNodes)
+        + uploadChangedEntries(dev_materials, uploadedArrays.materials, scene->materials);
+    if (!deviceBVH && !geomsAnimated) {
+        copied += uploadChangedEntries(dev_bvhNodes, uploadedArrays.bvhNodes, scene->bvhNodes);
+    }
+    for (size_t i = 0; i < traceDevices.size(); i++) {
+        TraceDevice &td = traceDevices[i];
+        cudaSetDevice(td.device);
+        uploadChangedEntries(td.geoms, uploadedArrays.geoms, scene->deviceGeoms);
+        if (!deviceBVH && !geomsAnimated) {
+            uploadChangedEntries(td.bvhNodes, uploadedArrays.bvhNodes, scene->bvhNodes);
+        }
+        uploadChangedEntries(td.lights, uploadedArrays.lights, scene->lights);
+        uploadChangedEntries(td.lightNodes, uploadedArrays.lightNodes, scene->lightNodes);
+        uploadChangedEntries(td.materials, uploadedArrays.materials, scene->materials);
+    }
+    cudaSetDevice(primaryDevice);
+    keepUploadedArrays(scene);
+    // An edited material may have gained a lobe or map
+    sceneMaterialFeatures = materialFeatures(scene);
+    rebuildAccelerationStructures(scene);
+    return copied;
+}
+
+/**
+ * Whether edits can be written into the back copy of the hot arrays while
+ * launches go on. Not when structures built from them would have to be
+ * built again to match: a GPU-built or GPU-refit top-level BVH, or OptiX's
+ * ASes, which also hold the arrays' addresses.
+ */
+static bool sceneEditsBuffered() {
+    return !deviceBVH && !geomsAnimated && !pathtraceHardwareRTAvailable();
+}
+
+// uploadChangedEntries into the back copy, by way of `staged`, on sceneEditStream
+template <typename T>
+static size_t queueChangedEntries(T *device, T *staged, const std::vector<T> &previous,
+        const std::vector<T> &next) {
+    size_t copied = 0;
+    size_t begin = 0;
+    while (begin < next.size()) {
+        if (memcmp(&previous[begin], &next[begin], sizeof(T)) == 0) {
+            begin++;
+            continue;
+        }
+        size_t end = begin + 1;
+        while (end < next.size() && memcmp(&previous[end], &next[end], sizeof(T)) != 0) {
+            end++;
+        }
+        memcpy(staged + begin, next.data() + begin, (end - begin) * sizeof(T));
+        cudaMemcpyAsync(device + begin, staged + begin, (end - begin) * sizeof(T), cudaMemcpyHostToDevice,
+            sceneEditStream);
+        copied += end - begin;
+        begin = end;
+    }
+    return copied;
+}
+
+// Where `p`, a pointer into the hot arrays at `from`, lands in the copy at `to`
+template <typename T>
+static T * rebaseHotArray(T *p, const char *from, char *to) {
+    const char *c = reinterpret_cast<const char *>(p);
+    if (c < from || c > from + sceneHotBytes) {
+        return p;
+    }
+    return reinterpret_cast<T *>(to + (c - from));
+}
+
+static char * sceneHotBack() {
+    return sceneHotFront == dev_sceneData ? dev_sceneBack : dev_sceneData;
+}
+
+/**
+ * uploadSceneEdits for sceneEditsBuffered() scenes, without stopping the
+ * render: on a side stream, once no launch reads the back copy, the front
+ * copy is copied over it and the edited entries over that, and
+ * swapSceneBuffers makes it the front at the next launch. The other GPUs
+ * get the edits then, in order on their streams. Returns the number of
+ * entries changed.
+ */
+static size_t queueSceneEdits(const Scene *scene) {
+    if (dev_sceneBack == NULL) {
+        deviceMemory::allocate(&dev_sceneBack, std::max(sceneHotBytes, (size_t)16));
+        cudaMallocHost(&hst_sceneEdits, std::max(sceneHotBytes, (size_t)16));
+        cudaStreamCreateWithFlags(&sceneEditStream, cudaStreamNonBlocking);
+        cudaEventCreateWithFlags(&sceneEditsReady, cudaEventDisableTiming);
+        cudaEventCreateWithFlags(&sceneBackReleased, cudaEventDisableTiming);
+        cudaEventRecord(sceneEditsReady, sceneEditStream);
+        cudaEventRecord(sceneBackReleased, 0);
+    }
+    // The staging may still feed the last edits' copies, which only wait
+    // for launches queued before the last swap
+    cudaEventSynchronize(sceneEditsReady);
+    char *back = sceneHotBack();
+    if (!sceneSwapPending) {
+        cudaStreamWaitEvent(sceneEditStream, sceneBackReleased, 0);
+        for (size_t i = 0; i < traceDevices.size(); i++) {
+            cudaStreamWaitEvent(sceneEditStream, traceDevices[i].sceneRead, 0);
+        }
+        cudaMemcpyAsync(back, sceneHotFront, sceneHotBytes, cudaMemcpyDeviceToDevice, sceneEditStream);
+    }
+    const char *front = sceneHotFront;
+    size_t copied = queueChangedEntries(rebaseHotArray(dev_geoms, front, back),
+            rebaseHotArray(dev_geoms, front, hst_sceneEdits), uploadedArrays.geoms, scene->deviceGeoms)
+        + queueChangedEntries(rebaseHotArray(dev_lights, front, back),
+            rebaseHotArray(dev_lights, front, hst_sceneEdits), uploadedArrays.lights, scene->lights)
+        + queueChangedEntries(rebaseHotArray(dev_lightNodes, front, back),
+            rebaseHotArray(dev_lightNodes, front, hst_sceneEdits), uploadedArrays.lightNodes, scene->lightNodes)
+        + queueChangedEntries(rebaseHotArray(dev_materials, front, back),
+            rebaseHotArray(dev_materials, front, hst_sceneEdits), uploadedArrays.materials, scene->materials)
+        + queueChangedEntries(rebaseHotArray(dev_bvhNodes, front, back),
+            rebaseHotArray(dev_bvhNodes, front, hst_sceneEdits), uploadedArrays.bvhNodes, scene->bvhNodes);
+    cudaEventRecord(sceneEditsReady, sceneEditStream);
+    sceneSwapPending = true;
+    keepUploadedArrays(scene);
+    sceneMaterialFeatures = materialFeatures(scene);
+    checkCUDAError("queueSceneEdits");
+    return copied;
+}
+
+/**
+ * At an iteration boundary: makes queued edits the front copy for the
+ * launches queued from now on, and queues their copies to the other GPUs.
+ * Launches already queued read the old front to the end, and the next
+ * edits wait for them before writing it.
+ */
+static void swapSceneBuffers() {
+    if (!sceneSwapPending) {
+        return;
+    }
+    sceneSwapPending = false;
+    cudaStreamWaitEvent(0, sceneEditsReady, 0);
+    const char *front = sceneHotFront;
+    char *back = sceneHotBack();
+    dev_geoms = rebaseHotArray(dev_geoms, front, back);
+    dev_bvhNodes = rebaseHotArray(dev_bvhNodes, front, back);
+    dev_bvhGeomIndices = rebaseHotArray(dev_bvhGeomIndices, front, back);
+    dev_materials = rebaseHotArray(dev_materials, front, back);
+    dev_meshes = rebaseHotArray(dev_meshes, front, back);
+    dev_sphereClouds = rebaseHotArray(dev_sphereClouds, front, back);
+    dev_sdfVolumes = rebaseHotArray(dev_sdfVolumes, front, back);
+    dev_media = rebaseHotArray(dev_media, front, back);
+    dev_lights = rebaseHotArray(dev_lights, front, back);
+    dev_lightNodes = rebaseHotArray(dev_lightNodes, front, back);
+    sceneHotFront = back;
+    cudaEventRecord(sceneBackReleased, 0);
+    // A graph holds the old addresses, and the L2 window the old range
+    destroyGraph();
+    if (primaryL2Policy.accessPolicyWindow.num_bytes > 0) {
+        primaryL2Policy.accessPolicyWindow.base_ptr = sceneHotFront;
+        cudaStreamSetAttribute(0, cudaStreamAttributeAccessPolicyWindow, &primaryL2Policy);
+        if (graphCaptureStream != NULL) {
+            cudaStreamSetAttribute(graphCaptureStream, cudaStreamAttributeAccessPolicyWindow, &primaryL2Policy);
+        }
+        cudaGetLastError();
+    }
+
+    const Scene *scene = hst_scene;
+    for (size_t i = 0; i < traceDevices.size(); i++) {
+        TraceDevice &td = traceDevices[i];
+        cudaSetDevice(td.device);
+        cudaStreamWaitEvent(td.stream, sceneEditsReady, 0);
+        cudaMemcpyPeerAsync(td.geoms, td.device, dev_geoms, primaryDevice,
+            scene->deviceGeoms.size() * sizeof(DeviceGeom), td.stream);
+        cudaMemcpyPeerAsync(td.bvhNodes, td.device, dev_bvhNodes, primaryDevice,
+            scene->bvhNodes.size() * sizeof(BVHNode), td.stream);
+        cudaMemcpyPeerAsync(td.lights, td.device, dev_lights, primaryDevice,
+            scene->lights.size() * sizeof(Light), td.stream);
+        cudaMemcpyPeerAsync(td.lightNodes, td.device, dev_lightNodes, primaryDevice,
+            scene->lightNodes.size() * sizeof(LightNode), td.stream);
+        cudaMemcpyPeerAsync(td.materials, td.device, dev_materials, primaryDevice,
+            scene->materials.size() * sizeof(Material), td.stream);
+        cudaEventRecord(td.sceneRead, td.stream);
+    }
+    cudaSetDevice(primaryDevice);
+    checkCUDAError("swapSceneBuffers");
+}
+
+// Drops the back copy, once queued edits have been swapped in or are no longer wanted
+static void freeSceneEdits() {
+    if (dev_sceneBack == NULL) {
+        return;
+    }
+    cudaStreamSynchronize(sceneEditStream);
+    deviceMemory::release(dev_sceneBack);
+    cudaFreeHost(hst_sceneEdits);
+    cudaStreamDestroy(sceneEditStream);
+    cudaEventDestroy(sceneEditsReady);
+    cudaEventDestroy(sceneBackReleased);
+    dev_sceneBack = NULL;
+    hst_sceneEdits = NULL;
+    sceneEditStream = NULL;
+    sceneEditsReady = NULL;
+    sceneBackReleased = NULL;
+    sceneSwapPending = false;
+}
+
+// Waits until no kernel or copy on any GPU can still read the scene arrays
+static void waitForSceneReaders() {
+    swapSceneBuffers();
+    waitForDisplay();
+    cudaDeviceSynchronize();
+    for (size_t i = 0; i < traceDevices.size(); i++) {
+        cudaSetDevice(traceDevices[i].device);
+        cudaStreamSynchronize(traceDevices[i].stream);
+    }
+    cudaSetDevice(primaryDevice);
+}
+
+// Replaces every GPU's scene arrays with a fresh upload of `scene`
+static void reuploadScene(const Scene *scene) {
+    releaseSceneBuffers(dev_sceneData, dev_sceneGeometry, sceneGeometryPaging);
+    freeTextures();
+    bindSceneBuffers(scene, uploadScene(scene));
+    environmentTexture = uploadTextures(scene, dev_sdfVolumes, dev_media);
+    keepUploadedArrays(scene);
+    for (size_t i = 0; i < traceDevices.size(); i++) {
+        TraceDevice &td = traceDevices[i];
+        cudaSetDevice(td.device);
+        releaseSceneBuffers(td.sceneData, td.sceneGeometry, td.geometryPaging);
+        bindTraceDeviceScene(td, uploadScene(scene));
+        td.environmentTexture = uploadTextures(scene, td.sdfVolumes, td.media);
+    }
+    cudaSetDevice(primaryDevice);
+    rebuildAccelerationStructures(scene);
+}
+
+/**
+ * Switches to a reloaded version of the current scene with the same
+ * camera, keeping every image and path buffer. If the reload only changed
+ * transforms, materials or emission, the BVH keeps its topology and is
+ * refit, and only the changed geoms, BVH nodes, lights and materials are
+ * copied to each GPU. Otherwise (geoms, materials or lights added or
+ * removed, meshes, textures or the environment edited) the scene is
+ * uploaded again in full. An in-place update waits for no launch where
+ * sceneEditsBuffered(), as pathtraceSceneEdited's edits do.
+ * The caller resets accumulation and owns both scenes.
+ *
+ * @return whether the update was incremental.
+ */
+bool pathtraceUpdateScene(Scene *scene) {
+    const Scene *previous = hst_scene;
+    const bool incremental = scene->geoms.size() == previous->geoms.size()
+        && scene->materials.size() == previous->materials.size()
+        && scene->lights.size() == previous->lights.size()
+        && sameEntries(scene->meshes, previous->meshes)
+        && sameEntries(scene->meshBvhNodes, previous->meshBvhNodes)
+        && sameEntries(scene->meshWideNodes, previous->meshWideNodes)
+        && sameEntries(scene->meshTriangles, previous->meshTriangles)
+        && sameEntries(scene->meshPositions, previous->meshPositions)
+        && sameEntries(scene->meshNormals, previous->meshNormals)
+        && sameEntries(scene->meshUVs, previous->meshUVs)
+        && sameTextures(scene->textures, previous->textures)
+        && scene->environment.image.filename == previous->environment.image.filename
+        && scene->environment.image.levels == previous->environment.image.levels
+        && scene->environment.intensity == previous->environment.intensity;
+
+    if (incremental && sceneEditsBuffered()) {
+        scene->refitBVH(previous->bvhNodes, previous->bvhGeomIndices);
+        size_t copied = queueSceneEdits(scene);
+        printf("Scene updated in place: %zu geoms, BVH nodes, lights and materials changed\n", copied);
+    } else if (incremental) {
+        waitForSceneReaders();
+        scene->refitBVH(previous->bvhNodes, previous->bvhGeomIndices);
+        size_t copied = uploadSceneEdits(scene);
+        printf("Scene updated in place: %zu geoms, BVH nodes, lights and materials changed\n", copied);
+    } else {
+        waitForSceneReaders();
+        reuploadScene(scene);
+        printf("Scene uploaded again\n");
+    }
+    hst_scene = scene;
+    radianceCacheValid = false;
+    pathGuideValid = false;
+    photonMapValid = false;
+    reservoirsValid = false;
+
+    checkCUDAError("pathtraceUpdateScene");
+    return incremental;
+}
+
+/**
+ * Copies host-side edits of hst_scene's geoms, top-level BVH nodes, lights
+ * and materials to every GPU, for instance after Scene::moveGeom or a
+ * material change followed by Scene::rebuildLights. Only the changed
+ * entries are copied, unless the number of lights changed, which needs a
+ * full re-upload. Where sceneEditsBuffered(), the primary's copies go to
+ * the back copy of its arrays and take effect at the next pathtrace(), so
+ * the render never stops for them. The caller resets accumulation.
+ */
+void pathtraceSceneEdited() {
+    if (hst_scene->lights.size() != uploadedArrays.lights.size()) {
+        waitForSceneReaders();
+        reuploadScene(hst_scene);
+    } else if (sceneEditsBuffered()) {
+        queueSceneEdits(hst_scene);
+    } else {
+        waitForSceneReaders();
+        uploadSceneEdits(hst_scene);
+    }
+    radianceCacheValid = false;
+    pathGuideValid = false;
+    photonMapValid = false;
+    reservoirsValid = false;
+    checkCUDAError("pathtraceSceneEdited");
+}
+
+/**
+ * The device side of Scene::setGeomFrame: builds each moved geom's
+ * transform from its pose as utilityCore::buildTransformationMatrix does,
+ * inverts it and rewrites its DeviceGeom as buildDeviceGeom would, with
+ * finishGeom's choice of intersection test. Its material, mesh and light
+ * stay.
+ */
+__global__ void animateGeoms(int count, const GeomTransform *transforms, DeviceGeom *geoms) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index >= count) {
+        return;
+    }
+    const GeomTransform pose = transforms[index];
+    glm::mat4 rotation = glm::rotate(glm::mat4(), glm::radians(pose.rotation.x), glm::vec3(1, 0, 0));
+    rotation = rotation * glm::rotate(glm::mat4(), glm::radians(pose.rotation.y), glm::vec3(0, 1, 0));
+    rotation = rotation * glm::rotate(glm::mat4(), glm::radians(pose.rotation.z), glm::vec3(0, 0, 1));
+    const glm::mat4 transform = glm::translate(glm::mat4(), pose.translation) * rotation
+        * glm::scale(glm::mat4(), pose.scale);
+    const glm::mat4 inverseT = glm::transpose(glm::inverse(transform));
+
+    GeomType type = pose.type;
+    glm::vec3 axes[3] = { glm::vec3(transform[0]), glm::vec3(transform[1]), glm::vec3(transform[2]) };
+    if (type == CUBE) {
+        bool diagonal = true;
+        for (int a = 0; a < 3; a++) {
+            for (int b = 0; b < 3; b++) {
+                diagonal = diagonal && (a == b || fabsf(axes[a][b]) <= 1e-6f * fabsf(axes[a][a]));
+            }
+        }
+        type = diagonal ? AXIS_ALIGNED_CUBE : CUBE;
+    } else if (type == SPHERE) {
+        float length = glm::length(axes[0]);
+        if (fabsf(glm::length(axes[1]) - length) <= 1e-5f * length
+                && fabsf(glm::length(axes[2]) - length) <= 1e-5f * length) {
+            type = UNIFORM_SPHERE;
+        }
+    }
+
+    DeviceGeom &geom = geoms[pose.geom];
+    geom.inverseRows[0] = inverseT[0];
+    geom.inverseRows[1] = inverseT[1];
+    geom.inverseRows[2] = inverseT[2];
+    if (type == UNIFORM_SPHERE) {
+        geom.inverseRows[0] = glm::vec4(glm::vec3(transform[3]), 0.5f * glm::length(axes[0]));
+    }
+    geom.type = type;
+}
+
+/**
+ * Moves geoms for an animation frame to the poses Scene::setGeomFrame
+ * returned for hst_scene. Only the poses are uploaded: the primary GPU
+ * rebuilds the geoms' records from them and refits the top-level BVH to
+ * match, rebuilding it once refits have made it too costly, and the other
+ * devices get copies. The lights are copied as edits are, in case a moved
+ * geom emits, and OptiX builds its ASes again. The caller resets
+ * accumulation.
+ */
+void pathtraceAnimateGeoms(const std::vector<GeomTransform> &transforms) {
+    const Scene *scene = hst_scene;
+    const int count = (int)transforms.size();
+    if (count == 0) {
+        return;
+    }
+    waitForSceneReaders();
+    if (count > geomTransformCapacity) {
+        deviceMemory::release(dev_geomTransforms);
+        deviceMemory::allocate(&dev_geomTransforms, count * sizeof(GeomTransform));
+        geomTransformCapacity = count;
+    }
+    // The tree as built, before any geom moves
+    if (bvhBuiltCost <= 0.0f) {
+        bvhBuiltCost = boundBVHCost(scene);
+    }
+    cudaMemcpy(dev_geomTransforms, transforms.data(), count * sizeof(GeomTransform), cudaMemcpyHostToDevice);
+    animateGeoms<<<(count + 127) / 128, 128>>>(count, dev_geomTransforms, dev_geoms);
+    geomsAnimated = true;
+    tileListsBinned = false;
+    refitTopLevelBVH(scene);
+
+    uploadChangedEntries(dev_lights, uploadedArrays.lights, scene->lights);
+    uploadChangedEntries(dev_lightNodes, uploadedArrays.lightNodes, scene->lightNodes);
+    const size_t geomBytes = scene->deviceGeoms.size() * sizeof(DeviceGeom);
+    for (size_t i = 0; i < traceDevices.size(); i++) {
+        TraceDevice &td = traceDevices[i];
+        cudaMemcpyPeer(td.geoms, td.device, dev_geoms, primaryDevice, geomBytes);
+        cudaSetDevice(td.device);
+        uploadChangedEntries(td.lights, uploadedArrays.lights, scene->lights);
+        uploadChangedEntries(td.lightNodes, uploadedArrays.lightNodes, scene->lightNodes);
+    }
+    cudaSetDevice(primaryDevice);
+    // The host's records match what the GPU computed, up to rounding
+    uploadedArrays.geoms = scene->deviceGeoms;
+    uploadedArrays.lights = scene->lights;
+    uploadedArrays.lightNodes = scene->lightNodes;
+    buildHardwareAS(scene);
+
+    radianceCacheValid = false;
+    pathGuideValid = false;
+    photonMapValid = false;
+    reservoirsValid = false;
+    checkCUDAError("pathtraceAnimateGeoms");
+}
+
+void pathtraceFree() {
+    // Released buffers stay in the device pools for the next pathtraceInit
+    deviceMemory::release(dev_image);  // no-op if dev_image is null
+    deviceMemory::release(dev_moments);
+    deviceMemory::release(dev_converged);
+  	freePathBuffers();
+  	deviceMemory::release(dev_queueCounters);
+  	deviceMemory::release(dev_pathQueue);
+  	deviceMemory::release(dev_cooperativeLive);
+  	deviceMemory::release(dev_rayCounts);
+  	dev_rayCounts = NULL;
+  	destroyGraph();
+  	if (graphCaptureStream != NULL) {
+  		cudaStreamDestroy(graphCaptureStream);
+  		graphCaptureStream = NULL;
+  	}
+  	StreamCompaction::Efficient::freeScratch();
+  	freeGeometryResidency();
+  	if (pagingStream != NULL) {
+  		cudaStreamDestroy(pagingStream);
+  		cudaEventDestroy(geomHitsCopied);
+  		pagingStream = NULL;
+  		geomHitsCopied = NULL;
+  	}
+  	freeSceneEdits();
+  	releaseSceneBuffers(dev_sceneData, dev_sceneGeometry, sceneGeometryPaging);
+  	dev_sceneGeometry = NULL;
+  	sceneGeometryPaging = GEOMETRY_RESIDENT;
+  	deviceMemory::release(dev_lbvhNodes);
+  	deviceMemory::release(dev_lbvhGeomIndices);
+  	dev_lbvhNodes = NULL;
+  	dev_lbvhGeomIndices = NULL;
+  	lbvhCapacity = 0;
+  	deviceMemory::release(dev_geomTransforms);
+  	dev_geomTransforms = NULL;
+  	geomTransformCapacity = 0;
+  	geomsAnimated = false;
+  	LBVH::freeScratch();
+  	TileCulling::freeScratch();
+  	tileListsBinned = false;
+  	tileListsValid = false;
+  	OptixBackend::release();
+  	freeTextures();
+  	firstBounceCached = false;
+  	deviceMemory::release(radianceCache.keys);
+  	deviceMemory::release(radianceCache.cells);
+  	radianceCache = RadianceCache();
+  	radianceCacheValid = false;
+  	deviceMemory::release(pathGuide.keys);
+  	deviceMemory::release(dev_guideTraining);
+  	deviceMemory::release(dev_guideDistributions);
+  	pathGuide = PathGuide();
+  	dev_guideTraining = NULL;
+  	dev_guideDistributions = NULL;
+  	pathGuideValid = false;
+  	deviceMemory::release(dev_photonPositions);
+  	deviceMemory::release(dev_photonPower);
+  	deviceMemory::release(dev_photonCellStart);
+  	deviceMemory::release(dev_photonCellEnd);
+  	deviceMemory::release(dev_photonCount);
+  	dev_photonPositions = NULL;
+  	dev_photonPower = NULL;
+  	dev_photonCellStart = NULL;
+  	dev_photonCellEnd = NULL;
+  	dev_photonCount = NULL;
+  	photonGrid = PhotonGrid();
+  	photonMapValid = false;
+  	deviceMemory::release(dev_bdptVertices);
+  	deviceMemory::release(dev_bdptVertexCounts);
+  	deviceMemory::release(dev_bdptCameraPaths);
+  	deviceMemory::release(dev_bdptQueue);
+  	deviceMemory::release(dev_bdptQueueCount);
+  	deviceMemory::release(dev_bdptRays);
+  	deviceMemory::release(dev_bdptSample);
+  	dev_bdptVertices = NULL;
+  	dev_bdptVertexCounts = NULL;
+  	dev_bdptCameraPaths = NULL;
+  	dev_bdptQueue = NULL;
+  	dev_bdptQueueCount = NULL;
+  	dev_bdptRays = NULL;
+  	dev_bdptSample = NULL;
+  	bdptBandCapacity = 0;
+  	bdptQueueCapacity = 0;
+  	bdptSamplePixels = 0;
+  	deviceMemory::release(dev_reservoirs);
+  	deviceMemory::release(dev_reservoirScratch);
+  	dev_reservoirs = NULL;
+  	dev_reservoirScratch = NULL;
+  	reservoirGBuffer = NULL;
+  	reservoirsValid = false;
+  	StreamCompaction::Radix::freeScratch();
+    deviceMemory::release(dev_gBuffer);
+    deviceMemory::release(dev_rasterHits);
+    dev_rasterHits = NULL;
+    rasterHitsValid = false;
+    deviceMemory::release(dev_prevGBuffer);
+    deviceMemory::release(dev_temporal);
+    deviceMemory::release(dev_temporalLength);
+    deviceMemory::release(dev_history);
+    deviceMemory::release(dev_historyLength);
+    deviceMemory::release(dev_denoiseStaging);
+    denoiserDestroy(denoiser);
+    denoiser = NULL;
+    deviceMemory::release(dev_denoiserScratch);
+    cudaFreeHost(hst_pinnedImage);
+    deviceMemory::release(dev_readback);
+    cudaFreeHost(hst_readback);
+    dev_readback = NULL;
+    hst_readback = NULL;
+    if (readbackStream != NULL) {
+        cudaStreamDestroy(readbackStream);
+        cudaEventDestroy(readbackReady);
+        cudaEventDestroy(readbackDone);
+        readbackStream = NULL;
+    }
+    deviceMemory::release(dev_checkpointImage);
+    deviceMemory::release(dev_checkpointMoments);
+    deviceMemory::release(dev_checkpointGBuffer);
+    cudaFreeHost(hst_checkpointGBuffer);
+    dev_checkpointImage = NULL;
+    dev_checkpointMoments = NULL;
+    dev_checkpointGBuffer = NULL;
+    hst_checkpointGBuffer = NULL;
+    accumulationCodec::release();
+    denoiserDestroy(regionDenoiser);
+    deviceMemory::release(dev_regionScratch);
+    deviceMemory::release(dev_regionColor);
+    deviceMemory::release(dev_regionGBuffer);
+    deviceMemory::release(dev_regionMoments);
+    deviceMemory::release(dev_regionLengths);
+    deviceMemory::release(dev_regionDenoised);
+    regionDenoiser = NULL;
+    dev_regionScratch = NULL;
+    dev_regionColor = NULL;
+    dev_regionGBuffer = NULL;
+    dev_regionMoments = NULL;
+    dev_regionLengths = NULL;
+    dev_regionDenoised = NULL;
+    regionScratchBytes = 0;
+    denoiserDestroy(batchDenoiser);
+    deviceMemory::release(dev_batchColor);
+    deviceMemory::release(dev_batchGBuffer);
+    deviceMemory::release(dev_batchMoments);
+    deviceMemory::release(dev_batchSamples);
+    deviceMemory::release(dev_batchDenoised);
+    batchDenoiser = NULL;
+    batchDenoiserImages = 0;
+    dev_batchColor = NULL;
+    dev_batchGBuffer = NULL;
+    dev_batchMoments = NULL;
+    dev_batchSamples = NULL;
+    dev_batchDenoised = NULL;
+    batchResolution = glm::ivec2(0);
+    batchCapacity = 0;
+    batchCameras.clear();
+    deviceMemory::release(dev_rayCost);
+    deviceMemory::release(dev_rayCostMax);
+    dev_rayCost = NULL;
+    dev_rayCostMax = NULL;
+    deviceMemory::release(dev_specular);
+    deviceMemory::release(dev_specularGBuffer);
+    deviceMemory::release(dev_diffuseColor);
+    deviceMemory::release(dev_specularDenoised);
+    deviceMemory::release(dev_splitDenoised);
+    dev_specular = NULL;
+    dev_specularGBuffer = NULL;
+    dev_diffuseColor = NULL;
+    dev_specularDenoised = NULL;
+    dev_splitDenoised = NULL;
+    specularValid = false;
+    deviceMemory::release(dev_taaHistory);
+    deviceMemory::release(dev_taaResolved);
+    dev_taaHistory = NULL;
+    dev_taaResolved = NULL;
+    taaValid = false;
+    taaReproject = false;
+    deviceMemory::release(dev_stopLuminance);
+    deviceMemory::release(dev_stopSum);
+    dev_stopLuminance = NULL;
+    dev_stopSum = NULL;
+    stopLuminanceValid = false;
+    regionCapacity = 0;
+    regionDenoiserSize = glm::ivec2(0);
+    if (checkpointStream != NULL) {
+        cudaStreamDestroy(checkpointStream);
+        cudaEventDestroy(checkpointReady);
+        cudaEventDestroy(checkpointDone);
+        checkpointStream = NULL;
+    }
+    for (int slot = 0; slot < TIMER_COUNT; slot++) {
+        cudaEventDestroy(timerEvents[slot][0]);
+        cudaEventDestroy(timerEvents[slot][1]);
+    }
+    cudaStreamDestroy(displayStream);
+    cudaEventDestroy(traceQueued);
+    cudaEventDestroy(displayDone);
+    displayStream = NULL;
+    freeTraceDevices();
+    uploadedArrays = EditableSceneArrays();
+    // TODO: clean up any extra device memory you created
+
+    checkCUDAError("pathtraceFree");
+}
+
+/**
+ * Cooperatively copies `count` elements of `src` into `shared` and returns
+ * the shared copy, or returns `src` itself when `shared` is NULL. Every
+ * thread of the block must reach this, so call it before any early exit.
+ */
+template <typename T>
+__device__ const T * stageToShared(const T * src, int count, T * shared)
+{
+	if (shared == NULL) {
+		return src;
+	}
+	const int words = count * sizeof(T) / sizeof(int);
+	const int * srcWords = reinterpret_cast<const int *>(src);
+	int * sharedWords = reinterpret_cast<int *>(shared);
+	for (int w = threadIdx.x; w < words; w += blockDim.x) {
+		sharedWords[w] = srcWords[w];
+	}
+	__syncthreads();
+	return shared;
+}
+
+/**
+ * Maps a uniform square sample onto the unit disk with Shirley and Chiu's
+ * concentric mapping, which keeps the sampler's strata compact.
+ */
+__host__ __device__ inline glm::vec2 concentricDiskSample(float u1, float u2)
+{
+	float a = 2.0f * u1 - 1.0f;
+	float b = 2.0f * u2 - 1.0f;
+	if (a == 0.0f && b == 0.0f) {
+		return glm::vec2(0.0f);
+	}
+	float r, phi;
+	if (fabsf(a) > fabsf(b)) {
+		r = a;
+		phi = (PI / 4.0f) * (b / a);
+	} else {
+		r = b;
+		phi = (PI / 2.0f) - (PI / 4.0f) * (a / b);
+	}
+	return r * glm::vec2(cosf(phi), sinf(phi));
+}
+
+/**
+ * Stereo: row `row` of the stacked image lies in view row / its height.
+ * Moves `cam` to that view's eye, as RenderState::viewCamera does, and
+ * returns the row within the view; with no eyeSeparation it is unchanged.
+ * Both eyes draw the same jitter and lens samples for a pixel.
+ */
+__host__ __device__ inline int viewRow(Camera & cam, float eyeSeparation, int row)
+{
+	if (eyeSeparation > 0.0f) {
+		const int view = row / cam.resolution.y;
+		cam.position += cam.right * (eyeSeparation * (view - 0.5f));
+		row -= view * cam.resolution.y;
+	}
+	return row;
+}
+
+// Pixel tiles of PathtraceOptions::tiledPathOrder: a 128-thread block
+// covers four of them, so its warps each trace one 8x4 patch of the image
+#define PATH_TILE_WIDTH 8
+#define PATH_TILE_HEIGHT 4
+
+/**
+ * The slot, among a sample's columns * rows, of band pixel (column, y):
+ * row-major, or with `tiled` in PATH_TILE_WIDTH x PATH_TILE_HEIGHT tiles,
+ * each row-major inside, along strips of PATH_TILE_HEIGHT rows. Tiles on
+ * the band's right and bottom edges are cut to fit, so the slots stay
+ * dense.
+ */
+__host__ __device__ inline int pathSlot(int column, int y, int columns, int rows, bool tiled)
+{
+	if (!tiled) {
+		return column + y * columns;
+	}
+	const int strip = y - y % PATH_TILE_HEIGHT;
+	const int height = glm::min(PATH_TILE_HEIGHT, rows - strip);
+	const int tile = column - column % PATH_TILE_WIDTH;
+	const int width = glm::min(PATH_TILE_WIDTH, columns - tile);
+	return strip * columns + tile * height + (y - strip) * width + (column - tile);
+}
+
+// The band pixel (column, y) in slot `slot` of a sample's, inverting pathSlot
+__host__ __device__ inline glm::ivec2 pathPixel(int slot, int columns, int rows, bool tiled)
+{
+	if (!tiled) {
+		return glm::ivec2(slot % columns, slot / columns);
+	}
+	const int strip = slot / (PATH_TILE_HEIGHT * columns) * PATH_TILE_HEIGHT;
+	const int height = glm::min(PATH_TILE_HEIGHT, rows - strip);
+	const int inStrip = slot - strip * columns;
+	const int tile = inStrip / (PATH_TILE_WIDTH * height) * PATH_TILE_WIDTH;
+	const int width = glm::min(PATH_TILE_WIDTH, columns - tile);
+	const int inTile = inStrip - tile * height;
+	return glm::ivec2(tile + inTile % width, strip + inTile / width);
+}
+
+/**
+ * Points segment.ray through image pixel (x, y) for sample
+ * segment.sampleIndex, from the pixel's centre ray `centreDirection`: see
+ * generateRayFromCamera.
+ */
+template <bool THIN_LENS, bool MOTION_BLUR>
+__host__ __device__ void cameraSample(const Camera & cam, int traceDepth, int x, int y,
+	glm::vec3 centreDirection, bool jitter, int sampler, PathSegment & segment)
+{
+	segment.ray.origin = cam.position;
+	segment.ray.direction = centreDirection;
+	// A pixel's cone, from a point at the eye (or on the lens)
+	segment.ray.coneWidth = 0.0f;
+	segment.ray.coneSpread = cam.pixelLength.y;
+	// Antialiasing: a box-filtered offset within the pixel, drawn from
+	// the dimensions of bounce traceDepth, which shading never reaches
+	if (jitter || THIN_LENS || MOTION_BLUR) {
+		int pixel = x + y * cam.resolution.x;
+		Sampler rng = makeSampler(sampler, makeSeededRandomEngine(segment.sampleIndex, pixel, traceDepth),
+			pixel, segment.sampleIndex, traceDepth);
+		glm::vec3 direction = centreDirection;
+		if (jitter) {
+			float jx = nextSample(rng) - 0.5f;
+			float jy = nextSample(rng) - 0.5f;
+			direction = cameraRayDirection(cam, x + jx, y + jy);
+		}
+		// The lens takes the bounce's second pair of dimensions and the
+		// shutter the one after, with or without jitter
+		const int lensDimension = traceDepth * SAMPLER_BOUNCE_DIMENSIONS + 2;
+		glm::vec3 origin = cam.position;
+		if (MOTION_BLUR) {
+			rng.dimension = lensDimension + 2;
+			origin += nextSample(rng) * cam.motion;
+		}
+		if (THIN_LENS) {
+			rng.dimension = lensDimension;
+			float u1 = nextSample(rng);
+			float u2 = nextSample(rng);
+			glm::vec2 lens = cam.lensRadius * concentricDiskSample(u1, u2);
+			glm::vec3 focus = origin + direction * (cam.focalDistance / glm::dot(direction, cam.view));
+			origin += cam.right * lens.x + cam.up * lens.y;
+			direction = glm::normalize(focus - origin);
+		}
+		segment.ray.origin = origin;
+		segment.ray.direction = direction;
+	}
+}
+
+/**
+* Generate PathSegments with rays from the camera through the screen into the
+* scene, which is the first bounce of rays.
+*
+* Antialiasing - add rays for sub-pixel sampling
+* motion blur - jitter rays "in time": MOTION_BLUR moves the origin along
+*   cam.motion by a shutter time in [0, 1)
+* lens effect - jitter ray origin positions based on a lens: THIN_LENS
+*   moves it across a disk of cam.lensRadius, aiming at the ray's point on
+*   the plane cam.focalDistance along the view
+*
+* With both off this is the pinhole camera; launchCameraRays picks the
+* instance, so a pinhole pays nothing for either.
+*
+* Only columns firstColumn .. firstColumn + columns - 1 get paths, packed
+* into columns * rows slots per sample in pathSlot's order, so a region
+* traces no more paths than it has pixels. With a `stride` above 1 the
+* columns and rows are those of the lattice of every stride-th pixel each
+* way, see PathtraceOptions::pixelStride. Rows are of the stacked image,
+* whose views the eyeSeparation sets apart, see viewRow.
+*/
+template <bool THIN_LENS, bool MOTION_BLUR>
+__global__ void generateRayFromCamera(Camera cam, float eyeSeparation, int traceDepth, int firstRow,
+	int rows, int firstColumn, int columns, int stride, int firstSample, int samples, bool jitter,
+	int sampler, bool tiled, PathSegments pathSegments)
+{
+	int column = (blockIdx.x * blockDim.x) + threadIdx.x;
+	int latticeRow = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+	if (column < columns && latticeRow < rows) {
+		// Pixel indices are relative to the band's first row
+		int x = firstColumn + column * stride;
+		int y = latticeRow * stride;
+		int index = x + (y * cam.resolution.x);
+		int slot = pathSlot(column, latticeRow, columns, rows, tiled);
+		PathSegment segment;
+
+    segment.color = glm::vec3(1.0f, 1.0f, 1.0f);
+		segment.radiance = glm::vec3(0.0f);
+		segment.scatterPdf = 0.0f;
+		segment.specularPath = false;
+
+		const int row = viewRow(cam, eyeSeparation, firstRow + y);
+		const glm::vec3 centreDirection = cameraRayDirection(cam, (float)x, (float)row);
+
+		segment.pixelIndex = index;
+		segment.remainingBounces = traceDepth;
+		// Each sample gets its own slot; its random numbers are keyed on
+		// the image pixel and sample number alone
+		const int pixelcount = columns * rows;
+		for (int s = 0; s < samples; s++) {
+			segment.sampleIndex = firstSample + s;
+			cameraSample<THIN_LENS, MOTION_BLUR>(cam, traceDepth, x, row, centreDirection,
+				jitter, sampler, segment);
+			storePathSegment(pathSegments, slot + s * pixelcount, segment);
+		}
+	}
+}
+
+/**
+ * Path regeneration: camera paths for `count` more of a band's jobs from
+ * job firstJob on, into the slots from firstSlot that compaction freed.
+ * Job j is the path generateRayFromCamera would put in slot j, sample
+ * firstSample + j / (columns * rows) of the pixel in slot j % (columns * rows).
+ */
+template <bool THIN_LENS, bool MOTION_BLUR>
+__global__ void kernRegenerateCameraPaths(int count, int firstJob, int firstSlot, Camera cam,
+	float eyeSeparation, int traceDepth, int firstRow, int rows, int firstColumn, int columns, int firstSample, bool jitter,
+	int sampler, bool tiled, PathSegments pathSegments)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < count) {
+		const int job = firstJob + index;
+		const int pixelcount = columns * rows;
+		const glm::ivec2 local = pathPixel(job % pixelcount, columns, rows, tiled);
+		const int x = firstColumn + local.x;
+		const int y = local.y;
+		PathSegment segment;
+		segment.color = glm::vec3(1.0f, 1.0f, 1.0f);
+		segment.radiance = glm::vec3(0.0f);
+		segment.scatterPdf = 0.0f;
+		segment.specularPath = false;
+		segment.pixelIndex = x + y * cam.resolution.x;
+		segment.remainingBounces = traceDepth;
+		segment.sampleIndex = firstSample + job / pixelcount;
+		const int row = viewRow(cam, eyeSeparation, firstRow + y);
+		cameraSample<THIN_LENS, MOTION_BLUR>(cam, traceDepth, x, row,
+			cameraRayDirection(cam, (float)x, (float)row), jitter, sampler, segment);
+		storePathSegment(pathSegments, firstSlot + index, segment);
+	}
+}
+
+// Whether camera rays leave from anywhere but cam.position
+static bool cameraBlurs(const Camera &cam) {
+	return cam.lensRadius > 0.0f || cam.motion != glm::vec3(0.0f);
+}
+
+// Launches the kernRegenerateCameraPaths instance for the camera's lens and motion
+static void launchRegeneratedRays(int count, int firstJob, int firstSlot, const Camera &cam,
+	float eyeSeparation, int traceDepth, int firstRow, int rows, int firstColumn, int columns,
+	int firstSample, bool jitter, int sampler, bool tiled, PathSegments pathSegments)
+{
+	const bool thinLens = cam.lensRadius > 0.0f;
+	const bool motionBlur = cam.motion != glm::vec3(0.0f);
+	const int blockSize = 128;
+	const dim3 blocks = (count + blockSize - 1) / blockSize;
+	if (thinLens && motionBlur) {
+		kernRegenerateCameraPaths<true, true><<<blocks, blockSize>>>(count, firstJob, firstSlot, cam,
+			eyeSeparation, traceDepth, firstRow, rows, firstColumn, columns, firstSample, jitter, sampler,
+			tiled, pathSegments);
+	} else if (thinLens) {
+		kernRegenerateCameraPaths<true, false><<<blocks, blockSize>>>(count, firstJob, firstSlot, cam,
+			eyeSeparation, traceDepth, firstRow, rows, firstColumn, columns, firstSample, jitter, sampler,
+			tiled, pathSegments);
+	} else if (motionBlur) {
+		kernRegenerateCameraPaths<false, true><<<blocks, blockSize>>>(count, firstJob, firstSlot, cam,
+			eyeSeparation, traceDepth, firstRow, rows, firstColumn, columns, firstSample, jitter, sampler,
+			tiled, pathSegments);
+	} else {
+		kernRegenerateCameraPaths<false, false><<<blocks, blockSize>>>(count, firstJob, firstSlot, cam,
+			eyeSeparation, traceDepth, firstRow, rows, firstColumn, columns, firstSample, jitter, sampler,
+			tiled, pathSegments);
+	}
+}
+
+// Launches the generateRayFromCamera instance for the camera's lens and motion
+static void launchCameraRays(dim3 blocks, dim3 threads, cudaStream_t stream, const Camera &cam,
+	float eyeSeparation, int traceDepth, int firstRow, int rows, int firstColumn, int columns, int stride,
+	int firstSample, int samples, bool jitter, int sampler, bool tiled, PathSegments pathSegments)
+{
+	const bool thinLens = cam.lensRadius > 0.0f;
+	const bool motionBlur = cam.motion != glm::vec3(0.0f);
+	if (thinLens && motionBlur) {
+		generateRayFromCamera<true, true><<<blocks, threads, 0, stream>>>(cam, eyeSeparation,
+			traceDepth, firstRow, rows, firstColumn, columns, stride, firstSample, samples, jitter, sampler,
+			tiled, pathSegments);
+	} else if (thinLens) {
+		generateRayFromCamera<true, false><<<blocks, threads, 0, stream>>>(cam, eyeSeparation,
+			traceDepth, firstRow, rows, firstColumn, columns, stride, firstSample, samples, jitter, sampler,
+			tiled, pathSegments);
+	} else if (motionBlur) {
+		generateRayFromCamera<false, true><<<blocks, threads, 0, stream>>>(cam, eyeSeparation,
+			traceDepth, firstRow, rows, firstColumn, columns, stride, firstSample, samples, jitter, sampler,
+			tiled, pathSegments);
+	} else {
+		generateRayFromCamera<false, false><<<blocks, threads, 0, stream>>>(cam, eyeSeparation,
+			traceDepth, firstRow, rows, firstColumn, columns, stride, firstSample, samples, jitter, sampler,
+			tiled, pathSegments);
+	}
+}
+
+/**
+ * Filtered lookup of texture `map` at a hit seen along `direction`, or
+ * false if the map is not on the device, and always on the host, whose
+ * CPU renderer does not filter textures. The mip level follows a ray cone
+ * of one pixel's spread over the hit distance, widened by the incidence
+ * angle; past the first bounce that distance is only the segment's own,
+ * so secondary hits sample sharper mips than a full cone would choose.
+ */
+__host__ __device__ bool sampleTexture(int map, const ShadeableIntersection & intersection, glm::vec3 direction,
+	glm::vec4 & value)
+{
+#ifdef __CUDA_ARCH__
+	const DeviceTexture texture = c_textures[map];
+	if (texture.object == 0) {
+		return false;
+	}
+	float cosine = fmaxf(fabsf(glm::dot(intersection.surfaceNormal, direction)), 0.05f);
+	float texels = c_pixelSpread * intersection.t / cosine * intersection.uvDensity * texture.size;
+	float lod = texels > 1.0f ? log2f(texels) : 0.0f;
+	// Images are stored top row first, uv has v up
+	float4 texel = texture.levels > 0
+		? sampleVirtualTexture(c_virtualTextures, texture, intersection.uv.x, 1.0f - intersection.uv.y, lod)
+		: tex2DLod<float4>(texture.object, intersection.uv.x, 1.0f - intersection.uv.y, lod);
+	value = glm::vec4(texel.x, texel.y, texel.z, texel.w);
+	return true;
+#else
+	return false;
+#endif
+}
+
+// The material's colour under its albedo map
+__host__ __device__ glm::vec3 texturedColor(const Material & material, const ShadeableIntersection & intersection,
+	glm::vec3 direction)
+{
+	glm::vec4 albedo;
+	if (material.albedoMap >= 0 && sampleTexture(material.albedoMap, intersection, direction, albedo)) {
+		return material.color * glm::vec3(albedo);
+	}
+	return material.color;
+}
+
+/**
+ * Applies the material's texture maps at a hit: the albedo map to its
+ * colour, the roughness map to its specular exponent (a Beckmann-like
+ * 2 / r^2 - 2, mirror-sharp at zero) and the tangent-space normal map to
+ * `normal`, unless the mapped normal would face away from the ray.
+ */
+__host__ __device__ void applyTextureMaps(const ShadeableIntersection & intersection, glm::vec3 direction,
+	Material & material, glm::vec3 & normal)
+{
+	material.color = texturedColor(material, intersection, direction);
+	glm::vec4 texel;
+	if (material.roughnessMap >= 0 && sampleTexture(material.roughnessMap, intersection, direction, texel)) {
+		float roughness = texel.x;
+		material.specular.exponent = roughness < 1e-3f ? 0.0f : fmaxf(2.0f / (roughness * roughness) - 2.0f, 1.0f);
+	}
+	if (material.normalMap >= 0 && sampleTexture(material.normalMap, intersection, direction, texel)) {
+		glm::vec3 t = intersection.tangent;
+		glm::vec3 b = intersection.bitangentSign * glm::cross(normal, t);
+		glm::vec3 m = glm::vec3(texel) * 2.0f - 1.0f;
+		glm::vec3 mapped = m.x * t + m.y * b + m.z * normal;
+		if (glm::dot(mapped, mapped) > 0.0f && glm::dot(mapped, direction) < 0.0f) {
+			normal = glm::normalize(mapped);
+		}
+	}
+}
+
+// Stores a hit, with its texturing half only when its material has maps
+__device__ void storeHit(const ShadeableIntersections & intersections, int index,
+	const ShadeableIntersection & intersection, const Material * materials)
+{
+	if (intersection.t > 0.0f)
+	{
+		storeIntersection(intersections, index, intersection.t, intersection.materialId,
+			intersection.surfaceNormal, intersection.geomIndex, intersection.frontFace);
+		if (hasTextureMaps(materials[intersection.materialId]))
+		{
+			storeIntersectionSurface(intersections, index, intersection);
+		}
+	}
+	else
+	{
+		storeIntersectionMiss(intersections, index);
+	}
+}
+
+__device__ ShadeableIntersection loadHit(const ShadeableIntersections & intersections, int index,
+	const Material * materials)
+{
+	ShadeableIntersection intersection = loadIntersection(intersections, index);
+	if (intersection.t > 0.0f && hasTextureMaps(materials[intersection.materialId]))
+	{
+		loadIntersectionSurface(intersections, index, intersection);
+	}
+	return intersection;
+}
+
+__host__ __device__ ShadeableIntersection resolveHit(const Ray & ray, float t, int hit_geom_index,
+	const MeshHit & mesh_hit, const DeviceGeom * geoms, const MeshData & meshData,
+	const Material * materials);
+
+// A hit stored by computeHitRecords, resolved against the ray that made it
+__device__ ShadeableIntersection loadHitRecord(const ShadeableIntersections & intersections, int index,
+	const Ray & ray, const DeviceGeom * geoms, const MeshData & meshData, const Material * materials)
+{
+	float2 tMaterial = intersections.tMaterial[index];
+	if (!(tMaterial.x > 0.0f))
+	{
+		return loadIntersection(intersections, index);
+	}
+	MeshHit mesh_hit;
+	loadHitRecordTriangle(intersections, index, mesh_hit.triangle, mesh_hit.u, mesh_hit.v);
+	return resolveHit(ray, tMaterial.x, __float_as_int(tMaterial.y), mesh_hit, geoms, meshData, materials);
+}
+
+/**
+ * Closest-hit tests over the run of TYPE geoms at leaf entries j ..
+ * end - 1, stopping at the first of another type; returns the entry after
+ * the run. Every thread of a warp in the run executes the same test.
+ */
+template <int TYPE>
+__host__ __device__ int closestInRun(int j, int end, const int * bvhGeomIndices, const DeviceGeom * geoms,
+	const Ray & ray, const MeshData & meshData, float & t_min, int & hit_geom_index, MeshHit & mesh_hit)
+{
+	MeshHit tmp_mesh_hit;
+	for (; j < end; j++)
+	{
+		int i = bvhGeomIndices[j];
+		const DeviceGeom & geom = geoms[i];
+		if (geom.type != TYPE)
+		{
+			break;
+		}
+		float t = geomIntersectionTest<TYPE>(geom, ray, meshData, t_min, tmp_mesh_hit);
+
+		// Compute the minimum t from the intersection tests to determine what
+		// scene geometry object was hit first.
+		if (t > 0.0f && t_min > t)
+		{
+			t_min = t;
+			hit_geom_index = i;
+			mesh_hit = tmp_mesh_hit;
+		}
+	}
+	return j;
+}
+
+// Shadow-ray version of closestInRun: sets `occluded` and returns `end` at the first hit
+template <int TYPE>
+__host__ __device__ int occludedInRun(int j, int end, const int * bvhGeomIndices, const DeviceGeom * geoms,
+	const Ray & ray, const MeshData & meshData, float tMax, bool & occluded)
+{
+	MeshHit mesh_hit;
+	for (; j < end; j++)
+	{
+		const DeviceGeom & geom = geoms[bvhGeomIndices[j]];
+		if (geom.type != TYPE)
+		{
+			break;
+		}
+		float t = geomIntersectionTest<TYPE>(geom, ray, meshData, tMax, mesh_hit);
+		if (t > 0.0f && t < tMax)
+		{
+			occluded = true;
+			return end;
+		}
+	}
+	return j;
+}
+
+/**
+ * Tests the geoms of leaf `node` against `ray`, as closestHit does.
+ * Scene::buildBVH groups each leaf's geoms by type, so the type is picked
+ * once per run rather than per geom.
+ */
+__host__ __device__ inline void closestInLeaf(
+	const BVHNode & node
+	, const int * bvhGeomIndices
+	, const DeviceGeom * geoms
+	, const Ray & ray
+	, const MeshData & meshData
+	, float & t_min
+	, int & hit_geom_index
+	, MeshHit & mesh_hit
+	)
+{
+	const int end = node.offset + node.count;
+	for (int j = node.offset; j < end; )
+	{
+		switch (geoms[bvhGeomIndices[j]].type)
+		{
+		case AXIS_ALIGNED_CUBE:
+			j = closestInRun<AXIS_ALIGNED_CUBE>(j, end, bvhGeomIndices, geoms, ray, meshData,
+				t_min, hit_geom_index, mesh_hit);
+			break;
+		case UNIFORM_SPHERE:
+			j = closestInRun<UNIFORM_SPHERE>(j, end, bvhGeomIndices, geoms, ray, meshData,
+				t_min, hit_geom_index, mesh_hit);
+			break;
+		case CUBE:
+			j = closestInRun<CUBE>(j, end, bvhGeomIndices, geoms, ray, meshData,
+				t_min, hit_geom_index, mesh_hit);
+			break;
+		case SPHERE:
+			j = closestInRun<SPHERE>(j, end, bvhGeomIndices, geoms, ray, meshData,
+				t_min, hit_geom_index, mesh_hit);
+			break;
+		case MESH:
+			j = closestInRun<MESH>(j, end, bvhGeomIndices, geoms, ray, meshData,
+				t_min, hit_geom_index, mesh_hit);
+			break;
+		case SPHERE_CLOUD:
+			j = closestInRun<SPHERE_CLOUD>(j, end, bvhGeomIndices, geoms, ray, meshData,
+				t_min, hit_geom_index, mesh_hit);
+			break;
+		case SDF_VOLUME:
+			j = closestInRun<SDF_VOLUME>(j, end, bvhGeomIndices, geoms, ray, meshData,
+				t_min, hit_geom_index, mesh_hit);
+			break;
+		default:
+			j++;
+		}
+	}
+}
+
+// Whether any geom of leaf `node` lies along `ray` closer than `tMax`
+__host__ __device__ inline bool occludedInLeaf(
+	const BVHNode & node
+	, const int * bvhGeomIndices
+	, const DeviceGeom * geoms
+	, const Ray & ray
+	, const MeshData & meshData
+	, float tMax
+	)
+{
+	const int end = node.offset + node.count;
+	bool occluded = false;
+	for (int j = node.offset; j < end; )
+	{
+		switch (geoms[bvhGeomIndices[j]].type)
+		{
+		case AXIS_ALIGNED_CUBE:
+			j = occludedInRun<AXIS_ALIGNED_CUBE>(j, end, bvhGeomIndices, geoms, ray, meshData,
+				tMax, occluded);
+			break;
+		case UNIFORM_SPHERE:
+			j = occludedInRun<UNIFORM_SPHERE>(j, end, bvhGeomIndices, geoms, ray, meshData,
+				tMax, occluded);
+			break;
+		case CUBE:
+			j = occludedInRun<CUBE>(j, end, bvhGeomIndices, geoms, ray, meshData, tMax, occluded);
+			break;
+		case SPHERE:
+			j = occludedInRun<SPHERE>(j, end, bvhGeomIndices, geoms, ray, meshData, tMax, occluded);
+			break;
+		case MESH:
+			j = occludedInRun<MESH>(j, end, bvhGeomIndices, geoms, ray, meshData, tMax, occluded);
+			break;
+		case SPHERE_CLOUD:
+			j = occludedInRun<SPHERE_CLOUD>(j, end, bvhGeomIndices, geoms, ray, meshData,
+				tMax, occluded);
+			break;
+		case SDF_VOLUME:
+			j = occludedInRun<SDF_VOLUME>(j, end, bvhGeomIndices, geoms, ray, meshData,
+				tMax, occluded);
+			break;
+		default:
+			j++;
+		}
+	}
+	return occluded;
+}
+
+// Far children a short-stack traversal keeps in registers
+#define SHORT_STACK_SIZE 4
+
+/**
+ * Traversal state under MeshData::shortStack. closestHit's stack of
+ * BVH_STACK_SIZE entries is indexed at run time, so it lives in local
+ * memory and deep trees touch it on every push and pop. This keeps the
+ * last SHORT_STACK_SIZE far children in registers, shifting them down
+ * with constant indices, and drops the oldest when a push overflows. A
+ * restart trail of two bits per level, which child the path took and
+ * whether its sibling is still to visit, stands in for what was dropped:
+ * once the short stack runs dry with subtrees pending, the traversal
+ * walks the trail down from the root to the deepest of them. The walk
+ * orders children by the ray alone, not by how far it has got, so it
+ * retraces the path taken. Trees up to 63 levels deep, as BVH_STACK_SIZE
+ * already assumes.
+ */
+struct ShortStack
+{
+	int entries[SHORT_STACK_SIZE];  // newest first
+	int size;
+	int level;                      // of the node being visited; the root's is 0
+	unsigned long long second;      // bit l: the path's level-l node is its parent's second child
+	unsigned long long pending;     // bit l: the path's level-l node's sibling is still to visit
+};
+
+__host__ __device__ inline void shortStackPush(ShortStack & stack, int node_index)
+{
+#pragma unroll
+	for (int i = SHORT_STACK_SIZE - 1; i > 0; i--)
+	{
+		stack.entries[i] = stack.entries[i - 1];
+	}
+	stack.entries[0] = node_index;
+	stack.size = stack.size < SHORT_STACK_SIZE ? stack.size + 1 : SHORT_STACK_SIZE;
+}
+
+/**
+ * Interior node `node_index`'s children in the order the traversal takes
+ * them: with `nearFirst`, by where the ray enters their boxes, whatever
+ * their distance, otherwise as stored. `hit_first` and `hit_second` say
+ * which of them start before `tMax`.
+ */
+__host__ __device__ inline void orderChildren(
+	const BVHNode * bvhNodes
+	, int node_index
+	, const BVHNode & node
+	, const Ray & ray
+	, const glm::vec3 & invDirection
+	, float tMax
+	, bool nearFirst
+	, int & first
+	, int & second
+	, bool & hit_first
+	, bool & hit_second
+	)
+{
+	first = node_index + 1;
+	second = node.offset;
+	float t_first = aabbIntersectionTest(bvhNodes[first].bboxMin, bvhNodes[first].bboxMax,
+		ray, invDirection, FLT_MAX);
+	float t_second = aabbIntersectionTest(bvhNodes[second].bboxMin, bvhNodes[second].bboxMax,
+		ray, invDirection, FLT_MAX);
+	if (nearFirst && t_second >= 0.0f && (t_first < 0.0f || t_second < t_first))
+	{
+		int tmp = first;
+		first = second;
+		second = tmp;
+		float t = t_first;
+		t_first = t_second;
+		t_second = t;
+	}
+	hit_first = t_first >= 0.0f && t_first <= tMax;
+	hit_second = t_second >= 0.0f && t_second <= tMax;
+}
+
+/**
+ * Steps from interior node `node_index` to the child to visit next,
+ * queuing its sibling when both start before `tMax`. Returns -1 when
+ * neither does; shortStackPop then picks up.
+ */
+__host__ __device__ inline int shortStackDescend(
+	ShortStack & stack
+	, const BVHNode * bvhNodes
+	, int node_index
+	, const BVHNode & node
+	, const Ray & ray
+	, const glm::vec3 & invDirection
+	, float tMax
+	, bool nearFirst
+	)
+{
+	int first, second;
+	bool hit_first, hit_second;
+	orderChildren(bvhNodes, node_index, node, ray, invDirection, tMax, nearFirst, first, second,
+		hit_first, hit_second);
+	if (!hit_first && !hit_second)
+	{
+		return -1;
+	}
+	const unsigned long long bit = 1ull << ++stack.level;
+	if (hit_first)
+	{
+		if (hit_second)
+		{
+			shortStackPush(stack, second);
+			stack.pending |= bit;
+		}
+		stack.second &= ~bit;
+		return first;
+	}
+	stack.second |= bit;
+	return second;
+}
+
+/**
+ * The deepest subtree still to visit, or -1 when there is none: the
+ * newest far child on the short stack or, with the stack run dry, the one
+ * the restart trail leads to from the root. Its box is not tested again,
+ * as closestHit does not test what it pops.
+ */
+__host__ __device__ inline int shortStackPop(
+	ShortStack & stack
+	, const BVHNode * bvhNodes
+	, const Ray & ray
+	, const glm::vec3 & invDirection
+	, bool nearFirst
+	, const MeshData & meshData
+	)
+{
+	if (stack.pending == 0)
+	{
+		return -1;
+	}
+	// Nothing is pending below the node being left
+	int level = stack.level;
+	while (((stack.pending >> level) & 1ull) == 0)
+	{
+		level--;
+	}
+	const unsigned long long bit = 1ull << level;
+	stack.pending &= ~bit;
+	stack.second |= bit;
+	stack.level = level;
+	if (stack.size > 0)
+	{
+		// The newest entry is the deepest pending sibling
+		const int node_index = stack.entries[0];
+#pragma unroll
+		for (int i = 0; i < SHORT_STACK_SIZE - 1; i++)
+		{
+			stack.entries[i] = stack.entries[i + 1];
+		}
+		stack.size--;
+		return node_index;
+	}
+
+	int node_index = 0;
+	for (int l = 1; l <= level; l++)
+	{
+		const BVHNode node = bvhNodes[node_index];
+		countNodeVisit(meshData);
+		int first, second;
+		bool hit_first, hit_second;
+		orderChildren(bvhNodes, node_index, node, ray, invDirection, FLT_MAX, nearFirst, first, second,
+			hit_first, hit_second);
+		node_index = ((stack.second >> l) & 1ull) ? second : first;
+	}
+	return node_index;
+}
+
+// closestHit on a short stack
+__host__ __device__ int closestHitShortStack(
+	const Ray & ray
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, const MeshData & meshData
+	, float & t_min
+	, MeshHit & mesh_hit
+	)
+{
+	t_min = FLT_MAX;
+	int hit_geom_index = -1;
+	const glm::vec3 invDirection = 1.0f / ray.direction;
+	ShortStack stack;
+	stack.size = 0;
+	stack.level = 0;
+	stack.second = 0;
+	stack.pending = 0;
+	int node_index = 0;
+	if (geoms_size == 0 || aabbIntersectionTest(bvhNodes[0].bboxMin, bvhNodes[0].bboxMax,
+			ray, invDirection, t_min) < 0.0f)
+	{
+		node_index = -1;
+	}
+
+	while (node_index >= 0)
+	{
+		const BVHNode node = bvhNodes[node_index];
+		countNodeVisit(meshData);
+
+		if (node.count > 0)
+		{
+			closestInLeaf(node, bvhGeomIndices, geoms, ray, meshData, t_min, hit_geom_index, mesh_hit);
+			node_index = -1;
+		}
+		else
+		{
+			node_index = shortStackDescend(stack, bvhNodes, node_index, node, ray, invDirection, t_min, true);
+		}
+		if (node_index < 0)
+		{
+			node_index = shortStackPop(stack, bvhNodes, ray, invDirection, true, meshData);
+		}
+	}
+	return hit_geom_index;
+}
+
+// occludedRay on a short stack
+__host__ __device__ bool occludedShortStack(
+	const Ray & ray
+	, float tMax
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, const MeshData & meshData
+	)
+{
+	const glm::vec3 invDirection = 1.0f / ray.direction;
+	ShortStack stack;
+	stack.size = 0;
+	stack.level = 0;
+	stack.second = 0;
+	stack.pending = 0;
+	int node_index = 0;
+	if (geoms_size == 0 || aabbIntersectionTest(bvhNodes[0].bboxMin, bvhNodes[0].bboxMax,
+			ray, invDirection, tMax) < 0.0f)
+	{
+		node_index = -1;
+	}
+
+	while (node_index >= 0)
+	{
+		const BVHNode node = bvhNodes[node_index];
+
+		if (node.count > 0)
+		{
+			if (occludedInLeaf(node, bvhGeomIndices, geoms, ray, meshData, tMax))
+			{
+				return true;
+			}
+			node_index = -1;
+		}
+		else
+		{
+			node_index = shortStackDescend(stack, bvhNodes, node_index, node, ray, invDirection, tMax, false);
+		}
+		if (node_index < 0)
+		{
+			node_index = shortStackPop(stack, bvhNodes, ray, invDirection, false, meshData);
+		}
+	}
+	return false;
+}
+
+/**
+ * The traversal alone: the index of the closest geom along `ray`, or -1,
+ * with its `t` and, for meshes, where on the mesh it was hit. Nothing is
+ * derived from the hit, so only this state stays live through the loop.
+ */
+__host__ __device__ int closestHit(
+	const Ray & ray
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, const MeshData & meshData
+	, float & t_min
+	, MeshHit & mesh_hit
+	)
+{
+	if (meshData.shortStack)
+	{
+		return closestHitShortStack(ray, geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData, t_min, mesh_hit);
+	}
+	t_min = FLT_MAX;
+	int hit_geom_index = -1;
+	// The tests only return distances; the normal is computed once, for
+	// the closest hit, from where it was hit
+
+	// Traverse the BVH nearest child first, skipping any box that starts
+	// beyond the closest hit so far. Ray directions are unit length, so
+	// box distances are comparable with the t of the geometry tests.
+	const glm::vec3 invDirection = 1.0f / ray.direction;
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	int node_index = 0;
+	if (geoms_size == 0 || aabbIntersectionTest(bvhNodes[0].bboxMin, bvhNodes[0].bboxMax,
+			ray, invDirection, t_min) < 0.0f)
+	{
+		node_index = -1;
+	}
+
+	while (node_index >= 0)
+	{
+		const BVHNode node = bvhNodes[node_index];
+		countNodeVisit(meshData);
+
+		if (node.count > 0)
+		{
+			closestInLeaf(node, bvhGeomIndices, geoms, ray, meshData, t_min, hit_geom_index, mesh_hit);
+			node_index = stack_size > 0 ? stack[--stack_size] : -1;
+			continue;
+		}
+
+		int left = node_index + 1;
+		int right = node.offset;
+		float t_left = aabbIntersectionTest(bvhNodes[left].bboxMin, bvhNodes[left].bboxMax,
+			ray, invDirection, t_min);
+		float t_right = aabbIntersectionTest(bvhNodes[right].bboxMin, bvhNodes[right].bboxMax,
+			ray, invDirection, t_min);
+
+		if (t_left >= 0.0f && t_right >= 0.0f)
+		{
+			// Visit the nearer child now, the other one later
+			if (t_right < t_left)
+			{
+				int tmp = left;
+				left = right;
+				right = tmp;
+			}
+			stack[stack_size++] = right;
+			node_index = left;
+		}
+		else if (t_left >= 0.0f)
+		{
+			node_index = left;
+		}
+		else if (t_right >= 0.0f)
+		{
+			node_index = right;
+		}
+		else
+		{
+			node_index = stack_size > 0 ? stack[--stack_size] : -1;
+		}
+	}
+	return hit_geom_index;
+}
+
+/**
+ * The ShadeableIntersection of a closestHit result: the facing normal, and
+ * the surfaceFrame for textured materials.
+ */
+__host__ __device__ ShadeableIntersection resolveHit(
+	const Ray & ray
+	, float t
+	, int hit_geom_index
+	, const MeshHit & mesh_hit
+	, const DeviceGeom * geoms
+	, const MeshData & meshData
+	, const Material * materials
+	)
+{
+	ShadeableIntersection intersection;
+	if (hit_geom_index == -1)
+	{
+		intersection.t = -1.0f;
+		intersection.materialId = -1;
+		intersection.surfaceNormal = glm::vec3(0.0f);
+		intersection.geomIndex = -1;
+		intersection.frontFace = true;
+	}
+	else
+	{
+		//The ray hits something
+		intersection.t = t;
+		intersection.materialId = hitMaterial(geoms[hit_geom_index], meshData, mesh_hit);
+		intersection.surfaceNormal = surfaceNormal(geoms[hit_geom_index], ray, t, meshData, mesh_hit,
+			intersection.frontFace);
+		intersection.geomIndex = hit_geom_index;
+		if (hasTextureMaps(materials[intersection.materialId]))
+		{
+			surfaceFrame(geoms[hit_geom_index], ray, t, meshData, mesh_hit, intersection);
+		}
+	}
+	return intersection;
+}
+
+// Perfect mirror and glass bounces the G-buffer looks through, at most
+#define GBUFFER_MAX_SPECULAR_BOUNCES 4
+
+// Whether every ray leaves a surface of `m` along one deterministic direction
+__host__ __device__ inline bool perfectSpecular(const Material & m)
+{
+	return m.hasReflective + m.hasRefractive >= 1.0f && m.specular.exponent <= 0.0f
+		&& m.roughnessMap < 0 && m.emittance <= 0.0f;
+}
+
+/**
+ * Writes the G-buffer for the camera ray `ray` whose first hit is
+ * `intersection`. Perfect mirrors and glass would show the denoiser their
+ * own flat surface instead of what they reflect, so the first
+ * non-specular vertex is recorded instead: the specular chain is
+ * followed, taking the reflection, or the transmission on a mostly
+ * refractive surface. Its distance is summed along the chain, so the
+ * rebuilt position is the virtual image behind the mirror, and its albedo
+ * is tinted by the specular colours on the way.
+ */
+__host__ __device__ void writeGBufferPixel(
+	GBufferPixel & gBufferPixel
+	, Ray ray
+	, float t
+	, ShadeableIntersection intersection
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, const MeshData & meshData
+	, const Material * materials
+	)
+{
+	float distance = t;
+	glm::vec3 tint(1.0f);
+	for (int bounce = 0; bounce < GBUFFER_MAX_SPECULAR_BOUNCES
+			&& perfectSpecular(materials[intersection.materialId]); bounce++)
+	{
+		const Material & m = materials[intersection.materialId];
+		const glm::vec3 normal = intersection.surfaceNormal;
+		glm::vec3 direction = glm::reflect(ray.direction, normal);
+		if (m.hasRefractive > m.hasReflective)
+		{
+			float ior = m.indexOfRefraction > 0.0f ? m.indexOfRefraction : 1.0f;
+			glm::vec3 refracted = glm::refract(ray.direction, normal,
+				intersection.frontFace ? 1.0f / ior : ior);
+			// Zero under total internal reflection, which keeps the reflection
+			if (glm::dot(refracted, refracted) > 0.0f)
+			{
+				direction = glm::normalize(refracted);
+			}
+		}
+		Ray next;
+		next.origin = ray.origin + ray.direction * t + direction * 0.0001f;
+		next.direction = direction;
+		next.coneWidth = ray.coneWidth + ray.coneSpread * t;
+		next.coneSpread = ray.coneSpread;
+
+		float nextT;
+		MeshHit meshHit;
+		int hitGeomIndex = closestHit(next, geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData,
+			nextT, meshHit);
+		if (hitGeomIndex == -1)
+		{
+			// Only the mirror itself is left to stop the filter at
+			break;
+		}
+		tint *= m.specular.color;
+		intersection = resolveHit(next, nextT, hitGeomIndex, meshHit, geoms, meshData, materials);
+		ray = next;
+		t = nextT;
+		distance += nextT;
+	}
+	encodeGBufferPixel(gBufferPixel, distance, intersection.surfaceNormal,
+		tint * texturedColor(materials[intersection.materialId], intersection, ray.direction),
+		intersection.materialId);
+}
+
+// intersectRay past the traversal, for the traversals other than closestHit
+__host__ __device__ ShadeableIntersection resolveRayHit(
+	const Ray & ray
+	, float t_min
+	, int hit_geom_index
+	, const MeshHit & mesh_hit
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, const MeshData & meshData
+	, const Material * materials
+	, GBufferPixel * gBufferPixel
+	)
+{
+	ShadeableIntersection intersection = resolveHit(ray, t_min, hit_geom_index, mesh_hit, geoms,
+		meshData, materials);
+
+	if (gBufferPixel != NULL)
+	{
+		if (hit_geom_index == -1)
+		{
+			encodeGBufferMiss(*gBufferPixel);
+		}
+		else
+		{
+			writeGBufferPixel(*gBufferPixel, ray, t_min, intersection, geoms, geoms_size,
+				bvhNodes, bvhGeomIndices, meshData, materials);
+		}
+	}
+	return intersection;
+}
+
+/**
+ * Finds the closest hit along `ray`. When `gBufferPixel` is non-null (the
+ * camera ray's bounce) the hit is also written to it, see
+ * writeGBufferPixel, so the denoiser inputs cost no extra pass over the
+ * intersections. Hits on textured materials also get their surfaceFrame.
+ */
+__host__ __device__ ShadeableIntersection intersectRay(
+	const Ray & ray
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, const MeshData & meshData
+	, const Material * materials
+	, GBufferPixel * gBufferPixel
+	)
+{
+	float t_min;
+	MeshHit mesh_hit;
+	int hit_geom_index = closestHit(ray, geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData,
+		t_min, mesh_hit);
+	return resolveRayHit(ray, t_min, hit_geom_index, mesh_hit, geoms, geoms_size, bvhNodes, bvhGeomIndices,
+		meshData, materials, gBufferPixel);
+}
+
+/**
+ * Shadow-ray test: whether anything lies along `ray` closer than `tMax`.
+ * Any hit answers it, so the traversal returns at the first one and visits
+ * children in stored order without sorting them.
+ */
+__host__ __device__ bool occludedRay(
+	const Ray & ray
+	, float tMax
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, const MeshData & meshData
+	)
+{
+	if (meshData.shortStack)
+	{
+		return occludedShortStack(ray, tMax, geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData);
+	}
+	const glm::vec3 invDirection = 1.0f / ray.direction;
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	int node_index = 0;
+	if (geoms_size == 0 || aabbIntersectionTest(bvhNodes[0].bboxMin, bvhNodes[0].bboxMax,
+			ray, invDirection, tMax) < 0.0f)
+	{
+		node_index = -1;
+	}
+
+	while (node_index >= 0)
+	{
+		const BVHNode node = bvhNodes[node_index];
+
+		if (node.count > 0)
+		{
+			if (occludedInLeaf(node, bvhGeomIndices, geoms, ray, meshData, tMax))
+			{
+				return true;
+			}
+			node_index = stack_size > 0 ? stack[--stack_size] : -1;
+			continue;
+		}
+
+		int left = node_index + 1;
+		int right = node.offset;
+		bool hit_left = aabbIntersectionTest(bvhNodes[left].bboxMin, bvhNodes[left].bboxMax,
+			ray, invDirection, tMax) >= 0.0f;
+		bool hit_right = aabbIntersectionTest(bvhNodes[right].bboxMin, bvhNodes[right].bboxMax,
+			ray, invDirection, tMax) >= 0.0f;
+
+		if (hit_left && hit_right)
+		{
+			stack[stack_size++] = right;
+			node_index = left;
+		}
+		else if (hit_left || hit_right)
+		{
+			node_index = hit_left ? left : right;
+		}
+		else
+		{
+			node_index = stack_size > 0 ? stack[--stack_size] : -1;
+		}
+	}
+	return false;
+}
+
+// A packet traversal gives up once its warp's rays want fewer than this
+// share of the nodes it visits, checked every PACKET_CHECK_VISITS nodes
+#define PACKET_MIN_UTILIZATION 0.4f
+#define PACKET_CHECK_VISITS 16
+
+/**
+ * closestHit a warp at a time, for coherent rays such as the camera's
+ * (PathtraceOptions::packetCameraRays). The warp's rays walk the tree
+ * together on one stack, the same in every lane, so each node is fetched
+ * once for all of them and every step is a ballot: a child is visited if
+ * any ray's interval through its box is open, the nearer one first by a
+ * majority of the rays that enter both. Leaves are tested by the rays
+ * that reach their box. Once the rays part ways and too few of them want
+ * the nodes visited, each finishes with closestHit on its own, bounded by
+ * nothing the packet found, which keeps the result the same. Every active
+ * lane of the warp must call it.
+ */
+__device__ int closestHitPacket(
+	const Ray & ray
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, const MeshData & meshData
+	, float & t_min
+	, MeshHit & mesh_hit
+	)
+{
+	const unsigned int mask = __activemask();
+	const int lanes = __popc(mask);
+	t_min = FLT_MAX;
+	int hit_geom_index = -1;
+	const glm::vec3 invDirection = 1.0f / ray.direction;
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	int node_index = __any_sync(mask, geoms_size > 0 && aabbIntersectionTest(bvhNodes[0].bboxMin,
+		bvhNodes[0].bboxMax, ray, invDirection, t_min) >= 0.0f) ? 0 : -1;
+	int visits = 0;
+	int wanted = 0;
+	bool coherent = true;
+
+	while (node_index >= 0)
+	{
+		const BVHNode node = bvhNodes[node_index];
+		countNodeVisit(meshData);
+
+		if (node.count > 0)
+		{
+			if (aabbIntersectionTest(node.bboxMin, node.bboxMax, ray, invDirection, t_min) >= 0.0f)
+			{
+				closestInLeaf(node, bvhGeomIndices, geoms, ray, meshData, t_min, hit_geom_index, mesh_hit);
+			}
+			node_index = stack_size > 0 ? stack[--stack_size] : -1;
+			continue;
+		}
+
+		int left = node_index + 1;
+		int right = node.offset;
+		const float t_left = aabbIntersectionTest(bvhNodes[left].bboxMin, bvhNodes[left].bboxMax,
+			ray, invDirection, t_min);
+		const float t_right = aabbIntersectionTest(bvhNodes[right].bboxMin, bvhNodes[right].bboxMax,
+			ray, invDirection, t_min);
+		const unsigned int wantLeft = __ballot_sync(mask, t_left >= 0.0f);
+		const unsigned int wantRight = __ballot_sync(mask, t_right >= 0.0f);
+		const unsigned int rightNearer = __ballot_sync(mask, t_left >= 0.0f && t_right >= 0.0f
+			&& t_right < t_left);
+
+		wanted += __popc(wantLeft | wantRight);
+		if (++visits == PACKET_CHECK_VISITS)
+		{
+			if (wanted < PACKET_MIN_UTILIZATION * visits * lanes)
+			{
+				coherent = false;
+				break;
+			}
+			visits = 0;
+			wanted = 0;
+		}
+
+		if (wantLeft != 0 && wantRight != 0)
+		{
+			if (2 * __popc(rightNearer) > __popc(wantLeft & wantRight))
+			{
+				int tmp = left;
+				left = right;
+				right = tmp;
+			}
+			stack[stack_size++] = right;
+			node_index = left;
+		}
+		else if (wantLeft != 0)
+		{
+			node_index = left;
+		}
+		else if (wantRight != 0)
+		{
+			node_index = right;
+		}
+		else
+		{
+			node_index = stack_size > 0 ? stack[--stack_size] : -1;
+		}
+	}
+
+	if (!coherent)
+	{
+		float t;
+		MeshHit ray_hit;
+		const int ray_geom_index = closestHit(ray, geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData,
+			t, ray_hit);
+		if (ray_geom_index >= 0 && t < t_min)
+		{
+			t_min = t;
+			hit_geom_index = ray_geom_index;
+			mesh_hit = ray_hit;
+		}
+	}
+	return hit_geom_index;
+}
+
+/**
+ * occludedRay a warp at a time, for next-event estimation's shadow rays
+ * under PathtraceOptions::packetShadowRays, which mostly head for the same
+ * light: closestHitPacket's shared walk, where rays drop out as they find
+ * an occluder and the warp stops once all have. Rays still open when the
+ * warp's rays part ways finish with occludedRay. Every active lane of
+ * the warp must call it.
+ */
+__device__ bool occludedPacket(
+	const Ray & ray
+	, float tMax
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, const MeshData & meshData
+	)
+{
+	const unsigned int mask = __activemask();
+	const glm::vec3 invDirection = 1.0f / ray.direction;
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	int node_index = __any_sync(mask, geoms_size > 0 && aabbIntersectionTest(bvhNodes[0].bboxMin,
+		bvhNodes[0].bboxMax, ray, invDirection, tMax) >= 0.0f) ? 0 : -1;
+	int visits = 0;
+	int wanted = 0;
+	int open = 0;
+	bool occluded = false;
+
+	while (node_index >= 0)
+	{
+		const BVHNode node = bvhNodes[node_index];
+
+		if (node.count > 0)
+		{
+			if (!occluded && aabbIntersectionTest(node.bboxMin, node.bboxMax, ray, invDirection, tMax) >= 0.0f)
+			{
+				occluded = occludedInLeaf(node, bvhGeomIndices, geoms, ray, meshData, tMax);
+			}
+			if (__all_sync(mask, occluded))
+			{
+				return occluded;
+			}
+			node_index = stack_size > 0 ? stack[--stack_size] : -1;
+			continue;
+		}
+
+		const int left = node_index + 1;
+		const int right = node.offset;
+		const bool hit_left = !occluded && aabbIntersectionTest(bvhNodes[left].bboxMin, bvhNodes[left].bboxMax,
+			ray, invDirection, tMax) >= 0.0f;
+		const bool hit_right = !occluded && aabbIntersectionTest(bvhNodes[right].bboxMin,
+			bvhNodes[right].bboxMax, ray, invDirection, tMax) >= 0.0f;
+		const unsigned int wantLeft = __ballot_sync(mask, hit_left);
+		const unsigned int wantRight = __ballot_sync(mask, hit_right);
+
+		wanted += __popc(wantLeft | wantRight);
+		open += __popc(__ballot_sync(mask, !occluded));
+		if (++visits == PACKET_CHECK_VISITS)
+		{
+			if (wanted < PACKET_MIN_UTILIZATION * open)
+			{
+				break;
+			}
+			visits = 0;
+			wanted = 0;
+			open = 0;
+		}
+
+		if (wantLeft != 0 && wantRight != 0)
+		{
+			stack[stack_size++] = right;
+			node_index = left;
+		}
+		else if (wantLeft != 0 || wantRight != 0)
+		{
+			node_index = wantLeft != 0 ? left : right;
+		}
+		else
+		{
+			node_index = stack_size > 0 ? stack[--stack_size] : -1;
+		}
+	}
+
+	// Only left early when the rays part ways
+	if (node_index >= 0 && !occluded)
+	{
+		occluded = occludedRay(ray, tMax, geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData);
+	}
+	return occluded;
+}
+
+/**
+ * Intersects the path in slot `path_index` and stores the hit in the same
+ * slot of `intersections`. Depth 0 also fills the G-buffer.
+ */
+__device__ void intersectPath(
+	int path_index
+	, int depth
+	, const PathSegments & pathSegments
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, const MeshData & meshData
+	, const Material * materials
+	, const ShadeableIntersections & intersections
+	, GBufferPixel * gBuffer
+	, bool packetRays = false
+	)
+{
+	// Only the ray is needed, plus the pixel on the G-buffer bounce
+	Ray ray = loadRay(pathSegments, path_index);
+
+	// With several samples per pixel only sample 0, which sits in the
+	// pixel's own slot, writes the G-buffer
+	GBufferPixel * gBufferPixel = NULL;
+	if (depth == 0 && gBuffer != NULL)
+	{
+		int pixel = loadPixelIndex(pathSegments, path_index);
+		gBufferPixel = pixel == path_index ? &gBuffer[pixel] : NULL;
+	}
+
+	ShadeableIntersection intersection;
+	if (packetRays)
+	{
+		float t_min;
+		MeshHit mesh_hit;
+		const int hit_geom_index = closestHitPacket(ray, geoms, geoms_size, bvhNodes, bvhGeomIndices,
+			meshData, t_min, mesh_hit);
+		intersection = resolveRayHit(ray, t_min, hit_geom_index, mesh_hit, geoms, geoms_size,
+			bvhNodes, bvhGeomIndices, meshData, materials, gBufferPixel);
+	}
+	else
+	{
+		intersection = intersectRay(ray, geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData, materials,
+			gBufferPixel);
+	}
+	storeHit(intersections, path_index, intersection, materials);
+}
+
+// Adds a path ray's BVH node fetches to its pixel's RayCost, when counting
+__device__ inline void countNodeVisits(RayCost * rayCost, const PathSegments & pathSegments, int path_index,
+	unsigned int nodeVisits)
+{
+	if (rayCost != NULL)
+	{
+		atomicAdd(&rayCost[loadPixelIndex(pathSegments, path_index)].nodes, nodeVisits);
+	}
+}
+
+__global__ void __launch_bounds__(LAUNCH_MAX_BLOCK_SIZE) computeIntersections(
+	int depth
+	, int num_paths
+	, PathSegments pathSegments
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, bool stageGeoms
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, MeshData meshData
+	, Material * materials
+	, ShadeableIntersections intersections
+	, GBufferPixel * gBuffer
+	, RayCost * rayCost
+	, bool packetRays
+	)
+{
+	extern __shared__ int s_geomStage[];
+	geoms = stageToShared(geoms, geoms_size,
+		stageGeoms ? reinterpret_cast<DeviceGeom *>(s_geomStage) : NULL);
+
+	int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+
+	if (path_index < num_paths)
+	{
+		unsigned int nodeVisits = 0;
+		if (rayCost != NULL)
+		{
+			meshData.nodeVisits = &nodeVisits;
+		}
+		intersectPath(path_index, depth, pathSegments, geoms, geoms_size,
+			bvhNodes, bvhGeomIndices, meshData, materials, intersections, gBuffer, packetRays);
+		countNodeVisits(rayCost, pathSegments, path_index, nodeVisits);
+	}
+}
+
+/**
+ * Reduced-state computeIntersections for bounces without a G-buffer: it
+ * loads only the ray and stores only what the traversal found, as a hit
+ * record (see storeHitRecord), so the normal and texture frame code is kept
+ * out of the traversal's registers. shadePath resolves the records.
+ */
+__global__ void __launch_bounds__(LAUNCH_MAX_BLOCK_SIZE) computeHitRecords(
+	int num_paths
+	, PathSegments pathSegments
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, bool stageGeoms
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, MeshData meshData
+	, ShadeableIntersections intersections
+	, RayCost * rayCost
+	)
+{
+	extern __shared__ int s_geomStage[];
+	geoms = stageToShared(geoms, geoms_size,
+		stageGeoms ? reinterpret_cast<DeviceGeom *>(s_geomStage) : NULL);
+
+	int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+
+	if (path_index < num_paths)
+	{
+		Ray ray = loadRay(pathSegments, path_index);
+		float t;
+		MeshHit mesh_hit;
+		unsigned int nodeVisits = 0;
+		if (rayCost != NULL)
+		{
+			meshData.nodeVisits = &nodeVisits;
+		}
+		int hit_geom_index = closestHit(ray, geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData,
+			t, mesh_hit);
+		countNodeVisits(rayCost, pathSegments, path_index, nodeVisits);
+		if (hit_geom_index >= 0)
+		{
+			storeHitRecord(intersections, path_index, t, hit_geom_index, mesh_hit.triangle,
+				mesh_hit.u, mesh_hit.v);
+		}
+		else
+		{
+			storeIntersectionMiss(intersections, path_index);
+		}
+	}
+}
+
+/**
+ * The G-buffer of the pixel-centre camera rays, for antialiased rendering
+ * with an unjittered G-buffer. Those rays only change with the camera, so
+ * this runs once per pathtraceReset().
+ */
+__global__ void computeCentreGBuffer(
+	Camera cam
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, MeshData meshData
+	, const Material * materials
+	, GBufferPixel * gBuffer
+	)
+{
+	int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+	int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+	if (x < cam.resolution.x && y < cam.resolution.y) {
+		int index = x + (y * cam.resolution.x);
+		Ray ray;
+		ray.origin = cam.position;
+		ray.direction = cameraRayDirection(cam, (float)x, (float)y);
+		ray.coneWidth = 0.0f;
+		ray.coneSpread = cam.pixelLength.y;
+		intersectRay(ray, geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData, materials, &gBuffer[index]);
+	}
+}
+
+/**
+ * Tests `ray` against the one geom, and for meshes the one triangle, of a
+ * rasterized hit. Returns -1 if it misses them.
+ */
+__device__ float rasterHitTest(const DeviceGeom & geom, int triangle, const Ray & ray,
+	const MeshData & meshData, MeshHit & mesh_hit)
+{
+	switch (geom.type)
+	{
+	case AXIS_ALIGNED_CUBE:
+		return geomIntersectionTest<AXIS_ALIGNED_CUBE>(geom, ray, meshData, FLT_MAX, mesh_hit);
+	case UNIFORM_SPHERE:
+		return geomIntersectionTest<UNIFORM_SPHERE>(geom, ray, meshData, FLT_MAX, mesh_hit);
+	case CUBE:
+		return geomIntersectionTest<CUBE>(geom, ray, meshData, FLT_MAX, mesh_hit);
+	case SPHERE:
+		return geomIntersectionTest<SPHERE>(geom, ray, meshData, FLT_MAX, mesh_hit);
+	case MESH:
+	{
+		if (triangle < 0)
+		{
+			return -1.0f;
+		}
+		Ray q;
+		q.origin = worldToObjectPoint(geom, ray.origin);
+		q.direction = worldToObjectVector(geom, ray.direction);
+		mesh_hit.triangle = triangle;
+		return meshTriangleTest(meshData, meshData.meshes[geom.meshid], triangle, q, watertightRay(q.direction),
+			mesh_hit.u, mesh_hit.v);
+	}
+	default:
+		return -1.0f;
+	}
+}
+
+/**
+ * intersectRay for a pixel-centre camera ray whose pixel rasterized to
+ * `hit` (see pathtraceSetRasterHits): only the geom and triangle the
+ * raster found are tested, for the exact distance and barycentrics. A ray
+ * that misses them after all, where rasterization and the intersection
+ * tests round an edge differently, is traced in full.
+ */
+__device__ ShadeableIntersection intersectRasterHit(
+	const Ray & ray
+	, int2 hit
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, const MeshData & meshData
+	, const Material * materials
+	, GBufferPixel * gBufferPixel
+	)
+{
+	MeshHit mesh_hit;
+	if (hit.x < 0)
+	{
+		if (gBufferPixel != NULL)
+		{
+			encodeGBufferMiss(*gBufferPixel);
+		}
+		return resolveHit(ray, -1.0f, -1, mesh_hit, geoms, meshData, materials);
+	}
+	float t = rasterHitTest(geoms[hit.x], hit.y, ray, meshData, mesh_hit);
+	if (!(t > 0.0f))
+	{
+		return intersectRay(ray, geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData, materials,
+			gBufferPixel);
+	}
+	ShadeableIntersection intersection = resolveHit(ray, t, hit.x, mesh_hit, geoms, meshData, materials);
+	if (gBufferPixel != NULL)
+	{
+		writeGBufferPixel(*gBufferPixel, ray, t, intersection, geoms, geoms_size,
+			bvhNodes, bvhGeomIndices, meshData, materials);
+	}
+	return intersection;
+}
+
+/**
+ * computeIntersections for the camera bounce under
+ * PathtraceOptions::rasterPrimary, from the rasterized hits of the band's
+ * pixels rather than a traversal per path.
+ */
+__global__ void computeRasterIntersections(
+	int num_paths
+	, PathSegments pathSegments
+	, const int2 * rasterHits
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, MeshData meshData
+	, const Material * materials
+	, ShadeableIntersections intersections
+	, GBufferPixel * gBuffer
+	)
+{
+	int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+
+	if (path_index < num_paths)
+	{
+		Ray ray = loadRay(pathSegments, path_index);
+		int pixel = loadPixelIndex(pathSegments, path_index);
+		// As in intersectPath, sample 0 in the pixel's own slot writes the G-buffer
+		GBufferPixel * gBufferPixel = gBuffer != NULL && pixel == path_index ? &gBuffer[pixel] : NULL;
+		ShadeableIntersection intersection = intersectRasterHit(ray, rasterHits[pixel], geoms, geoms_size,
+			bvhNodes, bvhGeomIndices, meshData, materials, gBufferPixel);
+		storeHit(intersections, path_index, intersection, materials);
+	}
+}
+
+// computeCentreGBuffer from the rasterized hits
+__global__ void computeRasterGBuffer(
+	Camera cam
+	, const int2 * rasterHits
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, MeshData meshData
+	, const Material * materials
+	, GBufferPixel * gBuffer
+	)
+{
+	int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+	int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+	if (x < cam.resolution.x && y < cam.resolution.y) {
+		int index = x + (y * cam.resolution.x);
+		Ray ray;
+		ray.origin = cam.position;
+		ray.direction = cameraRayDirection(cam, (float)x, (float)y);
+		ray.coneWidth = 0.0f;
+		ray.coneSpread = cam.pixelLength.y;
+		intersectRasterHit(ray, rasterHits[index], geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData,
+			materials, &gBuffer[index]);
+	}
+}
+
+/**
+ * closestHit over the `count` geoms `list` names, taken in runs of a type
+ * as a BVH leaf's are, instead of a traversal of the whole tree.
+ */
+__device__ int closestHitInList(
+	const Ray & ray
+	, const int * list
+	, int count
+	, const DeviceGeom * geoms
+	, const MeshData & meshData
+	, float & t_min
+	, MeshHit & mesh_hit
+	)
+{
+	t_min = FLT_MAX;
+	int hit_geom_index = -1;
+	for (int j = 0; j < count; )
+	{
+		switch (geoms[list[j]].type)
+		{
+		case AXIS_ALIGNED_CUBE:
+			j = closestInRun<AXIS_ALIGNED_CUBE>(j, count, list, geoms, ray, meshData,
+				t_min, hit_geom_index, mesh_hit);
+			break;
+		case UNIFORM_SPHERE:
+			j = closestInRun<UNIFORM_SPHERE>(j, count, list, geoms, ray, meshData,
+				t_min, hit_geom_index, mesh_hit);
+			break;
+		case CUBE:
+			j = closestInRun<CUBE>(j, count, list, geoms, ray, meshData, t_min, hit_geom_index, mesh_hit);
+			break;
+		case SPHERE:
+			j = closestInRun<SPHERE>(j, count, list, geoms, ray, meshData, t_min, hit_geom_index, mesh_hit);
+			break;
+		case MESH:
+			j = closestInRun<MESH>(j, count, list, geoms, ray, meshData, t_min, hit_geom_index, mesh_hit);
+			break;
+		case SPHERE_CLOUD:
+			j = closestInRun<SPHERE_CLOUD>(j, count, list, geoms, ray, meshData,
+				t_min, hit_geom_index, mesh_hit);
+			break;
+		case SDF_VOLUME:
+			j = closestInRun<SDF_VOLUME>(j, count, list, geoms, ray, meshData,
+				t_min, hit_geom_index, mesh_hit);
+			break;
+		default:
+			j++;
+		}
+	}
+	return hit_geom_index;
+}
+
+/**
+ * computeIntersections for the camera bounce under
+ * PathtraceOptions::tileCulling: each ray is tested against the geoms
+ * binned into its pixel's tile (see tileCulling.h) rather than traversing
+ * the BVH. When all of a block's rays fall in one tile, as under
+ * tiledPathOrder, the tile's list is staged in shared memory once for the
+ * block. Rays whose tile lists more than CULL_TILE_MAX_GEOMS geoms
+ * traverse the BVH as usual.
+ */
+__global__ void __launch_bounds__(LAUNCH_MAX_BLOCK_SIZE) computeTileIntersections(
+	int num_paths
+	, int firstRow
+	, PathSegments pathSegments
+	, TileGeomLists tileLists
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, MeshData meshData
+	, const Material * materials
+	, ShadeableIntersections intersections
+	, GBufferPixel * gBuffer
+	)
+{
+	__shared__ int s_blockTile;
+	__shared__ int s_tileGeoms[CULL_TILE_MAX_GEOMS];
+
+	int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+	int pixel = -1;
+	int tile = -1;
+	if (path_index < num_paths)
+	{
+		// Pixel indices are relative to the band's first row
+		pixel = loadPixelIndex(pathSegments, path_index);
+		const int x = pixel % tileLists.width;
+		const int y = firstRow + pixel / tileLists.width;
+		tile = (y / CULL_TILE_SIZE) * tileLists.tilesX + x / CULL_TILE_SIZE;
+	}
+	// Thread 0 always has a path, so its tile is the block's if any is
+	if (threadIdx.x == 0)
+	{
+		s_blockTile = tile;
+	}
+	__syncthreads();
+	const int * list = NULL;
+	int count = 0;
+	if (__syncthreads_and(tile == s_blockTile || path_index >= num_paths))
+	{
+		const int first = tileLists.offsets[s_blockTile];
+		count = tileLists.offsets[s_blockTile + 1] - first;
+		if (count <= CULL_TILE_MAX_GEOMS)
+		{
+			for (int k = threadIdx.x; k < count; k += blockDim.x)
+			{
+				s_tileGeoms[k] = tileLists.geoms[first + k];
+			}
+			list = s_tileGeoms;
+		}
+		__syncthreads();
+	}
+	else if (tile >= 0)
+	{
+		const int first = tileLists.offsets[tile];
+		count = tileLists.offsets[tile + 1] - first;
+		list = count <= CULL_TILE_MAX_GEOMS ? tileLists.geoms + first : NULL;
+	}
+
+	if (path_index < num_paths)
+	{
+		Ray ray = loadRay(pathSegments, path_index);
+		// As in intersectPath, sample 0 in the pixel's own slot writes the G-buffer
+		GBufferPixel * gBufferPixel = gBuffer != NULL && pixel == path_index ? &gBuffer[pixel] : NULL;
+		float t_min;
+		MeshHit mesh_hit;
+		const int hit_geom_index = list != NULL
+			? closestHitInList(ray, list, count, geoms, meshData, t_min, mesh_hit)
+			: closestHit(ray, geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData, t_min, mesh_hit);
+		ShadeableIntersection intersection = resolveRayHit(ray, t_min, hit_geom_index, mesh_hit, geoms,
+			geoms_size, bvhNodes, bvhGeomIndices, meshData, materials, gBufferPixel);
+		storeHit(intersections, path_index, intersection, materials);
+	}
+}
+
+/**
+ * Wavefront extend stage with persistent threads (Aila & Laine 2009). The
+ * grid only fills the GPU once; each warp grabs the next 32 queue entries
+ * from `workCounter` until the queue is drained, so the launch size does not
+ * depend on how many paths are left.
+ */
+__global__ void extendPersistent(
+	int depth
+	, const int * queue
+	, int queueLength
+	, int * workCounter
+	, PathSegments pathSegments
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, bool stageGeoms
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, MeshData meshData
+	, Material * materials
+	, ShadeableIntersections intersections
+	, GBufferPixel * gBuffer
+	)
+{
+	extern __shared__ int s_extendGeomStage[];
+	geoms = stageToShared(geoms, geoms_size,
+		stageGeoms ? reinterpret_cast<DeviceGeom *>(s_extendGeomStage) : NULL);
+
+	const int lane = threadIdx.x & (WARP_SIZE - 1);
+	while (true)
+	{
+		int batch = 0;
+		if (lane == 0)
+		{
+			batch = atomicAdd(workCounter, WARP_SIZE);
+		}
+		batch = __shfl_sync(0xffffffff, batch, 0);
+		if (batch >= queueLength)
+		{
+			break;
+		}
+
+		int entry = batch + lane;
+		if (entry < queueLength)
+		{
+			intersectPath(queue[entry], depth, pathSegments, geoms, geoms_size,
+				bvhNodes, bvhGeomIndices, meshData, materials, intersections, gBuffer);
+		}
+	}
+}
+
+// Set in the depth that seeds the random fallback's light-sampling engine,
+// so its stream is independent of the scatter engine of the same bounce
+#define NEE_SEED_BIT 0x100
+
+/**
+ * Adds one ray to counts[slot] for every active lane, with one atomic per
+ * distinct slot in the warp rather than one per ray. Safe in divergent
+ * code: only the lanes that reach it take part.
+ */
+__device__ void countWarpRays(unsigned long long * counts, int slot)
+{
+  const int lane = threadIdx.x & (WARP_SIZE - 1);
+  unsigned int remaining = __activemask();
+  while (remaining != 0) {
+    int leader = __ffs(remaining) - 1;
+    int leaderSlot = __shfl_sync(remaining, slot, leader);
+    unsigned int same = __ballot_sync(remaining, slot == leaderSlot);
+    if (lane == leader) {
+      atomicAdd(&counts[leaderSlot], (unsigned long long)__popc(same));
+    }
+    remaining &= ~same;
+  }
+}
+
+// Host shading (the CPU renderer) counts no rays
+__host__ __device__ void countShadowRay(const LightData & lights, const PathSegment & segment)
+{
+#ifdef __CUDA_ARCH__
+  if (lights.rayCounts != NULL) {
+    countWarpRays(lights.rayCounts, TELEMETRY_BOUNCES);
+  }
+  if (lights.rayCost != NULL) {
+    atomicAdd(&lights.rayCost[lights.firstPixel + segment.pixelIndex].shadowRays, 1u);
+  }
+#endif
+}
+
+// Whether next-event estimation's shadow ray is blocked before `tMax`
+__host__ __device__ inline bool shadowOccluded(const LightData & lights, const Ray & shadowRay, float tMax)
+{
+#ifdef __CUDA_ARCH__
+  if (lights.packetShadows) {
+    return occludedPacket(shadowRay, tMax, lights.geoms, lights.geomCount, lights.bvhNodes,
+      lights.bvhGeomIndices, lights.meshData);
+  }
+#endif
+  return occludedRay(shadowRay, tMax, lights.geoms, lights.geomCount, lights.bvhNodes,
+    lights.bvhGeomIndices, lights.meshData);
+}
+
+// Counts a path hit on geom `geomIndex` for updateGeometryResidency
+__host__ __device__ void countGeomHit(const LightData & lights, int geomIndex)
+{
+#ifdef __CUDA_ARCH__
+  if (lights.geomHits != NULL && geomIndex >= 0 && geomIndex < lights.geomCount) {
+    atomicAdd(&lights.geomHits[geomIndex], 1u);
+  }
+#endif
+}
+
+/**
+ * The density of the direction scattered from a vertex towards `wi`: the
+ * cosine lobe about `normal` of a diffuse surface, or the phase function of
+ * a `medium` for a ray arriving along `direction`. Either is also what the
+ * vertex scatters towards wi per unit of incoming radiance, with the
+ * albedo left out, since both are sampled exactly.
+ */
+__host__ __device__ inline float vertexScatterPdf(glm::vec3 normal, glm::vec3 direction, glm::vec3 wi,
+  const Medium * medium)
+{
+  if (medium != NULL) {
+    return henyeyGreenstein(medium->g, glm::dot(direction, wi));
+  }
+  return fmaxf(glm::dot(normal, wi), 0.0f) / PI;
+}
+
+/**
+ * The density the vertex of vertexScatterPdf actually scatters towards
+ * `wi` with, for MIS weights: the same, unless its diffuse bounce is
+ * guided by `guide` (see scatterRay).
+ */
+__host__ __device__ inline float vertexSamplingPdf(float scatterPdf, glm::vec3 normal, glm::vec3 wi,
+  const Medium * medium, const float * guide)
+{
+  return medium == NULL && guide != NULL ? guidedDiffusePdf(guide, normal, wi) : scatterPdf;
+}
+
+// Transmittance of an unoccluded shadow ray through the media, up to tMax
+__host__ __device__ inline float shadowTransmittance(const LightData & lights, const Ray & shadowRay,
+  float tMax, Sampler & rng)
+{
+  if (lights.media.count == 0) {
+    return 1.0f;
+  }
+  // The engine is free for this after the light sample's own numbers
+  return mediumTransmittance(lights.media, shadowRay, tMax, rng.rng);
+}
+
+/**
+ * Next-event estimation at a diffuse vertex: connects it to a point drawn
+ * on one of the lights, or to a direction drawn from the environment map,
+ * and, unless the shadow ray is blocked, adds the light's contribution,
+ * MIS-weighted against the scattered ray hitting the same point.
+ * `segment.color` already includes the surface's albedo. With a
+ * `reservoir`, the lights' share of the samples connects to its point
+ * instead, at its W and the lights' full weight.
+ *
+ * With a `medium`, the vertex is a collision in it along segment.ray,
+ * which is still the ray that arrived there: its phase function takes
+ * the place of the cosine lobe and `normal` is not read. Either way the
+ * shadow ray's light is weighed by its transmittance through the media.
+ * A surface whose bounce is guided by `guide` weighs its sample against
+ * the density it scatters with, the guided mixture.
+ */
+__host__ __device__ void sampleDirectLight(
+  const LightData & lights
+  , Sampler & rng
+  , glm::vec3 point
+  , glm::vec3 normal
+  , PathSegment & segment
+  , const Reservoir * reservoir = NULL
+  , const Medium * medium = NULL
+  , const float * guide = NULL
+  )
+{
+  float u1 = nextSample(rng);
+  float u2 = nextSample(rng);
+  float pick = nextSample(rng);
+  if (pick >= 1.0f - lights.environment.pmf) {
+    float pdf;
+    glm::vec3 wi = sampleEnvironment(lights.environment, u1, u2, pdf);
+    float pdfScatter = vertexScatterPdf(normal, segment.ray.direction, wi, medium);
+    if (!(pdf > 0.0f) || pdfScatter <= 0.0f) {
+      return;
+    }
+    Ray shadowRay;
+    shadowRay.origin = point + wi * 0.0001f;
+    shadowRay.direction = wi;
+    // The scattered ray's cone, so shadow rays see meshes at the same detail
+    shadowRay.coneWidth = segment.ray.coneWidth;
+    shadowRay.coneSpread = segment.ray.coneSpread;
+    countShadowRay(lights, segment);
+    if (shadowOccluded(lights, shadowRay, FLT_MAX)) {
+      return;
+    }
+    float pdfLight = lights.environment.pmf * pdf;
+    segment.radiance += segment.color * environmentRadiance(lights.environment, wi)
+      * (shadowTransmittance(lights, shadowRay, FLT_MAX, rng) * pdfScatter / pdfLight
+      * powerHeuristic(pdfLight, vertexSamplingPdf(pdfScatter, normal, wi, medium, guide)));
+    return;
+  }
+  if (reservoir != NULL) {
+    glm::vec3 toLight = reservoir->point - point;
+    float distance = glm::length(toLight);
+    glm::vec3 wi = toLight / distance;
+    float pdfScatter = vertexScatterPdf(normal, segment.ray.direction, wi, medium);
+    if (!(distance > 0.0f) || pdfScatter <= 0.0f) {
+      return;
+    }
+    Ray shadowRay;
+    shadowRay.origin = point + wi * 0.0001f;
+    shadowRay.direction = wi;
+    shadowRay.coneWidth = segment.ray.coneWidth;
+    shadowRay.coneSpread = segment.ray.coneSpread;
+    countShadowRay(lights, segment);
+    if (shadowOccluded(lights, shadowRay, distance - 0.0002f)) {
+      return;
+    }
+    // This branch is taken with the lights' share of the samples
+    float cosLight = fabsf(glm::dot(reservoir->normal, wi));
+    segment.radiance += segment.color * lights.lights[reservoir->light].radiance
+      * (shadowTransmittance(lights, shadowRay, distance, rng)
+      * pdfScatter * cosLight / (distance * distance) * reservoir->W / (1.0f - lights.environment.pmf));
+    return;
+  }
+  // The light tree walks the lights' share of the samples down to one
+  // light by what each part of the scene gives this point
+  float pmf;
+  int l;
+  if (lights.lightTree != NULL) {
+    pick = fminf(pick / (1.0f - lights.environment.pmf), 0.99999994f);
+    l = sampleLightTree(lights, point, pick, pmf);
+    if (l < 0) {
+      return;
+    }
+    pmf *= 1.0f - lights.environment.pmf;
+  } else {
+    l = pickLight(lights, pick);
+    pmf = lights.lights[l].pmf;
+  }
+  const Light & light = lights.lights[l];
+  glm::vec3 lightPoint;
+  glm::vec3 lightNormal;
+  sampleLightPoint(light, pick, u1, u2, lightPoint, lightNormal);
+
+  glm::vec3 toLight = lightPoint - point;
+  float distance = glm::length(toLight);
+  glm::vec3 wi = toLight / distance;
+  float pdfScatter = vertexScatterPdf(normal, segment.ray.direction, wi, medium);
+  if (!(distance > 0.0f) || pdfScatter <= 0.0f) {
+    return;
+  }
+  Ray shadowRay;
+  shadowRay.origin = point + wi * 0.0001f;
+  shadowRay.direction = wi;
+  shadowRay.coneWidth = segment.ray.coneWidth;
+  shadowRay.coneSpread = segment.ray.coneSpread;
+  countShadowRay(lights, segment);
+  if (shadowOccluded(lights, shadowRay, distance - 0.0002f)) {
+    return;
+  }
+  float pdfLight = lightPdf(light, pmf, distance, glm::dot(lightNormal, wi));
+  segment.radiance += segment.color * light.radiance
+    * (shadowTransmittance(lights, shadowRay, distance, rng) * pdfScatter / pdfLight
+    * powerHeuristic(pdfLight, vertexSamplingPdf(pdfScatter, normal, wi, medium, guide)));
+}
+
+/**
+ * MIS weight of an emitter found by a scattered ray. Specular bounces and
+ * camera rays (scatterPdf 0) and emitters light sampling cannot reach keep
+ * the full weight. Which triangle of an emissive mesh was hit is not known
+ * here, so those are left to light sampling alone after a diffuse vertex.
+ */
+__host__ __device__ float emitterHitWeight(
+  const LightData & lights
+  , const ShadeableIntersection & intersection
+  , const PathSegment & segment
+  )
+{
+  int l = lights.geoms[intersection.geomIndex].lightIndex;
+  if (segment.scatterPdf <= 0.0f || l < 0) {
+    return 1.0f;
+  }
+  const Light & light = lights.lights[l];
+  if (light.type == MESH) {
+    return 0.0f;
+  }
+  float pmf = light.pmf;
+  if (lights.lightTree != NULL) {
+    // The vertex the ray left, before the offset every scattered ray starts with
+    const glm::vec3 from = segment.ray.origin - segment.ray.direction * 0.0001f;
+    pmf = (1.0f - lights.environment.pmf) * lightTreePmf(lights, from, l);
+  }
+  float pdfLight = lightPdf(light, pmf, intersection.t,
+    glm::dot(intersection.surfaceNormal, segment.ray.direction));
+  return powerHeuristic(segment.scatterPdf, pdfLight);
+}
+
+/**
+ * Delta-tracks the segment's ray through the media up to its intersection,
+ * or out of the scene for a miss. Returns false if it reaches the
+ * intersection; otherwise the path has scattered at the collision it found
+ * instead, one bounce spent: its throughput takes the medium's albedo, the
+ * lights are sampled through the phase function with NEE on, and the ray
+ * leaves in a direction drawn from it. Kept out of line, so scenes
+ * without media only pay for the branch around the call.
+ */
+__host__ __device__ __noinline__ bool scatterInMedium(
+  const ShadeableIntersection & intersection
+  , PathSegment & segment
+  , int rouletteBounces
+  , int sampler
+  , const LightData & lights
+  )
+{
+  const int pixel = lights.firstPixel + segment.pixelIndex;
+  Sampler rng = makeSampler(SAMPLER_RANDOM,
+    makeSeededRandomEngine(segment.sampleIndex, pixel, segment.remainingBounces | MEDIUM_SEED_BIT),
+    pixel, segment.sampleIndex, segment.remainingBounces);
+  int m = -1;
+  const float t = sampleMediumCollision(lights.media, segment.ray,
+    intersection.t > 0.0f ? intersection.t : FLT_MAX, rng.rng, m);
+  if (t < 0.0f) {
+    return false;
+  }
+  const Medium & medium = lights.media.media[m];
+  segment.remainingBounces--;
+  const glm::vec3 point = segment.ray.origin + t * segment.ray.direction;
+  segment.color *= medium.albedo;
+
+  // A camera-ray collision does not use the pixel's reservoir, which is
+  // for its G-buffer surface, so it samples no lights; emitters it finds
+  // keep the full weight, as the resampled ones expect
+  const bool cameraVertex = lights.traceDepth - 1 - segment.remainingBounces == 0;
+  const bool sampleLights = directLighting(lights) && !(lights.reservoirs != NULL && cameraVertex);
+  if (sampleLights) {
+    Sampler lightRng = makeSampler(sampler,
+      makeSeededRandomEngine(segment.sampleIndex, pixel, segment.remainingBounces | NEE_SEED_BIT),
+      pixel, segment.sampleIndex, segment.remainingBounces);
+    lightRng.dimension += SAMPLER_LIGHT_DIMENSION;
+    sampleDirectLight(lights, lightRng, point, glm::vec3(0.0f), segment, NULL, &medium);
+  }
+
+  Sampler scatterRng = makeSampler(sampler,
+    makeSeededRandomEngine(segment.sampleIndex, pixel, segment.remainingBounces),
+    pixel, segment.sampleIndex, segment.remainingBounces);
+  const float u1 = nextSample(scatterRng);
+  const float u2 = nextSample(scatterRng);
+  const glm::vec3 incident = segment.ray.direction;
+  const glm::vec3 direction = sampleHenyeyGreenstein(incident, medium.g, u1, u2);
+  segment.scatterPdf = sampleLights ? henyeyGreenstein(medium.g, glm::dot(incident, direction)) : 0.0f;
+  segment.ray.coneWidth += segment.ray.coneSpread * t;
+  segment.ray.coneSpread = scatteredConeSpread(segment.ray.coneSpread, 1.0f);
+  segment.ray.origin = point + direction * 0.0001f;
+  segment.ray.direction = direction;
+
+  if (segment.remainingBounces > 0 && segment.remainingBounces <= rouletteBounces) {
+    nextSample(scatterRng);  // the dimension of a surface's lobe choice
+    float survival = glm::min(glm::max(segment.color.r, glm::max(segment.color.g, segment.color.b)), 1.0f);
+    if (nextSample(scatterRng) < survival) {
+      segment.color /= survival;
+    } else {
+      segment.remainingBounces = 0;
+      segment.color = glm::vec3(0.0f);
+    }
+  }
+  if (directLighting(lights) && segment.remainingBounces == 0) {
+    segment.color = segment.radiance;
+  }
+  return true;
+}
+
+/**
+ * Teaches the guide cell of the vertex that scattered `ray` with
+ * throughput `color` and density `pdf` the light `found` that way, the
+ * radiance the segment's shading added to the path.
+ */
+__host__ __device__ inline void trainPathGuide(const PathGuide & guide, const Ray & ray, float pdf,
+  glm::vec3 color, glm::vec3 found)
+{
+  const glm::vec3 luminance(0.2126f, 0.7152f, 0.0722f);
+  const float throughput = glm::dot(color, luminance);
+  if (throughput > 0.0f) {
+    guideAdd(guide, ray.origin, ray.direction, glm::dot(found, luminance) / (throughput * pdf));
+  }
+}
+
+/**
+ * Quad `quad` of materials[id] (see Material). Tables in global memory are
+ * read through the read-only data cache; ones staged in shared memory and
+ * host ones are read as they are.
+ */
+__host__ __device__ inline float4 materialQuad(const Material * materials, int id, int quad)
+{
+  const float4 * quads = reinterpret_cast<const float4 *>(materials + id) + quad;
+#ifdef __CUDA_ARCH__
+  if (__isGlobal(quads)) {
+    return __ldg(quads);
+  }
+#endif
+  return *quads;
+}
+
+/**
+ * The parts of materials[id] that shading a hit reads in a scene with the
+ * MaterialFeature bits `Features`, rather than all 64 bytes: an emitter
+ * needs only its colour and emittance, other materials their lobe weights
+ * too, the specular lobe only when they have one and the normal and
+ * roughness maps only in textured scenes. What is not fetched reads as 0,
+ * or -1 for the maps.
+ */
+template <int Features = MATERIAL_FEATURES_ALL>
+__host__ __device__ Material fetchMaterial(const Material * materials, int id)
+{
+  Material material = {};
+  float4 * quads = reinterpret_cast<float4 *>(&material);
+  quads[0] = materialQuad(materials, id, 0);
+  material.albedoMap = -1;
+  material.normalMap = -1;
+  material.roughnessMap = -1;
+  if (material.emittance > 0.0f) {
+    return material;
+  }
+  quads[1] = materialQuad(materials, id, 1);
+  if ((Features & (MATERIAL_REFLECTIVE | MATERIAL_REFRACTIVE))
+      && material.hasReflective + material.hasRefractive > 0.0f) {
+    quads[2] = materialQuad(materials, id, 2);
+  }
+  if (Features & MATERIAL_TEXTURED) {
+    quads[3] = materialQuad(materials, id, 3);
+  }
+  return material;
+}
+
+/**
+ * Shades a live segment against its intersection: lights and misses end the
+ * path, anything else scatters it. `sampler` is a SamplerType; for the
+ * random fallback `idx` seeds the RNG. Once no more than
+ * `rouletteBounces` bounces remain, scattered paths face Russian roulette:
+ * they survive with a probability following their throughput and are
+ * reweighted by its inverse, which keeps the estimate unbiased. Pass -1 to
+ * disable it.
+ *
+ * With directLighting(lights), diffuse vertices also sample a light or the
+ * environment directly (next-event estimation). `color` is then only the
+ * throughput, light gathered along the way goes to `radiance`, and a path
+ * that ends hands its radiance over as its colour; running out of bounces
+ * adds nothing. Paths that leave the scene pick up the environment's
+ * radiance, MIS-weighted when it is sampled.
+ *
+ * With lights.cache as well, rays scattered off diffuse vertices feed
+ * what they find into the radiance cache (radianceCache.h), and a path
+ * that reaches a purely diffuse surface with a filled cell, no sooner than
+ * RADIANCE_CACHE_FIRST_BOUNCE bounces in, takes the cell's radiance
+ * instead of tracing on. With lights.photons, diffuse vertices gather the
+ * caustic photons (photonMap.h), and emitters reached through specular
+ * bounces after a diffuse vertex add nothing, as the photons carry them.
+ * With lights.media, the ray may scatter in a medium on its way to the
+ * intersection instead (see scatterInMedium). With lights.guide, diffuse
+ * bounces are guided by their cell's learned CDF, and while it learns,
+ * each light-sampled vertex's cell is taught what this segment added.
+ *
+ * `Features` (MaterialFeature bits) leaves out the material features no
+ * material of the scene has, see materialFeatures().
+ */
+template <int Features = MATERIAL_FEATURES_ALL>
+__host__ __device__ void shadeSegment(
+  const ShadeableIntersection & intersection
+  , PathSegment & segment
+  , const Material * materials
+  , int rouletteBounces
+  , int sampler
+  , const LightData & lights
+  )
+{
+#ifdef __CUDA_ARCH__
+  if (lights.rayCounts != NULL) {
+    countWarpRays(lights.rayCounts,
+      glm::clamp(lights.traceDepth - segment.remainingBounces, 0, TELEMETRY_BOUNCES - 1));
+  }
+  if (lights.rayCost != NULL) {
+    atomicAdd(&lights.rayCost[lights.firstPixel + segment.pixelIndex].bounces, 1u);
+  }
+#endif
+  // The cache's samples are light-sampled diffuse bounces' rays, where
+  // scatterPdf is set; its cells include direct light, so it needs NEE on
+  const bool cached = lights.cache.keys != NULL && directLighting(lights);
+  const bool fillCache = cached && segment.scatterPdf > 0.0f;
+  // Photons bring the light of the emitters that specular bounces off a
+  // diffuse vertex (scatterPdf -1) would find, so those hits count nothing
+  const bool photons = lights.photons.positions != NULL && directLighting(lights);
+  // The radiance added from here on is what the vertex the ray left found
+  // that way, per unit of its throughput
+  const bool trainGuide = lights.guide.training != NULL && segment.scatterPdf > 0.0f;
+  const Ray arriving = segment.ray;
+  const float arrivingPdf = segment.scatterPdf;
+  const glm::vec3 arrivingColor = segment.color;
+  const glm::vec3 arrivingRadiance = segment.radiance;
+  if (lights.media.count > 0 && scatterInMedium(intersection, segment, rouletteBounces, sampler, lights)) {
+    if (trainGuide) {
+      trainPathGuide(lights.guide, arriving, arrivingPdf, arrivingColor, segment.radiance - arrivingRadiance);
+    }
+    return;
+  }
+  if (intersection.t > 0.0f) { // if the intersection exists...
+    segment.remainingBounces--;
+    countGeomHit(lights, intersection.geomIndex);
+    // Set up the RNG, keyed on pixel, sample and bounce so the result does
+    // not depend on which slot, band or device the path was traced in
+    const int pixel = lights.firstPixel + segment.pixelIndex;
+    Sampler rng = makeSampler(sampler, makeSeededRandomEngine(segment.sampleIndex, pixel, segment.remainingBounces),
+      pixel, segment.sampleIndex, segment.remainingBounces);
+
+    Material material = fetchMaterial<Features>(materials, intersection.materialId);
+    glm::vec3 materialColor = material.color;
+
+    // If the material indicates that the object was a light, "light" the ray
+    if (material.emittance > 0.0f) {
+      if (fillCache) {
+        radianceCacheAdd(lights.cache, segment.ray.origin, materialColor * material.emittance);
+      }
+      const bool photonLit = photons && segment.scatterPdf < 0.0f
+        && lights.geoms[intersection.geomIndex].lightIndex >= 0;
+      // The camera hit took its light sample from the pixel's reservoir,
+      // which carries the lights' full weight
+      const bool resampled = lights.reservoirs != NULL && segment.scatterPdf > 0.0f
+        && lights.traceDepth - 1 - segment.remainingBounces == 1
+        && lights.reservoirs[pixel].light >= 0
+        && lights.geoms[intersection.geomIndex].lightIndex >= 0;
+      if (directLighting(lights)) {
+        if (!photonLit && !resampled) {
+          segment.radiance += segment.color * (materialColor * material.emittance)
+            * emitterHitWeight(lights, intersection, segment);
+        }
+      } else {
+        segment.color *= (materialColor * material.emittance);
+      }
+      segment.remainingBounces = 0;
+    }
+    else {
+      glm::vec3 intersectPos = intersection.t * segment.ray.direction + segment.ray.origin;
+      glm::vec3 normal = intersection.surfaceNormal;
+      if ((Features & MATERIAL_TEXTURED) && hasTextureMaps(material)) {
+        applyTextureMaps(intersection, segment.ray.direction, material, normal);
+      }
+      const float hasReflective = (Features & MATERIAL_REFLECTIVE) ? material.hasReflective : 0.0f;
+      const float hasRefractive = (Features & MATERIAL_REFRACTIVE) ? material.hasRefractive : 0.0f;
+      // The diffuse lobe's share of the caustic photons' irradiance leaves
+      // towards the path, before the scatter picks a lobe
+      const float diffuseShare = 1.0f - hasReflective - hasRefractive;
+      glm::vec3 caustic(0.0f);
+      if (photons && diffuseShare > 0.0f) {
+        caustic = material.color * (diffuseShare / PI) * gatherPhotons(lights.photons, intersectPos, normal);
+        segment.radiance += segment.color * caustic;
+      }
+      // Only a purely diffuse surface leaves with albedo times its cell
+      if (cached && hasReflective <= 0.0f && hasRefractive <= 0.0f) {
+        float samples;
+        glm::vec3 incoming = radianceCacheLookup(lights.cache, intersectPos, samples);
+        if (fillCache) {
+          radianceCacheAdd(lights.cache, segment.ray.origin, material.color * incoming + caustic);
+        }
+        if (segment.scatterPdf > 0.0f && samples >= RADIANCE_CACHE_MIN_SAMPLES
+            && lights.traceDepth - 1 - segment.remainingBounces >= RADIANCE_CACHE_FIRST_BOUNCE) {
+          segment.radiance += segment.color * material.color * incoming;
+          segment.remainingBounces = 0;
+          segment.color = segment.radiance;
+          if (trainGuide) {
+            trainPathGuide(lights.guide, arriving, arrivingPdf, arrivingColor, segment.radiance - arrivingRadiance);
+          }
+          return;
+        }
+      }
+      // Light sampling only pays off, and is only weighted, on the diffuse lobe
+      const bool afterDiffuse = segment.scatterPdf != 0.0f;
+      const float * guide = directLighting(lights) ? guideDistribution(lights.guide, intersectPos) : NULL;
+      int lobe = scatterRay<Features>(segment, intersectPos, normal, intersection.frontFace, material, rng, guide);
+      // The camera hit's lobe decides whether the path's light is specular
+      if (lights.traceDepth - 1 - segment.remainingBounces == 0) {
+        segment.specularPath = lobe != LOBE_DIFFUSE;
+      }
+      bool sampleLights = directLighting(lights) && lobe == LOBE_DIFFUSE;
+      if (sampleLights) {
+        Sampler lightRng = makeSampler(sampler,
+          makeSeededRandomEngine(segment.sampleIndex, pixel, segment.remainingBounces | NEE_SEED_BIT),
+          pixel, segment.sampleIndex, segment.remainingBounces);
+        lightRng.dimension += SAMPLER_LIGHT_DIMENSION;
+        const bool cameraHit = lights.reservoirs != NULL
+          && lights.traceDepth - 1 - segment.remainingBounces == 0 && lights.reservoirs[pixel].light >= 0;
+        sampleDirectLight(lights, lightRng, intersectPos, normal, segment,
+          cameraHit ? &lights.reservoirs[pixel] : NULL, NULL, guide);
+      }
+      segment.scatterPdf = sampleLights
+        ? guidedDiffusePdf(guide, normal, segment.ray.direction)
+        : photons && afterDiffuse ? -1.0f : 0.0f;
+
+      if (segment.remainingBounces > 0 && segment.remainingBounces <= rouletteBounces) {
+        float survival = glm::min(glm::max(segment.color.r, glm::max(segment.color.g, segment.color.b)), 1.0f);
+        if (nextSample(rng) < survival) {
+          segment.color /= survival;
+        } else {
+          segment.remainingBounces = 0;
+          segment.color = glm::vec3(0.0f);
+        }
+      }
+    }
+  // If there was no intersection, the ray sees the environment (or the
+  // black background without one)
+  } else {
+    const EnvironmentLight & environment = lights.environment;
+    glm::vec3 environmentColor = environmentRadiance(environment, segment.ray.direction);
+    if (fillCache) {
+      radianceCacheAdd(lights.cache, segment.ray.origin, environmentColor);
+    }
+    if (directLighting(lights)) {
+      float weight = segment.scatterPdf > 0.0f && environment.pmf > 0.0f
+        ? powerHeuristic(segment.scatterPdf,
+          environment.pmf * environmentPdf(environment, segment.ray.direction))
+        : 1.0f;
+      segment.radiance += segment.color * environmentColor * weight;
+    } else {
+      segment.color *= environmentColor;
+    }
+    segment.remainingBounces = 0;
+  }
+
+  if (directLighting(lights) && segment.remainingBounces == 0) {
+    segment.color = segment.radiance;
+  }
+  if (trainGuide) {
+    trainPathGuide(lights.guide, arriving, arrivingPdf, arrivingColor, segment.radiance - arrivingRadiance);
+  }
+}
+
+/**
+ * Host entry points of the per-path steps above, for the CPU renderer
+ * (cpuRenderer.h): the same camera sampling, traversal and shading, run
+ * on host copies of the scene that `lights` points at.
+ */
+void hostCameraSample(const Camera &cam, float eyeSeparation, int traceDepth, int x, int y,
+		bool jitter, int sampler, PathSegment &segment) {
+	Camera eye = cam;
+	const int row = viewRow(eye, eyeSeparation, y);
+	const glm::vec3 centreDirection = cameraRayDirection(eye, (float)x, (float)row);
+	const bool thinLens = cam.lensRadius > 0.0f;
+	const bool motionBlur = cam.motion != glm::vec3(0.0f);
+	if (thinLens && motionBlur) {
+		cameraSample<true, true>(eye, traceDepth, x, row, centreDirection, jitter, sampler, segment);
+	} else if (thinLens) {
+		cameraSample<true, false>(eye, traceDepth, x, row, centreDirection, jitter, sampler, segment);
+	} else if (motionBlur) {
+		cameraSample<false, true>(eye, traceDepth, x, row, centreDirection, jitter, sampler, segment);
+	} else {
+		cameraSample<false, false>(eye, traceDepth, x, row, centreDirection, jitter, sampler, segment);
+	}
+}
+
+ShadeableIntersection hostIntersect(const Ray &ray, const LightData &lights, const Material *materials,
+		GBufferPixel *gBufferPixel) {
+	return intersectRay(ray, lights.geoms, lights.geomCount, lights.bvhNodes, lights.bvhGeomIndices,
+		lights.meshData, materials, gBufferPixel);
+}
+
+void hostShade(const ShadeableIntersection &intersection, PathSegment &segment, const Material *materials,
+		int rouletteBounces, int sampler, const LightData &lights) {
+	shadeSegment(intersection, segment, materials, rouletteBounces, sampler, lights);
+}
+
+float hostBoxIntersectionTest(const DeviceGeom &box, const Ray &ray) {
+	return boxIntersectionTest(box, ray);
+}
+
+float hostSphereIntersectionTest(const DeviceGeom &sphere, const Ray &ray) {
+	return sphereIntersectionTest(sphere, ray);
+}
+
+/**
+ * Shades the path in slot `idx` against its intersection, a hit record
+ * with `hitRecords`, and stores the updated segment back. Returns whether
+ * the path has bounces left.
+ */
+template <int Features = MATERIAL_FEATURES_ALL>
+__device__ bool shadePath(
+  int idx
+  , const ShadeableIntersections & shadeableIntersections
+  , const PathSegments & pathSegments
+  , const Material * materials
+  , int rouletteBounces
+  , int sampler
+  , const LightData & lights
+  , bool hitRecords
+  )
+{
+  if (loadRemainingBounces(pathSegments, idx) == 0) {
+    return false;
+  }
+  PathSegment segment = loadPathSegment(pathSegments, idx);
+  ShadeableIntersection intersection = hitRecords
+    ? loadHitRecord(shadeableIntersections, idx, segment.ray, lights.geoms, lights.meshData, materials)
+    : loadHit(shadeableIntersections, idx, materials);
+  shadeSegment<Features>(intersection, segment, materials, rouletteBounces, sampler, lights);
+  storePathSegment(pathSegments, idx, segment);
+  return segment.remainingBounces > 0;
+}
+
+/**
+ * Adds a finished path's colour to its pixel, and its luminance to the
+ * pixel's moments for the denoiser's variance estimate. Several samples of
+ * a pixel land in the same entries, hence `atomic`.
+ */
+// Adds a path's colour, and its luminance's moments, to its pixel, each
+// weighed by `weight`: 1 / PathtraceOptions::pathSplit for split paths,
+// whose squared luminance then stands for the sample's, conservatively
+__device__ void addToPixel(float4 colorPixel, float4 * image, glm::vec2 * moments, bool atomic,
+  float weight = 1.0f)
+{
+  int pixel = __float_as_int(colorPixel.w);
+  glm::vec3 color = unpackVec3(colorPixel);
+  float luminance = glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+  const glm::vec2 moment = glm::vec2(luminance, luminance * luminance) * weight;
+  color *= weight;
+  if (atomic) {
+    atomicAdd(&image[pixel].x, color.x);
+    atomicAdd(&image[pixel].y, color.y);
+    atomicAdd(&image[pixel].z, color.z);
+    atomicAdd(&moments[pixel].x, moment.x);
+    atomicAdd(&moments[pixel].y, moment.y);
+  } else {
+    float4 sum = image[pixel];
+    image[pixel] = make_float4(sum.x + color.x, sum.y + color.y, sum.z + color.z, sum.w);
+    moments[pixel] += moment;
+  }
+}
+
+/**
+ * Split pipeline shade stage, over the live paths only. With `image` set,
+ * paths that end here are added to it at once rather than by finalGather,
+ * so compaction can drop them. A variant is built for every combination of
+ * `Features`; see shadeKernel().
+ */
+template <int Features>
+__global__ void __launch_bounds__(LAUNCH_MAX_BLOCK_SIZE) shadeSimpleMaterials (
+  int num_paths
+	, ShadeableIntersections shadeableIntersections
+	, PathSegments pathSegments
+	, const Material * materials
+	, int num_materials
+	, bool stageMaterials
+	, int rouletteBounces
+	, int sampler
+	, LightData lights
+	, float4 * image
+	, glm::vec2 * moments
+	, bool atomic
+	, bool hitRecords
+	)
+{
+  extern __shared__ int s_materialStage[];
+  materials = stageToShared(materials, num_materials,
+    stageMaterials ? reinterpret_cast<Material *>(s_materialStage) : NULL);
+
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx < num_paths)
+  {
+    bool alive = shadePath<Features>(idx, shadeableIntersections, pathSegments, materials, rouletteBounces,
+      sampler, lights, hitRecords);
+    if (!alive && image != NULL) {
+      addToPixel(loadColorPixel(pathSegments, idx), image, moments, atomic);
+    }
+  }
+}
+
+typedef void (*ShadeKernel)(int, ShadeableIntersections, PathSegments, const Material *, int, bool, int,
+	int, LightData, float4 *, glm::vec2 *, bool, bool);
+
+// The shadeSimpleMaterials variant compiled for the MaterialFeature bits `features`
+static ShadeKernel shadeKernel(int features) {
+	switch (features) {
+	case 0: return shadeSimpleMaterials<0>;
+	case 1: return shadeSimpleMaterials<1>;
+	case 2: return shadeSimpleMaterials<2>;
+	case 3: return shadeSimpleMaterials<3>;
+	case 4: return shadeSimpleMaterials<4>;
+	case 5: return shadeSimpleMaterials<5>;
+	case 6: return shadeSimpleMaterials<6>;
+	default: return shadeSimpleMaterials<MATERIAL_FEATURES_ALL>;
+	}
+}
+
+/**
+ * Fixed-depth variants of computeIntersections and shadeSimpleMaterials for
+ * PIPELINE_GRAPH. Every slot is launched every bounce and finished paths
+ * return early, so the launch sequence never depends on a host read.
+ * Samples are seeded by their sample number, stored with the path, so one
+ * captured graph can be replayed for every iteration.
+ */
+__global__ void computeIntersectionsFixed(
+	int depth
+	, int num_paths
+	, PathSegments pathSegments
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, bool stageGeoms
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, MeshData meshData
+	, Material * materials
+	, ShadeableIntersections intersections
+	, GBufferPixel * gBuffer
+	)
+{
+	extern __shared__ int s_geomStage[];
+	geoms = stageToShared(geoms, geoms_size,
+		stageGeoms ? reinterpret_cast<DeviceGeom *>(s_geomStage) : NULL);
+
+	int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+
+	if (path_index < num_paths && loadRemainingBounces(pathSegments, path_index) > 0)
+	{
+		intersectPath(path_index, depth, pathSegments, geoms, geoms_size,
+			bvhNodes, bvhGeomIndices, meshData, materials, intersections, gBuffer);
+	}
+}
+
+__global__ void shadeFixedDepth(
+  int num_paths
+	, ShadeableIntersections shadeableIntersections
+	, PathSegments pathSegments
+	, const Material * materials
+	, int num_materials
+	, bool stageMaterials
+	, int rouletteBounces
+	, int sampler
+	, LightData lights
+	)
+{
+  extern __shared__ int s_materialStage[];
+  materials = stageToShared(materials, num_materials,
+    stageMaterials ? reinterpret_cast<Material *>(s_materialStage) : NULL);
+
+  int idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (idx < num_paths)
+  {
+    shadePath(idx, shadeableIntersections, pathSegments, materials, rouletteBounces, sampler, lights, false);
+  }
+}
+
+/**
+ * Fused pipeline: each thread intersects and shades its path bounce after
+ * bounce with the hit kept in registers, so there is one launch per
+ * iteration and no intersection buffer traffic. Geoms and materials share
+ * the dynamic shared memory, geoms first. Divergent path lengths idle the
+ * finished lanes, hence only worth it for shallow scenes.
+ */
+__global__ void __launch_bounds__(LAUNCH_MAX_BLOCK_SIZE) pathtraceMegakernel(
+	int num_paths
+	, PathSegments pathSegments
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, bool stageGeoms
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, MeshData meshData
+	, const Material * materials
+	, int num_materials
+	, bool stageMaterials
+	, int rouletteBounces
+	, int sampler
+	, LightData lights
+	, ShadeableIntersections firstBounceCache
+	, bool readFirstBounce
+	, bool writeFirstBounce
+	, GBufferPixel * gBuffer
+	)
+{
+	extern __shared__ int s_megakernelStage[];
+	int * materialStage = s_megakernelStage;
+	if (stageGeoms) {
+		materialStage += geoms_size * sizeof(DeviceGeom) / sizeof(int);
+	}
+	geoms = stageToShared(geoms, geoms_size,
+		stageGeoms ? reinterpret_cast<DeviceGeom *>(s_megakernelStage) : NULL);
+	materials = stageToShared(materials, num_materials,
+		stageMaterials ? reinterpret_cast<Material *>(materialStage) : NULL);
+	// Shadow rays can use the staged geoms too
+	lights.geoms = geoms;
+
+	int idx = blockIdx.x * blockDim.x + threadIdx.x;
+	if (idx < num_paths)
+	{
+		PathSegment segment = loadPathSegment(pathSegments, idx);
+
+		for (int depth = 0; segment.remainingBounces > 0; depth++)
+		{
+			ShadeableIntersection intersection;
+			if (depth == 0 && readFirstBounce)
+			{
+				intersection = loadHit(firstBounceCache, idx, materials);
+			}
+			else
+			{
+				intersection = intersectRay(segment.ray, geoms, geoms_size, bvhNodes, bvhGeomIndices,
+					meshData, materials, depth == 0 && gBuffer != NULL && segment.pixelIndex == idx
+					? &gBuffer[segment.pixelIndex] : NULL);
+				if (depth == 0 && writeFirstBounce)
+				{
+					storeHit(firstBounceCache, idx, intersection, materials);
+				}
+			}
+			shadeSegment(intersection, segment, materials, rouletteBounces, sampler, lights);
+		}
+
+		storePathSegment(pathSegments, idx, segment);
+	}
+}
+
+/**
+ * Cooperative pipeline: every bounce of the iteration in one launch of a
+ * grid that fits on the GPU at once. Each bounce runs the split pipeline's
+ * two stages as grid-stride loops over every slot, with a grid-wide sync
+ * where the split pipeline would end a kernel, so the intersections still
+ * go through dev_intersections but no bounce costs a launch. Like the
+ * graph there is no compaction; instead each block counts its survivors
+ * into `live`, and the grid stops as soon as a bounce leaves none.
+ * Needs a cooperative launch, see traceCooperative().
+ */
+__global__ void __launch_bounds__(COOPERATIVE_BLOCK_SIZE) traceCooperativeGrid(
+	int num_paths
+	, int traceDepth
+	, PathSegments pathSegments
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, bool stageGeoms
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, MeshData meshData
+	, const Material * materials
+	, int num_materials
+	, bool stageMaterials
+	, int rouletteBounces
+	, int sampler
+	, LightData lights
+	, ShadeableIntersections intersections
+	, ShadeableIntersections firstBounceCache
+	, bool readFirstBounce
+	, bool writeFirstBounce
+	, GBufferPixel * gBuffer
+	, int * live
+	)
+{
+	cooperative_groups::grid_group grid = cooperative_groups::this_grid();
+	extern __shared__ int s_cooperativeStage[];
+	int * materialStage = s_cooperativeStage;
+	if (stageGeoms) {
+		materialStage += geoms_size * sizeof(DeviceGeom) / sizeof(int);
+	}
+	geoms = stageToShared(geoms, geoms_size,
+		stageGeoms ? reinterpret_cast<DeviceGeom *>(s_cooperativeStage) : NULL);
+	materials = stageToShared(materials, num_materials,
+		stageMaterials ? reinterpret_cast<Material *>(materialStage) : NULL);
+	lights.geoms = geoms;
+
+	const int first = blockIdx.x * blockDim.x + threadIdx.x;
+	const int stride = gridDim.x * blockDim.x;
+	for (int depth = 0; depth < traceDepth; depth++)
+	{
+		const ShadeableIntersections & bounceIntersections =
+			depth == 0 && (readFirstBounce || writeFirstBounce) ? firstBounceCache : intersections;
+		// Last read two bounces ago, so nobody is still looking at it
+		if (first == 0)
+		{
+			live[(depth + 1) % 3] = 0;
+		}
+		if (depth > 0 || !readFirstBounce)
+		{
+			for (int idx = first; idx < num_paths; idx += stride)
+			{
+				if (loadRemainingBounces(pathSegments, idx) > 0)
+				{
+					intersectPath(idx, depth, pathSegments, geoms, geoms_size,
+						bvhNodes, bvhGeomIndices, meshData, materials, bounceIntersections, gBuffer);
+				}
+			}
+		}
+		grid.sync();
+
+		int survivors = 0;
+		for (int idx = first; idx < num_paths; idx += stride)
+		{
+			survivors += shadePath(idx, bounceIntersections, pathSegments, materials, rouletteBounces,
+				sampler, lights, false);
+		}
+		if (__syncthreads_or(survivors) && threadIdx.x == 0)
+		{
+			atomicAdd(&live[depth % 3], 1);
+		}
+		grid.sync();
+		if (*(volatile int *)&live[depth % 3] == 0)
+		{
+			break;
+		}
+	}
+}
+
+/**
+ * Reserves the next batch of up to a warp's worth of queued entries, never
+ * past the tail, so every entry reserved already has a producer. Returns
+ * the batch size, or 0 once every path has ended.
+ */
+__device__ int dequeuePaths(PathQueue * queue, int & first)
+{
+	volatile PathQueue * counters = queue;
+	while (true)
+	{
+		int head = counters->head;
+		int queued = counters->tail - head;
+		if (queued <= 0)
+		{
+			if (counters->live == 0)
+			{
+				return 0;
+			}
+			continue;
+		}
+		int count = min(queued, WARP_SIZE);
+		if (atomicCAS(&queue->head, head, head + count) == head)
+		{
+			first = head;
+			return count;
+		}
+	}
+}
+
+/**
+ * Persistent pipeline: a grid that only fills the GPU once, whose warps
+ * pull path slots from a lock-free ring buffer until every path has ended.
+ * Each entry is one bounce, intersected and shaded with the hit kept in
+ * registers; survivors go back on the tail with one atomicAdd per warp.
+ * So no bounce costs a launch or a host read, and warps that draw short
+ * paths simply take more. Free entries hold -1: a consumer empties one
+ * with atomicExch and a producer fills it with atomicCAS, each spinning
+ * until the other side is done with it, which needs every block resident.
+ * With telemetry on, the last warp out adds the launch's load balance.
+ */
+__global__ void __launch_bounds__(PERSISTENT_BLOCK_SIZE) tracePersistentQueue(
+	int * ring
+	, int capacity
+	, PathQueue * queue
+	, PathSegments pathSegments
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, bool stageGeoms
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, MeshData meshData
+	, const Material * materials
+	, int num_materials
+	, bool stageMaterials
+	, int rouletteBounces
+	, int sampler
+	, LightData lights
+	, ShadeableIntersections firstBounceCache
+	, bool readFirstBounce
+	, bool writeFirstBounce
+	, GBufferPixel * gBuffer
+	)
+{
+	extern __shared__ int s_queueStage[];
+	int * materialStage = s_queueStage;
+	if (stageGeoms) {
+		materialStage += geoms_size * sizeof(DeviceGeom) / sizeof(int);
+	}
+	geoms = stageToShared(geoms, geoms_size,
+		stageGeoms ? reinterpret_cast<DeviceGeom *>(s_queueStage) : NULL);
+	materials = stageToShared(materials, num_materials,
+		stageMaterials ? reinterpret_cast<Material *>(materialStage) : NULL);
+	lights.geoms = geoms;
+
+	const int lane = threadIdx.x & (WARP_SIZE - 1);
+	unsigned int bounces = 0;
+	while (true)
+	{
+		int first = 0;
+		int count = 0;
+		if (lane == 0)
+		{
+			count = dequeuePaths(queue, first);
+		}
+		count = __shfl_sync(0xffffffff, count, 0);
+		first = __shfl_sync(0xffffffff, first, 0);
+		if (count == 0)
+		{
+			break;
+		}
+
+		int slot = -1;
+		if (lane < count)
+		{
+			int entry = (first + lane) % capacity;
+			while ((slot = atomicExch(&ring[entry], -1)) < 0) {}
+		}
+		bool alive = false;
+		if (slot >= 0)
+		{
+			PathSegment segment = loadPathSegmentCoherent(pathSegments, slot);
+			int depth = lights.traceDepth - segment.remainingBounces;
+			ShadeableIntersection intersection;
+			if (depth == 0 && readFirstBounce)
+			{
+				intersection = loadHit(firstBounceCache, slot, materials);
+			}
+			else
+			{
+				intersection = intersectRay(segment.ray, geoms, geoms_size, bvhNodes, bvhGeomIndices,
+					meshData, materials, depth == 0 && gBuffer != NULL && segment.pixelIndex == slot
+					? &gBuffer[segment.pixelIndex] : NULL);
+				if (depth == 0 && writeFirstBounce)
+				{
+					storeHit(firstBounceCache, slot, intersection, materials);
+				}
+			}
+			shadeSegment(intersection, segment, materials, rouletteBounces, sampler, lights);
+			storePathSegment(pathSegments, slot, segment);
+			alive = segment.remainingBounces > 0;
+			bounces++;
+		}
+		// The segments have to be visible before their slots are
+		__threadfence();
+
+		unsigned int ballot = __ballot_sync(0xffffffff, alive);
+		int base = 0;
+		if (lane == 0)
+		{
+			if (ballot != 0)
+			{
+				base = atomicAdd(&queue->tail, __popc(ballot));
+			}
+			if (count > __popc(ballot))
+			{
+				atomicSub(&queue->live, count - __popc(ballot));
+			}
+		}
+		base = __shfl_sync(0xffffffff, base, 0);
+		if (alive)
+		{
+			int entry = (base + __popc(ballot & ((1u << lane) - 1))) % capacity;
+			while (atomicCAS(&ring[entry], -1, slot) != -1) {}
+		}
+	}
+
+	if (lights.rayCounts == NULL)
+	{
+		return;
+	}
+	for (int offset = WARP_SIZE / 2; offset > 0; offset /= 2)
+	{
+		bounces += __shfl_down_sync(0xffffffff, bounces, offset);
+	}
+	if (lane == 0)
+	{
+		atomicMin(&queue->warpMin, bounces);
+		atomicMax(&queue->warpMax, bounces);
+		atomicAdd(&queue->warpTotal, bounces);
+		__threadfence();
+		const int warps = gridDim.x * blockDim.x / WARP_SIZE;
+		if (atomicAdd(&queue->warpsDone, 1) == warps - 1)
+		{
+			volatile PathQueue * counters = queue;
+			unsigned long long * counts = lights.rayCounts + RAY_COUNT_QUEUE;
+			atomicAdd(&counts[0], 1ull);
+			atomicAdd(&counts[1], (unsigned long long)warps);
+			atomicAdd(&counts[2], (unsigned long long)counters->warpMin);
+			atomicAdd(&counts[3], (unsigned long long)counters->warpMax);
+			atomicAdd(&counts[4], (unsigned long long)counters->warpTotal);
+		}
+	}
+}
+
+// The calculator's pick for `kernel`, up to LAUNCH_MAX_BLOCK_SIZE, or 128
+// if it fails; a positive `blockSize` is taken as it is
+template <typename Kernel>
+static KernelLaunch chooseLaunch(Kernel kernel, int sharedBytes, const cudaDeviceProp &prop,
+		int blockSize = 0) {
+	KernelLaunch launch = { std::min(blockSize, LAUNCH_MAX_BLOCK_SIZE), 0.0f };
+	int minGridSize = 0;
+	if (launch.blockSize <= 0 && (cudaOccupancyMaxPotentialBlockSize(&minGridSize, &launch.blockSize,
+			kernel, sharedBytes, LAUNCH_MAX_BLOCK_SIZE) != cudaSuccess || launch.blockSize <= 0)) {
+		cudaGetLastError();
+		launch.blockSize = 128;
+	}
+	int blocksPerSM = 0;
+	cudaOccupancyMaxActiveBlocksPerMultiprocessor(&blocksPerSM, kernel, launch.blockSize, sharedBytes);
+	launch.occupancy = (float)(blocksPerSM * launch.blockSize) / prop.maxThreadsPerMultiProcessor;
+	return launch;
+}
+
+static void chooseLaunchConfiguration() {
+	int device = 0;
+	cudaDeviceProp prop;
+	cudaGetDevice(&device);
+	cudaGetDeviceProperties(&prop, device);
+	snprintf(launchConfig.device, sizeof(launchConfig.device), "%s", prop.name);
+	launchConfig.computeCapability = prop.major * 10 + prop.minor;
+	launchConfig.multiprocessors = prop.multiProcessorCount;
+	launchConfig.cooperativeLaunch = prop.cooperativeLaunch != 0;
+	launchConfig.intersect = chooseLaunch(computeIntersections, sharedGeomBytes, prop, intersectBlockOverride);
+	launchConfig.hitRecords = chooseLaunch(computeHitRecords, sharedGeomBytes, prop, intersectBlockOverride);
+	launchConfig.shade = chooseLaunch(shadeSimpleMaterials<MATERIAL_FEATURES_ALL>, sharedMaterialBytes, prop,
+		shadeBlockOverride);
+	launchConfig.megakernel = chooseLaunch(pathtraceMegakernel, sharedGeomBytes + sharedMaterialBytes, prop);
+	checkCUDAError("choose launch configuration");
+}
+
+const LaunchConfiguration &pathtraceLaunchConfiguration() {
+	return launchConfig;
+}
+
+void pathtraceOverrideBlockSizes(int intersect, int shade) {
+	if (intersect == intersectBlockOverride && shade == shadeBlockOverride) {
+		return;
+	}
+	intersectBlockOverride = intersect;
+	shadeBlockOverride = shade;
+	// Before pathtraceInit the first scene's binding picks them up
+	if (launchConfig.multiprocessors > 0) {
+		chooseLaunchConfiguration();
+	}
+}
+
+/**
+ * Wavefront shade stage: shades the queued path slots and appends the ones
+ * still alive to `nextQueue`, with one atomic per warp. Every thread of a
+ * warp has to reach the ballot, so there is no early exit.
+ */
+__global__ void shadeQueued (
+  const int * queue
+  , int queueLength
+  , int * nextQueue
+  , int * nextQueueLength
+  , ShadeableIntersections shadeableIntersections
+  , PathSegments pathSegments
+  , const Material * materials
+  , int num_materials
+  , bool stageMaterials
+  , int rouletteBounces
+  , int sampler
+  , LightData lights
+  )
+{
+  extern __shared__ int s_queuedMaterialStage[];
+  materials = stageToShared(materials, num_materials,
+    stageMaterials ? reinterpret_cast<Material *>(s_queuedMaterialStage) : NULL);
+
+  int entry = blockIdx.x * blockDim.x + threadIdx.x;
+  int slot = entry < queueLength ? queue[entry] : -1;
+  bool alive = slot >= 0 && shadePath(slot, shadeableIntersections, pathSegments,
+    materials, rouletteBounces, sampler, lights, false);
+
+  const int lane = threadIdx.x & (WARP_SIZE - 1);
+  unsigned int ballot = __ballot_sync(0xffffffff, alive);
+  int base = 0;
+  if (lane == 0 && ballot != 0) {
+    base = atomicAdd(nextQueueLength, __popc(ballot));
+  }
+  base = __shfl_sync(0xffffffff, base, 0);
+  if (alive) {
+    nextQueue[base + __popc(ballot & ((1u << lane) - 1))] = slot;
+  }
+}
+
+// Sort keys for material-coherent shading. Misses get the key past the last
+// material so they end up together at the back. Hit records hold the geom,
+// whose material is looked up in `geoms`, NULL for whole intersections;
+// cloud spheres with materials of their own sort by their geom's.
+__global__ void kernMaterialSortKeys(int num_paths, int num_materials,
+	ShadeableIntersections intersections, const DeviceGeom * geoms, unsigned int * keys, int * order)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < num_paths)
+	{
+		float2 tMaterial = intersections.tMaterial[index];
+		int id = __float_as_int(tMaterial.y);
+		if (geoms != NULL && tMaterial.x > 0.0f)
+		{
+			id = geoms[id].materialid;
+		}
+		keys[index] = tMaterial.x > 0.0f ? id : num_materials;
+		order[index] = index;
+	}
+}
+
+// Ray sort keys: Morton order of the origin's cell in the scene box, then
+// the direction's cell, RAY_SORT_ORIGIN_BITS and 2 bits per axis
+#define RAY_SORT_ORIGIN_BITS 5
+#define RAY_SORT_KEY_BITS (3 * RAY_SORT_ORIGIN_BITS + 6)
+// Bounces with fewer live paths than this are not worth sorting
+#define RAY_SORT_MIN_PATHS 65536
+
+__global__ void kernRaySortKeys(int num_paths, PathSegments paths, const BVHNode * bvhNodes,
+	int geomCount, unsigned int * keys, int * order)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < num_paths)
+	{
+		glm::vec3 boxMin(-1.0f);
+		glm::vec3 boxMax(1.0f);
+		if (geomCount > 0) {
+			boxMin = bvhNodes[0].bboxMin;
+			boxMax = bvhNodes[0].bboxMax;
+		}
+		const float cells = (float)(1 << RAY_SORT_ORIGIN_BITS);
+		const Ray ray = loadRay(paths, index);
+		glm::vec3 unit = (ray.origin - boxMin) / glm::max(boxMax - boxMin, glm::vec3(1e-20f));
+		glm::uvec3 cell = glm::uvec3(glm::clamp(unit * cells, glm::vec3(0.0f), glm::vec3(cells - 1.0f)));
+		glm::vec3 direction = ray.direction;
+		glm::uvec3 octant = glm::uvec3(glm::clamp((direction + 1.0f) * 2.0f, glm::vec3(0.0f), glm::vec3(3.0f)));
+
+		unsigned int originCode = (LBVH::expandBits(cell.x) << 2) | (LBVH::expandBits(cell.y) << 1)
+			| LBVH::expandBits(cell.z);
+		unsigned int directionCode = (LBVH::expandBits(octant.x) << 2) | (LBVH::expandBits(octant.y) << 1)
+			| LBVH::expandBits(octant.z);
+		keys[index] = (originCode << 6) | directionCode;
+		order[index] = index;
+	}
+}
+
+__global__ void kernGatherPaths(int num_paths, const int * order,
+	PathSegments pathsIn, PathSegments pathsOut)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < num_paths)
+	{
+		copyPathSegment(pathsOut, index, pathsIn, order[index]);
+	}
+}
+
+// Hit records only move their 16 bytes
+__global__ void kernGatherIntersections(int num_paths, const int * order,
+	ShadeableIntersections intersectionsIn, ShadeableIntersections intersectionsOut, bool hitRecords)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < num_paths)
+	{
+		if (hitRecords)
+		{
+			copyHitRecord(intersectionsOut, index, intersectionsIn, order[index]);
+		}
+		else
+		{
+			copyIntersection(intersectionsOut, index, intersectionsIn, order[index]);
+		}
+	}
+}
+
+/**
+ * Path splitting: the first `n` paths, at their camera hits, each go on as
+ * `split` paths in slots i, n + i, .. (split - 1) * n + i, their hit copied
+ * along. Copy c takes sample number sampleIndex * split + c, marked with
+ * PATH_SPLIT_SAMPLE_BIT, so the copies shade and scatter apart.
+ */
+__global__ void kernSplitPaths(int n, int split, PathSegments paths, ShadeableIntersections intersections,
+	bool hitRecords)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < n)
+	{
+		PathSegment segment = loadPathSegment(paths, index);
+		const int first = segment.sampleIndex * split;
+		// The path's own slot last, as the others copy its hit
+		for (int c = split - 1; c >= 0; c--)
+		{
+			segment.sampleIndex = (int)((unsigned int)(first + c) | PATH_SPLIT_SAMPLE_BIT);
+			storePathSegment(paths, c * n + index, segment);
+			if (c > 0 && hitRecords)
+			{
+				copyHitRecord(intersections, c * n + index, intersections, index);
+			}
+			else if (c > 0)
+			{
+				copyIntersection(intersections, c * n + index, intersections, index);
+			}
+		}
+	}
+}
+
+// Flags paths that still have bounces left, for stream compaction
+__global__ void kernFlagLivePaths(int num_paths, PathSegments pathSegments, int * flags)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < num_paths)
+	{
+		flags[index] = loadRemainingBounces(pathSegments, index) > 0;
+	}
+}
+
+// Adaptive sampling: camera paths of unconverged pixels are kept
+__global__ void kernFlagActivePaths(int num_paths, PathSegments pathSegments,
+	const unsigned char * converged, int * flags)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < num_paths)
+	{
+		int pixel = loadPixelIndex(pathSegments, index);
+		flags[index] = !converged[pixel];
+	}
+}
+
+// Halves the cells of the radiance cache past RADIANCE_CACHE_MAX_SAMPLES samples
+__global__ void kernDecayRadianceCache(int n, float4 * cells)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < n)
+	{
+		float4 c = cells[index];
+		if (c.w > RADIANCE_CACHE_MAX_SAMPLES)
+		{
+			cells[index] = make_float4(c.x * 0.5f, c.y * 0.5f, c.z * 0.5f, c.w * 0.5f);
+		}
+	}
+}
+
+/**
+ * Readies the radiance cache for a launch: allocated on first use, cleared
+ * and sized to the scene after a scene change, and its full cells decayed.
+ */
+static void prepareRadianceCache() {
+	if (radianceCache.keys == NULL) {
+		deviceMemory::allocate(&radianceCache.keys, RADIANCE_CACHE_CELLS * sizeof(unsigned int));
+		deviceMemory::allocate(&radianceCache.cells, RADIANCE_CACHE_CELLS * sizeof(float4));
+		radianceCache.mask = RADIANCE_CACHE_CELLS - 1;
+		radianceCacheValid = false;
+	}
+	if (!radianceCacheValid) {
+		// The host BVH's root bounds the scene, even when the GPU builds its own
+		const std::vector<BVHNode> &nodes = hst_scene->bvhNodes;
+		const float diagonal = nodes.empty() ? 1.0f : glm::length(nodes[0].bboxMax - nodes[0].bboxMin);
+		radianceCache.cellSize = fmaxf(diagonal, 1e-3f) / RADIANCE_CACHE_RESOLUTION;
+		waitForDisplay();
+		cudaMemset(radianceCache.keys, 0, RADIANCE_CACHE_CELLS * sizeof(unsigned int));
+		cudaMemset(radianceCache.cells, 0, RADIANCE_CACHE_CELLS * sizeof(float4));
+		radianceCacheValid = true;
+	}
+	const int blockSize1d = 128;
+	kernDecayRadianceCache<<<(RADIANCE_CACHE_CELLS + blockSize1d - 1) / blockSize1d, blockSize1d>>>(
+		RADIANCE_CACHE_CELLS, radianceCache.cells);
+	checkCUDAError("prepare radiance cache");
+}
+
+/**
+ * Rebuilds the CDF of each of the `n` guide cells from what it has learned
+ * (see guiding.h), and halves the sums of the cells that are full. Cells
+ * with too few samples get an all-zero CDF, which guides nothing.
+ */
+__global__ void kernBuildPathGuide(int n, float * training, float * distributions)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < n)
+	{
+		float * bins = training + index * GUIDE_RECORD;
+		float * cdf = distributions + index * GUIDE_RECORD;
+		const float samples = bins[GUIDE_BINS];
+		float total = 0.0f;
+		for (int b = 0; b < GUIDE_BINS; b++) {
+			total += bins[b];
+		}
+		if (samples < GUIDE_MIN_SAMPLES || !(total > 0.0f)) {
+			cdf[GUIDE_BINS] = 0.0f;
+			return;
+		}
+		cdf[0] = 0.0f;
+		for (int b = 0; b < GUIDE_BINS; b++) {
+			cdf[b + 1] = cdf[b] + (1.0f - GUIDE_UNIFORM) * bins[b] / total + GUIDE_UNIFORM / GUIDE_BINS;
+		}
+		cdf[GUIDE_BINS] = 1.0f;
+		if (samples > GUIDE_MAX_SAMPLES) {
+			for (int b = 0; b <= GUIDE_BINS; b++) {
+				bins[b] *= 0.5f;
+			}
+		}
+	}
+}
+
+/**
+ * Readies the path guide for a launch: allocated on first use, cleared and
+ * sized to the scene after a scene change, and its CDFs rebuilt from what
+ * the launches before learned, until GUIDE_TRAINING_LAUNCHES have.
+ */
+static void preparePathGuide() {
+	if (pathGuide.keys == NULL) {
+		deviceMemory::allocate(&pathGuide.keys, GUIDE_CELLS * sizeof(unsigned int));
+		deviceMemory::allocate(&dev_guideTraining, GUIDE_CELLS * GUIDE_RECORD * sizeof(float));
+		deviceMemory::allocate(&dev_guideDistributions, GUIDE_CELLS * GUIDE_RECORD * sizeof(float));
+		pathGuide.distributions = dev_guideDistributions;
+		pathGuide.mask = GUIDE_CELLS - 1;
+		pathGuideValid = false;
+	}
+	if (!pathGuideValid) {
+		const std::vector<BVHNode> &nodes = hst_scene->bvhNodes;
+		const float diagonal = nodes.empty() ? 1.0f : glm::length(nodes[0].bboxMax - nodes[0].bboxMin);
+		pathGuide.cellSize = fmaxf(diagonal, 1e-3f) / GUIDE_RESOLUTION;
+		waitForDisplay();
+		cudaMemset(pathGuide.keys, 0, GUIDE_CELLS * sizeof(unsigned int));
+		cudaMemset(dev_guideTraining, 0, GUIDE_CELLS * GUIDE_RECORD * sizeof(float));
+		cudaMemset(dev_guideDistributions, 0, GUIDE_CELLS * GUIDE_RECORD * sizeof(float));
+		pathGuideLaunches = 0;
+		pathGuideValid = true;
+	}
+	if (pathGuideLaunches <= GUIDE_TRAINING_LAUNCHES) {
+		const int blockSize1d = 128;
+		kernBuildPathGuide<<<(GUIDE_CELLS + blockSize1d - 1) / blockSize1d, blockSize1d>>>(
+			GUIDE_CELLS, dev_guideTraining, dev_guideDistributions);
+		checkCUDAError("prepare path guide");
+	}
+	pathGuide.training = pathGuideLaunches < GUIDE_TRAINING_LAUNCHES ? dev_guideTraining : NULL;
+	pathGuideLaunches = std::min(pathGuideLaunches + 1, GUIDE_TRAINING_LAUNCHES + 1);
+}
+
+/**
+ * Traces photon `index` of `n` from Scene::lights, picked by power, from a
+ * uniform point on the light and a cosine-distributed direction off either
+ * side. Photons follow specular bounces, and are stored, with the flux
+ * they carry, at every surface with a diffuse lobe they reach after at
+ * least one; diffuse bounces end them. The Sobol sequence over the photon
+ * index stratifies the emission.
+ */
+__global__ void kernEmitPhotons(int n, int traceDepth, LightData lights, const Material * materials,
+	float4 * positions, float4 * power, int * count, int capacity)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index >= n)
+	{
+		return;
+	}
+
+	Sampler emission = makeSampler(SAMPLER_SOBOL, makeSeededRandomEngine(index, 0, traceDepth), 0, index,
+		traceDepth);
+	// The lights' pmfs leave the environment its share of the light samples
+	const float lightsPmf = lights.lights[lights.count - 1].cdf;
+	float pick = nextSample(emission) * lightsPmf;
+	float u0 = nextSample(emission);
+	float u1 = nextSample(emission);
+	float u2 = nextSample(emission);
+	float u3 = nextSample(emission);
+	float u4 = nextSample(emission);
+	float side = nextSample(emission);
+	const Light & light = lights.lights[pickLight(lights, pick)];
+	glm::vec3 point;
+	glm::vec3 normal;
+	sampleLightPoint(light, u0, u1, u2, point, normal);
+	glm::vec3 direction = samplePowerCosine(side < 0.5f ? normal : -normal, 1.0f, u3, u4);
+
+	// Flux of radiance over area, the cosine-weighted hemisphere (pi) and
+	// both sides, per photon emitted
+	PathSegment photon;
+	photon.ray.origin = point + direction * 0.0001f;
+	photon.ray.direction = direction;
+	photon.ray.coneWidth = 0.0f;
+	photon.ray.coneSpread = 0.0f;
+	photon.color = light.radiance * (2.0f * PI * light.area * lightsPmf / (light.pmf * n));
+
+	for (int depth = 0; depth < traceDepth; depth++)
+	{
+		ShadeableIntersection hit = intersectRay(photon.ray, lights.geoms, lights.geomCount, lights.bvhNodes,
+			lights.bvhGeomIndices, lights.meshData, materials, NULL);
+		if (!(hit.t > 0.0f))
+		{
+			return;
+		}
+		Material material = fetchMaterial(materials, hit.materialId);
+		if (material.emittance > 0.0f)
+		{
+			return;
+		}
+		glm::vec3 hitPoint = photon.ray.origin + hit.t * photon.ray.direction;
+		glm::vec3 hitNormal = hit.surfaceNormal;
+		if (hasTextureMaps(material))
+		{
+			applyTextureMaps(hit, photon.ray.direction, material, hitNormal);
+		}
+		// Every bounce before this one was specular
+		if (depth > 0 && material.hasReflective + material.hasRefractive < 1.0f)
+		{
+			int slot = atomicAdd(count, 1);
+			if (slot < capacity)
+			{
+				positions[slot] = make_float4(hitPoint.x, hitPoint.y, hitPoint.z, 0.0f);
+				power[slot] = make_float4(photon.color.r, photon.color.g, photon.color.b, 0.0f);
+			}
+		}
+		Sampler rng = makeSampler(SAMPLER_SOBOL, makeSeededRandomEngine(index, 0, depth), 0, index, depth);
+		if (scatterRay(photon, hitPoint, hitNormal, hit.frontFace, material, rng) == LOBE_DIFFUSE)
+		{
+			return;
+		}
+	}
+}
+
+// Keys of the photons' buckets, and the identity order for the sort to permute
+__global__ void kernPhotonKeys(int n, PhotonGrid grid, const float4 * positions, unsigned int * keys,
+	int * order)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index < n)
+	{
+		float4 p = positions[index];
+		keys[index] = photonBucket(grid, glm::vec3(p.x, p.y, p.z));
+		order[index] = index;
+	}
+}
+
+// Gathers the photons into bucket order and marks where each bucket's run starts and ends
+__global__ void kernPhotonCells(int n, const unsigned int * keys, const int * order,
+	const float4 * positions, const float4 * power, float4 * sortedPositions, float4 * sortedPower,
+	unsigned int * cellStart, unsigned int * cellEnd)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index < n)
+	{
+		sortedPositions[index] = positions[order[index]];
+		sortedPower[index] = power[order[index]];
+		unsigned int key = keys[index];
+		if (index == 0 || keys[index - 1] != key)
+		{
+			cellStart[key] = index;
+		}
+		if (index == n - 1 || keys[index + 1] != key)
+		{
+			cellEnd[key] = index + 1;
+		}
+	}
+}
+
+/**
+ * Emits PHOTON_COUNT photons into the photon map and sorts the stored ones
+ * into their grid, with a gather radius sized to the scene. Only needed
+ * again once the scene changes.
+ */
+static void buildPhotonMap(const MeshData & meshData) {
+	NvtxRange photonRange("photon map");
+	if (dev_photonPositions == NULL) {
+		deviceMemory::allocate(&dev_photonPositions, PHOTON_COUNT * sizeof(float4));
+		deviceMemory::allocate(&dev_photonPower, PHOTON_COUNT * sizeof(float4));
+		deviceMemory::allocate(&dev_photonCellStart, (1u << PHOTON_GRID_BITS) * sizeof(unsigned int));
+		deviceMemory::allocate(&dev_photonCellEnd, (1u << PHOTON_GRID_BITS) * sizeof(unsigned int));
+		deviceMemory::allocate(&dev_photonCount, sizeof(int));
+	}
+	const std::vector<BVHNode> &nodes = hst_scene->bvhNodes;
+	const float diagonal = nodes.empty() ? 1.0f : glm::length(nodes[0].bboxMax - nodes[0].bboxMin);
+	photonGrid.positions = dev_photonPositions;
+	photonGrid.power = dev_photonPower;
+	photonGrid.cellStart = dev_photonCellStart;
+	photonGrid.cellEnd = dev_photonCellEnd;
+	photonGrid.mask = (1u << PHOTON_GRID_BITS) - 1;
+	photonGrid.radius = fmaxf(diagonal, 1e-3f) / PHOTON_RADIUS_RESOLUTION;
+	photonMapValid = true;
+
+	waitForDisplay();
+	cudaMemset(dev_photonCellStart, 0xff, (1u << PHOTON_GRID_BITS) * sizeof(unsigned int));
+	cudaMemset(dev_photonCount, 0, sizeof(int));
+	if (hst_scene->lights.empty()) {
+		return;
+	}
+
+	// The photons are stored unsorted in scratch, then gathered into the grid
+	float4 * positions = NULL;
+	float4 * power = NULL;
+	unsigned int * keys = NULL;
+	int * order = NULL;
+	deviceMemory::allocate(&positions, PHOTON_COUNT * sizeof(float4));
+	deviceMemory::allocate(&power, PHOTON_COUNT * sizeof(float4));
+	deviceMemory::allocate(&keys, PHOTON_COUNT * sizeof(unsigned int));
+	deviceMemory::allocate(&order, PHOTON_COUNT * sizeof(int));
+
+	LightData lights = {};
+	lights.lights = dev_lights;
+	lights.count = hst_scene->lights.size();
+	lights.geoms = dev_geoms;
+	lights.geomCount = hst_scene->geoms.size();
+	lights.bvhNodes = dev_bvhNodes;
+	lights.bvhGeomIndices = dev_bvhGeomIndices;
+	lights.meshData = meshData;
+	const int blockSize1d = 128;
+	kernEmitPhotons<<<(PHOTON_COUNT + blockSize1d - 1) / blockSize1d, blockSize1d>>>(PHOTON_COUNT,
+		hst_scene->state.traceDepth, lights, dev_materials, positions, power, dev_photonCount, PHOTON_COUNT);
+	int stored = 0;
+	cudaMemcpy(&stored, dev_photonCount, sizeof(int), cudaMemcpyDeviceToHost);
+	stored = std::min(stored, PHOTON_COUNT);
+
+	if (stored > 0) {
+		dim3 numBlocks = (stored + blockSize1d - 1) / blockSize1d;
+		kernPhotonKeys<<<numBlocks, blockSize1d>>>(stored, photonGrid, positions, keys, order);
+		StreamCompaction::Radix::sortByKey(stored, keys, order, PHOTON_GRID_BITS);
+		kernPhotonCells<<<numBlocks, blockSize1d>>>(stored, keys, order, positions, power,
+			dev_photonPositions, dev_photonPower, dev_photonCellStart, dev_photonCellEnd);
+	}
+	deviceMemory::release(positions);
+	deviceMemory::release(power);
+	deviceMemory::release(keys);
+	deviceMemory::release(order);
+	checkCUDAError("build photon map");
+}
+
+/**
+ * Light subpath `index` of a band of PathtraceOptions::bidirectional, for
+ * pixel firstPixel + index: leaves a point on a light picked by power,
+ * cosine-distributed off either side, and stores each diffuse vertex it
+ * reaches in `vertices`, connecting it to the camera through `queue` as
+ * it goes. Subpaths leaving mesh lights end at once (see bidirectional.h).
+ */
+__global__ void kernBdptLightPaths(int count, int firstPixel, int pixelcount, int sampleIndex,
+	int maxPathLength, int samplerType, Camera cam, float pixelArea, LightData lights,
+	const Material * materials, BdptVertex * vertices, int * vertexCounts, BdptQueue queue,
+	unsigned long long * rays)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index >= count)
+	{
+		return;
+	}
+	vertexCounts[index] = 0;
+	// Keyed apart from the camera subpaths, whose pixels are below pixelcount
+	const int key = pixelcount + firstPixel + index;
+	Sampler emission = makeSampler(samplerType, makeSeededRandomEngine(sampleIndex, key, 0), key, sampleIndex, 0);
+	const float lightsPmf = lights.lights[lights.count - 1].cdf;
+	float pick = nextSample(emission) * lightsPmf;
+	float u1 = nextSample(emission);
+	float u2 = nextSample(emission);
+	float u3 = nextSample(emission);
+	float u4 = nextSample(emission);
+	float side = nextSample(emission);
+	const Light & light = lights.lights[pickLight(lights, pick)];
+	if (light.type == MESH)
+	{
+		return;
+	}
+	glm::vec3 point;
+	glm::vec3 normal;
+	sampleLightPoint(light, pick, u1, u2, point, normal);
+	normal = side < 0.5f ? normal : -normal;
+	Ray ray;
+	ray.direction = samplePowerCosine(normal, 1.0f, u3, u4);
+	ray.origin = point + ray.direction * 0.0001f;
+	ray.coneWidth = 0.0f;
+	ray.coneSpread = 0.0f;
+
+	// Either side is picked half the time
+	const float pickPmf = light.pmf / lightsPmf;
+	const float cosLight = glm::dot(normal, ray.direction);
+	const float emissionPdf = pickPmf * cosLight / (TWO_PI * light.area);
+	if (!(emissionPdf > 0.0f))
+	{
+		return;
+	}
+	glm::vec3 throughput = light.radiance * (cosLight / emissionPdf);
+	float dVCM = bdptMis((pickPmf / light.area) / emissionPdf);
+	float dVC = bdptMis(cosLight / emissionPdf);
+	const float lightPaths = (float)pixelcount;
+
+	int stored = 0;
+	unsigned long long traced = 0;
+	for (int pathLength = 1; stored < BDPT_MAX_LIGHT_VERTICES; pathLength++)
+	{
+		traced++;
+		ShadeableIntersection hit = intersectRay(ray, lights.geoms, lights.geomCount, lights.bvhNodes,
+			lights.bvhGeomIndices, lights.meshData, materials, NULL);
+		if (!(hit.t > 0.0f))
+		{
+			break;
+		}
+		Material material = fetchMaterial(materials, hit.materialId);
+		if (material.emittance > 0.0f)
+		{
+			break;
+		}
+		const glm::vec3 hitPoint = ray.origin + hit.t * ray.direction;
+		glm::vec3 hitNormal = hit.surfaceNormal;
+		if (hasTextureMaps(material))
+		{
+			applyTextureMaps(hit, ray.direction, material, hitNormal);
+		}
+		const float cosIn = fabsf(glm::dot(hitNormal, ray.direction));
+		dVCM *= bdptMis(hit.t * hit.t);
+		dVCM /= bdptMis(cosIn);
+		dVC /= bdptMis(cosIn);
+
+		const float diffuse = fmaxf(1.0f - material.hasReflective - material.hasRefractive, 0.0f);
+		if (diffuse > 0.0f)
+		{
+			BdptVertex & vertex = vertices[index * BDPT_MAX_LIGHT_VERTICES + stored++];
+			vertex.position = hitPoint;
+			vertex.dVCM = dVCM;
+			vertex.normal = hitNormal;
+			vertex.dVC = dVC;
+			vertex.throughput = throughput;
+			vertex.diffuse = diffuse;
+			vertex.albedo = material.color;
+			vertex.pathLength = pathLength;
+			vertex.incoming = -ray.direction;
+
+			// Connected to the camera, into the pixel it projects to
+			glm::vec2 pixel;
+			glm::vec3 toCamera = cam.position - hitPoint;
+			const float distance = glm::length(toCamera);
+			toCamera /= distance;
+			glm::vec3 f;
+			float pdfForward;
+			float pdfReverse;
+			if (cameraProjectPoint(cam, hitPoint, pixel)
+				&& bdptDiffuse(material.color, diffuse, hitNormal, -ray.direction, toCamera, f, pdfForward, pdfReverse))
+			{
+				const int x = (int)floorf(pixel.x + 0.5f);
+				const int y = (int)floorf(pixel.y + 0.5f);
+				const float cosCamera = -glm::dot(cam.view, toCamera);
+				if (x >= 0 && x < cam.resolution.x && y >= 0 && y < cam.resolution.y && cosCamera > 0.0f)
+				{
+					// Camera rays are uniform over their pixel, a pixelArea
+					// patch of the image plane one unit along the view
+					const float cameraPdf = 1.0f / (pixelArea * cosCamera * cosCamera * cosCamera);
+					const float toSurface = cameraPdf * glm::dot(hitNormal, toCamera) / (distance * distance);
+					const float wLight = bdptMis(toSurface / lightPaths) * (dVCM + dVC * bdptMis(pdfReverse));
+					bdptPush(queue, hitPoint + toCamera * 0.0001f, toCamera, distance - 0.0002f,
+						x + y * cam.resolution.x, throughput * f * (toSurface / (lightPaths * (1.0f + wLight))));
+				}
+			}
+		}
+		if (pathLength + 2 > maxPathLength)
+		{
+			break;
+		}
+
+		Sampler rng = makeSampler(samplerType, makeSeededRandomEngine(sampleIndex, key, pathLength), key,
+			sampleIndex, pathLength);
+		PathSegment segment;
+		segment.ray = ray;
+		segment.color = throughput;
+		const int lobe = scatterRay(segment, hitPoint, hitNormal, hit.frontFace, material, rng);
+		const float cosOut = fabsf(glm::dot(hitNormal, segment.ray.direction));
+		if (lobe == LOBE_DIFFUSE)
+		{
+			const float pdfForward = diffuse * cosOut / PI;
+			if (!(pdfForward > 0.0f))
+			{
+				break;
+			}
+			dVC = bdptMis(cosOut / pdfForward) * (dVC * bdptMis(diffuse * cosIn / PI) + dVCM);
+			dVCM = bdptMis(1.0f / pdfForward);
+		}
+		else
+		{
+			dVCM = 0.0f;
+			dVC *= bdptMis(cosOut);
+		}
+		throughput = segment.color;
+		ray = segment.ray;
+	}
+	vertexCounts[index] = stored;
+	atomicAdd(rays, traced);
+}
+
+// Pinhole camera rays for a band's pixels, jittered within them
+__global__ void kernBdptCameraRays(int count, int firstPixel, int sampleIndex, int samplerType, Camera cam,
+	float pixelArea, int pixelcount, BdptCameraPath * paths)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index >= count)
+	{
+		return;
+	}
+	const int pixel = firstPixel + index;
+	Sampler rng = makeSampler(samplerType, makeSeededRandomEngine(sampleIndex, pixel, 0), pixel, sampleIndex, 0);
+	const float jx = nextSample(rng) - 0.5f;
+	const float jy = nextSample(rng) - 0.5f;
+	const glm::vec3 direction = cameraRayDirection(cam, pixel % cam.resolution.x + jx,
+		pixel / cam.resolution.x + jy);
+	const float cosCamera = glm::dot(direction, cam.view);
+	const float cameraPdf = 1.0f / (pixelArea * cosCamera * cosCamera * cosCamera);
+	BdptCameraPath path;
+	path.origin = cam.position;
+	path.direction = direction;
+	path.throughput = glm::vec3(1.0f);
+	path.dVCM = bdptMis((float)pixelcount / cameraPdf);
+	path.dVC = 0.0f;
+	path.pathLength = 1;
+	paths[index] = path;
+}
+
+/**
+ * One bounce of a band's camera subpaths: an emitter hit is added to the
+ * pixel's sample with its MIS weight; at a diffuse vertex, a light sample
+ * and a connection to every vertex of the pixel's light subpath go to
+ * `queue`; then the path scatters on.
+ */
+__global__ void kernBdptCameraBounce(int count, int firstPixel, int sampleIndex, int maxPathLength,
+	int samplerType, LightData lights, const Material * materials, const BdptVertex * vertices,
+	const int * vertexCounts, BdptCameraPath * paths, float4 * sample, BdptQueue queue,
+	unsigned long long * rays)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index >= count)
+	{
+		return;
+	}
+	BdptCameraPath path = paths[index];
+	if (path.pathLength == 0)
+	{
+		return;
+	}
+	const int pixel = firstPixel + index;
+	Ray ray;
+	ray.origin = path.origin;
+	ray.direction = path.direction;
+	ray.coneWidth = 0.0f;
+	ray.coneSpread = 0.0f;
+	atomicAdd(rays, 1ull);
+	ShadeableIntersection hit = intersectRay(ray, lights.geoms, lights.geomCount, lights.bvhNodes,
+		lights.bvhGeomIndices, lights.meshData, materials, NULL);
+	glm::vec3 radiance(0.0f);
+	if (!(hit.t > 0.0f))
+	{
+		// The environment is not sampled, so this is its only strategy
+		radiance = path.throughput * environmentRadiance(lights.environment, ray.direction);
+		path.pathLength = 0;
+	}
+	Material material;
+	glm::vec3 hitPoint;
+	glm::vec3 normal;
+	float cosIn = 0.0f;
+	if (path.pathLength > 0)
+	{
+		material = fetchMaterial(materials, hit.materialId);
+		hitPoint = ray.origin + hit.t * ray.direction;
+		normal = hit.surfaceNormal;
+		if (hasTextureMaps(material))
+		{
+			applyTextureMaps(hit, ray.direction, material, normal);
+		}
+		cosIn = fabsf(glm::dot(normal, ray.direction));
+		path.dVCM *= bdptMis(hit.t * hit.t);
+		path.dVCM /= bdptMis(cosIn);
+		path.dVC /= bdptMis(cosIn);
+	}
+	if (path.pathLength > 0 && material.emittance > 0.0f)
+	{
+		float weight = 1.0f;
+		const int l = lights.geoms[hit.geomIndex].lightIndex;
+		if (path.pathLength > 1 && l >= 0 && lights.lights[l].type != MESH)
+		{
+			const Light & light = lights.lights[l];
+			const float pickPmf = light.pmf / lights.lights[lights.count - 1].cdf;
+			const float directPdf = pickPmf / light.area;
+			const float emissionPdf = pickPmf * cosIn / (TWO_PI * light.area);
+			weight = 1.0f / (1.0f + bdptMis(directPdf) * path.dVCM + bdptMis(emissionPdf) * path.dVC);
+		}
+		radiance = path.throughput * material.color * material.emittance * weight;
+		path.pathLength = 0;
+	}
+	if (path.pathLength > 0 && path.pathLength < maxPathLength)
+	{
+		Sampler rng = makeSampler(samplerType, makeSeededRandomEngine(sampleIndex, pixel, path.pathLength),
+			pixel, sampleIndex, path.pathLength);
+		const float diffuse = fmaxf(1.0f - material.hasReflective - material.hasRefractive, 0.0f);
+		const glm::vec3 incoming = -ray.direction;
+		if (diffuse > 0.0f)
+		{
+			// Next-event estimation
+			float pick = nextSample(rng) * lights.lights[lights.count - 1].cdf;
+			float u1 = nextSample(rng);
+			float u2 = nextSample(rng);
+			const Light & light = lights.lights[pickLight(lights, pick)];
+			glm::vec3 lightPoint;
+			glm::vec3 lightNormal;
+			sampleLightPoint(light, pick, u1, u2, lightPoint, lightNormal);
+			glm::vec3 toLight = lightPoint - hitPoint;
+			const float distance = glm::length(toLight);
+			toLight /= distance;
+			const float cosLight = fabsf(glm::dot(lightNormal, toLight));
+			glm::vec3 f;
+			float pdfForward;
+			float pdfReverse;
+			if (light.type != MESH && distance > 0.0f && cosLight > 1e-6f
+				&& path.pathLength + 1 <= maxPathLength
+				&& bdptDiffuse(material.color, diffuse, normal, incoming, toLight, f, pdfForward, pdfReverse))
+			{
+				const float pickPmf = light.pmf / lights.lights[lights.count - 1].cdf;
+				const float cosSurface = glm::dot(normal, toLight);
+				const float directPdf = distance * distance / (light.area * cosLight);
+				const float emissionPdf = cosLight / (TWO_PI * light.area);
+				const float wLight = bdptMis(pdfForward / (pickPmf * directPdf));
+				const float wCamera = bdptMis(emissionPdf * cosSurface / (directPdf * cosLight))
+					* (path.dVCM + path.dVC * bdptMis(pdfReverse));
+				bdptPush(queue, hitPoint + toLight * 0.0001f, toLight, distance - 0.0002f, pixel,
+					path.throughput * light.radiance * f
+					* (cosSurface / (pickPmf * directPdf * (wLight + 1.0f + wCamera))));
+			}
+
+			// Connections to the pixel's light subpath
+			const int stored = vertexCounts[index];
+			for (int k = 0; k < stored; k++)
+			{
+				const BdptVertex vertex = vertices[index * BDPT_MAX_LIGHT_VERTICES + k];
+				if (vertex.pathLength + 1 + path.pathLength > maxPathLength)
+				{
+					break;
+				}
+				glm::vec3 toVertex = vertex.position - hitPoint;
+				const float distance2 = glm::dot(toVertex, toVertex);
+				const float vertexDistance = sqrtf(distance2);
+				toVertex /= vertexDistance;
+				glm::vec3 cameraF;
+				float cameraForward;
+				float cameraReverse;
+				glm::vec3 lightF;
+				float lightForward;
+				float lightReverse;
+				if (!(vertexDistance > 0.0f)
+					|| !bdptDiffuse(material.color, diffuse, normal, incoming, toVertex, cameraF,
+						cameraForward, cameraReverse)
+					|| !bdptDiffuse(vertex.albedo, vertex.diffuse, vertex.normal, vertex.incoming, -toVertex,
+						lightF, lightForward, lightReverse))
+				{
+					continue;
+				}
+				const float cosCamera = glm::dot(normal, toVertex);
+				const float cosVertex = -glm::dot(vertex.normal, toVertex);
+				const float wLight = bdptMis(cameraForward * cosVertex / distance2)
+					* (vertex.dVCM + vertex.dVC * bdptMis(lightReverse));
+				const float wCamera = bdptMis(lightForward * cosCamera / distance2)
+					* (path.dVCM + path.dVC * bdptMis(cameraReverse));
+				bdptPush(queue, hitPoint + toVertex * 0.0001f, toVertex, vertexDistance - 0.0002f, pixel,
+					path.throughput * vertex.throughput * cameraF * lightF
+					* (cosCamera * cosVertex / (distance2 * (wLight + 1.0f + wCamera))));
+			}
+		}
+
+		PathSegment segment;
+		segment.ray = ray;
+		segment.color = path.throughput;
+		const int lobe = scatterRay(segment, hitPoint, normal, hit.frontFace, material, rng);
+		const float cosOut = fabsf(glm::dot(normal, segment.ray.direction));
+		if (lobe == LOBE_DIFFUSE)
+		{
+			const float pdfForward = diffuse * cosOut / PI;
+			path.dVC = bdptMis(cosOut / pdfForward) * (path.dVC * bdptMis(diffuse * cosIn / PI) + path.dVCM);
+			path.dVCM = bdptMis(1.0f / pdfForward);
+			path.pathLength = pdfForward > 0.0f ? path.pathLength + 1 : 0;
+		}
+		else
+		{
+			path.dVCM = 0.0f;
+			path.dVC *= bdptMis(cosOut);
+			path.pathLength++;
+		}
+		path.origin = segment.ray.origin;
+		path.direction = segment.ray.direction;
+		path.throughput = segment.color;
+	}
+	else
+	{
+		path.pathLength = 0;
+	}
+	paths[index] = path;
+	if (radiance != glm::vec3(0.0f))
+	{
+		atomicAdd(&sample[pixel].x, radiance.x);
+		atomicAdd(&sample[pixel].y, radiance.y);
+		atomicAdd(&sample[pixel].z, radiance.z);
+	}
+}
+
+// Adds each queued connection whose segment is unoccluded to its pixel's sample
+__global__ void kernBdptResolve(int count, const BdptConnection * connections, LightData lights,
+	float4 * sample)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index >= count)
+	{
+		return;
+	}
+	const BdptConnection connection = connections[index];
+	Ray ray;
+	ray.origin = connection.origin;
+	ray.direction = connection.direction;
+	ray.coneWidth = 0.0f;
+	ray.coneSpread = 0.0f;
+	if (occludedRay(ray, connection.distance, lights.geoms, lights.geomCount, lights.bvhNodes,
+		lights.bvhGeomIndices, lights.meshData))
+	{
+		return;
+	}
+	float4 * pixel = &sample[connection.pixel];
+	atomicAdd(&pixel->x, connection.contribution.x);
+	atomicAdd(&pixel->y, connection.contribution.y);
+	atomicAdd(&pixel->z, connection.contribution.z);
+}
+
+// Adds a finished sample of every pixel to the image and its moments
+__global__ void kernBdptAccumulate(int pixelcount, const float4 * sample, float4 * image, glm::vec2 * moments)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index >= pixelcount)
+	{
+		return;
+	}
+	const float4 s = sample[index];
+	const float luminance = 0.2126f * s.x + 0.7152f * s.y + 0.0722f * s.z;
+	const float4 sum = image[index];
+	image[index] = make_float4(sum.x + s.x, sum.y + s.y, sum.z + s.z, sum.w);
+	moments[index] += glm::vec2(luminance, luminance * luminance);
+}
+
+// Resolves and empties the queue, counting its shadow rays in `rays`
+static void resolveBidirectionalQueue(const LightData & lights, unsigned long long & rays) {
+	int queued = 0;
+	cudaMemcpy(&queued, dev_bdptQueueCount, sizeof(int), cudaMemcpyDeviceToHost);
+	queued = std::min(queued, bdptQueueCapacity);
+	if (queued > 0) {
+		const int blockSize1d = 128;
+		kernBdptResolve<<<(queued + blockSize1d - 1) / blockSize1d, blockSize1d>>>(queued, dev_bdptQueue, lights,
+			dev_bdptSample);
+		rays += queued;
+	}
+	cudaMemset(dev_bdptQueueCount, 0, sizeof(int));
+}
+
+/**
+ * PathtraceOptions::bidirectional's samples firstSample ..
+ * firstSample + samples - 1 of every pixel, added to dev_image (see
+ * bidirectional.h). Bands of BDPT_BAND_PATHS pixels trace their light
+ * subpaths, then their camera subpaths a bounce at a time; the queued
+ * connections of each step are resolved before the next. A sample is
+ * complete, light splats included, once every band has been traced.
+ */
+static void traceBidirectional(const MeshData & meshData, int firstSample, int samples, int samplerType) {
+	NvtxRange bidirectionalRange("bidirectional", firstSample);
+	const Camera & cam = hst_scene->state.camera;
+	const int pixelcount = cam.resolution.x * cam.resolution.y;
+	const int band = std::min(pixelcount, BDPT_BAND_PATHS);
+	if (band > bdptBandCapacity) {
+		deviceMemory::release(dev_bdptVertices);
+		deviceMemory::release(dev_bdptVertexCounts);
+		deviceMemory::release(dev_bdptCameraPaths);
+		deviceMemory::release(dev_bdptQueue);
+		bdptBandCapacity = band;
+		// A bounce queues at most one light sample and a connection per light vertex for each path
+		bdptQueueCapacity = band * (BDPT_MAX_LIGHT_VERTICES + 1);
+		deviceMemory::allocate(&dev_bdptVertices, band * BDPT_MAX_LIGHT_VERTICES * sizeof(BdptVertex));
+		deviceMemory::allocate(&dev_bdptVertexCounts, band * sizeof(int));
+		deviceMemory::allocate(&dev_bdptCameraPaths, band * sizeof(BdptCameraPath));
+		deviceMemory::allocate(&dev_bdptQueue, bdptQueueCapacity * sizeof(BdptConnection));
+	}
+	if (pixelcount > bdptSamplePixels) {
+		deviceMemory::release(dev_bdptSample);
+		deviceMemory::allocate(&dev_bdptSample, pixelcount * sizeof(float4));
+		bdptSamplePixels = pixelcount;
+	}
+	if (dev_bdptQueueCount == NULL) {
+		deviceMemory::allocate(&dev_bdptQueueCount, sizeof(int));
+		deviceMemory::allocate(&dev_bdptRays, sizeof(unsigned long long));
+	}
+
+	LightData lights = {};
+	lights.lights = dev_lights;
+	lights.count = hst_scene->lights.size();
+	lights.geoms = dev_geoms;
+	lights.geomCount = hst_scene->geoms.size();
+	lights.bvhNodes = dev_bvhNodes;
+	lights.bvhGeomIndices = dev_bvhGeomIndices;
+	lights.meshData = meshData;
+	lights.environment = environmentLight(hst_scene, environmentTexture, dev_environmentMarginalCdf,
+		dev_environmentConditionalCdf, false);
+	BdptQueue queue;
+	queue.connections = dev_bdptQueue;
+	queue.count = dev_bdptQueueCount;
+	queue.capacity = bdptQueueCapacity;
+	const float pixelArea = glm::length(cam.right) * cam.pixelLength.x * glm::length(cam.up) * cam.pixelLength.y;
+	const int traceDepth = hst_scene->state.traceDepth;
+	// Camera paths shade traceDepth hits, each with a light sample
+	const int maxPathLength = traceDepth + 1;
+	const int blockSize1d = 128;
+
+	waitForDisplay();
+	cudaMemset(dev_bdptQueueCount, 0, sizeof(int));
+	cudaMemset(dev_bdptRays, 0, sizeof(unsigned long long));
+	unsigned long long shadowRays = 0;
+	for (int s = 0; s < samples; s++) {
+		const int sampleIndex = firstSample + s;
+		cudaMemset(dev_bdptSample, 0, pixelcount * sizeof(float4));
+		for (int firstPixel = 0; firstPixel < pixelcount; firstPixel += band) {
+			const int count = std::min(band, pixelcount - firstPixel);
+			const dim3 numBlocks = (count + blockSize1d - 1) / blockSize1d;
+			kernBdptLightPaths<<<numBlocks, blockSize1d>>>(count, firstPixel, pixelcount, sampleIndex,
+				maxPathLength, samplerType, cam, pixelArea, lights, dev_materials, dev_bdptVertices,
+				dev_bdptVertexCounts, queue, dev_bdptRays);
+			checkCUDAError("bidirectional light paths");
+			resolveBidirectionalQueue(lights, shadowRays);
+			kernBdptCameraRays<<<numBlocks, blockSize1d>>>(count, firstPixel, sampleIndex, samplerType, cam,
+				pixelArea, pixelcount, dev_bdptCameraPaths);
+			for (int depth = 0; depth < traceDepth; depth++) {
+				kernBdptCameraBounce<<<numBlocks, blockSize1d>>>(count, firstPixel, sampleIndex, maxPathLength,
+					samplerType, lights, dev_materials, dev_bdptVertices, dev_bdptVertexCounts,
+					dev_bdptCameraPaths, dev_bdptSample, queue, dev_bdptRays);
+				checkCUDAError("bidirectional camera bounce");
+				resolveBidirectionalQueue(lights, shadowRays);
+			}
+		}
+		kernBdptAccumulate<<<(pixelcount + blockSize1d - 1) / blockSize1d, blockSize1d>>>(pixelcount,
+			dev_bdptSample, dev_image, dev_moments);
+	}
+	unsigned long long pathRays = 0;
+	cudaMemcpy(&pathRays, dev_bdptRays, sizeof(unsigned long long), cudaMemcpyDeviceToHost);
+	stats.raysTraced = (long long)(pathRays + shadowRays);
+	stats.depths = 0;
+	checkCUDAError("bidirectional");
+}
+
+/**
+ * The history pixel showing the surface of pixel (x, y), whose first hit
+ * is `g`: the position rebuilt from `g` is projected into prevCam, and the
+ * nearest history pixel is taken if its own first hit agrees in position
+ * and normal. Returns -1 for a disoccluded pixel.
+ */
+__device__ int reprojectPixel(const Camera &cam, const Camera &prevCam, const GBufferPixel &g, int x, int y,
+        const GBufferPixel *prevGBuffer) {
+    glm::vec2 prevPixel;
+    glm::vec3 position = gbufferPosition(g, cam, x, y);
+    if (g.t <= 0.0f || !cameraProjectPoint(prevCam, position, prevPixel)) {
+        return -1;
+    }
+    int px = (int)floorf(prevPixel.x + 0.5f);
+    int py = (int)floorf(prevPixel.y + 0.5f);
+    if (px < 0 || px >= prevCam.resolution.x || py < 0 || py >= prevCam.resolution.y) {
+        return -1;
+    }
+    int prevIndex = px + (py * prevCam.resolution.x);
+    GBufferPixel pg = prevGBuffer[prevIndex];
+    glm::vec3 prevPosition = gbufferPosition(pg, prevCam, px, py);
+    float tolerance = 0.02f * g.t + 4.0f * cam.pixelLength.x * g.t;
+    if (pg.t > 0.0f
+            && glm::distance(prevPosition, position) < tolerance
+            && glm::dot(gbufferNormal(pg), gbufferNormal(g)) > 0.9f) {
+        return prevIndex;
+    }
+    return -1;
+}
+
+// Whether ReSTIR's reservoirs have a surface to sample light for at `g`
+__device__ bool restirSurface(const GBufferPixel &g, const Material *materials) {
+    return g.t > 0.0f && g.materialId >= 0 && materials[g.materialId].emittance <= 0.0f;
+}
+
+/**
+ * ReSTIR's candidates and temporal reuse: RESTIR_CANDIDATES light points
+ * for each pixel's G-buffer surface, drawn the way sampleDirectLight
+ * draws them, then the reservoir `previous` held for the same surface
+ * when `history` is set, capped at RESTIR_HISTORY_CAP launches' worth.
+ */
+__global__ void kernRestirTemporal(Camera cam, Camera prevCam, bool history, int iter, LightData lights,
+        const Material *materials, const GBufferPixel *gBuffer, const GBufferPixel *prevGBuffer,
+        const Reservoir *previous, Reservoir *out) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < cam.resolution.x && y < cam.resolution.y) {
+        int index = x + (y * cam.resolution.x);
+        GBufferPixel g = gBuffer[index];
+        Reservoir r = emptyReservoir();
+        if (restirSurface(g, materials)) {
+            glm::vec3 point = gbufferPosition(g, cam, x, y);
+            glm::vec3 normal = gbufferNormal(g);
+            Sampler rng = makeSampler(SAMPLER_RANDOM, makeSeededRandomEngine(iter, index, RESTIR_SEED_DEPTH),
+                index, iter, 0);
+            // The lights' share of the light pmf, which every candidate is drawn from
+            const float lightsPmf = lights.lights[lights.count - 1].cdf;
+            for (int c = 0; c < RESTIR_CANDIDATES; c++) {
+                float pick = nextSample(rng) * lightsPmf;
+                float u1 = nextSample(rng);
+                float u2 = nextSample(rng);
+                int l = pickLight(lights, pick);
+                const Light &light = lights.lights[l];
+                glm::vec3 lightPoint, lightNormal;
+                sampleLightPoint(light, pick, u1, u2, lightPoint, lightNormal);
+                float sourcePdf = light.pmf / (lightsPmf * light.area);
+                float target = restirTarget(lights, l, lightPoint, lightNormal, point, normal);
+                reservoirUpdate(r, l, lightPoint, lightNormal, target / sourcePdf, 1.0f, nextSample(rng));
+            }
+            int prevIndex = history ? reprojectPixel(cam, prevCam, g, x, y, prevGBuffer) : -1;
+            if (prevIndex >= 0) {
+                reservoirMerge(lights, r, previous[prevIndex], RESTIR_HISTORY_CAP * RESTIR_CANDIDATES,
+                    point, normal, nextSample(rng));
+            }
+            reservoirFinish(lights, r, point, normal);
+        }
+        out[index] = r;
+    }
+}
+
+/**
+ * ReSTIR's spatial reuse: each pixel's reservoir merged with those of
+ * RESTIR_SPATIAL_NEIGHBOURS random pixels within RESTIR_SPATIAL_RADIUS
+ * whose surfaces are close to its own in depth and normal.
+ */
+__global__ void kernRestirSpatial(Camera cam, int iter, LightData lights, const Material *materials,
+        const GBufferPixel *gBuffer, const Reservoir *in, Reservoir *out) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < cam.resolution.x && y < cam.resolution.y) {
+        int index = x + (y * cam.resolution.x);
+        GBufferPixel g = gBuffer[index];
+        Reservoir r = in[index];
+        if (restirSurface(g, materials)) {
+            glm::vec3 point = gbufferPosition(g, cam, x, y);
+            glm::vec3 normal = gbufferNormal(g);
+            Sampler rng = makeSampler(SAMPLER_RANDOM,
+                makeSeededRandomEngine(iter, index, RESTIR_SPATIAL_SEED_DEPTH), index, iter, 0);
+            Reservoir merged = emptyReservoir();
+            reservoirMerge(lights, merged, r, FLT_MAX, point, normal, nextSample(rng));
+            for (int k = 0; k < RESTIR_SPATIAL_NEIGHBOURS; k++) {
+                float angle = TWO_PI * nextSample(rng);
+                float radius = RESTIR_SPATIAL_RADIUS * sqrtf(nextSample(rng));
+                int nx = (int)floorf(x + radius * cosf(angle) + 0.5f);
+                int ny = (int)floorf(y + radius * sinf(angle) + 0.5f);
+                float u = nextSample(rng);
+                if (nx < 0 || nx >= cam.resolution.x || ny < 0 || ny >= cam.resolution.y
+                        || (nx == x && ny == y)) {
+                    continue;
+                }
+                int neighbour = nx + (ny * cam.resolution.x);
+                GBufferPixel ng = gBuffer[neighbour];
+                if (restirSurface(ng, materials) && fabsf(ng.t - g.t) < 0.1f * g.t
+                        && glm::dot(gbufferNormal(ng), normal) > 0.9f) {
+                    reservoirMerge(lights, merged, in[neighbour], FLT_MAX, point, normal, u);
+                }
+            }
+            reservoirFinish(lights, merged, point, normal);
+            r = merged;
+        }
+        out[index] = r;
+    }
+}
+
+/**
+ * Resamples the lights for the reservoirs the camera hits of this launch
+ * connect to, from the centre G-buffer. dev_reservoirs keeps them as the
+ * next launch's history, with the G-buffer and camera they were made for.
+ */
+static void resampleLights(int iter) {
+	NvtxRange restirRange("restir");
+	const Camera &cam = hst_scene->state.camera;
+	const int pixelcount = cam.resolution.x * cam.resolution.y;
+	if (dev_reservoirs == NULL) {
+		deviceMemory::allocate(&dev_reservoirs, pixelcount * sizeof(Reservoir));
+		deviceMemory::allocate(&dev_reservoirScratch, pixelcount * sizeof(Reservoir));
+		reservoirsValid = false;
+	}
+	LightData lights = {};
+	lights.lights = dev_lights;
+	lights.count = hst_scene->lights.size();
+
+	const dim3 blockSize2d(8, 8);
+	const dim3 blocksPerGrid2d(
+		(cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+		(cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+	kernRestirTemporal<<<blocksPerGrid2d, blockSize2d>>>(cam, reservoirCamera, reservoirsValid, iter, lights,
+		dev_materials, dev_gBuffer, reservoirsValid ? reservoirGBuffer : dev_gBuffer, dev_reservoirs,
+		dev_reservoirScratch);
+	kernRestirSpatial<<<blocksPerGrid2d, blockSize2d>>>(cam, iter, lights, dev_materials, dev_gBuffer,
+		dev_reservoirScratch, dev_reservoirs);
+	checkCUDAError("restir");
+	reservoirCamera = cam;
+	reservoirGBuffer = dev_gBuffer;
+	reservoirsValid = true;
+}
+
+// Relative errors are measured against at least this mean luminance, so
+// dark pixels converge on absolute error instead of never converging
+#define ADAPTIVE_MIN_LUMINANCE 0.01f
+
+/**
+ * Marks pixels whose standard error of the mean luminance, from the
+ * moments of their `samples` samples, has dropped below `threshold` times
+ * the mean. Converged pixels are traced no more, and their sums instead
+ * grow by their own mean for each of the `skippedSamples` samples they
+ * miss: the mean and variance stay put, so every reader can keep
+ * normalizing dev_image by the iteration count.
+ */
+__global__ void kernUpdateConvergence(int n, int samples, int skippedSamples, float threshold,
+	int minSamples, float4 * image, glm::vec2 * moments, float4 * specular, unsigned char * converged)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < n)
+	{
+		bool done = converged[index];
+		if (!done && samples >= minSamples)
+		{
+			glm::vec2 m = moments[index] / (float)samples;
+			float variance = fmaxf(m.y - m.x * m.x, 0.0f);
+			float error = sqrtf(variance / samples) / fmaxf(m.x, ADAPTIVE_MIN_LUMINANCE);
+			done = error < threshold;
+			converged[index] = done;
+		}
+		if (done)
+		{
+			float fill = (float)skippedSamples / samples;
+			float4 c = image[index];
+			image[index] = make_float4(c.x + c.x * fill, c.y + c.y * fill, c.z + c.z * fill, c.w);
+			moments[index] += moments[index] * fill;
+			if (specular != NULL)
+			{
+				c = specular[index];
+				specular[index] = make_float4(c.x + c.x * fill, c.y + c.y * fill, c.z + c.z * fill, c.w);
+			}
+		}
+	}
+}
+
+// Add the current iteration's output to the overall image, and with
+// `specular` set the colour of specular paths to that too, each path
+// weighed by `weight` (see addToPixel)
+__global__ void finalGather(int nPaths, float4 * image, glm::vec2 * moments, PathSegments iterationPaths,
+	bool atomic, float4 * specular, float weight = 1.0f)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < nPaths)
+	{
+		float4 colorPixel = loadColorPixel(iterationPaths, index);
+		addToPixel(colorPixel, image, moments, atomic, weight);
+		colorPixel.x *= weight;
+		colorPixel.y *= weight;
+		colorPixel.z *= weight;
+		if (specular != NULL
+			&& (loadSampleBits(iterationPaths, index) & PATH_SPECULAR_BIT) != 0)
+		{
+			float4 * pixel = &specular[__float_as_int(colorPixel.w)];
+			if (atomic) {
+				atomicAdd(&pixel->x, colorPixel.x);
+				atomicAdd(&pixel->y, colorPixel.y);
+				atomicAdd(&pixel->z, colorPixel.z);
+			} else {
+				*pixel = make_float4(pixel->x + colorPixel.x, pixel->y + colorPixel.y, pixel->z + colorPixel.z,
+					pixel->w);
+			}
+		}
+	}
+}
+
+/**
+ * First half of the segmented gather: moves each path's colour back to
+ * slot s * pixelcount + local, where generateRayFromCamera put sample s of
+ * the pixel, undoing the reordering of compaction. `local` packs the
+ * pixel's column among firstColumn .. firstColumn + columns - 1 of rows
+ * `width` pixels wide; for whole rows it is the pixel. Every path has its
+ * own slot, so the writes need no atomics.
+ */
+__global__ void kernScatterToSampleSlots(int nPaths, int pixelcount, int width, int firstColumn,
+	int columns, int firstSample, PathSegments paths, float4 * slots)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < nPaths)
+	{
+		float4 colorPixel = loadColorPixel(paths, index);
+		int sample = (int)loadSampleBits(paths, index) - firstSample;
+		int pixel = __float_as_int(colorPixel.w);
+		int local = (pixel % width - firstColumn) + (pixel / width) * columns;
+		slots[sample * pixelcount + local] = colorPixel;
+	}
+}
+
+/**
+ * Second half: one thread per packed pixel (see kernScatterToSampleSlots)
+ * sums its samples' slots, reading them coalesced, and adds them to the
+ * image and moments once. Pixels adaptive sampling has converged traced
+ * no paths this launch and are skipped.
+ */
+__global__ void gatherSampleSlots(int pixelcount, int width, int firstColumn, int columns,
+	int samples, float4 * image, glm::vec2 * moments, const float4 * slots, const unsigned char * converged)
+{
+	int local = (blockIdx.x * blockDim.x) + threadIdx.x;
+	int pixel = (local / columns) * width + firstColumn + local % columns;
+
+	if (local < pixelcount && (converged == NULL || !converged[pixel]))
+	{
+		glm::vec3 color(0.0f);
+		glm::vec2 moment(0.0f);
+		for (int s = 0; s < samples; s++) {
+			glm::vec3 c = unpackVec3(slots[s * pixelcount + local]);
+			float luminance = glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+			color += c;
+			moment += glm::vec2(luminance, luminance * luminance);
+		}
+		float4 sum = image[pixel];
+		image[pixel] = make_float4(sum.x + color.x, sum.y + color.y, sum.z + color.z, sum.w);
+		moments[pixel] += moment;
+	}
+}
+
+/**
+ * Wavefront replacement for the bounce loop of pathtrace(). Paths stay in
+ * their slots; each bounce works on a queue of live slot indices, which the
+ * shade stage appends to for the next bounce, so there is no compaction pass
+ * and the loop simply runs until the queue is empty. The first queue is
+ * every slot, which keeps slot-indexed first-bounce caching valid.
+ */
+static void traceWavefront(int numPaths, const MeshData &meshData, GBufferPixel *gBuffer,
+		bool cacheFirstBounce, int rouletteBounces, int sampler, const LightData &lights) {
+	if (persistentBlocks == 0) {
+		// Just enough persistent blocks to fill every SM once
+		int device = 0;
+		cudaDeviceProp prop;
+		cudaGetDevice(&device);
+		cudaGetDeviceProperties(&prop, device);
+		int blocksPerSM = 0;
+		cudaOccupancyMaxActiveBlocksPerMultiprocessor(&blocksPerSM, extendPersistent,
+			PERSISTENT_BLOCK_SIZE, sharedGeomBytes);
+		persistentBlocks = std::max(blocksPerSM, 1) * prop.multiProcessorCount;
+	}
+
+	const int numMaterials = hst_scene->materials.size();
+	const int * queue = dev_pathIdentity;
+	int queueLength = numPaths;
+	int next = 0;
+	int depth = 0;
+
+	while (queueLength > 0) {
+		NvtxRange bounceRange("bounce", depth, queueLength);
+		recordPathCount(depth, queueLength);
+		ShadeableIntersections bounceIntersections = dev_intersections;
+		if (depth == 0 && cacheFirstBounce && firstBounceCached) {
+			bounceIntersections = dev_firstBounceCache;
+		} else {
+			cudaMemset(dev_queueCounters, 0, sizeof(int));
+			stats.raysTraced += queueLength;
+			timerStart(bounceTimer(TIMER_INTERSECT, depth));
+			extendPersistent<<<persistentBlocks, PERSISTENT_BLOCK_SIZE, sharedGeomBytes>>>(
+				depth
+				, queue
+				, queueLength
+				, dev_queueCounters
+				, dev_paths
+				, dev_geoms
+				, hst_scene->geoms.size()
+				, sharedGeomBytes > 0
+				, dev_bvhNodes
+				, dev_bvhGeomIndices
+				, meshData
+				, dev_materials
+				, dev_intersections
+				, gBuffer
+				);
+			timerStop(bounceTimer(TIMER_INTERSECT, depth));
+			checkCUDAError("wavefront extend");
+
+			if (depth == 0 && cacheFirstBounce) {
+				copyIntersections(dev_firstBounceCache, dev_intersections, numPaths);
+				firstBounceCached = true;
+			}
+		}
+		cudaMemset(dev_queueCounters + 1, 0, sizeof(int));
+		dim3 numBlocksQueue = (queueLength + PERSISTENT_BLOCK_SIZE - 1) / PERSISTENT_BLOCK_SIZE;
+		timerStart(bounceTimer(TIMER_SHADE, depth));
+		shadeQueued<<<numBlocksQueue, PERSISTENT_BLOCK_SIZE, sharedMaterialBytes>>>(
+			queue
+			, queueLength
+			, dev_queues[next]
+			, dev_queueCounters + 1
+			, bounceIntersections
+			, dev_paths
+			, dev_materials
+			, numMaterials
+			, sharedMaterialBytes > 0
+			, rouletteBounces
+			, sampler
+			, lights
+			);
+		timerStop(bounceTimer(TIMER_SHADE, depth));
+		checkCUDAError("wavefront shade");
+		depth++;
+
+		cudaMemcpy(&queueLength, dev_queueCounters + 1, sizeof(int), cudaMemcpyDeviceToHost);
+		queue = dev_queues[next];
+		next ^= 1;
+	}
+	stats.depths = depth;
+}
+
+/**
+ * Persistent replacement for the bounce loop of pathtrace(): one launch of
+ * tracePersistentQueue over a ring that starts out holding every slot.
+ * Like the megakernel it neither counts bounces nor compacts, and the
+ * first-bounce cache stays slot-indexed.
+ */
+static void tracePersistent(int numPaths, const MeshData &meshData, GBufferPixel *gBuffer,
+		bool cacheFirstBounce, int rouletteBounces, int sampler, const LightData &lights) {
+	const int stageBytes = sharedGeomBytes + sharedMaterialBytes;
+	int blocksPerSM = 0;
+	cudaOccupancyMaxActiveBlocksPerMultiprocessor(&blocksPerSM, tracePersistentQueue,
+		PERSISTENT_BLOCK_SIZE, stageBytes);
+	const int blocks = std::max(blocksPerSM, 1) * launchConfig.multiprocessors;
+
+	PathQueue start = { 0, numPaths, numPaths, 0, 0xffffffffu, 0u, 0u };
+	cudaMemcpy(dev_pathQueue, &start, sizeof(PathQueue), cudaMemcpyHostToDevice);
+	cudaMemcpy(dev_queues[0], dev_pathIdentity, numPaths * sizeof(int), cudaMemcpyDeviceToDevice);
+
+	const bool readFirstBounce = cacheFirstBounce && firstBounceCached;
+	const bool writeFirstBounce = cacheFirstBounce && !firstBounceCached;
+	timerStart(TIMER_MEGAKERNEL);
+	tracePersistentQueue<<<blocks, PERSISTENT_BLOCK_SIZE, stageBytes>>>(
+		dev_queues[0]
+		, numPaths
+		, dev_pathQueue
+		, dev_paths
+		, dev_geoms
+		, hst_scene->geoms.size()
+		, sharedGeomBytes > 0
+		, dev_bvhNodes
+		, dev_bvhGeomIndices
+		, meshData
+		, dev_materials
+		, hst_scene->materials.size()
+		, sharedMaterialBytes > 0
+		, rouletteBounces
+		, sampler
+		, lights
+		, dev_firstBounceCache
+		, readFirstBounce
+		, writeFirstBounce
+		, gBuffer
+		);
+	timerStop(TIMER_MEGAKERNEL);
+	checkCUDAError("persistent queue");
+	stats.depths = 0;
+	firstBounceCached = firstBounceCached || writeFirstBounce;
+}
+
+/**
+ * Cooperative replacement for the bounce loop of pathtrace(): one
+ * cudaLaunchCooperativeKernel of traceCooperativeGrid, as many blocks as
+ * are co-resident (fewer if the paths need fewer). The bounces are neither
+ * timed nor counted individually, and the first-bounce cache stays
+ * slot-indexed.
+ */
+static void traceCooperative(int numPaths, const MeshData &meshData, GBufferPixel *gBuffer,
+		bool cacheFirstBounce, int rouletteBounces, int sampler, const LightData &lights) {
+	const int stageBytes = sharedGeomBytes + sharedMaterialBytes;
+	int blocksPerSM = 0;
+	cudaOccupancyMaxActiveBlocksPerMultiprocessor(&blocksPerSM, traceCooperativeGrid,
+		COOPERATIVE_BLOCK_SIZE, stageBytes);
+	const int blocks = std::max(std::min(blocksPerSM * launchConfig.multiprocessors,
+		(numPaths + COOPERATIVE_BLOCK_SIZE - 1) / COOPERATIVE_BLOCK_SIZE), 1);
+	cudaMemset(dev_cooperativeLive, 0, 3 * sizeof(int));
+
+	int traceDepth = hst_scene->state.traceDepth;
+	int geomCount = hst_scene->geoms.size();
+	bool stageGeoms = sharedGeomBytes > 0;
+	int materialCount = hst_scene->materials.size();
+	bool stageMaterials = sharedMaterialBytes > 0;
+	LightData launchLights = lights;
+	MeshData launchMeshData = meshData;
+	bool readFirstBounce = cacheFirstBounce && firstBounceCached;
+	bool writeFirstBounce = cacheFirstBounce && !firstBounceCached;
+	void *args[] = {
+		&numPaths, &traceDepth, &dev_paths, &dev_geoms, &geomCount, &stageGeoms, &dev_bvhNodes,
+		&dev_bvhGeomIndices, &launchMeshData, &dev_materials, &materialCount, &stageMaterials,
+		&rouletteBounces, &sampler, &launchLights, &dev_intersections, &dev_firstBounceCache,
+		&readFirstBounce, &writeFirstBounce, &gBuffer, &dev_cooperativeLive,
+	};
+	timerStart(TIMER_MEGAKERNEL);
+	cudaLaunchCooperativeKernel((const void *)traceCooperativeGrid, blocks, COOPERATIVE_BLOCK_SIZE, args,
+		stageBytes);
+	timerStop(TIMER_MEGAKERNEL);
+	checkCUDAError("cooperative launch");
+	stats.depths = 0;
+	firstBounceCached = firstBounceCached || writeFirstBounce;
+}
+
+// What the first bounce of a captured graph does
+enum GraphFirstBounce {
+	GRAPH_TRACE_FIRST,      // intersect into dev_intersections, no caching
+	GRAPH_WRITE_CACHE,      // intersect straight into dev_firstBounceCache
+	GRAPH_READ_CACHE,       // no intersection, shade from the cache
+};
+
+/**
+ * Captures traceDepth intersect + shade bounces over every path slot and
+ * instantiates them. The kernel arguments bake in the scene buffers, the
+ * G-buffer pointer (NULL when the G-buffer is not traced), the roulette
+ * depth and whether lights are sampled, so pathtraceReset() and a change
+ * of settings force a new capture. Nothing varies between replays but
+ * the camera rays generated ahead of them.
+ */
+static void captureGraph(int numPaths, const MeshData &meshData, GBufferPixel *gBuffer,
+		int firstBounce, int rouletteBounces, int sampler, const LightData &lights) {
+	if (graphCaptureStream == NULL) {
+		cudaStreamCreateWithFlags(&graphCaptureStream, cudaStreamNonBlocking);
+		cudaStreamSetAttribute(graphCaptureStream, cudaStreamAttributeAccessPolicyWindow, &primaryL2Policy);
+	}
+	const int traceDepth = hst_scene->state.traceDepth;
+	const int numMaterials = hst_scene->materials.size();
+	const int blockSize1d = 128;
+	dim3 numBlocksPaths = (numPaths + blockSize1d - 1) / blockSize1d;
+
+	cudaGraph_t graph;
+	cudaStreamBeginCapture(graphCaptureStream, cudaStreamCaptureModeThreadLocal);
+	for (int depth = 0; depth < traceDepth; depth++) {
+		ShadeableIntersections bounceIntersections = depth == 0 && firstBounce != GRAPH_TRACE_FIRST
+			? dev_firstBounceCache : dev_intersections;
+		if (depth > 0 || firstBounce != GRAPH_READ_CACHE) {
+			computeIntersectionsFixed<<<numBlocksPaths, blockSize1d, sharedGeomBytes, graphCaptureStream>>>(
+				depth
+				, numPaths
+				, dev_paths
+				, dev_geoms
+				, hst_scene->geoms.size()
+				, sharedGeomBytes > 0
+				, dev_bvhNodes
+				, dev_bvhGeomIndices
+				, meshData
+				, dev_materials
+				, bounceIntersections
+				, gBuffer
+				);
+		}
+		shadeFixedDepth<<<numBlocksPaths, blockSize1d, sharedMaterialBytes, graphCaptureStream>>>(
+			numPaths
+			, bounceIntersections
+			, dev_paths
+			, dev_materials
+			, numMaterials
+			, sharedMaterialBytes > 0
+			, rouletteBounces
+			, sampler
+			, lights
+			);
+	}
+	cudaStreamEndCapture(graphCaptureStream, &graph);
+	cudaGraphInstantiateWithFlags(&graphExec, graph, 0);
+	cudaGraphDestroy(graph);
+	graphFirstBounce = firstBounce;
+	graphRouletteBounces = rouletteBounces;
+	graphSampler = sampler;
+	graphGBuffer = gBuffer;
+	graphWideNodes = meshData.wideNodes;
+	graphLodScale = meshData.lodScale;
+	graphLightCount = lights.count;
+	graphLightTree = lights.lightTree;
+	graphEnvironmentPmf = lights.environment.pmf;
+	graphRayCounts = lights.rayCounts;
+	graphRayCost = lights.rayCost;
+	graphCache = lights.cache;
+	graphGuide = lights.guide;
+	graphPhotons = lights.photons;
+	graphReservoirs = lights.reservoirs;
+	graphGeomHits = lights.geomHits;
+	checkCUDAError("capture graph");
+}
+
+/**
+ * Graph replacement for the bounce loop of pathtrace(): a fixed traceDepth
+ * bounces with no compaction, replayed as one CUDA graph so the per-launch
+ * overhead of the split pipeline is paid once per capture. Pays off when
+ * launches are short (small scenes and resolutions), where that overhead
+ * is a real part of the frame.
+ */
+static void traceGraph(int numPaths, const MeshData &meshData, GBufferPixel *gBuffer,
+		bool cacheFirstBounce, int rouletteBounces, int sampler, const LightData &lights) {
+	int firstBounce = !cacheFirstBounce ? GRAPH_TRACE_FIRST
+		: firstBounceCached ? GRAPH_READ_CACHE : GRAPH_WRITE_CACHE;
+	if (graphExec == NULL || firstBounce != graphFirstBounce
+			|| rouletteBounces != graphRouletteBounces || sampler != graphSampler
+			|| gBuffer != graphGBuffer || lights.count != graphLightCount
+			|| lights.lightTree != graphLightTree
+			|| lights.environment.pmf != graphEnvironmentPmf
+			|| lights.rayCounts != graphRayCounts || lights.rayCost != graphRayCost
+			|| lights.cache.keys != graphCache.keys
+			|| lights.cache.cellSize != graphCache.cellSize
+			|| lights.guide.keys != graphGuide.keys
+			|| lights.guide.training != graphGuide.training
+			|| lights.guide.cellSize != graphGuide.cellSize
+			|| lights.photons.positions != graphPhotons.positions
+			|| lights.photons.radius != graphPhotons.radius
+			|| lights.reservoirs != graphReservoirs
+			|| lights.geomHits != graphGeomHits
+			|| meshData.wideNodes != graphWideNodes
+			|| meshData.lodScale != graphLodScale) {
+		NvtxRange captureRange("capture graph", firstBounce);
+		destroyGraph();
+		captureGraph(numPaths, meshData, gBuffer, firstBounce, rouletteBounces, sampler, lights);
+	}
+
+	timerStart(TIMER_MEGAKERNEL);
+	cudaGraphLaunch(graphExec, 0);
+	timerStop(TIMER_MEGAKERNEL);
+	checkCUDAError("graph launch");
+
+	firstBounceCached = firstBounceCached || firstBounce == GRAPH_WRITE_CACHE;
+	// The bounces are not timed or counted individually
+	stats.depths = 0;
+}
+
+// Adds a secondary device's staged accumulation into the primary's
+__global__ void kernAddAccumulation(int n, float4 * image, glm::vec2 * moments,
+	const float4 * addImage, const glm::vec2 * addMoments)
+{
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+	if (index < n)
+	{
+		float4 a = image[index];
+		float4 b = addImage[index];
+		image[index] = make_float4(a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w);
+		moments[index] += addMoments[index];
+	}
+}
+
+/**
+ * Sets how many GPUs pathtraceInit() spreads the samples over, counting the
+ * current (display) device first; 0 uses every visible device. Takes
+ * effect at the next pathtraceInit().
+ */
+void pathtraceUseDevices(int count) {
+	requestedDevices = count;
+}
+
+/**
+ * Whether the primary (display) device only merges, denoises and displays
+ * what the other devices trace, so that work never waits behind its own
+ * launches. Launches it would not split anyway stay on it. Needs a second
+ * device from pathtraceUseDevices(); takes effect at the next pathtrace().
+ */
+void pathtraceDedicateDisplayDevice(bool enable) {
+	dedicatedDisplay = enable;
+}
+
+// GPUs tracing, the primary included
+int pathtraceDeviceCount() {
+	return 1 + (int)traceDevices.size();
+}
+
+std::vector<int> pathtraceDevices() {
+	std::vector<int> devices(1, primaryDevice);
+	for (size_t i = 0; i < traceDevices.size(); i++) {
+		devices.push_back(traceDevices[i].device);
+	}
+	return devices;
+}
+
+static void initTraceDevices(Scene *scene) {
+	const Camera &cam = scene->state.camera;
+	const int pixelcount = cam.resolution.x * cam.resolution.y;
+	int visible = 1;
+	cudaGetDeviceCount(&visible);
+	cudaGetDevice(&primaryDevice);
+	const int wanted = requestedDevices < 1 ? visible : std::min(requestedDevices, visible);
+
+	for (int device = 0; device < visible && pathtraceDeviceCount() < wanted; device++) {
+		if (device == primaryDevice) {
+			continue;
+		}
+		TraceDevice td = {};
+		td.device = device;
+		// Peer access makes the merge copies direct; without it they are staged by the driver
+		int canAccess = 0;
+		cudaDeviceCanAccessPeer(&canAccess, primaryDevice, device);
+		if (canAccess) {
+			cudaDeviceEnablePeerAccess(device, 0);
+			deviceMemory::sharePool(primaryDevice, device);
+			deviceMemory::sharePool(device, primaryDevice);
+		}
+		cudaEventCreateWithFlags(&td.merged, cudaEventDisableTiming);
+		deviceMemory::allocate(&td.stagedImage, pixelcount * sizeof(float4));
+		deviceMemory::allocate(&td.stagedMoments, pixelcount * sizeof(glm::vec2));
+		cudaEventRecord(td.merged, 0);
+
+		cudaSetDevice(device);
+		cudaStreamCreateWithFlags(&td.stream, cudaStreamNonBlocking);
+		cudaEventCreateWithFlags(&td.copied, cudaEventDisableTiming);
+		cudaEventCreateWithFlags(&td.sceneRead, cudaEventDisableTiming);
+		bindTraceDeviceScene(td, uploadScene(scene));
+		td.environmentTexture = uploadTextures(scene, td.sdfVolumes, td.media);
+		deviceMemory::allocate(&td.gBuffer, pixelcount * sizeof(GBufferPixel));
+		deviceMemory::allocate(&td.image, pixelcount * sizeof(float4));
+		deviceMemory::allocate(&td.moments, pixelcount * sizeof(glm::vec2));
+		deviceMemory::allocate(&td.rayCounts, RAY_COUNT_SLOTS * sizeof(unsigned long long));
+		cudaMemset(td.image, 0, pixelcount * sizeof(float4));
+		cudaMemset(td.moments, 0, pixelcount * sizeof(glm::vec2));
+		cudaMemset(td.rayCounts, 0, RAY_COUNT_SLOTS * sizeof(unsigned long long));
+		cudaSetDevice(primaryDevice);
+
+		traceDevices.push_back(td);
+	}
+	if (dedicatedDisplay && traceDevices.empty()) {
+		printf("No second GPU to trace on; the display GPU traces as well\n");
+	}
+	checkCUDAError("initTraceDevices");
+}
+
+static void resetTraceDevices() {
+	const Camera &cam = hst_scene->state.camera;
+	const int pixelcount = cam.resolution.x * cam.resolution.y;
+	for (size_t i = 0; i < traceDevices.size(); i++) {
+		TraceDevice &td = traceDevices[i];
+		cudaSetDevice(td.device);
+		cudaMemsetAsync(td.image, 0, pixelcount * sizeof(float4), td.stream);
+		cudaMemsetAsync(td.moments, 0, pixelcount * sizeof(glm::vec2), td.stream);
+		td.pending = false;
+	}
+	cudaSetDevice(primaryDevice);
+}
+
+static void freeTraceDevices() {
+	for (size_t i = 0; i < traceDevices.size(); i++) {
+		TraceDevice &td = traceDevices[i];
+		deviceMemory::release(td.stagedImage);
+		deviceMemory::release(td.stagedMoments);
+		cudaEventDestroy(td.merged);
+
+		cudaSetDevice(td.device);
+		cudaStreamSynchronize(td.stream);
+		releaseSceneBuffers(td.sceneData, td.sceneGeometry, td.geometryPaging);
+		deviceMemory::release(td.lbvhNodes);
+		deviceMemory::release(td.lbvhGeomIndices);
+		freePathSegments(td.paths);
+		deviceMemory::release(td.gBuffer);
+		deviceMemory::release(td.image);
+		deviceMemory::release(td.moments);
+		deviceMemory::release(td.rayCounts);
+		cudaEventDestroy(td.copied);
+		cudaEventDestroy(td.sceneRead);
+		cudaStreamDestroy(td.stream);
+		cudaSetDevice(primaryDevice);
+	}
+	traceDevices.clear();
+}
+
+/**
+ * Queues samples firstSample .. firstSample + samples - 1 of every pixel
+ * on secondary device `td`, accumulated into its own image. Returns at
+ * once; the device traces while the primary runs its own share.
+ */
+static void traceOnDevice(TraceDevice &td, int firstSample, int samples,
+		int rouletteBounces, int sampler, bool jitter, bool nextEventEstimation, bool wideMeshBVH,
+		bool meshLOD, bool watertight, bool shortStack, bool lightTree, bool tiledPathOrder, int gather) {
+	const int traceDepth = hst_scene->state.traceDepth;
+	const Camera &cam = hst_scene->state.camera;
+	const int pixelcount = cam.resolution.x * cam.resolution.y;
+	const int numPaths = pixelcount * samples;
+	const dim3 blockSize2d(8, 8);
+	const dim3 blocksPerGrid2d(
+			(cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+			(cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+	const int blockSize1d = 128;
+	dim3 numBlocksPaths = (numPaths + blockSize1d - 1) / blockSize1d;
+
+	cudaSetDevice(td.device);
+	if (numPaths > td.pathCapacity) {
+		freePathSegments(td.paths);
+		allocPathSegments(td.paths, numPaths);
+		td.pathCapacity = numPaths;
+	}
+
+	MeshData meshData;
+	meshData.meshes = td.meshes;
+	meshData.nodes = td.meshBvhNodes;
+	meshData.wideNodes = wideMeshBVH ? td.meshWideNodes : NULL;
+	meshData.triangles = td.meshTriangles;
+	meshData.triangleRecords = td.meshTriangleRecords;
+	meshData.positions = td.meshPositions;
+	meshData.normals = td.meshNormals;
+	meshData.uvs = td.meshUVs;
+	meshData.compactPositions = td.meshCompactPositions;
+	meshData.compactNormals = td.meshCompactNormals;
+	meshData.compactUVs = td.meshCompactUVs;
+	meshData.lodScale = meshLOD ? 1.0f : 0.0f;
+	meshData.watertight = watertight;
+	meshData.shortStack = shortStack;
+	meshData.clouds = td.sphereClouds;
+	meshData.cloudNodes = td.cloudBvhNodes;
+	meshData.cloudSpheres = td.cloudSpheres;
+	meshData.sdfs = td.sdfVolumes;
+	meshData.sdfVoxels = NULL;
+	meshData.nodeVisits = NULL;
+
+	LightData lights;
+	lights.lights = td.lights;
+	lights.count = nextEventEstimation ? hst_scene->lights.size() : 0;
+	lights.lightTree = lightTree && lights.count > 0 ? td.lightNodes : NULL;
+	lights.geoms = td.geoms;
+	lights.geomCount = hst_scene->geoms.size();
+	lights.bvhNodes = td.bvhNodes;
+	lights.bvhGeomIndices = td.bvhGeomIndices;
+	lights.meshData = meshData;
+	lights.environment = environmentLight(hst_scene, td.environmentTexture, td.environmentMarginalCdf,
+		td.environmentConditionalCdf, nextEventEstimation);
+	lights.rayCounts = telemetryEnabled ? td.rayCounts : NULL;
+	lights.traceDepth = traceDepth;
+	lights.firstPixel = 0;
+	lights.cache = RadianceCache();
+	lights.guide = PathGuide();
+	lights.photons = PhotonGrid();
+	lights.reservoirs = NULL;
+	lights.geomHits = NULL;
+	lights.rayCost = NULL;
+	lights.media = mediumData(hst_scene, td.media, td.mediumMajorants);
+	lights.packetShadows = false;
+
+	// Stereo images are only traced on the primary
+	launchCameraRays(blocksPerGrid2d, blockSize2d, td.stream, cam, 0.0f, traceDepth,
+		0, cam.resolution.y, 0, cam.resolution.x, 1, firstSample, samples, jitter, sampler, tiledPathOrder,
+		td.paths);
+	const int megakernelBlockSize = launchConfig.megakernel.blockSize;
+	dim3 numBlocksMegakernel = (numPaths + megakernelBlockSize - 1) / megakernelBlockSize;
+	pathtraceMegakernel<<<numBlocksMegakernel, megakernelBlockSize, sharedGeomBytes + sharedMaterialBytes,
+		td.stream>>>(
+		numPaths
+		, td.paths
+		, td.geoms
+		, hst_scene->geoms.size()
+		, sharedGeomBytes > 0
+		, td.bvhNodes
+		, td.bvhGeomIndices
+		, meshData
+		, td.materials
+		, hst_scene->materials.size()
+		, sharedMaterialBytes > 0
+		, rouletteBounces
+		, sampler
+		, lights
+		, ShadeableIntersections()
+		, false
+		, false
+		, td.gBuffer
+		);
+	// The megakernel leaves paths in their slots, ready for the segmented gather
+	if (samples > 1 && gather == GATHER_SEGMENTED) {
+		dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+		gatherSampleSlots<<<numBlocksPixels, blockSize1d, 0, td.stream>>>(pixelcount, cam.resolution.x,
+			0, cam.resolution.x, samples, td.image, td.moments, td.paths.colorPixel, NULL);
+	} else {
+		finalGather<<<numBlocksPaths, blockSize1d, 0, td.stream>>>(
+			numPaths, td.image, td.moments, td.paths, samples > 1, NULL);
+	}
+	td.pending = true;
+	cudaSetDevice(primaryDevice);
+	checkCUDAError("trace on device");
+}
+
+/**
+ * Folds every secondary device's unmerged samples into dev_image and
+ * dev_moments, in stream order on the default stream. Each device copies
+ * its accumulation to the primary's staging buffers and clears it on its
+ * own stream, so it can go on tracing as soon as the copy is done.
+ */
+static void mergeTraceDevices() {
+	const Camera &cam = hst_scene->state.camera;
+	const int pixelcount = cam.resolution.x * cam.resolution.y;
+	const int blockSize1d = 128;
+	dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+
+	bool waited = false;
+	for (size_t i = 0; i < traceDevices.size(); i++) {
+		TraceDevice &td = traceDevices[i];
+		if (!td.pending) {
+			continue;
+		}
+		NvtxRange mergeRange("merge device", td.device);
+		cudaSetDevice(td.device);
+		cudaStreamWaitEvent(td.stream, td.merged, 0);
+		cudaMemcpyPeerAsync(td.stagedImage, primaryDevice, td.image, td.device,
+			pixelcount * sizeof(float4), td.stream);
+		cudaMemcpyPeerAsync(td.stagedMoments, primaryDevice, td.moments, td.device,
+			pixelcount * sizeof(glm::vec2), td.stream);
+		cudaMemsetAsync(td.image, 0, pixelcount * sizeof(float4), td.stream);
+		cudaMemsetAsync(td.moments, 0, pixelcount * sizeof(glm::vec2), td.stream);
+		cudaEventRecord(td.copied, td.stream);
+		cudaSetDevice(primaryDevice);
+
+		// The display may still be reading the image being added to
+		if (!waited) {
+			waitForDisplay();
+			waited = true;
+		}
+		cudaStreamWaitEvent(0, td.copied, 0);
+		kernAddAccumulation<<<numBlocksPixels, blockSize1d>>>(pixelcount, dev_image, dev_moments,
+			td.stagedImage, td.stagedMoments);
+		cudaEventRecord(td.merged, 0);
+		td.pending = false;
+	}
+	checkCUDAError("merge devices");
+}
+
+/**
+ * Whether the G-buffer comes from computeCentreGBuffer's pixel-centre
+ * pinhole rays rather than the camera rays of bands `columns` wide. Unless
+ * the jittered G-buffer is wanted, antialiasing leaves it to them, as do
+ * part rows and the tiled path order, which traceRows cannot write it
+ * from, and lens or motion blur, whose rays the denoiser cannot rebuild
+ * positions along. Without antialiasing those are the same hits. ReSTIR
+ * needs the surfaces before the camera rays are traced.
+ */
+static bool centreGBufferPass(const PathtraceOptions &options, const Camera &cam, int columns) {
+    return (options.antialias && !options.jitteredGBuffer) || columns < cam.resolution.x
+        || options.tiledPathOrder || cameraBlurs(cam) || options.restir || options.bidirectional;
+}
+
+/**
+ * Whether PathtraceOptions::rasterPrimary's hits stand for the pixel-centre
+ * rays of this camera: rasterization sees the full-detail meshes of one
+ * view. With `cameraRays` they must stand for the camera rays themselves,
+ * which takes a pinhole without antialiasing.
+ */
+static bool rasterPrimaryHits(const PathtraceOptions &options, const Camera &cam, bool cameraRays) {
+    return options.rasterPrimary && rasterHitsValid && !options.meshLOD
+        && hst_scene->state.viewCount() == 1
+        && !(cameraRays && (options.antialias || cameraBlurs(cam)));
+}
+
+/**
+ * Whether PathtraceOptions::tileCulling's lists stand for this camera's
+ * rays: one pinhole view, each of whose rays stays within a pixel of its
+ * own. They are only binned on the primary GPU, for the split pipeline.
+ */
+static bool tileCullingApplies(const PathtraceOptions &options, const Camera &cam) {
+    return options.tileCulling && options.pipeline == PIPELINE_SPLIT && !cameraBlurs(cam)
+        && hst_scene->state.viewCount() == 1 && !hst_scene->geoms.empty();
+}
+
+/**
+ * Bounce captures (pathtraceCaptureBounce): one split-pipeline bounce's
+ * kernel inputs and outputs as a binary file, for pathtraceReplay to time
+ * the bounce's kernels on without the window, the scene parser or the
+ * rest of the iteration. Native byte order, like the scene cache. The
+ * header is followed by the bound scene arrays in CaptureArray order, then
+ * the bounce's path segments and intersections, each SoA array in turn as
+ * in PathSegments and ShadeableIntersections, and the whole image's
+ * G-buffer, all as raw bytes.
+ */
+
+// Bumped whenever the layout below changes
+static const char CAPTURE_MAGIC[8] = { 'P', 'T', 'C', 'A', 'P', '0', '0', '5' };
+
+// The scene arrays a capture holds, in file order
+enum CaptureArray {
+    CAPTURE_GEOMS,
+    CAPTURE_BVH_NODES,
+    CAPTURE_BVH_GEOM_INDICES,
+    CAPTURE_LIGHTS,
+    CAPTURE_LIGHT_NODES,
+    CAPTURE_MESHES,
+    CAPTURE_MESH_BVH_NODES,
+    CAPTURE_MESH_WIDE_NODES,
+    CAPTURE_MESH_TRIANGLES,
+    CAPTURE_MESH_TRIANGLE_RECORDS,
+    CAPTURE_MESH_POSITIONS,
+    CAPTURE_MESH_NORMALS,
+    CAPTURE_MESH_UVS,
+    CAPTURE_MESH_COMPACT_POSITIONS,
+    CAPTURE_MESH_COMPACT_NORMALS,
+    CAPTURE_MESH_COMPACT_UVS,
+    CAPTURE_SPHERE_CLOUDS,
+    CAPTURE_CLOUD_BVH_NODES,
+    CAPTURE_CLOUD_SPHERES,
+    CAPTURE_SDF_VOLUMES,
+    CAPTURE_MEDIA,
+    CAPTURE_MEDIUM_MAJORANTS,
+    CAPTURE_MATERIALS,
+    CAPTURE_ENVIRONMENT_MARGINAL_CDF,
+    CAPTURE_ENVIRONMENT_CONDITIONAL_CDF,
+    CAPTURE_ARRAY_COUNT,
+};
+
+struct CaptureHeader {
+    char magic[8];
+    uint32_t structBytes[8];    // catches replays built with other struct layouts
+    Camera camera;
+    int firstSample;        // the launch's first sample number
+    int depth;              // the captured bounce
+    int paths;              // length of every segment and intersection array
+    int gBufferPixels;      // the image's, 0 before pathtraceInit allocated it
+    int bounceGBuffer;      // the bounce's kernels took the G-buffer, rather than computeCentreGBuffer
+    int firstPixel;         // image index of the band's first pixel
+    int traceDepth;
+    int rouletteBounces;
+    int sampler;
+    int materialFeatures;   // of the shadeSimpleMaterials variant the bounce ran
+    int hitRecords;         // intersections are computeHitRecords' compact ones
+    int multipleSamples;    // the launch traced several samples per pixel
+    int lightCount;         // 0 without next-event estimation
+    int lightTree;          // next-event estimation picked lights through the light nodes
+    int wideMeshBVH;
+    int watertight;
+    int shortStack;
+    int compactPaths;       // segments are in the compact layout
+    float lodScale;
+    float pixelSpread;      // c_pixelSpread
+    int environmentWidth;
+    int environmentHeight;
+    float environmentIntensity;
+    float environmentPmf;
+    uint64_t arrayBytes[CAPTURE_ARRAY_COUNT];
+};
+
+static void captureStructBytes(uint32_t bytes[8]) {
+    bytes[0] = sizeof(DeviceGeom);
+    bytes[1] = sizeof(Material);
+    bytes[2] = sizeof(BVHNode);
+    bytes[3] = sizeof(Light);
+    bytes[4] = sizeof(Camera);
+    bytes[5] = sizeof(GBufferPixel);
+    bytes[6] = sizeof(SdfVolume);
+    bytes[7] = sizeof(Medium);
+}
+
+// The bound scene arrays of the primary device in CaptureArray order, and their sizes
+static void boundSceneArrays(const void *arrays[CAPTURE_ARRAY_COUNT], uint64_t bytes[CAPTURE_ARRAY_COUNT]) {
+    const Scene *scene = hst_scene;
+    const bool lbvh = dev_bvhNodes == dev_lbvhNodes;
+    int i = 0;
+    const auto add = [&](const void *array, size_t size) {
+        arrays[i] = array;
+        bytes[i] = array != NULL ? size : 0;
+        i++;
+    };
+    add(dev_geoms, scene->deviceGeoms.size() * sizeof(DeviceGeom));
+    add(dev_bvhNodes, boundBVHNodeCount(scene) * sizeof(BVHNode));
+    add(dev_bvhGeomIndices, (lbvh ? scene->deviceGeoms.size() : scene->bvhGeomIndices.size()) * sizeof(int));
+    add(dev_lights, scene->lights.size() * sizeof(Light));
+    add(dev_lightNodes, scene->lightNodes.size() * sizeof(LightNode));
+    add(dev_meshes, scene->meshes.size() * sizeof(Mesh));
+    add(dev_meshBvhNodes, scene->meshBvhNodes.size() * sizeof(BVHNode));
+    add(dev_meshWideNodes, scene->meshWideNodes.size() * sizeof(WideBVHNode));
+    add(dev_meshTriangles, scene->meshTriangles.size() * sizeof(glm::ivec3));
+    add(dev_meshTriangleRecords, scene->meshTriangleRecords.size() * sizeof(TriangleRecord));
+    add(dev_meshPositions, scene->meshPositions.size() * sizeof(glm::vec3));
+    add(dev_meshNormals, scene->meshNormals.size() * sizeof(glm::vec3));
+    add(dev_meshUVs, scene->meshUVs.size() * sizeof(glm::vec2));
+    add(dev_meshCompactPositions, scene->meshPositions.size() * sizeof(ushort3));
+    add(dev_meshCompactNormals, scene->meshNormals.size() * sizeof(ushort2));
+    add(dev_meshCompactUVs, scene->meshUVs.size() * sizeof(__half2));
+    add(dev_sphereClouds, scene->sphereClouds.size() * sizeof(SphereCloud));
+    add(dev_cloudBvhNodes, scene->cloudBvhNodes.size() * sizeof(BVHNode));
+    add(dev_cloudSpheres, scene->cloudSpheres.size() * sizeof(CloudSphere));
+    add(dev_sdfVolumes, scene->sdfVolumes.size() * sizeof(SdfVolume));
+    add(dev_media, scene->media.size() * sizeof(Medium));
+    add(dev_mediumMajorants, scene->mediumMajorants.size() * sizeof(float));
+    add(dev_materials, scene->materials.size() * sizeof(Material));
+    add(dev_environmentMarginalCdf, scene->environment.marginalCdf.size() * sizeof(float));
+    add(dev_environmentConditionalCdf, scene->environment.conditionalCdf.size() * sizeof(float));
+}
+
+// Appends `bytes` of device (or managed or mapped) memory at `data` to `out`
+static bool writeDeviceBytes(FILE *out, const void *data, size_t bytes) {
+    std::vector<char> host(bytes);
+    if (bytes > 0) {
+        cudaMemcpy(host.data(), data, bytes, cudaMemcpyDeviceToHost);
+    }
+    return fwrite(host.data(), 1, bytes, out) == bytes;
+}
+
+// Either layout, each array in turn
+static bool writeCapturedPaths(FILE *out, const PathSegments &paths, int n) {
+    void *arrays[5];
+    size_t bytes[5];
+    const int count = pathSegmentArrays(paths, arrays, bytes);
+    bool written = true;
+    for (int i = 0; written && i < count; i++) {
+        written = writeDeviceBytes(out, arrays[i], n * bytes[i]);
+    }
+    return written;
+}
+
+static bool writeCapturedIntersections(FILE *out, const ShadeableIntersections &intersections, int n) {
+    return writeDeviceBytes(out, intersections.tMaterial, n * sizeof(float2))
+        && writeDeviceBytes(out, intersections.normal, n * sizeof(float4))
+        && writeDeviceBytes(out, intersections.surface, n * sizeof(float4))
+        && writeDeviceBytes(out, intersections.hitRecord, n * sizeof(int2));
+}
+
+/**
+ * Writes captureFile for the bounce about to be shaded: the `numPaths`
+ * paths as its intersection kernel read them (which only writes the
+ * intersections) and its intersections, before any sort by material.
+ * What the replay cannot rebuild is left out: texture objects, and the
+ * radiance cache, guiding, photon and ReSTIR state, whose reads the
+ * replayed shading goes without. The request is dropped either way.
+ */
+static void captureBounce(int depth, int numPaths, const PathSegments &paths,
+        const ShadeableIntersections &intersections, bool bounceGBuffer, bool hitRecords, int materialFeatures,
+        int rouletteBounces, int sampler, bool multipleSamples, int firstSample, const MeshData &meshData,
+        const LightData &lights) {
+    const std::string file = captureFile;
+    captureFile.clear();
+    const glm::ivec2 resolution = imageResolution();
+
+    CaptureHeader header = {};
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    captureStructBytes(header.structBytes);
+    header.camera = hst_scene->state.camera;
+    header.firstSample = firstSample;
+    header.depth = depth;
+    header.paths = numPaths;
+    header.gBufferPixels = dev_gBuffer != NULL ? resolution.x * resolution.y : 0;
+    header.bounceGBuffer = bounceGBuffer;
+    header.firstPixel = lights.firstPixel;
+    header.traceDepth = lights.traceDepth;
+    header.rouletteBounces = rouletteBounces;
+    header.sampler = sampler;
+    header.materialFeatures = materialFeatures;
+    header.hitRecords = hitRecords;
+    header.multipleSamples = multipleSamples;
+    header.lightCount = lights.count;
+    header.lightTree = lights.lightTree != NULL;
+    header.wideMeshBVH = meshData.wideNodes != NULL;
+    header.watertight = meshData.watertight;
+    header.shortStack = meshData.shortStack;
+    header.compactPaths = isCompact(paths);
+    header.lodScale = meshData.lodScale;
+    header.pixelSpread = header.camera.pixelLength.y;
+    header.environmentWidth = lights.environment.width;
+    header.environmentHeight = lights.environment.height;
+    header.environmentIntensity = lights.environment.intensity;
+    header.environmentPmf = lights.environment.pmf;
+    const void *arrays[CAPTURE_ARRAY_COUNT];
+    boundSceneArrays(arrays, header.arrayBytes);
+
+    FILE *out = fopen(file.c_str(), "wb");
+    bool written = out != NULL && fwrite(&header, sizeof(header), 1, out) == 1;
+    for (int i = 0; written && i < CAPTURE_ARRAY_COUNT; i++) {
+        written = writeDeviceBytes(out, arrays[i], header.arrayBytes[i]);
+    }
+    written = written && writeCapturedPaths(out, paths, numPaths)
+        && writeCapturedIntersections(out, intersections, numPaths)
+        && writeDeviceBytes(out, dev_gBuffer, header.gBufferPixels * sizeof(GBufferPixel));
+    if (out != NULL) {
+        written = fclose(out) == 0 && written;
+    }
+    checkCUDAError("capture bounce");
+    if (written) {
+        printf("Captured bounce %d (%d paths) to %s\n", depth, numPaths, file.c_str());
+    } else {
+        printf("Cannot write the bounce capture %s\n", file.c_str());
+    }
+}
+
+static bool readCapturedBytes(FILE *in, void *data, size_t bytes) {
+    return fread(data, 1, bytes, in) == bytes;
+}
+
+// Reads `n` captured segments or intersections into `dst`'s device arrays
+static bool readCapturedPaths(FILE *in, const PathSegments &dst, int n) {
+    void *arrays[5];
+    size_t bytes[5];
+    const int count = pathSegmentArrays(dst, arrays, bytes);
+    std::vector<char> host(n * sizeof(float4));
+    for (int i = 0; i < count; i++) {
+        if (!readCapturedBytes(in, host.data(), n * bytes[i])) {
+            return false;
+        }
+        cudaMemcpy(arrays[i], host.data(), n * bytes[i], cudaMemcpyHostToDevice);
+    }
+    return true;
+}
+
+static bool readCapturedIntersections(FILE *in, const ShadeableIntersections &dst, int n) {
+    std::vector<char> host(n * sizeof(float4));
+    void *arrays[4] = { dst.tMaterial, dst.normal, dst.surface, dst.hitRecord };
+    const size_t bytes[4] = { n * sizeof(float2), n * sizeof(float4), n * sizeof(float4), n * sizeof(int2) };
+    for (int i = 0; i < 4; i++) {
+        if (!readCapturedBytes(in, host.data(), bytes[i])) {
+            return false;
+        }
+        cudaMemcpy(arrays[i], host.data(), bytes[i], cudaMemcpyHostToDevice);
+    }
+    return true;
+}
+
+/**
+ * Replays the bounce that `file` captured on the current device, outside
+ * pathtraceInit / pathtraceFree: its scene arrays go into one allocation,
+ * as uploadScene packs them, and the intersection and shading kernels run
+ * `warmup` untimed and then `repetitions` timed times each on the captured
+ * paths, which are restored before every run. Texture maps, SDF volumes
+ * and heterogeneous media read as absent (their objects are per process),
+ * and shading adds nothing to an image. `kernel` picks "intersect" or
+ * "shade" alone, or both when empty.
+ */
+bool pathtraceReplay(const std::string &file, const std::string &kernel, int warmup, int repetitions,
+        ReplayResult &result, std::string &error) {
+    FILE *in = fopen(file.c_str(), "rb");
+    if (in == NULL) {
+        error = "cannot open " + file;
+        return false;
+    }
+    CaptureHeader header;
+    uint32_t structBytes[8];
+    captureStructBytes(structBytes);
+    if (!readCapturedBytes(in, &header, sizeof(header)) || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0
+            || memcmp(header.structBytes, structBytes, sizeof(structBytes)) != 0) {
+        fclose(in);
+        error = file + " is not a bounce capture of this build";
+        return false;
+    }
+
+    // Packed like uploadScene's data, with texture objects cleared
+    size_t offsets[CAPTURE_ARRAY_COUNT];
+    size_t bytes = 0;
+    for (int i = 0; i < CAPTURE_ARRAY_COUNT; i++) {
+        offsets[i] = (bytes + 15) & ~(size_t)15;
+        bytes = offsets[i] + header.arrayBytes[i];
+    }
+    std::vector<char> staging(std::max(bytes, (size_t)16));
+    bool ok = true;
+    for (int i = 0; ok && i < CAPTURE_ARRAY_COUNT; i++) {
+        ok = readCapturedBytes(in, staging.data() + offsets[i], header.arrayBytes[i]);
+    }
+    SdfVolume *sdfs = reinterpret_cast<SdfVolume *>(staging.data() + offsets[CAPTURE_SDF_VOLUMES]);
+    for (size_t i = 0; i < header.arrayBytes[CAPTURE_SDF_VOLUMES] / sizeof(SdfVolume); i++) {
+        sdfs[i].texture = 0;
+    }
+    Medium *media = reinterpret_cast<Medium *>(staging.data() + offsets[CAPTURE_MEDIA]);
+    for (size_t i = 0; i < header.arrayBytes[CAPTURE_MEDIA] / sizeof(Medium); i++) {
+        media[i].texture = 0;
+    }
+    char *data = NULL;
+    deviceMemory::allocate(&data, staging.size());
+    cudaMemcpy(data, staging.data(), staging.size(), cudaMemcpyHostToDevice);
+    const auto array = [&](int i) -> char * {
+        return header.arrayBytes[i] > 0 ? data + offsets[i] : NULL;
+    };
+
+    const int n = std::max(header.paths, 1);
+    PathSegments captured = {};
+    PathSegments paths = {};
+    ShadeableIntersections capturedHits = {};
+    ShadeableIntersections hits = {};
+    GBufferPixel *gBuffer = NULL;
+    allocPathSegments(captured, n, header.compactPaths != 0);
+    allocPathSegments(paths, n, header.compactPaths != 0);
+    allocIntersections(capturedHits, n);
+    allocIntersections(hits, n);
+    ok = ok && readCapturedPaths(in, captured, header.paths) && readCapturedIntersections(in, capturedHits, header.paths);
+    if (ok && header.gBufferPixels > 0) {
+        std::vector<GBufferPixel> pixels(header.gBufferPixels);
+        ok = readCapturedBytes(in, pixels.data(), pixels.size() * sizeof(GBufferPixel));
+        deviceMemory::allocate(&gBuffer, pixels.size() * sizeof(GBufferPixel));
+        cudaMemcpy(gBuffer, pixels.data(), pixels.size() * sizeof(GBufferPixel), cudaMemcpyHostToDevice);
+    }
+    fclose(in);
+
+    const DeviceGeom *geoms = reinterpret_cast<DeviceGeom *>(array(CAPTURE_GEOMS));
+    const int geomCount = header.arrayBytes[CAPTURE_GEOMS] / sizeof(DeviceGeom);
+    const BVHNode *bvhNodes = reinterpret_cast<BVHNode *>(array(CAPTURE_BVH_NODES));
+    const int *bvhGeomIndices = reinterpret_cast<int *>(array(CAPTURE_BVH_GEOM_INDICES));
+    Material *materials = reinterpret_cast<Material *>(array(CAPTURE_MATERIALS));
+    const int materialCount = header.arrayBytes[CAPTURE_MATERIALS] / sizeof(Material);
+    MeshData meshData = {};
+    meshData.meshes = reinterpret_cast<Mesh *>(array(CAPTURE_MESHES));
+    meshData.nodes = reinterpret_cast<BVHNode *>(array(CAPTURE_MESH_BVH_NODES));
+    meshData.wideNodes = header.wideMeshBVH ? reinterpret_cast<WideBVHNode *>(array(CAPTURE_MESH_WIDE_NODES)) : NULL;
+    meshData.triangles = reinterpret_cast<glm::ivec3 *>(array(CAPTURE_MESH_TRIANGLES));
+    meshData.triangleRecords = reinterpret_cast<TriangleRecord *>(array(CAPTURE_MESH_TRIANGLE_RECORDS));
+    meshData.positions = reinterpret_cast<glm::vec3 *>(array(CAPTURE_MESH_POSITIONS));
+    meshData.normals = reinterpret_cast<glm::vec3 *>(array(CAPTURE_MESH_NORMALS));
+    meshData.uvs = reinterpret_cast<glm::vec2 *>(array(CAPTURE_MESH_UVS));
+    meshData.compactPositions = reinterpret_cast<ushort3 *>(array(CAPTURE_MESH_COMPACT_POSITIONS));
+    meshData.compactNormals = reinterpret_cast<ushort2 *>(array(CAPTURE_MESH_COMPACT_NORMALS));
+    meshData.compactUVs = reinterpret_cast<__half2 *>(array(CAPTURE_MESH_COMPACT_UVS));
+    meshData.lodScale = header.lodScale;
+    meshData.watertight = header.watertight != 0;
+    meshData.shortStack = header.shortStack != 0;
+    meshData.clouds = reinterpret_cast<SphereCloud *>(array(CAPTURE_SPHERE_CLOUDS));
+    meshData.cloudNodes = reinterpret_cast<BVHNode *>(array(CAPTURE_CLOUD_BVH_NODES));
+    meshData.cloudSpheres = reinterpret_cast<CloudSphere *>(array(CAPTURE_CLOUD_SPHERES));
+    meshData.sdfs = reinterpret_cast<SdfVolume *>(array(CAPTURE_SDF_VOLUMES));
+    LightData lights = {};
+    lights.lights = reinterpret_cast<Light *>(array(CAPTURE_LIGHTS));
+    lights.count = header.lightCount;
+    lights.lightTree = header.lightTree ? reinterpret_cast<LightNode *>(array(CAPTURE_LIGHT_NODES)) : NULL;
+    lights.environment.marginalCdf = reinterpret_cast<float *>(array(CAPTURE_ENVIRONMENT_MARGINAL_CDF));
+    lights.environment.conditionalCdf = reinterpret_cast<float *>(array(CAPTURE_ENVIRONMENT_CONDITIONAL_CDF));
+    lights.environment.width = header.environmentWidth;
+    lights.environment.height = header.environmentHeight;
+    lights.environment.intensity = header.environmentIntensity;
+    lights.environment.pmf = header.environmentPmf;
+    lights.geoms = geoms;
+    lights.geomCount = geomCount;
+    lights.bvhNodes = bvhNodes;
+    lights.bvhGeomIndices = bvhGeomIndices;
+    lights.meshData = meshData;
+    lights.traceDepth = header.traceDepth;
+    lights.firstPixel = header.firstPixel;
+    lights.media.media = reinterpret_cast<Medium *>(array(CAPTURE_MEDIA));
+    lights.media.count = header.arrayBytes[CAPTURE_MEDIA] / sizeof(Medium);
+    lights.media.majorants = reinterpret_cast<float *>(array(CAPTURE_MEDIUM_MAJORANTS));
+
+    // No maps, and the launch configuration a scene of these arrays would get
+    DeviceTexture table[MAX_TEXTURES] = {};
+    cudaMemcpyToSymbol(c_textures, table, sizeof(table));
+    cudaMemcpyToSymbol(c_pixelSpread, &header.pixelSpread, sizeof(float));
+    sharedGeomBytes = geomCount * sizeof(DeviceGeom) > SCENE_SHARED_MAX_BYTES ? 0 : geomCount * sizeof(DeviceGeom);
+    sharedMaterialBytes = materialCount * sizeof(Material) > SCENE_SHARED_MAX_BYTES
+        ? 0 : materialCount * sizeof(Material);
+    chooseLaunchConfiguration();
+    GBufferPixel *bandGBuffer = gBuffer != NULL && header.bounceGBuffer ? gBuffer + header.firstPixel : NULL;
+
+    result.resolution = header.camera.resolution;
+    result.depth = header.depth;
+    result.paths = header.paths;
+    result.geoms = geomCount;
+    result.hitRecords = header.hitRecords != 0;
+    result.intersectMs.clear();
+    result.shadeMs.clear();
+    result.mismatches = 0;
+    cudaEvent_t start;
+    cudaEvent_t stop;
+    cudaEventCreate(&start);
+    cudaEventCreate(&stop);
+    const auto timeKernel = [&](const std::function<void()> &launch, std::vector<double> &ms) {
+        for (int rep = 0; rep < warmup + repetitions; rep++) {
+            copyPathSegments(paths, captured, header.paths);
+            copyIntersections(hits, capturedHits, header.paths);
+            cudaEventRecord(start);
+            launch();
+            cudaEventRecord(stop);
+            cudaEventSynchronize(stop);
+            float elapsed = 0.0f;
+            cudaEventElapsedTime(&elapsed, start, stop);
+            if (rep >= warmup) {
+                ms.push_back(elapsed);
+            }
+        }
+    };
+
+    if (ok && header.paths > 0 && (kernel.empty() || kernel == "intersect")) {
+        const KernelLaunch &launch = header.hitRecords ? launchConfig.hitRecords : launchConfig.intersect;
+        dim3 numblocks = (header.paths + launch.blockSize - 1) / launch.blockSize;
+        timeKernel([&]() {
+            if (header.hitRecords) {
+                computeHitRecords<<<numblocks, launch.blockSize, sharedGeomBytes>>>(header.paths, paths, geoms,
+                    geomCount, sharedGeomBytes > 0, bvhNodes, bvhGeomIndices, meshData, hits, NULL);
+            } else {
+                computeIntersections<<<numblocks, launch.blockSize, sharedGeomBytes>>>(header.depth, header.paths,
+                    paths, geoms, geomCount, sharedGeomBytes > 0, bvhNodes, bvhGeomIndices, meshData, materials,
+                    hits, bandGBuffer, NULL, false);
+            }
+        }, result.intersectMs);
+        // The last run's hits against the captured ones
+        std::vector<float2> replayed(header.paths);
+        std::vector<float2> expected(header.paths);
+        cudaMemcpy(replayed.data(), hits.tMaterial, header.paths * sizeof(float2), cudaMemcpyDeviceToHost);
+        cudaMemcpy(expected.data(), capturedHits.tMaterial, header.paths * sizeof(float2), cudaMemcpyDeviceToHost);
+        for (int i = 0; i < header.paths; i++) {
+            result.mismatches += memcmp(&replayed[i], &expected[i], sizeof(float2)) != 0;
+        }
+    }
+    if (ok && header.paths > 0 && (kernel.empty() || kernel == "shade")) {
+        const int blockSize = launchConfig.shade.blockSize;
+        dim3 numblocks = (header.paths + blockSize - 1) / blockSize;
+        const ShadeKernel shadeVariant = shadeKernel(header.materialFeatures);
+        timeKernel([&]() {
+            shadeVariant<<<numblocks, blockSize, sharedMaterialBytes>>>(header.paths, hits, paths, materials,
+                materialCount, sharedMaterialBytes > 0, header.rouletteBounces, header.sampler, lights, NULL, NULL,
+                header.multipleSamples != 0, header.hitRecords != 0);
+        }, result.shadeMs);
+    }
+    cudaEventDestroy(start);
+    cudaEventDestroy(stop);
+    checkCUDAError("replay bounce");
+
+    freePathSegments(captured);
+    freePathSegments(paths);
+    freeIntersections(capturedHits);
+    freeIntersections(hits);
+    deviceMemory::release(gBuffer);
+    deviceMemory::release(data);
+    if (!ok) {
+        error = file + " is truncated";
+    }
+    return ok;
+}
+
+/**
+ * Traces `samples` samples for each pixel of columns firstColumn ..
+ * firstColumn + columns - 1 of the `rows` rows from firstRow down. The
+ * per-pixel buffers are offset to the band, so every kernel sees it as a
+ * whole image of its own, with paths in slots 0 .. columns * rows * samples.
+ * With a `stride` above 1 the columns and rows are every stride-th pixel's.
+ */
+static void traceRows(int firstRow, int rows, int firstColumn, int columns, int stride, int samples,
+		const PathtraceOptions &options, const MeshData &meshData, int rouletteBounces,
+		int materialKeyBits, int firstSample) {
+    const int traceDepth = hst_scene->state.traceDepth;
+    const Camera &cam = hst_scene->state.camera;
+    const float eyeSeparation = hst_scene->state.eyeSeparation;
+    const int bandOffset = firstRow * cam.resolution.x;
+    // Path regeneration starts with one sample per pixel and refills the
+    // slots of ended paths with the later samples, which needs the paths
+    // added to the image as they end
+    const bool regenerate = options.regeneratePaths && options.pipeline == PIPELINE_SPLIT
+        && samples > 1 && !options.adaptiveSampling;
+    const int bandPixels = columns * rows;
+    const int bandJobs = bandPixels * samples;
+    int nextJob = regenerate ? bandPixels : bandJobs;
+    int numPaths = nextJob;
+    const int numMaterials = hst_scene->materials.size();
+    float4 * image = dev_image + bandOffset;
+    glm::vec2 * moments = dev_moments + bandOffset;
+    // NULL while the G-buffer comes from computeCentreGBuffer instead. The
+    // jittered one is only as current as the last launch's first sample,
+    // and reconstructed positions (along the pixel-centre ray) are off by
+    // up to half a pixel. Part rows and the tiled path order put sample 0
+    // away from the pixel's own slot, where the bounce kernels look for it.
+    GBufferPixel * gBuffer = centreGBufferPass(options, cam, columns) ? NULL : dev_gBuffer + bandOffset;
+    LightData lights;
+    lights.lights = dev_lights;
+    lights.count = options.nextEventEstimation ? hst_scene->lights.size() : 0;
+    lights.lightTree = options.lightTree && lights.count > 0 ? dev_lightNodes : NULL;
+    lights.geoms = dev_geoms;
+    lights.geomCount = hst_scene->geoms.size();
+    lights.bvhNodes = dev_bvhNodes;
+    lights.bvhGeomIndices = dev_bvhGeomIndices;
+    lights.meshData = meshData;
+    lights.environment = environmentLight(hst_scene, environmentTexture, dev_environmentMarginalCdf,
+        dev_environmentConditionalCdf, options.nextEventEstimation);
+    lights.rayCounts = telemetryEnabled ? dev_rayCounts : NULL;
+    lights.traceDepth = traceDepth;
+    lights.firstPixel = bandOffset;
+    lights.cache = options.radianceCache ? radianceCache : RadianceCache();
+    lights.guide = options.pathGuiding ? pathGuide : PathGuide();
+    lights.photons = options.photonCaustics ? photonGrid : PhotonGrid();
+    lights.reservoirs = options.restir ? dev_reservoirs : NULL;
+    lights.geomHits = dev_geomHits;
+    lights.rayCost = options.rayCost ? dev_rayCost : NULL;
+    lights.media = mediumData(hst_scene, dev_media, dev_mediumMajorants);
+    lights.packetShadows = options.packetShadowRays;
+    // Band pixels' costs, for the path rays' BVH node fetches
+    RayCost * rayCost = options.rayCost ? dev_rayCost + bandOffset : NULL;
+    const bool accumulateOnTermination = (options.accumulateOnTermination || regenerate)
+        && options.pipeline == PIPELINE_SPLIT;
+    NvtxRange bandRange("rows", firstRow, numPaths);
+
+	// 2D block for generating ray from camera
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (columns + blockSize2d.x - 1) / blockSize2d.x,
+            (rows + blockSize2d.y - 1) / blockSize2d.y);
+
+	// 1D block for path tracing
+	const int blockSize1d = 128;
+
+    ///////////////////////////////////////////////////////////////////////////
+
+    // Pathtracing Recap:
+    // * Initialize array of path rays (using rays that come out of the camera)
+    //   * You can pass the Camera object to that kernel.
+    //   * Each path ray must carry at minimum a (ray, color) pair,
+    //   * where color starts as the multiplicative identity, white = (1, 1, 1).
+    //   * This has already been done for you.
+    // * NEW: For the first depth, computeIntersections also fills the
+    //   geometry buffers (gbuffers)
+    // * For each depth:
+    //   * Compute an intersection in the scene for each path ray.
+    //     A very naive version of this has been implemented for you, but feel
+    //     free to add more primitives and/or a better algorithm.
+    //     Currently, intersection distance is recorded as a parametric distance,
+    //     t, or a "distance along the ray." t = -1.0 indicates no intersection.
+    //     * Color is attenuated (multiplied) by reflections off of any object
+    //   * Stream compact away all of the terminated paths.
+    //     StreamCompaction::Efficient::partition moves them behind the live
+    //     ones rather than discarding them, since finalGather still has to
+    //     add their colour.
+    //     * Note that you can't really use a 2D kernel launch any more - switch
+    //       to 1D.
+    //   * Shade the rays that intersected something or didn't bottom out.
+    //     That is, color the ray by performing a color computation according
+    //     to the shader, then generate a new ray to continue the ray path.
+    //     We recommend just updating the ray's PathSegment in place.
+    //     Note that this step may come before or after stream compaction,
+    //     since some shaders you write may also cause a path to terminate.
+    // * Finally:
+    //     * if not denoising, add this iteration's results to the image
+    //     * if denoising, denoise() filters the raw pathtraced result using the
+    //       gbuffer, and showDenoisedImage() puts the result in the display texture from opengl
+
+	timerStart(TIMER_GENERATE_RAYS);
+	launchCameraRays(blocksPerGrid2d, blockSize2d, 0, cam, eyeSeparation, traceDepth, firstRow, rows,
+		firstColumn, columns, stride, firstSample, regenerate ? 1 : samples, options.antialias, options.sampler,
+		options.tiledPathOrder, dev_paths);
+	timerStop(TIMER_GENERATE_RAYS);
+	checkCUDAError("generate camera ray");
+
+	// Adaptive sampling traces a dense list of the unconverged pixels' paths
+	if (options.adaptiveSampling) {
+		dim3 numBlocksPaths = (numPaths + blockSize1d - 1) / blockSize1d;
+		kernFlagActivePaths<<<numBlocksPaths, blockSize1d>>>(numPaths, dev_paths,
+			dev_converged + bandOffset, dev_pathFlags);
+		int numActive = StreamCompaction::Efficient::partition(numPaths, sizeof(int),
+			dev_pathOrder, dev_pathIdentity, dev_pathFlags);
+		kernGatherPaths<<<numBlocksPaths, blockSize1d>>>(numActive, dev_pathOrder,
+			dev_paths, dev_pathsCompacted);
+		copyPathSegments(dev_paths, dev_pathsCompacted, numActive);
+		checkCUDAError("compact converged pixels");
+		numPaths = numActive;
+		if (numPaths == 0) {
+			return;
+		}
+	}
+
+	// Only the first bounce writes the G-buffer, and not when it is cached
+	if (gBuffer != NULL && !(options.cacheFirstBounce && firstBounceCached)) {
+		waitForDisplay();
+	}
+
+	int depth = 0;
+	int num_paths = numPaths;
+
+	// --- PathSegment Tracing Stage ---
+	// Shoot ray into scene, bounce between objects, push shading chunks
+
+	// clean shading chunks
+	cudaMemset(dev_intersections.tMaterial, 0, numPaths * sizeof(float2));
+
+  // The wavefront, persistent, cooperative, graph and megakernel pipelines replace the bounce loop below
+  if (options.pipeline == PIPELINE_WAVEFRONT) {
+    traceWavefront(numPaths, meshData, gBuffer, options.cacheFirstBounce, rouletteBounces,
+      options.sampler, lights);
+  } else if (options.pipeline == PIPELINE_PERSISTENT) {
+    tracePersistent(numPaths, meshData, gBuffer, options.cacheFirstBounce, rouletteBounces,
+      options.sampler, lights);
+  } else if (options.pipeline == PIPELINE_COOPERATIVE) {
+    traceCooperative(numPaths, meshData, gBuffer, options.cacheFirstBounce, rouletteBounces,
+      options.sampler, lights);
+  } else if (options.pipeline == PIPELINE_GRAPH) {
+    traceGraph(numPaths, meshData, gBuffer, options.cacheFirstBounce, rouletteBounces,
+      options.sampler, lights);
+  } else if (options.pipeline == PIPELINE_MEGAKERNEL) {
+    bool readFirstBounce = options.cacheFirstBounce && firstBounceCached;
+    bool writeFirstBounce = options.cacheFirstBounce && !firstBounceCached;
+    const int megakernelBlockSize = launchConfig.megakernel.blockSize;
+    dim3 numBlocksMegakernel = (numPaths + megakernelBlockSize - 1) / megakernelBlockSize;
+    timerStart(TIMER_MEGAKERNEL);
+    pathtraceMegakernel<<<numBlocksMegakernel, megakernelBlockSize, sharedGeomBytes + sharedMaterialBytes>>>(
+      numPaths
+      , dev_paths
+      , dev_geoms
+      , hst_scene->geoms.size()
+      , sharedGeomBytes > 0
+      , dev_bvhNodes
+      , dev_bvhGeomIndices
+      , meshData
+      , dev_materials
+      , numMaterials
+      , sharedMaterialBytes > 0
+      , rouletteBounces
+      , options.sampler
+      , lights
+      , dev_firstBounceCache
+      , readFirstBounce
+      , writeFirstBounce
+      , gBuffer
+      );
+    timerStop(TIMER_MEGAKERNEL);
+    checkCUDAError("megakernel");
+    // Bounces happen inside the kernel, so there is nothing to count
+    stats.depths = 0;
+    firstBounceCached = firstBounceCached || writeFirstBounce;
+  }
+
+  bool iterationComplete = options.pipeline != PIPELINE_SPLIT;
+	while (!iterationComplete) {
+	NvtxRange bounceRange("bounce", depth, num_paths);
+
+	// tracing
+	// Camera rays only change with the camera, so the first bounce (and the
+	// G-buffer written with it) can be reused until pathtraceReset().
+	dim3 numblocksPathSegmentTracing = (num_paths + blockSize1d - 1) / blockSize1d;
+	recordPathCount(depth, num_paths);
+
+	// Optionally make rays that start near each other in similar directions
+	// contiguous, so warps walk the same BVH nodes. Camera rays are coherent
+	// already; later bounces scatter. The material sort buffers are free
+	// until shading.
+	if (options.sortRays && depth > 0 && num_paths >= RAY_SORT_MIN_PATHS) {
+		timerStart(bounceTimer(TIMER_SORT_RAYS, depth));
+		kernRaySortKeys<<<numblocksPathSegmentTracing, blockSize1d>>>(num_paths, dev_paths, dev_bvhNodes,
+			hst_scene->geoms.size(), dev_materialKeys, dev_materialOrder);
+		StreamCompaction::Radix::sortByKey(num_paths, dev_materialKeys, dev_materialOrder, RAY_SORT_KEY_BITS);
+		kernGatherPaths<<<numblocksPathSegmentTracing, blockSize1d>>>(num_paths, dev_materialOrder,
+			dev_paths, dev_pathsCompacted);
+		copyPathSegments(dev_paths, dev_pathsCompacted, num_paths);
+		timerStop(bounceTimer(TIMER_SORT_RAYS, depth));
+		checkCUDAError("sort rays");
+	} else {
+		timerClear(bounceTimer(TIMER_SORT_RAYS, depth));
+	}
+
+	// The G-buffer bounce and the first-bounce cache need whole hits, and
+	// OptiX stores those too
+	const bool optixIntersect = options.hardwareRT && pathtraceHardwareRTAvailable();
+	const bool rasterHits = depth == 0 && rasterPrimaryHits(options, cam, true);
+	const bool tileCulled = depth == 0 && !rasterHits && !optixIntersect && tileCullingApplies(options, cam)
+		&& tileListsValid;
+	// The camera's rays are coherent enough to walk the tree a warp at a time
+	const bool packetRays = depth == 0 && options.packetCameraRays && !rasterHits && !optixIntersect && !tileCulled;
+	const bool hitRecords = options.hitRecords && !optixIntersect
+		&& !(depth == 0 && (gBuffer != NULL || options.cacheFirstBounce || rasterHits || tileCulled || packetRays));
+	ShadeableIntersections bounceIntersections = dev_intersections;
+	if (depth == 0 && options.cacheFirstBounce && firstBounceCached) {
+		bounceIntersections = dev_firstBounceCache;
+	} else {
+		// Rasterized hits cost no traversal, bar the odd edge
+		stats.raysTraced += rasterHits ? 0 : num_paths;
+		timerStart(bounceTimer(TIMER_INTERSECT, depth));
+		if (rasterHits) {
+			dim3 numblocksRaster = (num_paths + blockSize1d - 1) / blockSize1d;
+			computeRasterIntersections<<<numblocksRaster, blockSize1d>>>(
+				num_paths
+				, dev_paths
+				, dev_rasterHits + bandOffset
+				, dev_geoms
+				, hst_scene->geoms.size()
+				, dev_bvhNodes
+				, dev_bvhGeomIndices
+				, meshData
+				, dev_materials
+				, dev_intersections
+				, gBuffer
+				);
+		} else if (optixIntersect) {
+			OptixBackend::intersect(depth, num_paths, dev_paths, dev_intersections, gBuffer);
+		} else if (tileCulled) {
+			const int intersectBlockSize = launchConfig.intersect.blockSize;
+			dim3 numblocksIntersect = (num_paths + intersectBlockSize - 1) / intersectBlockSize;
+			computeTileIntersections<<<numblocksIntersect, intersectBlockSize>>>(
+				num_paths
+				, firstRow
+				, dev_paths
+				, tileLists
+				, dev_geoms
+				, hst_scene->geoms.size()
+				, dev_bvhNodes
+				, dev_bvhGeomIndices
+				, meshData
+				, dev_materials
+				, dev_intersections
+				, gBuffer
+				);
+		} else if (hitRecords) {
+			const int recordBlockSize = launchConfig.hitRecords.blockSize;
+			dim3 numblocksRecords = (num_paths + recordBlockSize - 1) / recordBlockSize;
+			computeHitRecords<<<numblocksRecords, recordBlockSize, sharedGeomBytes>>>(
+				num_paths
+				, dev_paths
+				, dev_geoms
+				, hst_scene->geoms.size()
+				, sharedGeomBytes > 0
+				, dev_bvhNodes
+				, dev_bvhGeomIndices
+				, meshData
+				, dev_intersections
+				, rayCost
+				);
+		} else {
+			const int intersectBlockSize = launchConfig.intersect.blockSize;
+			dim3 numblocksIntersect = (num_paths + intersectBlockSize - 1) / intersectBlockSize;
+			computeIntersections <<<numblocksIntersect, intersectBlockSize, sharedGeomBytes>>> (
+				depth
+				, num_paths
+				, dev_paths
+				, dev_geoms
+				, hst_scene->geoms.size()
+				, sharedGeomBytes > 0
+				, dev_bvhNodes
+				, dev_bvhGeomIndices
+				, meshData
+				, dev_materials
+				, dev_intersections
+				, gBuffer
+				, rayCost
+				, packetRays
+				);
+		}
+		timerStop(bounceTimer(TIMER_INTERSECT, depth));
+		checkCUDAError("trace one bounce");
+
+		if (depth == 0 && options.cacheFirstBounce) {
+			copyIntersections(dev_firstBounceCache, dev_intersections, numPaths);
+			firstBounceCached = true;
+		}
+	}
+
+	// Each camera hit goes on as options.pathSplit paths, in slots past the
+	// camera paths'; the cached hits stay as they are for the next launch
+	if (depth == 0 && options.pathSplit > 1) {
+		if (bounceIntersections.tMaterial != dev_intersections.tMaterial) {
+			copyIntersections(dev_intersections, bounceIntersections, num_paths);
+			bounceIntersections = dev_intersections;
+		}
+		kernSplitPaths<<<numblocksPathSegmentTracing, blockSize1d>>>(num_paths, options.pathSplit, dev_paths,
+			dev_intersections, hitRecords);
+		checkCUDAError("split paths");
+		num_paths *= options.pathSplit;
+		numPaths = num_paths;
+		numblocksPathSegmentTracing = (num_paths + blockSize1d - 1) / blockSize1d;
+	}
+
+	if (!captureFile.empty() && depth == captureDepth) {
+		captureBounce(depth, num_paths, dev_paths, bounceIntersections, gBuffer != NULL, hitRecords,
+			options.specializedShading ? sceneMaterialFeatures : MATERIAL_FEATURES_ALL, rouletteBounces,
+			options.sampler, samples > 1, firstSample, meshData, lights);
+	}
+
+  // Optionally make paths hitting the same material contiguous, so warps
+  // take the same branches in the shader. The sorted copies live in the
+  // compaction buffers and are partitioned straight back into dev_paths.
+  PathSegments shadedPaths = dev_paths;
+  ShadeableIntersections shadedIntersections = bounceIntersections;
+  if (options.sortByMaterial) {
+    kernMaterialSortKeys<<<numblocksPathSegmentTracing, blockSize1d>>>(num_paths, numMaterials,
+      bounceIntersections, hitRecords ? dev_geoms : NULL, dev_materialKeys, dev_materialOrder);
+    StreamCompaction::Radix::sortByKey(num_paths, dev_materialKeys, dev_materialOrder, materialKeyBits);
+    kernGatherPaths<<<numblocksPathSegmentTracing, blockSize1d>>>(num_paths, dev_materialOrder,
+      dev_paths, dev_pathsCompacted);
+    kernGatherIntersections<<<numblocksPathSegmentTracing, blockSize1d>>>(num_paths, dev_materialOrder,
+      bounceIntersections, dev_intersectionsSorted, hitRecords);
+    checkCUDAError("sort by material");
+    shadedPaths = dev_pathsCompacted;
+    shadedIntersections = dev_intersectionsSorted;
+  }
+
+  const int shadeBlockSize = launchConfig.shade.blockSize;
+  dim3 numblocksShade = (num_paths + shadeBlockSize - 1) / shadeBlockSize;
+  const ShadeKernel shadeVariant = shadeKernel(options.specializedShading
+    ? sceneMaterialFeatures : MATERIAL_FEATURES_ALL);
+  timerStart(bounceTimer(TIMER_SHADE, depth));
+  shadeVariant<<<numblocksShade, shadeBlockSize, sharedMaterialBytes>>> (
+    num_paths,
+    shadedIntersections,
+    shadedPaths,
+    dev_materials,
+    numMaterials,
+    sharedMaterialBytes > 0,
+    rouletteBounces,
+    options.sampler,
+    lights,
+    accumulateOnTermination ? image : NULL,
+    moments,
+    samples > 1,
+    hitRecords
+  );
+  timerStop(bounceTimer(TIMER_SHADE, depth));
+  checkCUDAError("shade one bounce");
+  depth++;
+
+  // Stream compact: keep live paths at the front so the next bounce only
+  // launches over them. Only path indices are partitioned; the segments are
+  // then gathered through them. Terminated paths stay past num_paths for
+  // finalGather, so the result always ends up back in dev_paths rather than
+  // swapping buffers, which would lose the paths parked past the live range.
+  // Paths already accumulated at termination are simply dropped.
+  timerStart(bounceTimer(TIMER_COMPACT, depth - 1));
+  kernFlagLivePaths<<<numblocksPathSegmentTracing, blockSize1d>>>(num_paths, shadedPaths, dev_pathFlags);
+  int num_live = StreamCompaction::Efficient::partition(num_paths, sizeof(int),
+    dev_pathOrder, dev_pathIdentity, dev_pathFlags);
+  const int num_kept = accumulateOnTermination ? num_live : num_paths;
+  dim3 numblocksKept = (num_kept + blockSize1d - 1) / blockSize1d;
+  if (num_kept == 0) {
+    // Nothing to move
+  } else if (shadedPaths.cone == dev_paths.cone && shadedPaths.packedCone == dev_paths.packedCone) {
+    kernGatherPaths<<<numblocksKept, blockSize1d>>>(num_kept, dev_pathOrder,
+      dev_paths, dev_pathsCompacted);
+    copyPathSegments(dev_paths, dev_pathsCompacted, num_kept);
+  } else {
+    kernGatherPaths<<<numblocksKept, blockSize1d>>>(num_kept, dev_pathOrder,
+      shadedPaths, dev_paths);
+  }
+  timerStop(bounceTimer(TIMER_COMPACT, depth - 1));
+  checkCUDAError("compact paths");
+  num_paths = num_live;
+
+  // The freed slots take the next jobs' camera paths, which then trace
+  // alongside the older paths until they too run out of bounces
+  if (regenerate && num_paths < bandPixels && nextJob < bandJobs) {
+    const int count = std::min(bandPixels - num_paths, bandJobs - nextJob);
+    launchRegeneratedRays(count, nextJob, num_paths, cam, eyeSeparation, traceDepth, firstRow, rows,
+      firstColumn, columns, firstSample, options.antialias, options.sampler, options.tiledPathOrder,
+      dev_paths);
+    checkCUDAError("regenerate paths");
+    nextJob += count;
+    num_paths += count;
+  }
+
+  iterationComplete = (!regenerate && depth == traceDepth) || num_paths == 0;
+  stats.depths = depth;
+	}
+
+  // Assemble this iteration and apply it to the image
+  dim3 numBlocksPaths = (numPaths + blockSize1d - 1) / blockSize1d;
+	waitForDisplay();
+	if (accumulateOnTermination) {
+		// Every path was added as it ended
+		timerClear(TIMER_FINAL_GATHER);
+		return;
+	}
+	timerStart(TIMER_FINAL_GATHER);
+	if (samples > 1 && options.gather == GATHER_SEGMENTED) {
+		// Only the other pipelines without adaptive sampling leave every path
+		// in its slot; otherwise it goes back there through the free
+		// compaction buffer, whose origins serve in the compact layout
+		const int bandPixels = columns * rows;
+		const float4 * slots = dev_paths.colorPixel;
+		if (options.pipeline == PIPELINE_SPLIT || options.adaptiveSampling || compactPathBuffers) {
+			float4 * scratch = compactPathBuffers ? dev_pathsCompacted.originOctDirection
+				: dev_pathsCompacted.colorPixel;
+			kernScatterToSampleSlots<<<numBlocksPaths, blockSize1d>>>(numPaths, bandPixels, cam.resolution.x,
+				firstColumn, columns, firstSample, dev_paths, scratch);
+			slots = scratch;
+		}
+		dim3 numBlocksPixels = (bandPixels + blockSize1d - 1) / blockSize1d;
+		gatherSampleSlots<<<numBlocksPixels, blockSize1d>>>(bandPixels, cam.resolution.x, firstColumn,
+			columns, samples, image, moments, slots, options.adaptiveSampling ? dev_converged + bandOffset : NULL);
+	} else {
+		finalGather<<<numBlocksPaths, blockSize1d>>>(numPaths, image, moments, dev_paths,
+			samples > 1 || options.pathSplit > 1, options.splitSpecular ? dev_specular + bandOffset : NULL,
+			1.0f / options.pathSplit);
+	}
+	timerStop(TIMER_FINAL_GATHER);
+}
+
+/**
+ * Copies the sums of each pixel a coarse launch traced, every `stride`-th
+ * pixel each way from the region's corner, over the rest of its stride x
+ * stride block, so the display, the denoiser and the readbacks see a
+ * whole, blocky image of the launch's sample count.
+ */
+__global__ void fillPixelBlocks(int width, PixelRect region, int stride, float4 * image, glm::vec2 * moments)
+{
+	int x = region.x + (blockIdx.x * blockDim.x) + threadIdx.x;
+	int y = region.y + (blockIdx.y * blockDim.y) + threadIdx.y;
+
+	if (x < region.x + region.width && y < region.y + region.height) {
+		int tracedX = region.x + (x - region.x) / stride * stride;
+		int tracedY = region.y + (y - region.y) / stride * stride;
+		if (tracedX != x || tracedY != y) {
+			int traced = tracedX + tracedY * width;
+			image[x + y * width] = image[traced];
+			moments[x + y * width] = moments[traced];
+		}
+	}
+}
+
+/**
+ * Wrapper for the __global__ call that sets up the kernel calls and does a ton
+ * of memory management. Traces options.samplesPerLaunch samples per pixel;
+ * `iter` is the sample count including them, so they are sample numbers
+ * iter - samplesPerLaunch .. iter - 1 (shifted by options.seedOffset),
+ * which with the pixel and bounce seed their random numbers. With
+ * options.region set only its pixels are traced, and only their paths
+ * generated, so a launch costs in proportion to the region's area.
+ */
+void pathtrace(int frame, int iter, const PathtraceOptions &options) {
+    NvtxRange pathtraceRange("pathtrace", iter);
+    swapSceneBuffers();
+    const int traceDepth = hst_scene->state.traceDepth;
+    const Camera &cam = hst_scene->state.camera;
+    const int views = hst_scene->state.viewCount();
+    const glm::ivec2 resolution = imageResolution();
+    // Bidirectional tracing takes a single pinhole view lit by Scene::lights,
+    // and traces all of it on the primary
+    const bool bidirectional = options.bidirectional && views == 1 && !cameraBlurs(cam)
+        && !hst_scene->lights.empty();
+    // The stacked views of a stereo pair are traced whole, as one image;
+    // a display region only covers one of them
+    const PixelRect region = views > 1 ? clampRegion(PixelRect(), resolution)
+        : clampRegion(options.region, resolution);
+    const bool regional = partialRegion(region, resolution);
+    // A coarse launch traces the lattice of every stride-th pixel each way
+    // from the region's corner; a stereo pair is always traced in full
+    const int stride = views > 1 || bidirectional ? 1 : std::max(options.pixelStride, 1);
+    const int latticeColumns = (region.width + stride - 1) / stride;
+    const int latticeRows = (region.height + stride - 1) / stride;
+    // Device d traces totalSamples / devices, plus one while d is below the
+    // remainder, so the primary's share is never zero. A region is too
+    // small to be worth splitting and stays on the primary, as do stereo
+    // pairs, which only the primary traces, and coarse launches. So do
+    // split specular launches, whose buffer only the primary has. A
+    // dedicated display device hands its share to the others, which then
+    // split the samples among themselves the same way.
+    const int totalSamples = glm::clamp(options.samplesPerLaunch, 1, MAX_SAMPLES_PER_LAUNCH);
+    const int devices = regional || views > 1 || stride > 1 || options.splitSpecular || bidirectional ? 1
+        : pathtraceDeviceCount();
+    const bool displayOnly = dedicatedDisplay && devices > 1;
+    const int tracers = displayOnly ? devices - 1 : devices;
+    const int samples = totalSamples / tracers + (totalSamples % tracers > 0 ? 1 : 0);
+    // Bands of tileRows rows trace one after another through one band's
+    // worth of path slots, bounding their memory whatever the resolution
+    const int tileRows = options.tileRows > 0 ? std::min(options.tileRows, latticeRows)
+        : latticeRows;
+    const bool tiled = tileRows * stride < resolution.y;
+    const int numPaths = latticeColumns * tileRows * samples;
+    // Split camera hits take slots past the camera paths', in the split
+    // pipeline's bounce loop alone; the deterministic gather sums by sample
+    const int split = options.pipeline == PIPELINE_SPLIT && !options.deterministic && !bidirectional
+        ? glm::clamp(options.pathSplit, 1, MAX_PATH_SPLIT) : 1;
+    renderedCamera = cam;
+    temporalValid = false;
+    stats.raysTraced = 0;
+    stats.pathBytes = 0;
+    // Only seeds depend on iter, so distributed workers shift theirs apart
+    iter += options.seedOffset;
+
+    // The cached first bounce and a captured graph cover one slot layout
+    if (samples != launchSamples || options.tiledPathOrder != launchTiledPaths) {
+        launchSamples = samples;
+        launchTiledPaths = options.tiledPathOrder;
+        firstBounceCached = false;
+        destroyGraph();
+    }
+    // The compact layout's words hold so many bounces and pixels
+    const bool compact = options.compactPaths && traceDepth <= PATH_COMPACT_MAX_DEPTH
+        && resolution.x * resolution.y < PATH_COMPACT_MAX_PIXELS;
+    if (compact != compactPathBuffers && !displayOnly) {
+        compactPathBuffers = compact;
+        if (pathCapacity > 0) {
+            freePathSegments(dev_paths);
+            freePathSegments(dev_pathsCompacted);
+            allocPathSegments(dev_paths, pathCapacity, compact);
+            allocPathSegments(dev_pathsCompacted, pathCapacity, compact);
+            destroyGraph();
+        }
+    }
+    if (numPaths * split > pathCapacity && !displayOnly) {
+        freePathBuffers();
+        allocPathBuffers(numPaths * split);
+        firstBounceCached = false;
+        destroyGraph();
+    }
+
+    // Every band reuses the same slots, and adaptive sampling moves pixels
+    // between them, so a slot-indexed first-bounce cache would not match
+    // and a graph would bake in one band's buffers and path count. A
+    // region is traced as bands of its rows, and so is a lattice.
+    PathtraceOptions bandOptions = options;
+    if (tiled || regional || stride > 1 || options.adaptiveSampling) {
+        bandOptions.cacheFirstBounce = false;
+        if (bandOptions.pipeline == PIPELINE_GRAPH) {
+            bandOptions.pipeline = PIPELINE_SPLIT;
+        }
+        firstBounceCached = false;
+        destroyGraph();
+    }
+    // Without cooperative launches the grid could not sync
+    if (bandOptions.pipeline == PIPELINE_COOPERATIVE && !launchConfig.cooperativeLaunch) {
+        bandOptions.pipeline = PIPELINE_SPLIT;
+    }
+    // Jittered camera rays differ every launch, so there is no first bounce
+    // to cache; regenerated paths start in slots the cache does not cover
+    if (options.antialias || cameraBlurs(cam) || options.regeneratePaths) {
+        bandOptions.cacheFirstBounce = false;
+    }
+    // Float atomics add a pixel's samples in whatever order they land;
+    // the segmented gather sums them in sample order
+    if (options.deterministic) {
+        bandOptions.gather = GATHER_SEGMENTED;
+        bandOptions.accumulateOnTermination = false;
+        bandOptions.regeneratePaths = false;
+    }
+    // Specular paths are told apart in finalGather's per-path adds, so the
+    // specular buffer needs it even over the deterministic gather
+    if (options.splitSpecular) {
+        bandOptions.gather = GATHER_ATOMIC;
+        bandOptions.accumulateOnTermination = false;
+        bandOptions.regeneratePaths = false;
+    }
+    // The reservoirs cover one view, and only resample Scene::lights
+    bandOptions.restir = options.restir && options.nextEventEstimation && views == 1
+        && !hst_scene->lights.empty();
+    // The passes over every pixel of a band, or its slots in pixel order,
+    // would see the untraced pixels as theirs; without the segmented gather
+    // a coarse launch is not bit-exact
+    if (stride > 1) {
+        bandOptions.adaptiveSampling = false;
+        bandOptions.regeneratePaths = false;
+        bandOptions.gather = GATHER_ATOMIC;
+        bandOptions.restir = false;
+    }
+    // Split paths are weighed in finalGather's per-path adds, and take
+    // the slots that regenerated paths would
+    bandOptions.pathSplit = split;
+    if (split > 1) {
+        bandOptions.gather = GATHER_ATOMIC;
+        bandOptions.accumulateOnTermination = false;
+        bandOptions.regeneratePaths = false;
+    }
+    // The bidirectional pass fills every pixel, each sample whole
+    bandOptions.bidirectional = bidirectional;
+    if (bidirectional) {
+        bandOptions.adaptiveSampling = false;
+        bandOptions.restir = false;
+    }
+    // The other devices trace every pixel whatever dev_converged says, and
+    // only the primary's camera rays could write the G-buffer
+    if (displayOnly) {
+        bandOptions.adaptiveSampling = false;
+        bandOptions.restir = false;
+    }
+
+	MeshData meshData;
+	meshData.meshes = dev_meshes;
+	meshData.nodes = dev_meshBvhNodes;
+	meshData.wideNodes = options.wideMeshBVH ? dev_meshWideNodes : NULL;
+	meshData.triangles = dev_meshTriangles;
+	meshData.triangleRecords = dev_meshTriangleRecords;
+	meshData.positions = dev_meshPositions;
+	meshData.normals = dev_meshNormals;
+	meshData.uvs = dev_meshUVs;
+	meshData.compactPositions = dev_meshCompactPositions;
+	meshData.compactNormals = dev_meshCompactNormals;
+	meshData.compactUVs = dev_meshCompactUVs;
+	meshData.lodScale = options.meshLOD ? 1.0f : 0.0f;
+	meshData.watertight = options.watertight;
+	meshData.shortStack = options.shortStack;
+	meshData.clouds = dev_sphereClouds;
+	meshData.cloudNodes = dev_cloudBvhNodes;
+	meshData.cloudSpheres = dev_cloudSpheres;
+	meshData.sdfs = dev_sdfVolumes;
+	meshData.sdfVoxels = NULL;
+	meshData.nodeVisits = NULL;
+
+	// Material sort keys run from 0 to numMaterials (misses), so only the
+	// bits needed for that range are sorted on.
+	const int numMaterials = hst_scene->materials.size();
+	// Russian roulette applies once rouletteMinDepth bounces have been traced
+	const int rouletteBounces = options.russianRoulette
+		? traceDepth - std::max(options.rouletteMinDepth, 1) : -1;
+
+	int materialKeyBits = 1;
+	while ((1 << materialKeyBits) <= numMaterials) {
+		materialKeyBits++;
+	}
+
+	// The convergence test needs every sample so far in dev_image, and
+	// converged pixels' sums absorb the primary's samples this launch
+	if (bandOptions.adaptiveSampling && accumulatedSamples > 0) {
+		const int pixelcount = resolution.x * resolution.y;
+		const int blockSize1d = 128;
+		dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+		mergeTraceDevices();
+		waitForDisplay();
+		kernUpdateConvergence<<<numBlocksPixels, blockSize1d>>>(pixelcount, accumulatedSamples, samples,
+			options.adaptiveThreshold, std::max(options.adaptiveMinSamples, 1), dev_image, dev_moments,
+			specularValid ? dev_specular : NULL, dev_converged);
+		checkCUDAError("update convergence");
+	}
+	accumulatedSamples += totalSamples;
+	updateGeometryResidency();
+	virtualTextures::update();
+
+	if (options.rayCost && dev_rayCost == NULL) {
+		const int pixelcount = resolution.x * resolution.y;
+		deviceMemory::allocate(&dev_rayCost, pixelcount * sizeof(RayCost));
+		deviceMemory::allocate(&dev_rayCostMax, sizeof(unsigned int));
+		cudaMemset(dev_rayCost, 0, pixelcount * sizeof(RayCost));
+	}
+
+	if (options.splitSpecular && dev_specular == NULL) {
+		const int pixelcount = resolution.x * resolution.y;
+		deviceMemory::allocate(&dev_specular, pixelcount * sizeof(float4));
+		cudaMemset(dev_specular, 0, pixelcount * sizeof(float4));
+	}
+	// The split only holds if every sample since the restart went into
+	// dev_specular too; coarse launches' blocks only fill dev_image
+	if (!options.splitSpecular || stride > 1) {
+		specularValid = false;
+	} else if (accumulatedSamples == totalSamples) {
+		specularValid = true;
+	}
+
+	if (options.radianceCache) {
+		prepareRadianceCache();
+	}
+	if (options.pathGuiding) {
+		preparePathGuide();
+	}
+	if (options.photonCaustics && !photonMapValid) {
+		buildPhotonMap(meshData);
+	}
+
+	if (!displayOnly && !centreGBufferPass(bandOptions, cam, latticeColumns)) {
+		centreGBufferValid = false;
+	} else if (!centreGBufferValid) {
+		const dim3 blockSize2d(8, 8);
+		const dim3 blocksPerGrid2d(
+			(cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+			(cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+		waitForDisplay();
+		if (rasterPrimaryHits(bandOptions, cam, false)) {
+			computeRasterGBuffer<<<blocksPerGrid2d, blockSize2d>>>(cam, dev_rasterHits, dev_geoms,
+				hst_scene->geoms.size(), dev_bvhNodes, dev_bvhGeomIndices, meshData, dev_materials,
+				dev_gBuffer);
+		} else {
+			// Each view's pixel-centre rays leave from its own eye
+			for (int view = 0; view < views; view++) {
+				computeCentreGBuffer<<<blocksPerGrid2d, blockSize2d>>>(hst_scene->state.viewCamera(view),
+					dev_geoms, hst_scene->geoms.size(), dev_bvhNodes, dev_bvhGeomIndices, meshData,
+					dev_materials, dev_gBuffer + view * cam.resolution.x * cam.resolution.y);
+			}
+		}
+		checkCUDAError("centre G-buffer");
+		centreGBufferValid = true;
+	}
+	if (!displayOnly && tileCullingApplies(bandOptions, cam) && !tileListsBinned) {
+		tileListsValid = TileCulling::build(cam, hst_scene->geoms.size(), dev_geoms, dev_meshes,
+			dev_meshBvhNodes, dev_sphereClouds, dev_cloudBvhNodes, dev_sdfVolumes, tileLists);
+		tileListsBinned = true;
+	}
+	if (bandOptions.restir) {
+		resampleLights(iter);
+	}
+
+	// The launch's samples are numbers iter - totalSamples .. iter - 1 of
+	// each pixel's sampler sequence, the primary's first
+	const int firstSample = iter - totalSamples;
+	if (bidirectional) {
+		traceBidirectional(meshData, firstSample, totalSamples, options.sampler);
+		return;
+	}
+
+	// Secondary GPUs first, so they trace while the host drives the primary.
+	// Each takes the next sample numbers, which alone seed the samples, so
+	// a sample traces the same path whichever device it lands on. Share 0
+	// is the primary's unless it only displays.
+	int deviceFirstSample = firstSample + (displayOnly ? 0 : samples);
+	for (int d = 1; d < devices; d++) {
+		const int share = displayOnly ? d - 1 : d;
+		int deviceSamples = totalSamples / tracers + (share < totalSamples % tracers ? 1 : 0);
+		if (deviceSamples > 0) {
+			traceOnDevice(traceDevices[d - 1], deviceFirstSample, deviceSamples,
+				rouletteBounces, options.sampler, options.antialias, options.nextEventEstimation,
+				options.wideMeshBVH, options.meshLOD, options.watertight, options.shortStack, options.lightTree,
+				options.tiledPathOrder, bandOptions.gather);
+			deviceFirstSample += deviceSamples;
+		}
+	}
+
+	if (displayOnly) {
+		checkCUDAError("pathtrace");
+		return;
+	}
+	const int lastRow = region.y + region.height;
+	for (int firstRow = region.y; firstRow < lastRow; firstRow += tileRows * stride) {
+		const int rows = std::min(tileRows, (lastRow - firstRow + stride - 1) / stride);
+		traceRows(firstRow, rows, region.x, latticeColumns, stride, samples,
+			bandOptions, meshData, rouletteBounces, materialKeyBits, firstSample);
+	}
+	if (stride > 1) {
+		const dim3 blockSize2d(8, 8);
+		const dim3 blocksPerGrid2d(
+			(region.width + blockSize2d.x - 1) / blockSize2d.x,
+			(region.height + blockSize2d.y - 1) / blockSize2d.y);
+		fillPixelBlocks<<<blocksPerGrid2d, blockSize2d>>>(resolution.x, region, stride, dev_image, dev_moments);
+		checkCUDAError("fill pixel blocks");
+	}
+	collectGeometryHits();
+	virtualTextures::collect();
+
+    ///////////////////////////////////////////////////////////////////////////
+
+    // CHECKITOUT: use dev_image as reference if you want to implement saving denoised images.
+    // Otherwise, screenshots are also acceptable.
+    // The image stays on the GPU; pathtraceRetrieveImage() copies it back on demand.
+
+    checkCUDAError("pathtrace");
+}
+
+/**
+ * Copies the accumulated image into hst_scene->state.image. Only needed
+ * when the host actually reads the image (saving or exporting), so it is
+ * not part of pathtrace().
+ */
+void pathtraceRetrieveImage() {
+    NvtxRange retrieveRange("retrieve image");
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+
+    // Go through pinned memory so the device-to-host copy runs at full
+    // PCIe bandwidth instead of being staged by the driver.
+    mergeTraceDevices();
+    cudaMemcpyAsync(hst_pinnedImage, dev_image,
+            pixelcount * sizeof(float4), cudaMemcpyDeviceToHost);
+    cudaStreamSynchronize(0);
+    copyHostColors(hst_pinnedImage, pixelcount, hst_scene->state.image.data());
+
+    checkCUDAError("pathtraceRetrieveImage");
+}
+
+// Same, into a caller-owned snapshot that later iterations leave alone
+void pathtraceRetrieveImage(std::vector<glm::vec3> &out) {
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+
+    mergeTraceDevices();
+    cudaMemcpyAsync(hst_pinnedImage, dev_image,
+            pixelcount * sizeof(float4), cudaMemcpyDeviceToHost);
+    cudaStreamSynchronize(0);
+    out.resize(pixelcount);
+    copyHostColors(hst_pinnedImage, pixelcount, out.data());
+
+    checkCUDAError("pathtraceRetrieveImage");
+}
+
+// The per-pixel luminance sums behind the variance estimate
+void pathtraceRetrieveMoments(std::vector<glm::vec2> &out) {
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+
+    out.resize(pixelcount);
+    mergeTraceDevices();
+    cudaMemcpy(out.data(), dev_moments, pixelcount * sizeof(glm::vec2), cudaMemcpyDeviceToHost);
+
+    checkCUDAError("pathtraceRetrieveMoments");
+}
+
+/**
+ * Replaces the accumulation with sums traced elsewhere, so denoise() and
+ * the retrieve functions treat them as this renderer's own samples. The
+ * first bounce cache is dropped, since the G-buffer no longer matches it.
+ */
+void pathtraceLoadAccumulation(int samples, const std::vector<glm::vec3> &image,
+        const std::vector<glm::vec2> &moments, const std::vector<GBufferPixel> &gBuffer) {
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+
+    waitForDisplay();
+    resetTraceDevices();
+    for (int i = 0; i < pixelcount; i++) {
+        hst_pinnedImage[i] = make_float4(image[i].x, image[i].y, image[i].z, 0.0f);
+    }
+    cudaMemcpy(dev_image, hst_pinnedImage, pixelcount * sizeof(float4), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_moments, moments.data(), pixelcount * sizeof(glm::vec2), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_gBuffer, gBuffer.data(), pixelcount * sizeof(GBufferPixel), cudaMemcpyHostToDevice);
+    cudaMemset(dev_converged, 0, pixelcount * sizeof(unsigned char));
+    accumulatedSamples = samples;
+    firstBounceCached = false;
+    // Loaded hits stand in for the centre G-buffer until the next reset
+    centreGBufferValid = true;
+    destroyGraph();
+    temporalValid = false;
+
+    checkCUDAError("pathtraceLoadAccumulation");
+}
+
+// The sums' three channels, then the moments' two, as accumulationCodec streams in `out`
+static void packAccumulation(const float4 *image, const glm::vec2 *moments, int pixelcount,
+        std::vector<unsigned char> &out, cudaStream_t stream) {
+    out.clear();
+    for (int c = 0; c < 3; c++) {
+        accumulationCodec::encode(reinterpret_cast<const float *>(image) + c, pixelcount, 4, out, stream);
+    }
+    for (int c = 0; c < 2; c++) {
+        accumulationCodec::encode(reinterpret_cast<const float *>(moments) + c, pixelcount, 2, out, stream);
+    }
+}
+
+/**
+ * The accumulated sums and moments, losslessly packed on the GPU by
+ * accumulationCodec, for a partial render to write or send at a fraction
+ * of its raw size. Waits for the launches queued so far.
+ */
+void pathtraceRetrievePacked(std::vector<unsigned char> &out) {
+    const glm::ivec2 resolution = imageResolution();
+    mergeTraceDevices();
+    packAccumulation(dev_image, dev_moments, resolution.x * resolution.y, out, 0);
+    checkCUDAError("pathtraceRetrievePacked");
+}
+
+/**
+ * Loads `part` as the accumulation, as pathtraceLoadAccumulation does, or
+ * unless `first` adds its sums, moments and samples to the accumulation,
+ * keeping its G-buffer. Packed sums are unpacked on the GPU, straight into
+ * the accumulation. Returns false, leaving the accumulation as it was, if
+ * `part` does not match the image or its packed sums are malformed.
+ */
+bool pathtraceMergeAccumulation(const accumulationFile::Accumulation &part, bool first) {
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+    if (part.width != resolution.x || part.height != resolution.y
+            || part.gBuffer.size() != (size_t)pixelcount || (part.packed.empty()
+                && (part.image.size() != (size_t)pixelcount || part.moments.size() != (size_t)pixelcount))) {
+        return false;
+    }
+    size_t packedBytes = 0;
+    for (int c = 0; c < 5 && !part.packed.empty(); c++) {
+        const size_t used = accumulationCodec::check(part.packed.data() + packedBytes,
+            part.packed.size() - packedBytes, pixelcount);
+        if (used == 0) {
+            return false;
+        }
+        packedBytes += used;
+    }
+    if (first && part.packed.empty()) {
+        pathtraceLoadAccumulation(part.samples, part.image, part.moments, part.gBuffer);
+        return true;
+    }
+
+    waitForDisplay();
+    if (first) {
+        resetTraceDevices();
+    } else {
+        mergeTraceDevices();
+    }
+    if (part.packed.empty()) {
+        float4 *addImage = NULL;
+        glm::vec2 *addMoments = NULL;
+        deviceMemory::allocate(&addImage, pixelcount * sizeof(float4));
+        deviceMemory::allocate(&addMoments, pixelcount * sizeof(glm::vec2));
+        for (int i = 0; i < pixelcount; i++) {
+            hst_pinnedImage[i] = make_float4(part.image[i].x, part.image[i].y, part.image[i].z, 0.0f);
+        }
+        cudaMemcpy(addImage, hst_pinnedImage, pixelcount * sizeof(float4), cudaMemcpyHostToDevice);
+        cudaMemcpy(addMoments, part.moments.data(), pixelcount * sizeof(glm::vec2), cudaMemcpyHostToDevice);
+        const int blockSize1d = 128;
+        kernAddAccumulation<<<(pixelcount + blockSize1d - 1) / blockSize1d, blockSize1d>>>(pixelcount, dev_image,
+            dev_moments, addImage, addMoments);
+        cudaDeviceSynchronize();
+        deviceMemory::release(addImage);
+        deviceMemory::release(addMoments);
+    } else {
+        if (first) {
+            // The sums' fourth channel is not packed
+            cudaMemset(dev_image, 0, pixelcount * sizeof(float4));
+        }
+        const unsigned char *in = part.packed.data();
+        const unsigned char *end = in + part.packed.size();
+        for (int c = 0; c < 5; c++) {
+            float *values = c < 3 ? reinterpret_cast<float *>(dev_image) + c
+                : reinterpret_cast<float *>(dev_moments) + (c - 3);
+            in += accumulationCodec::decode(in, end - in, pixelcount, values, c < 3 ? 4 : 2, !first, 0);
+        }
+    }
+    if (first) {
+        cudaMemcpy(dev_gBuffer, part.gBuffer.data(), pixelcount * sizeof(GBufferPixel), cudaMemcpyHostToDevice);
+        accumulatedSamples = 0;
+        // Loaded hits stand in for the centre G-buffer until the next reset
+        centreGBufferValid = true;
+    }
+    cudaMemset(dev_converged, 0, pixelcount * sizeof(unsigned char));
+    accumulatedSamples += part.samples;
+    firstBounceCached = false;
+    destroyGraph();
+    temporalValid = false;
+
+    checkCUDAError("pathtraceMergeAccumulation");
+    return true;
+}
+
+void pathtraceSetRasterHits(cudaArray_t hits) {
+    const Camera &cam = hst_scene->state.camera;
+    const size_t rowBytes = cam.resolution.x * sizeof(int2);
+    cudaMemcpy2DFromArray(dev_rasterHits, rowBytes, hits, 0, 0, rowBytes, cam.resolution.y,
+        cudaMemcpyDeviceToDevice);
+    rasterHitsValid = true;
+
+    checkCUDAError("pathtraceSetRasterHits");
+}
+
+// Longest history, in samples, that reprojection carries over a camera move
+#define TEMPORAL_MAX_HISTORY 32.0f
+
+/**
+ * Blends the current accumulation with the history reprojected from the
+ * previous camera. Each pixel's history pixel is found by
+ * reprojectPixel; a disoccluded pixel starts from its current samples
+ * alone. History is weighted by its sample count,
+ * capped at TEMPORAL_MAX_HISTORY, so it fades as the new image converges.
+ */
+__global__ void temporalReproject(Camera cam, Camera prevCam, int iter, bool historyValid,
+        const float4* image, const GBufferPixel* gBuffer,
+        const float4* history, const float* historyLength, const GBufferPixel* prevGBuffer,
+        float4* colorOut, float* lengthOut) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < cam.resolution.x && y < cam.resolution.y) {
+        int index = x + (y * cam.resolution.x);
+        glm::vec3 color = loadColor(image, index) * (1.0f / iter);
+        float length = (float)iter;
+
+        int prevIndex = historyValid ? reprojectPixel(cam, prevCam, gBuffer[index], x, y, prevGBuffer) : -1;
+        if (prevIndex >= 0) {
+            float prevLength = glm::min(historyLength[prevIndex], TEMPORAL_MAX_HISTORY);
+            color = (color * length + loadColor(history, prevIndex) * prevLength)
+                / (length + prevLength);
+            length += prevLength;
+        }
+
+        storeColor(colorOut, index, color);
+        lengthOut[index] = length;
+    }
+}
+
+// Normalizes (and widens, for Half4) a colour buffer into FP32
+template <typename T>
+__global__ void unpackColors(glm::ivec2 resolution, const T* colorIn, float colorScale, float4* colorOut) {
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < resolution.x && y < resolution.y) {
+        int index = x + (y * resolution.x);
+        storeColor(colorOut, index, loadColor(colorIn, index) * colorScale);
+    }
+}
+
+/**
+ * Writes the filtered crop's pixels inside `region` over a full-frame
+ * FP32 result, normalized with `colorScale`.
+ */
+template <typename T>
+__global__ void pasteRegion(PixelRect region, PixelRect crop, const T* cropColor, float colorScale,
+        int width, float4* colorOut) {
+    int x = region.x + (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = region.y + (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < region.x + region.width && y < region.y + region.height) {
+        int cropIndex = (x - crop.x) + (y - crop.y) * crop.width;
+        storeColor(colorOut, x + y * width, loadColor(cropColor, cropIndex) * colorScale);
+    }
+}
+
+/**
+ * Split specular mode's G-buffer. Where the first hit in `gBuffer` has a
+ * reflective or refractive lobe short of a perfect one, whose virtual
+ * image the G-buffer shows already, it holds the hit in the mirror
+ * direction from there at the summed distance, so the denoiser rebuilds
+ * the reflection's virtual image; the reflection stands in for the
+ * transmission too. Everywhere else it is a copy of `gBuffer`.
+ */
+__global__ void computeSpecularGBuffer(
+	Camera cam
+	, const GBufferPixel * gBuffer
+	, const DeviceGeom * geoms
+	, int geoms_size
+	, const BVHNode * bvhNodes
+	, const int * bvhGeomIndices
+	, MeshData meshData
+	, const Material * materials
+	, GBufferPixel * specularGBuffer
+	)
+{
+	int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+	int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+	if (x < cam.resolution.x && y < cam.resolution.y) {
+		int index = x + (y * cam.resolution.x);
+		GBufferPixel pixel = gBuffer[index];
+		if (pixel.t > 0.0f && pixel.materialId >= 0) {
+			const Material & m = materials[pixel.materialId];
+			if (m.hasReflective + m.hasRefractive > 0.0f && !perfectSpecular(m)) {
+				glm::vec3 incident = cameraRayDirection(cam, (float)x, (float)y);
+				Ray ray;
+				ray.direction = glm::reflect(incident, gbufferNormal(pixel));
+				ray.origin = cam.position + incident * pixel.t + ray.direction * 0.0001f;
+				ray.coneWidth = cam.pixelLength.y * pixel.t;
+				ray.coneSpread = cam.pixelLength.y;
+				GBufferPixel reflected;
+				intersectRay(ray, geoms, geoms_size, bvhNodes, bvhGeomIndices, meshData, materials, &reflected);
+				if (reflected.t > 0.0f) {
+					reflected.t += pixel.t;
+					pixel = reflected;
+				}
+			}
+		}
+		specularGBuffer[index] = pixel;
+	}
+}
+
+// Split specular mode: the diffuse part of the image is what the specular part leaves
+__global__ void subtractColors(int n, const float4 * image, const float4 * specular, float4 * diffuse) {
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index < n) {
+		float4 c = image[index];
+		float4 s = specular[index];
+		diffuse[index] = make_float4(c.x - s.x, c.y - s.y, c.z - s.z, c.w);
+	}
 }
 
-void showImage(uchar4* pbo, int iter) {
-const Camera &cam = hst_scene->state.camera;
+__global__ void addColors(int n, const float4 * addend, float4 * sum) {
+	int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+	if (index < n) {
+		float4 a = addend[index];
+		float4 c = sum[index];
+		sum[index] = make_float4(c.x + a.x, c.y + a.y, c.z + a.z, c.w);
+	}
+}
+
+// Grows the region buffers to a crop of `size` and resizes the denoiser to it; false if that fails
+static bool prepareRegionDenoiser(glm::ivec2 size) {
+    const Camera &cam = hst_scene->state.camera;
+    const int pixels = size.x * size.y;
+    if (pixels > regionCapacity) {
+        deviceMemory::release(dev_regionColor);
+        deviceMemory::release(dev_regionGBuffer);
+        deviceMemory::release(dev_regionMoments);
+        deviceMemory::release(dev_regionLengths);
+        deviceMemory::allocate(&dev_regionColor, pixels * sizeof(float4));
+        deviceMemory::allocate(&dev_regionGBuffer, pixels * sizeof(GBufferPixel));
+        deviceMemory::allocate(&dev_regionMoments, pixels * sizeof(glm::vec2));
+        deviceMemory::allocate(&dev_regionLengths, pixels * sizeof(float));
+        regionCapacity = pixels;
+    }
+    if (dev_regionDenoised == NULL) {
+        deviceMemory::allocate(&dev_regionDenoised, cam.resolution.x * cam.resolution.y * sizeof(float4));
+    }
+    if (size == regionDenoiserSize) {
+        return true;
+    }
+    denoiserDestroy(regionDenoiser);
+    regionDenoiser = NULL;
+    regionDenoiserSize = glm::ivec2(0);
+    size_t bytes = 0;
+    denoiserScratchBytes(size.x, size.y, &bytes);
+    if (bytes > regionScratchBytes) {
+        deviceMemory::release(dev_regionScratch);
+        deviceMemory::allocate(&dev_regionScratch, bytes);
+        regionScratchBytes = bytes;
+    }
+    if (denoiserCreate(size.x, size.y, dev_regionScratch, regionScratchBytes,
+            &regionDenoiser) != DENOISER_SUCCESS) {
+        fprintf(stderr, "Could not create the region denoiser.\n");
+        return false;
+    }
+    if (!denoiseNetwork.empty()) {
+        denoiserSetNetwork(regionDenoiser, denoiseNetwork.data(), denoiseNetwork.size());
+    }
+    regionDenoiserSize = size;
+    return true;
+}
+
+// Copies the crop of a row-major image `width` elements wide into a dense buffer
+template <typename T>
+static void copyCrop(T *dst, const T *src, int width, const PixelRect &crop, cudaStream_t stream) {
+    cudaMemcpy2DAsync(dst, crop.width * sizeof(T), src + crop.x + crop.y * width, width * sizeof(T),
+            crop.width * sizeof(T), crop.height, cudaMemcpyDeviceToDevice, stream);
+}
+
+/**
+ * The split specular half of denoise(): filters the diffuse part of the
+ * image with `settings` over the G-buffer, the specular part with the
+ * specular footprint and colour weight over computeSpecularGBuffer's, and
+ * adds the two into dev_splitDenoised. The moments are of the whole
+ * image, so only the diffuse part is variance guided.
+ */
+static void denoiseSplitSpecular(const DenoiseOptions &options, DenoiserSettings settings,
+        const DenoiserCamera &camera, DenoiserInputs inputs) {
+    const Camera &cam = hst_scene->state.camera;
+    const int views = hst_scene->state.viewCount();
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+    if (dev_splitDenoised == NULL) {
+        deviceMemory::allocate(&dev_specularGBuffer, pixelcount * sizeof(GBufferPixel));
+        deviceMemory::allocate(&dev_diffuseColor, pixelcount * sizeof(float4));
+        deviceMemory::allocate(&dev_specularDenoised, pixelcount * sizeof(float4));
+        deviceMemory::allocate(&dev_splitDenoised, pixelcount * sizeof(float4));
+    }
+
+    MeshData meshData = {};
+    meshData.meshes = dev_meshes;
+    meshData.nodes = dev_meshBvhNodes;
+    meshData.triangles = dev_meshTriangles;
+    meshData.triangleRecords = dev_meshTriangleRecords;
+    meshData.positions = dev_meshPositions;
+    meshData.normals = dev_meshNormals;
+    meshData.uvs = dev_meshUVs;
+    meshData.compactPositions = dev_meshCompactPositions;
+    meshData.compactNormals = dev_meshCompactNormals;
+    meshData.compactUVs = dev_meshCompactUVs;
+    meshData.clouds = dev_sphereClouds;
+    meshData.cloudNodes = dev_cloudBvhNodes;
+    meshData.cloudSpheres = dev_cloudSpheres;
+    meshData.sdfs = dev_sdfVolumes;
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    for (int view = 0; view < views; view++) {
+        const int offset = view * cam.resolution.x * cam.resolution.y;
+        computeSpecularGBuffer<<<blocksPerGrid2d, blockSize2d, 0, displayStream>>>(
+                hst_scene->state.viewCamera(view), dev_gBuffer + offset, dev_geoms, hst_scene->geoms.size(),
+                dev_bvhNodes, dev_bvhGeomIndices, meshData, dev_materials, dev_specularGBuffer + offset);
+    }
+    const int blockSize1d = 128;
+    const dim3 blocksPerGrid1d = (pixelcount + blockSize1d - 1) / blockSize1d;
+    subtractColors<<<blocksPerGrid1d, blockSize1d, 0, displayStream>>>(pixelcount, dev_image, dev_specular,
+            dev_diffuseColor);
+    checkCUDAError("split specular");
+
+    DenoiserResult result;
+    inputs.color = reinterpret_cast<const float *>(dev_diffuseColor);
+    denoiserFilter(denoiser, &settings, &camera, &inputs, reinterpret_cast<float *>(dev_splitDenoised),
+            &result, displayStream);
+    int levels = result.levels;
+    const float tiles = result.filteredTiles;
+
+    settings.filterSize = options.specularFilterSize;
+    settings.colorWeight = options.specularColorWeight;
+    settings.varianceGuided = 0;
+    inputs.color = reinterpret_cast<const float *>(dev_specular);
+    inputs.gBuffer = dev_specularGBuffer;
+    denoiserFilter(denoiser, &settings, &camera, &inputs, reinterpret_cast<float *>(dev_specularDenoised),
+            &result, displayStream);
+    addColors<<<blocksPerGrid1d, blockSize1d, 0, displayStream>>>(pixelcount, dev_specularDenoised,
+            dev_splitDenoised);
+    checkCUDAError("denoise split specular");
+
+    dev_denoised = dev_splitDenoised;
+    denoisedIter = 1;
+    denoisedHalf = false;
+    stats.denoiseLevels = std::max(levels, result.levels);
+    stats.denoiseTiles = std::max(tiles, result.filteredTiles);
+}
+
+/**
+ * Runs the A-Trous denoiser (see denoiser/denoiser.h), its guided filter
+ * or bilateral grid in its stead, or the OptiX AI denoiser when selected
+ * and available, over the current accumulated image,
+ * after reprojecting it onto the history when temporal accumulation is on.
+ * With options.region set, A-Trous filters just a crop of the region plus
+ * the footprint's reach; outside the region the result is the unfiltered
+ * image. A stereo pair is filtered in the same launches as stacked layers
+ * of one image, by A-Trous alone and without temporal reprojection.
+ */
+// The denoiser's settings for `options`, with the method left to the caller
+static DenoiserSettings filterSettings(const DenoiseOptions &options) {
+    DenoiserSettings settings;
+    settings.filterSize = options.filterSize;
+    settings.kernel = options.kernel == ATROUS_GAUSSIAN ? DENOISER_GAUSSIAN : DENOISER_B3_SPLINE;
+    settings.colorWeight = options.colorWeight;
+    settings.normalWeight = options.normalWeight;
+    settings.positionWeight = options.positionWeight;
+    settings.varianceGuided = options.varianceGuided;
+    settings.separable = options.separable;
+    settings.halfPrecision = options.halfPrecision;
+    settings.pyramid = options.pyramid;
+    settings.demodulateAlbedo = options.demodulateAlbedo;
+    settings.convergence = options.earlyOutThreshold;
+    settings.tileConvergence = options.tileConvergence;
+    settings.method = DENOISER_ATROUS;
+    return settings;
+}
+
+void denoise(int iter, const DenoiseOptions &options) {
+    NvtxRange denoiseRange("denoise", options.filterSize);
+    const Camera &cam = hst_scene->state.camera;
+    const int views = hst_scene->state.viewCount();
+    const bool temporal = options.temporal && views == 1;
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+
+    mergeTraceDevices();
+    beginDisplayWork();
+    timerStart(TIMER_DENOISE, displayStream);
+
+    // The denoiser reads the accumulated image and normalizes it on load
+    dev_denoised = dev_image;
+    denoisedIter = iter;
+
+    if (temporal) {
+        temporalReproject<<<blocksPerGrid2d, blockSize2d, 0, displayStream>>>(cam, historyCamera, iter, historyValid,
+                dev_image, dev_gBuffer, dev_history, dev_historyLength, dev_prevGBuffer,
+                dev_temporal, dev_temporalLength);
+        checkCUDAError("temporal reproject");
+        temporalValid = true;
+        dev_denoised = dev_temporal;
+        denoisedIter = 1;
+    }
+
+    if (options.backend == DENOISE_OPTIX && views == 1) {
+        // Beauty, albedo and normals stay on the device, read straight from
+        // the accumulation and the G-buffer
+        const float4 *result = OptixBackend::denoise(cam, dev_denoised, 1.0f / denoisedIter,
+                dev_gBuffer, displayStream);
+        checkCUDAError("optix denoise");
+        if (result != NULL) {
+            dev_denoised = result;
+            denoisedIter = 1;
+            denoisedHalf = false;
+            stats.denoiseLevels = 0;
+            stats.denoiseTiles = 1.0f;
+            timerStop(TIMER_DENOISE, displayStream);
+            endDisplayWork();
+            return;
+        }
+    }
+
+    DenoiserSettings settings = filterSettings(options);
+    // Stereo pairs, which the other methods cannot keep apart, take
+    // A-Trous, as does the kernel-predicting one without its network
+    settings.method = views > 1 ? DENOISER_ATROUS
+        : options.backend == DENOISE_GUIDED ? DENOISER_GUIDED
+        : options.backend == DENOISE_BILATERAL_GRID ? DENOISER_BILATERAL_GRID
+        : options.backend == DENOISE_KERNEL_PREDICTING && !denoiseNetwork.empty() ? DENOISER_KERNEL_PREDICTING
+        : DENOISER_ATROUS;
+
+    // Layer k of a stereo pair is seen from the left eye moved k eye separations right
+    const glm::vec3 firstEye = hst_scene->state.viewCamera(0).position;
+    const glm::vec3 layerOffset = cam.right * hst_scene->state.eyeSeparation;
+    DenoiserCamera camera;
+    for (int axis = 0; axis < 3; axis++) {
+        camera.position[axis] = firstEye[axis];
+        camera.view[axis] = cam.view[axis];
+        camera.up[axis] = cam.up[axis];
+        camera.right[axis] = cam.right[axis];
+        camera.layerOffset[axis] = layerOffset[axis];
+    }
+    camera.pixelLength[0] = cam.pixelLength.x;
+    camera.pixelLength[1] = cam.pixelLength.y;
+    camera.layers = views;
+
+    DenoiserInputs inputs;
+    inputs.color = reinterpret_cast<const float *>(dev_denoised);
+    inputs.colorScale = 1.0f / denoisedIter;
+    inputs.gBuffer = dev_gBuffer;
+    inputs.moments = reinterpret_cast<const float *>(dev_moments);
+    inputs.samples = iter;
+    inputs.sampleCounts = temporal ? dev_temporalLength : NULL;
+
+    // A region is filtered as an image of its own: the crop of the inputs
+    // the footprint reaches, seen by a camera whose view points at the
+    // crop's centre, so the G-buffer's positions rebuild unchanged. Stereo
+    // pairs are always filtered whole.
+    const PixelRect region = clampRegion(views > 1 ? PixelRect() : options.region, cam.resolution);
+    if (options.splitSpecular && specularValid && !temporal && !partialRegion(region, cam.resolution)) {
+        denoiseSplitSpecular(options, settings, camera, inputs);
+        timerStop(TIMER_DENOISE, displayStream);
+        endDisplayWork();
+        return;
+    }
+    Denoiser filter = denoiser;
+    PixelRect crop = region;
+    if (partialRegion(region, cam.resolution)) {
+        const int halo = ((4 << denoiserLevels(options.filterSize)) - 3) / 2;
+        const PixelRect reach = { region.x - halo, region.y - halo,
+            region.width + 2 * halo, region.height + 2 * halo };
+        crop = clampRegion(reach, cam.resolution);
+    }
+    if (partialRegion(region, cam.resolution) && prepareRegionDenoiser(glm::ivec2(crop.width, crop.height))) {
+        filter = regionDenoiser;
+        const int width = cam.resolution.x;
+        copyCrop(dev_regionColor, dev_denoised, width, crop, displayStream);
+        copyCrop(dev_regionGBuffer, dev_gBuffer, width, crop, displayStream);
+        copyCrop(dev_regionMoments, dev_moments, width, crop, displayStream);
+        if (temporal) {
+            copyCrop(dev_regionLengths, dev_temporalLength, width, crop, displayStream);
+        }
+        const glm::vec3 view = cam.view
+            - cam.right * cam.pixelLength.x * (crop.x + crop.width * 0.5f - cam.resolution.x * 0.5f)
+            - cam.up * cam.pixelLength.y * (crop.y + crop.height * 0.5f - cam.resolution.y * 0.5f);
+        for (int axis = 0; axis < 3; axis++) {
+            camera.view[axis] = view[axis];
+        }
+        inputs.color = reinterpret_cast<const float *>(dev_regionColor);
+        inputs.gBuffer = dev_regionGBuffer;
+        inputs.moments = reinterpret_cast<const float *>(dev_regionMoments);
+        inputs.sampleCounts = temporal ? dev_regionLengths : NULL;
+    }
+
+    // The result stays in the denoiser's scratch until the next call
+    DenoiserResult result;
+    denoiserFilter(filter, &settings, &camera, &inputs, NULL, &result, displayStream);
+    checkCUDAError("denoise");
+    stats.denoiseLevels = result.levels;
+    stats.denoiseTiles = result.filteredTiles;
+    if (filter != denoiser) {
+        // The rest of the frame keeps the normalized input
+        const dim3 blocksPerRegion(
+                (region.width + blockSize2d.x - 1) / blockSize2d.x,
+                (region.height + blockSize2d.y - 1) / blockSize2d.y);
+        unpackColors<<<blocksPerGrid2d, blockSize2d, 0, displayStream>>>(cam.resolution, dev_denoised,
+                1.0f / denoisedIter, dev_regionDenoised);
+        if (result.halfPrecision) {
+            pasteRegion<<<blocksPerRegion, blockSize2d, 0, displayStream>>>(region, crop,
+                    static_cast<const Half4 *>(result.color), result.colorScale, cam.resolution.x,
+                    dev_regionDenoised);
+        } else {
+            pasteRegion<<<blocksPerRegion, blockSize2d, 0, displayStream>>>(region, crop,
+                    static_cast<const float4 *>(result.color), result.colorScale, cam.resolution.x,
+                    dev_regionDenoised);
+        }
+        checkCUDAError("paste denoised region");
+        dev_denoised = dev_regionDenoised;
+        denoisedIter = 1;
+        denoisedHalf = false;
+        timerStop(TIMER_DENOISE, displayStream);
+        endDisplayWork();
+        return;
+    }
+    denoisedHalf = result.halfPrecision != 0;
+    if (denoisedHalf) {
+        dev_denoisedHalf = static_cast<const Half4 *>(result.color);
+    } else if (result.color != dev_denoised) {
+        dev_denoised = static_cast<const float4 *>(result.color);
+        denoisedIter = 1;
+    }
+    timerStop(TIMER_DENOISE, displayStream);
+    endDisplayWork();
+}
+
+// Each of a queued image's pixels had `samples` samples
+__global__ void fillSampleCounts(int n, float samples, float *counts) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index < n) {
+        counts[index] = samples;
+    }
+}
+
+bool pathtraceQueueDenoise(int iter, int capacity) {
+    const Camera &cam = hst_scene->state.camera;
+    if (hst_scene->state.viewCount() > 1 || capacity < 2 || iter < 1) {
+        return false;
+    }
+    const int queued = (int)batchCameras.size();
+    if (queued > 0 && (cam.resolution != batchResolution || queued >= batchCapacity)) {
+        return false;
+    }
+    if (cam.resolution != batchResolution || capacity != batchCapacity) {
+        const size_t pixels = (size_t)cam.resolution.x * cam.resolution.y * capacity;
+        deviceMemory::release(dev_batchColor);
+        deviceMemory::release(dev_batchGBuffer);
+        deviceMemory::release(dev_batchMoments);
+        deviceMemory::release(dev_batchSamples);
+        deviceMemory::release(dev_batchDenoised);
+        deviceMemory::allocate(&dev_batchColor, pixels * sizeof(float4));
+        deviceMemory::allocate(&dev_batchGBuffer, pixels * sizeof(GBufferPixel));
+        deviceMemory::allocate(&dev_batchMoments, pixels * sizeof(glm::vec2));
+        deviceMemory::allocate(&dev_batchSamples, pixels * sizeof(float));
+        deviceMemory::allocate(&dev_batchDenoised, pixels * sizeof(float4));
+        batchResolution = cam.resolution;
+        batchCapacity = capacity;
+    }
+
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    const size_t slot = (size_t)queued * pixelcount;
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    const int blockSize1d = 128;
+
+    mergeTraceDevices();
+    waitForDisplay();
+    unpackColors<<<blocksPerGrid2d, blockSize2d>>>(cam.resolution, dev_image, 1.0f / iter, dev_batchColor + slot);
+    cudaMemcpy(dev_batchGBuffer + slot, dev_gBuffer, pixelcount * sizeof(GBufferPixel), cudaMemcpyDeviceToDevice);
+    cudaMemcpy(dev_batchMoments + slot, dev_moments, pixelcount * sizeof(glm::vec2), cudaMemcpyDeviceToDevice);
+    fillSampleCounts<<<(pixelcount + blockSize1d - 1) / blockSize1d, blockSize1d>>>(pixelcount, (float)iter,
+            dev_batchSamples + slot);
+    checkCUDAError("queue denoise");
+
+    DenoiserCamera camera;
+    for (int axis = 0; axis < 3; axis++) {
+        camera.position[axis] = cam.position[axis];
+        camera.view[axis] = cam.view[axis];
+        camera.up[axis] = cam.up[axis];
+        camera.right[axis] = cam.right[axis];
+        camera.layerOffset[axis] = 0.0f;
+    }
+    camera.pixelLength[0] = cam.pixelLength.x;
+    camera.pixelLength[1] = cam.pixelLength.y;
+    camera.layers = 1;
+    batchCameras.push_back(camera);
+    batchFewestSamples = queued == 0 ? iter : std::min(batchFewestSamples, iter);
+    return true;
+}
+
+int pathtraceDenoiseBatch(const DenoiseOptions &options, std::vector<std::vector<glm::vec3>> &out) {
+    const int count = (int)batchCameras.size();
+    out.clear();
+    if (count == 0) {
+        return 0;
+    }
+    NvtxRange denoiseRange("denoise batch", count);
+    if (count != batchDenoiserImages) {
+        denoiserDestroy(batchDenoiser);
+        batchDenoiser = NULL;
+        batchDenoiserImages = 0;
+        if (denoiserCreate(batchResolution.x, batchResolution.y * count, NULL, 0,
+                &batchDenoiser) != DENOISER_SUCCESS) {
+            fprintf(stderr, "Could not create the batch denoiser.\n");
+            batchCameras.clear();
+            return 0;
+        }
+        batchDenoiserImages = count;
+    }
+
+    // Stacked images, like stereo pairs, are A-Trous's alone
+    const DenoiserSettings settings = filterSettings(options);
+
+    DenoiserInputs inputs;
+    inputs.color = reinterpret_cast<const float *>(dev_batchColor);
+    inputs.colorScale = 1.0f;
+    inputs.gBuffer = dev_batchGBuffer;
+    inputs.moments = reinterpret_cast<const float *>(dev_batchMoments);
+    inputs.samples = batchFewestSamples;
+    inputs.sampleCounts = dev_batchSamples;
+
+    waitForDisplay();
+    timerStart(TIMER_DENOISE, 0);
+    const DenoiserStatus status = denoiserFilterBatch(batchDenoiser, &settings, batchCameras.data(), count,
+            &inputs, reinterpret_cast<float *>(dev_batchDenoised), NULL, 0);
+    timerStop(TIMER_DENOISE, 0);
+    checkCUDAError("denoise batch");
+    batchCameras.clear();
+    if (status != DENOISER_SUCCESS) {
+        fprintf(stderr, "Could not denoise the batch.\n");
+        return 0;
+    }
+
+    const int pixelcount = batchResolution.x * batchResolution.y;
+    std::vector<float4> host((size_t)pixelcount * count);
+    cudaMemcpy(host.data(), dev_batchDenoised, host.size() * sizeof(float4), cudaMemcpyDeviceToHost);
+    checkCUDAError("retrieve denoised batch");
+    out.resize(count);
+    for (int i = 0; i < count; i++) {
+        out[i].resize(pixelcount);
+        copyHostColors(&host[(size_t)i * pixelcount], pixelcount, out[i].data());
+    }
+    return count;
+}
+
+/**
+ * Copies the result of the last denoise() into `out`, normalized, for
+ * host-side comparisons. dev_denoiseStaging stages the FP32 copy; no result
+ * ever lives there.
+ */
+void pathtraceRetrieveDenoised(std::vector<glm::vec3> &out) {
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+
+    waitForDisplay();
+    if (denoisedHalf) {
+        unpackColors<<<blocksPerGrid2d, blockSize2d>>>(resolution, dev_denoisedHalf, 1.0f, dev_denoiseStaging);
+    } else {
+        unpackColors<<<blocksPerGrid2d, blockSize2d>>>(resolution, dev_denoised,
+                1.0f / denoisedIter, dev_denoiseStaging);
+    }
+    cudaMemcpyAsync(hst_pinnedImage, dev_denoiseStaging,
+            pixelcount * sizeof(float4), cudaMemcpyDeviceToHost);
+    cudaStreamSynchronize(0);
+    out.resize(pixelcount);
+    copyHostColors(hst_pinnedImage, pixelcount, out.data());
+
+    checkCUDAError("pathtraceRetrieveDenoised");
+}
+
+/**
+ * Merges the devices' samples and, when the denoised result is stored in
+ * FP16 or still unnormalized, widens it into dev_denoiseStaging; then waits
+ * so the pointers can be read from any stream.
+ */
+PathtraceDeviceBuffers pathtraceDeviceBuffers() {
+    const glm::ivec2 resolution = imageResolution();
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+
+    mergeTraceDevices();
+    waitForDisplay();
+    PathtraceDeviceBuffers buffers;
+    buffers.image = dev_image;
+    buffers.moments = dev_moments;
+    buffers.gBuffer = dev_gBuffer;
+    buffers.denoised = dev_denoised;
+    if (denoisedHalf) {
+        unpackColors<<<blocksPerGrid2d, blockSize2d>>>(resolution, dev_denoisedHalf, 1.0f, dev_denoiseStaging);
+        buffers.denoised = dev_denoiseStaging;
+    } else if (dev_denoised != NULL && denoisedIter != 1) {
+        unpackColors<<<blocksPerGrid2d, blockSize2d>>>(resolution, dev_denoised,
+                1.0f / denoisedIter, dev_denoiseStaging);
+        buffers.denoised = dev_denoiseStaging;
+    }
+    cudaDeviceSynchronize();
+
+    checkCUDAError("pathtraceDeviceBuffers");
+    return buffers;
+}
+
+/**
+ * Adds up the pixels' squared relative standard errors of the mean
+ * luminance, from the moments of their `samples` samples, with the means
+ * floored as adaptive sampling floors them; one atomic per warp.
+ */
+__global__ void relativeErrorSum(int n, int samples, const glm::vec2 *moments, float *sum) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    float error2 = 0.0f;
+    if (index < n) {
+        glm::vec2 m = moments[index] / (float)samples;
+        float variance = fmaxf(m.y - m.x * m.x, 0.0f);
+        float mean = fmaxf(m.x, ADAPTIVE_MIN_LUMINANCE);
+        error2 = variance / (samples * mean * mean);
+    }
+    for (int offset = WARP_SIZE / 2; offset > 0; offset /= 2) {
+        error2 += __shfl_down_sync(0xffffffff, error2, offset);
+    }
+    if ((threadIdx.x & (WARP_SIZE - 1)) == 0) {
+        atomicAdd(sum, error2);
+    }
+}
+
+/**
+ * Adds up the pixels' squared luminance changes since `previous`, relative
+ * to the floored luminance, if `compare`; then replaces `previous`.
+ */
+__global__ void denoisedChangeSum(int n, const float4 *denoised, float *previous, bool compare, float *sum) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    float change2 = 0.0f;
+    if (index < n) {
+        float4 c = denoised[index];
+        float luminance = glm::dot(glm::vec3(c.x, c.y, c.z), glm::vec3(0.2126f, 0.7152f, 0.0722f));
+        if (compare) {
+            float change = (luminance - previous[index]) / fmaxf(luminance, ADAPTIVE_MIN_LUMINANCE);
+            change2 = change * change;
+        }
+        previous[index] = luminance;
+    }
+    for (int offset = WARP_SIZE / 2; offset > 0; offset /= 2) {
+        change2 += __shfl_down_sync(0xffffffff, change2, offset);
+    }
+    if ((threadIdx.x & (WARP_SIZE - 1)) == 0) {
+        atomicAdd(sum, change2);
+    }
+}
+
+// Reads back and clears dev_stopSum, as the RMS over `pixelcount` pixels
+static float stopSumRms(int pixelcount) {
+    float sum = 0.0f;
+    cudaMemcpy(&sum, dev_stopSum, sizeof(float), cudaMemcpyDeviceToHost);
+    cudaMemset(dev_stopSum, 0, sizeof(float));
+    return sqrtf(sum / pixelcount);
+}
+
+float pathtraceRelativeError(int samples) {
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+    const int blockSize1d = 128;
+
+    if (dev_stopSum == NULL) {
+        deviceMemory::allocate(&dev_stopSum, sizeof(float));
+        cudaMemset(dev_stopSum, 0, sizeof(float));
+    }
+    mergeTraceDevices();
+    relativeErrorSum<<<(pixelcount + blockSize1d - 1) / blockSize1d, blockSize1d>>>(pixelcount,
+            std::max(samples, 1), dev_moments, dev_stopSum);
+    float error = stopSumRms(pixelcount);
+
+    checkCUDAError("pathtraceRelativeError");
+    return error;
+}
+
+float pathtraceDenoisedChange() {
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+    const int blockSize1d = 128;
+
+    if (dev_stopSum == NULL) {
+        deviceMemory::allocate(&dev_stopSum, sizeof(float));
+        cudaMemset(dev_stopSum, 0, sizeof(float));
+    }
+    if (dev_stopLuminance == NULL) {
+        deviceMemory::allocate(&dev_stopLuminance, pixelcount * sizeof(float));
+    }
+    const float4 *denoised = pathtraceDeviceBuffers().denoised;
+    if (denoised == NULL) {
+        return -1.0f;
+    }
+    const bool compare = stopLuminanceValid;
+    denoisedChangeSum<<<(pixelcount + blockSize1d - 1) / blockSize1d, blockSize1d>>>(pixelcount,
+            denoised, dev_stopLuminance, compare, dev_stopSum);
+    float change = stopSumRms(pixelcount);
+    stopLuminanceValid = true;
+
+    checkCUDAError("pathtraceDenoisedChange");
+    return compare ? change : -1.0f;
+}
+
+// Copies the first-hit G-buffer into `out`, for AOV output
+void pathtraceRetrieveGBuffer(std::vector<GBufferPixel> &out) {
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+
+    out.resize(pixelcount);
+    waitForDisplay();
+    cudaMemcpy(out.data(), dev_gBuffer, pixelcount * sizeof(GBufferPixel), cudaMemcpyDeviceToHost);
+
+    checkCUDAError("pathtraceRetrieveGBuffer");
+}
+
+void pathtraceCopyRaw(void *image, void *gBuffer) {
+    NvtxRange copyRange("copy raw frame");
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+
+    mergeTraceDevices();
+    waitForDisplay();
+    cudaMemcpyAsync(image, dev_image, pixelcount * sizeof(float4), cudaMemcpyDeviceToHost);
+    cudaMemcpyAsync(gBuffer, dev_gBuffer, pixelcount * sizeof(GBufferPixel), cudaMemcpyDeviceToHost);
+    cudaStreamSynchronize(0);
+
+    checkCUDAError("pathtraceCopyRaw");
+}
+
+/**
+ * Starts copying the current image (the last denoise() result if
+ * `denoised`) to the host without waiting for it. The normalized snapshot
+ * is taken on the default stream, so later iterations can overwrite
+ * dev_image while the copy is in flight; pathtraceFinishReadback collects
+ * it. Only one readback can be pending.
+ */
+void pathtraceBeginReadback(int iter, bool denoised) {
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+
+    if (dev_readback == NULL) {
+        deviceMemory::allocate(&dev_readback, pixelcount * sizeof(float4));
+        cudaMallocHost(&hst_readback, pixelcount * sizeof(float4));
+        cudaStreamCreateWithFlags(&readbackStream, cudaStreamNonBlocking);
+        cudaEventCreateWithFlags(&readbackReady, cudaEventDisableTiming);
+        cudaEventCreateWithFlags(&readbackDone, cudaEventDisableTiming);
+    }
+
+    if (!denoised) {
+        mergeTraceDevices();
+        unpackColors<<<blocksPerGrid2d, blockSize2d>>>(resolution, dev_image, 1.0f / iter, dev_readback);
+    } else if (denoisedHalf) {
+        waitForDisplay();
+        unpackColors<<<blocksPerGrid2d, blockSize2d>>>(resolution, dev_denoisedHalf, 1.0f, dev_readback);
+    } else {
+        waitForDisplay();
+        unpackColors<<<blocksPerGrid2d, blockSize2d>>>(resolution, dev_denoised,
+                1.0f / denoisedIter, dev_readback);
+    }
+    cudaEventRecord(readbackReady, 0);
+    cudaStreamWaitEvent(readbackStream, readbackReady, 0);
+    cudaMemcpyAsync(hst_readback, dev_readback, pixelcount * sizeof(float4),
+            cudaMemcpyDeviceToHost, readbackStream);
+    cudaEventRecord(readbackDone, readbackStream);
+    readbackPending = true;
+
+    checkCUDAError("pathtraceBeginReadback");
+}
+
+// Waits for the pending readback and moves it into `out`
+void pathtraceFinishReadback(std::vector<glm::vec3> &out) {
+    if (!readbackPending) {
+        out.clear();
+        return;
+    }
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+
+    cudaEventSynchronize(readbackDone);
+    out.resize(pixelcount);
+    copyHostColors(hst_readback, pixelcount, out.data());
+    readbackPending = false;
+
+    checkCUDAError("pathtraceFinishReadback");
+}
+
+/**
+ * Starts copying the accumulation as it stands after `samples` samples
+ * (raw sums, moments and G-buffer) to the host for a checkpoint, without
+ * waiting for it. The snapshot is taken on the default stream, so tracing
+ * carries on while the copy is in flight; pathtraceCheckpointReady says
+ * when pathtraceFinishCheckpoint can collect it without blocking. Only one
+ * checkpoint can be pending.
+ */
+void pathtraceBeginCheckpoint(int samples) {
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+
+    if (dev_checkpointImage == NULL) {
+        deviceMemory::allocate(&dev_checkpointImage, pixelcount * sizeof(float4));
+        deviceMemory::allocate(&dev_checkpointMoments, pixelcount * sizeof(glm::vec2));
+        deviceMemory::allocate(&dev_checkpointGBuffer, pixelcount * sizeof(GBufferPixel));
+        cudaMallocHost(&hst_checkpointGBuffer, pixelcount * sizeof(GBufferPixel));
+        cudaStreamCreateWithFlags(&checkpointStream, cudaStreamNonBlocking);
+        cudaEventCreateWithFlags(&checkpointReady, cudaEventDisableTiming);
+        cudaEventCreateWithFlags(&checkpointDone, cudaEventDisableTiming);
+    }
+
+    mergeTraceDevices();
+    cudaMemcpyAsync(dev_checkpointImage, dev_image, pixelcount * sizeof(float4), cudaMemcpyDeviceToDevice);
+    cudaMemcpyAsync(dev_checkpointMoments, dev_moments, pixelcount * sizeof(glm::vec2),
+            cudaMemcpyDeviceToDevice);
+    cudaMemcpyAsync(dev_checkpointGBuffer, dev_gBuffer, pixelcount * sizeof(GBufferPixel),
+            cudaMemcpyDeviceToDevice);
+    cudaEventRecord(checkpointReady, 0);
+    cudaStreamWaitEvent(checkpointStream, checkpointReady, 0);
+    cudaMemcpyAsync(hst_checkpointGBuffer, dev_checkpointGBuffer, pixelcount * sizeof(GBufferPixel),
+            cudaMemcpyDeviceToHost, checkpointStream);
+    cudaEventRecord(checkpointDone, checkpointStream);
+    checkpointPending = true;
+    checkpointSamples = samples;
+
+    checkCUDAError("pathtraceBeginCheckpoint");
+}
+
+// Whether a checkpoint is pending and its copy has landed; never blocks
+bool pathtraceCheckpointReady() {
+    return checkpointPending && cudaEventQuery(checkpointDone) == cudaSuccess;
+}
+
+/**
+ * Waits for the pending checkpoint and moves it into `packed`, its sums
+ * and moments packed as pathtraceRetrievePacked packs them, and `gBuffer`.
+ * The packing runs on the checkpoint's stream, so tracing goes on
+ * meanwhile. Returns its sample count, 0 if none was pending.
+ */
+int pathtraceFinishCheckpoint(std::vector<unsigned char> &packed, std::vector<GBufferPixel> &gBuffer) {
+    if (!checkpointPending) {
+        return 0;
+    }
+    const glm::ivec2 resolution = imageResolution();
+    const int pixelcount = resolution.x * resolution.y;
+
+    cudaEventSynchronize(checkpointDone);
+    packAccumulation(dev_checkpointImage, dev_checkpointMoments, pixelcount, packed, checkpointStream);
+    gBuffer.assign(hst_checkpointGBuffer, hst_checkpointGBuffer + pixelcount);
+    checkpointPending = false;
+
+    checkCUDAError("pathtraceFinishCheckpoint");
+    return checkpointSamples;
+}
+
+// The first pixel, in the stacked image, of the view options.eye shows
+static int displayedViewOffset(const DisplayOptions &options) {
+    const RenderState &state = hst_scene->state;
+    const int view = glm::clamp(options.eye, 0, state.viewCount() - 1);
+    return view * state.camera.resolution.x * state.camera.resolution.y;
+}
+
+// Edge of resolveToDisplay's square blocks
+#define TAA_TILE 8
+
+__device__ inline glm::vec3 rgbToYCoCg(const glm::vec3 &c) {
+    return glm::vec3(0.25f * (c.r + 2.0f * c.g + c.b), 0.5f * (c.r - c.b), 0.25f * (2.0f * c.g - c.r - c.b));
+}
+
+__device__ inline glm::vec3 yCoCgToRgb(const glm::vec3 &c) {
+    return glm::vec3(c.x + c.y - c.z, c.x + c.z, c.x - c.y - c.z);
+}
+
+/**
+ * The TAA resolve of a denoised frame, written straight to the display
+ * like sendImageToDisplay. Each block stages its pixels and a one-pixel
+ * ring around them in shared memory, in YCoCg; a pixel's history, found
+ * by reprojectPixel when `reproject` and at the same pixel otherwise, is
+ * clamped to the box of its 3x3 neighbourhood and blended with the pixel
+ * by `blend`. A disoccluded pixel takes the frame alone. The result,
+ * normalized, goes to `resolved` for the next resolve too.
+ */
+template <typename T>
+__global__ void resolveToDisplay(cudaSurfaceObject_t display, Camera cam, Camera prevCam, bool reproject,
+        float colorScale, float scale, float blend, DisplayOptions options, const T* image,
+        const GBufferPixel* gBuffer, const GBufferPixel* prevGBuffer, bool historyValid,
+        const float4* history, float4* resolved) {
+    __shared__ float3 s_taaTile[TAA_TILE + 2][TAA_TILE + 2];
+
+    const int tileX = blockIdx.x * TAA_TILE - 1;
+    const int tileY = blockIdx.y * TAA_TILE - 1;
+    for (int i = threadIdx.x + threadIdx.y * TAA_TILE; i < (TAA_TILE + 2) * (TAA_TILE + 2);
+            i += TAA_TILE * TAA_TILE) {
+        int sx = min(max(tileX + i % (TAA_TILE + 2), 0), cam.resolution.x - 1);
+        int sy = min(max(tileY + i / (TAA_TILE + 2), 0), cam.resolution.y - 1);
+        glm::vec3 c = rgbToYCoCg(loadColor(image, sx + (sy * cam.resolution.x)) * colorScale);
+        s_taaTile[i / (TAA_TILE + 2)][i % (TAA_TILE + 2)] = make_float3(c.x, c.y, c.z);
+    }
+    __syncthreads();
+
+    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
+    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+
+    if (x < cam.resolution.x && y < cam.resolution.y) {
+        int index = x + (y * cam.resolution.x);
+        glm::vec3 lo(1e30f);
+        glm::vec3 hi(-1e30f);
+        for (int dy = 0; dy < 3; dy++) {
+            for (int dx = 0; dx < 3; dx++) {
+                float3 s = s_taaTile[threadIdx.y + dy][threadIdx.x + dx];
+                lo = glm::min(lo, glm::vec3(s.x, s.y, s.z));
+                hi = glm::max(hi, glm::vec3(s.x, s.y, s.z));
+            }
+        }
+        float3 centre = s_taaTile[threadIdx.y + 1][threadIdx.x + 1];
+        glm::vec3 color(centre.x, centre.y, centre.z);
+
+        int prevIndex = !historyValid ? -1
+            : reproject ? reprojectPixel(cam, prevCam, gBuffer[index], x, y, prevGBuffer) : index;
+        if (prevIndex >= 0) {
+            glm::vec3 past = glm::clamp(rgbToYCoCg(loadColor(history, prevIndex)), lo, hi);
+            color = glm::mix(past, color, blend);
+        }
+        color = yCoCgToRgb(color);
+
+        storeColor(resolved, index, color);
+        surf2Dwrite(make_uchar4(displayChannel(color.x, scale, options), displayChannel(color.y, scale, options),
+                displayChannel(color.z, scale, options), 0), display, x * sizeof(uchar4), y);
+    }
+}
+
+// showDenoisedImage through resolveToDisplay, which swaps in the new history
+static void resolveDenoisedToDisplay(cudaSurfaceObject_t display, const DisplayOptions &options) {
+    const Camera &cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    const dim3 blockSize2d(TAA_TILE, TAA_TILE);
+    const dim3 blocksPerGrid2d(
+            (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
+            (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+
+    if (dev_taaHistory == NULL) {
+        deviceMemory::allocate(&dev_taaHistory, pixelcount * sizeof(float4));
+        deviceMemory::allocate(&dev_taaResolved, pixelcount * sizeof(float4));
+        taaValid = false;
+    }
+    const float blend = glm::clamp(options.taaBlend, 0.0f, 1.0f);
+    if (denoisedHalf) {
+        resolveToDisplay<<<blocksPerGrid2d, blockSize2d, 0, displayStream>>>(display, cam, taaCamera,
+                taaReproject, 1.0f, displayScale(1, options), blend, options, dev_denoisedHalf, dev_gBuffer,
+                dev_prevGBuffer, taaValid, dev_taaHistory, dev_taaResolved);
+    } else {
+        resolveToDisplay<<<blocksPerGrid2d, blockSize2d, 0, displayStream>>>(display, cam, taaCamera,
+                taaReproject, 1.0f / denoisedIter, displayScale(1, options), blend, options, dev_denoised,
+                dev_gBuffer, dev_prevGBuffer, taaValid, dev_taaHistory, dev_taaResolved);
+    }
+    checkCUDAError("resolve to display");
+    std::swap(dev_taaHistory, dev_taaResolved);
+    taaCamera = cam;
+    taaValid = true;
+    taaReproject = false;
+}
+
+/**
+ * Writes the last denoise() result to the display. With
+ * options.temporalAA, a single view shown whole is resolved against the
+ * frames shown before it on the way (see resolveToDisplay).
+ */
+void showDenoisedImage(cudaSurfaceObject_t display, const DisplayOptions &options) {
+    const Camera &cam = hst_scene->state.camera;
+    const int offset = displayedViewOffset(options);
+    const PixelRect region = clampRegion(options.region, cam.resolution);
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (region.width + blockSize2d.x - 1) / blockSize2d.x,
+            (region.height + blockSize2d.y - 1) / blockSize2d.y);
+
+    // Filtered levels are already normalized; with no levels run this is dev_image
+    beginDisplayWork();
+    timerStart(TIMER_DISPLAY, displayStream);
+    if (options.temporalAA && hst_scene->state.viewCount() == 1 && !partialRegion(region, cam.resolution)) {
+        resolveDenoisedToDisplay(display, options);
+    } else if (denoisedHalf) {
+        sendImageToDisplay<<<blocksPerGrid2d, blockSize2d, 0, displayStream>>>(display, cam.resolution,
+                region, displayScale(1, options), options, dev_denoisedHalf + offset);
+    } else {
+        sendImageToDisplay<<<blocksPerGrid2d, blockSize2d, 0, displayStream>>>(display, cam.resolution,
+                region, displayScale(denoisedIter, options), options, dev_denoised + offset);
+    }
+    timerStop(TIMER_DISPLAY, displayStream);
+    endDisplayWork();
+}
+
+// CHECKITOUT: this kernel "post-processes" the gbuffer/gbuffers into something that you can visualize for debugging.
+void showGBuffer(cudaSurfaceObject_t display, int view) {
+    const Camera &cam = hst_scene->state.camera;
     const dim3 blockSize2d(8, 8);
     const dim3 blocksPerGrid2d(
             (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
             (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
 
+    // CHECKITOUT: process the gbuffer results and send them to OpenGL buffer for visualization
+    beginDisplayWork();
+    timerStart(TIMER_DISPLAY, displayStream);
+    // The left eye's, for a stereo pair
+    if (view >= GBUFFER_BOUNCES) {
+        const int channel = view - GBUFFER_BOUNCES;
+        if (dev_rayCost != NULL) {
+            const int pixelcount = cam.resolution.x * cam.resolution.y;
+            const int blockSize1d = 128;
+            const dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+            cudaMemsetAsync(dev_rayCostMax, 0, sizeof(unsigned int), displayStream);
+            rayCostMax<<<numBlocksPixels, blockSize1d, 0, displayStream>>>(pixelcount, dev_rayCost, channel,
+                    dev_rayCostMax);
+        }
+        rayCostToDisplay<<<blocksPerGrid2d, blockSize2d, 0, displayStream>>>(display, cam.resolution,
+                dev_rayCost, channel, dev_rayCostMax);
+    } else {
+        gbufferToDisplay<<<blocksPerGrid2d, blockSize2d, 0, displayStream>>>(display,
+                hst_scene->state.viewCamera(0), dev_gBuffer, view,
+                dev_bvhNodes, (int)hst_scene->geoms.size());
+    }
+    timerStop(TIMER_DISPLAY, displayStream);
+    endDisplayWork();
+}
+
+void showImage(cudaSurfaceObject_t display, int iter, const DisplayOptions &options) {
+const Camera &cam = hst_scene->state.camera;
+    const PixelRect region = clampRegion(options.region, cam.resolution);
+    const dim3 blockSize2d(8, 8);
+    const dim3 blocksPerGrid2d(
+            (region.width + blockSize2d.x - 1) / blockSize2d.x,
+            (region.height + blockSize2d.y - 1) / blockSize2d.y);
+
     // Send results to OpenGL buffer for rendering
-    sendImageToPBO<<<blocksPerGrid2d, blockSize2d>>>(pbo, cam.resolution, iter, dev_image);
+    mergeTraceDevices();
+    beginDisplayWork();
+    timerStart(TIMER_DISPLAY, displayStream);
+    sendImageToDisplay<<<blocksPerGrid2d, blockSize2d, 0, displayStream>>>(display, cam.resolution,
+            region, displayScale(iter, options), options, dev_image + displayedViewOffset(options));
+    timerStop(TIMER_DISPLAY, displayStream);
+    endDisplayWork();
+}
+
+/**
+ * The stream denoise() and the show functions queue on. Map the display
+ * texture on it, and time display work with events recorded on it.
+ */
+cudaStream_t pathtraceDisplayStream() {
+    return displayStream;
+}
+
+void pathtraceEnableTelemetry(bool enabled) {
+    telemetryEnabled = enabled;
+}
+
+// Adds one device's counters to `out` and clears them, once its work is done
+static void collectRayCounts(unsigned long long *dev_counts, RayTelemetry &out) {
+    unsigned long long counts[RAY_COUNT_SLOTS];
+    cudaDeviceSynchronize();
+    cudaMemcpy(counts, dev_counts, sizeof(counts), cudaMemcpyDeviceToHost);
+    cudaMemset(dev_counts, 0, sizeof(counts));
+    for (int bounce = 0; bounce < TELEMETRY_BOUNCES; bounce++) {
+        out.pathRays[bounce] += (long long)counts[bounce];
+    }
+    out.shadowRays += (long long)counts[TELEMETRY_BOUNCES];
+    out.queueLaunches += (long long)counts[RAY_COUNT_QUEUE];
+    out.queueWarps += (long long)counts[RAY_COUNT_QUEUE + 1];
+    out.queueWarpMin += (long long)counts[RAY_COUNT_QUEUE + 2];
+    out.queueWarpMax += (long long)counts[RAY_COUNT_QUEUE + 3];
+    out.queueBounces += (long long)counts[RAY_COUNT_QUEUE + 4];
+}
+
+void pathtraceReadTelemetry(RayTelemetry &out) {
+    collectRayCounts(dev_rayCounts, out);
+    for (size_t i = 0; i < traceDevices.size(); i++) {
+        cudaSetDevice(traceDevices[i].device);
+        collectRayCounts(traceDevices[i].rayCounts, out);
+    }
+    cudaSetDevice(primaryDevice);
+    checkCUDAError("pathtraceReadTelemetry");
+}
+
+/**
+ * Turns the GPU timers on or off. While off no events are recorded and the
+ * averages in pathtraceStats() hold their last values. Unsmoothed, they
+ * are each stage's latest time instead, for callers timing single frames.
+ */
+void pathtraceEnableTiming(bool enabled, bool smoothed) {
+    timingEnabled = enabled;
+    timingSmoothed = smoothed;
+}
+
+/**
+ * Folds every finished timer into its rolling average and returns the
+ * current stats. Waits for timers still in flight, so call it once per
+ * frame, after the frame's work has been queued.
+ */
+const PathtraceStats &pathtraceStats() {
+    for (int slot = 0; slot < TIMER_COUNT; slot++) {
+        timerResolve(slot);
+    }
+    stats.generateRaysMs = timerAverageMs[TIMER_GENERATE_RAYS];
+    stats.megakernelMs = timerAverageMs[TIMER_MEGAKERNEL];
+    stats.finalGatherMs = timerAverageMs[TIMER_FINAL_GATHER];
+    stats.denoiseMs = timerAverageMs[TIMER_DENOISE];
+    stats.displayMs = timerAverageMs[TIMER_DISPLAY];
+    for (int depth = 0; depth < STATS_MAX_DEPTH; depth++) {
+        stats.intersectMs[depth] = timerAverageMs[TIMER_INTERSECT + depth];
+        stats.shadeMs[depth] = timerAverageMs[TIMER_SHADE + depth];
+        stats.sortRaysMs[depth] = timerAverageMs[TIMER_SORT_RAYS + depth];
+        stats.compactMs[depth] = timerAverageMs[TIMER_COMPACT + depth];
+    }
+    stats.memory = deviceMemory::usage(primaryDevice);
+    return stats;
 }
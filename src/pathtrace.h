@@ -2,9 +2,420 @@
 
 #include <vector>
 #include "scene.h"
+#include "deviceMemory.h"
+#include "accumulationFile.h"
 
+void pathtraceUseDevices(int count);
+void pathtraceDedicateDisplayDevice(bool enable);
+void pathtraceUseDeviceBVH(bool enable);
+void pathtraceUsePagedGeometry(bool enable);
+void pathtraceShareGeometry(bool enable);
+void pathtraceUseVirtualTextures(bool enable);
+void pathtraceUseL2Persistence(bool enable);
+// Weights of the kernel-predicting denoiser (see DENOISER_KPN_WEIGHTS); empty drops them
+void pathtraceUseDenoiseNetwork(const std::vector<float> &weights);
+bool pathtraceDenoiseNetworkAvailable();
+bool pathtraceHardwareRTAvailable();
+bool pathtraceAIDenoiserAvailable();
+int pathtraceDeviceCount();
+// The CUDA devices traced on, the primary first
+std::vector<int> pathtraceDevices();
 void pathtraceInit(Scene *scene);
+void pathtraceReset();
+bool pathtraceUpdateScene(Scene *scene);
+void pathtraceSceneEdited();
+void pathtraceAnimateGeoms(const std::vector<GeomTransform> &transforms);
 void pathtraceFree();
-void pathtrace(int frame, int iteration);
-void showGBuffer(uchar4 *pbo);
-void showImage(uchar4 *pbo, int iter);
+// How pathtrace() schedules the bounces of an iteration
+enum PathtracePipeline {
+    PIPELINE_SPLIT,         // intersect, shade and compact kernels per bounce
+    PIPELINE_WAVEFRONT,     // persistent extend threads fed by path queues
+    PIPELINE_MEGAKERNEL,    // one thread traces its whole path in one kernel
+    PIPELINE_GRAPH,         // fixed-depth split kernels replayed as a CUDA graph
+    PIPELINE_PERSISTENT,    // persistent warps trace every bounce from one device ring buffer
+    PIPELINE_COOPERATIVE,   // split stages as one cooperative launch, grid-synced between them
+};
+
+// How finalGather adds several samples per pixel into the image
+enum GatherMode {
+    GATHER_ATOMIC,          // each path adds itself with per-channel float atomics
+    GATHER_SEGMENTED,       // paths regrouped by sample, then one thread per pixel sums them
+};
+
+// Where shading draws its random numbers from, see sampler.h
+enum SamplerType {
+    SAMPLER_RANDOM,     // a hash-seeded minstd engine per shade call
+    SAMPLER_SOBOL,      // per-pixel Owen-scrambled Sobol, padded in pairs
+};
+
+// Path slots are allocated for up to this many samples per pixel per launch
+#define MAX_SAMPLES_PER_LAUNCH 8
+// ...times up to this many paths split from each camera hit
+#define MAX_PATH_SPLIT 8
+
+// Image pixels x .. x + width - 1 of rows y .. y + height - 1; an empty
+// rectangle stands for the whole image
+struct PixelRect {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Per-iteration render settings driven by the control panel
+struct PathtraceOptions {
+    bool sortByMaterial;    // sort paths by material before shading (split only)
+    bool cacheFirstBounce;  // reuse camera-ray hits until pathtraceReset()
+    int pipeline;           // a PathtracePipeline
+    bool russianRoulette;   // terminate dim paths early, unbiased
+    int rouletteMinDepth;   // bounces traced before roulette starts
+    int samplesPerLaunch;   // samples per pixel traced by one pathtrace() call
+    int seedOffset;         // added to the iteration that seeds the samples
+    int tileRows;           // rows traced per band of path slots, 0 for the whole image
+    int pixelStride;        // trace every pixelStride-th pixel each way, copied over its block; 1 for all (primary GPU only)
+    bool adaptiveSampling;  // stop tracing pixels once their estimate converges
+    float adaptiveThreshold;    // converged: standard error below this fraction of the mean
+    int adaptiveMinSamples;     // samples every pixel gets before it may converge
+    int sampler;            // a SamplerType
+    bool antialias;         // jitter camera rays within their pixel
+    bool jitteredGBuffer;   // antialiased: G-buffer from the jittered rays, not the pixel centres
+    bool nextEventEstimation;   // sample Scene::lights directly at diffuse bounces, with MIS
+    bool lightTree;         // NEE picks lights through Scene::lightNodes by estimated contribution, not power
+    bool wideMeshBVH;       // walk meshes' 4-wide BVHs rather than their binary ones
+    bool meshLOD;           // walk meshes at the level of detail of each ray's cone (software traversal)
+    bool watertight;        // watertight ray/triangle tests, without cracks along shared edges (software traversal)
+    bool shortStack;        // walk the top-level BVH on a short register stack with a restart trail (software traversal)
+    bool sortRays;          // sort bounce rays by origin and direction before intersecting (split only)
+    bool specializedShading;    // shade with the variant compiled for just the scene's material features (split only)
+    bool tiledPathOrder;    // camera paths fill their slots by 8x4 pixel tiles rather than rows, for coherent warps
+    bool hardwareRT;        // intersect path rays with OptiX when available (split only, primary GPU)
+    int gather;             // a GatherMode, for more than one sample per launch
+    bool accumulateOnTermination;   // add paths to the image as they end, not in finalGather (split only)
+    bool regeneratePaths;   // refill ended paths' slots with the launch's later samples (split only)
+    bool hitRecords;        // intersect into compact hit records, resolved when shading (split only)
+    bool deterministic;     // add samples in a fixed order, so reruns match bit for bit
+    bool rayCost;           // count each pixel's bounces, BVH nodes and shadow rays for the ray cost views (primary GPU only)
+    // Also sum the paths that left the camera hit specularly into their own
+    // buffer, for DenoiseOptions::splitSpecular. Takes the atomic
+    // finalGather, and the primary GPU alone.
+    bool splitSpecular;
+    // End paths at filled cells of a world-space radiance cache (radianceCache.h)
+    // after their first bounces, with NEE only: faster, slightly biased, and
+    // not bit-exact under `deterministic`. Secondary GPUs trace in full.
+    bool radianceCache;
+    // Gather caustics from a photon map (photonMap.h), with NEE only; its
+    // photons are emitted once and reused until the scene changes
+    bool photonCaustics;
+    // Resample Scene::lights for the camera hits through per-pixel
+    // reservoirs (restir.h) reused across launches and neighbours, with
+    // NEE only: one shadow ray per hit, slightly biased. Primary GPU only.
+    bool restir;
+    // Guide diffuse bounces by per-cell histograms of incoming light
+    // (guiding.h) learned over the first launches, with NEE only. Primary
+    // GPU only.
+    bool pathGuiding;
+    // Take the pixel-centre camera rays' hits from the preview's rasterized
+    // ids (see pathtraceSetRasterHits) instead of tracing them. Only without
+    // antialiasing, lens or motion blur, mesh LOD and stereo; split only.
+    bool rasterPrimary;
+    // Test camera rays against per-tile lists of the geoms whose boxes
+    // project over their tile (tileCulling.h) instead of the top-level BVH.
+    // A single view without lens or motion blur; split only.
+    bool tileCulling;
+    // Walk the BVH a warp at a time, on one shared stack, for camera rays and
+    // for next-event estimation's shadow rays, which leave a warp's hits
+    // mostly toward the same light. A warp's rays part to per-ray traversal
+    // once they want too few of the nodes visited. Primary GPU only.
+    bool packetCameraRays;
+    bool packetShadowRays;
+    // Split each camera hit into this many paths, each shaded and traced on
+    // its own and weighed 1 / pathSplit, so one camera ray and G-buffer
+    // write serve several indirect samples; 1 for none. Split pipeline
+    // only, with the atomic gather, and not with `deterministic`.
+    int pathSplit;
+    // Keep the primary's path segments in the compact layout (pathbuffers.h),
+    // 44 bytes a path rather than 72, with directions, colours and cones
+    // quantized. Traces deeper than 63 bounces or images past 2^26 pixels
+    // keep the full layout.
+    bool compactPaths;
+    // Trace bidirectionally (bidirectional.h), for scenes lit mostly through
+    // indirect paths. A single pinhole view lit by Scene::lights only, on the
+    // primary GPU; otherwise the launch is path traced as usual.
+    bool bidirectional;
+    PixelRect region;       // trace only these pixels (primary GPU only), empty for all
+};
+
+void pathtrace(int frame, int iteration, const PathtraceOptions &options);
+/**
+ * Hands over the camera's rasterized hits for PathtraceOptions::rasterPrimary
+ * (see rasterVisibility.h): an array of one int2 per pixel, its geom and,
+ * for meshes, triangle, or -1 where nothing covers the pixel centre, row y
+ * of the array being row y of the image. Copied at once; they stand until
+ * pathtraceReset().
+ */
+void pathtraceSetRasterHits(cudaArray_t hits);
+void pathtraceRetrieveImage();
+void pathtraceRetrieveImage(std::vector<glm::vec3> &out);
+// Curves the display transform maps exposed radiance through
+enum ToneMapper {
+    TONEMAP_CLAMP,          // clip to [0, 1]
+    TONEMAP_REINHARD,       // c / (1 + c) per channel
+    TONEMAP_ACES,           // Narkowicz's fit of the ACES filmic curve
+};
+
+// How the show functions turn linear radiance into display texels
+struct DisplayOptions {
+    float exposure;         // in stops: radiance is scaled by 2^exposure
+    int toneMapper;         // a ToneMapper
+    bool srgb;              // encode with the sRGB OETF instead of writing linear values
+    PixelRect region;       // texels to update, empty for all
+    int eye;                // the view of a stereo pair shown, 0 for the left
+    bool temporalAA;        // showDenoisedImage resolves against the frames it showed before
+    float taaBlend;         // the new frame's weight in that resolve, in [0, 1]
+};
+
+// G-buffer channels showGBuffer() can display
+enum GBufferView {
+    GBUFFER_DEPTH,          // first-hit distance, near bright
+    GBUFFER_NORMAL,         // world-space normal mapped to [0, 1]
+    GBUFFER_POSITION,       // world-space position within the scene bounds
+    GBUFFER_ALBEDO,
+    // Heatmaps of each pixel's RayCost, while PathtraceOptions::rayCost counts them
+    GBUFFER_BOUNCES,
+    GBUFFER_BVH_NODES,
+    GBUFFER_SHADOW_RAYS,
+};
+
+void showGBuffer(cudaSurfaceObject_t display, int view);
+void showImage(cudaSurfaceObject_t display, int iter, const DisplayOptions &options);
+// 5-tap kernels the A-Trous levels can dilate
+enum AtrousKernel {
+    ATROUS_B3_SPLINE,
+    ATROUS_GAUSSIAN,
+};
+
+// What filters the image in denoise()
+enum DenoiseBackend {
+    DENOISE_ATROUS,         // the A-Trous filter of denoiser/
+    DENOISE_OPTIX,          // the OptiX AI denoiser, see OptixBackend::denoise
+    DENOISE_GUIDED,         // denoiser/'s guided filter, see DenoiserMethod
+    DENOISE_BILATERAL_GRID, // denoiser/'s bilateral grid
+    DENOISE_KERNEL_PREDICTING,  // denoiser/'s kernel-predicting network
+};
+
+// Denoiser settings driven by the control panel. The OptiX backend takes
+// only `temporal`; without it in the build it falls back to A-Trous, as
+// the kernel-predicting one does without network weights.
+struct DenoiseOptions {
+    int backend;            // a DenoiseBackend
+    int filterSize;         // filter footprint in pixels
+    int kernel;             // an AtrousKernel
+    float colorWeight;      // edge-stopping standard deviations, see denoise()
+    float normalWeight;     // 0 disables the normal term
+    float positionWeight;   // 0 disables the position term
+    bool temporal;          // reproject history across camera moves
+    bool varianceGuided;    // colorWeight counts per-pixel standard deviations
+    bool separable;         // horizontal + vertical passes per level
+    bool halfPrecision;     // FP16 storage for the filter's colour buffers
+    bool pyramid;           // later levels at half resolution, upsampled
+    bool demodulateAlbedo;  // filter lighting / albedo, remodulate after
+    float earlyOutThreshold;  // stop once a level changes luminance by less than this fraction; 0 runs all
+    float tileConvergence;  // leave tiles unfiltered once their pixels' standard error is below this fraction; 0 filters all
+    PixelRect region;       // filter only these pixels, reading a footprint's halo around them (A-Trous only)
+    // Filter the diffuse and specular parts of the image apart, each guided
+    // by its own G-buffer, and add them after: A-Trous only, without
+    // temporal reprojection or a region, and only while every sample since
+    // the restart was traced with PathtraceOptions::splitSpecular
+    bool splitSpecular;
+    int specularFilterSize;     // the specular part's footprint, usually narrower
+    float specularColorWeight;  // its colour term, never variance guided
+};
+
+// Bounces that get their own timers and path counts in PathtraceStats
+#define STATS_MAX_DEPTH 16
+
+/**
+ * GPU time of each stage of the frame, in ms, as a rolling average over
+ * recent frames, and the paths alive at the start of each bounce of the
+ * last iteration. Per-bounce entries past STATS_MAX_DEPTH are not kept.
+ * With tileRows set, the bounce timers and counts cover the last band.
+ * raysTraced counts the last iteration's path rays in every band and
+ * bounce, as intersected on the primary GPU; the megakernel, graph and
+ * persistent pipelines do not count theirs, nor their path buffer bytes.
+ */
+struct PathtraceStats {
+    float generateRaysMs;
+    float intersectMs[STATS_MAX_DEPTH];     // computeIntersections / extend
+    float shadeMs[STATS_MAX_DEPTH];
+    float sortRaysMs[STATS_MAX_DEPTH];      // 0 where rays were not sorted
+    float compactMs[STATS_MAX_DEPTH];       // flagging and partitioning live paths
+    float megakernelMs;                     // all bounces, megakernel, graph, persistent and cooperative only
+    float finalGatherMs;
+    float denoiseMs;
+    int denoiseLevels;                      // A-Trous levels of the last denoise, 0 from OptiX
+    float denoiseTiles;                     // fraction of the tiles those levels ran over, see tileConvergence
+    float displayMs;                        // sendImageToDisplay and friends
+    int pathCounts[STATS_MAX_DEPTH];
+    int depths;                             // bounces of the last iteration
+    long long raysTraced;
+    long long pathBytes;                    // path segment traffic of those bounces, see recordPathCount
+    DeviceMemoryUsage memory;               // the renderer's buffers on the primary device
+};
+
+void denoise(int iter, const DenoiseOptions &options);
+
+/**
+ * Batched denoising, for renders of many small images such as a dataset's.
+ * pathtraceQueueDenoise copies the accumulation after `iter` samples, its
+ * G-buffer and moments into the next of `capacity` slots, with the scene's
+ * camera; false, with nothing queued, for stereo scenes, a full queue or a
+ * resolution other than the queued images'. pathtraceDenoiseBatch then
+ * filters every queued image with A-Trous in one set of launches, whatever
+ * options.backend is, fills `out` with them normalized, in queue order, and
+ * empties the queue. Returns how many it filtered.
+ */
+bool pathtraceQueueDenoise(int iter, int capacity);
+int pathtraceDenoiseBatch(const DenoiseOptions &options, std::vector<std::vector<glm::vec3>> &out);
+void pathtraceRetrieveDenoised(std::vector<glm::vec3> &out);
+void pathtraceRetrieveGBuffer(std::vector<GBufferPixel> &out);
+void pathtraceRetrieveMoments(std::vector<glm::vec2> &out);
+/**
+ * Copies the raw accumulation (float4 sums per pixel) and the G-buffer to
+ * host memory and waits for the copies. Memory that is pinned or
+ * registered with cudaHostRegister receives them by DMA, with no staging.
+ */
+void pathtraceCopyRaw(void *image, void *gBuffer);
+void pathtraceLoadAccumulation(int samples, const std::vector<glm::vec3> &image,
+        const std::vector<glm::vec2> &moments, const std::vector<GBufferPixel> &gBuffer);
+void pathtraceRetrievePacked(std::vector<unsigned char> &out);
+bool pathtraceMergeAccumulation(const accumulationFile::Accumulation &part, bool first);
+void pathtraceBeginReadback(int iter, bool denoised);
+
+// The renderer's results in place on the primary device, for zero-copy
+// consumers such as src/pathtracerApi.h. Valid until the next pathtrace(),
+// denoise(), pathtraceReset() or pathtraceFree().
+struct PathtraceDeviceBuffers {
+    const float4 *image;            // RGBA sums over the accumulated samples
+    const glm::vec2 *moments;       // luminance and squared luminance sums
+    const GBufferPixel *gBuffer;    // first hits, see gbuffer.h
+    const float4 *denoised;         // last denoise() result, normalized; NULL before one
+};
+PathtraceDeviceBuffers pathtraceDeviceBuffers();
+
+/**
+ * Estimates for stopping a render once it is good enough, reduced on the
+ * primary device so only a float is read back. pathtraceRelativeError is
+ * the RMS over pixels of the relative standard error of each pixel's mean
+ * luminance, from the moments of its `samples` samples. A denoised image
+ * has no such estimate, so pathtraceDenoisedChange gives the RMS relative
+ * change of the last denoise() result since the one it last saw, or -1
+ * for the first since a reset. Between results of N and 2N samples that
+ * change estimates the 2N result's error, as the second half's samples
+ * are independent of the first's.
+ */
+float pathtraceRelativeError(int samples);
+float pathtraceDenoisedChange();
+void pathtraceFinishReadback(std::vector<glm::vec3> &out);
+void pathtraceBeginCheckpoint(int samples);
+bool pathtraceCheckpointReady();
+int pathtraceFinishCheckpoint(std::vector<unsigned char> &packed, std::vector<GBufferPixel> &gBuffer);
+void showDenoisedImage(cudaSurfaceObject_t display, const DisplayOptions &options);
+cudaStream_t pathtraceDisplayStream();
+void pathtraceEnableTiming(bool enabled, bool smoothed = true);
+
+/**
+ * Rays traced, as counted on the devices while telemetry is on: path rays
+ * by bounce, after compaction (bounce 0 being the camera rays), and
+ * next-event estimation's shadow rays. The shading kernels count them
+ * with one atomic per warp. The persistent pipeline adds its load balance:
+ * the path bounces each of its warps traced, summed over its launches.
+ */
+struct RayTelemetry {
+    long long pathRays[TELEMETRY_BOUNCES];  // the last entry also holds deeper bounces
+    long long shadowRays;
+    long long queueLaunches;
+    long long queueWarps;                   // over every launch
+    long long queueWarpMin;                 // each launch's least loaded warp
+    long long queueWarpMax;                 // and its most loaded one
+    long long queueBounces;                 // over every warp
+};
+
+void pathtraceEnableTelemetry(bool enabled);
+
+// Adds the counts since the last read, over every device, to `out` and
+// clears them. Waits for all queued work.
+void pathtraceReadTelemetry(RayTelemetry &out);
+
+// A kernel's block size and the share of an SM's threads resident at it
+struct KernelLaunch {
+    int blockSize;
+    float occupancy;
+};
+
+/**
+ * How the heavy path tracing kernels are launched. Block sizes come from the
+ * occupancy calculator for the primary device each time a scene is bound,
+ * as its shared memory staging changes what fits; the other devices launch
+ * with the same sizes. The light per-path and per-pixel kernels keep 128
+ * threads and 8x8 tiles.
+ */
+struct LaunchConfiguration {
+    char device[256];
+    int computeCapability;      // major * 10 + minor
+    int multiprocessors;
+    bool cooperativeLaunch;     // whether PIPELINE_COOPERATIVE can run, or falls back to split
+    KernelLaunch intersect;     // computeIntersections
+    KernelLaunch hitRecords;    // computeHitRecords
+    KernelLaunch shade;         // shadeSimpleMaterials
+    KernelLaunch megakernel;
+    size_t l2PersistingBytes;   // L2 set aside for the scene's hot arrays, 0 without persistence
+    size_t l2WindowBytes;       // the access policy window over them
+};
+
+const LaunchConfiguration &pathtraceLaunchConfiguration();
+
+// Launches computeIntersections and computeHitRecords, and
+// shadeSimpleMaterials, with these block sizes (at most 256) instead of the
+// calculator's; 0 goes back to the calculator. Holds across scenes.
+void pathtraceOverrideBlockSizes(int intersect, int shade);
+const PathtraceStats &pathtraceStats();
+
+/**
+ * Writes the kernel inputs of bounce `depth` of the next split-pipeline
+ * launch that reaches it to `file`: the scene arrays, the camera, the
+ * path segments, the intersections and the G-buffer, for
+ * pathtraceReplay. One bounce is captured per call.
+ */
+void pathtraceCaptureBounce(const std::string &file, int depth);
+
+// A captured bounce's kernels as pathtraceReplay timed them
+struct ReplayResult {
+    glm::ivec2 resolution;      // the captured camera's
+    int depth;                  // the captured bounce
+    int paths;
+    int geoms;
+    bool hitRecords;            // the intersection kernel is computeHitRecords
+    std::vector<double> intersectMs;    // per timed run, empty if not replayed
+    std::vector<double> shadeMs;
+    int mismatches;             // replayed hits that differ from the captured ones
+};
+
+// Times a capture's intersection and shading kernels in isolation, without
+// a scene loaded, and leaves pathtraceLaunchConfiguration() describing
+// their launches; see pathtrace.cu. False with `error` set if `file` is
+// not a capture of this build.
+bool pathtraceReplay(const std::string &file, const std::string &kernel, int warmup, int repetitions,
+        ReplayResult &result, std::string &error);
+
+// The kernels' per-path steps as host functions over host copies of the
+// scene, for the CPU renderer (cpuRenderer.h). `lights` also carries the
+// buffers intersection walks; y is a row of the stacked image.
+void hostCameraSample(const Camera &cam, float eyeSeparation, int traceDepth, int x, int y,
+        bool jitter, int sampler, PathSegment &segment);
+ShadeableIntersection hostIntersect(const Ray &ray, const LightData &lights, const Material *materials,
+        GBufferPixel *gBufferPixel);
+void hostShade(const ShadeableIntersection &intersection, PathSegment &segment, const Material *materials,
+        int rouletteBounces, int sampler, const LightData &lights);
+// The scalar tests cpuSimd's packet ones are checked against
+float hostBoxIntersectionTest(const DeviceGeom &box, const Ray &ray);
+float hostSphereIntersectionTest(const DeviceGeom &sphere, const Ray &ray);
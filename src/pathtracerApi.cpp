@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "pathtracerApi.h"
+#include "benchmark.h"
+#include "pathtrace.h"
+#include "scene.h"
+
+// Scene has no destructor definition, so like main() this never frees one
+static Scene *scene = NULL;
+static int accumulated = 0;
+
+int ptLoadScene(const char *sceneFile) {
+    ptShutdown();
+    // Scene's constructor aborts the process on an unreadable file
+    FILE *file = fopen(sceneFile, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+    fclose(file);
+    scene = new Scene(sceneFile);
+    pathtraceInit(scene);
+    pathtraceReset();
+    accumulated = 0;
+    return 0;
+}
+
+void ptShutdown(void) {
+    if (scene != NULL) {
+        pathtraceFree();
+        scene = NULL;
+    }
+}
+
+void ptSceneSettings(int *iterations, int *traceDepth) {
+    if (scene != NULL) {
+        *iterations = scene->state.iterations;
+        *traceDepth = scene->state.traceDepth;
+    }
+}
+
+void ptSetCamera(const float position[3], const float lookAt[3], const float up[3]) {
+    if (scene == NULL) {
+        return;
+    }
+    scene->setCamera(glm::vec3(position[0], position[1], position[2]),
+        glm::vec3(lookAt[0], lookAt[1], lookAt[2]), glm::vec3(up[0], up[1], up[2]));
+    ptReset();
+}
+
+void ptReset(void) {
+    if (scene != NULL) {
+        pathtraceReset();
+        accumulated = 0;
+    }
+}
+
+int ptTrace(int samples, const PtTraceSettings *settings) {
+    if (scene == NULL) {
+        return 0;
+    }
+    PathtraceOptions options = benchmarkPathtraceOptions(settings->hardwareRT != 0);
+    options.nextEventEstimation = settings->nextEventEstimation != 0;
+    options.russianRoulette = settings->russianRoulette != 0;
+    options.antialias = settings->antialias != 0;
+    options.deterministic = settings->deterministic != 0;
+    const int perLaunch = std::min(std::max(settings->samplesPerLaunch, 1), MAX_SAMPLES_PER_LAUNCH);
+    for (int target = accumulated + samples; accumulated < target; ) {
+        options.samplesPerLaunch = std::min(perLaunch, target - accumulated);
+        accumulated += options.samplesPerLaunch;
+        pathtrace(0, accumulated, options);
+    }
+    return accumulated;
+}
+
+void ptDenoise(int backend, const DenoiserSettings *settings) {
+    if (scene == NULL || accumulated == 0) {
+        return;
+    }
+    DenoiseOptions options;
+    options.backend = backend;
+    options.filterSize = settings->filterSize;
+    options.kernel = settings->kernel == DENOISER_GAUSSIAN ? ATROUS_GAUSSIAN : ATROUS_B3_SPLINE;
+    options.colorWeight = settings->colorWeight;
+    options.normalWeight = settings->normalWeight;
+    options.positionWeight = settings->positionWeight;
+    options.temporal = false;
+    options.varianceGuided = settings->varianceGuided != 0;
+    options.separable = settings->separable != 0;
+    options.halfPrecision = settings->halfPrecision != 0;
+    options.pyramid = settings->pyramid != 0;
+    options.demodulateAlbedo = settings->demodulateAlbedo != 0;
+    options.earlyOutThreshold = settings->convergence;
+    options.tileConvergence = settings->tileConvergence;
+    options.splitSpecular = false;
+    options.specularFilterSize = settings->filterSize;
+    options.specularColorWeight = settings->colorWeight;
+    options.region = PixelRect();
+    denoise(accumulated, options);
+}
+
+void ptDeviceBuffers(PtDeviceBuffers *out) {
+    *out = PtDeviceBuffers();
+    if (scene == NULL) {
+        return;
+    }
+    const PathtraceDeviceBuffers buffers = pathtraceDeviceBuffers();
+    out->width = scene->state.camera.resolution.x;
+    out->height = scene->state.camera.resolution.y * scene->state.viewCount();
+    out->samples = accumulated;
+    out->image = buffers.image;
+    out->moments = buffers.moments;
+    out->gBuffer = buffers.gBuffer;
+    out->denoised = buffers.denoised;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "../denoiser/denoiser.h"
+
+/**
+ * C interface of the renderer for in-process batch use, built as the
+ * `pathtracer` shared library (cmake -DBUILD_PYTHON_BINDINGS=ON) that
+ * python/pathtracer.py loads. One scene is resident at a time: its BVH,
+ * textures and device buffers stay up across ptReset() and ptSetCamera(),
+ * so many renders of one scene pay for loading once.
+ *
+ * Results stay in device memory; ptDeviceBuffers() hands out the
+ * renderer's own pointers for zero-copy consumers. Every call runs on the
+ * calling thread's current device and returns once its work is queued,
+ * except ptDeviceBuffers(), which waits for it.
+ */
+
+#ifdef _WIN32
+#define PT_API __declspec(dllexport)
+#else
+#define PT_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The settings ptTrace() varies; the rest are the benchmark's
+typedef struct PtTraceSettings {
+    int samplesPerLaunch;       // 1 to MAX_SAMPLES_PER_LAUNCH
+    int hardwareRT;             // OptiX intersection where available
+    int nextEventEstimation;
+    int russianRoulette;
+    int antialias;
+    int deterministic;          // samples added in a fixed order, reruns match bit for bit
+} PtTraceSettings;
+
+typedef struct PtDeviceBuffers {
+    int width;
+    int height;                 // of every view, a STEREO pair stacked left over right
+    int samples;                // accumulated in `image` and `moments`
+    const void *image;          // float4 sums per pixel
+    const void *moments;        // float2 sums of luminance and its square
+    const void *gBuffer;        // 16-byte GBufferPixel per pixel (src/gbuffer.h)
+    const void *denoised;       // normalized float4 per pixel, or NULL
+} PtDeviceBuffers;
+
+// Loads a scene file and sets the renderer up for it; 0 on success
+PT_API int ptLoadScene(const char *sceneFile);
+
+// Frees the renderer's device state
+PT_API void ptShutdown(void);
+
+// The scene's ITERATIONS and DEPTH
+PT_API void ptSceneSettings(int *iterations, int *traceDepth);
+
+// Moves the camera, keeping its field of view, and clears the accumulation
+PT_API void ptSetCamera(const float position[3], const float lookAt[3], const float up[3]);
+
+// Clears the accumulation
+PT_API void ptReset(void);
+
+// Traces `samples` more samples per pixel; returns the accumulated total
+PT_API int ptTrace(int samples, const PtTraceSettings *settings);
+
+// Denoises the accumulation with a DenoiseBackend (0 A-Trous, 1 OptiX, 2 guided
+// filter, 3 bilateral grid); settings->method is taken from it
+PT_API void ptDenoise(int backend, const DenoiserSettings *settings);
+
+PT_API void ptDeviceBuffers(PtDeviceBuffers *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "intersections.h"
+
+/**
+ * The caustic photon map of PathtraceOptions::photonCaustics. Photons
+ * leave Scene::lights, follow specular bounces only, and are stored at
+ * every surface with a diffuse lobe they reach after at least one. The
+ * stored photons are sorted into the buckets of a hashed grid of cells
+ * twice the gather radius wide, so a gather reads the 2x2x2 cells around
+ * its point. Shading then gathers them at diffuse vertices instead of
+ * counting emitters found through specular bounces off a diffuse vertex,
+ * which are exactly the light paths the photons carry.
+ */
+
+// Photons emitted per build, and the most that are stored
+#define PHOTON_COUNT (1 << 19)
+// Buckets of the hashed grid, 2^PHOTON_GRID_BITS
+#define PHOTON_GRID_BITS 20
+// Gather radii along the diagonal of the scene's bounds
+#define PHOTON_RADIUS_RESOLUTION 256
+// Photons further than this fraction of the radius off the tangent plane
+// belong to another surface
+#define PHOTON_DISC_THICKNESS 0.25f
+#define PHOTON_EMPTY_BUCKET 0xffffffffu
+
+__host__ __device__ inline unsigned int photonBucket(const PhotonGrid &grid, glm::ivec3 cell) {
+    return utilhash((unsigned int)cell.x ^ utilhash((unsigned int)cell.y ^ utilhash((unsigned int)cell.z)))
+        & grid.mask;
+}
+
+// The bucket of the cell holding `p`
+__host__ __device__ inline unsigned int photonBucket(const PhotonGrid &grid, glm::vec3 p) {
+    return photonBucket(grid, glm::ivec3(glm::floor(p / (2.0f * grid.radius))));
+}
+
+/**
+ * Irradiance at `p` from the photons within the gather radius, on a disc
+ * about the plane of `normal`. Cells whose buckets collide are read once.
+ */
+__host__ __device__ inline glm::vec3 gatherPhotons(const PhotonGrid &grid, glm::vec3 p, glm::vec3 normal) {
+    const glm::ivec3 base = glm::ivec3(glm::floor(p / (2.0f * grid.radius) - 0.5f));
+    const float radius2 = grid.radius * grid.radius;
+    unsigned int read[8];
+    glm::vec3 power(0.0f);
+    for (int c = 0; c < 8; c++) {
+        unsigned int bucket = photonBucket(grid, base + glm::ivec3(c & 1, (c >> 1) & 1, c >> 2));
+        bool seen = false;
+        for (int k = 0; k < c; k++) {
+            seen = seen || read[k] == bucket;
+        }
+        read[c] = bucket;
+        unsigned int begin = grid.cellStart[bucket];
+        if (seen || begin == PHOTON_EMPTY_BUCKET) {
+            continue;
+        }
+        for (unsigned int i = begin; i < grid.cellEnd[bucket]; i++) {
+            float4 position = grid.positions[i];
+            glm::vec3 d = glm::vec3(position.x, position.y, position.z) - p;
+            if (glm::dot(d, d) < radius2 && fabsf(glm::dot(d, normal)) < PHOTON_DISC_THICKNESS * grid.radius) {
+                float4 photon = grid.power[i];
+                power += glm::vec3(photon.x, photon.y, photon.z);
+            }
+        }
+    }
+    return power / (PI * radius2);
+}
@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cuda_runtime.h>
+
+#include "powerMonitor.h"
+
+#ifdef ENABLE_NVML
+#include <nvml.h>
+#endif
+
+using powerMonitor::Efficiency;
+
+// The Stats pane's window, opened by the first traced() and rolled over every POWER_WINDOW_SECONDS
+static bool windowOpen = false;
+static std::chrono::steady_clock::time_point windowStart;
+static double windowJoules = 0.0;
+static long long windowSamples = 0;
+static long long windowRays = 0;
+static Efficiency lastEfficiency = {};
+
+#ifdef ENABLE_NVML
+
+struct PowerDevice {
+    nvmlDevice_t handle;
+    bool energyCounter;             // the driver counts the energy itself
+    unsigned long long startEnergy; // its counter at start(), in mJ
+    double integrated;              // J of sampled power, without the counter
+    double watts;                   // the latest sample
+    double limitWatts;
+    int utilization;                // percent, from the latest sample
+};
+
+static std::vector<PowerDevice> powerDevices;
+static std::mutex powerMutex;
+static std::thread sampler;
+static std::atomic<bool> sampling(false);
+static bool started = false;    // start() is only tried once
+
+// The sampling thread: power draw every POWER_SAMPLE_MS, integrated by the trapezoid rule
+static void samplePower() {
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+    while (sampling) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(POWER_SAMPLE_MS));
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        const double seconds = std::chrono::duration<double>(now - last).count();
+        last = now;
+        std::lock_guard<std::mutex> lock(powerMutex);
+        for (size_t i = 0; i < powerDevices.size(); i++) {
+            PowerDevice &device = powerDevices[i];
+            unsigned int milliwatts = 0;
+            if (nvmlDeviceGetPowerUsage(device.handle, &milliwatts) == NVML_SUCCESS) {
+                const double watts = milliwatts * 1e-3;
+                device.integrated += 0.5 * (device.watts + watts) * seconds;
+                device.watts = watts;
+            }
+            nvmlUtilization_t rates;
+            if (nvmlDeviceGetUtilizationRates(device.handle, &rates) == NVML_SUCCESS) {
+                device.utilization = (int)rates.gpu;
+            }
+        }
+    }
+}
+
+bool powerMonitor::start(const std::vector<int> &devices) {
+    if (started) {
+        return sampling;
+    }
+    started = true;
+    if (nvmlInit_v2() != NVML_SUCCESS) {
+        printf("NVML is not available; GPU power is not measured\n");
+        return false;
+    }
+    for (size_t i = 0; i < devices.size(); i++) {
+        // NVML numbers devices its own way; the PCI bus id is common to both
+        char busId[32];
+        nvmlDevice_t handle;
+        if (cudaDeviceGetPCIBusId(busId, sizeof(busId), devices[i]) != cudaSuccess
+                || nvmlDeviceGetHandleByPciBusId_v2(busId, &handle) != NVML_SUCCESS) {
+            continue;
+        }
+        PowerDevice device = {};
+        device.handle = handle;
+        device.energyCounter = nvmlDeviceGetTotalEnergyConsumption(handle, &device.startEnergy) == NVML_SUCCESS;
+        unsigned int milliwatts = 0;
+        if (nvmlDeviceGetPowerUsage(handle, &milliwatts) == NVML_SUCCESS) {
+            device.watts = milliwatts * 1e-3;
+        }
+        if (nvmlDeviceGetEnforcedPowerLimit(handle, &milliwatts) == NVML_SUCCESS) {
+            device.limitWatts = milliwatts * 1e-3;
+        }
+        powerDevices.push_back(device);
+    }
+    if (powerDevices.empty()) {
+        nvmlShutdown();
+        return false;
+    }
+    windowOpen = false;
+    lastEfficiency = Efficiency();
+    sampling = true;
+    sampler = std::thread(samplePower);
+    // A thread still joinable when its static is destroyed would abort the process
+    atexit(powerMonitor::stop);
+    return true;
+}
+
+void powerMonitor::stop() {
+    if (!sampling) {
+        return;
+    }
+    sampling = false;
+    sampler.join();
+    powerDevices.clear();
+    nvmlShutdown();
+}
+
+bool powerMonitor::available() {
+    return sampling;
+}
+
+double powerMonitor::joules() {
+    std::lock_guard<std::mutex> lock(powerMutex);
+    double joules = 0.0;
+    for (size_t i = 0; i < powerDevices.size(); i++) {
+        const PowerDevice &device = powerDevices[i];
+        unsigned long long millijoules = 0;
+        if (device.energyCounter && nvmlDeviceGetTotalEnergyConsumption(device.handle, &millijoules) == NVML_SUCCESS) {
+            joules += (millijoules - device.startEnergy) * 1e-3;
+        } else {
+            joules += device.integrated;
+        }
+    }
+    return joules;
+}
+
+double powerMonitor::watts() {
+    std::lock_guard<std::mutex> lock(powerMutex);
+    double watts = 0.0;
+    for (size_t i = 0; i < powerDevices.size(); i++) {
+        watts += powerDevices[i].watts;
+    }
+    return watts;
+}
+
+double powerMonitor::limitWatts() {
+    std::lock_guard<std::mutex> lock(powerMutex);
+    double watts = 0.0;
+    for (size_t i = 0; i < powerDevices.size(); i++) {
+        watts += powerDevices[i].limitWatts;
+    }
+    return watts;
+}
+
+int powerMonitor::utilization() {
+    std::lock_guard<std::mutex> lock(powerMutex);
+    int busiest = -1;
+    for (size_t i = 0; i < powerDevices.size(); i++) {
+        busiest = std::max(busiest, powerDevices[i].utilization);
+    }
+    return busiest;
+}
+
+#else
+
+bool powerMonitor::start(const std::vector<int> &devices) {
+    return false;
+}
+
+void powerMonitor::stop() {
+}
+
+bool powerMonitor::available() {
+    return false;
+}
+
+double powerMonitor::joules() {
+    return 0.0;
+}
+
+double powerMonitor::watts() {
+    return 0.0;
+}
+
+double powerMonitor::limitWatts() {
+    return 0.0;
+}
+
+int powerMonitor::utilization() {
+    return -1;
+}
+
+#endif
+
+void powerMonitor::traced(int samples, long long pathRays) {
+    if (!available()) {
+        return;
+    }
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (!windowOpen) {
+        // This launch ran before the window, so it is not counted
+        windowOpen = true;
+        windowStart = now;
+        windowJoules = joules();
+        windowSamples = 0;
+        windowRays = 0;
+        return;
+    }
+    windowSamples += samples;
+    windowRays += pathRays;
+    const double seconds = std::chrono::duration<double>(now - windowStart).count();
+    if (seconds >= POWER_WINDOW_SECONDS) {
+        const double energy = joules() - windowJoules;
+        lastEfficiency.samplesPerSecond = windowSamples / seconds;
+        lastEfficiency.mraysPerSecond = windowRays / (seconds * 1e6);
+        lastEfficiency.watts = energy / seconds;
+        lastEfficiency.samplesPerJoule = energy > 0.0 ? windowSamples / energy : 0.0;
+        windowStart = now;
+        windowJoules += energy;
+        windowSamples = 0;
+        windowRays = 0;
+    }
+}
+
+Efficiency powerMonitor::efficiency() {
+    return lastEfficiency;
+}
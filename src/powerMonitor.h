@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+
+// How often the sampling thread reads each GPU's power draw
+#define POWER_SAMPLE_MS 50
+// The Stats pane's efficiency figures cover windows of this length
+#define POWER_WINDOW_SECONDS 1.0
+
+/**
+ * GPU power draw through NVML, in builds with ENABLE_NVML, sampled on its
+ * own thread for as long as the renderer runs on the GPUs given to
+ * start(). Energy comes from the driver's energy counter where the GPU has
+ * one (Volta on), and otherwise from integrating the sampled power. The
+ * telemetry reports (telemetry.h) and the Stats pane turn it into samples
+ * per joule next to samples/s and Mrays/s, which with the power limit the
+ * GPU enforced tells which pipeline settings and power cap render most
+ * efficiently on a GPU model.
+ */
+namespace powerMonitor {
+    // Rolling throughput over the last finished POWER_WINDOW_SECONDS window
+    struct Efficiency {
+        double samplesPerSecond;    // samples per pixel traced per second
+        double mraysPerSecond;      // path rays, where the pipeline counts bounces
+        double watts;               // mean draw over the window
+        double samplesPerJoule;
+    };
+
+    // Starts sampling the CUDA devices `devices`, once for the whole run,
+    // which later calls keep to; false without NVML
+    bool start(const std::vector<int> &devices);
+    // At exit, unless called before
+    void stop();
+
+    // Whether sampling runs
+    bool available();
+
+    // Summed over the sampled GPUs: energy drawn since start(), the
+    // latest power draw and the power limits they enforce
+    double joules();
+    double watts();
+    double limitWatts();
+    // Percent of the last sample period some kernel ran, on the busiest
+    // sampled GPU; -1 without NVML
+    int utilization();
+
+    // After each pathtrace() call, with the samples per pixel and path rays it traced
+    void traced(int samples, long long pathRays);
+    Efficiency efficiency();
+}
@@ -2,6 +2,11 @@
 #include <ctime>
 #include "main.h"
 #include "preview.h"
+#include "autotune.h"
+#include "kernelCounters.h"
+#include "powerMonitor.h"
+#include "nvtx.h"
+#include "rasterVisibility.h"
 
 #include "../imgui/imgui.h"
 #include "../imgui/imgui_impl_glfw.h"
@@ -11,8 +16,13 @@
 
 GLuint positionLocation = 0;
 GLuint texcoordsLocation = 1;
-GLuint pbo;
 GLuint displayImage;
+// displayImage registered with CUDA, which writes it through a surface.
+// Mapped on the display stream, so mapping and unmapping never stall the
+// trace, and there is no PBO to copy into the texture afterwards.
+static cudaGraphicsResource *displayResource = NULL;
+static cudaArray_t displayArray = NULL;
+static cudaSurfaceObject_t displaySurface = 0;
 
 GLFWwindow *window;
 
@@ -36,6 +46,35 @@ void initTextures() {
     glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
 }
 
+/**
+ * Maps the display texture on `stream` and returns a surface for the show
+ * functions to write. The surface object is reused for as long as the
+ * mapping keeps handing back the same array.
+ */
+cudaSurfaceObject_t mapDisplaySurface(cudaStream_t stream) {
+    cudaArray_t array = NULL;
+    cudaGraphicsMapResources(1, &displayResource, stream);
+    cudaGraphicsSubResourceGetMappedArray(&array, displayResource, 0, 0);
+    if (array != displayArray) {
+        if (displaySurface != 0) {
+            // The old surface may still be in use by queued display work
+            cudaStreamSynchronize(stream);
+            cudaDestroySurfaceObject(displaySurface);
+        }
+        cudaResourceDesc desc = {};
+        desc.resType = cudaResourceTypeArray;
+        desc.res.array.array = array;
+        cudaCreateSurfaceObject(&displaySurface, &desc);
+        displayArray = array;
+    }
+    return displaySurface;
+}
+
+// Hands the texture back to OpenGL once the work queued on `stream` is done
+void unmapDisplaySurface(cudaStream_t stream) {
+    cudaGraphicsUnmapResources(1, &displayResource, stream);
+}
+
 void initVAO(void) {
     GLfloat vertices[] = {
         -1.0f, -1.0f,
@@ -83,26 +122,22 @@ GLuint initShader() {
     return program;
 }
 
-void deletePBO(GLuint* pbo) {
-    if (pbo) {
-        // unregister this buffer object with CUDA
-        cudaGLUnregisterBufferObject(*pbo);
-
-        glBindBuffer(GL_ARRAY_BUFFER, *pbo);
-        glDeleteBuffers(1, pbo);
-
-        *pbo = (GLuint)NULL;
-    }
-}
-
 void deleteTexture(GLuint* tex) {
     glDeleteTextures(1, tex);
     *tex = (GLuint)NULL;
 }
 
 void cleanupCuda() {
-    if (pbo) {
-        deletePBO(&pbo);
+    rasterVisibility::release();
+    if (displaySurface != 0) {
+        cudaDestroySurfaceObject(displaySurface);
+        displaySurface = 0;
+        displayArray = NULL;
+    }
+    if (displayResource != NULL) {
+        // unregister the texture with CUDA before deleting it
+        cudaGraphicsUnregisterResource(displayResource);
+        displayResource = NULL;
     }
     if (displayImage) {
         deleteTexture(&displayImage);
@@ -110,42 +145,38 @@ void cleanupCuda() {
 }
 
 void initCuda() {
-    cudaGLSetGLDevice(0);
+    // Interop runs on the renderer's primary device. cudaGLSetGLDevice
+    // would fail once the scene loader has already made the context.
+    cudaSetDevice(0);
 
     // Clean up on program exit
     atexit(cleanupCuda);
 }
 
-void initPBO() {
-    // set up vertex data parameter
-    int num_texels = width * height;
-    int num_values = num_texels * 4;
-    int size_tex_data = sizeof(GLubyte) * num_values;
-
-    // Generate a buffer ID called a PBO (Pixel Buffer Object)
-    glGenBuffers(1, &pbo);
-
-    // Make this the current UNPACK buffer (OpenGL is state-based)
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
-
-    // Allocate data for the buffer. 4-channel 8-bit image
-    glBufferData(GL_PIXEL_UNPACK_BUFFER, size_tex_data, NULL, GL_DYNAMIC_COPY);
-    cudaGLRegisterBufferObject(pbo);
-
+void initDisplayResource() {
+    // Registered once; every frame only maps and unmaps it
+    cudaGraphicsGLRegisterImage(&displayResource, displayImage, GL_TEXTURE_2D,
+            cudaGraphicsRegisterFlagsSurfaceLoadStore);
 }
 
 void errorCallback(int error, const char* description) {
     fprintf(stderr, "%s\n", description);
 }
 
-bool init() {
+/**
+ * Creates the window, hidden and not yet at the scene's size, its GL
+ * context and the control panel. Touches neither CUDA nor the scene, so it
+ * can run while another thread loads them.
+ */
+bool initWindow() {
     glfwSetErrorCallback(errorCallback);
 
     if (!glfwInit()) {
         exit(EXIT_FAILURE);
     }
 
-    window = glfwCreateWindow(width, height, "CIS 565 Path Tracer", NULL, NULL);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    window = glfwCreateWindow(640, 480, "CIS 565 Path Tracer", NULL, NULL);
     if (!window) {
         glfwTerminate();
         return false;
@@ -163,9 +194,6 @@ bool init() {
 
     // Initialize other stuff
     initVAO();
-    initTextures();
-    initCuda();
-    initPBO();
     GLuint passthroughProgram = initShader();
 
     glUseProgram(passthroughProgram);
@@ -185,9 +213,162 @@ bool init() {
     return true;
 }
 
+// Sizes the window to the loaded scene, registers its display texture with
+// CUDA and shows it
+void initDisplay() {
+    glfwSetWindowSize(window, width, height);
+    initTextures();
+    initCuda();
+    initDisplayResource();
+    glfwShowWindow(window);
+}
+
 static ImGuiWindowFlags windowFlags= ImGuiWindowFlags_None | ImGuiWindowFlags_NoMove;
 static bool ui_hide = false;
 
+// Rolling GPU times per stage, device memory, live paths per bounce and,
+// with NVML, energy efficiency, beside the panel
+// Launches the Stats pane's kernel counter window measures
+#define KERNEL_COUNTERS_PREVIEW_LAUNCHES 8
+
+static void drawStats(int windowWidth) {
+    const PathtraceStats &stats = pathtraceStats();
+
+    ImGui::SetNextWindowPos(ImVec2((float)windowWidth - 320.0f, 0.0f));
+    ImGui::SetNextWindowSize(ImVec2(320.0f, 0.0f));
+    ImGui::Begin("Stats", 0, windowFlags);
+
+    float traceMs = stats.generateRaysMs + stats.megakernelMs + stats.finalGatherMs;
+    for (int depth = 0; depth < stats.depths && depth < STATS_MAX_DEPTH; depth++) {
+        traceMs += stats.sortRaysMs[depth] + stats.intersectMs[depth] + stats.shadeMs[depth]
+            + stats.compactMs[depth];
+    }
+    ImGui::Text("Generate rays   %7.3f ms", stats.generateRaysMs);
+    if (stats.depths == 0) {
+        ImGui::Text("All bounces     %7.3f ms", stats.megakernelMs);
+    }
+    ImGui::Text("Final gather    %7.3f ms", stats.finalGatherMs);
+    ImGui::Text("Path trace      %7.3f ms", traceMs);
+    ImGui::Text("Denoise         %7.3f ms  %d levels, %3.0f%% of tiles", stats.denoiseMs, stats.denoiseLevels,
+            stats.denoiseTiles * 100.0f);
+    ImGui::Text("Display         %7.3f ms", stats.displayMs);
+
+    ImGui::Separator();
+    const float mib = 1.0f / (1024.0f * 1024.0f);
+    ImGui::Text("Device memory   %7.1f MiB", stats.memory.current * mib);
+    ImGui::Text("Peak            %7.1f MiB", stats.memory.peak * mib);
+    ImGui::Text("Pool reserved   %7.1f MiB", stats.memory.reserved * mib);
+
+    if (stats.depths > 0) {
+        ImGui::Separator();
+        ImGui::Text("Depth     Paths   Ray sort  Intersect     Shade  Mrays/s");
+        for (int depth = 0; depth < stats.depths && depth < STATS_MAX_DEPTH; depth++) {
+            float intersectMs = stats.intersectMs[depth];
+            ImGui::Text("%5d %9d %6.3f ms %7.3f ms %6.3f ms %8.1f", depth, stats.pathCounts[depth],
+                stats.sortRaysMs[depth], intersectMs, stats.shadeMs[depth],
+                intersectMs > 0.0f ? stats.pathCounts[depth] / (intersectMs * 1e3f) : 0.0f);
+        }
+    }
+
+    if (powerMonitor::available()) {
+        const powerMonitor::Efficiency efficiency = powerMonitor::efficiency();
+        ImGui::Separator();
+        ImGui::Text("Samples/s       %7.1f", efficiency.samplesPerSecond);
+        ImGui::Text("Path Mrays/s    %7.1f", efficiency.mraysPerSecond);
+        ImGui::Text("Power           %7.1f W  limit %.0f W", efficiency.watts, powerMonitor::limitWatts());
+        ImGui::Text("Samples/J       %7.3f", efficiency.samplesPerJoule);
+    }
+
+    if (kernelCounters::available()) {
+        ImGui::Separator();
+        if (kernelCounters::collecting()) {
+            ImGui::Text("Collecting kernel counters...");
+        } else if (ImGui::Button("Collect kernel counters")) {
+            kernelCounters::start(KERNEL_COUNTERS_PREVIEW_LAUNCHES);
+        }
+        const std::vector<kernelCounters::KernelReport> &kernels = kernelCounters::report();
+        if (!kernels.empty()) {
+            ImGui::Text("Kernel          ms  occ%% dram%% l2hit%% warp%%  bound");
+            for (size_t i = 0; i < kernels.size(); i++) {
+                const kernelCounters::KernelReport &kernel = kernels[i];
+                ImGui::Text("%-12.12s %6.2f %5.1f %5.1f %6.1f %5.1f  %s", kernel.name.c_str(), kernel.ms,
+                    kernel.occupancy, kernel.dramPercent, kernel.l2HitRate, kernel.warpEfficiency, kernel.bound);
+            }
+        }
+    }
+
+    ImGui::End();
+}
+
+/**
+ * Edits one of the scene's materials in place. Any change is handed to
+ * runCuda through ui_editedMaterial, which copies just what changed to the
+ * GPUs and restarts accumulation.
+ */
+static void drawMaterialEditor() {
+    static int selected = 0;
+    if (!ImGui::CollapsingHeader("Materials") || scene->materials.empty()) {
+        return;
+    }
+    int last = (int)scene->materials.size() - 1;
+    ImGui::SliderInt("Material", &selected, 0, last);
+    selected = std::max(0, std::min(selected, last));
+
+    Material &material = scene->materials[selected];
+    bool changed = false;
+    changed |= ImGui::ColorEdit3("Color", &material.color[0]);
+    changed |= ImGui::ColorEdit3("Specular Color", &material.specular.color[0]);
+    changed |= ImGui::DragFloat("Specular Exponent", &material.specular.exponent, 1.0f, 0.0f, 10000.0f);
+    changed |= ImGui::SliderFloat("Reflective", &material.hasReflective, 0.0f, 1.0f);
+    changed |= ImGui::SliderFloat("Refractive", &material.hasRefractive, 0.0f, 1.0f);
+    changed |= ImGui::DragFloat("Index Of Refraction", &material.indexOfRefraction, 0.01f, 1.0f, 3.0f);
+    changed |= ImGui::DragFloat("Emittance", &material.emittance, 0.1f, 0.0f, 1000.0f);
+    if (changed) {
+        ui_editedMaterial = selected;
+    }
+}
+
+// Moves one of the scene's geoms, handed to runCuda through ui_editedGeom
+static void drawGeomEditor() {
+    static int selected = 0;
+    if (!ImGui::CollapsingHeader("Objects") || scene->geoms.empty()) {
+        return;
+    }
+    int last = (int)scene->geoms.size() - 1;
+    ImGui::SliderInt("Object", &selected, 0, last);
+    selected = std::max(0, std::min(selected, last));
+
+    // Picked by OBJECT id, which Scene::coherentGeomOrder may have moved
+    const int index = scene->objectGeoms[selected];
+    Geom &geom = scene->geoms[index];
+    bool changed = false;
+    changed |= ImGui::DragFloat3("Translation", &geom.translation[0], 0.05f);
+    changed |= ImGui::DragFloat3("Rotation", &geom.rotation[0], 1.0f);
+    changed |= ImGui::DragFloat3("Scale", &geom.scale[0], 0.05f);
+    if (changed) {
+        ui_editedGeom = index;
+    }
+}
+
+/**
+ * Outlines the region of interest, or the one being dragged out, over the
+ * image. The preview mirrors the image horizontally, so pixel column x is
+ * at window column width - 1 - x.
+ */
+static void drawRegion(int windowWidth, int windowHeight) {
+    const bool dragging = ui_regionDrag.width > 0;
+    if (!dragging && !(ui_regionOfInterest && ui_regionRect.width > 0)) {
+        return;
+    }
+    const PixelRect &rect = dragging ? ui_regionDrag : ui_regionRect;
+    const float sx = (float)windowWidth / width;
+    const float sy = (float)windowHeight / height;
+    const ImVec2 min((width - rect.x - rect.width) * sx, rect.y * sy);
+    const ImVec2 max((width - rect.x) * sx, (rect.y + rect.height) * sy);
+    ImGui::GetBackgroundDrawList()->AddRect(min, max,
+        dragging ? IM_COL32(255, 255, 0, 255) : IM_COL32(0, 255, 0, 255));
+}
+
 void drawGui(int windowWidth, int windowHeight) {
     // Dear imgui new frame
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
@@ -213,49 +394,195 @@ void drawGui(int windowWidth, int windowHeight) {
     ImGui::SliderInt("Iterations", &ui_iterations, 1, startupIterations);
 
     ImGui::Checkbox("Denoise", &ui_denoise);
+    ImGui::Combo("Denoiser", &ui_denoiseBackend, "A-Trous\0OptiX AI\0Guided Filter\0Bilateral Grid\0Kernel Predicting\0");
+    ImGui::Checkbox("Temporal Reprojection", &ui_temporal);
+    ImGui::Checkbox("Variance-Guided Color Weight", &ui_varianceGuided);
 
     ImGui::SliderInt("Filter Size", &ui_filterSize, 0, 100);
+    ImGui::Combo("Filter Kernel", &ui_filterKernel, "B3 Spline\0Gaussian\0");
+    ImGui::Checkbox("Separable Filter", &ui_separableFilter);
+    ImGui::Checkbox("FP16 Filter Buffers", &ui_halfPrecisionFilter);
+    ImGui::Checkbox("Half-Res Coarse Levels", &ui_pyramidFilter);
+    ImGui::Checkbox("Demodulate Albedo", &ui_demodulateAlbedo);
+    ImGui::SliderFloat("Level Early-Out", &ui_earlyOutThreshold, 0.0f, 0.05f, "%.4f");
+    ImGui::SliderFloat("Tile Convergence", &ui_tileConvergence, 0.0f, 0.1f, "%.4f");
     ImGui::SliderFloat("Color Weight", &ui_colorWeight, 0.0f, 10.0f);
     ImGui::SliderFloat("Normal Weight", &ui_normalWeight, 0.0f, 10.0f);
     ImGui::SliderFloat("Position Weight", &ui_positionWeight, 0.0f, 10.0f);
+    ImGui::Checkbox("Split Specular", &ui_splitSpecular);
+    ImGui::SliderInt("Specular Filter Size", &ui_specularFilterSize, 0, 100);
+    ImGui::SliderFloat("Specular Color Weight", &ui_specularColorWeight, 0.0f, 10.0f);
 
     ImGui::Separator();
 
     ImGui::Checkbox("Show GBuffer", &ui_showGbuffer);
+    ImGui::Combo("GBuffer Channel", &ui_gbufferView, "Depth\0Normal\0Position\0Albedo\0Bounces\0BVH Nodes\0Shadow Rays\0");
+    ImGui::SliderFloat("Exposure (stops)", &ui_exposure, -8.0f, 8.0f);
+    ImGui::Combo("Tone Mapping", &ui_toneMapper, "Clamp\0Reinhard\0ACES\0");
+    ImGui::Checkbox("sRGB Display", &ui_srgbDisplay);
+    ImGui::Checkbox("Temporal AA", &ui_temporalAA);
+    ImGui::SliderFloat("TAA Blend", &ui_taaBlend, 0.02f, 1.0f);
+    if (scene->state.viewCount() > 1) {
+        ImGui::Combo("Stereo Eye", &ui_stereoEye, "Left\0Right\0");
+    }
 
     ImGui::Separator();
 
+    ImGui::Checkbox("Sort By Material", &ui_sortByMaterial);
+    ImGui::Checkbox("Sort Rays", &ui_sortRays);
+    ImGui::Checkbox("Specialized Shading", &ui_specializedShading);
+    ImGui::Checkbox("Tiled Path Order", &ui_tiledPathOrder);
+    ImGui::Checkbox("Cache First Bounce", &ui_cacheFirstBounce);
+    ImGui::Combo("Pipeline", &ui_pipeline, "Split\0Wavefront\0Megakernel\0Graph\0Persistent\0Cooperative\0");
+    if (autotune::tuning()) {
+        ImGui::Text("Autotuning: launches try other pipeline settings");
+    }
+    ImGui::Checkbox("Russian Roulette", &ui_russianRoulette);
+    ImGui::SliderInt("Roulette Min Depth", &ui_rouletteMinDepth, 1, 16);
+    ImGui::SliderInt("Samples Per Launch", &ui_samplesPerLaunch, 1, MAX_SAMPLES_PER_LAUNCH);
+    ImGui::Combo("Final Gather", &ui_gather, "Atomic\0Segmented\0");
+    ImGui::Checkbox("Accumulate On Termination", &ui_accumulateOnTermination);
+    ImGui::Checkbox("Regenerate Paths", &ui_regeneratePaths);
+    ImGui::Checkbox("Compact Hit Records", &ui_hitRecords);
+    ImGui::Checkbox("Deterministic Accumulation", &ui_deterministic);
+    ImGui::Checkbox("Radiance Cache", &ui_radianceCache);
+    ImGui::Checkbox("Photon Caustics", &ui_photonCaustics);
+    ImGui::Checkbox("ReSTIR Direct Light", &ui_restir);
+    ImGui::Checkbox("Path Guiding", &ui_pathGuiding);
+    ImGui::Checkbox("Bidirectional", &ui_bidirectional);
+    ImGui::Checkbox("Raster Primary Visibility", &ui_rasterPrimary);
+    ImGui::Checkbox("Tile Culled Camera Rays", &ui_tileCulling);
+    ImGui::Checkbox("Packet Camera Rays", &ui_packetCameraRays);
+    ImGui::Checkbox("Packet Shadow Rays", &ui_packetShadowRays);
+    ImGui::SliderInt("Path Split", &ui_pathSplit, 1, MAX_PATH_SPLIT);
+    ImGui::Checkbox("Compact Path Buffers", &ui_compactPaths);
+    ImGui::SliderInt("Launches Per Display", &ui_launchesPerDisplay, 1, 32);
+    ImGui::Checkbox("Sync-Free Batch", &ui_syncFreeBatch);
+    ImGui::Checkbox("Frame Budget", &ui_frameBudget);
+    ImGui::SliderFloat("Frame Budget (ms)", &ui_frameBudgetMs, 4.0f, 100.0f);
+    ImGui::Checkbox("Pause When Hidden", &ui_pauseWhenHidden);
+    ImGui::Checkbox("Power Cap", &ui_powerCap);
+    ImGui::SliderInt("Power Cap (iterations/s)", &ui_powerCapIterations, 1, 240);
+    ImGui::Checkbox("Interactive Quality Ladder", &ui_interactiveQuality);
+    ImGui::SliderInt("Interactive Stride", &ui_interactiveStride, 1, 8);
+    ImGui::SliderInt("Interactive Depth", &ui_interactiveDepth, 1, 8);
+    ImGui::Combo("Sampler", &ui_sampler, "Random\0Sobol\0");
+    ImGui::Checkbox("Antialias", &ui_antialias);
+    ImGui::Checkbox("Jittered GBuffer", &ui_jitteredGBuffer);
+    ImGui::Checkbox("Light Sampling (NEE)", &ui_nextEventEstimation);
+    ImGui::Checkbox("Wide Mesh BVH", &ui_wideMeshBVH);
+    ImGui::Checkbox("Mesh LOD", &ui_meshLOD);
+    ImGui::Checkbox("Watertight Triangles", &ui_watertight);
+    ImGui::Checkbox("Short-Stack Traversal", &ui_shortStack);
+    ImGui::Checkbox("Light BVH", &ui_lightTree);
+    if (pathtraceHardwareRTAvailable()) {
+        ImGui::Checkbox("Hardware RT (OptiX)", &ui_hardwareRT);
+    }
+    ImGui::SliderInt("Tile Rows (0: off)", &ui_tileRows, 0, height);
+    ImGui::Checkbox("Region Of Interest (shift + drag)", &ui_regionOfInterest);
+    if (ImGui::Button("Clear Region")) {
+        ui_regionOfInterest = false;
+        ui_regionRect = PixelRect();
+    }
+    ImGui::Checkbox("Adaptive Sampling", &ui_adaptiveSampling);
+    ImGui::SliderFloat("Adaptive Threshold", &ui_adaptiveThreshold, 0.001f, 0.2f, "%.3f");
+    ImGui::SliderInt("Adaptive Min Samples", &ui_adaptiveMinSamples, 1, 256);
+
+    ImGui::Separator();
+
+    drawMaterialEditor();
+    drawGeomEditor();
+
+    ImGui::Separator();
+
+    ImGui::Checkbox("Show Stats", &ui_showStats);
+    ImGui::Checkbox("Reload Scene On Change", &ui_reloadScene);
+    if (ImGui::Button("Save EXR AOVs")) {
+        ui_saveAovs = true;
+    }
     if (ImGui::Button("Save image and exit")) {
         ui_saveAndExit = true;
     }
 
     ImGui::End();
 
+    if (ui_showStats && !ui_hide) {
+        drawStats(windowWidth);
+    }
+    drawRegion(windowWidth, windowHeight);
+
     ImGui::Render();
     ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
+// Longest an idle preview sleeps between frames, so scene reloads are still noticed
+#define IDLE_WAIT_SECONDS 0.25
+
+// With ui_pauseWhenHidden, a minimized or unfocused window traces nothing
+static bool previewHidden() {
+    return ui_pauseWhenHidden && (glfwGetWindowAttrib(window, GLFW_ICONIFIED)
+        || !glfwGetWindowAttrib(window, GLFW_FOCUSED));
+}
+
 void mainLoop() {
+    bool busy = true;
+    // Under the power cap, when the iterations traced so far are paid for
+    double resumeTime = 0.0;
+    // Whether swaps stopped waiting for the refresh, for sync-free batches
+    bool swapUnsynced = false;
     while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
-        runCuda();
+        NvtxRange frameRange("frame", iteration);
+        // Once the image is final and nothing changes, frames are only
+        // drawn for input (or the occasional reload check), as while the
+        // window is hidden; the power cap sleeps off each frame's
+        // iterations, though input wakes it at once
+        double wait = busy ? resumeTime - glfwGetTime() : IDLE_WAIT_SECONDS;
+        if (previewHidden()) {
+            wait = IDLE_WAIT_SECONDS;
+        }
+        if (wait > 0.0) {
+            glfwWaitEventsTimeout(wait);
+        } else {
+            glfwPollEvents();
+        }
+        if (previewHidden()) {
+            continue;
+        }
+        const int firstIteration = iteration;
+        busy = runCuda();
+        if (ui_powerCap) {
+            // A restart counts from zero
+            const int traced = iteration >= firstIteration ? iteration - firstIteration : iteration;
+            resumeTime = glfwGetTime() + traced / (double)std::max(ui_powerCapIterations, 1);
+        } else {
+            resumeTime = 0.0;
+        }
 
         string title = "CIS565 Path Tracer | " + utilityCore::convertIntToString(iteration) + " Iterations";
         glfwSetWindowTitle(window, title.c_str());
 
-        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
-        glBindTexture(GL_TEXTURE_2D, displayImage);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-        glClear(GL_COLOR_BUFFER_BIT);
+        {
+            NvtxRange uploadRange("texture upload");
+            glBindTexture(GL_TEXTURE_2D, displayImage);
+            glClear(GL_COLOR_BUFFER_BIT);
 
-        // VAO, shader program, and texture already bound
-        glDrawElements(GL_TRIANGLES, 6,  GL_UNSIGNED_SHORT, 0);
+            // VAO, shader program, and texture already bound
+            glDrawElements(GL_TRIANGLES, 6,  GL_UNSIGNED_SHORT, 0);
+        }
 
         // Draw imgui
-        int display_w, display_h;
-        glfwGetFramebufferSize(window, &display_w, &display_h);
-        drawGui(display_w, display_h);
-
+        {
+            NvtxRange guiRange("gui");
+            int display_w, display_h;
+            glfwGetFramebufferSize(window, &display_w, &display_h);
+            drawGui(display_w, display_h);
+        }
+
+        if (ui_syncFreeBatch != swapUnsynced) {
+            swapUnsynced = ui_syncFreeBatch;
+            glfwSwapInterval(swapUnsynced ? 0 : 1);
+        }
+        NvtxRange swapRange("swap buffers");
         glfwSwapBuffers(window);
     }
     glfwDestroyWindow(window);
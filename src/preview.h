@@ -1,7 +1,9 @@
 #pragma once
 
-extern GLuint pbo;
+cudaSurfaceObject_t mapDisplaySurface(cudaStream_t stream);
+void unmapDisplaySurface(cudaStream_t stream);
 
 std::string currentTimeString();
-bool init();
+bool initWindow();
+void initDisplay();
 void mainLoop();
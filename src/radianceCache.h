@@ -0,0 +1,113 @@
+#pragma once
+
+#include "sceneStructs.h"
+
+/**
+ * The world-space radiance cache of PathtraceOptions::radianceCache: an
+ * open-addressed hash table of RADIANCE_CACHE_CELLS cells, each the mean of
+ * the cosine-distributed radiance arriving at the diffuse vertices inside
+ * it, i.e. irradiance / pi. A Lambertian vertex of albedo a then leaves
+ * with a * that mean, whatever the direction, which is what lets a path
+ * that reaches a filled cell stop there.
+ *
+ * Cells are filled from the paths themselves: a ray scattered off a
+ * diffuse vertex adds what it found to the vertex's cell, in full rather
+ * than MIS-weighted, since the cell stands in for both strategies. An
+ * emitter adds its emission, a miss the environment and a diffuse surface
+ * its albedo times its own cell, so the cells pick up one more bounce of
+ * interreflection each time they turn over. Cells are keyed on position
+ * alone; surfaces meeting at an angle share the cells along their seam.
+ */
+
+// Slots of the table, a power of two
+#define RADIANCE_CACHE_CELLS (1 << 20)
+// Slots tried after a key's own before a lookup gives up
+#define RADIANCE_CACHE_PROBES 8
+// Cell edges along the diagonal of the scene's bounds
+#define RADIANCE_CACHE_RESOLUTION 128
+// Samples a cell needs before paths may end at it
+#define RADIANCE_CACHE_MIN_SAMPLES 16
+// Cells past this many samples are halved once per launch, so that the
+// early, darker estimates of a cell fade out as its neighbours fill in
+#define RADIANCE_CACHE_MAX_SAMPLES 1024
+// Bounces traced in full before a path may end at a cell
+#define RADIANCE_CACHE_FIRST_BOUNCE 2
+
+__host__ __device__ inline unsigned int radianceCacheHash(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+// The key of the cell holding `p`, never 0
+__host__ __device__ inline unsigned int radianceCacheKey(const RadianceCache &cache, glm::vec3 p) {
+    glm::ivec3 c = glm::ivec3(glm::floor(p / cache.cellSize));
+    unsigned int key = radianceCacheHash((unsigned int)c.x
+        ^ radianceCacheHash((unsigned int)c.y ^ radianceCacheHash((unsigned int)c.z)));
+    return key != 0 ? key : 1;
+}
+
+/**
+ * The slot of `key`, or -1 if it has none. With `insert`, an empty slot on
+ * the way is claimed for it; only the device inserts.
+ */
+__host__ __device__ inline int radianceCacheSlot(const RadianceCache &cache, unsigned int key, bool insert) {
+    for (int probe = 0; probe < RADIANCE_CACHE_PROBES; probe++) {
+        unsigned int slot = (key + probe) & cache.mask;
+        unsigned int found = cache.keys[slot];
+#ifdef __CUDA_ARCH__
+        if (found == 0 && insert) {
+            found = atomicCAS(&cache.keys[slot], 0u, key);
+            if (found == 0) {
+                return (int)slot;
+            }
+        }
+#endif
+        if (found == key) {
+            return (int)slot;
+        }
+        if (found == 0) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * The mean incoming radiance of the cell holding `p`, black for a cell
+ * with no samples yet. `samples` is set to the cell's sample count.
+ */
+__host__ __device__ inline glm::vec3 radianceCacheLookup(const RadianceCache &cache, glm::vec3 p, float &samples) {
+    samples = 0.0f;
+    int slot = radianceCacheSlot(cache, radianceCacheKey(cache, p), false);
+    if (slot < 0) {
+        return glm::vec3(0.0f);
+    }
+    float4 cell = cache.cells[slot];
+    if (!(cell.w > 0.0f)) {
+        return glm::vec3(0.0f);
+    }
+    samples = cell.w;
+    return glm::vec3(cell.x, cell.y, cell.z) / cell.w;
+}
+
+// Adds one sample of the radiance arriving at `p`, dropped if the table is full
+__host__ __device__ inline void radianceCacheAdd(const RadianceCache &cache, glm::vec3 p, glm::vec3 radiance) {
+#ifdef __CUDA_ARCH__
+    if (!(radiance.x >= 0.0f && radiance.y >= 0.0f && radiance.z >= 0.0f)) {
+        return;
+    }
+    int slot = radianceCacheSlot(cache, radianceCacheKey(cache, p), true);
+    if (slot < 0) {
+        return;
+    }
+    float4 *cell = &cache.cells[slot];
+    atomicAdd(&cell->x, radiance.x);
+    atomicAdd(&cell->y, radiance.y);
+    atomicAdd(&cell->z, radiance.z);
+    atomicAdd(&cell->w, 1.0f);
+#endif
+}
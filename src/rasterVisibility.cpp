@@ -0,0 +1,316 @@
+#include <cstdio>
+#include <vector>
+#include <GL/glew.h>
+#include <cuda_runtime.h>
+#include <cuda_gl_interop.h>
+
+#include "glslUtility.hpp"
+#include "pathtrace.h"
+#include "rasterVisibility.h"
+
+static const char *rasterVS =
+    "#version 330\n"
+    "in vec3 Position;\n"
+    "uniform mat4 u_model;\n"
+    "uniform mat4 u_viewProjection;\n"
+    "out vec3 v_world;\n"
+    "\n"
+    "void main() {\n"
+    "    vec4 world = u_model * vec4(Position, 1.0);\n"
+    "    v_world = world.xyz;\n"
+    "    gl_Position = u_viewProjection * world;\n"
+    "}\n";
+
+// Spheres are the radius 0.5 ball of sphereIntersectionTest inside the
+// unit cube drawn for them, hit along the ray from the eye
+static const char *rasterFS =
+    "#version 330\n"
+    "uniform mat4 u_inverseModel;\n"
+    "uniform mat4 u_viewProjection;\n"
+    "uniform vec3 u_eye;\n"
+    "uniform int u_geom;\n"
+    "uniform int u_firstTriangle;\n"
+    "uniform bool u_sphere;\n"
+    "in vec3 v_world;\n"
+    "layout(location = 0) out ivec2 hit;\n"
+    "\n"
+    "void main() {\n"
+    "    gl_FragDepth = gl_FragCoord.z;\n"
+    "    if (u_sphere) {\n"
+    "        vec3 ro = (u_inverseModel * vec4(u_eye, 1.0)).xyz;\n"
+    "        vec3 rd = (u_inverseModel * vec4(v_world - u_eye, 0.0)).xyz;\n"
+    "        float a = dot(rd, rd);\n"
+    "        float b = dot(ro, rd);\n"
+    "        float radicand = b * b - a * (dot(ro, ro) - 0.25);\n"
+    "        if (radicand < 0.0) {\n"
+    "            discard;\n"
+    "        }\n"
+    "        float root = sqrt(radicand);\n"
+    "        float t = (-b - root) / a;\n"
+    "        if (t <= 0.0) {\n"
+    "            t = (-b + root) / a;\n"
+    "        }\n"
+    "        if (t <= 0.0) {\n"
+    "            discard;\n"
+    "        }\n"
+    "        vec4 clip = u_viewProjection * vec4(u_eye + t * (v_world - u_eye), 1.0);\n"
+    "        gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;\n"
+    "    }\n"
+    "    hit = ivec2(u_geom, u_firstTriangle < 0 ? -1 : u_firstTriangle + gl_PrimitiveID);\n"
+    "}\n";
+
+// The near plane sits this fraction of the way to the far one
+#define RASTER_NEAR_FRACTION 1e-4f
+
+namespace rasterVisibility {
+
+static const Scene *uploadedScene = NULL;
+static bool drawable = false;
+// Scene::meshPositions and meshTriangles, then a unit cube's corners and
+// its 12 triangles from cubeFirstTriangle, for the cubes and spheres
+static GLuint vertexArray = 0;
+static GLuint positionBuffer = 0;
+static GLuint indexBuffer = 0;
+static int cubeFirstTriangle = 0;
+static GLuint program = 0;
+// The GL_RG32I hits and their depth, and the hits registered with CUDA
+static GLuint framebuffer = 0;
+static GLuint hitTexture = 0;
+static GLuint depthBuffer = 0;
+static glm::ivec2 targetSize(0);
+static cudaGraphicsResource *hitResource = NULL;
+
+static bool upload(const Scene *scene) {
+    for (size_t i = 0; i < scene->geoms.size(); i++) {
+        const GeomType type = scene->geoms[i].type;
+        if (type != SPHERE && type != CUBE && type != MESH) {
+            printf("Raster primary visibility: the scene has geoms it cannot draw, so its camera rays are traced\n");
+            return false;
+        }
+    }
+
+    std::vector<glm::vec3> positions(scene->meshPositions);
+    std::vector<glm::ivec3> triangles(scene->meshTriangles);
+    const int firstCorner = (int)positions.size();
+    for (int c = 0; c < 8; c++) {
+        positions.push_back(glm::vec3(c & 1, (c >> 1) & 1, c >> 2) - 0.5f);
+    }
+    // Culling is off, so the faces' winding does not matter
+    static const int faces[6][4] = {
+        { 0, 2, 6, 4 }, { 1, 5, 7, 3 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 }, { 0, 1, 3, 2 }, { 4, 6, 7, 5 },
+    };
+    cubeFirstTriangle = (int)triangles.size();
+    for (int f = 0; f < 6; f++) {
+        triangles.push_back(firstCorner + glm::ivec3(faces[f][0], faces[f][1], faces[f][2]));
+        triangles.push_back(firstCorner + glm::ivec3(faces[f][0], faces[f][2], faces[f][3]));
+    }
+
+    glGenVertexArrays(1, &vertexArray);
+    glBindVertexArray(vertexArray);
+    glGenBuffers(1, &positionBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
+    glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), positions.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+    glGenBuffers(1, &indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, triangles.size() * sizeof(glm::ivec3), triangles.data(),
+        GL_STATIC_DRAW);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    const char *attribLocations[] = { "Position" };
+    program = glslUtility::createProgramFromSource(rasterVS, rasterFS, attribLocations, 1);
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    return linked == GL_TRUE;
+}
+
+static void releaseTarget() {
+    if (hitResource != NULL) {
+        cudaGraphicsUnregisterResource(hitResource);
+        hitResource = NULL;
+    }
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteTextures(1, &hitTexture);
+    glDeleteRenderbuffers(1, &depthBuffer);
+    framebuffer = 0;
+    hitTexture = 0;
+    depthBuffer = 0;
+    targetSize = glm::ivec2(0);
+}
+
+// (Re)creates the render target for `size` pixels; false if GL or CUDA refuse it
+static bool resizeTarget(glm::ivec2 size) {
+    if (size == targetSize) {
+        return true;
+    }
+    releaseTarget();
+    glGenTextures(1, &hitTexture);
+    glBindTexture(GL_TEXTURE_2D, hitTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32I, size.x, size.y, 0, GL_RG_INTEGER, GL_INT, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glGenRenderbuffers(1, &depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, size.x, size.y);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    GLint previous = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hitTexture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+    const bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, previous);
+
+    if (!complete || cudaGraphicsGLRegisterImage(&hitResource, hitTexture, GL_TEXTURE_2D,
+            cudaGraphicsRegisterFlagsReadOnly) != cudaSuccess) {
+        printf("Raster primary visibility: cannot create its %dx%d render target\n", size.x, size.y);
+        hitResource = NULL;
+        releaseTarget();
+        return false;
+    }
+    targetSize = size;
+    return true;
+}
+
+/**
+ * The clip transform that puts world point p at pixel (x, y) of
+ * cameraProjectPoint on the centre of texel (x, y): window coordinates
+ * are pixels plus one half, with rows counted up from the bottom, which
+ * is row y of the array CUDA maps. The depth is the distance along the
+ * view, from `nearDepth` to `farDepth`.
+ */
+static glm::mat4 viewProjection(const Camera &cam, float nearDepth, float farDepth) {
+    const glm::vec2 resolution(cam.resolution);
+    const glm::vec3 rowX = cam.right * (-2.0f / (resolution.x * glm::dot(cam.right, cam.right) * cam.pixelLength.x))
+        + cam.view / resolution.x;
+    const glm::vec3 rowY = cam.up * (-2.0f / (resolution.y * glm::dot(cam.up, cam.up) * cam.pixelLength.y))
+        + cam.view / resolution.y;
+    const float a = (farDepth + nearDepth) / (farDepth - nearDepth);
+    const float b = -2.0f * farDepth * nearDepth / (farDepth - nearDepth);
+    const glm::vec3 rows[4] = { rowX, rowY, a * cam.view, cam.view };
+    const float offsets[4] = { 0.0f, 0.0f, b, 0.0f };
+    glm::mat4 m(0.0f);
+    for (int r = 0; r < 4; r++) {
+        m[0][r] = rows[r].x;
+        m[1][r] = rows[r].y;
+        m[2][r] = rows[r].z;
+        m[3][r] = offsets[r] - glm::dot(rows[r], cam.position);
+    }
+    return m;
+}
+
+void render(const Scene *scene) {
+    if (scene != uploadedScene) {
+        release();
+        uploadedScene = scene;
+        drawable = upload(scene);
+    }
+    if (!drawable || scene->state.viewCount() > 1 || scene->bvhNodes.empty()) {
+        return;
+    }
+    const Camera &cam = scene->state.camera;
+    if (!resizeTarget(cam.resolution)) {
+        drawable = false;
+        return;
+    }
+
+    // Depths span the scene's bounds as seen along the view
+    const BVHNode &root = scene->bvhNodes[0];
+    float farDepth = 0.0f;
+    for (int c = 0; c < 8; c++) {
+        const glm::vec3 corner((c & 1) ? root.bboxMax.x : root.bboxMin.x,
+            (c & 2) ? root.bboxMax.y : root.bboxMin.y, (c & 4) ? root.bboxMax.z : root.bboxMin.z);
+        farDepth = glm::max(farDepth, glm::dot(corner - cam.position, cam.view));
+    }
+    farDepth = glm::max(farDepth * 1.01f, 1e-3f);
+    const glm::mat4 clip = viewProjection(cam, farDepth * RASTER_NEAR_FRACTION, farDepth);
+
+    GLint previousProgram = 0;
+    GLint previousVertexArray = 0;
+    GLint previousFramebuffer = 0;
+    GLint previousViewport[4];
+    glGetIntegerv(GL_CURRENT_PROGRAM, &previousProgram);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVertexArray);
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+    glGetIntegerv(GL_VIEWPORT, previousViewport);
+    const GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+    const GLboolean cullFace = glIsEnabled(GL_CULL_FACE);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(0, 0, targetSize.x, targetSize.y);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+    glDisable(GL_CULL_FACE);
+    const GLint miss[4] = { -1, -1, 0, 0 };
+    const GLfloat farthest = 1.0f;
+    glClearBufferiv(GL_COLOR, 0, miss);
+    glClearBufferfv(GL_DEPTH, 0, &farthest);
+
+    glUseProgram(program);
+    glBindVertexArray(vertexArray);
+    glUniformMatrix4fv(glGetUniformLocation(program, "u_viewProjection"), 1, GL_FALSE, &clip[0][0]);
+    glUniform3fv(glGetUniformLocation(program, "u_eye"), 1, &cam.position[0]);
+    const GLint modelLocation = glGetUniformLocation(program, "u_model");
+    const GLint inverseModelLocation = glGetUniformLocation(program, "u_inverseModel");
+    const GLint geomLocation = glGetUniformLocation(program, "u_geom");
+    const GLint firstTriangleLocation = glGetUniformLocation(program, "u_firstTriangle");
+    const GLint sphereLocation = glGetUniformLocation(program, "u_sphere");
+    for (size_t i = 0; i < scene->geoms.size(); i++) {
+        const Geom &geom = scene->geoms[i];
+        int firstTriangle = cubeFirstTriangle;
+        int triangleCount = 12;
+        if (geom.type == MESH) {
+            const Mesh &mesh = scene->meshes[geom.meshid];
+            firstTriangle = mesh.triangleOffset;
+            triangleCount = mesh.triangleCount;
+        }
+        glUniformMatrix4fv(modelLocation, 1, GL_FALSE, &geom.transform[0][0]);
+        glUniformMatrix4fv(inverseModelLocation, 1, GL_FALSE, &geom.inverseTransform[0][0]);
+        glUniform1i(geomLocation, (GLint)i);
+        glUniform1i(firstTriangleLocation, geom.type == MESH ? firstTriangle : -1);
+        glUniform1i(sphereLocation, geom.type == SPHERE);
+        glDrawElements(GL_TRIANGLES, triangleCount * 3, GL_UNSIGNED_INT,
+            (const void *)((size_t)firstTriangle * sizeof(glm::ivec3)));
+    }
+
+    glBindVertexArray(previousVertexArray);
+    glUseProgram(previousProgram);
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+    glViewport(previousViewport[0], previousViewport[1], previousViewport[2], previousViewport[3]);
+    if (!depthTest) {
+        glDisable(GL_DEPTH_TEST);
+    }
+    if (cullFace) {
+        glEnable(GL_CULL_FACE);
+    }
+
+    // Mapping waits for the draws; the hits are copied out before the unmap
+    cudaArray_t hits = NULL;
+    cudaGraphicsMapResources(1, &hitResource, 0);
+    cudaGraphicsSubResourceGetMappedArray(&hits, hitResource, 0, 0);
+    pathtraceSetRasterHits(hits);
+    cudaGraphicsUnmapResources(1, &hitResource, 0);
+}
+
+void release() {
+    releaseTarget();
+    glDeleteVertexArrays(1, &vertexArray);
+    glDeleteBuffers(1, &positionBuffer);
+    glDeleteBuffers(1, &indexBuffer);
+    if (program != 0) {
+        glDeleteProgram(program);
+    }
+    vertexArray = 0;
+    positionBuffer = 0;
+    indexBuffer = 0;
+    program = 0;
+    uploadedScene = NULL;
+    drawable = false;
+}
+
+}
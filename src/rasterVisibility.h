@@ -0,0 +1,29 @@
+#pragma once
+
+#include "scene.h"
+
+/**
+ * Rasterized primary visibility for PathtraceOptions::rasterPrimary. The
+ * preview's OpenGL context draws the scene from its camera into an integer
+ * target holding, per pixel, the geom and (for meshes) the triangle that
+ * covers its centre, which CUDA reads through graphics interop (see
+ * pathtraceSetRasterHits) instead of tracing the pixel-centre camera rays.
+ * The projection puts each pixel's camera ray through the centre of its
+ * texel, so the two agree but for rounding at edges. Cubes and meshes are
+ * drawn as their triangles; spheres as their bounding cubes, ray-cast per
+ * fragment, so the depth test sees the true surface.
+ *
+ * Scenes with sphere clouds or SDF volumes are not drawn, and keep tracing
+ * their camera rays.
+ */
+namespace rasterVisibility {
+    /**
+     * Draws `scene` from its camera and hands the hits to the path tracer,
+     * uploading its triangles first if they are not yet. Leaves the GL
+     * state the preview draws with as it was.
+     */
+    void render(const Scene *scene);
+
+    // Frees the GL buffers, which the next render() rebuilds: for a new scene
+    void release();
+}
@@ -0,0 +1,155 @@
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET SocketHandle;
+#define INVALID_HANDLE INVALID_SOCKET
+#define closeSocket closesocket
+#else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int SocketHandle;
+#define INVALID_HANDLE -1
+#define closeSocket ::close
+#endif
+
+#include "remoteSession.h"
+
+// A client gone mid-frame fails the send rather than raising SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+static SocketHandle listener = INVALID_HANDLE;
+static SocketHandle client = INVALID_HANDLE;
+// Received bytes past the last complete line
+static std::string pending;
+
+static void dropClient() {
+    if (client != INVALID_HANDLE) {
+        closeSocket(client);
+        client = INVALID_HANDLE;
+    }
+    pending.clear();
+}
+
+bool remoteSession::listen(int port) {
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        return false;
+    }
+#endif
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_HANDLE) {
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof reuse);
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((unsigned short)port);
+    if (bind(listener, (const sockaddr *)&address, sizeof address) != 0 || ::listen(listener, 1) != 0) {
+        closeSocket(listener);
+        listener = INVALID_HANDLE;
+        return false;
+    }
+    return true;
+}
+
+bool remoteSession::accept() {
+    dropClient();
+    client = ::accept(listener, NULL, NULL);
+    if (client == INVALID_HANDLE) {
+        return false;
+    }
+    // Frames go out as soon as they are encoded, not batched by Nagle
+    int noDelay = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof noDelay);
+    return true;
+}
+
+bool remoteSession::receive(std::vector<std::string> &lines, int timeoutMs) {
+    if (client == INVALID_HANDLE) {
+        return false;
+    }
+    const size_t first = lines.size();
+    while (true) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(client, &readable);
+        timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+        const int ready = select((int)client + 1, &readable, NULL, NULL, timeoutMs < 0 ? NULL : &timeout);
+        if (ready < 0) {
+            dropClient();
+            return false;
+        }
+        if (ready == 0) {
+            return true;
+        }
+
+        char buffer[4096];
+        const int received = (int)recv(client, buffer, sizeof buffer, 0);
+        if (received <= 0) {
+            dropClient();
+            return false;
+        }
+        pending.append(buffer, received);
+        size_t end;
+        while ((end = pending.find('\n')) != std::string::npos) {
+            std::string line = pending.substr(0, end);
+            if (!line.empty() && line[line.size() - 1] == '\r') {
+                line.erase(line.size() - 1);
+            }
+            lines.push_back(line);
+            pending.erase(0, end + 1);
+        }
+        // Once a line came in, take only what else has already arrived
+        if (lines.size() > first) {
+            timeoutMs = 0;
+        }
+    }
+}
+
+static bool sendAll(const char *data, size_t bytes) {
+    while (bytes > 0) {
+        const int sent = (int)send(client, data, (int)bytes, SEND_FLAGS);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        bytes -= sent;
+    }
+    return true;
+}
+
+bool remoteSession::sendFrame(const RemoteFrameHeader &header, const unsigned char *data) {
+    if (client == INVALID_HANDLE) {
+        return false;
+    }
+    if (!sendAll((const char *)&header, sizeof header) || !sendAll((const char *)data, header.bytes)) {
+        dropClient();
+        return false;
+    }
+    return true;
+}
+
+void remoteSession::close() {
+    dropClient();
+    if (listener != INVALID_HANDLE) {
+        closeSocket(listener);
+        listener = INVALID_HANDLE;
+    }
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
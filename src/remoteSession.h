@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/**
+ * The TCP connection of --server mode: one client at a time drives the
+ * renderer with text commands and gets encoded frames back. Commands are
+ * lines of whitespace-separated words,
+ *
+ *     camera PHI THETA ZOOM     orbit angles (radians) and distance to lookat
+ *     lookat X Y Z              the point the camera orbits
+ *     set NAME VALUE            a control panel value, by its ui_ name
+ *                               without the prefix, e.g. "set exposure 1.5"
+ *     restart                   restart accumulation
+ *     keyframe                  make the next video frame a keyframe
+ *     quit                      close the connection
+ *
+ * and every frame is a RemoteFrameHeader followed by its `bytes` of
+ * encoded data: a JPEG file, or an H.264 or HEVC Annex B access unit, the
+ * first of which starts with the parameter sets.
+ */
+struct RemoteFrameHeader {
+    char magic[4];          // "PTV1"
+    unsigned int codec;     // a frameEncoder::Codec
+    unsigned int width;
+    unsigned int height;
+    unsigned int samples;   // accumulated in the frame
+    unsigned int bytes;     // of encoded data after the header
+};
+
+namespace remoteSession {
+    // Listens on `port` of every interface; false if it cannot be bound
+    bool listen(int port);
+
+    // Waits for the next client, dropping any current one
+    bool accept();
+
+    /**
+     * Appends the complete command lines the client has sent, waiting up
+     * to timeoutMs for the first (0 to only take what has arrived, -1 to
+     * wait for as long as it takes). False once the client disconnected.
+     */
+    bool receive(std::vector<std::string> &lines, int timeoutMs);
+
+    // Sends one frame; false once the client disconnected
+    bool sendFrame(const RemoteFrameHeader &header, const unsigned char *data);
+
+    // Closes the client connection and the listener
+    void close();
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "lights.h"
+
+/**
+ * Reservoir-based spatiotemporal importance resampling of direct light
+ * (Bitterli et al., "Spatiotemporal reservoir resampling for real-time ray
+ * tracing with dynamic direct lighting", SIGGRAPH 2020), for
+ * PathtraceOptions::restir. Every launch, each pixel's G-buffer surface
+ * streams RESTIR_CANDIDATES light points, drawn the way next-event
+ * estimation draws them, through a reservoir by their unshadowed
+ * contribution, merges the reservoir its surface had in the previous
+ * frame, found with the temporal denoiser's reprojection, then those of a
+ * few similar neighbours. The camera hits of the pixel then trace their one
+ * shadow ray to the point the reservoir kept, weighted by its W.
+ *
+ * Only the lights are resampled; the environment keeps its share of the
+ * light samples. Neighbours are merged without a visibility test, so the
+ * estimate is slightly biased where shadows cross them.
+ */
+
+// Light points drawn per pixel and launch
+#define RESTIR_CANDIDATES 32
+// A history weighs at most this many launches' candidates
+#define RESTIR_HISTORY_CAP 20
+// Neighbours merged per pixel, within this many pixels
+#define RESTIR_SPATIAL_NEIGHBOURS 4
+#define RESTIR_SPATIAL_RADIUS 16.0f
+// Seed depths of the passes' random engines, clear of the bounces'
+#define RESTIR_SEED_DEPTH 0x1ff
+#define RESTIR_SPATIAL_SEED_DEPTH 0x1fe
+
+__host__ __device__ inline Reservoir emptyReservoir() {
+    Reservoir r;
+    r.point = glm::vec3(0.0f);
+    r.weightSum = 0.0f;
+    r.normal = glm::vec3(0.0f);
+    r.candidates = 0.0f;
+    r.light = -1;
+    r.W = 0.0f;
+    return r;
+}
+
+/**
+ * The resampling target at surface point `point`: the luminance of the
+ * light's unshadowed contribution through a Lambertian surface of unit
+ * albedo, times pi, in area measure.
+ */
+__host__ __device__ inline float restirTarget(const LightData &lights, int light, glm::vec3 lightPoint,
+        glm::vec3 lightNormal, glm::vec3 point, glm::vec3 normal) {
+    if (light < 0) {
+        return 0.0f;
+    }
+    glm::vec3 toLight = lightPoint - point;
+    float distance2 = glm::dot(toLight, toLight);
+    if (!(distance2 > 0.0f)) {
+        return 0.0f;
+    }
+    glm::vec3 wi = toLight * (1.0f / sqrtf(distance2));
+    float cosSurface = glm::dot(normal, wi);
+    if (cosSurface <= 0.0f) {
+        return 0.0f;
+    }
+    glm::vec3 radiance = lights.lights[light].radiance;
+    return glm::dot(radiance, glm::vec3(0.2126f, 0.7152f, 0.0722f))
+        * cosSurface * fabsf(glm::dot(lightNormal, wi)) / distance2;
+}
+
+// Streams a sample of resampling weight `weight` through `r`, keeping it with probability weight / sum
+__host__ __device__ inline bool reservoirUpdate(Reservoir &r, int light, glm::vec3 point, glm::vec3 normal,
+        float weight, float candidates, float u) {
+    r.candidates += candidates;
+    if (!(weight > 0.0f)) {
+        return false;
+    }
+    r.weightSum += weight;
+    if (u * r.weightSum >= weight) {
+        return false;
+    }
+    r.light = light;
+    r.point = point;
+    r.normal = normal;
+    return true;
+}
+
+/**
+ * Merges reservoir `q`, with at most `maxCandidates` of its candidates
+ * counted, into `r` for surface point `point`: q's sample is resampled by
+ * its target here, times its W and candidate count.
+ */
+__host__ __device__ inline void reservoirMerge(const LightData &lights, Reservoir &r, const Reservoir &q,
+        float maxCandidates, glm::vec3 point, glm::vec3 normal, float u) {
+    float candidates = fminf(q.candidates, maxCandidates);
+    float target = restirTarget(lights, q.light, q.point, q.normal, point, normal);
+    reservoirUpdate(r, q.light, q.point, q.normal, target * q.W * candidates, candidates, u);
+}
+
+// Sets W for the sample `r` kept, from its target at `point`
+__host__ __device__ inline void reservoirFinish(const LightData &lights, Reservoir &r,
+        glm::vec3 point, glm::vec3 normal) {
+    float target = restirTarget(lights, r.light, r.point, r.normal, point, normal);
+    r.W = target > 0.0f && r.candidates > 0.0f ? r.weightSum / (r.candidates * target) : 0.0f;
+    if (!(r.W > 0.0f)) {
+        r.light = -1;
+        r.W = 0.0f;
+    }
+}
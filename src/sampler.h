@@ -0,0 +1,102 @@
+#pragma once
+
+#include <thrust/random.h>
+
+#include "intersections.h"
+#include "pathtrace.h"
+
+// Dimensions reserved per bounce: two for the scattered direction, one for
+// the BSDF lobe, one for Russian roulette, then from SAMPLER_LIGHT_DIMENSION two for the
+// point on a light, one for picking the light, one spare
+#define SAMPLER_BOUNCE_DIMENSIONS 8
+#define SAMPLER_LIGHT_DIMENSION 4
+
+/**
+ * The random numbers of one shade call. The Sobol sampler treats each
+ * pixel's samples as consecutive points of the (0, 2) sequence formed by
+ * the first two Sobol dimensions, and pads longer paths with independent
+ * copies of it, one per pair of dimensions. Every pair gets its own
+ * nested uniform (Owen) scramble and point order, seeded from the pixel
+ * and pair, following Burley, "Practical Hash-based Owen Scrambling"
+ * (JCGT 2020). Within a pixel any power-of-two run of samples is then
+ * stratified in each pair, so the error falls faster than with the
+ * independent random numbers of the minstd fallback.
+ */
+struct Sampler {
+    int type;                           // a SamplerType
+    thrust::default_random_engine rng;  // SAMPLER_RANDOM only
+    unsigned int pixelSeed;
+    unsigned int index;                 // the pixel's sample number
+    int dimension;                      // next dimension to draw
+};
+
+__host__ __device__ inline unsigned int reverseBits(unsigned int x) {
+#ifdef __CUDA_ARCH__
+    return __brev(x);
+#else
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+#endif
+}
+
+// Flips each bit of x depending only on the bits below it (Laine-Karras)
+__host__ __device__ inline unsigned int laineKarrasPermutation(unsigned int x, unsigned int seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Owen scrambling of a 0.32 fixed-point value: each bit depends only on the bits above it
+__host__ __device__ inline unsigned int nestedUniformScramble(unsigned int x, unsigned int seed) {
+    return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+// Second Sobol dimension; the first is reverseBits(index)
+__host__ __device__ inline unsigned int sobolSecondDimension(unsigned int index) {
+    unsigned int result = 0;
+    for (unsigned int v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+/**
+ * `rng` is only kept for SAMPLER_RANDOM. `bounce` must differ between the
+ * shade calls of one path; each gets SAMPLER_BOUNCE_DIMENSIONS dimensions.
+ */
+__host__ __device__ inline Sampler makeSampler(int type, thrust::default_random_engine rng,
+        int pixel, int sampleIndex, int bounce) {
+    Sampler sampler;
+    sampler.type = type;
+    sampler.rng = rng;
+    sampler.pixelSeed = utilhash((unsigned int)pixel);
+    sampler.index = (unsigned int)sampleIndex;
+    sampler.dimension = bounce * SAMPLER_BOUNCE_DIMENSIONS;
+    return sampler;
+}
+
+// The next uniform number in [0, 1)
+__host__ __device__ inline float nextSample(Sampler &sampler) {
+    if (sampler.type != SAMPLER_SOBOL) {
+        thrust::uniform_real_distribution<float> u01(0, 1);
+        return u01(sampler.rng);
+    }
+    unsigned int pair = (unsigned int)sampler.dimension / 2;
+    bool second = (sampler.dimension & 1) != 0;
+    sampler.dimension++;
+
+    // Both dimensions of a pair must visit the points in the same order
+    unsigned int seed = utilhash(sampler.pixelSeed ^ utilhash(pair));
+    unsigned int point = nestedUniformScramble(sampler.index, seed);
+    unsigned int x = second ? sobolSecondDimension(point) : reverseBits(point);
+    x = nestedUniformScramble(x, utilhash(seed + (second ? 2u : 1u)));
+    return (x >> 8) * (1.0f / (1 << 24));
+}
@@ -1,132 +1,824 @@
 #include <iostream>
 #include "scene.h"
+#include "bvh.h"
+#include "mappedFile.h"
+#include "parallelFor.h"
+#include <climits>
 #include <cstring>
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtx/string_cast.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <thread>
 
-Scene::Scene(string filename) {
+// Milliseconds since `start`
+static float msSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Builds a geom's transforms from its TRANS/ROTAT/SCALE and picks its
+ * intersection test. Touches only the geom, so geoms finish in parallel.
+ */
+static void finishGeom(Geom &geom) {
+    geom.transform = utilityCore::buildTransformationMatrix(
+            geom.translation, geom.rotation, geom.scale);
+    geom.inverseTransform = glm::inverse(geom.transform);
+    geom.invTranspose = glm::inverseTranspose(geom.transform);
+
+    // Unrotated cubes and round spheres get intersection tests that
+    // skip most of the transform
+    geom.deviceType = geom.type;
+    glm::vec3 axes[3] = { glm::vec3(geom.transform[0]), glm::vec3(geom.transform[1]),
+        glm::vec3(geom.transform[2]) };
+    if (geom.type == CUBE) {
+        bool diagonal = true;
+        for (int a = 0; a < 3; a++) {
+            for (int b = 0; b < 3; b++) {
+                diagonal = diagonal && (a == b || fabsf(axes[a][b]) <= 1e-6f * fabsf(axes[a][a]));
+            }
+        }
+        if (diagonal) {
+            geom.deviceType = AXIS_ALIGNED_CUBE;
+        }
+    } else if (geom.type == SPHERE) {
+        float length = glm::length(axes[0]);
+        if (fabsf(glm::length(axes[1]) - length) <= 1e-5f * length
+                && fabsf(glm::length(axes[2]) - length) <= 1e-5f * length) {
+            geom.deviceType = UNIFORM_SPHERE;
+        }
+    }
+}
+
+// The geoms' records for upload
+static void buildDeviceGeom(const Geom &geom, DeviceGeom &record) {
+    // Only the top three rows of the affine inverse are needed
+    glm::mat4 inverseT = glm::transpose(geom.inverseTransform);
+    record.inverseRows[0] = inverseT[0];
+    record.inverseRows[1] = inverseT[1];
+    record.inverseRows[2] = inverseT[2];
+    if (geom.deviceType == UNIFORM_SPHERE) {
+        record.inverseRows[0] = glm::vec4(glm::vec3(geom.transform[3]),
+            0.5f * glm::length(glm::vec3(geom.transform[0])));
+    }
+    record.type = geom.deviceType;
+    record.materialid = geom.materialid;
+    record.meshid = geom.meshid;
+    record.lightIndex = -1;
+}
+
+BVHBuilder Scene::bvhBuilder = BVH_MEDIAN;
+bool Scene::compactMeshes = false;
+bool Scene::coherentGeomOrder = false;
+
+Scene::Scene(string filename) : bvhBuildMs(0.0f) {
+    environment.intensity = 1.0f;
     cout << "Reading scene from " << filename << " ..." << endl;
     cout << " " << endl;
-    char* fname = (char*)filename.c_str();
-    fp_in.open(fname);
-    if (!fp_in.is_open()) {
+    size_t slash = filename.find_last_of("/\\");
+    sceneDirectory = slash == string::npos ? "" : filename.substr(0, slash + 1);
+
+    // A cache from an unchanged scene skips the parse and the BVH builds
+    const string cacheFile = filename + ".cache";
+    if (readCache(cacheFile)) {
+        cout << "Loaded " << geoms.size() << " geoms and " << materials.size()
+            << " materials from " << cacheFile << endl;
+        // The cached light pmfs assumed the environment loaded
+        if (!loadTextures()) {
+            rebuildLights();
+        }
+        return;
+    }
+    sourceFiles.push_back(filename);
+
+    MappedFile file(filename);
+    if (file.data() == NULL) {
         cout << "Error reading from file - aborting!" << endl;
         throw;
     }
-    while (fp_in.good()) {
-        string line;
-        utilityCore::safeGetline(fp_in, line);
-        if (!line.empty()) {
-            vector<string> tokens = utilityCore::tokenizeString(line);
-            if (strcmp(tokens[0].c_str(), "MATERIAL") == 0) {
-                loadMaterial(tokens[1]);
-                cout << " " << endl;
-            } else if (strcmp(tokens[0].c_str(), "OBJECT") == 0) {
-                loadGeom(tokens[1]);
-                cout << " " << endl;
-            } else if (strcmp(tokens[0].c_str(), "CAMERA") == 0) {
-                loadCamera();
-                cout << " " << endl;
+    // Scenes with load errors are not cached, so fixing them takes effect
+    bool loadedCleanly = true;
+    lines.reset(file.data(), file.size());
+    while (lines.nextLine()) {
+        if (lines[0].is("MATERIAL")) {
+            loadedCleanly = loadMaterial(lines[1].toInt()) >= 0 && loadedCleanly;
+            cout << " " << endl;
+        } else if (lines[0].is("OBJECT")) {
+            loadedCleanly = loadGeom(lines[1].toInt()) >= 0 && loadedCleanly;
+            cout << " " << endl;
+        } else if (lines[0].is("CAMERA")) {
+            loadedCleanly = loadCamera() >= 0 && loadedCleanly;
+            cout << " " << endl;
+        } else if (lines[0].is("MEDIUM")) {
+            loadedCleanly = loadMedium(lines[1].toInt()) >= 0 && loadedCleanly;
+            cout << " " << endl;
+        } else if (lines[0].is("ENVIRONMENT") && lines.size() >= 2) {
+            // ENVIRONMENT file.hdr [intensity]
+            environment.image.filename = sceneDirectory + lines[1].str();
+            environment.intensity = lines.size() >= 3 ? lines[2].toFloat() : 1.0f;
+        }
+    }
+    lines.reset(NULL, 0);
+
+    // The parse only records what each block says; meshes, transforms and
+    // device records are then built on all cores
+    loadedCleanly = loadMeshes() && loadedCleanly;
+    loadedCleanly = loadSphereClouds() && loadedCleanly;
+    loadedCleanly = loadSdfs() && loadedCleanly;
+    loadedCleanly = loadTextures() && loadedCleanly;
+    parallelFor((int)geoms.size(), 256, [&](int i) { finishGeom(geoms[i]); });
+
+    reorderGeoms();
+    buildBVH();
+
+    deviceGeoms.resize(geoms.size());
+    parallelFor((int)geoms.size(), 256, [&](int i) { buildDeviceGeom(geoms[i], deviceGeoms[i]); });
+
+    buildLights();
+    if (!lights.empty()) {
+        cout << "Sampling " << lights.size() << " of the scene's lights directly" << endl;
+    }
+    if (loadedCleanly) {
+        writeCache(cacheFile);
+    }
+}
+
+// World-space bounds of a light
+static AABB lightBounds(const Light &light) {
+    AABB box = BVH::emptyBounds();
+    if (light.type == MESH) {
+        for (int c = 0; c < 3; c++) {
+            BVH::growBounds(box, glm::vec3(light.transformRows[c]));
+        }
+        return box;
+    }
+    // Cubes and spheres both fit in the unit cube
+    for (int c = 0; c < 8; c++) {
+        glm::vec4 corner((c & 1) - 0.5f, ((c >> 1) & 1) - 0.5f, (c >> 2) - 0.5f, 1.0f);
+        BVH::growBounds(box, glm::vec3(glm::dot(light.transformRows[0], corner),
+                glm::dot(light.transformRows[1], corner), glm::dot(light.transformRows[2], corner)));
+    }
+    return box;
+}
+
+/**
+ * Grows the normal cone (axis, cosTheta) of a LightNode to hold the cone
+ * (otherAxis, otherCos) too, the narrowest such cone as in PBRT's
+ * DirectionCone union. Either sign of an axis will do, so the other is
+ * flipped towards this one first, and any cone wider than a hemisphere
+ * holds every direction.
+ */
+static void growCone(glm::vec3 &axis, float &cosTheta, glm::vec3 otherAxis, float otherCos) {
+    if (cosTheta <= -1.0f || otherCos <= -1.0f) {
+        cosTheta = -1.0f;
+        return;
+    }
+    float cosD = glm::dot(axis, otherAxis);
+    if (cosD < 0.0f) {
+        otherAxis = -otherAxis;
+        cosD = -cosD;
+    }
+    const float thetaA = acosf(glm::clamp(cosTheta, -1.0f, 1.0f));
+    const float thetaB = acosf(glm::clamp(otherCos, -1.0f, 1.0f));
+    const float thetaD = acosf(glm::min(cosD, 1.0f));
+    if (thetaD + thetaB <= thetaA) {
+        return;
+    }
+    if (thetaD + thetaA <= thetaB) {
+        axis = otherAxis;
+        cosTheta = otherCos;
+        return;
+    }
+    const float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+    if (thetaO >= 0.5f * PI || !(sinf(thetaD) > 1e-6f)) {
+        cosTheta = -1.0f;
+        return;
+    }
+    // Turn the axis by thetaO - thetaA towards the other one
+    const float turn = thetaO - thetaA;
+    axis = glm::normalize(sinf(thetaD - turn) * axis + sinf(turn) * otherAxis);
+    cosTheta = cosf(thetaO);
+}
+
+/**
+ * Builds the subtree of lightNodes over order[begin, end), splitting at
+ * the centroid median on the longest axis down to one light per leaf, and
+ * returns its root. Coincident lights are split by position in `order`.
+ */
+static int buildLightNode(vector<Light> &lights, const vector<AABB> &bounds, vector<int> &order,
+        vector<LightNode> &nodes, int begin, int end, int parent) {
+    const int index = nodes.size();
+    nodes.push_back(LightNode());
+    LightNode node;
+    node.parent = parent;
+    if (end - begin == 1) {
+        const int l = order[begin];
+        const Light &light = lights[l];
+        node.boundsMin = bounds[l].min;
+        node.boundsMax = bounds[l].max;
+        node.power = light.pmf;
+        node.axis = glm::vec3(0.0f, 0.0f, 1.0f);
+        node.cosTheta = -1.0f;
+        if (light.type == MESH) {
+            glm::vec3 p0(light.transformRows[0]);
+            node.axis = glm::normalize(glm::cross(glm::vec3(light.transformRows[1]) - p0,
+                    glm::vec3(light.transformRows[2]) - p0));
+            node.cosTheta = 1.0f;
+        }
+        node.offset = l;
+        node.count = 1;
+        lights[l].node = index;
+        nodes[index] = node;
+        return index;
+    }
+
+    AABB centroidBox = BVH::emptyBounds();
+    for (int i = begin; i < end; i++) {
+        BVH::growBounds(centroidBox, 0.5f * (bounds[order[i]].min + bounds[order[i]].max));
+    }
+    glm::vec3 extent = centroidBox.max - centroidBox.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    int mid = (begin + end) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+        return bounds[a].min[axis] + bounds[a].max[axis] < bounds[b].min[axis] + bounds[b].max[axis];
+    });
+
+    const int left = buildLightNode(lights, bounds, order, nodes, begin, mid, index);
+    const int right = buildLightNode(lights, bounds, order, nodes, mid, end, index);
+    const LightNode &a = nodes[left];
+    const LightNode &b = nodes[right];
+    node.boundsMin = glm::min(a.boundsMin, b.boundsMin);
+    node.boundsMax = glm::max(a.boundsMax, b.boundsMax);
+    node.power = a.power + b.power;
+    node.axis = a.axis;
+    node.cosTheta = a.cosTheta;
+    growCone(node.axis, node.cosTheta, b.axis, b.cosTheta);
+    node.offset = right;
+    node.count = 0;
+    nodes[index] = node;
+    return index;
+}
+
+/**
+ * Builds the light BVH over `lights` while their pmfs still hold their
+ * powers. With thousands of emitters, next-event estimation walks it down
+ * to one light by the children's estimated contributions at the shading
+ * point instead of by power alone (see sampleLightTree).
+ */
+void Scene::buildLightTree() {
+    lightNodes.clear();
+    if (lights.empty()) {
+        return;
+    }
+    vector<AABB> bounds(lights.size());
+    vector<int> order(lights.size());
+    for (size_t l = 0; l < lights.size(); l++) {
+        bounds[l] = lightBounds(lights[l]);
+        order[l] = (int)l;
+    }
+    lightNodes.reserve(2 * lights.size() - 1);
+    buildLightNode(lights, bounds, order, lightNodes, 0, (int)lights.size(), -1);
+}
+
+/**
+ * Lists the emissive cubes, uniformly scaled spheres and mesh triangles
+ * for next-event estimation, picked in proportion to their power or
+ * through the light tree. A mesh lists the triangles of its loaded level,
+ * with world-space corners in the rows of their transform, and its geom
+ * points at the first of them. Other emitters (sphere clouds, SDF volumes,
+ * ellipsoids) are still found by the scattered rays alone.
+ */
+void Scene::buildLights() {
+    float totalPower = 0.0f;
+    for (size_t i = 0; i < geoms.size(); i++) {
+        const Geom &geom = geoms[i];
+        const Material &material = materials[geom.materialid];
+        if (material.emittance <= 0.0f) {
+            continue;
+        }
+        glm::vec3 axes[3] = {
+            glm::vec3(geom.transform[0]), glm::vec3(geom.transform[1]), glm::vec3(geom.transform[2])
+        };
+        Light light = {};
+        if (geom.type == MESH) {
+            const Mesh &mesh = meshes[geom.meshid];
+            const glm::vec3 radiance = material.color * material.emittance;
+            const float luminance = glm::dot(radiance, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+            for (int t = 0; t < mesh.triangleCount && luminance > 0.0f; t++) {
+                const glm::ivec3 triangle = meshTriangles[mesh.triangleOffset + t];
+                glm::vec3 corners[3];
+                for (int c = 0; c < 3; c++) {
+                    corners[c] = glm::vec3(geom.transform * glm::vec4(meshPositions[triangle[c]], 1.0f));
+                }
+                light = {};
+                light.area = 0.5f * glm::length(glm::cross(corners[1] - corners[0], corners[2] - corners[0]));
+                if (!(light.area > 0.0f)) {
+                    continue;
+                }
+                for (int row = 0; row < 3; row++) {
+                    light.transformRows[row] = glm::vec4(corners[row], 0.0f);
+                }
+                light.radiance = radiance;
+                light.type = MESH;
+                light.geom = (int)i;
+                light.pmf = luminance * light.area;
+                totalPower += light.pmf;
+                if (deviceGeoms[i].lightIndex < 0) {
+                    deviceGeoms[i].lightIndex = (int)lights.size();
+                }
+                lights.push_back(light);
+            }
+            continue;
+        } else if (geom.type == CUBE) {
+            // Each pair of faces spans the images of the other two unit edges
+            float pairArea[3];
+            for (int a = 0; a < 3; a++) {
+                pairArea[a] = 2.0f * glm::length(glm::cross(axes[(a + 1) % 3], axes[(a + 2) % 3]));
             }
+            light.area = pairArea[0] + pairArea[1] + pairArea[2];
+            light.faceCdf[0] = pairArea[0] / light.area;
+            light.faceCdf[1] = (pairArea[0] + pairArea[1]) / light.area;
+            light.faceCdf[2] = 1.0f;
+        } else if (geom.type == SPHERE) {
+            float radius = 0.5f * glm::length(axes[0]);
+            if (fabsf(glm::length(axes[1]) - 2.0f * radius) > 1e-4f * radius
+                    || fabsf(glm::length(axes[2]) - 2.0f * radius) > 1e-4f * radius) {
+                continue;
+            }
+            light.area = 4.0f * PI * radius * radius;
+        } else {
+            continue;
+        }
+        glm::mat4 transformT = glm::transpose(geom.transform);
+        light.transformRows[0] = transformT[0];
+        light.transformRows[1] = transformT[1];
+        light.transformRows[2] = transformT[2];
+        light.radiance = material.color * material.emittance;
+        light.type = geom.type;
+        light.geom = (int)i;
+        light.pmf = glm::dot(light.radiance, glm::vec3(0.2126f, 0.7152f, 0.0722f)) * light.area;
+        if (light.pmf <= 0.0f) {
+            continue;
+        }
+        totalPower += light.pmf;
+        deviceGeoms[i].lightIndex = (int)lights.size();
+        lights.push_back(light);
+    }
+    buildLightTree();
+
+    // The environment, when there is one, takes the top of the CDF
+    const float lightsPmf = 1.0f - environmentPmf();
+    float cdf = 0.0f;
+    for (size_t l = 0; l < lights.size(); l++) {
+        lights[l].pmf *= lightsPmf / totalPower;
+        cdf += lights[l].pmf;
+        lights[l].cdf = cdf;
+    }
+    if (!lights.empty()) {
+        lights.back().cdf = lightsPmf;
+    }
+}
+
+/**
+ * The environment and the emitters get half the light samples each, since
+ * their powers are hard to compare; either alone gets them all.
+ */
+float Scene::environmentPmf() const {
+    if (environment.image.levels.empty()) {
+        return 0.0f;
+    }
+    return lights.empty() ? 1.0f : 0.5f;
+}
+
+/**
+ * Geoms are the instances of a two-level hierarchy: the top-level BVH
+ * bounds them in world space, while each mesh's BVH is in object space and
+ * shared by every geom using that mesh. Moving one therefore rebuilds only
+ * its transforms and device record, refits the top-level tree and lists
+ * the lights again, in case it is one.
+ */
+void Scene::moveGeom(int index) {
+    finishGeom(geoms[index]);
+    buildDeviceGeom(geoms[index], deviceGeoms[index]);
+    BVH::refit(bvhNodes, bvhGeomIndices, geomBounds());
+    rebuildLights();
+}
+
+void Scene::rebuildLights() {
+    lights.clear();
+    for (size_t i = 0; i < deviceGeoms.size(); i++) {
+        deviceGeoms[i].lightIndex = -1;
+    }
+    buildLights();
+}
+
+Scene::~Scene() {
+}
+
+vector<AABB> Scene::geomBounds() const {
+    vector<AABB> bounds(geoms.size());
+    for (size_t i = 0; i < geoms.size(); i++) {
+        if (geoms[i].type == MESH) {
+            const BVHNode &root = meshBvhNodes[meshes[geoms[i].meshid].bvhRoot];
+            AABB meshBounds;
+            meshBounds.min = root.bboxMin;
+            meshBounds.max = root.bboxMax;
+            bounds[i] = BVH::transformBounds(geoms[i].transform, meshBounds);
+        } else if (geoms[i].type == SPHERE_CLOUD) {
+            const BVHNode &root = cloudBvhNodes[sphereClouds[geoms[i].meshid].bvhRoot];
+            AABB cloudBounds;
+            cloudBounds.min = root.bboxMin;
+            cloudBounds.max = root.bboxMax;
+            bounds[i] = BVH::transformBounds(geoms[i].transform, cloudBounds);
+        } else if (geoms[i].type == SDF_VOLUME) {
+            AABB sdfBounds;
+            sdfBounds.min = sdfVolumes[geoms[i].meshid].boundsMin;
+            sdfBounds.max = sdfVolumes[geoms[i].meshid].boundsMax;
+            bounds[i] = BVH::transformBounds(geoms[i].transform, sdfBounds);
+        } else {
+            bounds[i] = BVH::geomBounds(geoms[i]);
         }
     }
+    return bounds;
 }
 
-int Scene::loadGeom(string objectid) {
-    int id = atoi(objectid.c_str());
+// Spreads the low 10 bits of v three apart, for a 30-bit Morton code
+static uint32_t expandMortonBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Morton bits per axis of the cells reorderGeoms groups materials in
+#define GEOM_ORDER_CELL_BITS 4
+
+/**
+ * The file's order of the geoms says nothing about where they are. With
+ * coherentGeomOrder they are sorted by the Morton code of their bounds'
+ * centres, and by material within each cell of a coarse 16^3 grid over
+ * them, so the geoms of a BVH leaf and neighbours in the linear loop sit
+ * together in memory, and a warp's hits on a cell fetch fewer materials.
+ * Keyframes follow their geoms; objectGeoms maps OBJECT ids either way.
+ */
+void Scene::reorderGeoms() {
+    const int n = (int)geoms.size();
+    objectGeoms.resize(n);
+    for (int i = 0; i < n; i++) {
+        objectGeoms[i] = i;
+    }
+    if (!coherentGeomOrder || n < 2) {
+        return;
+    }
+    const vector<AABB> bounds = geomBounds();
+    AABB centres = BVH::emptyBounds();
+    for (int i = 0; i < n; i++) {
+        BVH::growBounds(centres, 0.5f * (bounds[i].min + bounds[i].max));
+    }
+    const glm::vec3 extent = glm::max(centres.max - centres.min, glm::vec3(1e-20f));
+    vector<uint64_t> keys(n);
+    for (int i = 0; i < n; i++) {
+        const glm::vec3 unit = (0.5f * (bounds[i].min + bounds[i].max) - centres.min) / extent;
+        const glm::uvec3 cell = glm::uvec3(glm::clamp(unit * 1024.0f, glm::vec3(0.0f), glm::vec3(1023.0f)));
+        const uint32_t morton = (expandMortonBits(cell.x) << 2) | (expandMortonBits(cell.y) << 1)
+            | expandMortonBits(cell.z);
+        const uint64_t coarse = morton >> (3 * (10 - GEOM_ORDER_CELL_BITS));
+        keys[i] = (coarse << 52) | ((uint64_t)(geoms[i].materialid & 0xFFFFF) << 32) | morton;
+    }
+    vector<int> order(n);
+    for (int i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+
+    vector<Geom> sorted(n);
+    for (int i = 0; i < n; i++) {
+        sorted[i] = geoms[order[i]];
+        objectGeoms[order[i]] = i;
+    }
+    geoms.swap(sorted);
+    for (size_t k = 0; k < geomKeyframes.size(); k++) {
+        geomKeyframes[k].geom = objectGeoms[geomKeyframes[k].geom];
+    }
+    std::stable_sort(geomKeyframes.begin(), geomKeyframes.end(),
+        [](const GeomKeyframe &a, const GeomKeyframe &b) { return a.geom < b.geom; });
+}
+
+void Scene::buildBVH() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    BVH::build(geomBounds(), bvhNodes, bvhGeomIndices, 2, bvhBuilder);
+    // Leaves list their geoms grouped by intersection test, so traversal
+    // runs one test over each group; an edit that changes a geom's test
+    // only splits its group
+    for (size_t n = 0; n < bvhNodes.size(); n++) {
+        const BVHNode &node = bvhNodes[n];
+        if (node.count > 1) {
+            std::stable_sort(bvhGeomIndices.begin() + node.offset,
+                bvhGeomIndices.begin() + node.offset + node.count,
+                [&](int a, int b) { return geoms[a].deviceType < geoms[b].deviceType; });
+        }
+    }
+    float ms = msSince(start);
+    bvhBuildMs += ms;
+    cout << "Built " << (bvhBuilder == BVH_SAH ? "SAH" : "median") << " BVH with " << bvhNodes.size()
+        << " nodes over " << geoms.size() << " geoms in " << ms << " ms" << endl;
+}
+
+/**
+ * For a reload that moved geoms but kept their number: the old tree stays
+ * valid, if looser, and its node layout stays the same on the device.
+ */
+void Scene::refitBVH(const vector<BVHNode> &nodes, const vector<int> &geomIndices) {
+    bvhNodes = nodes;
+    bvhGeomIndices = geomIndices;
+    BVH::refit(bvhNodes, bvhGeomIndices, geomBounds());
+}
+
+// The three numbers after the keyword of the current line
+static glm::vec3 vec3Tokens(const LineTokenizer &lines, int first = 1) {
+    return glm::vec3(lines[first].toFloat(), lines[first + 1].toFloat(), lines[first + 2].toFloat());
+}
+
+int Scene::loadGeom(int id) {
     if (id != geoms.size()) {
         cout << "ERROR: OBJECT ID does not match expected number of geoms" << endl;
         return -1;
     } else {
         cout << "Loading Geom " << id << "..." << endl;
         Geom newGeom;
-        string line;
+        newGeom.meshid = -1;
 
         //load object type
-        utilityCore::safeGetline(fp_in, line);
-        if (!line.empty() && fp_in.good()) {
-            if (strcmp(line.c_str(), "sphere") == 0) {
+        if (lines.nextLine() && !lines.empty()) {
+            if (lines.size() == 1 && lines[0].is("sphere")) {
                 cout << "Creating new sphere..." << endl;
                 newGeom.type = SPHERE;
-            } else if (strcmp(line.c_str(), "cube") == 0) {
+            } else if (lines.size() == 1 && lines[0].is("cube")) {
                 cout << "Creating new cube..." << endl;
                 newGeom.type = CUBE;
+            } else if (lines.size() == 2 && lines[0].is("mesh")) {
+                string meshFile = lines[1].str();
+                cout << "Creating new mesh from " << meshFile << "..." << endl;
+                newGeom.type = MESH;
+                newGeom.meshid = queueMesh(sceneDirectory + meshFile);
+            } else if (lines.size() == 2 && lines[0].is("spheres")) {
+                string cloudFile = lines[1].str();
+                cout << "Creating new sphere cloud from " << cloudFile << "..." << endl;
+                newGeom.type = SPHERE_CLOUD;
+                newGeom.meshid = queueSphereCloud(sceneDirectory + cloudFile);
+            } else if (lines.size() == 2 && lines[0].is("sdf")) {
+                string sdfFile = lines[1].str();
+                cout << "Creating new SDF volume from " << sdfFile << "..." << endl;
+                newGeom.type = SDF_VOLUME;
+                newGeom.meshid = queueSdf(sceneDirectory + sdfFile);
             }
         }
 
         //link material
-        utilityCore::safeGetline(fp_in, line);
-        if (!line.empty() && fp_in.good()) {
-            vector<string> tokens = utilityCore::tokenizeString(line);
-            newGeom.materialid = atoi(tokens[1].c_str());
-            cout << "Connecting Geom " << objectid << " to Material " << newGeom.materialid << "..." << endl;
+        if (lines.nextLine() && !lines.empty()) {
+            newGeom.materialid = lines[1].toInt();
+            cout << "Connecting Geom " << id << " to Material " << newGeom.materialid << "..." << endl;
         }
 
         //load transformations
-        utilityCore::safeGetline(fp_in, line);
-        while (!line.empty() && fp_in.good()) {
-            vector<string> tokens = utilityCore::tokenizeString(line);
-
-            //load tranformations
-            if (strcmp(tokens[0].c_str(), "TRANS") == 0) {
-                newGeom.translation = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
-            } else if (strcmp(tokens[0].c_str(), "ROTAT") == 0) {
-                newGeom.rotation = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
-            } else if (strcmp(tokens[0].c_str(), "SCALE") == 0) {
-                newGeom.scale = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+        while (lines.nextLine() && !lines.empty()) {
+            if (lines[0].is("TRANS")) {
+                newGeom.translation = vec3Tokens(lines);
+            } else if (lines[0].is("ROTAT")) {
+                newGeom.rotation = vec3Tokens(lines);
+            } else if (lines[0].is("SCALE")) {
+                newGeom.scale = vec3Tokens(lines);
+            } else if (lines[0].is("KEYFRAME") && lines.size() >= 11) {
+                // KEYFRAME frame tx ty tz rx ry rz sx sy sz
+                GeomKeyframe keyframe;
+                keyframe.geom = id;
+                keyframe.frame = lines[1].toInt();
+                keyframe.translation = vec3Tokens(lines, 2);
+                keyframe.rotation = vec3Tokens(lines, 5);
+                keyframe.scale = vec3Tokens(lines, 8);
+                geomKeyframes.push_back(keyframe);
             }
-
-            utilityCore::safeGetline(fp_in, line);
         }
-
-        newGeom.transform = utilityCore::buildTransformationMatrix(
-                newGeom.translation, newGeom.rotation, newGeom.scale);
-        newGeom.inverseTransform = glm::inverse(newGeom.transform);
-        newGeom.invTranspose = glm::inverseTranspose(newGeom.transform);
+        // Geoms load in order, so only this one's keyframes need sorting
+        std::stable_sort(std::lower_bound(geomKeyframes.begin(), geomKeyframes.end(), id,
+                [](const GeomKeyframe &key, int geom) { return key.geom < geom; }),
+            geomKeyframes.end(),
+            [](const GeomKeyframe &a, const GeomKeyframe &b) { return a.frame < b.frame; });
 
         geoms.push_back(newGeom);
         return 1;
     }
 }
 
+/**
+ * Points the camera from its position at its lookAt and rebuilds an
+ * orthonormal right/up basis around `up`, the same way the interactive
+ * camera controls do.
+ */
+static void orientCamera(Camera &camera, glm::vec3 up) {
+    camera.view = glm::normalize(camera.lookAt - camera.position);
+    camera.right = glm::normalize(glm::cross(camera.view, up));
+    camera.up = glm::cross(camera.right, camera.view);
+}
+
+int Scene::animationFrames() const {
+    int frames = state.keyframes.empty() ? 0 : state.keyframes.back().frame + 1;
+    for (size_t i = 0; i < geomKeyframes.size(); i++) {
+        frames = std::max(frames, geomKeyframes[i].frame + 1);
+    }
+    return frames;
+}
+
+/**
+ * The position and lookAt at (fractional) `frame` of a KEYFRAME path,
+ * interpolated linearly between the surrounding keyframes and held at the
+ * first and last ones outside their range.
+ */
+static void keyframePose(const std::vector<CameraKeyframe> &keys, float frame,
+        glm::vec3 &position, glm::vec3 &lookAt) {
+    size_t next = 0;
+    while (next < keys.size() && keys[next].frame < frame) {
+        next++;
+    }
+    if (next == 0 || next == keys.size()) {
+        const CameraKeyframe &key = keys[next == 0 ? 0 : keys.size() - 1];
+        position = key.position;
+        lookAt = key.lookAt;
+    } else {
+        const CameraKeyframe &a = keys[next - 1];
+        const CameraKeyframe &b = keys[next];
+        float u = (frame - a.frame) / (float)(b.frame - a.frame);
+        position = glm::mix(a.position, b.position, u);
+        lookAt = glm::mix(a.lookAt, b.lookAt, u);
+    }
+}
+
+/**
+ * Moves the camera to `frame` of its KEYFRAME path. With a SHUTTER, its
+ * motion is the translation over the open shutter; the rotation over it
+ * is not blurred.
+ */
+void Scene::setCameraFrame(int frame) {
+    const std::vector<CameraKeyframe> &keys = state.keyframes;
+    if (keys.empty()) {
+        return;
+    }
+    Camera &camera = state.camera;
+    keyframePose(keys, (float)frame, camera.position, camera.lookAt);
+    camera.motion = glm::vec3(0.0f);
+    if (state.shutter > 0.0f) {
+        glm::vec3 closePosition, closeLookAt;
+        keyframePose(keys, frame + state.shutter, closePosition, closeLookAt);
+        camera.motion = closePosition - camera.position;
+    }
+    orientCamera(camera, sceneUp);
+}
+
+/**
+ * Each geom's pose is interpolated linearly between its surrounding
+ * keyframes, rotation angles included, and held outside their range like
+ * the camera's. The host keeps its transforms and device records current
+ * for the lights and any later edit, but leaves the top-level BVH to the
+ * GPU refit.
+ */
+vector<GeomTransform> Scene::setGeomFrame(int frame) {
+    vector<GeomTransform> transforms;
+    bool lightsMoved = false;
+    for (size_t begin = 0, end = 0; begin < geomKeyframes.size(); begin = end) {
+        const int index = geomKeyframes[begin].geom;
+        while (end < geomKeyframes.size() && geomKeyframes[end].geom == index) {
+            end++;
+        }
+        size_t next = begin;
+        while (next < end && geomKeyframes[next].frame < frame) {
+            next++;
+        }
+        Geom &geom = geoms[index];
+        if (next == begin || next == end) {
+            const GeomKeyframe &key = geomKeyframes[next == begin ? begin : end - 1];
+            geom.translation = key.translation;
+            geom.rotation = key.rotation;
+            geom.scale = key.scale;
+        } else {
+            const GeomKeyframe &a = geomKeyframes[next - 1];
+            const GeomKeyframe &b = geomKeyframes[next];
+            float u = (frame - a.frame) / (float)(b.frame - a.frame);
+            geom.translation = glm::mix(a.translation, b.translation, u);
+            geom.rotation = glm::mix(a.rotation, b.rotation, u);
+            geom.scale = glm::mix(a.scale, b.scale, u);
+        }
+        finishGeom(geom);
+        const int lightIndex = deviceGeoms[index].lightIndex;
+        buildDeviceGeom(geom, deviceGeoms[index]);
+        deviceGeoms[index].lightIndex = lightIndex;
+        lightsMoved = lightsMoved || lightIndex >= 0;
+
+        GeomTransform transform;
+        transform.geom = index;
+        transform.type = geom.type;
+        transform.translation = geom.translation;
+        transform.rotation = geom.rotation;
+        transform.scale = geom.scale;
+        transforms.push_back(transform);
+    }
+    if (lightsMoved) {
+        rebuildLights();
+    }
+    return transforms;
+}
+
+void Scene::setCamera(glm::vec3 position, glm::vec3 lookAt, glm::vec3 up) {
+    state.camera.position = position;
+    state.camera.lookAt = lookAt;
+    orientCamera(state.camera, up);
+}
+
+void Scene::setResolution(glm::ivec2 resolution) {
+    Camera &camera = state.camera;
+    camera.resolution = resolution;
+    float yscaled = tan(camera.fov.y * (PI / 180));
+    float xscaled = (yscaled * camera.resolution.x) / camera.resolution.y;
+    camera.fov.x = (atan(xscaled) * 180) / PI;
+    camera.pixelLength = glm::vec2(2 * xscaled / (float)camera.resolution.x
+        , 2 * yscaled / (float)camera.resolution.y);
+    state.image.assign(camera.resolution.x * camera.resolution.y * state.viewCount(), glm::vec3());
+}
+
 int Scene::loadCamera() {
     cout << "Loading Camera ..." << endl;
     RenderState &state = this->state;
     Camera &camera = state.camera;
     float fovy;
+    camera.lensRadius = 0.0f;
+    camera.focalDistance = 0.0f;
+    camera.motion = glm::vec3(0.0f);
+    state.shutter = 0.0f;
+    state.eyeSeparation = 0.0f;
+    state.targetError = 0.0f;
+    state.timeLimit = 0.0f;
 
     //load static properties
     for (int i = 0; i < 5; i++) {
-        string line;
-        utilityCore::safeGetline(fp_in, line);
-        vector<string> tokens = utilityCore::tokenizeString(line);
-        if (strcmp(tokens[0].c_str(), "RES") == 0) {
-            camera.resolution.x = atoi(tokens[1].c_str());
-            camera.resolution.y = atoi(tokens[2].c_str());
-        } else if (strcmp(tokens[0].c_str(), "FOVY") == 0) {
-            fovy = atof(tokens[1].c_str());
-        } else if (strcmp(tokens[0].c_str(), "ITERATIONS") == 0) {
-            state.iterations = atoi(tokens[1].c_str());
-        } else if (strcmp(tokens[0].c_str(), "DEPTH") == 0) {
-            state.traceDepth = atoi(tokens[1].c_str());
-        } else if (strcmp(tokens[0].c_str(), "FILE") == 0) {
-            state.imageName = tokens[1];
-        }
-    }
-
-    string line;
-    utilityCore::safeGetline(fp_in, line);
-    while (!line.empty() && fp_in.good()) {
-        vector<string> tokens = utilityCore::tokenizeString(line);
-        if (strcmp(tokens[0].c_str(), "EYE") == 0) {
-            camera.position = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
-        } else if (strcmp(tokens[0].c_str(), "LOOKAT") == 0) {
-            camera.lookAt = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
-        } else if (strcmp(tokens[0].c_str(), "UP") == 0) {
-            camera.up = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
-        }
-
-        utilityCore::safeGetline(fp_in, line);
+        lines.nextLine();
+        if (lines[0].is("RES")) {
+            camera.resolution.x = lines[1].toInt();
+            camera.resolution.y = lines[2].toInt();
+        } else if (lines[0].is("FOVY")) {
+            fovy = lines[1].toFloat();
+        } else if (lines[0].is("ITERATIONS")) {
+            state.iterations = lines[1].toInt();
+        } else if (lines[0].is("DEPTH")) {
+            state.traceDepth = lines[1].toInt();
+        } else if (lines[0].is("FILE")) {
+            state.imageName = lines[1].str();
+        }
+    }
+
+    while (lines.nextLine() && !lines.empty()) {
+        if (lines[0].is("EYE")) {
+            camera.position = vec3Tokens(lines);
+        } else if (lines[0].is("LOOKAT")) {
+            camera.lookAt = vec3Tokens(lines);
+        } else if (lines[0].is("UP")) {
+            camera.up = vec3Tokens(lines);
+        } else if (lines[0].is("KEYFRAME") && lines.size() >= 8) {
+            // KEYFRAME frame eyeX eyeY eyeZ lookAtX lookAtY lookAtZ
+            CameraKeyframe keyframe;
+            keyframe.frame = lines[1].toInt();
+            keyframe.position = vec3Tokens(lines, 2);
+            keyframe.lookAt = vec3Tokens(lines, 5);
+            state.keyframes.push_back(keyframe);
+        } else if (lines[0].is("APERTURE")) {
+            // APERTURE radius
+            camera.lensRadius = std::max(lines[1].toFloat(), 0.0f);
+        } else if (lines[0].is("FOCALDIST")) {
+            camera.focalDistance = lines[1].toFloat();
+        } else if (lines[0].is("MOTION")) {
+            // MOTION dx dy dz: how far the camera moves while the shutter is open
+            camera.motion = vec3Tokens(lines);
+        } else if (lines[0].is("SHUTTER")) {
+            // SHUTTER frames: with KEYFRAMEs, blur over this much of the camera path
+            state.shutter = std::max(lines[1].toFloat(), 0.0f);
+        } else if (lines[0].is("STEREO")) {
+            // STEREO separation: render a left and a right eye this far apart
+            state.eyeSeparation = std::max(lines[1].toFloat(), 0.0f);
+        } else if (lines[0].is("TARGETERROR")) {
+            // TARGETERROR e: headless, stop once the relative error is estimated below e
+            state.targetError = std::max(lines[1].toFloat(), 0.0f);
+        } else if (lines[0].is("TIMELIMIT")) {
+            // TIMELIMIT seconds: headless, stop tracing after this long
+            state.timeLimit = std::max(lines[1].toFloat(), 0.0f);
+        }
+    }
+    std::sort(state.keyframes.begin(), state.keyframes.end(),
+        [](const CameraKeyframe &a, const CameraKeyframe &b) { return a.frame < b.frame; });
+
+    // By default the LOOKAT point is in focus
+    if (camera.focalDistance <= 0.0f) {
+        camera.focalDistance = glm::length(camera.lookAt - camera.position);
     }
 
     //calculate fov based on resolution
@@ -135,14 +827,14 @@ int Scene::loadCamera() {
     float fovx = (atan(xscaled) * 180) / PI;
     camera.fov = glm::vec2(fovx, fovy);
 
-	camera.right = glm::normalize(glm::cross(camera.view, camera.up));
 	camera.pixelLength = glm::vec2(2 * xscaled / (float)camera.resolution.x
 							, 2 * yscaled / (float)camera.resolution.y);
 
-    camera.view = glm::normalize(camera.lookAt - camera.position);
+    sceneUp = camera.up;
+    orientCamera(camera, sceneUp);
 
     //set up render camera stuff
-    int arraylen = camera.resolution.x * camera.resolution.y;
+    int arraylen = camera.resolution.x * camera.resolution.y * state.viewCount();
     state.image.resize(arraylen);
     std::fill(state.image.begin(), state.image.end(), glm::vec3());
 
@@ -150,39 +842,921 @@ int Scene::loadCamera() {
     return 1;
 }
 
-int Scene::loadMaterial(string materialid) {
-    int id = atoi(materialid.c_str());
+int Scene::loadMaterial(int id) {
     if (id != materials.size()) {
         cout << "ERROR: MATERIAL ID does not match expected number of materials" << endl;
         return -1;
     } else {
         cout << "Loading Material " << id << "..." << endl;
-        Material newMaterial;
+        Material newMaterial = {};
+        newMaterial.albedoMap = -1;
+        newMaterial.normalMap = -1;
+        newMaterial.roughnessMap = -1;
 
         //load static properties
         for (int i = 0; i < 7; i++) {
-            string line;
-            utilityCore::safeGetline(fp_in, line);
-            vector<string> tokens = utilityCore::tokenizeString(line);
-            if (strcmp(tokens[0].c_str(), "RGB") == 0) {
-                glm::vec3 color( atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()) );
-                newMaterial.color = color;
-            } else if (strcmp(tokens[0].c_str(), "SPECEX") == 0) {
-                newMaterial.specular.exponent = atof(tokens[1].c_str());
-            } else if (strcmp(tokens[0].c_str(), "SPECRGB") == 0) {
-                glm::vec3 specColor(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
-                newMaterial.specular.color = specColor;
-            } else if (strcmp(tokens[0].c_str(), "REFL") == 0) {
-                newMaterial.hasReflective = atof(tokens[1].c_str());
-            } else if (strcmp(tokens[0].c_str(), "REFR") == 0) {
-                newMaterial.hasRefractive = atof(tokens[1].c_str());
-            } else if (strcmp(tokens[0].c_str(), "REFRIOR") == 0) {
-                newMaterial.indexOfRefraction = atof(tokens[1].c_str());
-            } else if (strcmp(tokens[0].c_str(), "EMITTANCE") == 0) {
-                newMaterial.emittance = atof(tokens[1].c_str());
+            lines.nextLine();
+            if (lines[0].is("RGB")) {
+                newMaterial.color = vec3Tokens(lines);
+            } else if (lines[0].is("SPECEX")) {
+                newMaterial.specular.exponent = lines[1].toFloat();
+            } else if (lines[0].is("SPECRGB")) {
+                newMaterial.specular.color = vec3Tokens(lines);
+            } else if (lines[0].is("REFL")) {
+                newMaterial.hasReflective = lines[1].toFloat();
+            } else if (lines[0].is("REFR")) {
+                newMaterial.hasRefractive = lines[1].toFloat();
+            } else if (lines[0].is("REFRIOR")) {
+                newMaterial.indexOfRefraction = lines[1].toFloat();
+            } else if (lines[0].is("EMITTANCE")) {
+                newMaterial.emittance = lines[1].toFloat();
+            }
+        }
+
+        // Optional texture maps, paths relative to the scene file
+        while (lines.nextLine() && !lines.empty()) {
+            if (lines[0].is("ALBEDOMAP")) {
+                newMaterial.albedoMap = queueTexture(sceneDirectory + lines[1].str(), true);
+            } else if (lines[0].is("NORMALMAP")) {
+                newMaterial.normalMap = queueTexture(sceneDirectory + lines[1].str(), false);
+            } else if (lines[0].is("ROUGHNESSMAP")) {
+                newMaterial.roughnessMap = queueTexture(sceneDirectory + lines[1].str(), false);
             }
         }
         materials.push_back(newMaterial);
         return 1;
     }
 }
+
+// Medium grid files start with this magic and int32 sample counts along x,
+// y and z (each at least 2), followed by the densities as floats, x
+// fastest, all little-endian; the MEDIUM block gives the box they span
+static const char MEDIUM_FILE_MAGIC[8] = { 'D', 'E', 'N', 'S', 'I', 'T', 'Y', '1' };
+#define MEDIUM_FILE_HEADER_BYTES 20
+// Voxels along each edge of a heterogeneous medium's majorant cells
+#define MEDIUM_MAJORANT_VOXELS 8
+
+/**
+ * Reads a medium's density grid into `voxels`, clamping negative densities
+ * to 0, and sets its resolution.
+ *
+ * @return false, with `error` set, if the file could not be read.
+ */
+static bool loadMediumGrid(const string &filename, Medium &medium, vector<float> &voxels, string &error) {
+    MappedFile file(filename);
+    if (file.data() == NULL) {
+        error = "could not read medium grid " + filename;
+        return false;
+    }
+    if (file.size() < MEDIUM_FILE_HEADER_BYTES
+            || memcmp(file.data(), MEDIUM_FILE_MAGIC, sizeof(MEDIUM_FILE_MAGIC)) != 0) {
+        error = filename + " is not a medium grid file";
+        return false;
+    }
+    int32_t resolution[3];
+    memcpy(resolution, file.data() + sizeof(MEDIUM_FILE_MAGIC), sizeof(resolution));
+    uint64_t count = 1;
+    for (int axis = 0; axis < 3; axis++) {
+        if (resolution[axis] < 2) {
+            error = "medium grid " + filename + " has an empty grid";
+            return false;
+        }
+        count *= (uint64_t)resolution[axis];
+    }
+    if (count > (uint64_t)INT_MAX || (file.size() - MEDIUM_FILE_HEADER_BYTES) / sizeof(float) < count) {
+        error = "medium grid " + filename + " is truncated";
+        return false;
+    }
+    medium.resolution = glm::ivec3(resolution[0], resolution[1], resolution[2]);
+    voxels.resize(count);
+    memcpy(voxels.data(), file.data() + MEDIUM_FILE_HEADER_BYTES, count * sizeof(float));
+    parallelFor((int)count, 65536, [&](int i) { voxels[i] = fmaxf(voxels[i], 0.0f); });
+    return true;
+}
+
+/**
+ * The majorants of a heterogeneous medium: its box split into cells of
+ * about MEDIUM_MAJORANT_VOXELS voxels a side, each bounded by the densest
+ * sample of the voxels it overlaps, as trilinear interpolation never
+ * exceeds its corners.
+ */
+static void buildMajorants(const Medium &medium, const vector<float> &voxels, vector<float> &majorants) {
+    const glm::ivec3 res = medium.resolution;
+    const glm::ivec3 cells = medium.majorantResolution;
+    majorants.assign(cells.x * cells.y * cells.z, 0.0f);
+    parallelFor(cells.z, 1, [&](int z) {
+        glm::ivec3 lo, hi;
+        lo.z = (int)floorf((float)z * (res.z - 1) / cells.z);
+        hi.z = std::min((int)ceilf((float)(z + 1) * (res.z - 1) / cells.z), res.z - 1);
+        for (int y = 0; y < cells.y; y++) {
+            lo.y = (int)floorf((float)y * (res.y - 1) / cells.y);
+            hi.y = std::min((int)ceilf((float)(y + 1) * (res.y - 1) / cells.y), res.y - 1);
+            for (int x = 0; x < cells.x; x++) {
+                lo.x = (int)floorf((float)x * (res.x - 1) / cells.x);
+                hi.x = std::min((int)ceilf((float)(x + 1) * (res.x - 1) / cells.x), res.x - 1);
+                float densest = 0.0f;
+                for (int k = lo.z; k <= hi.z; k++) {
+                    for (int j = lo.y; j <= hi.y; j++) {
+                        for (int i = lo.x; i <= hi.x; i++) {
+                            densest = fmaxf(densest, voxels[((size_t)k * res.y + j) * res.x + i]);
+                        }
+                    }
+                }
+                majorants[(z * cells.y + y) * cells.x + x] = medium.density * densest;
+            }
+        }
+    });
+}
+
+/**
+ * A MEDIUM block: the box (MIN, MAX) it fills, its DENSITY (extinction per
+ * world unit, 1 by default), scattering ALBEDO (1), phase asymmetry G (0)
+ * and optionally a GRID file of densities over the box that DENSITY
+ * scales; without one the medium is homogeneous.
+ */
+int Scene::loadMedium(int id) {
+    if (id != media.size()) {
+        cout << "ERROR: MEDIUM ID does not match expected number of media" << endl;
+        return -1;
+    }
+    cout << "Loading Medium " << id << "..." << endl;
+    Medium medium = {};
+    medium.density = 1.0f;
+    medium.albedo = glm::vec3(1.0f);
+    medium.voxelOffset = -1;
+    string gridFile;
+    while (lines.nextLine() && !lines.empty()) {
+        if (lines[0].is("MIN")) {
+            medium.boundsMin = vec3Tokens(lines);
+        } else if (lines[0].is("MAX")) {
+            medium.boundsMax = vec3Tokens(lines);
+        } else if (lines[0].is("DENSITY")) {
+            medium.density = fmaxf(lines[1].toFloat(), 0.0f);
+        } else if (lines[0].is("ALBEDO")) {
+            medium.albedo = glm::clamp(vec3Tokens(lines), 0.0f, 1.0f);
+        } else if (lines[0].is("G")) {
+            medium.g = glm::clamp(lines[1].toFloat(), -0.99f, 0.99f);
+        } else if (lines[0].is("GRID") && lines.size() >= 2) {
+            gridFile = sceneDirectory + lines[1].str();
+        }
+    }
+    if (!glm::all(glm::lessThan(medium.boundsMin, medium.boundsMax))) {
+        cout << "ERROR: medium " << id << " has an empty box" << endl;
+        return -1;
+    }
+
+    medium.majorantOffset = mediumMajorants.size();
+    if (gridFile.empty()) {
+        medium.majorantResolution = glm::ivec3(1);
+        mediumMajorants.push_back(medium.density);
+    } else {
+        sourceFiles.push_back(gridFile);
+        vector<float> voxels;
+        string error;
+        if (!loadMediumGrid(gridFile, medium, voxels, error)) {
+            cout << "ERROR: " << error << endl;
+            return -1;
+        }
+        medium.majorantResolution = glm::max((medium.resolution - 1 + MEDIUM_MAJORANT_VOXELS - 1)
+            / MEDIUM_MAJORANT_VOXELS, glm::ivec3(1));
+        vector<float> majorants;
+        buildMajorants(medium, voxels, majorants);
+        medium.voxelOffset = mediumVoxels.size();
+        mediumVoxels.insert(mediumVoxels.end(), voxels.begin(), voxels.end());
+        mediumMajorants.insert(mediumMajorants.end(), majorants.begin(), majorants.end());
+        const glm::ivec3 res = medium.resolution;
+        cout << "Loaded " << gridFile << ": " << res.x << "x" << res.y << "x" << res.z << " densities" << endl;
+    }
+    media.push_back(medium);
+    return 1;
+}
+
+// An OBJ face corner's position, texture coordinate and normal indices
+typedef glm::ivec3 ObjCorner;
+
+struct ObjCornerLess {
+    bool operator()(const ObjCorner &a, const ObjCorner &b) const {
+        return a.x != b.x ? a.x < b.x : (a.y != b.y ? a.y < b.y : a.z < b.z);
+    }
+};
+
+// The vertex data an OBJ file lists, before faces index it
+struct ObjVertices {
+    vector<glm::vec3> positions;
+    vector<glm::vec2> uvs;
+    vector<glm::vec3> normals;
+};
+
+/**
+ * Resolves one OBJ face corner ("v", "v/vt", "v//vn" or "v/vt/vn", indices
+ * 1-based or negative-relative) to a vertex of the mesh, reusing vertices
+ * that have the same position, texture coordinate and normal.
+ */
+static int objVertex(const Token &corner, const ObjVertices &in, map<ObjCorner, int, ObjCornerLess> &vertexIds,
+        vector<glm::vec3> &outPositions, vector<glm::vec2> &outUVs, vector<glm::vec3> &outNormals) {
+    int v = corner.toInt();
+    int vt = 0;
+    int vn = 0;
+    const char *firstSlash = std::find(corner.begin, corner.end, '/');
+    if (firstSlash != corner.end) {
+        Token uv = { firstSlash + 1, corner.end };
+        vt = uv.toInt();
+        const char *secondSlash = std::find(firstSlash + 1, corner.end, '/');
+        if (secondSlash != corner.end) {
+            Token normal = { secondSlash + 1, corner.end };
+            vn = normal.toInt();
+        }
+    }
+    v = v < 0 ? (int)in.positions.size() + v : v - 1;
+    vt = vt < 0 ? (int)in.uvs.size() + vt : vt - 1;
+    vn = vn < 0 ? (int)in.normals.size() + vn : vn - 1;
+    if (v < 0 || v >= (int)in.positions.size()) {
+        return -1;
+    }
+    if (vt >= (int)in.uvs.size()) {
+        vt = -1;
+    }
+    if (vn >= (int)in.normals.size()) {
+        vn = -1;
+    }
+
+    ObjCorner key(v, vt, vn);
+    map<ObjCorner, int, ObjCornerLess>::iterator it = vertexIds.find(key);
+    if (it != vertexIds.end()) {
+        return it->second;
+    }
+    int id = outPositions.size();
+    outPositions.push_back(in.positions[v]);
+    outUVs.push_back(vt >= 0 ? in.uvs[vt] : glm::vec2(0.0f));
+    outNormals.push_back(vn >= 0 ? in.normals[vn] : glm::vec3(0.0f));
+    vertexIds[key] = id;
+    return id;
+}
+
+// A mesh as loaded from its file, with vertex, triangle and node indices
+// local to it until Scene::loadMeshes appends it to the shared arrays
+struct ObjMesh {
+    Mesh mesh;
+    vector<BVHNode> nodes;
+    vector<WideBVHNode> wideNodes;     // empty if the tree could not be collapsed
+    vector<glm::ivec3> triangles;
+    vector<glm::vec3> positions;
+    vector<glm::vec3> normals;
+    vector<glm::vec2> uvs;
+    string error;
+    float bvhBuildMs;
+};
+
+/**
+ * Builds the object-space BVH of a mesh and its 4-wide collapse, and
+ * reorders its triangles into leaf order.
+ */
+static void buildMeshBVH(ObjMesh &obj, BVHBuilder builder) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    vector<AABB> bounds(obj.triangles.size());
+    for (size_t i = 0; i < obj.triangles.size(); i++) {
+        bounds[i] = BVH::emptyBounds();
+        for (int k = 0; k < 3; k++) {
+            BVH::growBounds(bounds[i], obj.positions[obj.triangles[i][k]]);
+        }
+    }
+
+    vector<int> order;
+    BVH::build(bounds, obj.nodes, order, 4, builder);
+
+    vector<glm::ivec3> sorted(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        sorted[i] = obj.triangles[order[i]];
+    }
+    obj.triangles.swap(sorted);
+    obj.mesh.triangleCount = obj.triangles.size();
+    BVH::collapseWide(obj.nodes, obj.wideNodes);
+    obj.bvhBuildMs = msSince(start);
+}
+
+// Moves `obj`'s positions onto its vertex grid, if it has one (see setMeshGrid)
+static void snapToMeshGrid(ObjMesh &obj) {
+    if (obj.mesh.gridStep == glm::vec3(0.0f)) {
+        return;
+    }
+    for (size_t i = 0; i < obj.positions.size(); i++) {
+        obj.positions[i] = meshGridPoint(obj.mesh, meshGridCoordinates(obj.mesh, obj.positions[i]));
+    }
+}
+
+/**
+ * With `compact` (Scene::compactMeshes), spans a loaded mesh's 16-bit
+ * vertex grid over the box of its positions and snaps them to it before
+ * its BVH is built, so the coordinates a compact upload stores decode to
+ * exactly the vertices the BVH bounds. Its levels of detail inherit the
+ * grid, which their averaged vertices stay inside.
+ */
+static void setMeshGrid(ObjMesh &obj, bool compact) {
+    obj.mesh.gridOrigin = glm::vec3(0.0f);
+    obj.mesh.gridStep = glm::vec3(0.0f);
+    if (!compact) {
+        return;
+    }
+    AABB box = BVH::emptyBounds();
+    for (size_t i = 0; i < obj.positions.size(); i++) {
+        BVH::growBounds(box, obj.positions[i]);
+    }
+    obj.mesh.gridOrigin = box.min;
+    obj.mesh.gridStep = (box.max - box.min) / 65535.0f;
+    snapToMeshGrid(obj);
+}
+
+// Meshes get coarser versions for PathtraceOptions::meshLOD down to this
+// many triangles, at most MESH_LOD_MAX_LEVELS of them
+#define MESH_LOD_MIN_TRIANGLES 64
+#define MESH_LOD_MAX_LEVELS 8
+
+/**
+ * A coarser version of `base` by vertex clustering (Rossignac & Borrel
+ * 1993): the vertices in each `cell`-wide grid cell merge into one at
+ * their mean position and uv, with their summed normal, and triangles
+ * left with fewer than three distinct vertices are dropped. Mean uvs
+ * smear across texture seams, which the wide footprints that pick coarse
+ * levels blur anyway.
+ */
+static void clusterMesh(const ObjMesh &base, float cell, ObjMesh &out) {
+    const size_t n = base.positions.size();
+    vector<std::pair<uint64_t, int> > keys(n);
+    for (size_t i = 0; i < n; i++) {
+        glm::ivec3 c = glm::clamp(glm::ivec3(glm::floor(base.positions[i] / cell)),
+            glm::ivec3(-(1 << 20)), glm::ivec3((1 << 20) - 1));
+        uint64_t key = (uint64_t)(c.x + (1 << 20)) << 42 | (uint64_t)(c.y + (1 << 20)) << 21
+            | (uint64_t)(c.z + (1 << 20));
+        keys[i] = std::make_pair(key, (int)i);
+    }
+    std::sort(keys.begin(), keys.end());
+    vector<int> cluster(n);
+    int clusters = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0 && keys[i].first != keys[i - 1].first) {
+            clusters++;
+        }
+        cluster[keys[i].second] = clusters;
+    }
+    clusters += n > 0 ? 1 : 0;
+
+    const bool normals = base.normals.size() == n;
+    const bool uvs = base.uvs.size() == n;
+    vector<int> count(clusters, 0);
+    out.mesh = base.mesh;
+    out.positions.assign(clusters, glm::vec3(0.0f));
+    out.normals.assign(normals ? clusters : 0, glm::vec3(0.0f));
+    out.uvs.assign(uvs ? clusters : 0, glm::vec2(0.0f));
+    for (size_t i = 0; i < n; i++) {
+        int c = cluster[i];
+        count[c]++;
+        out.positions[c] += base.positions[i];
+        if (normals) {
+            out.normals[c] += base.normals[i];
+        }
+        if (uvs) {
+            out.uvs[c] += base.uvs[i];
+        }
+    }
+    for (int c = 0; c < clusters; c++) {
+        out.positions[c] /= (float)count[c];
+        if (normals) {
+            float length = glm::length(out.normals[c]);
+            out.normals[c] = length > 0.0f ? out.normals[c] / length : glm::vec3(0.0f, 0.0f, 1.0f);
+        }
+        if (uvs) {
+            out.uvs[c] /= (float)count[c];
+        }
+    }
+    out.triangles.clear();
+    for (size_t t = 0; t < base.triangles.size(); t++) {
+        glm::ivec3 tri(cluster[base.triangles[t].x], cluster[base.triangles[t].y], cluster[base.triangles[t].z]);
+        if (tri.x != tri.y && tri.y != tri.z && tri.z != tri.x) {
+            out.triangles.push_back(tri);
+        }
+    }
+}
+
+/**
+ * The coarser versions of `base`, finest first, each with its own BVH:
+ * clusterings with cells of twice the mean edge length, doubling per
+ * level, until a level would keep fewer than MESH_LOD_MIN_TRIANGLES
+ * triangles. Sets base's lodCount and lodCellSize to match.
+ */
+static void buildMeshLODs(ObjMesh &base, BVHBuilder builder, vector<ObjMesh> &lods) {
+    double edges = 0.0;
+    for (size_t t = 0; t < base.triangles.size(); t++) {
+        for (int k = 0; k < 3; k++) {
+            edges += glm::length(base.positions[base.triangles[t][(k + 1) % 3]]
+                - base.positions[base.triangles[t][k]]);
+        }
+    }
+    const float firstCell = 2.0f * (float)(edges / (3.0 * base.triangles.size()));
+    float cell = firstCell;
+    while (lods.size() < MESH_LOD_MAX_LEVELS && cell > 0.0f) {
+        ObjMesh lod;
+        clusterMesh(base, cell, lod);
+        if (lod.triangles.size() < MESH_LOD_MIN_TRIANGLES) {
+            break;
+        }
+        lod.mesh.lodCount = 0;
+        lod.mesh.lodLevel = lods.size() + 1;
+        lod.mesh.lodCellSize = cell;
+        snapToMeshGrid(lod);
+        buildMeshBVH(lod, builder);
+        lods.push_back(lod);
+        cell *= 2.0f;
+    }
+    base.mesh.lodCount = lods.size();
+    base.mesh.lodLevel = 0;
+    base.mesh.lodCellSize = lods.empty() ? 0.0f : firstCell;
+}
+
+/**
+ * Loads a Wavefront OBJ file and builds its BVH, on the vertex grid with
+ * `compact`. Polygons are triangulated as fans; groups and materials are
+ * ignored. Only
+ * touches `out`, so meshes load in parallel.
+ *
+ * @return false, with out.error set, if the file could not be read.
+ */
+static bool loadObj(const string &filename, BVHBuilder builder, bool compact, ObjMesh &out) {
+    MappedFile file(filename);
+    if (file.data() == NULL) {
+        out.error = "could not read mesh " + filename;
+        return false;
+    }
+
+    ObjVertices vertices;
+    map<ObjCorner, int, ObjCornerLess> vertexIds;
+    bool hasNormals = true;
+    bool hasUVs = true;
+
+    LineTokenizer obj(file.data(), file.size());
+    vector<int> face;
+    while (obj.nextLine()) {
+        if (obj[0].is("v") && obj.size() >= 4) {
+            vertices.positions.push_back(vec3Tokens(obj));
+        } else if (obj[0].is("vt") && obj.size() >= 3) {
+            vertices.uvs.push_back(glm::vec2(obj[1].toFloat(), obj[2].toFloat()));
+        } else if (obj[0].is("vn") && obj.size() >= 4) {
+            vertices.normals.push_back(vec3Tokens(obj));
+        } else if (obj[0].is("f") && obj.size() >= 4) {
+            face.clear();
+            for (size_t i = 1; i < obj.size(); i++) {
+                int id = objVertex(obj[i], vertices, vertexIds, out.positions, out.uvs, out.normals);
+                if (id < 0) {
+                    out.error = "bad face vertex " + obj[i].str() + " in " + filename;
+                    return false;
+                }
+                const char *firstSlash = std::find(obj[i].begin, obj[i].end, '/');
+                if (std::count(obj[i].begin, obj[i].end, '/') < 2) {
+                    hasNormals = false;
+                }
+                if (firstSlash == obj[i].end || firstSlash + 1 == obj[i].end || firstSlash[1] == '/') {
+                    hasUVs = false;
+                }
+                face.push_back(id);
+            }
+            for (size_t i = 1; i + 1 < face.size(); i++) {
+                out.triangles.push_back(glm::ivec3(face[0], face[i], face[i + 1]));
+            }
+        }
+    }
+
+    if (out.triangles.empty()) {
+        out.error = "mesh " + filename + " has no faces";
+        return false;
+    }
+
+    out.mesh.hasNormals = hasNormals && !vertices.normals.empty();
+    out.mesh.hasUVs = hasUVs && !vertices.uvs.empty();
+    setMeshGrid(out, compact);
+    buildMeshBVH(out, builder);
+    return true;
+}
+
+// Mesh id of `filename`; geoms sharing a file share its mesh
+int Scene::queueMesh(const string &filename) {
+    map<string, int>::iterator it = meshIds.find(filename);
+    if (it != meshIds.end()) {
+        return it->second;
+    }
+    int id = meshFiles.size();
+    meshIds[filename] = id;
+    meshFiles.push_back(filename);
+    sourceFiles.push_back(filename);
+    return id;
+}
+
+/**
+ * Loads every queued mesh, one per thread, then appends them to the shared
+ * mesh arrays in mesh id order, each followed by its levels of detail.
+ * Geoms whose mesh failed to load are dropped.
+ *
+ * @return false if any mesh failed.
+ */
+bool Scene::loadMeshes() {
+    vector<ObjMesh> loaded(meshFiles.size());
+    vector<vector<ObjMesh> > lods(meshFiles.size());
+    vector<char> ok(meshFiles.size());
+    parallelFor((int)meshFiles.size(), 1, [&](int i) {
+        ok[i] = loadObj(meshFiles[i], bvhBuilder, compactMeshes, loaded[i]);
+        if (ok[i]) {
+            buildMeshLODs(loaded[i], bvhBuilder, lods[i]);
+        }
+    });
+
+    auto append = [&](const ObjMesh &obj) {
+        Mesh mesh = obj.mesh;
+        mesh.bvhRoot = meshBvhNodes.size();
+        mesh.triangleOffset = meshTriangles.size();
+        const int vertexOffset = meshPositions.size();
+        for (size_t n = 0; n < obj.nodes.size(); n++) {
+            BVHNode node = obj.nodes[n];
+            node.offset += node.count > 0 ? mesh.triangleOffset : mesh.bvhRoot;
+            meshBvhNodes.push_back(node);
+        }
+        mesh.wideRoot = obj.wideNodes.empty() ? -1 : (int)meshWideNodes.size();
+        for (size_t n = 0; n < obj.wideNodes.size(); n++) {
+            WideBVHNode node = obj.wideNodes[n];
+            for (int c = 0; c < node.childCount; c++) {
+                node.child[c] += node.triangleCount[c] > 0 ? mesh.triangleOffset : mesh.wideRoot;
+            }
+            meshWideNodes.push_back(node);
+        }
+        for (size_t t = 0; t < obj.triangles.size(); t++) {
+            const glm::ivec3 &triangle = obj.triangles[t];
+            meshTriangles.push_back(triangle + vertexOffset);
+            const glm::vec3 &p0 = obj.positions[triangle.x];
+            const glm::vec3 &p1 = obj.positions[triangle.y];
+            const glm::vec3 &p2 = obj.positions[triangle.z];
+            TriangleRecord record;
+            record.p0 = make_float4(p0.x, p0.y, p0.z, 0.0f);
+            record.p1 = make_float4(p1.x, p1.y, p1.z, 0.0f);
+            record.p2 = make_float4(p2.x, p2.y, p2.z, 0.0f);
+            meshTriangleRecords.push_back(record);
+        }
+        meshPositions.insert(meshPositions.end(), obj.positions.begin(), obj.positions.end());
+        meshNormals.insert(meshNormals.end(), obj.normals.begin(), obj.normals.end());
+        meshUVs.insert(meshUVs.end(), obj.uvs.begin(), obj.uvs.end());
+        bvhBuildMs += obj.bvhBuildMs;
+        meshes.push_back(mesh);
+    };
+
+    vector<int> meshRemap(meshFiles.size(), -1);
+    for (size_t i = 0; i < loaded.size(); i++) {
+        ObjMesh &obj = loaded[i];
+        if (!ok[i]) {
+            cout << "ERROR: " << obj.error << endl;
+            continue;
+        }
+        cout << "Loaded " << meshFiles[i] << ": " << obj.mesh.triangleCount << " triangles, "
+            << obj.positions.size() << " vertices, " << lods[i].size() << " levels of detail, BVH built in "
+            << obj.bvhBuildMs << " ms" << endl;
+        meshRemap[i] = meshes.size();
+        append(obj);
+        for (size_t l = 0; l < lods[i].size(); l++) {
+            append(lods[i][l]);
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < geoms.size(); i++) {
+        if (geoms[i].type == MESH) {
+            geoms[i].meshid = meshRemap[geoms[i].meshid];
+            if (geoms[i].meshid < 0) {
+                continue;
+            }
+        }
+        geoms[kept++] = geoms[i];
+    }
+    bool allLoaded = kept == geoms.size();
+    geoms.resize(kept);
+    return allLoaded;
+}
+
+// Sphere files start with this magic and a uint64 sphere count, followed by
+// that many 20-byte records laid out as CloudSphere, all little-endian
+static const char SPHERE_FILE_MAGIC[8] = { 'S', 'P', 'H', 'E', 'R', 'E', 'S', '1' };
+#define SPHERE_FILE_HEADER_BYTES 16
+
+// A sphere cloud as loaded, before it joins the shared cloud arrays
+struct LoadedCloud {
+    vector<CloudSphere> spheres;    // in leaf order of `nodes`
+    vector<BVHNode> nodes;
+    string error;
+    float bvhBuildMs;
+};
+
+/**
+ * Reads a sphere file and builds the cloud's object-space BVH, with its
+ * spheres reordered into leaf order. Material ids outside [0,
+ * materialCount) fall back to the geom's material.
+ *
+ * @return false, with out.error set, if the file could not be read.
+ */
+static bool loadSphereFile(const string &filename, int materialCount, BVHBuilder builder, LoadedCloud &out) {
+    MappedFile file(filename);
+    if (file.data() == NULL) {
+        out.error = "could not read sphere cloud " + filename;
+        return false;
+    }
+    uint64_t count = 0;
+    if (file.size() < SPHERE_FILE_HEADER_BYTES
+            || memcmp(file.data(), SPHERE_FILE_MAGIC, sizeof(SPHERE_FILE_MAGIC)) != 0) {
+        out.error = filename + " is not a sphere file";
+        return false;
+    }
+    memcpy(&count, file.data() + sizeof(SPHERE_FILE_MAGIC), sizeof(count));
+    if (count == 0 || count > (uint64_t)INT_MAX
+            || (file.size() - SPHERE_FILE_HEADER_BYTES) / sizeof(CloudSphere) < count) {
+        out.error = "sphere file " + filename + " is empty or truncated";
+        return false;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const CloudSphere *spheres = (const CloudSphere *)(file.data() + SPHERE_FILE_HEADER_BYTES);
+    vector<AABB> bounds(count);
+    parallelFor((int)count, 4096, [&](int i) {
+        CloudSphere sphere;
+        memcpy(&sphere, spheres + i, sizeof(sphere));
+        const float radius = fabsf(sphere.radius);
+        bounds[i].min = sphere.centre - radius;
+        bounds[i].max = sphere.centre + radius;
+    });
+
+    vector<int> order;
+    BVH::build(bounds, out.nodes, order, 4, builder);
+    vector<AABB>().swap(bounds);
+
+    out.spheres.resize(order.size());
+    parallelFor((int)order.size(), 4096, [&](int i) {
+        CloudSphere sphere;
+        memcpy(&sphere, spheres + order[i], sizeof(sphere));
+        sphere.radius = fabsf(sphere.radius);
+        if (sphere.materialid >= materialCount) {
+            sphere.materialid = -1;
+        }
+        out.spheres[i] = sphere;
+    });
+    out.bvhBuildMs = msSince(start);
+    return true;
+}
+
+// Cloud id of `filename`; geoms sharing a file share its cloud
+int Scene::queueSphereCloud(const string &filename) {
+    map<string, int>::iterator it = cloudIds.find(filename);
+    if (it != cloudIds.end()) {
+        return it->second;
+    }
+    int id = cloudFiles.size();
+    cloudIds[filename] = id;
+    cloudFiles.push_back(filename);
+    sourceFiles.push_back(filename);
+    return id;
+}
+
+/**
+ * Loads every queued sphere cloud, one per thread, then appends them to
+ * the shared cloud arrays in cloud id order, as loadMeshes does meshes.
+ * Geoms whose cloud failed to load are dropped.
+ *
+ * @return false if any cloud failed.
+ */
+bool Scene::loadSphereClouds() {
+    vector<LoadedCloud> loaded(cloudFiles.size());
+    vector<char> ok(cloudFiles.size());
+    parallelFor((int)cloudFiles.size(), 1, [&](int i) {
+        ok[i] = loadSphereFile(cloudFiles[i], (int)materials.size(), bvhBuilder, loaded[i]);
+    });
+
+    vector<int> cloudRemap(cloudFiles.size(), -1);
+    for (size_t i = 0; i < loaded.size(); i++) {
+        LoadedCloud &cloud = loaded[i];
+        if (!ok[i]) {
+            cout << "ERROR: " << cloud.error << endl;
+            continue;
+        }
+        cout << "Loaded " << cloudFiles[i] << ": " << cloud.spheres.size() << " spheres, BVH built in "
+            << cloud.bvhBuildMs << " ms" << endl;
+        bvhBuildMs += cloud.bvhBuildMs;
+        SphereCloud entry;
+        entry.bvhRoot = cloudBvhNodes.size();
+        entry.sphereOffset = cloudSpheres.size();
+        entry.sphereCount = cloud.spheres.size();
+        for (size_t n = 0; n < cloud.nodes.size(); n++) {
+            BVHNode node = cloud.nodes[n];
+            node.offset += node.count > 0 ? entry.sphereOffset : entry.bvhRoot;
+            cloudBvhNodes.push_back(node);
+        }
+        cloudSpheres.insert(cloudSpheres.end(), cloud.spheres.begin(), cloud.spheres.end());
+        cloudRemap[i] = sphereClouds.size();
+        sphereClouds.push_back(entry);
+        vector<CloudSphere>().swap(cloud.spheres);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < geoms.size(); i++) {
+        if (geoms[i].type == SPHERE_CLOUD) {
+            geoms[i].meshid = cloudRemap[geoms[i].meshid];
+            if (geoms[i].meshid < 0) {
+                continue;
+            }
+        }
+        geoms[kept++] = geoms[i];
+    }
+    bool allLoaded = kept == geoms.size();
+    geoms.resize(kept);
+    return allLoaded;
+}
+
+// SDF files start with this magic, int32 sample counts along x, y and z (each
+// at least 2) and the float corners of the box they span, min then max,
+// followed by the samples as floats, x fastest, all little-endian
+static const char SDF_FILE_MAGIC[8] = { 'S', 'D', 'F', 'G', 'R', 'I', 'D', '1' };
+#define SDF_FILE_HEADER_BYTES 44
+
+// An SDF volume as loaded, before it joins the shared voxel array
+struct LoadedSdf {
+    SdfVolume volume;
+    vector<float> voxels;
+    string error;
+};
+
+/**
+ * Reads an SDF file. Its samples sit on the corners of a grid over the
+ * box, so the voxel edges are the box's extent over resolution - 1.
+ *
+ * @return false, with out.error set, if the file could not be read.
+ */
+static bool loadSdfFile(const string &filename, LoadedSdf &out) {
+    MappedFile file(filename);
+    if (file.data() == NULL) {
+        out.error = "could not read SDF " + filename;
+        return false;
+    }
+    if (file.size() < SDF_FILE_HEADER_BYTES
+            || memcmp(file.data(), SDF_FILE_MAGIC, sizeof(SDF_FILE_MAGIC)) != 0) {
+        out.error = filename + " is not an SDF file";
+        return false;
+    }
+    int32_t resolution[3];
+    float corners[6];
+    memcpy(resolution, file.data() + sizeof(SDF_FILE_MAGIC), sizeof(resolution));
+    memcpy(corners, file.data() + sizeof(SDF_FILE_MAGIC) + sizeof(resolution), sizeof(corners));
+    uint64_t count = 1;
+    for (int axis = 0; axis < 3; axis++) {
+        if (resolution[axis] < 2 || !(corners[axis + 3] > corners[axis])) {
+            out.error = "SDF file " + filename + " has an empty grid";
+            return false;
+        }
+        count *= (uint64_t)resolution[axis];
+    }
+    if (count > (uint64_t)INT_MAX
+            || (file.size() - SDF_FILE_HEADER_BYTES) / sizeof(float) < count) {
+        out.error = "SDF file " + filename + " is truncated";
+        return false;
+    }
+
+    SdfVolume &volume = out.volume;
+    volume.texture = 0;
+    volume.resolution = glm::ivec3(resolution[0], resolution[1], resolution[2]);
+    volume.boundsMin = glm::vec3(corners[0], corners[1], corners[2]);
+    volume.boundsMax = glm::vec3(corners[3], corners[4], corners[5]);
+    const glm::vec3 voxel = (volume.boundsMax - volume.boundsMin) / glm::vec3(volume.resolution - 1);
+    volume.voxelSize = glm::min(glm::min(voxel.x, voxel.y), voxel.z);
+    out.voxels.resize(count);
+    memcpy(out.voxels.data(), file.data() + SDF_FILE_HEADER_BYTES, count * sizeof(float));
+    return true;
+}
+
+// SDF id of `filename`; geoms sharing a file share its volume
+int Scene::queueSdf(const string &filename) {
+    map<string, int>::iterator it = sdfIds.find(filename);
+    if (it != sdfIds.end()) {
+        return it->second;
+    }
+    int id = sdfFiles.size();
+    sdfIds[filename] = id;
+    sdfFiles.push_back(filename);
+    sourceFiles.push_back(filename);
+    return id;
+}
+
+/**
+ * Loads every queued SDF, one per thread, then appends their samples to
+ * sdfVoxels in SDF id order, as loadSphereClouds does clouds. Geoms whose
+ * SDF failed to load are dropped.
+ *
+ * @return false if any SDF failed.
+ */
+bool Scene::loadSdfs() {
+    vector<LoadedSdf> loaded(sdfFiles.size());
+    vector<char> ok(sdfFiles.size());
+    parallelFor((int)sdfFiles.size(), 1, [&](int i) {
+        ok[i] = loadSdfFile(sdfFiles[i], loaded[i]);
+    });
+
+    vector<int> sdfRemap(sdfFiles.size(), -1);
+    for (size_t i = 0; i < loaded.size(); i++) {
+        LoadedSdf &sdf = loaded[i];
+        if (!ok[i]) {
+            cout << "ERROR: " << sdf.error << endl;
+            continue;
+        }
+        const glm::ivec3 res = sdf.volume.resolution;
+        cout << "Loaded " << sdfFiles[i] << ": " << res.x << "x" << res.y << "x" << res.z
+            << " distance samples" << endl;
+        sdf.volume.voxelOffset = sdfVoxels.size();
+        sdfVoxels.insert(sdfVoxels.end(), sdf.voxels.begin(), sdf.voxels.end());
+        sdfRemap[i] = sdfVolumes.size();
+        sdfVolumes.push_back(sdf.volume);
+        vector<float>().swap(sdf.voxels);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < geoms.size(); i++) {
+        if (geoms[i].type == SDF_VOLUME) {
+            geoms[i].meshid = sdfRemap[geoms[i].meshid];
+            if (geoms[i].meshid < 0) {
+                continue;
+            }
+        }
+        geoms[kept++] = geoms[i];
+    }
+    bool allLoaded = kept == geoms.size();
+    geoms.resize(kept);
+    return allLoaded;
+}
+
+// Texture id of `filename`; materials sharing a file and colour space share it
+int Scene::queueTexture(const string &filename, bool srgb) {
+    pair<string, bool> key(filename, srgb);
+    map<pair<string, bool>, int>::iterator it = textureIds.find(key);
+    if (it != textureIds.end()) {
+        return it->second;
+    }
+    if (textures.size() >= MAX_TEXTURES) {
+        cout << "ERROR: more than " << MAX_TEXTURES << " textures, ignoring " << filename << endl;
+        return -1;
+    }
+    int id = textures.size();
+    textureIds[key] = id;
+    TextureImage texture;
+    texture.filename = filename;
+    texture.srgb = srgb;
+    texture.format = TEXTURE_RGBA8;
+    texture.width = 0;
+    texture.height = 0;
+    textures.push_back(texture);
+    return id;
+}
+
+/**
+ * Decodes every queued texture and the environment map, one per thread.
+ * Materials lose the maps that failed to load, which keep an empty entry
+ * so ids stay valid; a failed environment leaves the background black.
+ *
+ * @return false if any texture failed.
+ */
+bool Scene::loadTextures() {
+    const int count = (int)textures.size();
+    vector<string> errors(count + 1);
+    vector<char> ok(count + 1, 1);
+    parallelFor(count + 1, 1, [&](int i) {
+        if (i < count) {
+            ok[i] = textureLoader::load(textures[i], errors[i]);
+        } else if (!environment.image.filename.empty()) {
+            ok[i] = textureLoader::loadEnvironment(environment, errors[i]);
+        }
+    });
+
+    bool allLoaded = true;
+    if (!environment.image.filename.empty()) {
+        if (ok[count]) {
+            cout << "Loaded environment map " << environment.image.filename << ": "
+                << environment.image.width << "x" << environment.image.height << endl;
+        } else {
+            cout << "ERROR: " << errors[count] << endl;
+            allLoaded = false;
+        }
+    }
+    for (size_t i = 0; i < textures.size(); i++) {
+        if (ok[i]) {
+            cout << "Loaded texture " << textures[i].filename << ": " << textures[i].width << "x"
+                << textures[i].height << ", " << textures[i].levels.size() << " mip levels" << endl;
+            continue;
+        }
+        cout << "ERROR: " << errors[i] << endl;
+        textures[i].levels.clear();
+        allLoaded = false;
+        for (size_t m = 0; m < materials.size(); m++) {
+            Material &material = materials[m];
+            material.albedoMap = material.albedoMap == (int)i ? -1 : material.albedoMap;
+            material.normalMap = material.normalMap == (int)i ? -1 : material.normalMap;
+            material.roughnessMap = material.roughnessMap == (int)i ? -1 : material.roughnessMap;
+        }
+    }
+    return allLoaded;
+}
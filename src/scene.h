@@ -1,5 +1,6 @@
 #pragma once
 
+#include <map>
 #include <vector>
 #include <sstream>
 #include <fstream>
@@ -7,20 +8,121 @@
 #include "glm/glm.hpp"
 #include "utilities.h"
 #include "sceneStructs.h"
+#include "sceneTokenizer.h"
+#include "bvh.h"
+#include "texture.h"
 
 using namespace std;
 
 class Scene {
 private:
-    ifstream fp_in;
-    int loadMaterial(string materialid);
-    int loadGeom(string objectid);
+    LineTokenizer lines;    // over the scene file while it is parsed
+    int loadMaterial(int id);
+    int loadGeom(int id);
     int loadCamera();
+    int loadMedium(int id);
+    int queueMesh(const string &filename);
+    bool loadMeshes();
+    int queueSphereCloud(const string &filename);
+    bool loadSphereClouds();
+    int queueSdf(const string &filename);
+    bool loadSdfs();
+    int queueTexture(const string &filename, bool srgb);
+    bool loadTextures();
+    vector<AABB> geomBounds() const;
+    void reorderGeoms();
+    void buildBVH();
+    void buildLights();
+    void buildLightTree();
+    // Binary cache of everything above, see sceneCache.cpp
+    bool readCache(const string &cacheFile);
+    void writeCache(const string &cacheFile) const;
+
+    string sceneDirectory;
+    glm::vec3 sceneUp;      // the camera's UP as given, before orthogonalizing
+    vector<string> sourceFiles;     // the scene file, its meshes, clouds, SDFs and media, for the cache
+    vector<string> meshFiles;       // by mesh id, loaded together by loadMeshes
+    map<string, int> meshIds;
+    vector<string> cloudFiles;      // by cloud id, loaded together by loadSphereClouds
+    map<string, int> cloudIds;
+    vector<string> sdfFiles;        // by SDF id, loaded together by loadSdfs
+    map<string, int> sdfIds;
+    map<pair<string, bool>, int> textureIds;
 public:
     Scene(string filename);
     ~Scene();
 
+    // Split strategy of the host BVHs of scenes constructed from now on
+    static BVHBuilder bvhBuilder;
+    // Whether scenes constructed from now on snap mesh vertices to 16-bit
+    // grids (see Mesh::gridOrigin) and upload them compact
+    static bool compactMeshes;
+    // Whether scenes constructed from now on sort their geoms by place and
+    // material rather than keeping the file's order (see reorderGeoms)
+    static bool coherentGeomOrder;
+
+    // Frames spanned by the camera's and geoms' KEYFRAMEs, or 0 for a still scene
+    int animationFrames() const;
+    void setCameraFrame(int frame);
+    /**
+     * Moves every geom with KEYFRAMEs to `frame` of its path, as moveGeom
+     * would but without refitting the top-level BVH, and returns their new
+     * poses for pathtraceAnimateGeoms to apply on the GPU.
+     */
+    vector<GeomTransform> setGeomFrame(int frame);
+    // Points the camera from `position` at `lookAt`, keeping its field of view
+    void setCamera(glm::vec3 position, glm::vec3 lookAt, glm::vec3 up);
+    // Renders at `resolution` instead of RES's, keeping the vertical field of view
+    void setResolution(glm::ivec2 resolution);
+    // Takes over another scene's top-level BVH, refit to this scene's geoms
+    void refitBVH(const vector<BVHNode> &nodes, const vector<int> &geomIndices);
+    // Lists the lights again after materials changed their emission
+    void rebuildLights();
+    // Applies an edit of geoms[index]'s translation, rotation or scale
+    void moveGeom(int index);
+
     std::vector<Geom> geoms;
+    std::vector<DeviceGeom> deviceGeoms;    // compact copy of geoms for upload
     std::vector<Material> materials;
+    std::vector<BVHNode> bvhNodes;
+    std::vector<int> bvhGeomIndices;
+    std::vector<GeomKeyframe> geomKeyframes;    // sorted by geom, then frame
+    std::vector<int> objectGeoms;           // by OBJECT id (of the geoms that loaded), its index in geoms
+    std::vector<Light> lights;              // emitters sampled directly, see buildLights
+    std::vector<LightNode> lightNodes;      // the light BVH over them, see buildLightTree
+
+    // Triangle meshes referenced by MESH geoms, with all their per-mesh
+    // BVHs, triangles and vertices concatenated so they upload as one array each
+    std::vector<Mesh> meshes;
+    std::vector<BVHNode> meshBvhNodes;
+    std::vector<WideBVHNode> meshWideNodes; // the same BVHs collapsed 4-wide
+    std::vector<glm::ivec3> meshTriangles;
+    std::vector<TriangleRecord> meshTriangleRecords;    // their vertices, for the intersection tests
+    std::vector<glm::vec3> meshPositions;
+    std::vector<glm::vec3> meshNormals;
+    std::vector<glm::vec2> meshUVs;
+    // Sphere clouds referenced by SPHERE_CLOUD geoms, concatenated the same way
+    std::vector<SphereCloud> sphereClouds;
+    std::vector<BVHNode> cloudBvhNodes;
+    std::vector<CloudSphere> cloudSpheres;
+    // Distance grids referenced by SDF_VOLUME geoms; the device samples
+    // sdfVoxels through one 3D texture per volume instead
+    std::vector<SdfVolume> sdfVolumes;
+    std::vector<float> sdfVoxels;
+    // Participating media, with their density grids and majorant cells
+    // concatenated; the device samples the grids through textures too
+    std::vector<Medium> media;
+    std::vector<float> mediumVoxels;
+    std::vector<float> mediumMajorants;
+    // Referenced by the materials' maps; the pixels are read from their
+    // files on every load, cached or not
+    std::vector<TextureImage> textures;
+    EnvironmentMap environment;
+    // Share of next-event estimation samples that go to the environment
+    float environmentPmf() const;
     RenderState state;
+
+    // Time of the top-level BVH build plus each mesh's (which overlap), as
+    // measured when the scene was parsed; a cached scene keeps that value
+    float bvhBuildMs;
 };
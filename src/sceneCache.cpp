@@ -0,0 +1,302 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "scene.h"
+#include "mappedFile.h"
+
+/**
+ * Binary cache of a parsed scene, written next to the scene file as
+ * SCENE.txt.cache. It holds every array Scene::Scene builds, the BVHs and
+ * light list included, in native byte order, and the names of the textures
+ * the materials use and of the environment map, whose pixels are always
+ * read afresh. It also records the size and modification time of the
+ * scene file and each mesh and sphere cloud it loaded: any change to those, or to the
+ * layout of a cached struct or to Scene::bvhBuilder, Scene::compactMeshes or Scene::coherentGeomOrder, makes the cache stale
+ * and the scene is parsed again.
+ */
+
+// Bumped whenever the layout below changes
+static const char CACHE_MAGIC[8] = { 'P', 'T', 'S', 'C', 'N', '0', '1', '5' };
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t structBytes[15];   // catches readers built with other struct layouts
+};
+
+static void cacheStructBytes(uint32_t bytes[15]) {
+    bytes[0] = sizeof(Geom);
+    bytes[1] = sizeof(DeviceGeom);
+    bytes[2] = sizeof(Material);
+    bytes[3] = sizeof(Light);
+    bytes[4] = sizeof(BVHNode);
+    bytes[5] = sizeof(Mesh);
+    bytes[6] = sizeof(Camera);
+    bytes[7] = sizeof(CameraKeyframe);
+    bytes[8] = sizeof(WideBVHNode);
+    bytes[9] = sizeof(SphereCloud);
+    bytes[10] = sizeof(CloudSphere);
+    bytes[11] = sizeof(SdfVolume);
+    bytes[12] = sizeof(Medium);
+    bytes[13] = sizeof(LightNode);
+    bytes[14] = sizeof(TriangleRecord);
+}
+
+// Appends values to a byte buffer; arrays and strings are count-prefixed
+struct CacheWriter {
+    vector<unsigned char> out;
+
+    void bytes(const void *data, size_t count) {
+        const unsigned char *p = (const unsigned char *)data;
+        out.insert(out.end(), p, p + count);
+    }
+
+    template <typename T>
+    void value(const T &v) {
+        bytes(&v, sizeof(T));
+    }
+
+    template <typename T>
+    void array(const vector<T> &v) {
+        value((uint64_t)v.size());
+        bytes(v.data(), v.size() * sizeof(T));
+    }
+
+    void text(const string &s) {
+        value((uint64_t)s.size());
+        bytes(s.data(), s.size());
+    }
+};
+
+// Reads back what CacheWriter wrote; `ok` turns false at the first overrun
+struct CacheReader {
+    const unsigned char *p;
+    const unsigned char *end;
+    bool ok;
+
+    bool bytes(void *data, size_t count) {
+        ok = ok && (size_t)(end - p) >= count;
+        if (ok) {
+            memcpy(data, p, count);
+            p += count;
+        }
+        return ok;
+    }
+
+    template <typename T>
+    bool value(T &v) {
+        return bytes(&v, sizeof(T));
+    }
+
+    template <typename T>
+    bool array(vector<T> &v) {
+        uint64_t count = 0;
+        if (!value(count) || count > (uint64_t)(end - p) / sizeof(T)) {
+            ok = false;
+            return false;
+        }
+        v.resize((size_t)count);
+        return bytes(v.data(), v.size() * sizeof(T));
+    }
+
+    bool text(string &s) {
+        uint64_t count = 0;
+        if (!value(count) || count > (uint64_t)(end - p)) {
+            ok = false;
+            return false;
+        }
+        s.assign((const char *)p, (size_t)count);
+        p += count;
+        return true;
+    }
+};
+
+bool Scene::readCache(const string &cacheFile) {
+    MappedFile file(cacheFile);
+    CacheReader in = { file.data(), file.data() + file.size(), file.data() != NULL };
+
+    CacheHeader header;
+    uint32_t structBytes[15];
+    cacheStructBytes(structBytes);
+    if (!in.value(header) || memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+            || memcmp(header.structBytes, structBytes, sizeof(structBytes)) != 0) {
+        return false;
+    }
+
+    // Stale unless every source file is unchanged
+    uint64_t sourceCount = 0;
+    in.value(sourceCount);
+    vector<string> sources;
+    for (uint64_t i = 0; in.ok && i < sourceCount; i++) {
+        string source;
+        int64_t size = 0;
+        int64_t mtime = 0;
+        in.text(source);
+        in.value(size);
+        in.value(mtime);
+        int64_t currentSize;
+        int64_t currentMtime;
+        fileStamp(source, currentSize, currentMtime);
+        if (!in.ok || currentSize != size || currentMtime != mtime || size == 0) {
+            return false;
+        }
+        sources.push_back(source);
+    }
+    int32_t builder = -1;
+    if (!in.value(builder) || builder != (int32_t)bvhBuilder) {
+        return false;
+    }
+    int32_t compact = -1;
+    if (!in.value(compact) || compact != (int32_t)compactMeshes) {
+        return false;
+    }
+    int32_t coherent = -1;
+    if (!in.value(coherent) || coherent != (int32_t)coherentGeomOrder) {
+        return false;
+    }
+
+    in.array(materials);
+    in.array(geoms);
+    in.array(deviceGeoms);
+    in.array(lights);
+    in.array(lightNodes);
+    in.array(bvhNodes);
+    in.array(bvhGeomIndices);
+    in.array(meshes);
+    in.array(meshBvhNodes);
+    in.array(meshWideNodes);
+    in.array(meshTriangles);
+    in.array(meshTriangleRecords);
+    in.array(meshPositions);
+    in.array(meshNormals);
+    in.array(meshUVs);
+    in.array(sphereClouds);
+    in.array(cloudBvhNodes);
+    in.array(cloudSpheres);
+    in.array(sdfVolumes);
+    in.array(sdfVoxels);
+    in.array(media);
+    in.array(mediumVoxels);
+    in.array(mediumMajorants);
+    uint64_t textureCount = 0;
+    in.value(textureCount);
+    vector<pair<string, bool> > textureFiles;
+    for (uint64_t i = 0; in.ok && i < textureCount; i++) {
+        string filename;
+        uint8_t srgb = 0;
+        in.text(filename);
+        in.value(srgb);
+        textureFiles.push_back(make_pair(filename, srgb != 0));
+    }
+    in.text(environment.image.filename);
+    in.value(environment.intensity);
+    in.value(state.camera);
+    in.value(state.iterations);
+    in.value(state.traceDepth);
+    in.text(state.imageName);
+    in.array(state.keyframes);
+    in.value(state.shutter);
+    in.value(state.eyeSeparation);
+    in.value(state.targetError);
+    in.value(state.timeLimit);
+    in.array(geomKeyframes);
+    in.array(objectGeoms);
+    in.value(sceneUp);
+    in.value(bvhBuildMs);
+    if (!in.ok || in.p != in.end) {
+        return false;
+    }
+    sourceFiles = sources;
+    for (size_t i = 0; i < textureFiles.size(); i++) {
+        queueTexture(textureFiles[i].first, textureFiles[i].second);
+    }
+    state.image.assign(state.camera.resolution.x * state.camera.resolution.y * state.viewCount(), glm::vec3());
+    return true;
+}
+
+void Scene::writeCache(const string &cacheFile) const {
+    CacheWriter out;
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    cacheStructBytes(header.structBytes);
+    out.value(header);
+
+    out.value((uint64_t)sourceFiles.size());
+    for (size_t i = 0; i < sourceFiles.size(); i++) {
+        int64_t size;
+        int64_t mtime;
+        fileStamp(sourceFiles[i], size, mtime);
+        out.text(sourceFiles[i]);
+        out.value(size);
+        out.value(mtime);
+    }
+    out.value((int32_t)bvhBuilder);
+    out.value((int32_t)compactMeshes);
+    out.value((int32_t)coherentGeomOrder);
+
+    out.array(materials);
+    out.array(geoms);
+    out.array(deviceGeoms);
+    out.array(lights);
+    out.array(lightNodes);
+    out.array(bvhNodes);
+    out.array(bvhGeomIndices);
+    out.array(meshes);
+    out.array(meshBvhNodes);
+    out.array(meshWideNodes);
+    out.array(meshTriangles);
+    out.array(meshTriangleRecords);
+    out.array(meshPositions);
+    out.array(meshNormals);
+    out.array(meshUVs);
+    out.array(sphereClouds);
+    out.array(cloudBvhNodes);
+    out.array(cloudSpheres);
+    out.array(sdfVolumes);
+    out.array(sdfVoxels);
+    out.array(media);
+    out.array(mediumVoxels);
+    out.array(mediumMajorants);
+    out.value((uint64_t)textures.size());
+    for (size_t i = 0; i < textures.size(); i++) {
+        out.text(textures[i].filename);
+        out.value((uint8_t)textures[i].srgb);
+    }
+    out.text(environment.image.filename);
+    out.value(environment.intensity);
+    out.value(state.camera);
+    out.value(state.iterations);
+    out.value(state.traceDepth);
+    out.text(state.imageName);
+    out.array(state.keyframes);
+    out.value(state.shutter);
+    out.value(state.eyeSeparation);
+    out.value(state.targetError);
+    out.value(state.timeLimit);
+    out.array(geomKeyframes);
+    out.array(objectGeoms);
+    out.value(sceneUp);
+    out.value(bvhBuildMs);
+
+    // Through a temporary and a rename, so a concurrent reader never sees
+    // half a cache; failing to write one only costs the next startup
+    string tmpFile = cacheFile + ".tmp";
+    FILE *file = fopen(tmpFile.c_str(), "wb");
+    if (file == NULL) {
+        return;
+    }
+    bool ok = fwrite(out.out.data(), 1, out.out.size(), file) == out.out.size();
+    ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+    // rename() does not replace an existing file on Windows
+    if (ok) {
+        remove(cacheFile.c_str());
+    }
+#endif
+    if (!ok || rename(tmpFile.c_str(), cacheFile.c_str()) != 0) {
+        remove(tmpFile.c_str());
+        return;
+    }
+    cout << "Wrote scene cache " << cacheFile << endl;
+}
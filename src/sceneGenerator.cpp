@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+#include "sceneGenerator.h"
+
+// The box, as in scenes/cornell.txt: x and z in [-5, 5], y in [0, 10]
+#define BOX_HALF_WIDTH 5.0f
+#define BOX_HEIGHT 10.0f
+// Objects keep this far from the walls
+#define BOX_MARGIN 1.0f
+// Power of the single 3 x 3 light of scenes/cornell.txt, shared by all lights
+#define LIGHT_AREA_EMITTANCE (5.0f * 9.0f)
+
+SceneGeneratorSettings sceneGenerator::defaults() {
+    SceneGeneratorSettings settings;
+    settings.objects = 100;
+    settings.materials = 4;
+    settings.lights = 1;
+    settings.distribution = DISTRIBUTION_UNIFORM;
+    settings.sphereFraction = 0.5f;
+    settings.resolution = 512;
+    settings.depth = 8;
+    settings.seed = 1;
+    return settings;
+}
+
+bool sceneGenerator::takeOption(int &i, int argc, char **argv, SceneGeneratorSettings &settings) {
+    if (i + 1 >= argc) {
+        return false;
+    }
+    const char *value = argv[i + 1];
+    if (strcmp(argv[i], "--materials") == 0) {
+        settings.materials = std::max(atoi(value), 1);
+    } else if (strcmp(argv[i], "--lights") == 0) {
+        settings.lights = std::max(atoi(value), 1);
+    } else if (strcmp(argv[i], "--distribution") == 0) {
+        settings.distribution = strcmp(value, "grid") == 0 ? DISTRIBUTION_GRID
+            : strcmp(value, "clustered") == 0 ? DISTRIBUTION_CLUSTERED : DISTRIBUTION_UNIFORM;
+    } else if (strcmp(argv[i], "--sphere-fraction") == 0) {
+        settings.sphereFraction = std::min(std::max((float)atof(value), 0.0f), 1.0f);
+    } else if (strcmp(argv[i], "--resolution") == 0) {
+        settings.resolution = std::max(atoi(value), 1);
+    } else if (strcmp(argv[i], "--depth") == 0) {
+        settings.depth = std::max(atoi(value), 1);
+    } else if (strcmp(argv[i], "--seed") == 0) {
+        settings.seed = (unsigned)strtoul(value, NULL, 10);
+    } else {
+        return false;
+    }
+    i++;
+    return true;
+}
+
+static Material makeMaterial(glm::vec3 color, float reflective, float refractive, float emittance) {
+    Material material = {};
+    material.color = color;
+    material.specular.exponent = 0.0f;
+    material.specular.color = reflective + refractive > 0.0f ? color : glm::vec3(0.0f);
+    material.hasReflective = reflective;
+    material.hasRefractive = refractive;
+    material.indexOfRefraction = refractive > 0.0f ? 1.5f : 0.0f;
+    material.emittance = emittance;
+    material.albedoMap = -1;
+    material.normalMap = -1;
+    material.roughnessMap = -1;
+    return material;
+}
+
+static Geom makeGeom(GeomType type, int materialid, glm::vec3 translation, glm::vec3 rotation,
+        glm::vec3 scale) {
+    Geom geom = {};
+    geom.type = type;
+    geom.deviceType = type;
+    geom.materialid = materialid;
+    geom.meshid = -1;
+    geom.translation = translation;
+    geom.rotation = rotation;
+    geom.scale = scale;
+    return geom;
+}
+
+// Smallest n with n^k >= count
+static int rootCeil(int count, int k) {
+    int n = 1;
+    while ((int)pow((double)n, k) < count) {
+        n++;
+    }
+    return n;
+}
+
+void sceneGenerator::generate(const SceneGeneratorSettings &settings, std::vector<Material> &materials,
+        std::vector<Geom> &geoms) {
+    std::mt19937 rng(settings.seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    materials.clear();
+    geoms.clear();
+
+    // Materials: the lights', the walls' white, red and green, then the
+    // objects' cycling through diffuse, mirror, glass and diffuse again
+    const int lights = std::max(settings.lights, 1);
+    const int grid = rootCeil(lights, 2);
+    const float lightCell = 2.0f * (BOX_HALF_WIDTH - BOX_MARGIN) / grid;
+    const float lightSize = std::min(3.0f / sqrtf((float)lights), 0.8f * lightCell);
+    materials.push_back(makeMaterial(glm::vec3(1.0f), 0.0f, 0.0f,
+        LIGHT_AREA_EMITTANCE / (lights * lightSize * lightSize)));
+    materials.push_back(makeMaterial(glm::vec3(0.98f), 0.0f, 0.0f, 0.0f));
+    materials.push_back(makeMaterial(glm::vec3(0.85f, 0.35f, 0.35f), 0.0f, 0.0f, 0.0f));
+    materials.push_back(makeMaterial(glm::vec3(0.35f, 0.85f, 0.35f), 0.0f, 0.0f, 0.0f));
+    const int firstObjectMaterial = (int)materials.size();
+    for (int m = 0; m < std::max(settings.materials, 1); m++) {
+        glm::vec3 color(0.3f + 0.68f * unit(rng), 0.3f + 0.68f * unit(rng), 0.3f + 0.68f * unit(rng));
+        int kind = m % 4;
+        materials.push_back(makeMaterial(kind == 2 ? glm::vec3(0.98f) : color,
+            kind == 1 ? 1.0f : 0.0f, kind == 2 ? 1.0f : 0.0f, 0.0f));
+    }
+    const int objectMaterials = (int)materials.size() - firstObjectMaterial;
+
+    // The box: floor, ceiling, back, left and right walls
+    const float w = BOX_HALF_WIDTH;
+    const glm::vec3 wall(0.01f, 2.0f * w, 2.0f * w);
+    geoms.push_back(makeGeom(CUBE, 1, glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(2.0f * w, 0.01f, 2.0f * w)));
+    geoms.push_back(makeGeom(CUBE, 1, glm::vec3(0.0f, BOX_HEIGHT, 0.0f), glm::vec3(0.0f, 0.0f, 90.0f), wall));
+    geoms.push_back(makeGeom(CUBE, 1, glm::vec3(0.0f, 0.5f * BOX_HEIGHT, -w), glm::vec3(0.0f, 90.0f, 0.0f), wall));
+    geoms.push_back(makeGeom(CUBE, 2, glm::vec3(-w, 0.5f * BOX_HEIGHT, 0.0f), glm::vec3(0.0f), wall));
+    geoms.push_back(makeGeom(CUBE, 3, glm::vec3(w, 0.5f * BOX_HEIGHT, 0.0f), glm::vec3(0.0f), wall));
+
+    // Lights on a grid just under the ceiling, centred when there is one
+    for (int l = 0; l < lights; l++) {
+        float x = -(BOX_HALF_WIDTH - BOX_MARGIN) + (l % grid + 0.5f) * lightCell;
+        float z = -(BOX_HALF_WIDTH - BOX_MARGIN) + (l / grid + 0.5f) * lightCell;
+        geoms.push_back(makeGeom(CUBE, 0, glm::vec3(x, BOX_HEIGHT, z), glm::vec3(0.0f),
+            glm::vec3(lightSize, 0.3f, lightSize)));
+    }
+
+    // Objects fill x, z in [-4, 4] and y in [0.5, 8.5], sized to one cell of
+    // an n^3 grid, so the box never gets fuller than the grid layout
+    const int count = std::max(settings.objects, 0);
+    const glm::vec3 low(-(w - BOX_MARGIN), 0.5f, -(w - BOX_MARGIN));
+    const float extent = 2.0f * (w - BOX_MARGIN);
+    const int n = rootCeil(std::max(count, 1), 3);
+    const float cell = extent / n;
+    std::vector<glm::vec3> clusters;
+    if (settings.distribution == DISTRIBUTION_CLUSTERED) {
+        int numClusters = rootCeil(std::max(count, 1), 3);
+        for (int c = 0; c < numClusters; c++) {
+            clusters.push_back(low + extent * glm::vec3(0.2f + 0.6f * unit(rng), 0.2f + 0.6f * unit(rng),
+                0.2f + 0.6f * unit(rng)));
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        glm::vec3 p;
+        float size = 0.6f * cell;
+        if (settings.distribution == DISTRIBUTION_GRID) {
+            glm::vec3 jitter = 0.2f * cell * glm::vec3(unit(rng) - 0.5f, unit(rng) - 0.5f, unit(rng) - 0.5f);
+            p = low + cell * glm::vec3(i % n + 0.5f, (i / n) % n + 0.5f, i / (n * n) + 0.5f) + jitter;
+        } else if (settings.distribution == DISTRIBUTION_CLUSTERED) {
+            // A sum of uniforms is near enough Gaussian around the centre
+            const glm::vec3 centre = clusters[i % clusters.size()];
+            glm::vec3 offset;
+            for (int k = 0; k < 3; k++) {
+                offset[k] = unit(rng) + unit(rng) + unit(rng) - 1.5f;
+            }
+            p = glm::clamp(centre + 0.1f * extent * offset, low, low + extent);
+            size *= 0.5f + 0.5f * unit(rng);
+        } else {
+            p = low + extent * glm::vec3(unit(rng), unit(rng), unit(rng));
+            size *= 0.5f + 0.5f * unit(rng);
+        }
+        GeomType type = unit(rng) < settings.sphereFraction ? SPHERE : CUBE;
+        glm::vec3 rotation = type == CUBE ? glm::vec3(0.0f, 90.0f * unit(rng), 0.0f) : glm::vec3(0.0f);
+        geoms.push_back(makeGeom(type, firstObjectMaterial + i % objectMaterials, p, rotation,
+            glm::vec3(size)));
+    }
+}
+
+bool sceneGenerator::write(const std::string &filename, const SceneGeneratorSettings &settings) {
+    std::vector<Material> materials;
+    std::vector<Geom> geoms;
+    generate(settings, materials, geoms);
+
+    FILE *file = fopen(filename.c_str(), "w");
+    if (file == NULL) {
+        return false;
+    }
+    fprintf(file, "// Generated: %d objects, %d materials, %d lights\n\n",
+        settings.objects, settings.materials, settings.lights);
+    for (size_t m = 0; m < materials.size(); m++) {
+        const Material &material = materials[m];
+        fprintf(file, "MATERIAL %d\nRGB %g %g %g\nSPECEX %g\nSPECRGB %g %g %g\nREFL %g\nREFR %g\n"
+            "REFRIOR %g\nEMITTANCE %g\n\n", (int)m,
+            material.color.x, material.color.y, material.color.z, material.specular.exponent,
+            material.specular.color.x, material.specular.color.y, material.specular.color.z,
+            material.hasReflective, material.hasRefractive, material.indexOfRefraction,
+            material.emittance);
+    }
+    fprintf(file, "CAMERA\nRES %d %d\nFOVY 45\nITERATIONS 5000\nDEPTH %d\nFILE generated\n"
+        "EYE 0.0 5 10.5\nLOOKAT 0 5 0\nUP 0 1 0\n\n",
+        settings.resolution, settings.resolution, settings.depth);
+    for (size_t g = 0; g < geoms.size(); g++) {
+        const Geom &geom = geoms[g];
+        fprintf(file, "OBJECT %d\n%s\nmaterial %d\nTRANS %g %g %g\nROTAT %g %g %g\nSCALE %g %g %g\n\n",
+            (int)g, geom.type == SPHERE ? "sphere" : "cube", geom.materialid,
+            geom.translation.x, geom.translation.y, geom.translation.z,
+            geom.rotation.x, geom.rotation.y, geom.rotation.z,
+            geom.scale.x, geom.scale.y, geom.scale.z);
+    }
+    return fclose(file) == 0;
+}
+
+std::vector<std::string> sceneGenerator::writeScenes(const std::string &base, const char *tag,
+        const std::vector<int> &objectCounts, const SceneGeneratorSettings &settings) {
+    std::vector<std::string> filenames;
+    for (size_t i = 0; i < objectCounts.size(); i++) {
+        char name[32];
+        snprintf(name, sizeof(name), ".%s%d.txt", tag, objectCounts[i]);
+        SceneGeneratorSettings scene = settings;
+        scene.objects = objectCounts[i];
+        filenames.push_back(base + name);
+        if (!write(filenames.back(), scene)) {
+            removeScenes(filenames);
+            return std::vector<std::string>();
+        }
+    }
+    return filenames;
+}
+
+void sceneGenerator::removeScenes(const std::vector<std::string> &filenames) {
+    for (size_t i = 0; i < filenames.size(); i++) {
+        remove(filenames[i].c_str());
+        remove((filenames[i] + ".cache").c_str());
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "sceneStructs.h"
+
+/**
+ * Synthetic scenes for scaling studies: a Cornell box holding any number
+ * of spheres and cubes, materials and ceiling lights. They are built as the
+ * Material and Geom records Scene uses and saved as ordinary scene files,
+ * so Scene's parser derives the transforms, BVH and light list exactly as
+ * for a hand-written scene.
+ *
+ * Options, taken by --generate-scene and the benchmarks' --synthetic:
+ *     --materials N         materials the objects cycle through (default 4)
+ *     --lights N            ceiling lights, total power kept (default 1)
+ *     --distribution D      uniform, grid or clustered (default uniform)
+ *     --sphere-fraction F   share of the objects that are spheres (default 0.5)
+ *     --resolution N        image edge (default 512)
+ *     --depth N             trace depth (default 8)
+ *     --seed N              for positions, sizes and colours (default 1)
+ */
+
+// How the objects are placed in the box
+enum SceneDistribution {
+    DISTRIBUTION_UNIFORM,       // independently anywhere
+    DISTRIBUTION_GRID,          // one per cell of a jittered n^3 grid
+    DISTRIBUTION_CLUSTERED,     // around a few random centres, leaving most of the box empty
+};
+
+struct SceneGeneratorSettings {
+    int objects;            // besides the box's walls and lights
+    int materials;
+    int lights;
+    int distribution;       // a SceneDistribution
+    float sphereFraction;
+    int resolution;
+    int depth;
+    unsigned seed;
+};
+
+namespace sceneGenerator {
+    SceneGeneratorSettings defaults();
+
+    /**
+     * Takes argv[i], and its value, into settings if it is one of the
+     * options above, leaving i at the last argument used.
+     *
+     * @return false, with i unchanged, for any other argument.
+     */
+    bool takeOption(int &i, int argc, char **argv, SceneGeneratorSettings &settings);
+
+    // The scene's materials and geoms; only the fields a scene file sets are filled in
+    void generate(const SceneGeneratorSettings &settings, std::vector<Material> &materials,
+            std::vector<Geom> &geoms);
+
+    // Generates the scene and writes it as a scene file
+    bool write(const std::string &filename, const SceneGeneratorSettings &settings);
+
+    /**
+     * Writes one scene per object count, as BASE.TAG<count>.txt, for the
+     * benchmarks. Returns their names, or nothing if any write failed.
+     */
+    std::vector<std::string> writeScenes(const std::string &base, const char *tag,
+            const std::vector<int> &objectCounts, const SceneGeneratorSettings &settings);
+
+    // Deletes scenes writeScenes wrote, and the caches loading them left behind
+    void removeScenes(const std::vector<std::string> &filenames);
+}
@@ -0,0 +1,161 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <cuda_runtime.h>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "sceneShare.h"
+
+#define SHARE_MAGIC "PTGEOM01"
+#define SHARE_PRIME 0x100000001b3ULL
+
+// What a record file holds, in native byte order
+struct ShareRecord {
+    char magic[8];
+    uint64_t key;
+    uint64_t bytes;
+    long long pid;              // the exporter's
+    cudaIpcMemHandle_t handle;
+};
+
+// The records this process published, by the memory they export
+static std::map<void *, std::string> published;
+
+static long long processId() {
+#ifdef _WIN32
+    return _getpid();
+#else
+    return getpid();
+#endif
+}
+
+// The record of `key` on the current device, in the temporary directory
+static std::string recordFile(uint64_t key) {
+    const char *dir = getenv("TMPDIR");
+#ifdef _WIN32
+    if (dir == NULL) {
+        dir = getenv("TEMP");
+    }
+    if (dir == NULL) {
+        dir = ".";
+    }
+    const char separator = '\\';
+#else
+    if (dir == NULL) {
+        dir = "/tmp";
+    }
+    const char separator = '/';
+#endif
+    int device = 0;
+    cudaGetDevice(&device);
+    char busId[32] = "";
+    if (cudaDeviceGetPCIBusId(busId, sizeof(busId), device) != cudaSuccess) {
+        cudaGetLastError();
+        snprintf(busId, sizeof(busId), "device%d", device);
+    }
+    for (char *c = busId; *c != '\0'; c++) {
+        if (*c == ':' || *c == '.') {
+            *c = '-';
+        }
+    }
+    char name[96];
+    snprintf(name, sizeof(name), "pathtracer-geometry-%016llx-%s", (unsigned long long)key, busId);
+    return std::string(dir) + separator + name;
+}
+
+static bool readRecord(const std::string &file, ShareRecord &record) {
+    FILE *in = fopen(file.c_str(), "rb");
+    if (in == NULL) {
+        return false;
+    }
+    const bool read = fread(&record, sizeof(record), 1, in) == 1;
+    fclose(in);
+    return read && memcmp(record.magic, SHARE_MAGIC, sizeof(record.magic)) == 0;
+}
+
+uint64_t sceneShare::hash(const void *data, size_t bytes, uint64_t seed) {
+    // FNV-1a, a word at a time
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    uint64_t h = seed ^ (bytes * SHARE_PRIME);
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        h = (h ^ word) * SHARE_PRIME;
+    }
+    for (; i < bytes; i++) {
+        h = (h ^ p[i]) * SHARE_PRIME;
+    }
+    return h;
+}
+
+void *sceneShare::open(uint64_t key, size_t bytes) {
+    ShareRecord record;
+    if (!readRecord(recordFile(key), record) || record.key != key || record.bytes != bytes
+            || record.pid == processId()) {
+        return NULL;
+    }
+    void *mapped = NULL;
+    if (cudaIpcOpenMemHandle(&mapped, record.handle, cudaIpcMemLazyEnablePeerAccess) != cudaSuccess) {
+        // The exporter has exited, or cannot share with this process
+        cudaGetLastError();
+        return NULL;
+    }
+    return mapped;
+}
+
+void sceneShare::close(void *mapped) {
+    if (mapped != NULL) {
+        cudaIpcCloseMemHandle(mapped);
+    }
+}
+
+bool sceneShare::publish(void *device, size_t bytes, uint64_t key) {
+    ShareRecord record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.magic, SHARE_MAGIC, sizeof(record.magic));
+    record.key = key;
+    record.bytes = bytes;
+    record.pid = processId();
+    if (cudaIpcGetMemHandle(&record.handle, device) != cudaSuccess) {
+        cudaGetLastError();
+        return false;
+    }
+    // Written aside and renamed over the record, so a reader never sees half of one
+    const std::string file = recordFile(key);
+    const std::string temporary = file + "." + std::to_string(record.pid);
+    FILE *out = fopen(temporary.c_str(), "wb");
+    if (out == NULL) {
+        return false;
+    }
+    const bool written = fwrite(&record, sizeof(record), 1, out) == 1;
+    fclose(out);
+#ifdef _WIN32
+    remove(file.c_str());
+#endif
+    if (!written || rename(temporary.c_str(), file.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    published[device] = file;
+    return true;
+}
+
+void sceneShare::withdraw(void *device) {
+    std::map<void *, std::string>::iterator it = published.find(device);
+    if (it == published.end()) {
+        return;
+    }
+    // Another exporter may have replaced the record since
+    ShareRecord record;
+    if (readRecord(it->second, record) && record.pid == processId()) {
+        remove(it->second.c_str());
+    }
+    published.erase(it);
+}
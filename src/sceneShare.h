@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Sharing a scene's mesh arrays between renderer processes on one GPU,
+ * which would otherwise each hold a copy of the largest part of the scene.
+ * The first process to upload a scene's geometry exports its allocation
+ * with CUDA IPC and leaves a record of the handle in the temporary
+ * directory, named after the geometry's key and the device's PCI bus id;
+ * later processes with the same key find the record and map the exporter's
+ * memory, read-only, instead of uploading their own. The exporter must
+ * outlive the processes mapping its geometry. A record whose exporter has
+ * exited fails to map and is replaced by the next upload's.
+ */
+namespace sceneShare {
+    // Folds `bytes` at `data` into the key `seed`
+    uint64_t hash(const void *data, size_t bytes, uint64_t seed);
+
+    /**
+     * Maps the current device's geometry exported under `key`, which must
+     * be `bytes` long; NULL if no live process exports it.
+     */
+    void *open(uint64_t key, size_t bytes);
+
+    // Unmaps what open() returned
+    void close(void *mapped);
+
+    /**
+     * Exports `bytes` of cudaMalloc'd memory at `device`, already holding
+     * the geometry of `key`, to other processes. False if the device or
+     * platform has no CUDA IPC.
+     */
+    bool publish(void *device, size_t bytes, uint64_t key);
+
+    // Removes the record of publish(`device`) before the memory is freed
+    void withdraw(void *device);
+}
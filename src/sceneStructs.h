@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include <cuda_runtime.h>
+#include <cuda_fp16.h>
 #include "glm/glm.hpp"
 
 #define BACKGROUND_COLOR (glm::vec3(0.0f))
@@ -10,16 +11,32 @@
 enum GeomType {
     SPHERE,
     CUBE,
+    MESH,
+    SPHERE_CLOUD,
+    SDF_VOLUME,
+    // Intersection-test special cases, chosen by Scene::loadGeom; only
+    // DeviceGeoms use them
+    AXIS_ALIGNED_CUBE,  // a CUBE whose transform has no rotation
+    UNIFORM_SPHERE,     // a SPHERE scaled equally on every axis
 };
 
+// The cone of a ray around it is coneWidth wide at the origin and widens by
+// coneSpread per unit of distance; both 0 for a point ray, which always
+// sees the full-detail meshes.
 struct Ray {
     glm::vec3 origin;
     glm::vec3 direction;
+    float coneWidth;
+    float coneSpread;
 };
 
+// Host-side description of a scene object, as loaded from the scene file
 struct Geom {
     enum GeomType type;
+    enum GeomType deviceType;   // type, or the special case for its intersection test
     int materialid;
+    int meshid;         // index into Scene::meshes for MESH geoms, Scene::sphereClouds for
+                        // SPHERE_CLOUD ones, Scene::sdfVolumes for SDF_VOLUME ones, else -1
     glm::vec3 translation;
     glm::vec3 rotation;
     glm::vec3 scale;
@@ -28,16 +45,359 @@ struct Geom {
     glm::mat4 invTranspose;
 };
 
-struct Material {
+// 64-byte device-side record of a Geom, which is all the intersection tests
+// need: the rows of the world-to-object affine transform (the bottom row is
+// always 0 0 0 1). Its transpose maps object-space normals back to world
+// space, so invTranspose need not be stored, and world-space hit points come
+// from the world ray, so the forward transform need not be either.
+// UNIFORM_SPHEREs instead hold their world-space centre and radius in
+// inverseRows[0].
+struct DeviceGeom {
+    glm::vec4 inverseRows[3];
+    enum GeomType type;
+    int materialid;
+    int meshid;
+    int lightIndex;     // entry in Scene::lights (a mesh's first triangle), or -1
+};
+
+struct AABB {
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+// 32-byte BVH node, stored depth-first. Interior nodes (count == 0) have
+// their left child at the next index and their right child at `offset`;
+// leaves cover `count` entries of the primitive index list from `offset`.
+struct BVHNode {
+    glm::vec3 bboxMin;
+    int offset;
+    glm::vec3 bboxMax;
+    int count;
+};
+
+#define BVH_WIDTH 4
+
+/**
+ * 64-byte node of a mesh's 4-wide BVH, collapsed from its binary one (see
+ * BVH::collapseWide) in the spirit of compressed wide BVHs: one fetch
+ * holds every child's box, quantized to 8 bits per axis on a power-of-two
+ * grid from `origin` and rounded outwards. Child c < childCount is
+ * interior, at wide node child[c], if triangleCount[c] == 0; otherwise it
+ * is a leaf of triangles child[c] .. child[c] + triangleCount[c] - 1.
+ */
+struct WideBVHNode {
+    glm::vec3 origin;                   // minimum of the children's boxes
+    signed char exponent[3];            // grid step 2^exponent on each axis
+    unsigned char childCount;
+    int child[BVH_WIDTH];
+    unsigned char triangleCount[BVH_WIDTH];
+    unsigned char lo[3][BVH_WIDTH];     // child boxes, by axis then child
+    unsigned char hi[3][BVH_WIDTH];
+    int unused;                         // pads to 64 bytes
+};
+
+// An indexed triangle mesh in object space. Its triangles are stored in
+// leaf order of its own BVH, so leaves index them directly.
+struct Mesh {
+    int bvhRoot;            // root node in the shared mesh BVH node array
+    int wideRoot;           // root in the shared wide node array, -1 if it has none
+    int triangleOffset;     // first triangle in the shared triangle array
+    int triangleCount;
+    int hasNormals;         // 0: shade with the geometric normal
+    int hasUVs;             // 0: texture coordinates are all zero
+    int lodCount;           // coarser versions, in the entries right after this one
+    int lodLevel;           // 0 for a loaded mesh, k for its k-th coarser version
+    float lodCellSize;      // object-space clustering cell of level 1, doubling per level
+    glm::vec3 gridOrigin;   // Scene::compactMeshes: vertices lie on the 16-bit grid from here,
+    glm::vec3 gridStep;     // this far apart per axis, spanning the loaded mesh's box; its levels share it
+};
+
+// Scene::compactMeshes: the grid coordinates of object-space point p in `mesh`'s vertex grid
+__host__ __device__ inline ushort3 meshGridCoordinates(const Mesh &mesh, glm::vec3 p) {
+    glm::vec3 q(0.0f);
+    for (int a = 0; a < 3; a++) {
+        if (mesh.gridStep[a] > 0.0f) {
+            q[a] = glm::clamp(floorf((p[a] - mesh.gridOrigin[a]) / mesh.gridStep[a] + 0.5f), 0.0f, 65535.0f);
+        }
+    }
+    ushort3 c;
+    c.x = (unsigned short)q.x;
+    c.y = (unsigned short)q.y;
+    c.z = (unsigned short)q.z;
+    return c;
+}
+
+// The point at grid coordinates c, fused so the host and the device agree to the bit
+__host__ __device__ inline glm::vec3 meshGridPoint(const Mesh &mesh, ushort3 c) {
+    return glm::vec3(fmaf(mesh.gridStep.x, (float)c.x, mesh.gridOrigin.x),
+        fmaf(mesh.gridStep.y, (float)c.y, mesh.gridOrigin.y),
+        fmaf(mesh.gridStep.z, (float)c.z, mesh.gridOrigin.z));
+}
+
+// One sphere of a sphere cloud, in the cloud's object space. At 20 bytes,
+// millions of them take less room than a Geom apiece would.
+struct CloudSphere {
+    glm::vec3 centre;
+    float radius;
+    int materialid;         // -1: the geom's material
+};
+
+// Spheres loaded from a point file (see Scene::loadSphereClouds). Like a
+// mesh's triangles, they are stored in leaf order of the cloud's own BVH.
+struct SphereCloud {
+    int bvhRoot;            // root node in the shared cloud BVH node array
+    int sphereOffset;       // first sphere in the shared sphere array
+    int sphereCount;
+};
+
+/**
+ * A signed distance field, negative inside, sampled at the corners of a
+ * grid of voxels spanning an object-space box (see Scene::loadSdfs).
+ * Devices read it through a trilinearly filtered 3D texture; the host
+ * interpolates the same values from Scene::sdfVoxels.
+ */
+struct SdfVolume {
+    cudaTextureObject_t texture;    // on the device the table is on; 0 on the host
+    glm::vec3 boundsMin;
+    int voxelOffset;                // first value in Scene::sdfVoxels, x fastest
+    glm::vec3 boundsMax;
+    float voxelSize;                // shortest voxel edge, which scales the hit tolerance
+    glm::ivec3 resolution;          // samples along each axis, at least 2
+};
+
+/**
+ * A mesh triangle's object-space vertices, kept in BVH leaf order next to
+ * Scene::meshTriangles, so a leaf test reads one 16-byte aligned record
+ * instead of an index triple and three scattered positions. The vertices
+ * are stored as they are, not as edges, so neighbouring triangles share
+ * them bit for bit, as the watertight test needs. The w components are
+ * padding.
+ */
+struct TriangleRecord {
+    float4 p0;
+    float4 p1;
+    float4 p2;
+};
+
+// Device pointers to the shared mesh, sphere cloud and SDF arrays, passed to kernels by value
+struct MeshData {
+    const Mesh * meshes;
+    const BVHNode * nodes;
+    const WideBVHNode * wideNodes;  // NULL to walk the binary nodes instead
+    const glm::ivec3 * triangles;
+    const TriangleRecord * triangleRecords;    // like triangles; NULL to gather the positions instead
+    const glm::vec3 * positions;
+    const glm::vec3 * normals;
+    const glm::vec2 * uvs;          // per vertex, like normals
+    const ushort3 * compactPositions;   // grid coordinates (see Mesh::gridOrigin) in place of positions; NULL: positions
+    const ushort2 * compactNormals;     // octahedral (see encodeOctNormal) in place of normals; NULL: normals
+    const __half2 * compactUVs;         // in place of uvs; NULL: uvs
+    float lodScale;                 // ray footprints are scaled by this to pick a level; 0 for full detail
+    bool watertight;                // watertightTriangleTest rather than Moller-Trumbore
+    bool shortStack;                // the top-level BVH is walked on a short stack (see ShortStack)
+    const SphereCloud * clouds;
+    const BVHNode * cloudNodes;
+    const CloudSphere * cloudSpheres;
+    const SdfVolume * sdfs;
+    const float * sdfVoxels;        // host tracing only; NULL on the device
+    unsigned int * nodeVisits;      // the traversing thread's count of BVH nodes fetched; NULL: not counted
+};
+
+// An emitter that shading samples directly (next-event estimation): an
+// emissive cube, or an emissive sphere under a uniform scale. Points are
+// drawn uniformly over its surface, so their density is 1 / area.
+struct Light {
+    glm::vec4 transformRows[3];     // rows of the object-to-world affine transform
+    glm::vec3 radiance;             // material colour * emittance
+    float area;                     // world-space surface area
+    float faceCdf[3];               // CUBE: area of the x, y and z face pairs, cumulative / area
+    float pmf;                      // probability of being picked, by power
+    float cdf;                      // pmf summed up to and including this light
+    int type;                       // CUBE, SPHERE, or MESH for one triangle of a mesh
+    int geom;
+    int node;                       // its leaf in Scene::lightNodes
+};
+
+/**
+ * Node of the light BVH (see Scene::buildLightTree), stored depth-first
+ * with the left child right after its parent. It bounds the positions,
+ * power and normals of the lights below it; normals count up to sign, as
+ * lights emit from both sides.
+ */
+struct LightNode {
+    glm::vec3 boundsMin;
+    float power;                    // luminance * area, summed over its lights
+    glm::vec3 boundsMax;
+    float cosTheta;                 // of the cone about +-axis holding the normals; -1: any direction
+    glm::vec3 axis;
+    int offset;                     // interior: right child; leaf: its light
+    int parent;                     // -1 for the root
+    int count;                      // 1 for a leaf, 0 for an interior node
+};
+
+// The environment map on the device (see EnvironmentMap in texture.h):
+// its texture, read wherever a ray leaves the scene, and its sampling CDFs
+struct EnvironmentLight {
+    cudaTextureObject_t texture;    // 0: the background is BACKGROUND_COLOR
+    const float * texels;           // RGBA rows for host shading; NULL on the device
+    const float * marginalCdf;
+    const float * conditionalCdf;
+    int width;
+    int height;
+    float intensity;
+    float pmf;      // probability that next-event estimation samples it, 0 if never
+};
+
+// Bounces the device telemetry counts separately; deeper ones share the last
+#define TELEMETRY_BOUNCES 16
+
+// Everything next-event estimation reads, passed to kernels by value. The
+// scene buffers are the ones the shadow rays traverse; count 0 with no
+// sampled environment disables it. It also carries the telemetry counters,
+// since every shading kernel reads it: with rayCounts set, the path rays
+// shaded at each bounce go to rayCounts[0, TELEMETRY_BOUNCES) and the
+// shadow rays cast to rayCounts[TELEMETRY_BOUNCES]; the persistent
+// pipeline's load balance follows.
+/**
+ * World-space hash grid of incoming radiance at diffuse path vertices, see
+ * radianceCache.h. Cells hold the sum of the cosine-distributed incoming
+ * radiance samples added to them in xyz and their count in w; keys are
+ * fingerprints of the cell coordinates, 0 for an empty slot.
+ */
+struct RadianceCache {
+    unsigned int * keys;    // NULL: no cache
+    float4 * cells;
+    unsigned int mask;      // slots - 1, a power of two
+    float cellSize;         // world units per cell edge
+};
+
+/**
+ * World-space hash grid of learned incoming-light distributions, see
+ * guiding.h. Each slot has GUIDE_RECORD floats in both arrays: in
+ * `training`, the luminance per unit pdf of the light found in each
+ * direction bin, then the sample count; in `distributions`, a CDF over
+ * the bins built from them before the launch, all zero while untrained.
+ */
+struct PathGuide {
+    unsigned int * keys;            // NULL: scattering is not guided
+    float * training;               // NULL once learning has finished
+    const float * distributions;
+    unsigned int mask;              // slots - 1, a power of two
+    float cellSize;                 // world units per cell edge
+};
+
+/**
+ * The caustic photons of photonMap.h, sorted by the bucket of their cell:
+ * bucket b holds photons cellStart[b] .. cellEnd[b] - 1, or none if
+ * cellStart[b] is PHOTON_EMPTY_BUCKET.
+ */
+struct PhotonGrid {
+    const float4 * positions;       // NULL: no photon map
+    const float4 * power;           // flux, rgb
+    const unsigned int * cellStart;
+    const unsigned int * cellEnd;
+    unsigned int mask;              // buckets - 1, a power of two
+    float radius;                   // of a gather, half a cell edge
+};
+
+/**
+ * A pixel's weighted reservoir of light samples, see restir.h: the point on
+ * Scene::lights[light] it holds (light -1 for none), the sum of the
+ * resampling weights and the number of candidates streamed through it,
+ * and its unbiased contribution weight W, the estimate of 1 / pdf of the
+ * point in area measure.
+ */
+struct Reservoir {
+    glm::vec3 point;
+    float weightSum;
+    glm::vec3 normal;       // of the light at point; only its line matters
+    float candidates;
+    int light;
+    float W;
+};
+
+/**
+ * A world-space box of participating medium (see media.h and
+ * Scene::loadMedium). Its extinction per world unit is `density`, times
+ * the trilinearly interpolated grid value for a heterogeneous medium, whose
+ * samples sit at the corners of voxels spanning the box like an SDF's.
+ * `albedo` of what it extinguishes scatters, by a Henyey-Greenstein phase
+ * function of asymmetry `g`. A coarse grid of majorants, each bounding the
+ * extinction over its cell, lets tracking take long steps through thin
+ * regions; a homogeneous medium has one cell.
+ */
+struct Medium {
+    glm::vec3 boundsMin;
+    float density;
+    glm::vec3 boundsMax;
+    float g;
+    glm::vec3 albedo;
+    int voxelOffset;                // first value in Scene::mediumVoxels, x fastest; -1: homogeneous
+    glm::ivec3 resolution;          // grid samples along each axis, at least 2
+    int majorantOffset;             // first value in Scene::mediumMajorants, x fastest
+    glm::ivec3 majorantResolution;  // majorant cells along each axis
+    cudaTextureObject_t texture;    // of the grid, on the device the table is on; 0 on the host
+};
+
+// Pointers to the scene's media, passed to kernels by value
+struct MediumData {
+    const Medium * media;
+    int count;                      // 0: rays travel through vacuum
+    const float * majorants;
+    const float * voxels;           // host tracing only; NULL on the device
+};
+
+// What a pixel's samples cost since the last reset, for the ray cost views
+struct RayCost {
+    unsigned int bounces;           // path segments shaded
+    unsigned int nodes;             // BVH nodes their rays fetched (split pipeline only)
+    unsigned int shadowRays;
+};
+
+struct LightData {
+    const Light * lights;
+    int count;
+    const LightNode * lightTree;        // NULL: lights are picked by power alone
+    EnvironmentLight environment;
+    const DeviceGeom * geoms;
+    int geomCount;
+    const BVHNode * bvhNodes;
+    const int * bvhGeomIndices;
+    MeshData meshData;
+    unsigned long long * rayCounts;     // NULL: telemetry off
+    int traceDepth;                     // remainingBounces of a camera ray
+    int firstPixel;                     // image index of the band's first pixel, for seeding
+    RadianceCache cache;                // keys NULL: paths are traced in full
+    PathGuide guide;                    // keys NULL: diffuse bounces sample the cosine lobe alone
+    PhotonGrid photons;                 // positions NULL: caustics are path traced
+    const Reservoir * reservoirs;       // per image pixel, for camera hits; NULL for plain NEE
+    unsigned int * geomHits;            // path hits per geom, for paged geometry; NULL: not counted
+    RayCost * rayCost;                  // per image pixel, like reservoirs; NULL: not counted
+    MediumData media;
+    bool packetShadows;                 // shadow rays walk the BVH a warp at a time (occludedPacket)
+};
+
+// 64 bytes in four 16-byte quads, grouped by which hits read them so that
+// shading fetches only the quads it needs (see fetchMaterial): every hit
+// reads the first, non-emitters the second, specular lobes the third and
+// normal or roughness maps the fourth
+struct alignas(16) Material {
     glm::vec3 color;
-    struct {
-        float exponent;
-        glm::vec3 color;
-    } specular;
+    float emittance;
     float hasReflective;
     float hasRefractive;
     float indexOfRefraction;
-    float emittance;
+    // Entries of Scene::textures, or -1: the albedo map scales color, the
+    // tangent-space normal map bends the shading normal and the roughness
+    // map (its first channel) sets specular.exponent
+    int albedoMap;
+    struct {
+        glm::vec3 color;
+        float exponent;
+    } specular;
+    int normalMap;
+    int roughnessMap;
+    int unused[2];          // pads the last quad
 };
 
 struct Camera {
@@ -49,6 +409,35 @@ struct Camera {
     glm::vec3 right;
     glm::vec2 fov;
     glm::vec2 pixelLength;
+    float lensRadius;       // thin-lens aperture radius, 0 for a pinhole
+    float focalDistance;    // distance along view to the plane in focus
+    glm::vec3 motion;       // translation over the open shutter, 0 for a still camera
+};
+
+// One point of the camera path of an animation render
+struct CameraKeyframe {
+    int frame;
+    glm::vec3 position;
+    glm::vec3 lookAt;
+};
+
+// One pose of a geom's path in an animation render
+struct GeomKeyframe {
+    int geom;
+    int frame;
+    glm::vec3 translation;
+    glm::vec3 rotation;
+    glm::vec3 scale;
+};
+
+// A geom's pose for one animation frame, as uploaded for the GPU to
+// rebuild its DeviceGeom from (see pathtraceAnimateGeoms)
+struct GeomTransform {
+    int geom;
+    enum GeomType type;     // Geom::type, not its device specialization
+    glm::vec3 translation;
+    glm::vec3 rotation;
+    glm::vec3 scale;
 };
 
 struct RenderState {
@@ -57,6 +446,30 @@ struct RenderState {
     int traceDepth;
     std::vector<glm::vec3> image;
     std::string imageName;
+    std::vector<CameraKeyframe> keyframes;  // sorted by frame
+    float shutter;          // frames the shutter stays open, blurring keyframe motion
+    float eyeSeparation;    // STEREO: distance between the two eyes, 0 for a single view
+    // Headless renders stop short of `iterations` once the estimated
+    // relative error drops below TARGETERROR or after TIMELIMIT seconds; 0 for neither
+    float targetError;
+    float timeLimit;
+
+    // Views rendered together: two for stereo, stacked left over right
+    int viewCount() const {
+        return eyeSeparation > 0.0f ? 2 : 1;
+    }
+
+    // The camera of view `view`: for stereo, `camera` moved half the eye
+    // separation along its right axis, keeping its orientation
+    Camera viewCamera(int view) const {
+        Camera eye = camera;
+        if (viewCount() > 1) {
+            glm::vec3 offset = camera.right * (eyeSeparation * (view - 0.5f));
+            eye.position += offset;
+            eye.lookAt += offset;
+        }
+        return eye;
+    }
 };
 
 struct PathSegment {
@@ -64,6 +477,11 @@ struct PathSegment {
 	glm::vec3 color;
 	int pixelIndex;
 	int remainingBounces;
+	int sampleIndex;    // the pixel's sample number, for the sampler
+	bool specularPath;  // left the camera hit by a reflection or refraction
+	glm::vec3 radiance; // next-event estimation: light gathered so far
+	float scatterPdf;   // solid-angle pdf of the last bounce, 0 if it was specular, -1 if it
+	                    // was specular after a diffuse vertex while photons carry caustics
 };
 
 // Use with a corresponding PathSegment to do:
@@ -73,10 +491,50 @@ struct ShadeableIntersection {
   float t;
   glm::vec3 surfaceNormal;
   int materialId;
+  int geomIndex;
+  bool frontFace;           // hit from outside; surfaceNormal faces the ray either way
+  // Textured materials only, see surfaceFrame
+  glm::vec2 uv;
+  glm::vec3 tangent;        // unit, along increasing u
+  float bitangentSign;      // bitangent = bitangentSign * cross(normal, tangent)
+  float uvDensity;          // uv units per world unit on the surface
+};
+
+// Structure-of-arrays storage for a buffer of PathSegments. Each field group
+// is one aligned 16-byte record (8 for the cone), so every kernel issues
+// coalesced vector loads and only for the groups it needs (finalGather reads colorPixel
+// alone). The ints share the w components; see pathbuffers.h.
+// A buffer allocated compact (PathtraceOptions::compactPaths) has only the
+// last four groups, 44 bytes a path against the others' 72.
+struct PathSegments {
+  float4 * originBounces;   // ray origin, remainingBounces
+  float4 * direction;       // ray direction, sampleIndex with specularPath in its top bit
+  float4 * colorPixel;      // color, pixelIndex
+  float4 * radiancePdf;     // radiance, scatterPdf
+  float2 * cone;            // ray coneWidth, coneSpread
+  float4 * originOctDirection;  // ray origin, octahedral direction as 2x16-bit unorm
+  uint4 * throughputPixel;      // color and radiance as half3, pixelIndex and remainingBounces
+  uint2 * samplePdf;            // sampleIndex as in direction, scatterPdf
+  unsigned int * packedCone;    // ray coneWidth and coneSpread as half2
+};
+
+// Structure-of-arrays storage for a buffer of ShadeableIntersections. Miss
+// tests and sort keys only touch the 8-byte tMaterial. Bounces traced into
+// hit records (see storeHitRecord) fill only tMaterial and hitRecord.
+struct ShadeableIntersections {
+  float2 * tMaterial;       // t, materialId (geomIndex for hit records)
+  float4 * normal;          // surface normal, geomIndex (~geomIndex for back faces)
+  float4 * surface;         // uv, packed tangent, signed uvDensity; textured materials only
+  int2 * hitRecord;         // triangle, barycentrics as 2x16-bit unorm
 };
 
 // CHECKITOUT - a simple struct for storing scene geometry information per-pixel.
-// What information might be helpful for guiding a denoising filter?
+// Packed into 16 bytes since the denoiser reads it once per tap per level;
+// use the helpers in gbuffer.h rather than touching the fields directly.
+// World position is rebuilt from `t` and the camera ray through the pixel.
 struct GBufferPixel {
   float t;
+  unsigned short normal[2];   // octahedral, 2x16-bit unorm
+  __half albedo[3];
+  short materialId;
 };
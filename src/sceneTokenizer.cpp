@@ -0,0 +1,143 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "sceneTokenizer.h"
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+}
+
+static bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool Token::is(const char *word) const {
+    size_t length = strlen(word);
+    return size() == length && memcmp(begin, word, length) == 0;
+}
+
+std::string Token::str() const {
+    return std::string(begin, end);
+}
+
+int Token::toInt() const {
+    const char *c = begin;
+    bool negative = c != end && *c == '-';
+    if (c != end && (*c == '-' || *c == '+')) {
+        c++;
+    }
+    int value = 0;
+    for (; c != end && isDigit(*c); c++) {
+        value = value * 10 + (*c - '0');
+    }
+    return negative ? -value : value;
+}
+
+/**
+ * Digits with an optional sign, point and exponent are converted exactly
+ * (so the same as atof would) when the significand fits a double and the
+ * power of ten is itself exact: a single correctly rounded multiply or
+ * divide then gives the correctly rounded result. Anything else, from
+ * long significands to "inf", falls back to strtod on a stack copy.
+ */
+float Token::toFloat() const {
+    static const double powersOfTen[23] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *c = begin;
+    bool negative = c != end && *c == '-';
+    if (c != end && (*c == '-' || *c == '+')) {
+        c++;
+    }
+    uint64_t significand = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any = false;
+    for (; c != end && isDigit(*c); c++, any = true) {
+        if (digits > 0 || *c != '0') {
+            significand = significand * 10 + (*c - '0');
+            digits++;
+        }
+    }
+    if (c != end && *c == '.') {
+        for (c++; c != end && isDigit(*c); c++, any = true) {
+            if (digits > 0 || *c != '0') {
+                significand = significand * 10 + (*c - '0');
+                digits++;
+            }
+            exponent--;
+        }
+    }
+    if (any && c != end && (*c == 'e' || *c == 'E')) {
+        c++;
+        bool negativeExponent = c != end && *c == '-';
+        if (c != end && (*c == '-' || *c == '+')) {
+            c++;
+        }
+        int e = 0;
+        bool exponentDigits = false;
+        for (; c != end && isDigit(*c) && e < 10000; c++, exponentDigits = true) {
+            e = e * 10 + (*c - '0');
+        }
+        exponent += negativeExponent ? -e : e;
+        any = exponentDigits;
+    }
+
+    if (any && c == end && digits <= 15 && exponent >= -22 && exponent <= 22) {
+        double value = (double)significand;
+        value = exponent < 0 ? value / powersOfTen[-exponent] : value * powersOfTen[exponent];
+        return (float)(negative ? -value : value);
+    }
+
+    char buffer[64];
+    size_t length = size() < sizeof(buffer) - 1 ? size() : sizeof(buffer) - 1;
+    memcpy(buffer, begin, length);
+    buffer[length] = '\0';
+    return (float)strtod(buffer, NULL);
+}
+
+LineTokenizer::LineTokenizer() : p(NULL), end(NULL) {
+    none.begin = none.end = NULL;
+}
+
+LineTokenizer::LineTokenizer(const void *data, size_t size) {
+    none.begin = none.end = NULL;
+    reset(data, size);
+}
+
+void LineTokenizer::reset(const void *data, size_t size) {
+    p = (const char *)data;
+    end = p + size;
+    tokens.clear();
+}
+
+bool LineTokenizer::nextLine() {
+    tokens.clear();
+    if (p == end) {
+        return false;
+    }
+    while (p != end && *p != '\n' && *p != '\r') {
+        while (p != end && isSpace(*p)) {
+            p++;
+        }
+        Token token;
+        token.begin = p;
+        while (p != end && *p != '\n' && *p != '\r' && !isSpace(*p)) {
+            p++;
+        }
+        token.end = p;
+        if (token.size() > 0) {
+            tokens.push_back(token);
+        }
+    }
+    // "\n", "\r\n" and a lone "\r" all end a line
+    if (p != end && *p == '\r') {
+        p++;
+    }
+    if (p != end && *p == '\n') {
+        p++;
+    }
+    return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * Allocation-free splitting of the text scene and OBJ formats into
+ * whitespace-separated tokens, one line at a time. Tokens point straight
+ * into the caller's buffer (usually a MappedFile), which must outlive them.
+ */
+
+// A run of non-whitespace characters; empty when the line has no such token
+struct Token {
+    const char *begin;
+    const char *end;
+
+    size_t size() const { return end - begin; }
+    bool is(const char *word) const;
+    std::string str() const;
+    // The leading integer, like atoi
+    int toInt() const;
+    // Like atof: exact fast path for plain decimals, strtod for the rest
+    float toFloat() const;
+};
+
+class LineTokenizer {
+public:
+    LineTokenizer();
+    LineTokenizer(const void *data, size_t size);
+    void reset(const void *data, size_t size);
+
+    // Splits the next line; false once the input is used up
+    bool nextLine();
+
+    size_t size() const { return tokens.size(); }
+    bool empty() const { return tokens.empty(); }
+    // Tokens past the end of the line read as empty
+    const Token &operator[](size_t i) const { return i < tokens.size() ? tokens[i] : none; }
+
+private:
+    const char *p;
+    const char *end;
+    std::vector<Token> tokens;  // reused, so only ever-longer lines allocate
+    Token none;
+};
@@ -0,0 +1,217 @@
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+
+#include "telemetry.h"
+#include "pathtrace.h"
+#include "powerMonitor.h"
+
+// One period's counts, or the running totals
+struct TelemetryCounts {
+    long long iterations;
+    long long samples;
+    RayTelemetry rays;
+    double seconds;
+    double joules;      // the GPUs drew, with powerMonitor
+};
+
+static bool telemetryOn = false;
+static std::string telemetryTarget;
+static double telemetryPeriod = 5.0;
+static TelemetryCounts period;
+static TelemetryCounts totals;
+static std::chrono::steady_clock::time_point periodStart;
+static double periodStartJoules = 0.0;
+
+static bool prometheusTarget() {
+    const std::string suffix = ".prom";
+    return telemetryTarget.size() >= suffix.size()
+        && telemetryTarget.compare(telemetryTarget.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static long long secondaryRays(const RayTelemetry &rays) {
+    long long count = 0;
+    for (int bounce = 1; bounce < TELEMETRY_BOUNCES; bounce++) {
+        count += rays.pathRays[bounce];
+    }
+    return count;
+}
+
+static double mraysPerSecond(const TelemetryCounts &counts) {
+    long long rays = counts.rays.pathRays[0] + secondaryRays(counts.rays) + counts.rays.shadowRays;
+    return counts.seconds > 0.0 ? rays / (counts.seconds * 1e6) : 0.0;
+}
+
+static double samplesPerJoule(const TelemetryCounts &counts) {
+    return counts.joules > 0.0 ? counts.samples / counts.joules : 0.0;
+}
+
+static void writeJson(FILE *out, const TelemetryCounts &counts) {
+    const RayTelemetry &rays = counts.rays;
+    fprintf(out, "{\"time\": %lld, \"seconds\": %.3f, \"iterations\": %lld, \"samples\": %lld, "
+        "\"ms_per_iteration\": %.4f, \"path_rays\": [",
+        (long long)time(NULL), counts.seconds, counts.iterations, counts.samples,
+        counts.iterations > 0 ? counts.seconds * 1e3 / counts.iterations : 0.0);
+    // Trailing empty bounces are left out
+    int bounces = TELEMETRY_BOUNCES;
+    while (bounces > 1 && rays.pathRays[bounces - 1] == 0) {
+        bounces--;
+    }
+    for (int bounce = 0; bounce < bounces; bounce++) {
+        fprintf(out, "%s%lld", bounce > 0 ? ", " : "", rays.pathRays[bounce]);
+    }
+    fprintf(out, "], \"primary_rays\": %lld, \"secondary_rays\": %lld, \"shadow_rays\": %lld, "
+        "\"mrays_per_s\": %.2f, \"samples_per_s\": %.2f",
+        rays.pathRays[0], secondaryRays(rays), rays.shadowRays, mraysPerSecond(counts),
+        counts.seconds > 0.0 ? counts.samples / counts.seconds : 0.0);
+    if (powerMonitor::available()) {
+        fprintf(out, ", \"joules\": %.2f, \"watts\": %.1f, \"power_limit_watts\": %.1f, "
+            "\"samples_per_joule\": %.4f", counts.joules,
+            counts.seconds > 0.0 ? counts.joules / counts.seconds : 0.0, powerMonitor::limitWatts(),
+            samplesPerJoule(counts));
+    }
+    // Bounces per warp of the persistent pipeline, averaged over its launches
+    if (rays.queueLaunches > 0 && rays.queueWarps > 0) {
+        double mean = (double)rays.queueBounces / rays.queueWarps;
+        double max = (double)rays.queueWarpMax / rays.queueLaunches;
+        fprintf(out, ", \"queue_launches\": %lld, \"queue_warp_bounces\": "
+            "{\"min\": %.1f, \"mean\": %.1f, \"max\": %.1f}, \"queue_imbalance\": %.3f",
+            rays.queueLaunches, (double)rays.queueWarpMin / rays.queueLaunches, mean, max,
+            mean > 0.0 ? max / mean : 0.0);
+    }
+    fprintf(out, "}\n");
+    fflush(out);
+}
+
+// Rewritten through a temporary so a scraper never reads half a file
+static void writePrometheus(const TelemetryCounts &counts, const TelemetryCounts &latest) {
+    std::string tmpFile = telemetryTarget + ".tmp";
+    FILE *out = fopen(tmpFile.c_str(), "w");
+    if (out == NULL) {
+        return;
+    }
+    const RayTelemetry &rays = counts.rays;
+    fprintf(out, "# TYPE pathtracer_iterations_total counter\npathtracer_iterations_total %lld\n",
+        counts.iterations);
+    fprintf(out, "# TYPE pathtracer_samples_total counter\npathtracer_samples_total %lld\n", counts.samples);
+    fprintf(out, "# TYPE pathtracer_path_rays_total counter\n");
+    for (int bounce = 0; bounce < TELEMETRY_BOUNCES; bounce++) {
+        fprintf(out, "pathtracer_path_rays_total{bounce=\"%d\"} %lld\n", bounce, rays.pathRays[bounce]);
+    }
+    fprintf(out, "# TYPE pathtracer_primary_rays_total counter\npathtracer_primary_rays_total %lld\n",
+        rays.pathRays[0]);
+    fprintf(out, "# TYPE pathtracer_secondary_rays_total counter\npathtracer_secondary_rays_total %lld\n",
+        secondaryRays(rays));
+    fprintf(out, "# TYPE pathtracer_shadow_rays_total counter\npathtracer_shadow_rays_total %lld\n",
+        rays.shadowRays);
+    fprintf(out, "# TYPE pathtracer_queue_launches_total counter\npathtracer_queue_launches_total %lld\n",
+        rays.queueLaunches);
+    fprintf(out, "# TYPE pathtracer_queue_warps_total counter\npathtracer_queue_warps_total %lld\n",
+        rays.queueWarps);
+    fprintf(out, "# TYPE pathtracer_queue_warp_bounces_total counter\n");
+    fprintf(out, "pathtracer_queue_warp_bounces_total{warp=\"min\"} %lld\n", rays.queueWarpMin);
+    fprintf(out, "pathtracer_queue_warp_bounces_total{warp=\"max\"} %lld\n", rays.queueWarpMax);
+    fprintf(out, "pathtracer_queue_warp_bounces_total{warp=\"all\"} %lld\n", rays.queueBounces);
+    fprintf(out, "# TYPE pathtracer_iteration_seconds gauge\npathtracer_iteration_seconds %.6f\n",
+        latest.iterations > 0 ? latest.seconds / latest.iterations : 0.0);
+    fprintf(out, "# TYPE pathtracer_mrays_per_second gauge\npathtracer_mrays_per_second %.2f\n",
+        mraysPerSecond(latest));
+    if (powerMonitor::available()) {
+        fprintf(out, "# TYPE pathtracer_energy_joules_total counter\npathtracer_energy_joules_total %.2f\n",
+            counts.joules);
+        fprintf(out, "# TYPE pathtracer_power_watts gauge\npathtracer_power_watts %.1f\n",
+            latest.seconds > 0.0 ? latest.joules / latest.seconds : 0.0);
+        fprintf(out, "# TYPE pathtracer_power_limit_watts gauge\npathtracer_power_limit_watts %.1f\n",
+            powerMonitor::limitWatts());
+        fprintf(out, "# TYPE pathtracer_samples_per_joule gauge\npathtracer_samples_per_joule %.4f\n",
+            samplesPerJoule(latest));
+    }
+    bool ok = fclose(out) == 0;
+#ifdef _WIN32
+    // rename() does not replace an existing file on Windows
+    if (ok) {
+        remove(telemetryTarget.c_str());
+    }
+#endif
+    if (!ok || rename(tmpFile.c_str(), telemetryTarget.c_str()) != 0) {
+        remove(tmpFile.c_str());
+    }
+}
+
+static void report() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    period.seconds = std::chrono::duration<double>(now - periodStart).count();
+    pathtraceReadTelemetry(period.rays);
+    const double joules = powerMonitor::joules();
+    period.joules = joules - periodStartJoules;
+    periodStartJoules = joules;
+
+    totals.iterations += period.iterations;
+    totals.samples += period.samples;
+    totals.seconds += period.seconds;
+    totals.joules += period.joules;
+    for (int bounce = 0; bounce < TELEMETRY_BOUNCES; bounce++) {
+        totals.rays.pathRays[bounce] += period.rays.pathRays[bounce];
+    }
+    totals.rays.shadowRays += period.rays.shadowRays;
+    totals.rays.queueLaunches += period.rays.queueLaunches;
+    totals.rays.queueWarps += period.rays.queueWarps;
+    totals.rays.queueWarpMin += period.rays.queueWarpMin;
+    totals.rays.queueWarpMax += period.rays.queueWarpMax;
+    totals.rays.queueBounces += period.rays.queueBounces;
+
+    if (prometheusTarget()) {
+        writePrometheus(totals, period);
+    } else if (telemetryTarget == "-") {
+        writeJson(stdout, period);
+    } else {
+        FILE *out = fopen(telemetryTarget.c_str(), "a");
+        if (out != NULL) {
+            writeJson(out, period);
+            fclose(out);
+        }
+    }
+    period = TelemetryCounts();
+    periodStart = now;
+}
+
+bool telemetry::start(const std::string &target, double periodSeconds) {
+    telemetryTarget = target;
+    telemetryPeriod = periodSeconds > 0.0 ? periodSeconds : 5.0;
+    if (target != "-" && !prometheusTarget()) {
+        FILE *out = fopen(target.c_str(), "a");
+        if (out == NULL) {
+            return false;
+        }
+        fclose(out);
+    }
+    period = TelemetryCounts();
+    totals = TelemetryCounts();
+    periodStart = std::chrono::steady_clock::now();
+    periodStartJoules = powerMonitor::joules();
+    telemetryOn = true;
+    pathtraceEnableTelemetry(true);
+    return true;
+}
+
+bool telemetry::enabled() {
+    return telemetryOn;
+}
+
+void telemetry::traced(int samples) {
+    if (!telemetryOn) {
+        return;
+    }
+    period.iterations++;
+    period.samples += samples;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - periodStart).count();
+    if (elapsed >= telemetryPeriod) {
+        report();
+    }
+}
+
+void telemetry::flush() {
+    if (telemetryOn && period.iterations > 0) {
+        report();
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+
+/**
+ * Throughput telemetry for unattended runs, switched on in every mode with
+ *
+ *     --telemetry TARGET [--telemetry-period SECONDS]
+ *
+ * Every period (5 s by default) the device ray counters (see RayTelemetry)
+ * are read and one report goes to TARGET: "-" prints a JSON object per line
+ * to stdout, a name ending in .prom is rewritten in the Prometheus text
+ * format (for a node_exporter textfile collector or any scraper reading
+ * it), and any other name gets the JSON lines appended. Reports hold the
+ * period's iterations, samples, wall-clock ms per iteration, path rays per
+ * bounce, primary, secondary and shadow rays, and Mrays/s, plus, after
+ * persistent-pipeline launches, the least, mean and most bounces a warp
+ * traced and the ratio of most to mean; the Prometheus file holds the
+ * running totals. Builds with ENABLE_NVML add the energy the GPUs drew
+ * over the period (see powerMonitor.h), their mean power and power limit,
+ * and samples per joule beside samples/s.
+ */
+namespace telemetry {
+    // Turns the device counters on; false if TARGET cannot be written
+    bool start(const std::string &target, double periodSeconds);
+
+    bool enabled();
+
+    // After each pathtrace() call, with the samples per pixel it traced
+    void traced(int samples);
+
+    // Reports what the current period has counted so far. Call before
+    // pathtraceFree(), which drops the device counters.
+    void flush();
+}
@@ -0,0 +1,208 @@
+#include <cmath>
+#include <cstring>
+#include <stb_image.h>
+
+#include "texture.h"
+#include "mappedFile.h"
+
+/**
+ * Host side of texture loading: decoding images into mip chains. The
+ * upload to CUDA arrays is in texture.cu.
+ */
+
+static float srgbToLinear(float c) {
+    return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static unsigned char linearToSrgb(float c) {
+    c = c <= 0.0031308f ? 12.92f * c : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+    c = c < 0.0f ? 0.0f : (c > 1.0f ? 1.0f : c);
+    return (unsigned char)(c * 255.0f + 0.5f);
+}
+
+/**
+ * Appends mip levels to an RGBA8 image down to 1x1, each texel the average
+ * of the (up to) 2x2 texels above it. Colour channels of sRGB images are
+ * averaged in linear space, so dark and bright texels blend correctly.
+ */
+static void buildMipChain(TextureImage &image) {
+    float toLinear[256];
+    for (int i = 0; i < 256; i++) {
+        toLinear[i] = image.srgb ? srgbToLinear(i / 255.0f) : i / 255.0f;
+    }
+    int width = image.width;
+    int height = image.height;
+    while (width > 1 || height > 1) {
+        const std::vector<unsigned char> &src = image.levels.back();
+        int nextWidth = width > 1 ? width / 2 : 1;
+        int nextHeight = height > 1 ? height / 2 : 1;
+        std::vector<unsigned char> dst(nextWidth * nextHeight * 4);
+        for (int y = 0; y < nextHeight; y++) {
+            int y0 = 2 * y < height ? 2 * y : height - 1;
+            int y1 = 2 * y + 1 < height ? 2 * y + 1 : y0;
+            for (int x = 0; x < nextWidth; x++) {
+                int x0 = 2 * x < width ? 2 * x : width - 1;
+                int x1 = 2 * x + 1 < width ? 2 * x + 1 : x0;
+                const unsigned char *texels[4] = {
+                    &src[(y0 * width + x0) * 4], &src[(y0 * width + x1) * 4],
+                    &src[(y1 * width + x0) * 4], &src[(y1 * width + x1) * 4]
+                };
+                unsigned char *out = &dst[(y * nextWidth + x) * 4];
+                for (int c = 0; c < 4; c++) {
+                    float sum = 0.0f;
+                    for (int k = 0; k < 4; k++) {
+                        sum += c < 3 ? toLinear[texels[k][c]] : texels[k][c] / 255.0f;
+                    }
+                    sum *= 0.25f;
+                    out[c] = c < 3 && image.srgb ? linearToSrgb(sum) : (unsigned char)(sum * 255.0f + 0.5f);
+                }
+            }
+        }
+        image.levels.push_back(dst);
+        width = nextWidth;
+        height = nextHeight;
+    }
+}
+
+static uint32_t readU32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * Reads a DDS file of BC1 ("DXT1" or DX10 BC1_UNORM[_SRGB]) or BC7 (DX10
+ * BC7_UNORM[_SRGB]) blocks. The block data is kept as is, one level per
+ * mip the file has.
+ */
+static bool loadDDS(TextureImage &image, std::string &error) {
+    MappedFile file(image.filename);
+    const unsigned char *data = file.data();
+    if (data == NULL || file.size() < 128 || memcmp(data, "DDS ", 4) != 0) {
+        error = "could not read DDS texture " + image.filename;
+        return false;
+    }
+    image.height = readU32(data + 12);
+    image.width = readU32(data + 16);
+    int mipCount = readU32(data + 28) > 0 ? (int)readU32(data + 28) : 1;
+    size_t offset = 128;
+    if (memcmp(data + 84, "DXT1", 4) == 0) {
+        image.format = TEXTURE_BC1;
+    } else if (memcmp(data + 84, "DX10", 4) == 0 && file.size() >= 148) {
+        uint32_t dxgiFormat = readU32(data + 128);
+        offset = 148;
+        if (dxgiFormat == 71 || dxgiFormat == 72) {
+            image.format = TEXTURE_BC1;
+        } else if (dxgiFormat == 98 || dxgiFormat == 99) {
+            image.format = TEXTURE_BC7;
+        } else {
+            error = "unsupported DXGI format in " + image.filename + ", only BC1 and BC7 are read";
+            return false;
+        }
+    } else {
+        error = "unsupported DDS format in " + image.filename + ", only BC1 and BC7 are read";
+        return false;
+    }
+    if (image.width <= 0 || image.height <= 0 || image.width % 4 != 0 || image.height % 4 != 0) {
+        error = "DDS texture " + image.filename + " is not a multiple of 4 texels on each side";
+        return false;
+    }
+
+    const size_t blockBytes = image.format == TEXTURE_BC1 ? 8 : 16;
+    int width = image.width;
+    int height = image.height;
+    for (int level = 0; level < mipCount; level++) {
+        size_t bytes = (size_t)((width + 3) / 4) * ((height + 3) / 4) * blockBytes;
+        if (offset + bytes > file.size()) {
+            break;
+        }
+        image.levels.push_back(std::vector<unsigned char>(data + offset, data + offset + bytes));
+        offset += bytes;
+        // Levels below 4x4 texels still take a whole block; CUDA arrays
+        // cannot hold them, so the chain stops above them
+        if (width < 8 || height < 8) {
+            break;
+        }
+        width /= 2;
+        height /= 2;
+    }
+    if (image.levels.empty()) {
+        error = "DDS texture " + image.filename + " is truncated";
+        return false;
+    }
+    return true;
+}
+
+bool textureLoader::load(TextureImage &image, std::string &error) {
+    image.levels.clear();
+    size_t dot = image.filename.find_last_of('.');
+    std::string extension = dot == std::string::npos ? "" : image.filename.substr(dot + 1);
+    if (extension == "dds" || extension == "DDS") {
+        return loadDDS(image, error);
+    }
+    if (extension == "hdr" || extension == "HDR") {
+        int channels;
+        float *pixels = stbi_loadf(image.filename.c_str(), &image.width, &image.height, &channels, 4);
+        if (pixels == NULL) {
+            error = "could not read texture " + image.filename + ": " + stbi_failure_reason();
+            return false;
+        }
+        image.format = TEXTURE_RGBA32F;
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(pixels);
+        image.levels.push_back(std::vector<unsigned char>(bytes,
+            bytes + (size_t)image.width * image.height * 4 * sizeof(float)));
+        stbi_image_free(pixels);
+        return true;
+    }
+
+    int channels;
+    unsigned char *pixels = stbi_load(image.filename.c_str(), &image.width, &image.height, &channels, 4);
+    if (pixels == NULL) {
+        error = "could not read texture " + image.filename + ": " + stbi_failure_reason();
+        return false;
+    }
+    image.format = TEXTURE_RGBA8;
+    image.levels.push_back(std::vector<unsigned char>(pixels, pixels + image.width * image.height * 4));
+    stbi_image_free(pixels);
+    buildMipChain(image);
+    return true;
+}
+
+bool textureLoader::loadEnvironment(EnvironmentMap &environment, std::string &error) {
+    TextureImage &image = environment.image;
+    image.srgb = false;
+    if (!load(image, error)) {
+        return false;
+    }
+    if (image.format != TEXTURE_RGBA32F) {
+        error = "environment map " + image.filename + " is not an .hdr image";
+        image.levels.clear();
+        return false;
+    }
+
+    const int width = image.width;
+    const int height = image.height;
+    const float *texels = reinterpret_cast<const float *>(image.levels[0].data());
+    environment.marginalCdf.assign(height + 1, 0.0f);
+    environment.conditionalCdf.assign((size_t)height * (width + 1), 0.0f);
+    for (int y = 0; y < height; y++) {
+        const float sinTheta = sinf(3.14159265f * (y + 0.5f) / height);
+        float *row = &environment.conditionalCdf[(size_t)y * (width + 1)];
+        for (int x = 0; x < width; x++) {
+            const float *t = &texels[((size_t)y * width + x) * 4];
+            float luminance = 0.2126f * t[0] + 0.7152f * t[1] + 0.0722f * t[2];
+            row[x + 1] = row[x] + (luminance > 0.0f ? luminance : 0.0f) * sinTheta;
+        }
+        const float rowSum = row[width];
+        environment.marginalCdf[y + 1] = environment.marginalCdf[y] + rowSum;
+        // Black rows are sampled uniformly, though the marginal never picks them
+        for (int x = 1; x <= width; x++) {
+            row[x] = rowSum > 0.0f ? row[x] / rowSum : (float)x / width;
+        }
+    }
+    const float total = environment.marginalCdf[height];
+    for (int y = 1; y <= height; y++) {
+        environment.marginalCdf[y] = total > 0.0f ? environment.marginalCdf[y] / total : (float)y / height;
+    }
+    return true;
+}
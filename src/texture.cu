@@ -0,0 +1,148 @@
+#include <cmath>
+#include <cstring>
+
+#include "texture.h"
+
+/**
+ * Device side of textures: the mipmapped CUDA arrays and texture objects.
+ * Block-compressed arrays need the channel kinds CUDA 11.5 added; older
+ * toolkits only get the RGBA8 path.
+ */
+
+// Channel format of the array texels; false if this build cannot make one
+static bool channelFormat(const TextureImage &image, cudaChannelFormatDesc &desc) {
+    if (image.format == TEXTURE_RGBA8) {
+        desc = cudaCreateChannelDesc<uchar4>();
+        return true;
+    }
+    if (image.format == TEXTURE_RGBA32F) {
+        desc = cudaCreateChannelDesc<float4>();
+        return true;
+    }
+#if CUDART_VERSION >= 11050
+    cudaChannelFormatKind kind;
+    if (image.format == TEXTURE_BC1) {
+        kind = image.srgb ? cudaChannelFormatKindUnsignedBlockCompressed1SRGB
+            : cudaChannelFormatKindUnsignedBlockCompressed1;
+    } else {
+        kind = image.srgb ? cudaChannelFormatKindUnsignedBlockCompressed7SRGB
+            : cudaChannelFormatKindUnsignedBlockCompressed7;
+    }
+    desc = cudaCreateChannelDesc(8, 8, 8, 8, kind);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool textureLoader::create(const TextureImage &image, DeviceTexture &texture, cudaMipmappedArray_t &array,
+        std::string &error) {
+    cudaChannelFormatDesc desc;
+    if (!channelFormat(image, desc)) {
+        error = "texture " + image.filename + " is block-compressed, which needs CUDA 11.5 or later";
+        return false;
+    }
+    const int levels = (int)image.levels.size();
+    cudaExtent extent = make_cudaExtent(image.width, image.height, 0);
+    if (cudaMallocMipmappedArray(&array, &desc, extent, levels) != cudaSuccess) {
+        cudaGetLastError();
+        error = "could not allocate texture " + image.filename + " on the device";
+        return false;
+    }
+
+    // Block-compressed levels are copied as rows of 4x4 blocks
+    const bool compressed = image.format == TEXTURE_BC1 || image.format == TEXTURE_BC7;
+    const bool hdr = image.format == TEXTURE_RGBA32F;
+    const size_t texelBytes = hdr ? 4 * sizeof(float) : 4;
+    const size_t blockBytes = image.format == TEXTURE_BC1 ? 8 : 16;
+    int width = image.width;
+    int height = image.height;
+    for (int level = 0; level < levels; level++) {
+        cudaArray_t levelArray;
+        cudaGetMipmappedArrayLevel(&levelArray, array, level);
+        size_t rowBytes = compressed ? (size_t)((width + 3) / 4) * blockBytes : width * texelBytes;
+        size_t rows = compressed ? (height + 3) / 4 : height;
+        cudaMemcpy2DToArray(levelArray, 0, 0, image.levels[level].data(), rowBytes, rowBytes, rows,
+                cudaMemcpyHostToDevice);
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+
+    cudaResourceDesc resource;
+    memset(&resource, 0, sizeof(resource));
+    resource.resType = cudaResourceTypeMipmappedArray;
+    resource.res.mipmap.mipmap = array;
+
+    cudaTextureDesc sampling;
+    memset(&sampling, 0, sizeof(sampling));
+    sampling.addressMode[0] = cudaAddressModeWrap;
+    // An environment map's rows end at the poles
+    sampling.addressMode[1] = hdr ? cudaAddressModeClamp : cudaAddressModeWrap;
+    sampling.filterMode = cudaFilterModeLinear;
+    sampling.mipmapFilterMode = cudaFilterModeLinear;
+    sampling.maxMipmapLevelClamp = (float)(levels - 1);
+    sampling.readMode = hdr ? cudaReadModeElementType : cudaReadModeNormalizedFloat;
+    sampling.normalizedCoords = 1;
+    // Block-compressed sRGB textures decode through their channel kind
+    sampling.sRGB = image.srgb && !compressed;
+
+    texture = DeviceTexture();
+    texture.size = sqrtf((float)image.width * (float)image.height);
+    if (cudaCreateTextureObject(&texture.object, &resource, &sampling, NULL) != cudaSuccess) {
+        cudaGetLastError();
+        cudaFreeMipmappedArray(array);
+        error = "could not create a texture object for " + image.filename;
+        return false;
+    }
+    return true;
+}
+
+bool textureLoader::createVolume(const float *values, int width, int height, int depth, DeviceTexture &texture,
+        cudaMipmappedArray_t &array, std::string &error) {
+    cudaChannelFormatDesc desc = cudaCreateChannelDesc<float>();
+    cudaExtent extent = make_cudaExtent(width, height, depth);
+    if (cudaMallocMipmappedArray(&array, &desc, extent, 1) != cudaSuccess) {
+        cudaGetLastError();
+        error = "could not allocate a volume texture on the device";
+        return false;
+    }
+    cudaArray_t levelArray;
+    cudaGetMipmappedArrayLevel(&levelArray, array, 0);
+    cudaMemcpy3DParms copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.srcPtr = make_cudaPitchedPtr((void *)values, width * sizeof(float), width, height);
+    copy.dstArray = levelArray;
+    copy.extent = extent;
+    copy.kind = cudaMemcpyHostToDevice;
+    cudaMemcpy3D(&copy);
+
+    cudaResourceDesc resource;
+    memset(&resource, 0, sizeof(resource));
+    resource.resType = cudaResourceTypeMipmappedArray;
+    resource.res.mipmap.mipmap = array;
+
+    cudaTextureDesc sampling;
+    memset(&sampling, 0, sizeof(sampling));
+    sampling.addressMode[0] = cudaAddressModeClamp;
+    sampling.addressMode[1] = cudaAddressModeClamp;
+    sampling.addressMode[2] = cudaAddressModeClamp;
+    sampling.filterMode = cudaFilterModeLinear;
+    sampling.mipmapFilterMode = cudaFilterModePoint;
+    sampling.readMode = cudaReadModeElementType;
+    sampling.normalizedCoords = 1;
+
+    texture = DeviceTexture();
+    texture.size = cbrtf((float)width * (float)height * (float)depth);
+    if (cudaCreateTextureObject(&texture.object, &resource, &sampling, NULL) != cudaSuccess) {
+        cudaGetLastError();
+        cudaFreeMipmappedArray(array);
+        error = "could not create a volume texture object";
+        return false;
+    }
+    return true;
+}
+
+void textureLoader::destroy(const DeviceTexture &texture, cudaMipmappedArray_t array) {
+    cudaDestroyTextureObject(texture.object);
+    cudaFreeMipmappedArray(array);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+
+/**
+ * Material textures: loading image files with full mip chains on the host
+ * (texture.cpp), and turning them into mipmapped, hardware-filtered CUDA
+ * texture objects (texture.cu).
+ *
+ * PNG, JPEG, TGA, BMP and the other formats stb_image reads are expanded to
+ * RGBA8 and mipmapped with a box filter (in linear space for sRGB maps).
+ * DDS files holding BC1 or BC7 blocks are uploaded compressed, at 4 or 8
+ * bits per texel, with whatever mip levels the file carries; their
+ * dimensions must be multiples of 4. Radiance (.hdr) files stay float, at
+ * one level, for environment maps.
+ */
+
+// What a TextureImage's levels hold
+enum TextureFormat {
+    TEXTURE_RGBA8,
+    TEXTURE_BC1,    // 8 bytes per 4x4 block
+    TEXTURE_BC7,    // 16 bytes per 4x4 block
+    TEXTURE_RGBA32F,    // .hdr files: one level, v clamped rather than wrapped
+};
+
+// Textures one scene can bind, the size of the device-side table
+#define MAX_TEXTURES 256
+
+struct TextureImage {
+    std::string filename;
+    bool srgb;              // colour data (albedo maps), decoded to linear when sampled
+    int format;             // a TextureFormat; the fields below are set by load()
+    int width;
+    int height;
+    std::vector<std::vector<unsigned char> > levels;    // mip 0 first
+};
+
+/**
+ * An equirectangular HDR image lighting the rays that leave the scene,
+ * with u = 0..1 around +y from +x towards +z and v = 0 at +y. The CDFs
+ * importance-sample its texels by luminance * sin(theta), the density of
+ * their solid angle: the marginal one over rows (height + 1 entries) and a
+ * conditional one over each row's columns (width + 1 entries per row).
+ */
+struct EnvironmentMap {
+    TextureImage image;     // no environment if the filename is empty
+    float intensity;        // scales the image's radiance
+    std::vector<float> marginalCdf;
+    std::vector<float> conditionalCdf;
+};
+
+// A texture as the shading kernels see it
+struct DeviceTexture {
+    cudaTextureObject_t object;     // a virtual texture's is the tile pool's (see virtualTexture.h)
+    float size;             // sqrt(width * height): texels per unit of uv footprint
+    int levels;             // virtual textures: mip levels; 0 for a texture object of its own
+    int width;              // virtual textures: size of level 0
+    int height;
+    int firstPage;          // virtual textures: page table entry of level 0's first tile
+};
+
+namespace textureLoader {
+    // Reads image.filename into image's format, size and levels
+    bool load(TextureImage &image, std::string &error);
+
+    // Loads environment.image, which must be an .hdr file, and builds its CDFs
+    bool loadEnvironment(EnvironmentMap &environment, std::string &error);
+
+    /**
+     * Uploads the texture to a mipmapped array on the current device and
+     * makes a wrapping, trilinearly filtered texture object over it that
+     * reads normalized floats (RGBA32F ones read as is). Free both with
+     * destroy().
+     *
+     * @return false, with error set and nothing allocated, if the device
+     *         or CUDA version cannot hold the texture's format.
+     */
+    bool create(const TextureImage &image, DeviceTexture &texture, cudaMipmappedArray_t &array,
+            std::string &error);
+
+    /**
+     * Uploads a width x height x depth grid of floats, x fastest, to a
+     * one-level 3D array on the current device, with a clamped, trilinearly
+     * filtered texture object over it reading normalized coordinates, for
+     * SDF volumes. Free both with destroy().
+     */
+    bool createVolume(const float *values, int width, int height, int depth, DeviceTexture &texture,
+            cudaMipmappedArray_t &array, std::string &error);
+
+    void destroy(const DeviceTexture &texture, cudaMipmappedArray_t array);
+}
@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <cfloat>
+#include <cuda.h>
+#include <glm/glm.hpp>
+
+#include "tileCulling.h"
+#include "gbuffer.h"
+#include "lbvh.h"
+#include "deviceMemory.h"
+#include "../stream_compaction/common.h"
+#include "../stream_compaction/efficient.h"
+#include "../stream_compaction/radix.h"
+
+namespace TileCulling {
+
+#define CULL_BLOCK_SIZE 128
+// Low key bits below the tile, for the geom's type
+#define CULL_TYPE_BITS 3
+
+static AABB *dev_bounds = NULL;
+static int4 *dev_rects = NULL;          // per geom, its first and last tile each way
+static int *dev_counts = NULL;          // per geom, tiles covered, then their exclusive scan
+static unsigned int *dev_keys = NULL;   // per entry, tile and type
+static int *dev_entries = NULL;         // per entry, the geom
+static int *dev_offsets = NULL;         // per tile, plus the end
+static unsigned long long *dev_total = NULL;    // entries, summed wide as they can pass an int
+static int geomCapacity = 0;
+static int entryCapacity = 0;
+static int tileCapacity = 0;
+
+void freeScratch() {
+    deviceMemory::release(dev_bounds);
+    deviceMemory::release(dev_rects);
+    deviceMemory::release(dev_counts);
+    deviceMemory::release(dev_keys);
+    deviceMemory::release(dev_entries);
+    deviceMemory::release(dev_offsets);
+    deviceMemory::release(dev_total);
+    dev_bounds = NULL;
+    dev_rects = NULL;
+    dev_counts = NULL;
+    dev_keys = NULL;
+    dev_entries = NULL;
+    dev_offsets = NULL;
+    dev_total = NULL;
+    geomCapacity = 0;
+    entryCapacity = 0;
+    tileCapacity = 0;
+}
+
+/**
+ * The tiles geom `index`'s box covers on screen, padded by a pixel for
+ * antialiasing's jitter. A box straddling the eye's plane may cover any
+ * pixel, and one wholly behind it none.
+ */
+__global__ void kernTileRects(int n, const AABB *bounds, Camera cam, int tilesX, int tilesY, int4 *rects,
+        int *counts, unsigned long long *total) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index >= n) {
+        return;
+    }
+    const AABB box = bounds[index];
+    glm::vec2 lo(FLT_MAX);
+    glm::vec2 hi(-FLT_MAX);
+    int behind = 0;
+    for (int corner = 0; corner < 8; corner++) {
+        const glm::vec3 p((corner & 1) ? box.max.x : box.min.x, (corner & 2) ? box.max.y : box.min.y,
+            (corner & 4) ? box.max.z : box.min.z);
+        glm::vec2 pixel;
+        if (cameraProjectPoint(cam, p, pixel)) {
+            lo = glm::min(lo, pixel);
+            hi = glm::max(hi, pixel);
+        } else {
+            behind++;
+        }
+    }
+    int4 rect = make_int4(0, 0, tilesX - 1, tilesY - 1);
+    if (behind == 8) {
+        rect = make_int4(0, 0, -1, -1);
+    } else if (behind == 0) {
+        const float right = (float)(cam.resolution.x - 1);
+        const float bottom = (float)(cam.resolution.y - 1);
+        if (hi.x < -1.0f || hi.y < -1.0f || lo.x > right + 1.0f || lo.y > bottom + 1.0f) {
+            rect = make_int4(0, 0, -1, -1);
+        } else {
+            rect.x = (int)glm::clamp(lo.x - 1.0f, 0.0f, right) / CULL_TILE_SIZE;
+            rect.y = (int)glm::clamp(lo.y - 1.0f, 0.0f, bottom) / CULL_TILE_SIZE;
+            rect.z = (int)glm::clamp(hi.x + 1.0f, 0.0f, right) / CULL_TILE_SIZE;
+            rect.w = (int)glm::clamp(hi.y + 1.0f, 0.0f, bottom) / CULL_TILE_SIZE;
+        }
+    }
+    rects[index] = rect;
+    const int count = rect.z < rect.x ? 0 : (rect.z - rect.x + 1) * (rect.w - rect.y + 1);
+    counts[index] = count;
+    if (count > 0) {
+        atomicAdd(total, (unsigned long long)count);
+    }
+}
+
+// One entry per tile the geom covers, from its scanned count on
+__global__ void kernEmitEntries(int n, const DeviceGeom *geoms, const int4 *rects, const int *firsts,
+        int tilesX, unsigned int *keys, int *entries) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index >= n) {
+        return;
+    }
+    const int4 rect = rects[index];
+    const unsigned int type = (unsigned int)geoms[index].type;
+    int out = firsts[index];
+    for (int y = rect.y; y <= rect.w; y++) {
+        for (int x = rect.x; x <= rect.z; x++) {
+            keys[out] = ((unsigned int)(y * tilesX + x) << CULL_TYPE_BITS) | type;
+            entries[out] = index;
+            out++;
+        }
+    }
+}
+
+// Where each tile's run of the sorted entries starts; tiles without one start where the next does
+__global__ void kernTileOffsets(int count, int tiles, const unsigned int *keys, int *offsets) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index >= count) {
+        return;
+    }
+    const int tile = keys[index] >> CULL_TYPE_BITS;
+    const int previous = index > 0 ? (int)(keys[index - 1] >> CULL_TYPE_BITS) : -1;
+    for (int t = previous + 1; t <= tile; t++) {
+        offsets[t] = index;
+    }
+    if (index == count - 1) {
+        for (int t = tile + 1; t <= tiles; t++) {
+            offsets[t] = count;
+        }
+    }
+}
+
+static int blocksFor(int n) {
+    return StreamCompaction::Common::blocksFor(n, CULL_BLOCK_SIZE);
+}
+
+bool build(const Camera &cam, int n, const DeviceGeom *geoms, const Mesh *meshes, const BVHNode *meshNodes,
+        const SphereCloud *clouds, const BVHNode *cloudNodes, const SdfVolume *sdfs, TileGeomLists &lists) {
+    const int tilesX = (cam.resolution.x + CULL_TILE_SIZE - 1) / CULL_TILE_SIZE;
+    const int tilesY = (cam.resolution.y + CULL_TILE_SIZE - 1) / CULL_TILE_SIZE;
+    const int tiles = tilesX * tilesY;
+    if (n > geomCapacity) {
+        deviceMemory::release(dev_bounds);
+        deviceMemory::release(dev_rects);
+        deviceMemory::release(dev_counts);
+        deviceMemory::allocate(&dev_bounds, n * sizeof(AABB));
+        deviceMemory::allocate(&dev_rects, n * sizeof(int4));
+        deviceMemory::allocate(&dev_counts, n * sizeof(int));
+        geomCapacity = n;
+    }
+    if (dev_total == NULL) {
+        deviceMemory::allocate(&dev_total, sizeof(unsigned long long));
+    }
+    if (tiles + 1 > tileCapacity) {
+        deviceMemory::release(dev_offsets);
+        deviceMemory::allocate(&dev_offsets, (tiles + 1) * sizeof(int));
+        tileCapacity = tiles + 1;
+    }
+
+    int count = 0;
+    if (n > 0) {
+        LBVH::geomBounds(n, geoms, meshes, meshNodes, clouds, cloudNodes, sdfs, dev_bounds);
+        cudaMemset(dev_total, 0, sizeof(unsigned long long));
+        kernTileRects<<<blocksFor(n), CULL_BLOCK_SIZE>>>(n, dev_bounds, cam, tilesX, tilesY, dev_rects,
+            dev_counts, dev_total);
+        unsigned long long total = 0;
+        cudaMemcpy(&total, dev_total, sizeof(total), cudaMemcpyDeviceToHost);
+        checkCUDAError("tile culling bins");
+        if (total > CULL_MAX_ENTRIES) {
+            return false;
+        }
+        count = (int)total;
+        StreamCompaction::Efficient::scan(n, dev_counts, dev_counts);
+    }
+
+    if (count > entryCapacity) {
+        deviceMemory::release(dev_keys);
+        deviceMemory::release(dev_entries);
+        deviceMemory::allocate(&dev_keys, count * sizeof(unsigned int));
+        deviceMemory::allocate(&dev_entries, count * sizeof(int));
+        entryCapacity = count;
+    }
+    if (count > 0) {
+        kernEmitEntries<<<blocksFor(n), CULL_BLOCK_SIZE>>>(n, geoms, dev_rects, dev_counts, tilesX, dev_keys,
+            dev_entries);
+        int keyBits = CULL_TYPE_BITS;
+        while ((1 << (keyBits - CULL_TYPE_BITS)) < tiles) {
+            keyBits++;
+        }
+        // Stable, so each tile's geoms of a type stay in index order
+        StreamCompaction::Radix::sortByKey(count, dev_keys, dev_entries, keyBits);
+        kernTileOffsets<<<blocksFor(count), CULL_BLOCK_SIZE>>>(count, tiles, dev_keys, dev_offsets);
+    } else {
+        cudaMemset(dev_offsets, 0, (tiles + 1) * sizeof(int));
+    }
+    checkCUDAError("tile culling lists");
+
+    lists.offsets = dev_offsets;
+    lists.geoms = dev_entries;
+    lists.width = cam.resolution.x;
+    lists.tilesX = tilesX;
+    return true;
+}
+
+}
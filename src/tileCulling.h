@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cuda_runtime.h>
+#include "sceneStructs.h"
+
+/**
+ * Per-tile geom lists for PathtraceOptions::tileCulling. A camera ray can
+ * only hit the geoms whose boxes project over its pixel, so, as a tiled
+ * rasterizer bins triangles, each geom's world box is projected into the
+ * image and the geom is listed in every CULL_TILE_SIZE tile its screen
+ * rectangle covers. The camera bounce then tests a ray against its tile's
+ * list alone, staged in shared memory when a block's rays share a tile,
+ * rather than walking the top-level BVH from the root. Scenes seen from
+ * the front, with a few geoms over each part of the image, gain most.
+ */
+
+#define CULL_TILE_SIZE 16
+// Longest list a tile tests; rays in tiles with more geoms traverse the BVH
+#define CULL_TILE_MAX_GEOMS 64
+// (geom, tile) entries binned at most; past that no lists are built
+#define CULL_MAX_ENTRIES (1 << 24)
+
+struct TileGeomLists {
+    const int * offsets;    // tile t lists geoms[offsets[t]] .. geoms[offsets[t + 1] - 1]
+    const int * geoms;      // by type within a tile, as Scene::buildBVH groups leaves, then by index
+    int width;              // of the image, in pixels
+    int tilesX;
+};
+
+namespace TileCulling {
+    /**
+     * Bins geoms[0, n) into the tiles of the pinhole camera `cam`. All
+     * pointers are device memory on the current device. Returns false, with
+     * `lists` left as they were, when the geoms cover too many tiles to
+     * bin (see CULL_MAX_ENTRIES).
+     */
+    bool build(const Camera &cam, int n, const DeviceGeom *geoms, const Mesh *meshes, const BVHNode *meshNodes,
+            const SphereCloud *clouds, const BVHNode *cloudNodes, const SdfVolume *sdfs, TileGeomLists &lists);
+
+    void freeScratch();
+}
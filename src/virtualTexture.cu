@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "virtualTexture.h"
+#include "deviceMemory.h"
+
+// Where a page table entry points into the images
+struct VirtualPage {
+    int image;
+    int level;
+    int tileX;
+    int tileY;
+};
+
+static const std::vector<TextureImage> *images = NULL;    // the scene's, which outlive the pool
+static std::vector<VirtualPage> pageTiles;
+static int *hst_pages = NULL;           // pinned; what dev_pages holds once the queued copies land
+static int *dev_pages = NULL;
+static unsigned char *hst_feedback = NULL;  // pinned
+static unsigned char *dev_feedback = NULL;
+static bool feedbackPending = false;    // a copy of dev_feedback is on its way
+static cudaEvent_t feedbackCopied = NULL;
+static unsigned char *hst_staging = NULL;   // pinned, VT_UPLOADS_PER_UPDATE slots of texels
+static cudaArray_t poolArray = NULL;
+static cudaTextureObject_t poolLinear = 0;
+static cudaTextureObject_t poolSrgb = 0;
+static std::vector<int> slotPages;      // page each slot holds, -1 if free
+static std::vector<long long> slotWanted;   // update the slot's tile was last wanted in
+static std::vector<char> slotPinned;    // holds a mip tail
+static long long updates = 0;
+
+static int wrapTexel(int i, int n) {
+    i %= n;
+    return i < 0 ? i + n : i;
+}
+
+// The texels of page `page`'s slot, border included, as RGBA8 rows
+static void fillSlot(int page, unsigned char *out) {
+    const VirtualPage &tile = pageTiles[page];
+    const TextureImage &image = (*images)[tile.image];
+    const int width = virtualLevelSize(image.width, tile.level);
+    const int height = virtualLevelSize(image.height, tile.level);
+    const unsigned char *texels = image.levels[tile.level].data();
+    for (int j = 0; j < VT_SLOT_SIZE; j++) {
+        const int y = wrapTexel(tile.tileY * VT_TILE_SIZE + j - VT_TILE_BORDER, height);
+        for (int i = 0; i < VT_SLOT_SIZE; i++) {
+            const int x = wrapTexel(tile.tileX * VT_TILE_SIZE + i - VT_TILE_BORDER, width);
+            memcpy(out + (j * VT_SLOT_SIZE + i) * 4, texels + ((size_t)y * width + x) * 4, 4);
+        }
+    }
+}
+
+// Queues the copy of staged texels into `slot` on the legacy stream
+static void copySlot(const unsigned char *staged, int slot) {
+    cudaMemcpy2DToArrayAsync(poolArray, (slot % VT_POOL_SLOTS) * VT_SLOT_SIZE * 4,
+        (slot / VT_POOL_SLOTS) * VT_SLOT_SIZE, staged, VT_SLOT_SIZE * 4, VT_SLOT_SIZE * 4, VT_SLOT_SIZE,
+        cudaMemcpyHostToDevice, 0);
+}
+
+// A filtered view of the pool, decoding sRGB or not
+static cudaTextureObject_t poolTexture(bool srgb) {
+    cudaResourceDesc resource;
+    memset(&resource, 0, sizeof(resource));
+    resource.resType = cudaResourceTypeArray;
+    resource.res.array.array = poolArray;
+
+    cudaTextureDesc sampling;
+    memset(&sampling, 0, sizeof(sampling));
+    sampling.addressMode[0] = cudaAddressModeClamp;
+    sampling.addressMode[1] = cudaAddressModeClamp;
+    sampling.filterMode = cudaFilterModeLinear;
+    sampling.readMode = cudaReadModeNormalizedFloat;
+    sampling.normalizedCoords = 1;
+    sampling.sRGB = srgb;
+    cudaTextureObject_t object = 0;
+    cudaCreateTextureObject(&object, &resource, &sampling, NULL);
+    return object;
+}
+
+VirtualTexturePool virtualTextures::create(const std::vector<TextureImage> &sceneImages, DeviceTexture *table) {
+    destroy();
+    VirtualTexturePool pool = {};
+    images = &sceneImages;
+
+    std::vector<DeviceTexture> textures(sceneImages.size(), DeviceTexture());
+    size_t textureBytes = 0;
+    for (size_t i = 0; i < sceneImages.size() && i < MAX_TEXTURES; i++) {
+        const TextureImage &image = sceneImages[i];
+        if (image.format != TEXTURE_RGBA8 || image.levels.empty()) {
+            continue;
+        }
+        DeviceTexture &texture = textures[i];
+        texture.size = sqrtf((float)image.width * (float)image.height);
+        texture.levels = (int)image.levels.size();
+        texture.width = image.width;
+        texture.height = image.height;
+        texture.firstPage = (int)pageTiles.size();
+        for (int level = 0; level < texture.levels; level++) {
+            const int width = virtualLevelSize(image.width, level);
+            const int height = virtualLevelSize(image.height, level);
+            for (int y = 0; y < (height + VT_TILE_SIZE - 1) / VT_TILE_SIZE; y++) {
+                for (int x = 0; x < (width + VT_TILE_SIZE - 1) / VT_TILE_SIZE; x++) {
+                    VirtualPage page = { (int)i, level, x, y };
+                    pageTiles.push_back(page);
+                }
+            }
+            textureBytes += image.levels[level].size();
+        }
+    }
+    const int slots = VT_POOL_SLOTS * VT_POOL_SLOTS;
+    if (pageTiles.empty()) {
+        return pool;
+    }
+
+    cudaChannelFormatDesc desc = cudaCreateChannelDesc<uchar4>();
+    if (cudaMallocArray(&poolArray, &desc, VT_POOL_SLOTS * VT_SLOT_SIZE, VT_POOL_SLOTS * VT_SLOT_SIZE)
+            != cudaSuccess) {
+        cudaGetLastError();
+        printf("Cannot allocate the virtual texture pool; textures are uploaded whole\n");
+        poolArray = NULL;
+        pageTiles.clear();
+        return pool;
+    }
+    poolLinear = poolTexture(false);
+    poolSrgb = poolTexture(true);
+    const size_t pageCount = pageTiles.size();
+    cudaMallocHost(&hst_pages, pageCount * sizeof(int));
+    cudaMallocHost(&hst_feedback, pageCount);
+    cudaMallocHost(&hst_staging, (size_t)VT_UPLOADS_PER_UPDATE * VT_SLOT_SIZE * VT_SLOT_SIZE * 4);
+    deviceMemory::allocate(&dev_pages, pageCount * sizeof(int));
+    deviceMemory::allocate(&dev_feedback, pageCount);
+    cudaMemset(dev_feedback, 0, pageCount);
+    if (feedbackCopied == NULL) {
+        cudaEventCreateWithFlags(&feedbackCopied, cudaEventDisableTiming);
+    }
+    std::fill(hst_pages, hst_pages + pageCount, -1);
+    slotPages.assign(slots, -1);
+    slotWanted.assign(slots, 0);
+    slotPinned.assign(slots, 0);
+    updates = 0;
+
+    // The mip tails go up now, into the first slots, and stay
+    std::vector<unsigned char> staged(VT_SLOT_SIZE * VT_SLOT_SIZE * 4);
+    int pinned = 0;
+    for (size_t i = 0; i < textures.size(); i++) {
+        DeviceTexture &texture = textures[i];
+        if (texture.levels == 0) {
+            continue;
+        }
+        texture.object = sceneImages[i].srgb ? poolSrgb : poolLinear;
+        const int page = virtualTexturePage(texture, virtualTextureTail(texture), 0, 0);
+        fillSlot(page, staged.data());
+        cudaMemcpy2DToArray(poolArray, (pinned % VT_POOL_SLOTS) * VT_SLOT_SIZE * 4,
+            (pinned / VT_POOL_SLOTS) * VT_SLOT_SIZE, staged.data(), VT_SLOT_SIZE * 4, VT_SLOT_SIZE * 4,
+            VT_SLOT_SIZE, cudaMemcpyHostToDevice);
+        hst_pages[page] = pinned;
+        slotPages[pinned] = page;
+        slotPinned[pinned] = 1;
+        pinned++;
+        table[i] = texture;
+    }
+    cudaMemcpy(dev_pages, hst_pages, pageCount * sizeof(int), cudaMemcpyHostToDevice);
+    printf("Virtual textures: %d textures in %zu tiles (%zu MB), paged through a %d MB pool\n", pinned,
+        pageCount, textureBytes >> 20, (int)(((size_t)slots * VT_SLOT_SIZE * VT_SLOT_SIZE * 4) >> 20));
+
+    pool.pages = dev_pages;
+    pool.feedback = dev_feedback;
+    return pool;
+}
+
+void virtualTextures::destroy() {
+    if (feedbackPending) {
+        cudaEventSynchronize(feedbackCopied);
+        feedbackPending = false;
+    }
+    if (poolArray != NULL) {
+        cudaDestroyTextureObject(poolLinear);
+        cudaDestroyTextureObject(poolSrgb);
+        cudaFreeArray(poolArray);
+        poolArray = NULL;
+    }
+    deviceMemory::release(dev_pages);
+    deviceMemory::release(dev_feedback);
+    dev_pages = NULL;
+    dev_feedback = NULL;
+    cudaFreeHost(hst_pages);
+    cudaFreeHost(hst_feedback);
+    cudaFreeHost(hst_staging);
+    hst_pages = NULL;
+    hst_feedback = NULL;
+    hst_staging = NULL;
+    pageTiles.clear();
+    slotPages.clear();
+    images = NULL;
+}
+
+void virtualTextures::update() {
+    if (!feedbackPending || cudaEventQuery(feedbackCopied) != cudaSuccess) {
+        cudaGetLastError();
+        return;
+    }
+    feedbackPending = false;
+    updates++;
+    std::vector<int> missing;
+    for (size_t page = 0; page < pageTiles.size(); page++) {
+        if (hst_feedback[page] == 0) {
+            continue;
+        }
+        if (hst_pages[page] >= 0) {
+            slotWanted[hst_pages[page]] = updates;
+        } else {
+            missing.push_back((int)page);
+        }
+    }
+    if (missing.empty()) {
+        return;
+    }
+    // Coarse tiles first: the finer ones fall back to them meanwhile
+    std::sort(missing.begin(), missing.end(), [](int a, int b) {
+        return pageTiles[a].level > pageTiles[b].level;
+    });
+
+    // Free slots first, then those whose tiles were wanted longest ago;
+    // none that were wanted by the launch the feedback came from
+    std::vector<int> victims;
+    for (int slot = 0; slot < (int)slotPages.size(); slot++) {
+        if (!slotPinned[slot] && slotWanted[slot] < updates) {
+            victims.push_back(slot);
+        }
+    }
+    std::sort(victims.begin(), victims.end(), [](int a, int b) {
+        if ((slotPages[a] < 0) != (slotPages[b] < 0)) {
+            return slotPages[a] < 0;
+        }
+        return slotWanted[a] < slotWanted[b];
+    });
+
+    const int uploads = std::min((int)std::min(missing.size(), victims.size()), VT_UPLOADS_PER_UPDATE);
+    for (int k = 0; k < uploads; k++) {
+        const int page = missing[k];
+        const int slot = victims[k];
+        if (slotPages[slot] >= 0) {
+            hst_pages[slotPages[slot]] = -1;
+        }
+        unsigned char *staged = hst_staging + (size_t)k * VT_SLOT_SIZE * VT_SLOT_SIZE * 4;
+        fillSlot(page, staged);
+        copySlot(staged, slot);
+        hst_pages[page] = slot;
+        slotPages[slot] = page;
+        slotWanted[slot] = updates;
+    }
+    // Behind the texels, so no launch finds a page before its tile
+    if (uploads > 0) {
+        cudaMemcpyAsync(dev_pages, hst_pages, pageTiles.size() * sizeof(int), cudaMemcpyHostToDevice, 0);
+    }
+}
+
+void virtualTextures::collect() {
+    if (dev_feedback == NULL || feedbackPending) {
+        return;
+    }
+    cudaMemcpyAsync(hst_feedback, dev_feedback, pageTiles.size(), cudaMemcpyDeviceToHost, 0);
+    cudaEventRecord(feedbackCopied, 0);
+    cudaMemsetAsync(dev_feedback, 0, pageTiles.size(), 0);
+    feedbackPending = true;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <vector>
+#include <cuda_runtime.h>
+#include "texture.h"
+
+/**
+ * Sparse virtual textures, with pathtraceUseVirtualTextures(true): RGBA8
+ * material textures are cut into VT_TILE_SIZE tiles per mip level, and
+ * only the tiles shading asks for live on the device, in one pool of
+ * slots every texture shares. Lookups go through a page table from tile to
+ * slot. A lookup marks each tile it wants in a feedback buffer, and where
+ * the tile is missing falls back to the nearest coarser resident level,
+ * down to the texture's mip tail (its first level that fits in one tile),
+ * which stays resident. Between launches the host reads the feedback back
+ * and streams the missing tiles, coarsest first, from the scene's mip
+ * chains into free slots or the ones wanted least recently, so device
+ * memory follows what the camera sees rather than the size of the texture
+ * library. Only the primary device pages; the others upload whole textures.
+ */
+
+#define VT_TILE_SIZE 128
+// Texels copied around each tile from its neighbours (wrapping at the
+// texture's edges), so bilinear filtering never reads another tile's slot
+#define VT_TILE_BORDER 1
+#define VT_SLOT_SIZE (VT_TILE_SIZE + 2 * VT_TILE_BORDER)
+// The pool is this many slots on a side: 1024 tiles, 69 MB
+#define VT_POOL_SLOTS 32
+// Tiles streamed in between two launches at most
+#define VT_UPLOADS_PER_UPDATE 64
+
+// The page table and feedback the kernels read and mark
+struct VirtualTexturePool {
+    const int * pages;          // slot of each tile, y * VT_POOL_SLOTS + x, or -1 until resident
+    unsigned char * feedback;   // per tile: a lookup wanted it since the last collect()
+};
+
+// Width or height of mip `level` of a texture `size` texels across, as the mip chains halve it
+__host__ __device__ inline int virtualLevelSize(int size, int level) {
+    size >>= level;
+    return size > 1 ? size : 1;
+}
+
+// Page table entry of the tile at (tileX, tileY) of mip `level`
+__host__ __device__ inline int virtualTexturePage(const DeviceTexture &texture, int level, int tileX, int tileY) {
+    int page = texture.firstPage;
+    for (int l = 0; l < level; l++) {
+        const int width = virtualLevelSize(texture.width, l);
+        const int height = virtualLevelSize(texture.height, l);
+        page += ((width + VT_TILE_SIZE - 1) / VT_TILE_SIZE) * ((height + VT_TILE_SIZE - 1) / VT_TILE_SIZE);
+    }
+    const int width = virtualLevelSize(texture.width, level);
+    return page + tileY * ((width + VT_TILE_SIZE - 1) / VT_TILE_SIZE) + tileX;
+}
+
+// The texture's mip tail: its first level that fits in one tile
+__host__ __device__ inline int virtualTextureTail(const DeviceTexture &texture) {
+    int level = 0;
+    while (level + 1 < texture.levels
+            && ((texture.width >> level) > VT_TILE_SIZE || (texture.height >> level) > VT_TILE_SIZE)) {
+        level++;
+    }
+    return level;
+}
+
+#ifdef __CUDACC__
+
+/**
+ * Bilinear lookup at (u, v), wrapped, in mip `level`, or in the nearest
+ * coarser level with the tile resident. Every tile visited is marked in
+ * the feedback.
+ */
+__device__ inline float4 sampleVirtualLevel(const VirtualTexturePool &pool, const DeviceTexture &texture,
+        float u, float v, int level) {
+    const int tail = virtualTextureTail(texture);
+    u -= floorf(u);
+    v -= floorf(v);
+    for (;;) {
+        const int width = virtualLevelSize(texture.width, level);
+        const int height = virtualLevelSize(texture.height, level);
+        const float x = u * width;
+        const float y = v * height;
+        const int tileX = min((int)x / VT_TILE_SIZE, (width - 1) / VT_TILE_SIZE);
+        const int tileY = min((int)y / VT_TILE_SIZE, (height - 1) / VT_TILE_SIZE);
+        const int page = virtualTexturePage(texture, level, tileX, tileY);
+        if (pool.feedback[page] == 0) {
+            pool.feedback[page] = 1;
+        }
+        const int slot = pool.pages[page];
+        if (slot >= 0) {
+            const float poolTexels = (float)(VT_POOL_SLOTS * VT_SLOT_SIZE);
+            const float px = (slot % VT_POOL_SLOTS) * VT_SLOT_SIZE + VT_TILE_BORDER + x - tileX * VT_TILE_SIZE;
+            const float py = (slot / VT_POOL_SLOTS) * VT_SLOT_SIZE + VT_TILE_BORDER + y - tileY * VT_TILE_SIZE;
+            return tex2D<float4>(texture.object, px / poolTexels, py / poolTexels);
+        }
+        if (level == tail) {
+            // Only before the tail's upload has landed
+            return make_float4(0.0f, 0.0f, 0.0f, 1.0f);
+        }
+        // Past the tail the coarser levels run out; the tail is always there
+        level = level + 1 < texture.levels ? level + 1 : tail;
+    }
+}
+
+// Trilinear lookup at mip level `lod`, as tex2DLod filters a texture object
+__device__ inline float4 sampleVirtualTexture(const VirtualTexturePool &pool, const DeviceTexture &texture,
+        float u, float v, float lod) {
+    lod = fminf(fmaxf(lod, 0.0f), (float)(texture.levels - 1));
+    const int level = (int)lod;
+    const float blend = lod - level;
+    float4 texel = sampleVirtualLevel(pool, texture, u, v, level);
+    if (blend > 0.0f) {
+        const float4 coarser = sampleVirtualLevel(pool, texture, u, v, level + 1);
+        texel.x += blend * (coarser.x - texel.x);
+        texel.y += blend * (coarser.y - texel.y);
+        texel.z += blend * (coarser.z - texel.z);
+        texel.w += blend * (coarser.w - texel.w);
+    }
+    return texel;
+}
+
+#endif
+
+namespace virtualTextures {
+    /**
+     * Sets up the tile pool and page table on the current device for the
+     * RGBA8 textures of `images`, uploads their mip tails and writes their
+     * entries into `table`; the other textures' entries are left for the
+     * caller. Returns the pool for the kernels, all NULL if there was no
+     * texture to page or the pool could not be allocated.
+     */
+    VirtualTexturePool create(const std::vector<TextureImage> &images, DeviceTexture *table);
+    void destroy();
+
+    // Before a launch: once the feedback of an earlier launch is back,
+    // streams in the tiles it wanted, behind the launches already queued
+    void update();
+    // After a launch: copies its feedback back behind it and clears it for the next
+    void collect();
+}
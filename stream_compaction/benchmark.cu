@@ -0,0 +1,198 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <thrust/copy.h>
+#include <thrust/device_ptr.h>
+#include <thrust/execution_policy.h>
+#include <thrust/partition.h>
+#include <thrust/remove.h>
+#include <thrust/sort.h>
+
+#include "common.h"
+#include "efficient.h"
+#include "radix.h"
+
+/**
+ * Times the path compaction and sorting primitives against thrust:
+ *
+ *     compaction_benchmark [--live FRACTION] [--key-bits B] [--repetitions N] [SIZE...]
+ *
+ * Each size (default 640k, 1M, 2M, 4M and 8M elements) partitions int path
+ * indices by pseudo-random flags, FRACTION of them set (default 0.5), with
+ * Efficient::partition, thrust::partition and thrust::remove_if, then sorts
+ * them by pseudo-random keys of B bits (default 6, a material ID) with
+ * Radix::sortByKey on B bits, on all 32, and thrust::sort_by_key. It
+ * prints the mean ms per call over N calls (default 20) after one warm-up.
+ * The partition's live prefix is checked against thrust::copy_if and the
+ * sort against thrust::stable_sort_by_key.
+ */
+
+struct IsDead {
+    __host__ __device__ bool operator()(int flag) const {
+        return flag == 0;
+    }
+};
+
+struct IsLive {
+    __host__ __device__ bool operator()(int flag) const {
+        return flag != 0;
+    }
+};
+
+__global__ void kernBenchmarkInputs(int n, unsigned int threshold, int keyBits,
+        int *indices, int *flags, unsigned int *keys) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index < n) {
+        unsigned int h = (unsigned int)index * 0x9e3779b9u;
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        indices[index] = index;
+        flags[index] = h < threshold;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        keys[index] = keyBits >= 32 ? h : h >> (32 - keyBits);
+    }
+}
+
+// Mean ms of `repetitions` runs of `run`, each after `reset` restores its inputs
+template <typename Reset, typename Run>
+static float timeRuns(int repetitions, Reset reset, Run run) {
+    cudaEvent_t start, stop;
+    cudaEventCreate(&start);
+    cudaEventCreate(&stop);
+    float total = 0.0f;
+    for (int r = -1; r < repetitions; r++) {
+        reset();
+        cudaEventRecord(start);
+        run();
+        cudaEventRecord(stop);
+        cudaEventSynchronize(stop);
+        float ms;
+        cudaEventElapsedTime(&ms, start, stop);
+        if (r >= 0) {
+            total += ms;
+        }
+    }
+    cudaEventDestroy(start);
+    cudaEventDestroy(stop);
+    return total / repetitions;
+}
+
+int main(int argc, char **argv) {
+    float live = 0.5f;
+    int keyBits = 6;
+    int repetitions = 20;
+    std::vector<int> sizes;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--live") == 0 && i + 1 < argc) {
+            live = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--key-bits") == 0 && i + 1 < argc) {
+            keyBits = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc) {
+            repetitions = atoi(argv[++i]);
+        } else {
+            sizes.push_back(atoi(argv[i]));
+        }
+    }
+    if (sizes.empty()) {
+        const int defaults[] = { 640 << 10, 1 << 20, 2 << 20, 4 << 20, 8 << 20 };
+        sizes.assign(defaults, defaults + 5);
+    }
+    if (repetitions < 1 || live < 0.0f || live > 1.0f || keyBits < 1 || keyBits > 32) {
+        fprintf(stderr, "usage: %s [--live FRACTION] [--key-bits B] [--repetitions N] [SIZE...]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    const unsigned int threshold = live >= 1.0f ? 0xffffffffu : (unsigned int)(live * 4294967296.0);
+
+    printf("%10s %8s %12s %12s %12s %12s %12s %12s\n", "elements", "live", "efficient",
+            "partition", "remove_if", "radix", "radix32", "sort_by_key");
+    for (size_t s = 0; s < sizes.size(); s++) {
+        const int n = sizes[s];
+        if (n <= 0) {
+            continue;
+        }
+        int *dev_indices, *dev_flags, *dev_work, *dev_out, *dev_expected;
+        unsigned int *dev_keys, *dev_sortKeys, *dev_expectedKeys;
+        cudaMalloc(&dev_indices, n * sizeof(int));
+        cudaMalloc(&dev_flags, n * sizeof(int));
+        cudaMalloc(&dev_work, n * sizeof(int));
+        cudaMalloc(&dev_out, n * sizeof(int));
+        cudaMalloc(&dev_expected, n * sizeof(int));
+        cudaMalloc(&dev_keys, n * sizeof(unsigned int));
+        cudaMalloc(&dev_sortKeys, n * sizeof(unsigned int));
+        cudaMalloc(&dev_expectedKeys, n * sizeof(unsigned int));
+        kernBenchmarkInputs<<<StreamCompaction::Common::blocksFor(n), SC_BLOCK_SIZE>>>(n, threshold,
+                keyBits, dev_indices, dev_flags, dev_keys);
+        StreamCompaction::Efficient::initScratch(n);
+        checkCUDAError("benchmark inputs");
+
+        auto resetIndices = [&]() {
+            cudaMemcpy(dev_work, dev_indices, n * sizeof(int), cudaMemcpyDeviceToDevice);
+        };
+        auto resetSort = [&]() {
+            resetIndices();
+            cudaMemcpy(dev_sortKeys, dev_keys, n * sizeof(unsigned int), cudaMemcpyDeviceToDevice);
+        };
+
+        int count = 0;
+        float efficientMs = timeRuns(repetitions, resetIndices, [&]() {
+            count = StreamCompaction::Efficient::partition(n, sizeof(int), dev_out, dev_work, dev_flags);
+        });
+        float partitionMs = timeRuns(repetitions, resetIndices, [&]() {
+            thrust::partition(thrust::device, dev_work, dev_work + n, dev_flags, IsLive());
+        });
+        float removeMs = timeRuns(repetitions, resetIndices, [&]() {
+            thrust::remove_if(thrust::device, dev_work, dev_work + n, dev_flags, IsDead());
+        });
+        checkCUDAError("benchmark compaction");
+
+        int expected = (int)(thrust::copy_if(thrust::device, dev_indices, dev_indices + n, dev_flags,
+                dev_expected, IsLive()) - dev_expected);
+        std::vector<int> got(count), want(expected);
+        cudaMemcpy(got.data(), dev_out, count * sizeof(int), cudaMemcpyDeviceToHost);
+        cudaMemcpy(want.data(), dev_expected, expected * sizeof(int), cudaMemcpyDeviceToHost);
+        const bool partitionMatches = got == want;
+
+        float radixMs = timeRuns(repetitions, resetSort, [&]() {
+            StreamCompaction::Radix::sortByKey(n, dev_sortKeys, dev_work, keyBits);
+        });
+        float radix32Ms = timeRuns(repetitions, resetSort, [&]() {
+            StreamCompaction::Radix::sortByKey(n, dev_sortKeys, dev_work, 32);
+        });
+        // Keeps the radix sort's result in dev_out for the check below
+        cudaMemcpy(dev_out, dev_work, n * sizeof(int), cudaMemcpyDeviceToDevice);
+        float thrustSortMs = timeRuns(repetitions, resetSort, [&]() {
+            thrust::sort_by_key(thrust::device, dev_sortKeys, dev_sortKeys + n, dev_work);
+        });
+        checkCUDAError("benchmark sort");
+
+        cudaMemcpy(dev_expectedKeys, dev_keys, n * sizeof(unsigned int), cudaMemcpyDeviceToDevice);
+        cudaMemcpy(dev_expected, dev_indices, n * sizeof(int), cudaMemcpyDeviceToDevice);
+        thrust::stable_sort_by_key(thrust::device, dev_expectedKeys, dev_expectedKeys + n, dev_expected);
+        got.resize(n);
+        want.resize(n);
+        cudaMemcpy(got.data(), dev_out, n * sizeof(int), cudaMemcpyDeviceToHost);
+        cudaMemcpy(want.data(), dev_expected, n * sizeof(int), cudaMemcpyDeviceToHost);
+        const bool sortMatches = got == want;
+
+        printf("%10d %8d %12.4f %12.4f %12.4f %12.4f %12.4f %12.4f%s%s\n", n, count, efficientMs,
+                partitionMs, removeMs, radixMs, radix32Ms, thrustSortMs,
+                partitionMatches ? "" : "  PARTITION MISMATCH", sortMatches ? "" : "  SORT MISMATCH");
+
+        cudaFree(dev_indices);
+        cudaFree(dev_flags);
+        cudaFree(dev_work);
+        cudaFree(dev_out);
+        cudaFree(dev_expected);
+        cudaFree(dev_keys);
+        cudaFree(dev_sortKeys);
+        cudaFree(dev_expectedKeys);
+    }
+    StreamCompaction::Radix::freeScratch();
+    StreamCompaction::Efficient::freeScratch();
+    return EXIT_SUCCESS;
+}
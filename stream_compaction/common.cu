@@ -0,0 +1,35 @@
+#include "common.h"
+
+void StreamCompaction::Common::checkCUDAErrorFn(const char *msg, const char *file, int line) {
+#ifndef NDEBUG
+    cudaDeviceSynchronize();
+#endif
+    cudaError_t err = cudaGetLastError();
+    if (cudaSuccess == err) {
+        return;
+    }
+
+    fprintf(stderr, "CUDA error");
+    if (file) {
+        fprintf(stderr, " (%s:%d)", file, line);
+    }
+    fprintf(stderr, ": %s: %s\n", msg, cudaGetErrorString(err));
+    exit(EXIT_FAILURE);
+}
+
+namespace StreamCompaction {
+namespace Common {
+
+__global__ void kernScatterWords(int n, int wordsPerElement,
+        int *odata, const int *idata, const int *indices) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index >= n * wordsPerElement) {
+        return;
+    }
+    int element = index / wordsPerElement;
+    int word = index - element * wordsPerElement;
+    odata[indices[element] * wordsPerElement + word] = idata[index];
+}
+
+}
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+#define FILENAME (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
+#define checkCUDAError(msg) StreamCompaction::Common::checkCUDAErrorFn(msg, FILENAME, __LINE__)
+
+// Threads per block for the element-wise kernels; the scan processes
+// 2 * SC_BLOCK_SIZE elements per block.
+#define SC_BLOCK_SIZE 256
+
+namespace StreamCompaction {
+namespace Common {
+    /**
+     * Check for CUDA errors; print and exit if there was a problem.
+     * Only synchronizes in debug builds, like the renderer's own check.
+     */
+    void checkCUDAErrorFn(const char *msg, const char *file = NULL, int line = -1);
+
+    inline int blocksFor(int n, int blockSize = SC_BLOCK_SIZE) {
+        return (n + blockSize - 1) / blockSize;
+    }
+
+    /**
+     * Scatters n elements of wordsPerElement 32-bit words each, so that
+     * element i of idata lands at slot indices[i] of odata. One thread per
+     * word keeps the reads fully coalesced for any payload size.
+     */
+    __global__ void kernScatterWords(int n, int wordsPerElement,
+            int *odata, const int *idata, const int *indices);
+}
+}
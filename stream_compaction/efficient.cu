@@ -0,0 +1,245 @@
+#include <cassert>
+
+#include "common.h"
+#include "efficient.h"
+
+namespace StreamCompaction {
+namespace Efficient {
+
+// Each block scans a tile of SCAN_ITEMS_PER_THREAD elements per thread
+#define SCAN_ITEMS_PER_THREAD 8
+#define SCAN_TILE_SIZE (SC_BLOCK_SIZE * SCAN_ITEMS_PER_THREAD)
+#define SCAN_WARPS (SC_BLOCK_SIZE / 32)
+#define FULL_MASK 0xffffffffu
+// Shared index with a word of padding every 32, so the per-thread runs of
+// SCAN_ITEMS_PER_THREAD words are read without bank conflicts
+#define SCAN_PADDED(i) ((i) + ((i) >> 5))
+
+// Look-back states of a tile, in the high half of its status word; the low
+// half holds the tile's aggregate or its inclusive prefix
+#define TILE_INVALID 0ull
+#define TILE_AGGREGATE 1ull
+#define TILE_PREFIX 2ull
+
+// Status words of the scan's tiles, then the counter handing tiles out;
+// the partition's destination indices and count. Reused across calls.
+static unsigned long long *dev_tileStatus = NULL;
+static int *dev_indices = NULL;
+static int *dev_count = NULL;
+static int scratchCapacity = 0;
+
+void freeScratch() {
+    cudaFree(dev_tileStatus);
+    cudaFree(dev_indices);
+    cudaFree(dev_count);
+    dev_tileStatus = NULL;
+    dev_indices = NULL;
+    dev_count = NULL;
+    scratchCapacity = 0;
+}
+
+void initScratch(int maxN) {
+    if (maxN <= scratchCapacity) {
+        return;
+    }
+    freeScratch();
+
+    int tiles = Common::blocksFor(maxN, SCAN_TILE_SIZE);
+    cudaMalloc(&dev_tileStatus, (tiles + 1) * sizeof(unsigned long long));
+    cudaMalloc(&dev_indices, maxN * sizeof(int));
+    cudaMalloc(&dev_count, sizeof(int));
+    scratchCapacity = maxN;
+    checkCUDAError("initScratch");
+}
+
+__device__ inline void publishTile(unsigned long long *tileStatus, int tile,
+        unsigned long long state, int value) {
+    atomicExch(tileStatus + tile, (state << 32) | (unsigned int)value);
+}
+
+/**
+ * Decoupled look-back (Merrill and Garland 2016), run by a whole warp:
+ * publishes the tile's aggregate, then sums the predecessors' published
+ * values 32 tiles at a time, back to the nearest one with an inclusive
+ * prefix, and publishes the tile's own. Returns the tile's exclusive
+ * prefix. Tiles are handed out in launch order, so every predecessor is
+ * already running and the spin always ends.
+ */
+__device__ int lookBack(unsigned long long *tileStatus, int tile, int aggregate, int lane) {
+    if (tile == 0) {
+        if (lane == 0) {
+            publishTile(tileStatus, 0, TILE_PREFIX, aggregate);
+        }
+        return 0;
+    }
+    if (lane == 0) {
+        publishTile(tileStatus, tile, TILE_AGGREGATE, aggregate);
+    }
+
+    int exclusive = 0;
+    for (int window = tile - 1; ; window -= 32) {
+        const int predecessor = window - lane;
+        unsigned long long word;
+        do {
+            word = predecessor >= 0
+                ? *(volatile unsigned long long *)(tileStatus + predecessor)
+                : TILE_PREFIX << 32;
+        } while (__any_sync(FULL_MASK, (word >> 32) == TILE_INVALID));
+
+        // Only the tiles up to the nearest inclusive prefix count
+        unsigned int prefixes = __ballot_sync(FULL_MASK, (word >> 32) == TILE_PREFIX);
+        int last = prefixes ? __ffs(prefixes) - 1 : 31;
+        int value = lane <= last ? (int)(unsigned int)word : 0;
+        for (int d = 16; d > 0; d >>= 1) {
+            value += __shfl_xor_sync(FULL_MASK, value, d);
+        }
+        exclusive += value;
+        if (prefixes) {
+            break;
+        }
+    }
+    if (lane == 0) {
+        publishTile(tileStatus, tile, TILE_PREFIX, exclusive + aggregate);
+    }
+    return exclusive;
+}
+
+/**
+ * Single-pass exclusive scan: each block takes the next tile, reduces it
+ * with warp shuffles, gets its prefix from the tiles before it by
+ * decoupled look-back and writes the tile scanned. Reading a whole tile
+ * before writing any of it lets odata alias idata.
+ */
+__global__ void __launch_bounds__(SC_BLOCK_SIZE) kernScanSinglePass(int n, int *odata,
+        const int *idata, unsigned long long *tileStatus, int *tileCounter) {
+    __shared__ int items[SCAN_PADDED(SCAN_TILE_SIZE)];
+    __shared__ int warpPrefix[SCAN_WARPS];
+    __shared__ int tileIndex;
+    __shared__ int tileExclusive;
+
+    const int t = threadIdx.x;
+    const int lane = t & 31;
+    const int warp = t >> 5;
+    if (t == 0) {
+        tileIndex = atomicAdd(tileCounter, 1);
+    }
+    __syncthreads();
+    const int tile = tileIndex;
+    const int base = tile * SCAN_TILE_SIZE;
+
+    // Coalesced loads, then each thread takes a run of consecutive items
+    for (int i = 0; i < SCAN_ITEMS_PER_THREAD; i++) {
+        int j = i * SC_BLOCK_SIZE + t;
+        items[SCAN_PADDED(j)] = base + j < n ? idata[base + j] : 0;
+    }
+    __syncthreads();
+    int values[SCAN_ITEMS_PER_THREAD];
+    int sum = 0;
+    for (int i = 0; i < SCAN_ITEMS_PER_THREAD; i++) {
+        values[i] = items[SCAN_PADDED(t * SCAN_ITEMS_PER_THREAD + i)];
+        sum += values[i];
+    }
+
+    int inclusive = sum;
+    for (int d = 1; d < 32; d <<= 1) {
+        int v = __shfl_up_sync(FULL_MASK, inclusive, d);
+        if (lane >= d) {
+            inclusive += v;
+        }
+    }
+    if (lane == 31) {
+        warpPrefix[warp] = inclusive;
+    }
+    __syncthreads();
+
+    if (warp == 0) {
+        int total = lane < SCAN_WARPS ? warpPrefix[lane] : 0;
+        int warpInclusive = total;
+        for (int d = 1; d < SCAN_WARPS; d <<= 1) {
+            int v = __shfl_up_sync(FULL_MASK, warpInclusive, d);
+            if (lane >= d) {
+                warpInclusive += v;
+            }
+        }
+        if (lane < SCAN_WARPS) {
+            warpPrefix[lane] = warpInclusive - total;
+        }
+        int aggregate = __shfl_sync(FULL_MASK, warpInclusive, SCAN_WARPS - 1);
+        int exclusive = lookBack(tileStatus, tile, aggregate, lane);
+        if (lane == 0) {
+            tileExclusive = exclusive;
+        }
+    }
+    __syncthreads();
+
+    int running = tileExclusive + warpPrefix[warp] + inclusive - sum;
+    for (int i = 0; i < SCAN_ITEMS_PER_THREAD; i++) {
+        items[SCAN_PADDED(t * SCAN_ITEMS_PER_THREAD + i)] = running;
+        running += values[i];
+    }
+    __syncthreads();
+    for (int i = 0; i < SCAN_ITEMS_PER_THREAD; i++) {
+        int j = i * SC_BLOCK_SIZE + t;
+        if (base + j < n) {
+            odata[base + j] = items[SCAN_PADDED(j)];
+        }
+    }
+}
+
+void scan(int n, int *dev_odata, const int *dev_idata) {
+    if (n <= 0) {
+        return;
+    }
+    initScratch(n);
+    int tiles = Common::blocksFor(n, SCAN_TILE_SIZE);
+    // Clears the tiles' status words and the tile counter after them
+    cudaMemsetAsync(dev_tileStatus, 0, (tiles + 1) * sizeof(unsigned long long));
+    kernScanSinglePass<<<tiles, SC_BLOCK_SIZE>>>(n, dev_odata, dev_idata, dev_tileStatus,
+            (int *)(dev_tileStatus + tiles));
+    checkCUDAError("scan");
+}
+
+/**
+ * Total of flags[0..n) from its exclusive scan.
+ */
+__global__ void kernScanTotal(int n, int *total, const int *scanned, const int *flags) {
+    if (threadIdx.x == 0) {
+        *total = scanned[n - 1] + (flags[n - 1] != 0);
+    }
+}
+
+/**
+ * Turns the exclusive scan of the flags into destination slots: flagged
+ * elements go to scan[i], the others after all flagged ones in order.
+ */
+__global__ void kernPartitionIndices(int n, int *indices, const int *flags, const int *numTrue) {
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index < n) {
+        int trueBefore = indices[index];
+        indices[index] = flags[index] ? trueBefore : *numTrue + index - trueBefore;
+    }
+}
+
+int partition(int n, size_t elemSize, void *dev_odata, const void *dev_idata, const int *dev_flags) {
+    assert(elemSize % sizeof(int) == 0);
+    if (n <= 0) {
+        return 0;
+    }
+    initScratch(n);
+
+    scan(n, dev_indices, dev_flags);
+    kernScanTotal<<<1, 1>>>(n, dev_count, dev_indices, dev_flags);
+    kernPartitionIndices<<<Common::blocksFor(n), SC_BLOCK_SIZE>>>(n, dev_indices, dev_flags, dev_count);
+
+    const int words = (int)(elemSize / sizeof(int));
+    Common::kernScatterWords<<<Common::blocksFor(n * words), SC_BLOCK_SIZE>>>(n, words,
+            (int *)dev_odata, (const int *)dev_idata, dev_indices);
+
+    int count;
+    cudaMemcpy(&count, dev_count, sizeof(int), cudaMemcpyDeviceToHost);
+    checkCUDAError("partition");
+    return count;
+}
+
+}
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+
+namespace StreamCompaction {
+namespace Efficient {
+    /**
+     * Allocates the scratch space for inputs of up to maxN elements, so no
+     * call below has to allocate. Calls with larger n grow it on demand.
+     */
+    void initScratch(int maxN);
+    void freeScratch();
+
+    /**
+     * Single-pass exclusive scan of n ints, with decoupled look-back
+     * between blocks. Both pointers are device memory and may alias.
+     */
+    void scan(int n, int *dev_odata, const int *dev_idata);
+
+    /**
+     * Stable partition of n elements of elemSize bytes (a multiple of 4).
+     * Elements whose dev_flags entry is non-zero are written to the front of
+     * dev_odata in their original order, the rest after them, also in order.
+     * Nothing is discarded. dev_odata and dev_idata must not alias.
+     *
+     * @return the number of flagged elements.
+     */
+    int partition(int n, size_t elemSize, void *dev_odata, const void *dev_idata, const int *dev_flags);
+}
+}
@@ -0,0 +1,147 @@
+#include <algorithm>
+
+#include "common.h"
+#include "efficient.h"
+#include "radix.h"
+
+namespace StreamCompaction {
+namespace Radix {
+
+// Digits sorted per pass
+#define RADIX_BITS 4
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define SORT_WARPS (SC_BLOCK_SIZE / 32)
+#define FULL_MASK 0xffffffffu
+
+// Ping-pong copies of keys and values plus the per-pass digit counts of
+// each block, digit-major, which are scanned in place into offsets.
+static unsigned int *dev_keysAlt = NULL;
+static int *dev_valuesAlt = NULL;
+static int *dev_digitOffsets = NULL;
+static int scratchCapacity = 0;
+
+void freeScratch() {
+    cudaFree(dev_keysAlt);
+    cudaFree(dev_valuesAlt);
+    cudaFree(dev_digitOffsets);
+    dev_keysAlt = NULL;
+    dev_valuesAlt = NULL;
+    dev_digitOffsets = NULL;
+    scratchCapacity = 0;
+}
+
+static void initScratch(int n) {
+    if (n <= scratchCapacity) {
+        return;
+    }
+    freeScratch();
+    cudaMalloc(&dev_keysAlt, n * sizeof(unsigned int));
+    cudaMalloc(&dev_valuesAlt, n * sizeof(int));
+    cudaMalloc(&dev_digitOffsets, RADIX_BUCKETS * Common::blocksFor(n) * sizeof(int));
+    scratchCapacity = n;
+    checkCUDAError("radix initScratch");
+}
+
+// Counts each block's keys per digit into counts[digit * gridDim.x + block]
+__global__ void kernDigitCounts(int n, int shift, unsigned int digitMask,
+        const unsigned int *keys, int *counts) {
+    __shared__ int blockCounts[RADIX_BUCKETS];
+    const int t = threadIdx.x;
+    if (t < RADIX_BUCKETS) {
+        blockCounts[t] = 0;
+    }
+    __syncthreads();
+    int index = (blockIdx.x * blockDim.x) + t;
+    if (index < n) {
+        atomicAdd(&blockCounts[(keys[index] >> shift) & digitMask], 1);
+    }
+    __syncthreads();
+    if (t < RADIX_BUCKETS) {
+        counts[t * gridDim.x + blockIdx.x] = blockCounts[t];
+    }
+}
+
+/**
+ * Stable scatter of one pass. Each lane finds the lanes of its warp with
+ * the same digit from one ballot per digit bit; its rank among them plus
+ * the counts of that digit in the warps before it and, from the scanned
+ * counts, in the blocks before it and of the smaller digits, is where its
+ * key and value go.
+ */
+__global__ void kernDigitScatter(int n, int shift, unsigned int digitMask, const int *offsets,
+        unsigned int *keysOut, int *valuesOut,
+        const unsigned int *keysIn, const int *valuesIn) {
+    __shared__ int warpCounts[SORT_WARPS][RADIX_BUCKETS];
+    const int t = threadIdx.x;
+    const int lane = t & 31;
+    const int warp = t >> 5;
+    for (int i = t; i < SORT_WARPS * RADIX_BUCKETS; i += blockDim.x) {
+        warpCounts[i / RADIX_BUCKETS][i % RADIX_BUCKETS] = 0;
+    }
+
+    int index = (blockIdx.x * blockDim.x) + t;
+    const bool valid = index < n;
+    unsigned int key = valid ? keysIn[index] : 0u;
+    unsigned int digit = (key >> shift) & digitMask;
+    unsigned int peers = __ballot_sync(FULL_MASK, valid);
+    for (int b = 0; b < RADIX_BITS; b++) {
+        unsigned int set = __ballot_sync(FULL_MASK, (digit >> b) & 1u);
+        peers &= (digit >> b) & 1u ? set : ~set;
+    }
+    const int rank = __popc(peers & ((1u << lane) - 1u));
+    __syncthreads();
+    if (valid && rank == 0) {
+        warpCounts[warp][digit] = __popc(peers);
+    }
+    __syncthreads();
+
+    // Counts per warp to exclusive prefixes over the warps, per digit
+    if (t < RADIX_BUCKETS) {
+        int sum = 0;
+        for (int w = 0; w < SORT_WARPS; w++) {
+            int count = warpCounts[w][t];
+            warpCounts[w][t] = sum;
+            sum += count;
+        }
+    }
+    __syncthreads();
+
+    if (valid) {
+        int dst = offsets[digit * gridDim.x + blockIdx.x] + warpCounts[warp][digit] + rank;
+        keysOut[dst] = key;
+        valuesOut[dst] = valuesIn[index];
+    }
+}
+
+void sortByKey(int n, unsigned int *dev_keys, int *dev_values, int numBits) {
+    if (n <= 1 || numBits <= 0) {
+        return;
+    }
+    numBits = std::min(numBits, 32);
+    initScratch(n);
+
+    unsigned int *keysIn = dev_keys;
+    int *valuesIn = dev_values;
+    unsigned int *keysOut = dev_keysAlt;
+    int *valuesOut = dev_valuesAlt;
+    const int blocks = Common::blocksFor(n);
+    for (int shift = 0; shift < numBits; shift += RADIX_BITS) {
+        const unsigned int digitMask = (1u << std::min(RADIX_BITS, numBits - shift)) - 1u;
+        kernDigitCounts<<<blocks, SC_BLOCK_SIZE>>>(n, shift, digitMask, keysIn, dev_digitOffsets);
+        Efficient::scan(RADIX_BUCKETS * blocks, dev_digitOffsets, dev_digitOffsets);
+        kernDigitScatter<<<blocks, SC_BLOCK_SIZE>>>(n, shift, digitMask, dev_digitOffsets,
+                keysOut, valuesOut, keysIn, valuesIn);
+        std::swap(keysIn, keysOut);
+        std::swap(valuesIn, valuesOut);
+    }
+
+    // An odd number of passes leaves the result in the scratch copies
+    if (keysIn != dev_keys) {
+        cudaMemcpy(dev_keys, keysIn, n * sizeof(unsigned int), cudaMemcpyDeviceToDevice);
+        cudaMemcpy(dev_values, valuesIn, n * sizeof(int), cudaMemcpyDeviceToDevice);
+    }
+    checkCUDAError("radix sortByKey");
+}
+
+}
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+namespace StreamCompaction {
+namespace Radix {
+    /**
+     * Stable LSD radix sort of n 32-bit keys with their int values, in place
+     * on device memory, 4 bits per pass. Only the low numBits bits of the
+     * keys are sorted on, so small key ranges (e.g. material IDs) take only
+     * a few passes. The values are meant to be indices into the sorted
+     * records, which are then gathered once, rather than the records.
+     */
+    void sortByKey(int n, unsigned int *dev_keys, int *dev_values, int numBits = 32);
+
+    void freeScratch();
+}
+}